@@ -904,13 +904,10 @@ static void wufn(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_POLL) {
     struct wumsg *m;
     if (xQueueReceive(q, &m, 0) == pdTRUE) {
-      struct mg_connection *t;
-      for (t = c->mgr->conns; t != NULL; t = t->next) {
-        if (t->id == m->id) {
-          struct mg_str data = mg_str_n((char *) m->data, m->len);
-          mg_call(t, MG_EV_WAKEUP, &data);
-          break;
-        }
+      struct mg_connection *t = mg_conn_by_id(c->mgr, m->id);
+      if (t != NULL) {
+        struct mg_str data = mg_str_n((char *) m->data, m->len);
+        mg_call(t, MG_EV_WAKEUP, &data);
       }
       free(m);
     }
@@ -1449,7 +1446,7 @@ static struct mg_dash_user *mg_dash_authenticate(struct mg_connection *c,
     return dash->guest;
   }
   mg_http_creds(hm, user, sizeof(user), pass, sizeof(pass));
-  ah = mg_http_get_header(hm, "Authorization");
+  ah = mg_http_get_header_id(hm, MG_HTTP_HDR_AUTHORIZATION);
   // MG_DEBUG(("user [%s], pass: [%s], h: %.*s", user, pass, hm->head.len,
   // hm->head.buf));
 
@@ -1753,6 +1750,577 @@ void mg_dash_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
   }
 }
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/deflate.c"
+#endif
+
+
+
+#if MG_ENABLE_DEFLATE
+#define MG_DEFLATE_HASH_BITS 12
+#define MG_DEFLATE_MAX_DIST 32768
+#define MG_DEFLATE_MAX_LEN 258
+#define MG_DEFLATE_MAX_SYMS 8192  // LZ77 symbols per block
+#define MG_DEFLATE_LAZY 32        // Look for a longer match after shorter ones
+
+// Huffman code: bit-reversed codes and their lengths
+struct deflate_tree {
+  uint16_t code[288];
+  uint8_t len[288];
+};
+
+// One compression call: bit writer, match finder and current block
+struct deflate_ctx {
+  unsigned char *out;                        // Next output byte
+  uint32_t bits;                             // Pending output bits
+  unsigned nbits;                            // Number of pending bits
+  uint32_t head[1 << MG_DEFLATE_HASH_BITS];  // Last position + 1 of a hash
+  uint32_t lfreq[288], dfreq[30];            // Block symbol frequencies
+  struct deflate_tree lt, dt;                // Block codes
+  struct deflate_tree ft, fd;                // Fixed codes
+  uint32_t *syms;  // Block symbols: distance << 9 | length, or a literal
+  size_t nsyms;    // Number of symbols in the block
+  size_t maxsyms;  // Block size limit
+};
+
+// Code lengths of both dynamic codes, run-length encoded
+struct deflate_hdr {
+  unsigned hlit, hdist, hclen, n;
+  uint8_t sym[288 + 30], extra[288 + 30];
+  uint32_t freq[19];
+  struct deflate_tree ct;
+};
+
+// Length and distance codes: base values and numbers of extra bits
+static const uint16_t s_lbase[29] = {3,  4,  5,  6,  7,  8,  9,  10,
+                                     11, 13, 15, 17, 19, 23, 27, 31,
+                                     35, 43, 51, 59, 67, 83, 99, 115,
+                                     131, 163, 195, 227, 258};
+static const uint8_t s_lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                   1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                   4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dbase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,   17,   25,
+    33,   49,   65,   97,   129,  193,   257,   385,  513,  769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t s_dext[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                   4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                   9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order of code length code lengths in a dynamic block header
+static const uint8_t s_clorder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+static void put_bits(struct deflate_ctx *x, uint32_t v, unsigned n) {
+  x->bits |= v << x->nbits, x->nbits += n;
+  while (x->nbits >= 8) {
+    *x->out++ = (unsigned char) x->bits;
+    x->bits >>= 8, x->nbits -= 8;
+  }
+}
+
+static void put_code(struct deflate_ctx *x, const struct deflate_tree *t,
+                     unsigned sym) {
+  put_bits(x, t->code[sym], t->len[sym]);
+}
+
+// Stored blocks of len bytes. An empty non-final one is a sync flush
+static void put_stored(struct deflate_ctx *x, const unsigned char *s,
+                       size_t len, bool last) {
+  do {
+    size_t n = len > 65535 ? 65535 : len;
+    put_bits(x, last && n == len ? 1U : 0U, 3);
+    if (x->nbits > 0) put_bits(x, 0, 8 - x->nbits);
+    put_bits(x, (uint32_t) n, 16);
+    put_bits(x, (uint32_t) n ^ 0xffffU, 16);
+    if (n > 0) memcpy(x->out, s, n);
+    x->out += n, s += n, len -= n;
+  } while (len > 0);
+}
+
+// Canonical codes for the lengths in t. Huffman codes go MSB first, unlike
+// everything else: store them reversed
+static void huff_codes(struct deflate_tree *t, unsigned n) {
+  unsigned count[16], next[16], i, j, c = 0;
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) count[t->len[i]]++;
+  for (count[0] = 0, i = 1; i < 16; i++) next[i] = c = (c + count[i - 1]) << 1;
+  for (i = 0; i < n; i++) {
+    unsigned len = t->len[i], code, r = 0;
+    if (len == 0) continue;
+    code = next[len]++;
+    for (j = 0; j < len; j++) r |= ((code >> j) & 1U) << (len - 1 - j);
+    t->code[i] = (uint16_t) r;
+  }
+}
+
+// Huffman code lengths, at most max bits, for n symbols with frequencies freq
+static void huff_build(struct deflate_tree *t, const uint32_t *freq,
+                       unsigned n, unsigned max) {
+  uint16_t sym[288], parent[576], depth[576];
+  uint32_t w[576];
+  unsigned count[16], i, j, k, a, b, m = 0, total = 0;
+  memset(t->len, 0, n);
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {  // Used symbols, sorted by frequency
+    if (freq[i] == 0) continue;
+    for (j = m++; j > 0 && freq[sym[j - 1]] > freq[i]; j--) sym[j] = sym[j - 1];
+    sym[j] = (uint16_t) i;
+  }
+  if (m == 1) t->len[sym[0]] = 1;
+  if (m > 1) {
+    // Merge two lightest nodes, taken from leaves or from merged nodes,
+    // which come in order of weight
+    for (i = 0; i < m; i++) w[i] = freq[sym[i]];
+    for (i = 0, j = k = m; k < 2 * m - 1; k++) {
+      a = i < m && (j >= k || w[i] <= w[j]) ? i++ : j++;
+      b = i < m && (j >= k || w[i] <= w[j]) ? i++ : j++;
+      w[k] = w[a] + w[b], parent[a] = parent[b] = (uint16_t) k;
+    }
+    for (depth[2 * m - 2] = 0, k = 2 * m - 2; k-- > 0;) {
+      depth[k] = (uint16_t) (depth[parent[k]] + 1);
+    }
+    for (i = 0; i < m; i++) count[depth[i] > max ? max : depth[i]]++;
+    // Clamped long codes overflow the code space. Make them fit again
+    for (i = 1; i <= max; i++) total += count[i] << (max - i);
+    while (total > (1U << max)) {
+      count[max]--;
+      for (i = max - 1; count[i] == 0; i--) continue;
+      count[i]--, count[i + 1] += 2, total--;
+    }
+    for (i = max, k = 0; i > 0; i--) {  // Shorter codes to frequent symbols
+      for (j = count[i]; j > 0; j--) t->len[sym[k++]] = (uint8_t) i;
+    }
+  }
+  huff_codes(t, n);
+}
+
+static size_t huff_cost(const struct deflate_tree *t, const uint32_t *freq,
+                        unsigned n) {
+  size_t i, bits = 0;
+  for (i = 0; i < n; i++) bits += (size_t) freq[i] * t->len[i];
+  return bits;
+}
+
+static void hdr_add(struct deflate_hdr *h, unsigned sym, unsigned extra) {
+  h->sym[h->n] = (uint8_t) sym, h->extra[h->n] = (uint8_t) extra;
+  h->freq[sym]++, h->n++;
+}
+
+// Make dynamic block header for block codes. Return its size in bits
+static size_t hdr_build(struct deflate_ctx *x, struct deflate_hdr *h) {
+  uint8_t lens[288 + 30];
+  size_t bits;
+  unsigned i, n, run;
+  memset(h, 0, sizeof(*h));
+  for (h->hlit = 286; h->hlit > 257 && x->lt.len[h->hlit - 1] == 0;) h->hlit--;
+  for (h->hdist = 30; h->hdist > 1 && x->dt.len[h->hdist - 1] == 0;) h->hdist--;
+  memcpy(lens, x->lt.len, h->hlit);
+  memcpy(lens + h->hlit, x->dt.len, h->hdist);
+  for (n = h->hlit + h->hdist, i = 0; i < n; i += run) {
+    for (run = 1; i + run < n && lens[i + run] == lens[i];) run++;
+    if (lens[i] == 0 && run >= 11) {
+      if (run > 138) run = 138;
+      hdr_add(h, 18, run - 11);
+    } else if (lens[i] == 0 && run >= 3) {
+      hdr_add(h, 17, run - 3);
+    } else if (run >= 4) {
+      if (run > 7) run = 7;
+      hdr_add(h, lens[i], 0);
+      hdr_add(h, 16, run - 4);
+    } else {
+      run = 1;
+      hdr_add(h, lens[i], 0);
+    }
+  }
+  huff_build(&h->ct, h->freq, 19, 7);
+  for (h->hclen = 19; h->hclen > 4 && h->ct.len[s_clorder[h->hclen - 1]] == 0;)
+    h->hclen--;
+  bits = 5 + 5 + 4 + 3 * h->hclen + huff_cost(&h->ct, h->freq, 19);
+  return bits + h->freq[16] * 2 + h->freq[17] * 3 + h->freq[18] * 7;
+}
+
+static void hdr_put(struct deflate_ctx *x, const struct deflate_hdr *h) {
+  static const uint8_t ext[3] = {2, 3, 7};  // Extra bits of codes 16, 17, 18
+  unsigned i;
+  put_bits(x, h->hlit - 257, 5);
+  put_bits(x, h->hdist - 1, 5);
+  put_bits(x, h->hclen - 4, 4);
+  for (i = 0; i < h->hclen; i++) put_bits(x, h->ct.len[s_clorder[i]], 3);
+  for (i = 0; i < h->n; i++) {
+    put_code(x, &h->ct, h->sym[i]);
+    if (h->sym[i] >= 16) put_bits(x, h->extra[i], ext[h->sym[i] - 16]);
+  }
+}
+
+static unsigned len_code(size_t len) {
+  unsigned i = 28;
+  while (s_lbase[i] > len) i--;
+  return i;
+}
+
+static unsigned dist_code(size_t dist) {
+  unsigned i = 29;
+  while (s_dbase[i] > dist) i--;
+  return i;
+}
+
+static void put_syms(struct deflate_ctx *x, const struct deflate_tree *lt,
+                     const struct deflate_tree *dt) {
+  size_t i;
+  for (i = 0; i < x->nsyms; i++) {
+    uint32_t len = x->syms[i] & 511U, dist = x->syms[i] >> 9;
+    if (dist == 0) {
+      put_code(x, lt, len);
+    } else {
+      unsigned lc = len_code(len), dc = dist_code(dist);
+      put_code(x, lt, 257 + lc);
+      put_bits(x, len - s_lbase[lc], s_lext[lc]);
+      put_code(x, dt, dc);
+      put_bits(x, dist - s_dbase[dc], s_dext[dc]);
+    }
+  }
+  put_code(x, lt, 256);
+}
+
+// Output the block made from s[start, end) with fixed codes, dynamic codes,
+// or stored as is: whichever is shorter
+static void put_block(struct deflate_ctx *x, const unsigned char *s,
+                      size_t start, size_t end, bool last) {
+  struct deflate_hdr h;
+  size_t i, extra = 0, fixed, dynamic, stored;
+  x->lfreq[256]++;  // End of block
+  for (i = 0; i < 29; i++) extra += (size_t) x->lfreq[257 + i] * s_lext[i];
+  for (i = 0; i < 30; i++) extra += (size_t) x->dfreq[i] * s_dext[i];
+  huff_build(&x->lt, x->lfreq, 286, 15);
+  huff_build(&x->dt, x->dfreq, 30, 15);
+  dynamic = hdr_build(x, &h) + huff_cost(&x->lt, x->lfreq, 286) +
+            huff_cost(&x->dt, x->dfreq, 30) + extra;
+  fixed = huff_cost(&x->ft, x->lfreq, 286) + huff_cost(&x->fd, x->dfreq, 30) +
+          extra;
+  stored = (end - start + 5 * ((end - start) / 65535 + 1)) * 8;
+  if (stored < fixed && stored < dynamic) {
+    put_stored(x, s + start, end - start, last);
+  } else if (fixed <= dynamic) {
+    put_bits(x, last ? 3U : 2U, 3);  // BFINAL, BTYPE 01: fixed codes
+    put_syms(x, &x->ft, &x->fd);
+  } else {
+    put_bits(x, last ? 5U : 4U, 3);  // BFINAL, BTYPE 10: dynamic codes
+    hdr_put(x, &h);
+    put_syms(x, &x->lt, &x->dt);
+  }
+  memset(x->lfreq, 0, sizeof(x->lfreq));
+  memset(x->dfreq, 0, sizeof(x->dfreq));
+  x->nsyms = 0;
+}
+
+static uint32_t hash3(const unsigned char *p) {
+  uint32_t v = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+  return (v * 2654435761U) >> (32 - MG_DEFLATE_HASH_BITS);
+}
+
+// Find the latest earlier occurrence of s[i..], and remember this one
+static size_t find_match(struct deflate_ctx *x, const unsigned char *s,
+                         size_t i, size_t end, size_t *dist) {
+  size_t n = 0, max = end - i;
+  uint32_t h, pos;
+  if (max > MG_DEFLATE_MAX_LEN) max = MG_DEFLATE_MAX_LEN;
+  if (max < 3) return 0;
+  h = hash3(s + i), pos = x->head[h];
+  x->head[h] = (uint32_t) (i + 1);
+  if (pos > 0 && i + 1 - pos <= MG_DEFLATE_MAX_DIST) {
+    const unsigned char *p = s + pos - 1;
+    while (n < max && p[n] == s[i + n]) n++;
+    *dist = i + 1 - pos;
+  }
+  return n;
+}
+
+static void add_literal(struct deflate_ctx *x, unsigned char c) {
+  x->syms[x->nsyms++] = c;
+  x->lfreq[c]++;
+}
+
+// Compress s[start, end). s[0, start) is earlier input matches can refer to
+static void deflate_run(struct deflate_ctx *x, const unsigned char *s,
+                        size_t start, size_t end, bool last) {
+  size_t i, k, from = start;
+  for (i = 0; i < start && i + 3 <= end; i++) {
+    x->head[hash3(s + i)] = (uint32_t) (i + 1);
+  }
+  for (i = start; i < end;) {
+    size_t dist = 0, n = find_match(x, s, i, end, &dist);
+    if (n >= 3 && n < MG_DEFLATE_LAZY && i + 1 < end) {
+      size_t dist2 = 0, n2 = find_match(x, s, i + 1, end, &dist2);
+      if (n2 > n) add_literal(x, s[i++]), n = n2, dist = dist2;
+    }
+    if (n >= 3) {
+      x->syms[x->nsyms++] = (uint32_t) (dist << 9 | n);
+      x->lfreq[257 + len_code(n)]++, x->dfreq[dist_code(dist)]++;
+      for (k = i + 1; k < i + n && k + 3 <= end; k++) {
+        x->head[hash3(s + k)] = (uint32_t) (k + 1);
+      }
+      i += n;
+    } else {
+      add_literal(x, s[i++]);
+    }
+    if (x->nsyms + 2 > x->maxsyms) put_block(x, s, from, i, false), from = i;
+  }
+  if (x->nsyms > 0 || last) put_block(x, s, from, end, last);
+}
+
+// Remember the input tail for the next call. On OOM, just forget history
+static void deflate_keep(struct mg_deflate *d, const unsigned char *s,
+                         size_t n) {
+  size_t keep = n > MG_DEFLATE_WINDOW ? MG_DEFLATE_WINDOW : n;
+  if (d->win == NULL) d->win = (char *) mg_calloc(1, MG_DEFLATE_WINDOW);
+  d->wlen = d->win == NULL ? 0 : keep;
+  if (d->wlen > 0) memcpy(d->win, s + n - keep, keep);
+}
+
+bool mg_deflate(struct mg_deflate *d, const char *buf, size_t len, bool last,
+                struct mg_iobuf *io) {
+  size_t i, n = d->wlen + len, maxsyms = len + 2;
+  const unsigned char *s = (const unsigned char *) (buf == NULL ? "" : buf);
+  struct deflate_ctx *x;
+  bool ok;
+  if (maxsyms > MG_DEFLATE_MAX_SYMS) maxsyms = MG_DEFLATE_MAX_SYMS;
+  x = (struct deflate_ctx *) mg_calloc(
+      1, sizeof(*x) + maxsyms * sizeof(uint32_t) + d->wlen + len);
+  ok = x != NULL && mg_iobuf_reserve(io, len + len / 8 + 64);
+  if (ok) {
+    unsigned char *p = (unsigned char *) (x + 1) + maxsyms * sizeof(uint32_t);
+    x->syms = (uint32_t *) (x + 1), x->maxsyms = maxsyms;
+    x->out = io->buf + io->len;
+    if (d->wlen > 0) {  // Put history and input together
+      memcpy(p, d->win, d->wlen);
+      if (len > 0) memcpy(p + d->wlen, s, len);
+      s = p;
+    }
+    for (i = 0; i < 288; i++) {
+      x->ft.len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    for (i = 0; i < 30; i++) x->fd.len[i] = 5;
+    huff_codes(&x->ft, 288);
+    huff_codes(&x->fd, 30);
+    deflate_run(x, s, d->wlen, n, last);
+    if (!last) put_stored(x, s, 0, false);  // Sync flush
+    if (x->nbits > 0) put_bits(x, 0, 8 - x->nbits);
+    io->len = (size_t) (x->out - io->buf);
+    if (!last) deflate_keep(d, s, n);
+  }
+  mg_free(x);
+  if (last) mg_deflate_free(d);
+  return ok;
+}
+
+bool mg_gzip(struct mg_deflate *d, const char *buf, size_t len, bool last,
+             struct mg_iobuf *io) {
+  static const unsigned char hdr[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+  if (!d->started && mg_iobuf_add(io, io->len, hdr, sizeof(hdr)) == 0) {
+    return false;
+  }
+  d->started = true;
+  d->crc = mg_crc32(d->crc, buf, len), d->size += (uint32_t) len;
+  if (!mg_deflate(d, buf, len, last, io)) return false;
+  if (last) {  // Trailer: CRC32 and input size, little endian
+    unsigned char t[8];
+    size_t i;
+    for (i = 0; i < 4; i++) {
+      t[i] = (unsigned char) (d->crc >> (8 * i));
+      t[i + 4] = (unsigned char) (d->size >> (8 * i));
+    }
+    if (mg_iobuf_add(io, io->len, t, sizeof(t)) == 0) return false;
+  }
+  return true;
+}
+
+void mg_deflate_free(struct mg_deflate *d) {
+  mg_free(d->win);
+  d->win = NULL, d->wlen = 0;
+}
+
+// Decoder: bit reader over the input, and output limits
+struct inflate_ctx {
+  const unsigned char *in;  // Input
+  size_t len, pos;          // Input length and next byte
+  uint32_t bits;            // Pending input bits
+  unsigned nbits;           // Number of pending bits
+  bool err;                 // Truncated input
+  struct mg_iobuf *io;      // Output
+  size_t start, max;        // Output offset of this call, and its size limit
+};
+
+// Canonical Huffman code: number of codes of each length, symbols by code
+struct inflate_huff {
+  uint16_t count[16];
+  uint16_t sym[288];
+};
+
+static unsigned get_bits(struct inflate_ctx *x, unsigned n) {
+  uint32_t v;
+  while (x->nbits < n) {
+    if (x->pos >= x->len) {
+      x->err = true;
+      return 0;
+    }
+    x->bits |= (uint32_t) x->in[x->pos++] << x->nbits, x->nbits += 8;
+  }
+  v = x->bits & ((1U << n) - 1), x->bits >>= n, x->nbits -= n;
+  return (unsigned) v;
+}
+
+// Codes for the n symbol lengths in len. Incomplete codes are fine, like
+// a single distance code, oversubscribed ones are not
+static bool huff_load(struct inflate_huff *h, const uint8_t *len, unsigned n) {
+  uint16_t offs[16];
+  unsigned i;
+  int left = 1;
+  memset(h->count, 0, sizeof(h->count));
+  for (i = 0; i < n; i++) h->count[len[i]]++;
+  for (i = 1; i < 16; i++) {
+    left = (left << 1) - h->count[i];
+    if (left < 0) return false;
+  }
+  for (offs[1] = 0, i = 1; i < 15; i++) {
+    offs[i + 1] = (uint16_t) (offs[i] + h->count[i]);
+  }
+  for (i = 0; i < n; i++) {
+    if (len[i] != 0) h->sym[offs[len[i]]++] = (uint16_t) i;
+  }
+  return true;
+}
+
+// Read one symbol, MSB first. Returns -1 on an unused code
+static int huff_decode(struct inflate_ctx *x, const struct inflate_huff *h) {
+  int code = 0, first = 0, index = 0, len;
+  for (len = 1; len < 16 && !x->err; len++) {
+    int count = h->count[len];
+    code |= (int) get_bits(x, 1);
+    if (code - count < first) return h->sym[index + (code - first)];
+    index += count, first = (first + count) << 1, code <<= 1;
+  }
+  return -1;
+}
+
+static bool inflate_out(struct inflate_ctx *x, size_t n) {
+  return x->io->len - x->start + n <= x->max && mg_iobuf_reserve(x->io, n);
+}
+
+static bool inflate_stored(struct inflate_ctx *x) {
+  size_t n;
+  x->bits = 0, x->nbits = 0;  // Skip to a byte boundary
+  if (x->pos + 4 > x->len) return false;
+  n = (size_t) x->in[x->pos] | (size_t) x->in[x->pos + 1] << 8;
+  if ((n ^ 0xffffU) != ((size_t) x->in[x->pos + 2] |
+                        (size_t) x->in[x->pos + 3] << 8)) {
+    return false;
+  }
+  x->pos += 4;
+  if (x->pos + n > x->len || !inflate_out(x, n)) return false;
+  if (n > 0) memcpy(x->io->buf + x->io->len, x->in + x->pos, n);
+  x->io->len += n, x->pos += n;
+  return true;
+}
+
+static bool inflate_codes(struct inflate_ctx *x, const struct inflate_huff *lh,
+                          const struct inflate_huff *dh) {
+  for (;;) {
+    int sym = huff_decode(x, lh);
+    if (sym < 0 || x->err) return false;
+    if (sym < 256) {
+      if (!inflate_out(x, 1)) return false;
+      x->io->buf[x->io->len++] = (unsigned char) sym;
+    } else if (sym == 256) {
+      return true;
+    } else {
+      size_t len, dist, i;
+      unsigned char *p, *q;
+      if (sym > 285) return false;
+      len = s_lbase[sym - 257] + get_bits(x, s_lext[sym - 257]);
+      sym = huff_decode(x, dh);
+      if (sym < 0 || sym > 29 || x->err) return false;
+      dist = s_dbase[sym] + get_bits(x, s_dext[sym]);
+      if (x->err || dist > x->io->len - x->start || !inflate_out(x, len)) {
+        return false;
+      }
+      p = x->io->buf + x->io->len, q = p - dist;
+      for (i = 0; i < len; i++) p[i] = q[i];  // Can overlap
+      x->io->len += len;
+    }
+  }
+}
+
+static bool inflate_fixed(struct inflate_ctx *x) {
+  struct inflate_huff lh, dh;
+  uint8_t len[288];
+  unsigned i;
+  for (i = 0; i < 288; i++) {
+    len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  }
+  huff_load(&lh, len, 288);
+  memset(len, 5, 30);
+  huff_load(&dh, len, 30);
+  return inflate_codes(x, &lh, &dh);
+}
+
+static bool inflate_dynamic(struct inflate_ctx *x) {
+  struct inflate_huff lh, dh;
+  uint8_t len[288 + 30];
+  unsigned i, n, hlit = get_bits(x, 5) + 257, hdist = get_bits(x, 5) + 1,
+                 hclen = get_bits(x, 4) + 4;
+  if (hlit > 286 || hdist > 30) return false;
+  memset(len, 0, 19);
+  for (i = 0; i < hclen; i++) len[s_clorder[i]] = (uint8_t) get_bits(x, 3);
+  if (x->err || !huff_load(&lh, len, 19)) return false;
+  for (i = 0; i < hlit + hdist;) {
+    int sym = huff_decode(x, &lh);
+    uint8_t v = 0;
+    if (sym < 0 || x->err) return false;
+    if (sym < 16) {
+      len[i++] = (uint8_t) sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (i == 0) return false;
+      v = len[i - 1], n = 3 + get_bits(x, 2);
+    } else {
+      n = sym == 17 ? 3 + get_bits(x, 3) : 11 + get_bits(x, 7);
+    }
+    if (i + n > hlit + hdist) return false;
+    while (n-- > 0) len[i++] = v;
+  }
+  if (x->err || len[256] == 0) return false;
+  return huff_load(&lh, len, hlit) && huff_load(&dh, len + hlit, hdist) &&
+         inflate_codes(x, &lh, &dh);
+}
+
+bool mg_inflate(const char *buf, size_t len, size_t max, struct mg_iobuf *io) {
+  struct inflate_ctx x;
+  bool ok = true, last = false;
+  memset(&x, 0, sizeof(x));
+  x.in = (const unsigned char *) buf, x.len = len;
+  x.io = io, x.start = io->len, x.max = max;
+  while (ok && !last && x.pos < x.len) {
+    unsigned type;
+    last = get_bits(&x, 1) != 0, type = get_bits(&x, 2);
+    if (x.err) {
+      ok = false;
+    } else if (type == 0) {
+      // A sync flush with its 00 00 ff ff stripped ends right here
+      ok = (!last && x.pos == x.len) || inflate_stored(&x);
+    } else if (type == 1) {
+      ok = inflate_fixed(&x);
+    } else if (type == 2) {
+      ok = inflate_dynamic(&x);
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok) io->len = x.start;
+  return ok;
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/dns.c"
 #endif
@@ -2028,6 +2596,7 @@ bool mg_dnsc_init(struct mg_mgr *mgr, struct mg_dns *dnsc) {
     dnsc->c = mg_connect(mgr, dnsc->url, NULL, NULL);
     if (dnsc->c == NULL) return false;
     dnsc->c->pfn = dns_cb;
+    dnsc->c->is_polled = 1;  // Expire requests even when no data comes
   }
   return true;
 }
@@ -2545,6 +3114,7 @@ struct mg_connection *mg_mdns_listen(struct mg_mgr *mgr, mg_event_handler_t fn,
   if (c == NULL) return NULL;
   c->mgr->mdns = c;  // Add mDNS entry to enable resolver to use it
   c->pfn = mdns_cb, c->pfn_data = fn_data;
+  c->is_polled = 1;  // Expire resolver requests
   mg_multicast_add(c, (char *) "224.0.0.251");
   return c;
 }
@@ -3603,6 +4173,121 @@ struct mg_fs mg_fs_posix = {p_stat,  p_list, p_open,   p_close,  p_read,
 
 
 
+
+// 16-byte blocks only: header lines are short, and 32-byte AVX2 blocks left
+// more of each line to the scalar code, which made AVX2 builds slower
+#if MG_ENABLE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#define MG_SIMD_N 16
+#elif MG_ENABLE_SIMD && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MG_SIMD_N 16
+#else
+#define MG_SIMD_N 0
+#endif
+
+#if MG_SIMD_N
+// Vector header scanning. Each function checks a block of MG_SIMD_N bytes,
+// and returns the index of the first byte that matches, or MG_SIMD_N
+#if defined(__SSE2__)
+typedef __m128i mg_simd_t;
+#define simd_load(p) _mm_loadu_si128((const __m128i *) (p))
+#define simd_set(c) _mm_set1_epi8((char) (c))
+#define simd_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define simd_or(a, b) _mm_or_si128((a), (b))
+#define simd_and(a, b) _mm_and_si128((a), (b))
+#define simd_gt(a, b) _mm_cmpgt_epi8((a), (b))  // Signed
+#define simd_max(a, b) _mm_max_epu8((a), (b))
+#define simd_bits(a) ((uint32_t) _mm_movemask_epi8(a))
+#endif
+
+#if defined(__ARM_NEON)
+// NEON has no movemask: narrow each byte to a nibble, 4 bits per byte
+static size_t simd_first(uint8x16_t hit) {
+  uint64_t m = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+  return m == 0 ? MG_SIMD_N : (size_t) __builtin_ctzll(m) / 4;
+}
+
+// Control character: < 0x20
+static size_t simd_ctl(const uint8_t *p) {
+  return simd_first(vcleq_u8(vld1q_u8(p), vdupq_n_u8(0x1f)));
+}
+
+static size_t simd_crlf(const uint8_t *p) {
+  uint8x16_t v = vld1q_u8(p);
+  return simd_first(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')),
+                             vceqq_u8(v, vdupq_n_u8('\n'))));
+}
+
+// Not a printable ASCII character (see clen()), or a stop character
+static size_t simd_text(const uint8_t *p, uint8_t stop) {
+  uint8x16_t v = vld1q_u8(p);
+  uint8x16_t ok = vandq_u8(vcgtq_u8(v, vdupq_n_u8(' ')),
+                           vcltq_u8(v, vdupq_n_u8(0x7f)));
+  return simd_first(vorrq_u8(vmvnq_u8(ok), vceqq_u8(v, vdupq_n_u8(stop))));
+}
+#else
+static size_t simd_first(uint32_t bits) {
+  return bits == 0 ? MG_SIMD_N : (size_t) __builtin_ctz(bits);
+}
+
+static size_t simd_ctl(const uint8_t *p) {
+  mg_simd_t v = simd_load(p), x = simd_set(0x1f);
+  return simd_first(simd_bits(simd_eq(simd_max(v, x), x)));
+}
+
+static size_t simd_crlf(const uint8_t *p) {
+  mg_simd_t v = simd_load(p);
+  return simd_first(simd_bits(
+      simd_or(simd_eq(v, simd_set('\r')), simd_eq(v, simd_set('\n')))));
+}
+
+// Bytes >= 0x80 are negative, so signed comparisons leave UTF-8 to clen()
+static size_t simd_text(const uint8_t *p, uint8_t stop) {
+  mg_simd_t v = simd_load(p);
+  mg_simd_t ok =
+      simd_and(simd_gt(v, simd_set(' ')), simd_gt(simd_set(0x7f), v));
+  uint32_t bits = simd_bits(ok) & ~simd_bits(simd_eq(v, simd_set(stop)));
+  return simd_first(~bits & (uint32_t) (((uint64_t) 1 << MG_SIMD_N) - 1));
+}
+#endif
+#endif
+
+// Skip bytes that are not control characters, a block at a time
+static const uint8_t *skip_ctl(const uint8_t *p, const uint8_t *end) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - p >= MG_SIMD_N) p += (n = simd_ctl(p));
+#endif
+  (void) end;
+  return p;
+}
+
+// Skip bytes that are not CR or LF, a block at a time
+static const char *skip_line(const char *s, const char *end) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - s >= MG_SIMD_N) {
+    s += (n = simd_crlf((const uint8_t *) s));
+  }
+#endif
+  (void) end;
+  return s;
+}
+
+// Skip printable ASCII characters other than `stop`, a block at a time
+static const char *skip_text(const char *s, const char *end, char stop) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - s >= MG_SIMD_N) {
+    s += (n = simd_text((const uint8_t *) s, (uint8_t) stop));
+  }
+#endif
+  (void) end, (void) stop;
+  return s;
+}
+
 static int mg_ncasecmp(const char *s1, const char *s2, size_t len) {
   int diff = 0;
   if (len > 0) do {
@@ -3780,9 +4465,13 @@ static bool isok(uint8_t c) {
   return c == '\n' || c == '\r' || c == '\t' || c >= ' ';
 }
 
-int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+// Find the end of headers, resuming the scan at `ofs`: bytes before it are
+// known to be valid and contain no terminator
+static int http_req_len(const unsigned char *buf, size_t buf_len, size_t ofs) {
   size_t i;
-  for (i = 0; i < buf_len; i++) {
+  for (i = ofs; i < buf_len; i++) {
+    i = (size_t) (skip_ctl(buf + i, buf + buf_len) - buf);  // Printable run
+    if (i >= buf_len) break;
     if (!isok(buf[i])) return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
@@ -3790,6 +4479,11 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   }
   return 0;
 }
+
+int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+  return http_req_len(buf, buf_len, 0);
+}
+
 struct mg_str *mg_http_get_header(struct mg_http_message *h, const char *name) {
   size_t i, n = strlen(name), max = sizeof(h->headers) / sizeof(h->headers[0]);
   for (i = 0; i < max && h->headers[i].name.len > 0; i++) {
@@ -3816,27 +4510,87 @@ static size_t clen(const char *s, const char *end) {
   return 0;
 }
 
+// Skip valid characters up to `stop`. Return advanced `s`
+static const char *skipchars(const char *s, const char *end, char stop) {
+  size_t n;
+  while ((s = skip_text(s, end, stop)) < end && s[0] != stop &&
+         (n = clen(s, end)) > 0) {
+    s += n;
+  }
+  return s;
+}
+
 // Skip until the newline. Return advanced `s`, or NULL on error
 static const char *skiptorn(const char *s, const char *end, struct mg_str *v) {
   v->buf = (char *) s;
-  while (s < end && s[0] != '\n' && s[0] != '\r') s++, v->len++;  // To newline
+  s = skip_line(s, end);
+  while (s < end && s[0] != '\n' && s[0] != '\r') s++;  // To newline
+  v->len = (size_t) (s - v->buf);
   if (s >= end || (s[0] == '\r' && s[1] != '\n')) return NULL;    // Stray \r
   if (s < end && s[0] == '\r') s++;                               // Skip \r
   if (s >= end || *s++ != '\n') return NULL;                      // Skip \n
   return s;
 }
 
+// Well-known header names, in MG_HTTP_HDR_* order
+static const char *s_http_headers[MG_HTTP_HDR_MAX] = {
+    "Content-Length",  "Transfer-Encoding", "Connection",
+    "Authorization",   "Cookie",            "Host",
+    "Content-Type",    "Accept-Encoding",   "If-None-Match",
+    "Range",           "Upgrade",           "Sec-WebSocket-Key",
+    "Sec-WebSocket-Protocol"};
+
+// Classify a header name by its length, with at most two comparisons.
+// Return MG_HTTP_HDR_*, or -1 if it is not a well-known header
+static int http_header_id(struct mg_str k) {
+  int a, b = -1;
+  switch (k.len) {
+    case 4: a = MG_HTTP_HDR_HOST; break;
+    case 5: a = MG_HTTP_HDR_RANGE; break;
+    case 6: a = MG_HTTP_HDR_COOKIE; break;
+    case 7: a = MG_HTTP_HDR_UPGRADE; break;
+    case 10: a = MG_HTTP_HDR_CONNECTION; break;
+    case 12: a = MG_HTTP_HDR_CONTENT_TYPE; break;
+    case 13:
+      a = MG_HTTP_HDR_AUTHORIZATION, b = MG_HTTP_HDR_IF_NONE_MATCH;
+      break;
+    case 14: a = MG_HTTP_HDR_CONTENT_LENGTH; break;
+    case 15: a = MG_HTTP_HDR_ACCEPT_ENCODING; break;
+    case 17:
+      a = MG_HTTP_HDR_TRANSFER_ENCODING, b = MG_HTTP_HDR_SEC_WEBSOCKET_KEY;
+      break;
+    case 22: a = MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL; break;
+    default: return -1;
+  }
+  if (mg_ncasecmp(k.buf, s_http_headers[a], k.len) == 0) return a;
+  if (b >= 0 && mg_ncasecmp(k.buf, s_http_headers[b], k.len) == 0) return b;
+  return -1;
+}
+
+struct mg_str *mg_http_get_header_id(struct mg_http_message *hm, int id) {
+  size_t i;
+  if (id < 0 || id >= MG_HTTP_HDR_MAX) return NULL;
+  if ((i = hm->hdr_index[id]) != 0) return &hm->headers[i - 1].value;
+  for (i = 0; i < MG_HTTP_HDR_MAX; i++) {
+    if (hm->hdr_index[i] != 0) return NULL;  // Indexed, header not there
+  }
+  // Nothing indexed: no well-known headers, or hm was not built by
+  // mg_http_parse(). Look it up by name
+  return mg_http_get_header(hm, s_http_headers[id]);
+}
+
 static bool mg_http_parse_headers(const char *s, const char *end,
-                                  struct mg_http_header *h, size_t max_hdrs) {
-  size_t i, n;
-  int cl_count = 0, te_count = 0, auth_count = 0;
-  int conn_count = 0, cookie_count = 0;
+                                  struct mg_http_message *hm) {
+  struct mg_http_header *h = hm->headers;
+  size_t i, max_hdrs = sizeof(hm->headers) / sizeof(hm->headers[0]);
+  int id;
   for (i = 0; i < max_hdrs; i++) {
     struct mg_str k = {NULL, 0}, v = {NULL, 0};
     if (s >= end) return false;
     if (s[0] == '\n' || (s[0] == '\r' && s[1] == '\n')) break;
     k.buf = (char *) s;
-    while (s < end && s[0] != ':' && (n = clen(s, end)) > 0) s += n, k.len += n;
+    s = skipchars(s, end, ':');
+    k.len = (size_t) (s - k.buf);
     if (k.len == 0) return false;                     // Empty name
     if (s >= end || clen(s, end) == 0) return false;  // Invalid UTF-8
     if (*s++ != ':') return false;  // Invalid, not followed by :
@@ -3846,27 +4600,24 @@ static bool mg_http_parse_headers(const char *s, const char *end,
     while (v.len > 0 && (v.buf[v.len - 1] == ' ' || v.buf[v.len - 1] == '\t')) {
       v.len--;  // Trim spaces
     }
-    // detect duplicated headers -> discard
-    if (((mg_strcasecmp(k, mg_str("Content-Length")) == 0) &&
-         (++cl_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Transfer-Encoding")) == 0) &&
-         (++te_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Authorization")) == 0) &&
-         (++auth_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Cookie")) == 0) && (++cookie_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Connection")) == 0) && (++conn_count > 1)))
+    // Index well-known headers, detect duplicated ones -> discard
+    id = http_header_id(k);
+    if (id >= 0 && hm->hdr_index[id] == 0) {
+      hm->hdr_index[id] = (uint16_t) (i + 1);
+    } else if (id >= 0 && id <= MG_HTTP_HDR_COOKIE) {
       return false;
+    }
     // MG_INFO(("--HH [%.*s] [%.*s]", (int) k.len, k.buf, (int) v.len, v.buf));
     h[i].name = k, h[i].value = v;  // Success. Assign values
   }
   return true;
 }
 
-int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
-  int is_response, req_len = mg_http_get_request_len((unsigned char *) s, len);
+// Parse a message whose headers are known to be `req_len` bytes long
+static int http_parse(const char *s, int req_len, struct mg_http_message *hm) {
+  int is_response;
   const char *end = s == NULL ? NULL : s + req_len, *qs;  // Cannot add to NULL
   const struct mg_str *cl;
-  size_t n;
   bool version_prefix_valid;
 
   memset(hm, 0, sizeof(*hm));
@@ -3879,10 +4630,12 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
 
   // Parse request line
   hm->method.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->method.len += n;
+  s = skipchars(s, end, ' ');
+  hm->method.len = (size_t) (s - hm->method.buf);
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   hm->uri.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->uri.len += n;
+  s = skipchars(s, end, ' ');
+  hm->uri.len = (size_t) (s - hm->uri.buf);
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   is_response =
       hm->method.len > 5 && (mg_ncasecmp(hm->method.buf, "HTTP/", 5) == 0);
@@ -3911,11 +4664,10 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   // Do this check after hm->method.len and hm->uri.len are finalised
   if (hm->method.len == 0 || hm->uri.len == 0) return -1;
 
-  if (!mg_http_parse_headers(s, end, hm->headers,
-                             sizeof(hm->headers) / sizeof(hm->headers[0])))
-    return -1;  // error when parsing
-  cl = mg_http_get_header(hm, "Content-Length");
-  if (cl != NULL && mg_http_get_header(hm, "Transfer-Encoding") != NULL)
+  if (!mg_http_parse_headers(s, end, hm)) return -1;  // error when parsing
+  cl = mg_http_get_header_id(hm, MG_HTTP_HDR_CONTENT_LENGTH);
+  if (cl != NULL &&
+      mg_http_get_header_id(hm, MG_HTTP_HDR_TRANSFER_ENCODING) != NULL)
     return -1; // cannot contain both CL and TE
   if (cl != NULL) {
     if (mg_to_size_t(*cl, &hm->body.len) == false) return -1;
@@ -3944,9 +4696,254 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   return req_len;
 }
 
+int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
+  return http_parse(s, mg_http_get_request_len((unsigned char *) s, len), hm);
+}
+
+static void http_cb(struct mg_connection *, int, void *);
+
+static struct mg_str http_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t')) {
+    s.len--;
+  }
+  return s;
+}
+
+// Return whether an Accept-Encoding header value allows gzip: "gzip" or
+// "x-gzip", else "*", listed without "q=0". Returns false for NULL
+static bool http_accepts_gzip(const struct mg_str *ae) {
+  struct mg_str s = ae == NULL ? mg_str_n(NULL, 0) : *ae, k, coding, params;
+  int gzip = -1, any = -1;  // -1: not listed, 0: refused, 1: accepted
+  while (mg_span(s, &k, &s, ',')) {
+    struct mg_str p, v;
+    int ok = 1;
+    if (!mg_span(k, &coding, &params, ';')) continue;  // Empty element
+    coding = http_trim(coding);
+    while (mg_span(params, &p, &params, ';')) {
+      mg_span(http_trim(p), &p, &v, '=');
+      if (mg_strcasecmp(p, mg_str("q")) == 0) {
+        size_t i;
+        v = http_trim(v);
+        for (i = 0; i < v.len && (v.buf[i] == '0' || v.buf[i] == '.');) i++;
+        if (v.len > 0 && v.buf[0] == '0' && i == v.len) ok = 0;  // q=0, 0.000
+      }
+    }
+    if (mg_strcasecmp(coding, mg_str("gzip")) == 0 ||
+        mg_strcasecmp(coding, mg_str("x-gzip")) == 0) {
+      gzip = ok;
+    } else if (mg_strcmp(coding, mg_str("*")) == 0) {
+      any = ok;
+    }
+  }
+  return gzip >= 0 ? gzip == 1 : any == 1;
+}
+
+#if MG_ENABLE_DEFLATE
+static const char s_gzip_hdrs[] =
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+
+// Compressed static file, see http_gzip_file()
+struct http_gzip {
+  uint32_t hash;  // Hash of the key; 0 for an unused entry
+  char *key;      // File path and ETag
+  char *data;     // Compressed content; NULL if the file does not compress
+  size_t len;     // Compressed content length
+  char etag[72];  // ETag of the compressed content
+  uint64_t used;  // When last used, for eviction
+};
+
+void mg_http_gzip_free(struct mg_mgr *mgr) {
+  struct http_gzip *cache = (struct http_gzip *) mgr->http_gzip;
+  size_t i;
+  for (i = 0; cache != NULL && i < MG_HTTP_GZIP_CACHE_SIZE; i++) {
+    mg_free(cache[i].key), mg_free(cache[i].data);
+  }
+  mg_free(cache);
+  mgr->http_gzip = NULL;
+}
+
+static bool http_gzip_type(struct mg_str mime) {
+  struct mg_str k, s = mg_str(MG_HTTP_GZIP_TYPES);
+  while (mg_span(s, &k, &s, ',')) {
+    if (mg_match(mime, k, NULL)) return true;
+  }
+  return false;
+}
+
+// Check response headers: compress allowed content types, only once.
+// Chunked responses must be chunked, others must not
+static bool http_gzip_hdrs(struct mg_str s, bool chunked) {
+  struct mg_str line, k, v;
+  bool ok = false, te = false;
+  while (mg_span(s, &line, &s, '\n')) {
+    if (!mg_span(line, &k, &v, ':')) continue;
+    while (v.len > 0 && v.buf[0] == ' ') v.buf++, v.len--;
+    while (v.len > 0 && (v.buf[v.len - 1] == '\r' || v.buf[v.len - 1] == ' ')) {
+      v.len--;
+    }
+    if (mg_strcasecmp(k, mg_str("Content-Encoding")) == 0) return false;
+    if (mg_strcasecmp(k, mg_str("Content-Type")) == 0) ok = http_gzip_type(v);
+    if (mg_strcasecmp(k, mg_str("Transfer-Encoding")) == 0) {
+      te = mg_strcasecmp(v, mg_str("chunked")) == 0;
+    }
+  }
+  return ok && te == chunked;
+}
+
+// Compress mg_http_reply() body at ofs. The headers end with hl bytes of
+// Content-Length placeholder, insert ours before it. Return new body offset
+static size_t http_gzip_reply(struct mg_connection *c, const char *headers,
+                              size_t ofs, size_t hl) {
+  struct mg_deflate d;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  size_t len = c->send.len - ofs, n = sizeof(s_gzip_hdrs) - 1;
+  memset(&d, 0, sizeof(d));
+  if (len >= MG_HTTP_GZIP_MIN && http_gzip_hdrs(mg_str(headers), false) &&
+      mg_gzip(&d, (char *) c->send.buf + ofs, len, true, &io) &&
+      io.len + n < len &&
+      mg_iobuf_add(&c->send, ofs - hl, s_gzip_hdrs, n) > 0) {
+    ofs += n;
+    memcpy(c->send.buf + ofs, io.buf, io.len);
+    c->send.len = ofs + io.len;
+  }
+  mg_iobuf_free(&io);
+  return ofs;
+}
+
+// Start compressing a chunked response, if its headers allow. They must be
+// the last thing in c->send
+static struct mg_deflate *http_gzip_start(struct mg_connection *c) {
+  char *s = (char *) c->send.buf;
+  size_t n = c->send.len, i = n < 9 ? 0 : n - 9;
+  struct mg_deflate *d;
+  if (n < 9 || memcmp(s + n - 4, "\r\n\r\n", 4) != 0) return NULL;
+  while (i > 0 && (s[i - 1] != '\n' || memcmp(s + i, "HTTP/", 5) != 0)) i--;
+  if (memcmp(s + i, "HTTP/", 5) != 0) return NULL;
+  if (!http_gzip_hdrs(mg_str_n(s + i, n - i), true)) return NULL;
+  if ((d = (struct mg_deflate *) mg_calloc(1, sizeof(*d))) == NULL) return NULL;
+  if (mg_iobuf_add(&c->send, n - 2, s_gzip_hdrs, sizeof(s_gzip_hdrs) - 1) ==
+      0) {
+    mg_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+static void http_gzip_end(struct mg_connection *c) {
+  mg_deflate_free((struct mg_deflate *) c->http_gzip);
+  mg_free(c->http_gzip);
+  c->http_gzip = NULL;
+  c->is_http_gzip = 0;
+}
+
+static void http_write_chunk(struct mg_connection *, const char *, size_t);
+
+// Compress a chunk. Return false if the response goes uncompressed
+static bool http_gzip_chunk(struct mg_connection *c, const char *buf,
+                            size_t len) {
+  struct mg_deflate *d = (struct mg_deflate *) c->http_gzip;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  if (d == NULL && (c->pfn != http_cb || (d = http_gzip_start(c)) == NULL)) {
+    c->is_http_gzip = 0;  // Decided for this response
+    return false;
+  }
+  c->http_gzip = d;
+  if (!mg_gzip(d, buf, len, len == 0, &io)) mg_error(c, "OOM");
+  if (io.len > 0) http_write_chunk(c, (char *) io.buf, io.len);
+  mg_iobuf_free(&io);
+  if (len == 0) {
+    http_write_chunk(c, "", 0);
+    http_gzip_end(c);
+    c->is_resp = 0;
+  }
+  return true;
+}
+
+// Find or make a compressed copy of a static file, either open (fd) or
+// cached in memory (data). Return NULL if the file does not compress
+static struct http_gzip *http_gzip_file(struct mg_mgr *mgr, const char *path,
+                                        const char *etag, struct mg_fd *fd,
+                                        const char *data, size_t size) {
+  struct http_gzip *e, *cache = (struct http_gzip *) mgr->http_gzip;
+  struct mg_deflate d;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  char key[MG_PATH_MAX + 80], *buf = NULL;
+  size_t i, len = 0, n = mg_snprintf(key, sizeof(key), "%s %s", path, etag);
+  uint32_t hash = mg_crc32(0, key, n);
+  bool ok;
+  if (n >= sizeof(key)) return NULL;
+  if (hash == 0) hash = 1;
+  if (cache == NULL) {
+    cache = (struct http_gzip *) mg_calloc(MG_HTTP_GZIP_CACHE_SIZE, sizeof(*e));
+    if ((mgr->http_gzip = cache) == NULL) return NULL;
+  }
+  for (i = 0; i < MG_HTTP_GZIP_CACHE_SIZE; i++) {
+    if (cache[i].hash != hash || strcmp(cache[i].key, key) != 0) continue;
+    cache[i].used = mg_millis();
+    return cache[i].data == NULL ? NULL : &cache[i];
+  }
+  if (data == NULL) {  // Not cached, read the file
+    if ((buf = (char *) mg_calloc(1, size)) == NULL) return NULL;
+    while (len < size && (i = fd->fs->rd(fd->fd, buf + len, size - len)) > 0) {
+      len += i;
+    }
+    fd->fs->sk(fd->fd, 0);
+    if (len != size) {  // Changed while we read it
+      mg_free(buf);
+      return NULL;
+    }
+    data = buf;
+  }
+  memset(&d, 0, sizeof(d));
+  ok = mg_gzip(&d, data, size, true, &io);
+  mg_free(buf);
+  if (!ok) {
+    mg_iobuf_free(&io);
+    return NULL;
+  }
+  for (e = &cache[0], i = 1; i < MG_HTTP_GZIP_CACHE_SIZE && e->hash != 0; i++) {
+    if (cache[i].hash == 0 || cache[i].used < e->used) e = &cache[i];
+  }
+  mg_free(e->key), mg_free(e->data);
+  memset(e, 0, sizeof(*e));
+  if ((e->key = (char *) mg_calloc(1, n + 1)) == NULL) {
+    mg_iobuf_free(&io);
+    return NULL;
+  }
+  memcpy(e->key, key, n);
+  if (io.len < size) {  // Worth it. Keep the data, trim the allocation
+    mg_iobuf_resize(&io, io.len);
+    e->data = (char *) io.buf, e->len = io.len;
+  } else {  // Does not compress: remember that, send as is
+    mg_iobuf_free(&io);
+  }
+  n = strlen(etag);
+  mg_snprintf(e->etag, sizeof(e->etag), "%.*s.gz\"", (int) (n - 1), etag);
+  e->used = mg_millis();
+  e->hash = hash;
+  return e->data == NULL ? NULL : e;
+}
+#endif
+
+static void http_write_chunk(struct mg_connection *c, const char *buf,
+                             size_t len) {
+  mg_printf(c, "%lx\r\n", (unsigned long) len);
+  if (!mg_send(c, buf, len) || !mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list *ap) {
   size_t len = c->send.len;
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip) {  // Format, then compress
+    struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+    mg_vxprintf(mg_pfn_iobuf, &io, fmt, ap);
+    mg_http_write_chunk(c, (char *) io.buf, io.len);
+    mg_iobuf_free(&io);
+    return;
+  }
+#endif
   if (!mg_send(c, "        \r\n", 10)) mg_error(c, "OOM");
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
   if (c->send.len >= len + 10) {
@@ -3965,8 +4962,10 @@ void mg_http_printf_chunk(struct mg_connection *c, const char *fmt, ...) {
 }
 
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len) {
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  if (!mg_send(c, buf, len) || !mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip && http_gzip_chunk(c, buf, len)) return;
+#endif
+  http_write_chunk(c, buf, len);
   if (len == 0) c->is_resp = 0;
 }
 
@@ -4041,16 +5040,24 @@ static const char *mg_http_status_code_str(int status_code) {
 }
 // clang-format on
 
+// Content-Length header of mg_http_reply(), filled in once the body is known
+static const char s_cl_placeholder[] = "Content-Length:            \r\n\r\n";
+
 void mg_http_reply(struct mg_connection *c, int code, const char *headers,
                    const char *fmt, ...) {
   va_list ap;
   size_t len;
-  mg_printf(c, "HTTP/1.1 %d %s\r\n%sContent-Length:            \r\n\r\n", code,
-            mg_http_status_code_str(code), headers == NULL ? "" : headers);
+  mg_printf(c, "HTTP/1.1 %d %s\r\n%s%s", code, mg_http_status_code_str(code),
+            headers == NULL ? "" : headers, s_cl_placeholder);
   len = c->send.len;
   va_start(ap, fmt);
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, &ap);
   va_end(ap);
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip) {
+    len = http_gzip_reply(c, headers, len, sizeof(s_cl_placeholder) - 1);
+  }
+#endif
   if (c->send.len > 16) {
     size_t n = mg_snprintf((char *) &c->send.buf[len - 15], 11, "%-10lu",
                            (unsigned long) (c->send.len - len));
@@ -4059,12 +5066,12 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   c->is_resp = 0;
 }
 
-static void http_cb(struct mg_connection *, int, void *);
 static void restore_http_cb(struct mg_connection *c) {
   mg_fs_close((struct mg_fd *) c->pfn_data);
   c->pfn_data = NULL;
   c->pfn = http_cb;
   c->is_resp = 0;
+  c->is_sendfile = 0;
 }
 
 char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime);
@@ -4073,14 +5080,37 @@ char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime) {
   return buf;
 }
 
-static void static_cb(struct mg_connection *c, int ev, void *ev_data) {
-  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
-    struct mg_fd *fd = (struct mg_fd *) c->pfn_data;
-    // Read to send IO buffer directly, avoid extra on-stack buffer
+#if MG_ENABLE_SENDFILE && MG_ENABLE_SOCKET
+
+// Plain TCP and a POSIX file: let the kernel copy file data to the socket.
+// Return false to fall back to reading the file into c->send
+static bool static_sendfile(struct mg_connection *c, struct mg_fd *fd,
+                            size_t *cl) {
+  long n;
+  if (fd->fs != &mg_fs_posix || c->is_tls || c->is_udp || c->is_http2) {
+    return false;
+  }
+  c->is_sendfile = 1;
+  if (c->send.len > 0 || c->send_refs != NULL) return true;  // Headers first
+  n = *cl == 0 ? 0 : mg_io_sendfile(c, fileno((FILE *) fd->fd), *cl);
+  if (n > 0) *cl -= (size_t) n;
+  if (n == MG_IO_ERR) c->is_closing = 1;
+  if (*cl == 0 || n == 0) restore_http_cb(c);  // Done, or file got shorter
+  return true;
+}
+#endif
+
+static void static_cb(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    struct mg_fd *fd = (struct mg_fd *) c->pfn_data;
+    // Read to send IO buffer directly, avoid extra on-stack buffer
     size_t n, max = MG_IO_SIZE, space;
     size_t *cl = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
                                      sizeof(size_t) * sizeof(size_t)];
-    if (c->send.size < max) mg_iobuf_resize(&c->send, max);
+#if MG_ENABLE_SENDFILE && MG_ENABLE_SOCKET
+    if (static_sendfile(c, fd, cl)) return;
+#endif
+    if (c->send.size + c->send.head < max) mg_iobuf_resize(&c->send, max);
     if (c->send.len >= c->send.size) return;  // Rate limit
     if ((space = c->send.size - c->send.len) > *cl) space = *cl;
     n = fd->fs->rd(fd->fd, c->send.buf + c->send.len, space);
@@ -4173,48 +5203,25 @@ static int getrange(struct mg_str *s, size_t *a, size_t *b) {
   return (int) numparsed;
 }
 
-void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
-                        const char *path,
-                        const struct mg_http_serve_opts *opts) {
-  char etag[64], tmp[MG_PATH_MAX];
-  struct mg_fs *fs = opts && opts->fs ? opts->fs : &mg_fs_posix;
-  struct mg_fd *fd = NULL;
-  size_t size = 0;
-  time_t mtime = 0;
-  const char *mime_types = opts && opts->mime_types ? opts->mime_types : NULL;
-  const char *hdrs = opts && opts->extra_headers ? opts->extra_headers : "";
-  struct mg_str *inm = NULL;
-  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
-  bool gzip = false;
-
-  if (path != NULL) {
-    // If a browser sends us "Accept-Encoding: gzip", try to open .gz first
-    struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
-    if (ae != NULL) {
-      if (mg_match(*ae, mg_str("*gzip*"), NULL)) {
-        mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
-        fd = mg_fs_open(fs, tmp, MG_FS_READ);
-        if (fd != NULL) gzip = true, path = tmp;
-      }
-    }
-    // No luck opening .gz? Open what we've told to open
-    if (fd == NULL) fd = mg_fs_open(fs, path, MG_FS_READ);
-  }
-
-  // Failed to open, and page404 is configured? Open it, then
-  if (fd == NULL && opts && opts->page404) {
-    fd = mg_fs_open(fs, opts->page404, MG_FS_READ);
-    path = opts->page404;
-    mime = guess_content_type(mg_str(path), mime_types);
+// Respond with a file that is either open (fd), or cached in memory (data)
+static void http_send_file(struct mg_connection *c, struct mg_http_message *hm,
+                           const char *hdrs, const char *path,
+                           struct mg_fd *fd, const char *data, size_t size,
+                           const char *etag, struct mg_str mime, bool gzip) {
+  struct mg_str *inm;
+#if MG_ENABLE_DEFLATE
+  struct http_gzip *gz = NULL;
+  if (!gzip && c->is_http_gzip && size >= MG_HTTP_GZIP_MIN &&
+      size <= MG_HTTP_GZIP_MAX_FILE && http_gzip_type(mime) &&
+      (gz = http_gzip_file(c->mgr, path, etag, fd, data, size)) != NULL) {
+    mg_fs_close(fd);  // Send the compressed copy instead
+    fd = NULL, data = gz->data, size = gz->len, etag = gz->etag, gzip = true;
   }
-
-  if (fd == NULL || fs->st(path, &size, &mtime) == 0) {
-    mg_http_reply(c, 404, hdrs, "Not found\n");
-    mg_fs_close(fd);
-    // NOTE: mg_http_etag() call should go first!
-  } else if (mg_http_etag(etag, sizeof(etag), size, mtime) != NULL &&
-             (inm = mg_http_get_header(hm, "If-None-Match")) != NULL &&
-             mg_strcasecmp(*inm, mg_str(etag)) == 0) {
+#else
+  (void) path;
+#endif
+  inm = mg_http_get_header_id(hm, MG_HTTP_HDR_IF_NONE_MATCH);
+  if (inm != NULL && mg_strcasecmp(*inm, mg_str(etag)) == 0) {
     mg_fs_close(fd);
     mg_http_reply(c, 304, hdrs, "");
   } else {
@@ -4223,7 +5230,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     size_t r1 = 0, r2 = 0, cl = size;
 
     // Handle Range header
-    struct mg_str *rh = mg_http_get_header(hm, "Range");
+    struct mg_str *rh = mg_http_get_header_id(hm, MG_HTTP_HDR_RANGE);
     range[0] = '\0';
     if (rh != NULL && (n = getrange(rh, &r1, &r2)) > 0) {
       // If range is specified like "400-", set second limit to content len
@@ -4239,7 +5246,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
         mg_snprintf(range, sizeof(range),
                     "Content-Range: bytes %llu-%llu/%llu\r\n", (uint64_t) r1,
                     (uint64_t) (r1 + cl - 1), (uint64_t) size);
-        fs->sk(fd->fd, r1);
+        if (fd != NULL) fd->fs->sk(fd->fd, r1);
       }
     }
     mg_printf(c,
@@ -4249,11 +5256,16 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
               "Content-Length: %llu\r\n"
               "%s%s%s\r\n",
               status, mg_http_status_code_str(status), (int) mime.len, mime.buf,
-              etag, (uint64_t) cl, gzip ? "Content-Encoding: gzip\r\n" : "",
+              etag, (uint64_t) cl,
+              gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+                   : "",
               range, hdrs);
     if (mg_strcasecmp(hm->method, mg_str("HEAD")) == 0 || c->is_closing) {
       c->is_resp = 0;
       mg_fs_close(fd);
+    } else if (fd == NULL) {
+      mg_send(c, data + r1, cl);
+      c->is_resp = 0;
     } else {  // start serving static content only if not closing, see #3354
       // Track to-be-sent content length at the end of c->data, aligned
       size_t *clp = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
@@ -4265,6 +5277,48 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
   }
 }
 
+void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
+                        const char *path,
+                        const struct mg_http_serve_opts *opts) {
+  char etag[64], tmp[MG_PATH_MAX];
+  struct mg_fs *fs = opts && opts->fs ? opts->fs : &mg_fs_posix;
+  struct mg_fd *fd = NULL;
+  size_t size = 0;
+  time_t mtime = 0;
+  const char *mime_types = opts && opts->mime_types ? opts->mime_types : NULL;
+  const char *hdrs = opts && opts->extra_headers ? opts->extra_headers : "";
+  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
+  bool gzip = false;
+
+  if (path != NULL) {
+    // If a browser sends us "Accept-Encoding: gzip", try to open .gz first
+    struct mg_str *ae =
+        mg_http_get_header_id(hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+    if (http_accepts_gzip(ae)) {
+      mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
+      fd = mg_fs_open(fs, tmp, MG_FS_READ);
+      if (fd != NULL) gzip = true, path = tmp;
+    }
+    // No luck opening .gz? Open what we've told to open
+    if (fd == NULL) fd = mg_fs_open(fs, path, MG_FS_READ);
+  }
+
+  // Failed to open, and page404 is configured? Open it, then
+  if (fd == NULL && opts && opts->page404) {
+    fd = mg_fs_open(fs, opts->page404, MG_FS_READ);
+    path = opts->page404;
+    mime = guess_content_type(mg_str(path), mime_types);
+  }
+
+  if (fd == NULL || fs->st(path, &size, &mtime) == 0) {
+    mg_http_reply(c, 404, hdrs, "Not found\n");
+    mg_fs_close(fd);
+  } else {
+    mg_http_etag(etag, sizeof(etag), size, mtime);
+    http_send_file(c, hm, hdrs, path, fd, NULL, size, etag, mime, gzip);
+  }
+}
+
 struct printdirentrydata {
   struct mg_connection *c;
   struct mg_http_message *hm;
@@ -4474,11 +5528,155 @@ static int uri_to_path(struct mg_connection *c, struct mg_http_message *hm,
   return uri_to_path2(c, hm, fs, u, p, path, path_size);
 }
 
+#if MG_HTTP_CACHE_SIZE > 0
+// Static file cache entry: all that's needed to respond without fs calls
+struct http_cache {
+  uint32_t hash;       // Hash of the key; 0 for an unused entry
+  char *key;           // Options and URI. Also holds path and mime strings
+  char *path;          // Resolved path of the file being sent
+  struct mg_str mime;  // Content type
+  char etag[64];       // ETag, as made by mg_http_etag()
+  size_t size;         // File size
+  time_t mtime;        // File modification time
+  bool gzip;           // The file is the .gz variant
+  char *data;          // File content, if size <= MG_HTTP_CACHE_MAX_FILE
+  uint64_t checked;    // When size and mtime were last checked
+  uint64_t used;       // When last used, for eviction
+};
+
+static void http_cache_drop(struct http_cache *e) {
+  mg_free(e->key);
+  mg_free(e->data);
+  memset(e, 0, sizeof(*e));
+}
+
+void mg_http_cache_free(struct mg_mgr *mgr) {
+  struct http_cache *cache = (struct http_cache *) mgr->http_cache;
+  size_t i;
+  for (i = 0; cache != NULL && i < MG_HTTP_CACHE_SIZE; i++) {
+    http_cache_drop(&cache[i]);
+  }
+  mg_free(cache);
+  mgr->http_cache = NULL;
+}
+
+// Find a cached file. Once in MG_HTTP_CACHE_TTL, check it is unchanged
+static struct http_cache *http_cache_find(struct mg_mgr *mgr, struct mg_fs *fs,
+                                          uint32_t hash, const char *key) {
+  struct http_cache *e = (struct http_cache *) mgr->http_cache, *end;
+  uint64_t now = mg_millis();
+  for (end = e + MG_HTTP_CACHE_SIZE; e != NULL && e < end; e++) {
+    size_t size = 0;
+    time_t mtime = 0;
+    if (e->hash != hash || strcmp(e->key, key) != 0) continue;
+    if (now - e->checked > MG_HTTP_CACHE_TTL) {
+      if (fs->st(e->path, &size, &mtime) == 0 || size != e->size ||
+          mtime != e->mtime) {
+        http_cache_drop(e);  // Modified or gone
+        return NULL;
+      }
+      e->checked = now;
+    }
+    e->used = now;
+    return e;
+  }
+  return NULL;
+}
+
+// Cache a regular file that path was resolved to, replacing the LRU entry
+static struct http_cache *http_cache_add(struct mg_mgr *mgr, struct mg_fs *fs,
+                                         uint32_t hash, const char *key,
+                                         const char *path, bool gzip,
+                                         const char *mime_types) {
+  struct http_cache *e, *cache = (struct http_cache *) mgr->http_cache;
+  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
+  char tmp[MG_PATH_MAX];
+  size_t i, size = 0, klen = strlen(key), plen;
+  time_t mtime = 0;
+  int flags = 0;
+  if (gzip) {
+    mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
+    flags = fs->st(tmp, &size, &mtime);
+    if (flags != 0) path = tmp;
+  }
+  if (flags == 0) gzip = false, flags = fs->st(path, &size, &mtime);
+  if (flags == 0 || (flags & MG_FS_DIR)) return NULL;
+  if (cache == NULL) {
+    cache = (struct http_cache *) mg_calloc(MG_HTTP_CACHE_SIZE, sizeof(*e));
+    if ((mgr->http_cache = cache) == NULL) return NULL;
+  }
+  for (e = &cache[0], i = 1; i < MG_HTTP_CACHE_SIZE && e->hash != 0; i++) {
+    if (cache[i].hash == 0 || cache[i].used < e->used) e = &cache[i];
+  }
+  http_cache_drop(e);
+  plen = strlen(path);
+  if ((e->key = (char *) mg_calloc(1, klen + plen + mime.len + 3)) == NULL) {
+    return NULL;
+  }
+  memcpy(e->key, key, klen);
+  e->path = e->key + klen + 1;
+  memcpy(e->path, path, plen);
+  e->mime = mg_str_n(e->path + plen + 1, mime.len);
+  memcpy((char *) e->mime.buf, mime.buf, mime.len);
+  if (size <= MG_HTTP_CACHE_MAX_FILE) {
+    struct mg_str data = mg_file_read(fs, path);
+    if (data.buf == NULL || data.len != size) {  // Changed while we read it
+      mg_free((void *) data.buf);
+      http_cache_drop(e);
+      return NULL;
+    }
+    e->data = (char *) data.buf;
+  }
+  mg_http_etag(e->etag, sizeof(e->etag), size, mtime);
+  e->size = size, e->mtime = mtime, e->gzip = gzip;
+  e->checked = e->used = mg_millis();
+  e->hash = hash;
+  return e;
+}
+
+// Respond from the cache. Called with path == NULL before the URI is
+// resolved, then with the resolved path to add the file to the cache
+static bool http_cache_serve(struct mg_connection *c,
+                             struct mg_http_message *hm,
+                             const struct mg_http_serve_opts *opts,
+                             const char *path) {
+  char key[MG_PATH_MAX + 100];
+  struct mg_fs *fs = opts->fs == NULL ? &mg_fs_posix : opts->fs;
+  struct mg_str *ae = mg_http_get_header_id(hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+  bool gzip = http_accepts_gzip(ae);
+  struct mg_fd *fd = NULL;
+  struct http_cache *e;
+  uint32_t hash;
+  size_t n = mg_snprintf(key, sizeof(key), "%p %d %s %s %s %.*s", fs, gzip,
+                         opts->root_dir ? opts->root_dir : "",
+                         opts->mime_types ? opts->mime_types : "",
+                         opts->ssi_pattern ? opts->ssi_pattern : "",
+                         (int) hm->uri.len, hm->uri.buf);
+  if (n >= sizeof(key)) return false;  // Too long, don't cache
+  if ((hash = mg_crc32(0, key, n)) == 0) hash = 1;
+  e = path == NULL ? http_cache_find(c->mgr, fs, hash, key)
+                   : http_cache_add(c->mgr, fs, hash, key, path, gzip,
+                                    opts->mime_types);
+  if (e == NULL) return false;
+  if (e->data == NULL && (fd = mg_fs_open(fs, e->path, MG_FS_READ)) == NULL) {
+    http_cache_drop(e);
+    return false;
+  }
+  http_send_file(c, hm, opts->extra_headers ? opts->extra_headers : "",
+                 e->path, fd, e->data, e->size, e->etag, e->mime, e->gzip);
+  return true;
+}
+#endif
+
 void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *opts) {
   char path[MG_PATH_MAX];
   const char *sp = opts->ssi_pattern;
-  int flags = uri_to_path(c, hm, opts, path, sizeof(path));
+  int flags;
+#if MG_HTTP_CACHE_SIZE > 0
+  if (http_cache_serve(c, hm, opts, NULL)) return;  // Hot file, no fs calls
+#endif
+  flags = uri_to_path(c, hm, opts, path, sizeof(path));
   if (flags < 0) {
     // Do nothing: the response has already been sent by uri_to_path()
   } else if (flags & MG_FS_DIR) {
@@ -4490,6 +5688,9 @@ void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
   } else if (flags && sp != NULL && mg_match(mg_str(path), mg_str(sp), NULL)) {
     mg_http_serve_ssi(c, opts->root_dir, path);
   } else {
+#if MG_HTTP_CACHE_SIZE > 0
+    if (flags != 0 && http_cache_serve(c, hm, opts, path)) return;
+#endif
     mg_http_serve_file(c, hm, path, opts);
   }
 }
@@ -4518,7 +5719,7 @@ size_t mg_url_encode(const char *s, size_t sl, char *buf, size_t len) {
 
 void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
                    char *pass, size_t passlen) {
-  struct mg_str *v = mg_http_get_header(hm, "Authorization");
+  struct mg_str *v = mg_http_get_header_id(hm, MG_HTTP_HDR_AUTHORIZATION);
   user[0] = pass[0] = '\0';
   if (v != NULL && v->len > 6 && memcmp(v->buf, "Basic ", 6) == 0) {
     char buf[256];
@@ -4530,7 +5731,7 @@ void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
     }
   } else if (v != NULL && v->len > 7 && memcmp(v->buf, "Bearer ", 7) == 0) {
     mg_snprintf(pass, passlen, "%.*s", (int) v->len - 7, v->buf + 7);
-  } else if ((v = mg_http_get_header(hm, "Cookie")) != NULL) {
+  } else if ((v = mg_http_get_header_id(hm, MG_HTTP_HDR_COOKIE)) != NULL) {
     struct mg_str t = mg_http_get_header_var(*v, mg_str_n("access_token", 12));
     if (t.len > 0) mg_snprintf(pass, passlen, "%.*s", (int) t.len, t.buf);
   } else {
@@ -4722,15 +5923,131 @@ static int skip_chunk(const char *buf, int len, int *pl, int *dl) {
   return i + 2 + n + 2;
 }
 
+// Remember how far the message being parsed was scanned: its header length
+// once known, and how many header or chunked body bytes were examined
+static void http_set_scan(struct mg_connection *c, size_t head, size_t scan) {
+  c->http_head = head, c->http_scan = scan;
+}
+
+// Parse a message at `ofs`. A partially buffered message stays buffered at
+// the start of c->recv, so resume its header scan where the previous read
+// stopped, and once its headers are found, do not scan for them again
+static int http_parse_conn(struct mg_connection *c, size_t ofs,
+                           struct mg_http_message *hm) {
+  const char *buf = (char *) c->recv.buf + ofs;
+  size_t len = c->recv.len - ofs;
+  int n = (int) c->http_head;
+  if (n == 0) {
+    n = http_req_len((uint8_t *) buf, len, c->http_scan);
+    if (n >= 0) http_set_scan(c, (size_t) n, n > 0 ? 0 : len);
+  }
+  return http_parse(buf, n, hm);
+}
+
+// Deliver a body fragment at `ofs` in streaming mode
+static void http_body(struct mg_connection *c, struct mg_http_message *hm,
+                      size_t ofs, size_t len) {
+  hm->body = mg_str_n((char *) c->recv.buf + ofs, len);
+  mg_call(c, MG_EV_HTTP_BODY, hm);
+}
+
+// Parse chunk size line at `s`. Return its length, 0 if not buffered yet,
+// or -1 on error
+static int http_chunk_size(const char *s, size_t len, size_t *size) {
+  size_t i = 0;
+  int n = 0;  // pass int to mg_str_to_num, treats as unsigned
+  while (i < len && is_hex_digit(s[i])) i++;
+  if (i == len || (i + 1 == len && s[i] == '\r')) return 0;
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') return -1;
+  if (!mg_str_to_num(mg_str_n(s, i), 16, &n, sizeof(n)) || n < 0) return -1;
+  *size = (size_t) n;
+  return (int) i + 2;
+}
+
+// Streaming mode: deliver the body of the message at `ofs` as it arrives,
+// removing delivered bytes from c->recv. The headers stay buffered until the
+// message is complete. c->http_scan holds the number of body bytes left for
+// Content-Length, or data + CRLF bytes left of the current chunk. A body
+// without either, c->is_http_eof set, ends when the connection closes.
+// Return true when the body is complete
+static bool http_stream(struct mg_connection *c, struct mg_http_message *hm,
+                        size_t ofs, bool is_chunked, bool is_closing) {
+  size_t start = ofs + hm->head.len, pos = start, left, n;
+  bool done = false;
+  if (!c->is_http_body) {  // First fragment of this message
+    c->is_http_body = 1;
+    c->is_http_eof = !is_chunked && hm->body.len == (size_t) ~0;
+    c->http_scan = is_chunked ? 0 : hm->body.len;
+  }
+  left = c->http_scan;
+  if (!is_chunked) {
+    n = c->recv.len - pos < left ? c->recv.len - pos : left;
+    if (n > 0 && !c->is_full) {
+      http_body(c, hm, pos, n), pos += n;
+      if (!c->is_http_eof) left -= n;
+    }
+    done = c->is_http_eof ? is_closing : left == 0;
+  }
+  while (is_chunked && !done && !c->is_full && c->is_closing == 0) {
+    const char *s = (char *) c->recv.buf + pos;
+    size_t avail = c->recv.len - pos, size = 0;
+    int k;
+    if (left == 0) {  // Chunk size line
+      if ((k = http_chunk_size(s, avail, &size)) <= 0) {
+        if (k < 0) mg_error(c, "Invalid chunk");
+        break;
+      }
+      if (size == 0) {  // Last chunk, followed by an empty line
+        if (avail < (size_t) k + 2) break;
+        if (s[k] != '\r' || s[k + 1] != '\n') {
+          mg_error(c, "Invalid chunk");
+          break;
+        }
+        pos += (size_t) k + 2, done = true;
+      } else {
+        pos += (size_t) k, left = size + 2;
+      }
+    } else if (left > 2) {  // Chunk data
+      if ((n = avail < left - 2 ? avail : left - 2) == 0) break;
+      http_body(c, hm, pos, n);
+      pos += n, left -= n;
+    } else {  // CRLF after chunk data
+      if (avail == 0) break;
+      if (s[0] != (left == 2 ? '\r' : '\n')) {
+        mg_error(c, "Invalid chunk");
+        break;
+      }
+      pos++, left--;
+    }
+  }
+  mg_iobuf_del(&c->recv, start, pos - start);
+  c->http_scan = left;
+  return done;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
+#if MG_ENABLE_DEFLATE
+  if (ev == MG_EV_CLOSE && c->http_gzip != NULL) http_gzip_end(c);
+#endif
+#if MG_ENABLE_HTTP2
+  if (ev == MG_EV_READ && c->is_accepted && !c->is_http2 &&
+      mg_http2_accept(c)) {
+    return;  // Got HTTP/2 client preface, or a part of it
+  }
+#endif
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE ||
-      (ev == MG_EV_POLL && c->is_accepted && !c->is_draining &&
-       c->recv.len > 0)) {  // see #2796
+      (ev == MG_EV_POLL && (c->is_accepted || c->is_http_stream) &&
+       !c->is_draining && c->recv.len > 0)) {  // see #2796
     struct mg_http_message hm;
     size_t ofs = 0;  // Parsing offset
+    if (c->http_head > c->recv.len ||
+        (c->http_scan > c->recv.len && !c->is_http_body)) {
+      http_set_scan(c, 0, 0);  // Received data was consumed elsewhere
+      c->is_http_body = 0;
+    }
     while (c->is_resp == 0 && ofs < c->recv.len) {
       const char *buf = (char *) c->recv.buf + ofs;
-      int n = mg_http_parse(buf, c->recv.len - ofs, &hm);
+      int n = http_parse_conn(c, ofs, &hm);
       struct mg_str *te;  // Transfer - encoding header
       bool is_chunked = false, is_http_1_0 = false;
       size_t old_len = c->recv.len;
@@ -4741,13 +6058,16 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         c->is_draining = 1;
         mg_hexdump(buf, c->recv.len - ofs > 16 ? 16 : c->recv.len - ofs);
         c->recv.len = 0;
+        http_set_scan(c, 0, 0);
         return;
       }
-      if (n == 0) break;                 // Request is not buffered yet
-      mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Got all HTTP headers
+      if (n == 0) break;  // Request is not buffered yet
+      // Got all HTTP headers. When streaming, report them once
+      if (!c->is_http_body) mg_call(c, MG_EV_HTTP_HDRS, &hm);
       if (c->recv.len != old_len) {
         // User manipulated received data. Wash our hands
         MG_DEBUG(("%lu detaching HTTP handler", c->id));
+        http_set_scan(c, 0, 0);
         c->pfn = NULL;
         return;
       }
@@ -4759,14 +6079,16 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
           hm.proto.len == 8 && mg_ncasecmp(hm.proto.buf, "HTTP/1.0", 8) == 0;
       // HTTP/1.0 does not use "Transfer-Encoding: chunked"
       if (!is_http_1_0 &&
-          (te = mg_http_get_header(&hm, "Transfer-Encoding")) != NULL) {
+          (te = mg_http_get_header_id(&hm, MG_HTTP_HDR_TRANSFER_ENCODING)) !=
+              NULL) {
         if (mg_strcasecmp(*te, mg_str("chunked")) == 0) {
           is_chunked = true;
         } else {
           mg_error(c, "Invalid Transfer-Encoding");  // See #2460
           return;
         }
-      } else if (mg_http_get_header(&hm, "Content-length") == NULL) {
+      } else if (mg_http_get_header_id(&hm, MG_HTTP_HDR_CONTENT_LENGTH) ==
+                 NULL) {
         // #2593: HTTP packets must contain either Transfer-Encoding or
         // Content-length
         bool is_response = mg_ncasecmp(hm.method.buf, "HTTP/", 5) == 0;
@@ -4792,15 +6114,29 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         }
       }
 
-      if (is_chunked) {
+      if (c->is_http_stream || c->is_http_body) {
+        // Streaming mode: deliver the body as it arrives, then report an
+        // empty-bodied message
+        size_t mofs = (size_t) (buf - (char *) c->recv.buf);
+        if (!http_stream(c, &hm, mofs, is_chunked, ev == MG_EV_CLOSE)) break;
+        c->is_http_body = 0;
+        hm.body = mg_str_n((char *) c->recv.buf + mofs + n, 0);
+        hm.message.len = (size_t) n;
+        ofs = mofs + (size_t) n;
+      } else if (is_chunked) {
         // For chunked data, strip off prefixes and suffixes from chunks
         // and relocate them right after the headers, then report a message
         char *s = (char *) c->recv.buf + ofs + n;
         int o = 0, pl, dl, cl, len = (int) (c->recv.len - ofs - (size_t) n);
 
-        // Find zero-length chunk (the end of the body)
+        // Find zero-length chunk (the end of the body), skipping the chunks
+        // already found on previous reads
+        if (c->http_scan <= (size_t) len) o = (int) c->http_scan;
         while ((cl = skip_chunk(s + o, len - o, &pl, &dl)) > 0 && dl) o += cl;
-        if (cl == 0) break;  // No zero-len chunk, buffer more data
+        if (cl == 0) {  // No zero-len chunk, buffer more data
+          http_set_scan(c, (size_t) n, (size_t) o);
+          break;
+        }
         if (cl < 0) {
           mg_error(c, "Invalid chunk");
           break;
@@ -4819,11 +6155,20 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         if (hm.body.len > len) break;  // Buffer more data
         ofs += (size_t) n + hm.body.len;
       }
+      http_set_scan(c, 0, 0);  // Message is complete
 
       if (c->is_accepted) c->is_resp = 1;  // Start generating response
+#if MG_ENABLE_DEFLATE
+      if (c->is_accepted) {  // Compress the response if the peer accepts it
+        struct mg_str *ae =
+            mg_http_get_header_id(&hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+        c->is_http_gzip = http_accepts_gzip(ae);
+      }
+#endif
       mg_call(c, MG_EV_HTTP_MSG, &hm);     // User handler can clear is_resp
       if (c->is_accepted && !c->is_resp) {
-        struct mg_str *cc = mg_http_get_header(&hm, "Connection");
+        struct mg_str *cc =
+            mg_http_get_header_id(&hm, MG_HTTP_HDR_CONNECTION);
         if (cc != NULL && mg_strcasecmp(*cc, mg_str("close")) == 0) {
           c->is_draining = 1;  // honor "Connection: close"
           break;
@@ -4848,122 +6193,1144 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
 }
 
 #ifdef MG_ENABLE_LINES
-#line 1 "src/iobuf.c"
+#line 1 "src/http2.c"
 #endif
 
 
 
 
 
-static size_t roundup(size_t size, size_t align) {
-  return align == 0 ? size : (size + align - 1) / align * align;
+#if MG_ENABLE_HTTP2
+// HTTP/2 server, RFC 9113. Every request stream gets a connection of its
+// own, which is not in mgr->conns and has no socket. The request is written
+// to its recv buffer as HTTP/1 text, so the usual HTTP handler parses it and
+// fires MG_EV_HTTP_MSG. The HTTP/1 response written to its send buffer, e.g.
+// by mg_http_reply() or mg_http_serve_dir(), is converted back to frames
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_WINDOW 65535     // Initial flow control window, the default
+#define H2_FRAME_MAX 16384  // Largest frame, the default for both sides
+#define H2_TABLE_MAX 4096   // HPACK dynamic table size, the default
+#define H2_BLOCK_MAX 32768  // Largest request header block we accept
+#define H2_LIST_MAX 16384   // Largest decoded header list, RFC 9113 6.5.2
+
+// Frame types
+enum {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+// Error codes
+enum {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_STREAM_CLOSED = 5,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_ENHANCE_YOUR_CALM = 11
+};
+
+// Frame flags
+#define H2_END_STREAM 1  // Also ACK, for SETTINGS and PING
+#define H2_END_HEADERS 4
+#define H2_PADDED 8
+#define H2_PRIO 0x20
+
+// How the stream response, sent by the HTTP/1 code, is being converted
+enum {
+  H2_RESP_HEAD,     // Waiting for the status line and headers
+  H2_RESP_LEN,      // Body has Content-Length
+  H2_RESP_CHUNKED,  // Chunked body
+  H2_RESP_CLOSE,    // Body ends when the stream connection closes
+  H2_RESP_DONE      // Response is complete
+};
+
+struct h2_stream {
+  struct h2_stream *next;   // Next stream, in ID order
+  struct mg_connection *c;  // Stream connection
+  uint32_t id;              // Stream ID
+  int64_t swin;             // Send window
+  size_t rwin;              // Receive window, left to the peer
+  size_t left;              // Response body left: Content-Length or chunk
+  size_t req_left;          // Request body left, if Content-Length is set
+  unsigned long stamp;      // When a DATA frame was sent last, round robin
+  uint8_t state;            // Response conversion state, H2_RESP_*
+  uint8_t urgency;          // Priority, 0 is the highest (RFC 9218)
+  bool incremental;         // Priority: share bandwidth, same urgency
+  bool has_prio;            // Priority header is set, ignore PRIORITY frames
+  bool is_head;             // HEAD request, the response has no body
+  bool is_blocked;          // Has nothing to send in this round
+  bool crlf;                // Response chunk data is sent, CRLF is due
+  bool req_len;             // Request has Content-Length
+  bool req_chunked;         // Request body is relayed in chunks
+  bool req_done;            // Request is complete: got END_STREAM
+};
+
+struct h2_conn {
+  struct h2_stream *streams;  // Open streams
+  mg_event_handler_t pfn;     // HTTP/1 handler, for stream connections
+  struct mg_iobuf block;      // Header block being received
+  struct mg_iobuf table;      // HPACK dynamic table, newest entry first
+  size_t table_size;          // Dynamic table size, RFC 7541 section 4.1
+  size_t table_max;           // Dynamic table size limit
+  size_t nstreams;            // Number of open streams
+  size_t rwin;                // Connection receive window, left to the peer
+  int64_t swin;               // Connection send window
+  int64_t init_win;           // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  uint32_t last_id;           // Highest stream ID seen
+  uint32_t block_id;          // Stream of the header block, 0 if none
+  uint8_t block_flags;        // HEADERS frame flags
+  unsigned block_weight;      // HEADERS frame priority weight, 0 if none
+  unsigned long stamp;        // DATA frames sent, round robin clock
+  bool is_goaway;             // Accept no new streams
+};
+
+// HPACK static table, RFC 7541 appendix A
+static const char *const s_h2_static[][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+
+#define H2_STATIC_SIZE (sizeof(s_h2_static) / sizeof(s_h2_static[0]))
+
+// HPACK Huffman code, RFC 7541 appendix B. The code is canonical, so it is
+// enough to know how many codes there are of each length, and the symbols
+// in code order. EOS, the last code, is not listed
+static const uint8_t s_h2_huff_count[31] = {
+    0, 0, 0, 0, 0,  10, 26, 32, 6,  0,  5,  3,  2,  6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+static const uint8_t s_h2_huff_sym[256] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,
+    51,  52,  53,  54,  55,  56,  57,  61,  65,  95,  98,  100, 102, 103, 104,
+    108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,  73,
+    74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38,  42,  44,  59,  88,  90,  33,
+    34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,  93,  126,
+    94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224,
+    226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181,
+    185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139,
+    140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174,
+    175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202,
+    205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2,
+    3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,
+    21,  23,  24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,
+    22};
+
+// Decode an integer with an n-bit prefix, RFC 7541 section 5.1
+static bool hp_int(const uint8_t **p, const uint8_t *end, int n, size_t *v) {
+  size_t max = (size_t) ((1U << n) - 1), shift = 0;
+  uint8_t b = 0x80;
+  if (*p >= end) return false;
+  if ((*v = *(*p)++ & max) < max) return true;
+  while (b & 0x80) {
+    if (*p >= end || shift > 21) return false;  // Up to 2^28, plenty
+    b = *(*p)++;
+    *v += (size_t) (b & 0x7f) << shift;
+    shift += 7;
+  }
+  return true;
 }
 
-bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
-  bool ok = true;
-  new_size = roundup(new_size, io->align);
-  if (new_size == 0) {
-    mg_bzero(io->buf, io->size);
-    mg_free(io->buf);
-    io->buf = NULL;
-    io->len = io->size = 0;
-  } else if (new_size != io->size) {
-    // NOTE(lsm): do not use realloc here. Use mg_calloc/mg_free only
-    void *p = mg_calloc(1, new_size);
-    if (p != NULL) {
-      size_t len = new_size < io->len ? new_size : io->len;
-      if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
-      mg_bzero(io->buf, io->size);
-      mg_free(io->buf);
-      io->buf = (unsigned char *) p;
-      io->size = new_size;
-      io->len = len;
+// Decode a Huffman-coded string, append it to io
+static bool hp_huff(const uint8_t *s, size_t n, struct mg_iobuf *io) {
+  uint32_t code = 0, first = 0, index = 0, len = 0;
+  bool ones = true;  // Padding must be the most significant bits of EOS
+  size_t i;
+  if (!mg_iobuf_reserve(io, n * 8 / 5 + 1)) return false;
+  for (i = 0; i < n * 8; i++) {
+    uint32_t bit = (uint32_t) (s[i / 8] >> (7 - i % 8)) & 1U;
+    uint32_t count = s_h2_huff_count[++len];
+    code |= bit, ones = ones && bit;
+    if (code < first + count) {  // Got a symbol, canonical decoding
+      if (index + code - first >= 256) return false;  // EOS is an error
+      if ((io->buf[io->len++] = s_h2_huff_sym[index + code - first]) == 0) {
+        return false;  // We use NUL as a delimiter, and it is invalid anyway
+      }
+      code = first = index = len = 0, ones = true;
+    } else if (len >= 30) {
+      return false;
     } else {
-      ok = false;
-      MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
+      index += count, first = (first + count) << 1, code <<= 1;
     }
   }
-  return ok;
+  return len < 8 && ones;
 }
 
-bool mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
-  io->buf = NULL;
-  io->align = align;
-  io->size = io->len = 0;
-  return mg_iobuf_resize(io, size);
+// Decode a string literal, append it to io, NUL-terminated
+static bool hp_str(const uint8_t **p, const uint8_t *end, struct mg_iobuf *io) {
+  bool huff = *p < end && (**p & 0x80);
+  size_t len;
+  if (!hp_int(p, end, 7, &len) || len > (size_t) (end - *p)) return false;
+  if (huff) {
+    if (!hp_huff(*p, len, io)) return false;
+  } else if (memchr(*p, 0, len) != NULL ||
+             mg_iobuf_add(io, io->len, *p, len) < len) {
+    return false;
+  }
+  *p += len;
+  return mg_iobuf_add(io, io->len, "", 1) == 1;
 }
 
-size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
-                    size_t len) {
-  size_t new_size = roundup(io->len + len, io->align);
-  mg_iobuf_resize(io, new_size);      // Attempt to resize
-  if (new_size != io->size) len = 0;  // Resize failure, append nothing
-  if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
-  if (buf != NULL) memmove(io->buf + ofs, buf, len);
-  if (ofs > io->len) io->len += ofs - io->len;
-  io->len += len;
-  return len;
+// Dynamic table entries are "name\0value\0", size is as per RFC 7541 4.1
+static size_t hp_entry(const uint8_t *p, size_t *size) {
+  size_t n = strlen((char *) p) + 1, v = strlen((char *) p + n) + 1;
+  if (size != NULL) *size = n + v - 2 + 32;
+  return n + v;
 }
 
-size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
-  if (ofs > io->len) ofs = io->len;
-  if (ofs + len > io->len) len = io->len - ofs;
-  if (io->buf) memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
-  if (io->buf) mg_bzero(io->buf + io->len - len, len);
-  io->len -= len;
-  return len;
+static void hp_evict(struct h2_conn *h, size_t max) {
+  while (h->table_size > max) {
+    size_t ofs = 0, last = 0, size = 0;
+    while (ofs < h->table.len) {
+      last = ofs, ofs += hp_entry(h->table.buf + ofs, &size);
+    }
+    h->table.len = last;
+    h->table_size -= size;
+  }
 }
 
-void mg_iobuf_free(struct mg_iobuf *io) {
-  mg_iobuf_resize(io, 0);
+// Add an entry, which io has at ofs, to the dynamic table
+static bool hp_add(struct h2_conn *h, struct mg_iobuf *io, size_t ofs) {
+  size_t size, len = hp_entry(io->buf + ofs, &size);
+  if (size > h->table_max) {
+    hp_evict(h, 0);  // Too large: the table just gets empty
+  } else {
+    hp_evict(h, h->table_max - size);
+    if (mg_iobuf_add(&h->table, 0, io->buf + ofs, len) == 0) return false;
+    h->table_size += size;
+  }
+  return true;
 }
 
-#ifdef MG_ENABLE_LINES
-#line 1 "src/json.c"
-#endif
-
-
-
-
+// Append a name, and a value if val is true, of a table entry to io
+static bool hp_index(struct h2_conn *h, size_t idx, bool val,
+                     struct mg_iobuf *io) {
+  const char *name, *value;
+  if (idx == 0) return false;
+  if (idx <= H2_STATIC_SIZE) {
+    name = s_h2_static[idx - 1][0], value = s_h2_static[idx - 1][1];
+  } else {
+    size_t ofs = 0;
+    for (idx -= H2_STATIC_SIZE + 1; idx > 0 && ofs < h->table.len; idx--) {
+      ofs += hp_entry(h->table.buf + ofs, NULL);
+    }
+    if (ofs >= h->table.len) return false;
+    name = (char *) h->table.buf + ofs, value = name + strlen(name) + 1;
+  }
+  return mg_iobuf_add(io, io->len, name, strlen(name) + 1) > 0 &&
+         (!val || mg_iobuf_add(io, io->len, value, strlen(value) + 1) > 0);
+}
 
-static const char *escapeseq(int esc) {
-  return esc ? "\b\f\n\r\t\\\"" : "bfnrt\\\"";
+// Decode a header block into io, as "name\0value\0" pairs. Indexed fields
+// make a small block expand a lot, so the decoded list size is capped
+static bool hp_decode(struct h2_conn *h, const uint8_t *p, size_t len,
+                      struct mg_iobuf *io) {
+  const uint8_t *end = p + len;
+  size_t size = 0;  // Header list size, as per RFC 9113 6.5.2
+  while (p < end) {
+    size_t idx, ofs = io->len;
+    uint8_t b = *p;
+    if (b & 0x80) {  // Indexed field
+      if (!hp_int(&p, end, 7, &idx) || !hp_index(h, idx, true, io)) {
+        return false;
+      }
+    } else if ((b & 0xe0) == 0x20) {  // Dynamic table size update
+      if (!hp_int(&p, end, 5, &idx) || idx > H2_TABLE_MAX) return false;
+      hp_evict(h, h->table_max = idx);
+    } else {  // Literal, with incremental indexing (01), or without it
+      bool add = (b & 0x40) != 0;
+      if (!hp_int(&p, end, add ? 6 : 4, &idx)) return false;
+      if (idx == 0 ? !hp_str(&p, end, io) : !hp_index(h, idx, false, io)) {
+        return false;
+      }
+      if (!hp_str(&p, end, io) || (add && !hp_add(h, io, ofs))) return false;
+    }
+    if (io->len > ofs && (size += io->len - ofs - 2 + 32) > H2_LIST_MAX) {
+      return false;
+    }
+  }
+  return true;
 }
 
-static char json_esc(int c, int esc) {
-  const char *p, *esc1 = escapeseq(esc), *esc2 = escapeseq(!esc);
-  for (p = esc1; *p != '\0'; p++) {
-    if (*p == c) return esc2[p - esc1];
+static void hp_put_int(struct mg_iobuf *io, uint8_t flags, int n, size_t v) {
+  uint8_t buf[8];
+  size_t len = 0, max = (size_t) ((1U << n) - 1);
+  if (v < max) {
+    buf[len++] = (uint8_t) (flags | v);
+  } else {
+    buf[len++] = (uint8_t) (flags | max);
+    for (v -= max; v >= 128; v >>= 7) buf[len++] = (uint8_t) (v | 128);
+    buf[len++] = (uint8_t) v;
   }
-  return 0;
+  mg_iobuf_add(io, io->len, buf, len);
 }
 
-static int mg_pass_string(const char *s, int len) {
-  int i;
-  for (i = 0; i < len; i++) {
-    if (s[i] == '\\' && i + 1 < len && json_esc(s[i + 1], 1)) {
-      i++;
-    } else if (s[i] == '\0') {
-      return MG_JSON_INVALID;
-    } else if (s[i] == '"') {
-      return i;
+static void hp_put_str(struct mg_iobuf *io, struct mg_str s, bool lower) {
+  size_t i, ofs;
+  hp_put_int(io, 0, 7, s.len);
+  ofs = io->len;
+  if (mg_iobuf_add(io, ofs, s.buf, s.len) == 0) return;
+  for (i = 0; lower && i < s.len; i++) {
+    if (io->buf[ofs + i] >= 'A' && io->buf[ofs + i] <= 'Z') {
+      io->buf[ofs + i] = (uint8_t) (io->buf[ofs + i] + 'a' - 'A');
     }
   }
-  return MG_JSON_INVALID;
 }
 
-static double mg_atod(const char *p, int len, int *numlen) {
-  double d = 0.0;
-  int i = 0, sign = 1;
-
-  // Sign
-  if (i < len && *p == '-') {
-    sign = -1, i++;
-  } else if (i < len && *p == '+') {
-    i++;
+// Encode a field as a literal without indexing. The encoder does not use the
+// dynamic table, so it keeps no state
+static void hp_put(struct mg_iobuf *io, struct mg_str name, struct mg_str val) {
+  size_t i;
+  for (i = 15; i <= H2_STATIC_SIZE; i++) {
+    if (mg_strcasecmp(name, mg_str(s_h2_static[i - 1][0])) == 0) break;
   }
-
-  // Decimal
+  if (i <= H2_STATIC_SIZE) {
+    hp_put_int(io, 0, 4, i);
+  } else {
+    hp_put_int(io, 0, 4, 0);
+    hp_put_str(io, name, true);
+  }
+  hp_put_str(io, val, false);
+}
+
+static void h2_frame(struct mg_connection *c, uint8_t type, uint8_t flags,
+                     uint32_t id, const void *buf, size_t len) {
+  uint8_t hdr[9];
+  MG_STORE_BE24(hdr, len);
+  hdr[3] = type, hdr[4] = flags;
+  MG_STORE_BE32(hdr + 5, id);
+  mg_send(c, hdr, sizeof(hdr));
+  if (len > 0) mg_send(c, buf, len);
+}
+
+// Send a frame with a 32-bit payload: RST_STREAM, WINDOW_UPDATE
+static void h2_frame32(struct mg_connection *c, uint8_t type, uint32_t id,
+                       uint32_t val) {
+  uint8_t buf[4];
+  MG_STORE_BE32(buf, val);
+  h2_frame(c, type, 0, id, buf, sizeof(buf));
+}
+
+// Connection error: say why, and close once that is sent
+static void h2_goaway(struct mg_connection *c, struct h2_conn *h,
+                      uint32_t code) {
+  uint8_t buf[8];
+  MG_STORE_BE32(buf, h->last_id);
+  MG_STORE_BE32(buf + 4, code);
+  h2_frame(c, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+  MG_ERROR(("%lu HTTP/2 error %lu", c->id, (unsigned long) code));
+  h->is_goaway = true;
+  c->is_draining = 1;
+}
+
+static struct h2_stream *h2_find(struct h2_conn *h, uint32_t id) {
+  struct h2_stream *s = h->streams;
+  while (s != NULL && s->id != id) s = s->next;
+  return s;
+}
+
+static struct h2_stream *h2_open(struct mg_connection *c, struct h2_conn *h,
+                                 uint32_t id) {
+  struct h2_stream *s = (struct h2_stream *) mg_calloc(1, sizeof(*s)), **p;
+  struct mg_connection *sc = s == NULL ? NULL : mg_alloc_conn(c->mgr);
+  if (sc == NULL) {
+    mg_free(s);
+    return NULL;
+  }
+  sc->fd = (void *) (size_t) MG_INVALID_SOCKET;
+  sc->loc = c->loc, sc->rem = c->rem;
+  sc->fn = c->fn, sc->fn_data = c->fn_data, sc->pfn = h->pfn;
+  sc->is_accepted = sc->is_http2 = 1;
+  s->c = sc, s->id = id, s->swin = h->init_win, s->rwin = H2_WINDOW;
+  s->urgency = 3;  // The default, RFC 9218
+  for (p = &h->streams; *p != NULL;) p = &(*p)->next;
+  *p = s;
+  h->nstreams++;
+  MG_DEBUG(("%lu stream %lu: %lu", c->id, (unsigned long) id, sc->id));
+  mg_call(sc, MG_EV_OPEN, NULL);
+  mg_call(sc, MG_EV_ACCEPT, NULL);  // mg_tls_init() ignores stream connections
+  return s;
+}
+
+static void h2_close(struct h2_conn *h, struct h2_stream *s) {
+  struct h2_stream **p = &h->streams;
+  while (*p != s) p = &(*p)->next;
+  *p = s->next;
+  s->c->recv.len = 0;  // Do not deliver an incomplete request on close
+  mg_close_conn(s->c);
+  mg_free(s);
+  h->nstreams--;
+}
+
+static void h2_reset(struct mg_connection *c, struct h2_conn *h,
+                     struct h2_stream *s, uint32_t code) {
+  h2_frame32(c, H2_RST_STREAM, s->id, code);
+  h2_close(h, s);
+}
+
+// Relay request data to the stream connection, let it parse what it has
+static void h2_relay(struct h2_stream *s, const void *buf, size_t len,
+                     bool end) {
+  struct mg_iobuf *io = &s->c->recv;
+  long n = (long) io->len;
+  if (s->req_chunked && len > 0) {
+    mg_xprintf(mg_pfn_iobuf, io, "%lx\r\n", (unsigned long) len);
+  }
+  mg_iobuf_add(io, io->len, buf, len);
+  if (s->req_chunked && len > 0) mg_iobuf_add(io, io->len, "\r\n", 2);
+  if (s->req_chunked && end) mg_iobuf_add(io, io->len, "0\r\n\r\n", 5);
+  if (end) s->req_done = true;
+  n = (long) io->len - n;
+  if (n > 0 && !s->c->is_full) mg_call(s->c, MG_EV_READ, &n);
+}
+
+// RFC 9218 priority field value, e.g. "u=1, i"
+static void h2_prio(struct h2_stream *s, struct mg_str v) {
+  struct mg_str k;
+  while (mg_span(v, &k, &v, ',')) {
+    while (k.len > 0 && k.buf[0] == ' ') k.buf++, k.len--;
+    while (k.len > 0 && k.buf[k.len - 1] == ' ') k.len--;
+    if (k.len == 3 && k.buf[0] == 'u' && k.buf[1] == '=' && k.buf[2] >= '0' &&
+        k.buf[2] <= '7') {
+      s->urgency = (uint8_t) (k.buf[2] - '0');
+    } else if (mg_strcmp(k, mg_str("i")) == 0 ||
+               mg_strcmp(k, mg_str("i=?1")) == 0) {
+      s->incremental = true;
+    }
+  }
+  s->has_prio = true;
+}
+
+// RFC 7540 priority weight, 1..256, maps to urgency 7..0
+static void h2_weight(struct h2_stream *s, unsigned weight) {
+  if (!s->has_prio) s->urgency = (uint8_t) ((256 - weight) * 8 / 256);
+}
+
+static bool h2_is_hop(struct mg_str name) {
+  return mg_strcasecmp(name, mg_str("connection")) == 0 ||
+         mg_strcasecmp(name, mg_str("keep-alive")) == 0 ||
+         mg_strcasecmp(name, mg_str("proxy-connection")) == 0 ||
+         mg_strcasecmp(name, mg_str("transfer-encoding")) == 0 ||
+         mg_strcasecmp(name, mg_str("upgrade")) == 0;
+}
+
+// Get the next "name\0value\0" pair of a decoded header block
+static bool h2_next(struct mg_iobuf *io, size_t *ofs, struct mg_str *name,
+                    struct mg_str *val) {
+  if (*ofs >= io->len) return false;
+  *name = mg_str((char *) io->buf + *ofs);
+  *val = mg_str(name->buf + name->len + 1);
+  *ofs += name->len + val->len + 2;
+  return true;
+}
+
+// Write the request to the stream connection as HTTP/1 text. The important
+// headers go first, as the HTTP/1 parser keeps MG_MAX_HTTP_HEADERS only
+bool mg_to_size_t(struct mg_str str, size_t *val);
+static bool h2_request(struct h2_stream *s, struct mg_iobuf *hdrs, bool end) {
+  struct mg_str k, v, method = {0, 0}, path = {0, 0}, auth = {0, 0};
+  struct mg_iobuf *io = &s->c->recv;
+  size_t i, ofs = 0, cookies = 0;
+  bool has_host = false, has_scheme = false, regular = false;
+  while (h2_next(hdrs, &ofs, &k, &v)) {
+    if (k.len == 0 || memchr(v.buf, '\r', v.len) || memchr(v.buf, '\n', v.len)) {
+      return false;
+    }
+    if (k.buf[0] == ':') {  // Pseudo-headers must go first
+      if (regular) return false;
+      if (mg_strcmp(k, mg_str(":method")) == 0) {
+        method = v;
+      } else if (mg_strcmp(k, mg_str(":path")) == 0) {
+        path = v;
+      } else if (mg_strcmp(k, mg_str(":authority")) == 0) {
+        auth = v;
+      } else if (mg_strcmp(k, mg_str(":scheme")) == 0) {
+        has_scheme = true;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    for (i = 0; i < k.len; i++) {  // Names are lowercase tokens
+      if (k.buf[i] <= ' ' || k.buf[i] >= 127 || k.buf[i] == ':' ||
+          (k.buf[i] >= 'A' && k.buf[i] <= 'Z')) {
+        return false;
+      }
+    }
+    regular = true;
+    if (mg_strcmp(k, mg_str("host")) == 0) has_host = true;
+    if (mg_strcmp(k, mg_str("cookie")) == 0) cookies++;
+    if (mg_strcmp(k, mg_str("priority")) == 0) h2_prio(s, v);
+    if (mg_strcmp(k, mg_str("content-length")) == 0) {
+      if (s->req_len || !mg_to_size_t(v, &s->req_left)) return false;
+      s->req_len = true;
+    }
+  }
+  if (method.len == 0 || path.len == 0 || !has_scheme) return false;
+  if (end && s->req_len && s->req_left > 0) return false;
+  s->is_head = mg_strcmp(method, mg_str("HEAD")) == 0;
+  s->req_chunked = !end && !s->req_len;
+  mg_xprintf(mg_pfn_iobuf, io, "%.*s %.*s HTTP/2.0\r\n", (int) method.len,
+             method.buf, (int) path.len, path.buf);
+  if (auth.len > 0 && !has_host) {
+    mg_xprintf(mg_pfn_iobuf, io, "Host: %.*s\r\n", (int) auth.len, auth.buf);
+  }
+  if (s->req_chunked) {
+    mg_xprintf(mg_pfn_iobuf, io, "Transfer-Encoding: chunked\r\n");
+  }
+  for (i = 0; i < 2; i++) {  // Host and Content-Length first, then the rest
+    for (ofs = 0; h2_next(hdrs, &ofs, &k, &v);) {
+      bool first = mg_strcmp(k, mg_str("host")) == 0 ||
+                   mg_strcmp(k, mg_str("content-length")) == 0;
+      if (k.buf[0] == ':' || first != (i == 0) || h2_is_hop(k)) continue;
+      if (mg_strcmp(k, mg_str("cookie")) == 0 && cookies > 1) continue;
+      mg_xprintf(mg_pfn_iobuf, io, "%.*s: %.*s\r\n", (int) k.len, k.buf,
+                 (int) v.len, v.buf);
+    }
+  }
+  if (cookies > 1) {  // Cookies may come split, join them, RFC 9113 8.2.3
+    const char *sep = "cookie: ";
+    for (ofs = 0; h2_next(hdrs, &ofs, &k, &v);) {
+      if (mg_strcmp(k, mg_str("cookie")) != 0) continue;
+      mg_xprintf(mg_pfn_iobuf, io, "%s%.*s", sep, (int) v.len, v.buf);
+      sep = "; ";
+    }
+    mg_xprintf(mg_pfn_iobuf, io, "\r\n");
+  }
+  mg_xprintf(mg_pfn_iobuf, io, "\r\n");
+  return true;
+}
+
+// A complete header block: a new request, or trailers. Return a connection
+// error code, 0 if none
+static uint32_t h2_block(struct mg_connection *c, struct h2_conn *h) {
+  struct mg_iobuf hdrs = {0, 0, 0, 256, 0};
+  struct h2_stream *s = h2_find(h, h->block_id);
+  uint32_t id = h->block_id, err = 0;
+  bool end = (h->block_flags & H2_END_STREAM) != 0;
+  h->block_id = 0;
+  if (!hp_decode(h, h->block.buf, h->block.len, &hdrs)) {
+    err = H2_COMPRESSION_ERROR;
+  } else if (s != NULL) {  // Trailers, which we do not relay
+    if (!end || s->req_done || (s->req_len && s->req_left > 0)) {
+      h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+    } else {
+      h2_relay(s, NULL, 0, true);
+    }
+  } else if ((id & 1) == 0) {
+    err = H2_PROTOCOL_ERROR;  // Not a client stream
+  } else if (id <= h->last_id || h->is_goaway) {
+    // A stream we have closed, or we are shutting down: ignore
+  } else if (h->nstreams >= MG_HTTP2_MAX_STREAMS ||
+             (s = h2_open(c, h, id)) == NULL) {
+    h->last_id = id;
+    h2_frame32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+  } else {
+    h->last_id = id;
+    if (!h2_request(s, &hdrs, end)) {
+      h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+    } else {
+      if (h->block_weight > 0) h2_weight(s, h->block_weight);
+      h2_relay(s, NULL, 0, end);
+    }
+  }
+  mg_iobuf_free(&hdrs);
+  mg_iobuf_free(&h->block);
+  return err;
+}
+
+// Strip padding. Return false if malformed
+static bool h2_unpad(uint8_t flags, const uint8_t **p, size_t *len) {
+  if (flags & H2_PADDED) {
+    size_t pad = *len > 0 ? **p : 0;
+    if (*len == 0 || pad >= *len) return false;
+    *p += 1, *len -= pad + 1;
+  }
+  return true;
+}
+
+static uint32_t h2_settings(struct mg_connection *c, struct h2_conn *h,
+                            const uint8_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i + 6 <= len; i += 6) {
+    uint16_t k = MG_LOAD_BE16(p + i);
+    uint32_t v = MG_LOAD_BE32(p + i + 2);
+    if (k == 2 && v > 1) return H2_PROTOCOL_ERROR;  // SETTINGS_ENABLE_PUSH
+    if (k == 4) {  // SETTINGS_INITIAL_WINDOW_SIZE, applies to open streams
+      struct h2_stream *s;
+      if (v > 0x7fffffff) return H2_FLOW_CONTROL_ERROR;
+      for (s = h->streams; s != NULL; s = s->next) s->swin += v - h->init_win;
+      h->init_win = v;
+    }
+    if (k == 5 && (v < H2_FRAME_MAX || v > 0xffffff)) {
+      return H2_PROTOCOL_ERROR;  // SETTINGS_MAX_FRAME_SIZE
+    }
+  }
+  h2_frame(c, H2_SETTINGS, H2_END_STREAM, 0, NULL, 0);  // ACK
+  return 0;
+}
+
+static uint32_t h2_window(struct mg_connection *c, struct h2_conn *h,
+                          struct h2_stream *s, uint32_t id, uint32_t inc) {
+  inc &= 0x7fffffff;
+  if (id == 0) {
+    if (inc == 0) return H2_PROTOCOL_ERROR;
+    if ((h->swin += inc) > 0x7fffffff) return H2_FLOW_CONTROL_ERROR;
+  } else if (s != NULL && inc == 0) {
+    h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+  } else if (s != NULL && (s->swin += inc) > 0x7fffffff) {
+    h2_reset(c, h, s, H2_FLOW_CONTROL_ERROR);
+  }
+  return 0;
+}
+
+static uint32_t h2_data(struct mg_connection *c, struct h2_conn *h,
+                        struct h2_stream *s, uint8_t flags, const uint8_t *p,
+                        size_t len) {
+  bool end = (flags & H2_END_STREAM) != 0;
+  size_t n = len;
+  if (len > h->rwin) return H2_FLOW_CONTROL_ERROR;
+  if ((h->rwin -= len) < H2_WINDOW / 2) {  // Credit the connection right away
+    h2_frame32(c, H2_WINDOW_UPDATE, 0, (uint32_t) (H2_WINDOW - h->rwin));
+    h->rwin = H2_WINDOW;
+  }
+  if (!h2_unpad(flags, &p, &n)) return H2_PROTOCOL_ERROR;
+  if (s == NULL || s->req_done) {
+    // We have closed it, or the request is complete: ignore
+  } else if (len > s->rwin) {
+    h2_reset(c, h, s, H2_FLOW_CONTROL_ERROR);
+  } else if (s->req_len && (n > s->req_left || (end && n < s->req_left))) {
+    h2_reset(c, h, s, H2_PROTOCOL_ERROR);  // Does not match Content-Length
+  } else {
+    s->rwin -= len;
+    if (s->req_len) s->req_left -= n;
+    h2_relay(s, p, n, end);
+  }
+  return 0;
+}
+
+// Handle a frame. Return a connection error code, 0 if none
+static uint32_t h2_frame_in(struct mg_connection *c, struct h2_conn *h,
+                            uint8_t type, uint8_t flags, uint32_t id,
+                            const uint8_t *p, size_t len) {
+  struct h2_stream *s = id == 0 ? NULL : h2_find(h, id);
+  MG_VERBOSE(("%lu type %d flags %x id %lu len %lu", c->id, type, flags,
+              (unsigned long) id, (unsigned long) len));
+  if (h->block_id != 0 && (type != H2_CONTINUATION || id != h->block_id)) {
+    return H2_PROTOCOL_ERROR;  // Header blocks must not be interleaved
+  }
+  if (type == H2_DATA) {
+    if (id == 0 || id > h->last_id) return H2_PROTOCOL_ERROR;
+    return h2_data(c, h, s, flags, p, len);
+  } else if (type == H2_HEADERS || type == H2_CONTINUATION) {
+    if (id == 0 || (type == H2_CONTINUATION && h->block_id == 0)) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (type == H2_HEADERS) {
+      if (!h2_unpad(flags, &p, &len)) return H2_PROTOCOL_ERROR;
+      h->block_flags = flags, h->block_weight = 0;
+      if (flags & H2_PRIO) {  // Dependency and weight
+        if (len < 5) return H2_PROTOCOL_ERROR;
+        h->block_weight = p[4] + 1U, p += 5, len -= 5;
+      }
+    }
+    if (h->block.len + len > H2_BLOCK_MAX) return H2_ENHANCE_YOUR_CALM;
+    if (mg_iobuf_add(&h->block, h->block.len, p, len) < len) {
+      return H2_INTERNAL_ERROR;
+    }
+    h->block_id = id;
+    if (flags & H2_END_HEADERS) return h2_block(c, h);
+  } else if (type == H2_PRIORITY) {
+    if (id == 0) return H2_PROTOCOL_ERROR;
+    if (len != 5) return H2_FRAME_SIZE_ERROR;
+    if (s != NULL) h2_weight(s, p[4] + 1U);
+  } else if (type == H2_RST_STREAM) {
+    if (id == 0 || id > h->last_id) return H2_PROTOCOL_ERROR;
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    if (s != NULL) h2_close(h, s);
+  } else if (type == H2_SETTINGS) {
+    if (id != 0) return H2_PROTOCOL_ERROR;
+    if (len % 6 != 0 || ((flags & H2_END_STREAM) && len != 0)) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if ((flags & H2_END_STREAM) == 0) return h2_settings(c, h, p, len);
+  } else if (type == H2_PING) {
+    if (id != 0) return H2_PROTOCOL_ERROR;
+    if (len != 8) return H2_FRAME_SIZE_ERROR;
+    if ((flags & H2_END_STREAM) == 0) h2_frame(c, H2_PING, 1, 0, p, len);
+  } else if (type == H2_GOAWAY) {
+    h->is_goaway = true;  // Finish open streams, then close
+  } else if (type == H2_WINDOW_UPDATE) {
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    return h2_window(c, h, s, id, MG_LOAD_BE32(p));
+  } else if (type == H2_PUSH_PROMISE) {
+    return H2_PROTOCOL_ERROR;  // Clients must not push
+  }
+  return 0;  // Unknown frame types are ignored
+}
+
+// Convert the HTTP/1 response head, if there is one, to a HEADERS frame
+static bool h2_resp_head(struct mg_connection *c, struct h2_stream *s) {
+  struct mg_iobuf *io = &s->c->send, hdrs = {0, 0, 0, 256, 0};
+  int n = mg_http_get_request_len(io->buf, io->len);
+  const char *p = (char *) io->buf, *end = p + (n > 0 ? n : 0);
+  struct mg_str st = {0, 0};
+  size_t i, ofs, cl = 0;
+  uint8_t flags = 0;
+  bool has_cl = false, chunked = false;
+  if (n <= 0) return false;
+  while (p < end && *p != ' ') p++;  // Status line: "HTTP/1.1 200 OK"
+  while (p < end && *p == ' ') p++;
+  st.buf = (char *) p;
+  while (p < end && *p >= '0' && *p <= '9') p++, st.len++;
+  while (p < end && *p != '\n') p++;
+  for (i = 8; i <= 14; i++) {
+    if (mg_strcmp(st, mg_str(s_h2_static[i - 1][1])) == 0) break;
+  }
+  if (i <= 14) {
+    hp_put_int(&hdrs, 0x80, 7, i);
+  } else {
+    hp_put_int(&hdrs, 0, 4, 8);
+    hp_put_str(&hdrs, st, false);
+  }
+  for (p++; p < end;) {  // Header lines
+    struct mg_str k, v;
+    const char *eol = p;
+    while (eol < end && *eol != '\n') eol++;
+    k = mg_str_n(p, (size_t) (eol - p));
+    p = eol + 1;
+    if (k.len > 0 && k.buf[k.len - 1] == '\r') k.len--;
+    if (!mg_span(k, &k, &v, ':')) continue;
+    while (v.len > 0 && (v.buf[0] == ' ' || v.buf[0] == '\t')) v.buf++, v.len--;
+    while (v.len > 0 && (v.buf[v.len - 1] == ' ' || v.buf[v.len - 1] == '\t'))
+      v.len--;
+    if (mg_strcasecmp(k, mg_str("content-length")) == 0) {
+      has_cl = mg_to_size_t(v, &cl);
+    } else if (mg_strcasecmp(k, mg_str("transfer-encoding")) == 0) {
+      chunked = mg_strcasecmp(v, mg_str("chunked")) == 0;
+    }
+    if (!h2_is_hop(k)) hp_put(&hdrs, k, v);
+  }
+  mg_iobuf_del(io, 0, (size_t) n);
+  if (st.len == 3 && st.buf[0] == '1') {
+    // Interim response, the final one follows
+  } else if (s->is_head || mg_strcmp(st, mg_str("204")) == 0 ||
+             mg_strcmp(st, mg_str("304")) == 0 || (has_cl && cl == 0)) {
+    flags = H2_END_STREAM, s->state = H2_RESP_DONE;
+  } else if (has_cl) {
+    s->state = H2_RESP_LEN, s->left = cl;
+  } else {
+    s->state = chunked ? H2_RESP_CHUNKED : H2_RESP_CLOSE, s->left = 0;
+  }
+  for (ofs = 0; ofs == 0 || ofs < hdrs.len; ofs += H2_FRAME_MAX) {
+    size_t len = hdrs.len - ofs > H2_FRAME_MAX ? H2_FRAME_MAX : hdrs.len - ofs;
+    uint8_t f = ofs + len >= hdrs.len ? H2_END_HEADERS : 0;
+    h2_frame(c, ofs == 0 ? H2_HEADERS : H2_CONTINUATION,
+             (uint8_t) (f | (ofs == 0 ? flags : 0)), s->id, hdrs.buf + ofs,
+             len);
+  }
+  mg_iobuf_free(&hdrs);
+  return true;
+}
+
+// Take a chunk header, or the CRLF after chunk data, off the response.
+// Return false if more data is needed
+static bool h2_resp_chunk(struct h2_stream *s, bool *end) {
+  struct mg_iobuf *io = &s->c->send;
+  size_t i = 0, size = 0;
+  if (s->crlf) {
+    if (io->len < 2) return false;
+    mg_iobuf_del(io, 0, 2);
+    s->crlf = false;
+  }
+  if (s->left > 0) return true;
+  while (i < io->len && io->buf[i] != '\n') i++;  // Chunk header: "size\r\n"
+  if (i >= io->len) return false;
+  for (i = 0; i < io->len; i++) {
+    int ch = io->buf[i], d = ch >= '0' && ch <= '9'   ? ch - '0'
+                             : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                             : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+                                                      : -1;
+    if (d < 0) break;
+    size = size * 16 + (size_t) d;
+  }
+  while (io->buf[i] != '\n') i++;
+  if (size == 0) {  // Last chunk, then an empty line. We send no trailers
+    if (io->len < i + 3) return false;
+    i += 2, *end = true;
+  }
+  mg_iobuf_del(io, 0, i + 1);
+  s->left = size;
+  return true;
+}
+
+// Send a DATA frame of the response. Return false if there is nothing to
+// send now
+static bool h2_resp_body(struct mg_connection *c, struct h2_conn *h,
+                         struct h2_stream *s) {
+  struct mg_iobuf *io = &s->c->send;
+  size_t n = io->len;
+  bool end = false;
+  if (s->state == H2_RESP_CHUNKED && !h2_resp_chunk(s, &end)) return false;
+  if (s->state == H2_RESP_CLOSE) {
+    end = n == 0 && (s->c->is_draining || s->c->is_closing);
+  } else if (n > s->left) {
+    n = s->left;
+  }
+  if (n > H2_FRAME_MAX) n = H2_FRAME_MAX;
+  if ((int64_t) n > h->swin) n = h->swin > 0 ? (size_t) h->swin : 0;
+  if ((int64_t) n > s->swin) n = s->swin > 0 ? (size_t) s->swin : 0;
+  if (s->state == H2_RESP_LEN) end = n == s->left;
+  if (n == 0 && !end) return false;
+  h2_frame(c, H2_DATA, end ? H2_END_STREAM : 0, s->id, io->buf, n);
+  mg_iobuf_del(io, 0, n);
+  h->swin -= (int64_t) n, s->swin -= (int64_t) n;
+  if (s->state != H2_RESP_CLOSE) s->left -= n;
+  if (s->state == H2_RESP_CHUNKED && s->left == 0 && n > 0) s->crlf = true;
+  if (end) s->state = H2_RESP_DONE;
+  s->stamp = ++h->stamp;
+  return true;
+}
+
+// Which stream sends first: higher urgency, then, for the same urgency,
+// non-incremental streams one by one, then incremental ones in turn
+static bool h2_before(const struct h2_stream *a, const struct h2_stream *b) {
+  if (a->urgency != b->urgency) return a->urgency < b->urgency;
+  if (a->incremental != b->incremental) return !a->incremental;
+  return a->incremental ? a->stamp < b->stamp : a->id < b->id;
+}
+
+// Move responses from stream connections to the connection
+static void h2_pump(struct mg_connection *c, struct h2_conn *h) {
+  struct h2_stream *s, *next;
+  for (s = h->streams; s != NULL; s = s->next) {
+    size_t used = H2_WINDOW - s->rwin;
+    while (s->state == H2_RESP_HEAD && h2_resp_head(c, s)) continue;
+    if (s->state == H2_RESP_DONE) s->c->send.len = 0;  // E.g. body of HEAD
+    s->is_blocked = s->state == H2_RESP_HEAD || s->state == H2_RESP_DONE;
+    if (s->req_done || s->c->is_full || used < H2_WINDOW / 2) continue;
+    if (s->c->recv.len + H2_WINDOW <= MG_MAX_RECV_SIZE) {  // Credit stream
+      h2_frame32(c, H2_WINDOW_UPDATE, s->id, (uint32_t) used);
+      s->rwin = H2_WINDOW;
+    } else if (s->rwin == 0) {
+      mg_error(s->c, "MG_MAX_RECV_SIZE");
+    }
+  }
+  while (c->send.len < H2_FRAME_MAX) {  // Send DATA, by priority
+    struct h2_stream *best = NULL;
+    for (s = h->streams; s != NULL; s = s->next) {
+      if (!s->is_blocked && (best == NULL || h2_before(s, best))) best = s;
+    }
+    if (best == NULL) break;
+    if (!h2_resp_body(c, h, best)) best->is_blocked = true;
+  }
+  for (s = h->streams; s != NULL; s = next) {
+    next = s->next;
+    if (s->state == H2_RESP_DONE) {
+      // Response is complete. If the request is not, tell to stop sending
+      if (!s->req_done) h2_frame32(c, H2_RST_STREAM, s->id, H2_NO_ERROR);
+      h2_close(h, s);
+    } else if (s->c->is_closing ||
+               (s->c->is_draining && s->c->send.len == 0 &&
+                s->state != H2_RESP_CLOSE)) {
+      h2_reset(c, h, s, H2_INTERNAL_ERROR);  // Gave up on the response
+    }
+  }
+  if (h->nstreams > 0) c->is_polled = 1;
+  if (h->is_goaway && h->nstreams == 0) c->is_draining = 1;
+}
+
+static void h2_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct h2_conn *h = (struct h2_conn *) c->pfn_data;
+  if (ev == MG_EV_READ) {
+    size_t ofs = 0;
+    uint32_t err;
+    while (!c->is_draining && c->recv.len - ofs >= 9) {
+      const uint8_t *p = c->recv.buf + ofs;
+      size_t len = MG_LOAD_BE24(p);
+      if (len > H2_FRAME_MAX) h2_goaway(c, h, H2_FRAME_SIZE_ERROR);
+      if (c->is_draining || c->recv.len - ofs < 9 + len) break;
+      err = h2_frame_in(c, h, p[3], p[4], MG_LOAD_BE32(p + 5) & 0x7fffffff,
+                        p + 9, len);
+      if (err != 0) h2_goaway(c, h, err);
+      ofs += 9 + len;
+    }
+    mg_iobuf_del(&c->recv, 0, c->is_draining ? c->recv.len : ofs);
+    h2_pump(c, h);
+  } else if (ev == MG_EV_POLL || ev == MG_EV_WRITE) {
+    // Stream connections get polled: that is how files are served
+    uint64_t now = ev == MG_EV_POLL ? *(uint64_t *) ev_data : mg_millis();
+    struct h2_stream *s;
+    for (s = h->streams; s != NULL; s = s->next) {
+      mg_call(s->c, MG_EV_POLL, &now);
+    }
+    h2_pump(c, h);
+  } else if (ev == MG_EV_CLOSE) {
+    while (h->streams != NULL) h2_close(h, h->streams);
+    mg_iobuf_free(&h->block);
+    mg_iobuf_free(&h->table);
+    mg_free(h);
+    c->pfn_data = NULL;
+  }
+}
+
+// Switch an accepted HTTP connection to HTTP/2, if it has got the client
+// preface. Return true if it has, or may have: then the HTTP/1 handler waits
+bool mg_http2_accept(struct mg_connection *c) {
+  size_t n = c->recv.len < 24 ? c->recv.len : 24;
+  uint8_t settings[12] = {0, 3, 0, 0, 0, 0,   // SETTINGS_MAX_CONCURRENT_STREAMS
+                          0, 6, 0, 0, 0, 0};  // SETTINGS_MAX_HEADER_LIST_SIZE
+  struct h2_conn *h;
+  if (n == 0 || memcmp(c->recv.buf, H2_PREFACE, n) != 0) return false;
+  if (n < 24) return true;
+  if ((h = (struct h2_conn *) mg_calloc(1, sizeof(*h))) == NULL) {
+    mg_error(c, "OOM");
+    return true;
+  }
+  h->pfn = c->pfn;
+  h->swin = h->init_win = H2_WINDOW;
+  h->rwin = H2_WINDOW;
+  h->table_max = H2_TABLE_MAX;
+  h->table.align = h->block.align = 256;
+  c->pfn = h2_cb, c->pfn_data = h;
+  MG_STORE_BE32(settings + 2, MG_HTTP2_MAX_STREAMS);
+  MG_STORE_BE32(settings + 8, H2_LIST_MAX);
+  h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  mg_iobuf_del(&c->recv, 0, 24);
+  MG_DEBUG(("%lu HTTP/2", c->id));
+  h2_cb(c, MG_EV_READ, NULL);
+  return true;
+}
+#endif
+
+#ifdef MG_ENABLE_LINES
+#line 1 "src/iobuf.c"
+#endif
+
+
+
+
+
+static size_t roundup(size_t size, size_t align) {
+  return align == 0 ? size : (size + align - 1) / align * align;
+}
+
+bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
+  bool ok = true;
+  unsigned char *base = io->buf == NULL ? NULL : io->buf - io->head;
+  new_size = roundup(new_size, io->align);
+  if (new_size == 0) {
+    mg_bzero(base, io->size + io->head);
+    mg_free(base);
+    io->buf = NULL;
+    io->len = io->size = io->head = 0;
+#if MG_IO_REALLOC && !MG_ENABLE_CUSTOM_CALLOC
+  } else if (new_size != io->size && io->head == 0 && io->buf != NULL) {
+    // Opted out of zeroing: realloc() may grow the buffer in place
+    unsigned char *p = (unsigned char *) realloc(io->buf, new_size);
+    if (p != NULL) {
+      if (new_size > io->size) memset(p + io->size, 0, new_size - io->size);
+      if (io->len > new_size) io->len = new_size;
+      io->buf = p;
+      io->size = new_size;
+    } else {
+      ok = false;
+      MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
+    }
+#endif
+  } else if (new_size != io->size) {
+    // NOTE(lsm): do not use realloc here. Use mg_calloc/mg_free only
+    void *p = mg_calloc(1, new_size);
+    if (p != NULL) {
+      size_t len = new_size < io->len ? new_size : io->len;
+      if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
+      mg_bzero(base, io->size + io->head);
+      mg_free(base);
+      io->buf = (unsigned char *) p;
+      io->size = new_size;
+      io->len = len;
+      io->head = 0;
+    } else {
+      ok = false;
+      MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
+    }
+  }
+  return ok;
+}
+
+bool mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
+  io->buf = NULL;
+  io->align = align;
+  io->size = io->len = io->head = 0;
+  return mg_iobuf_resize(io, size);
+}
+
+bool mg_iobuf_reserve(struct mg_iobuf *io, size_t len) {
+  size_t step = io->size, max = MG_IO_GROW_MAX;
+  if (io->len + len <= io->size) return true;
+  if (step > max) step = max;
+  if (step < io->len + len - io->size) step = io->len + len - io->size;
+  return mg_iobuf_resize(io, io->size + step);
+}
+
+size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
+                    size_t len) {
+  size_t gap = ofs > io->len ? ofs - io->len : 0;
+  if (!mg_iobuf_reserve(io, gap + len)) return 0;  // OOM, append nothing
+  if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
+  if (buf != NULL && len > 0) memmove(io->buf + ofs, buf, len);
+  io->len += gap + len;
+  return len;
+}
+
+size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
+  if (ofs > io->len) ofs = io->len;
+  if (ofs + len > io->len) len = io->len - ofs;
+  if (io->buf) memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
+  if (io->buf) mg_bzero(io->buf + io->len - len, len);
+  io->len -= len;
+  if (io->len == 0 && io->head > 0) {  // Empty: rewind to the allocation start
+    io->buf -= io->head, io->size += io->head, io->head = 0;
+  }
+  return len;
+}
+
+size_t mg_iobuf_skip(struct mg_iobuf *io, size_t len) {
+  if (len >= io->len || io->buf == NULL) return mg_iobuf_del(io, 0, len);
+  mg_bzero(io->buf, len);
+  io->buf += len, io->size -= len, io->head += len, io->len -= len;
+  if (io->head > io->size) {  // Over half the allocation is dead: compact
+    unsigned char *base = io->buf - io->head;
+    memmove(base, io->buf, io->len);  // Moves fewer bytes than were skipped
+    mg_bzero(base + io->len, io->head);
+    io->buf = base, io->size += io->head, io->head = 0;
+  }
+  return len;
+}
+
+void mg_iobuf_free(struct mg_iobuf *io) {
+  mg_iobuf_resize(io, 0);
+}
+
+#ifdef MG_ENABLE_LINES
+#line 1 "src/json.c"
+#endif
+
+
+
+
+
+static const char *escapeseq(int esc) {
+  return esc ? "\b\f\n\r\t\\\"" : "bfnrt\\\"";
+}
+
+static char json_esc(int c, int esc) {
+  const char *p, *esc1 = escapeseq(esc), *esc2 = escapeseq(!esc);
+  for (p = esc1; *p != '\0'; p++) {
+    if (*p == c) return esc2[p - esc1];
+  }
+  return 0;
+}
+
+static int mg_pass_string(const char *s, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    if (s[i] == '\\' && i + 1 < len && json_esc(s[i + 1], 1)) {
+      i++;
+    } else if (s[i] == '\0') {
+      return MG_JSON_INVALID;
+    } else if (s[i] == '"') {
+      return i;
+    }
+  }
+  return MG_JSON_INVALID;
+}
+
+static double mg_atod(const char *p, int len, int *numlen) {
+  double d = 0.0;
+  int i = 0, sign = 1;
+
+  // Sign
+  if (i < len && *p == '-') {
+    sign = -1, i++;
+  } else if (i < len && *p == '+') {
+    i++;
+  }
+
+  // Decimal
   for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
     d *= 10.0;
     d += p[i] - '0';
@@ -7264,6 +9631,7 @@ struct mg_connection *mg_modbus_listen(struct mg_mgr *mgr, const char *url,
 
 
 
+
 #define MQTT_CLEAN_SESSION 0x02
 #define MQTT_HAS_WILL 0x04
 #define MQTT_WILL_RETAIN 0x20
@@ -7326,10 +9694,6 @@ static bool mg_send_u16(struct mg_connection *c, uint16_t value) {
   return mg_send(c, &value, sizeof(value));
 }
 
-static bool mg_send_u32(struct mg_connection *c, uint32_t value) {
-  return mg_send(c, &value, sizeof(value));
-}
-
 static uint8_t varint_size(size_t length) {
   uint8_t bytes_needed = 0;
   do {
@@ -7408,49 +9772,46 @@ static size_t get_props_size(struct mg_mqtt_prop *props, size_t count) {
   return size;
 }
 
-static bool mg_send_mqtt_properties(struct mg_connection *c,
-                                    struct mg_mqtt_prop *props, size_t nprops) {
-  size_t total_size = get_properties_length(props, nprops);
-  uint8_t buf_v[4] = {0, 0, 0, 0};
-  uint8_t buf[4] = {0, 0, 0, 0};
-  size_t i, len = encode_varint(buf, total_size);
-
-  if (!mg_send(c, buf, (size_t) len)) return false;
+// Writes properties, without their length, to buf. Returns the end
+static uint8_t *mqtt_props_encode(uint8_t *buf, struct mg_mqtt_prop *props,
+                                  size_t nprops) {
+  size_t i;
   for (i = 0; i < nprops; i++) {
-    if (!mg_send(c, &props[i].id, sizeof(props[i].id))) return false;
-    switch (mqtt_prop_type_by_id(props[i].id)) {
-      case MQTT_PROP_TYPE_STRING_PAIR:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].key.len)) ||
-            !mg_send(c, props[i].key.buf, props[i].key.len) ||
-            !mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_BYTE:
-        if (!mg_send(c, &props[i].iv, sizeof(uint8_t))) return false;
-        break;
-      case MQTT_PROP_TYPE_SHORT:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].iv))) return false;
-        break;
-      case MQTT_PROP_TYPE_INT:
-        if (!mg_send_u32(c, mg_htonl((uint32_t) props[i].iv))) return false;
-        break;
-      case MQTT_PROP_TYPE_STRING:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_BINARY_DATA:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_VARIABLE_INT:
-        len = encode_varint(buf_v, props[i].iv);
-        if (!mg_send(c, buf_v, (size_t) len)) return false;
-        break;
+    struct mg_mqtt_prop *p = &props[i];
+    int type = mqtt_prop_type_by_id(p->id);
+    if (type < 0) break;  // get_properties_length() stops there, too
+    *buf++ = p->id;
+    if (type == MQTT_PROP_TYPE_STRING_PAIR) {
+      *buf++ = (uint8_t) (p->key.len >> 8), *buf++ = (uint8_t) p->key.len;
+      if (p->key.len > 0) memcpy(buf, p->key.buf, p->key.len);
+      buf += p->key.len;
+    }
+    if (type == MQTT_PROP_TYPE_STRING_PAIR || type == MQTT_PROP_TYPE_STRING ||
+        type == MQTT_PROP_TYPE_BINARY_DATA) {
+      *buf++ = (uint8_t) (p->val.len >> 8), *buf++ = (uint8_t) p->val.len;
+      if (p->val.len > 0) memcpy(buf, p->val.buf, p->val.len);
+      buf += p->val.len;
+    } else if (type == MQTT_PROP_TYPE_VARIABLE_INT) {
+      buf += encode_varint(buf, p->iv);
+    } else if (type == MQTT_PROP_TYPE_INT) {
+      *buf++ = (uint8_t) (p->iv >> 24), *buf++ = (uint8_t) (p->iv >> 16);
+      *buf++ = (uint8_t) (p->iv >> 8), *buf++ = (uint8_t) p->iv;
+    } else if (type == MQTT_PROP_TYPE_SHORT) {
+      *buf++ = (uint8_t) (p->iv >> 8), *buf++ = (uint8_t) p->iv;
+    } else if (type == MQTT_PROP_TYPE_BYTE) {
+      *buf++ = (uint8_t) p->iv;
     }
   }
+  return buf;
+}
+
+static bool mg_send_mqtt_properties(struct mg_connection *c,
+                                    struct mg_mqtt_prop *props, size_t nprops) {
+  size_t ofs = c->send.len, len = get_properties_length(props, nprops);
+  uint8_t *p;
+  if (!mg_send(c, NULL, varint_size(len) + len)) return false;
+  p = c->send.buf + ofs;
+  mqtt_props_encode(p + encode_varint(p, len), props, nprops);
   return true;
 }
 
@@ -7600,40 +9961,374 @@ fail:
   mg_error(c, "OOM");
 }
 
-uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts) {
-  uint16_t id = opts->retransmit_id;
-  uint8_t flags = (uint8_t) (((opts->qos & 3) << 1) | (opts->retain ? 1 : 0));
-  size_t len = 2 + opts->topic.len + opts->message.len;
-  MG_DEBUG(("%lu [%.*s] <- [%.*s%c", c->id, (int) opts->topic.len,
-            (char *) opts->topic.buf,
-            (int) (opts->message.len <= 10 ? opts->message.len : 10),
-            (char *) opts->message.buf, opts->message.len <= 10 ? ']' : ' '));
-  if (opts->qos > 0) len += 2;
-  if (c->is_mqtt5) len += get_props_size(opts->props, opts->num_props);
-
-  if (opts->qos > 0 && id != 0) flags |= 1 << 3;
-  if (!mqtt_send_header(c, MQTT_CMD_PUBLISH, flags, (uint32_t) len) ||
-      !mg_send_u16(c, mg_htons((uint16_t) opts->topic.len)) ||
-      !mg_send(c, opts->topic.buf, opts->topic.len))
-    goto fail;
-  if (opts->qos > 0) {  // need to send 'id' field
-    if (id == 0) {      // generate new one if not resending
-      if (++c->mgr->mqtt_id == 0) ++c->mgr->mqtt_id;
-      id = c->mgr->mqtt_id;
+// Session: QoS 1/2 PUBLISHes we sent, in order, until they are acknowledged
+#define MQTT_SMSG_SENT 1  // In flight on the current connection
+#define MQTT_SMSG_DUP 2   // Sent before, resend with DUP
+#define MQTT_SMSG_REL 4   // PUBREC received, PUBREL sent
+
+struct mqtt_smsg {
+  struct mqtt_smsg *next;
+  uint64_t sent_ms;  // When it was last sent
+  size_t len;        // PUBLISH packet length, the packet follows
+  uint16_t id;
+  uint8_t flags;  // MQTT_SMSG_*
+};
+
+struct mqtt_client {  // Client connection state, in c->pfn_data
+  struct mg_mqtt_session *session;
+  uint16_t alias_max;  // Server's Topic Alias Maximum, capped
+  uint16_t num_aliases;
+  struct mg_str aliases[MG_MQTT_TOPIC_ALIASES];  // Topic of alias i + 1
+};
+
+static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data);
+
+static struct mqtt_client *mqtt_client(struct mg_connection *c) {
+  return c->is_client && c->pfn == mqtt_cb ? (struct mqtt_client *) c->pfn_data
+                                           : NULL;
+}
+
+static struct mg_mqtt_session *mqtt_session(struct mg_connection *c) {
+  struct mqtt_client *cl = mqtt_client(c);
+  return cl == NULL ? NULL : cl->session;
+}
+
+static void mqtt_client_free(struct mg_connection *c) {
+  struct mqtt_client *cl = mqtt_client(c);
+  size_t i;
+  if (cl == NULL) return;
+  for (i = 0; i < cl->num_aliases; i++) mg_free((void *) cl->aliases[i].buf);
+  mg_free(cl);
+  c->pfn_data = NULL;
+}
+
+// Returns the topic alias to use, or 0. Sets *known if the server knows it,
+// so that the topic can be omitted. Topics get aliases first come, first
+// served, until the server's limit
+static uint16_t mqtt_alias(struct mqtt_client *cl, struct mg_str topic,
+                           bool *known) {
+  uint16_t i;
+  *known = false;
+  if (cl == NULL || topic.len <= 3) return 0;  // Alias takes 3 bytes
+  for (i = 0; i < cl->num_aliases; i++) {
+    if (mg_strcmp(cl->aliases[i], topic) == 0) {
+      *known = true;
+      return (uint16_t) (i + 1);
     }
-    if (!mg_send_u16(c, mg_htons(id))) goto fail;
   }
+  if (cl->num_aliases >= cl->alias_max) return 0;
+  cl->aliases[i] = mg_strdup(topic);
+  if (cl->aliases[i].buf == NULL) return 0;
+  return ++cl->num_aliases;
+}
 
-  if (c->is_mqtt5 && !mg_send_mqtt_properties(c, opts->props, opts->num_props))
-    goto fail;
+static struct mqtt_smsg *mqtt_smsg(struct mg_mqtt_session *s, uint16_t id) {
+  struct mqtt_smsg *m = (struct mqtt_smsg *) s->head;
+  while (m != NULL && m->id != id) m = m->next;
+  return m;
+}
 
-  if (opts->message.len > 0 &&
-      !mg_send(c, opts->message.buf, opts->message.len))
-    goto fail;
-  return id;
+static void mqtt_count(struct mg_mqtt_session *s) {
+  struct mqtt_smsg *m;
+  s->num_inflight = s->num_queued = 0;
+  for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+    if (m->flags & MQTT_SMSG_SENT) {
+      s->num_inflight++;
+    } else {
+      s->num_queued++;
+    }
+  }
+}
 
-fail:
-  mg_error(c, "OOM");
+static void mqtt_resend(struct mg_connection *c, struct mqtt_smsg *m) {
+  uint8_t *pkt = (uint8_t *) (m + 1);
+  bool ok;
+  if (m->flags & MQTT_SMSG_REL) {
+    uint16_t id = mg_htons(m->id);
+    ok = mqtt_send_header(c, MQTT_CMD_PUBREL, 2, sizeof(id)) &&
+         mg_send(c, &id, sizeof(id));
+  } else {
+    size_t ofs = c->send.len;
+    ok = mg_send(c, pkt, m->len);
+    if (ok && (m->flags & MQTT_SMSG_DUP)) c->send.buf[ofs] |= 8;  // DUP
+  }
+  if (!ok) mg_error(c, "OOM");
+  m->flags |= MQTT_SMSG_SENT | MQTT_SMSG_DUP;
+  m->sent_ms = mg_millis();
+}
+
+// Sends queued messages while the in-flight window has room
+static void mqtt_pump(struct mg_mqtt_session *s) {
+  struct mqtt_smsg *m;
+  size_t window = s->receive_max > 0 ? s->receive_max : MG_MQTT_INFLIGHT;
+  if (s->server_max > 0 && s->server_max < window) window = s->server_max;
+  mqtt_count(s);
+  for (m = (struct mqtt_smsg *) s->head; s->online && m != NULL; m = m->next) {
+    if (m->flags & MQTT_SMSG_SENT) continue;
+    if (s->num_inflight >= window) break;
+    mqtt_resend(s->c, m);
+    s->num_inflight++, s->num_queued--;
+  }
+}
+
+// File: "MQS1", then for each message: ID, flags, length, PUBLISH packet
+static void mqtt_save(struct mg_mqtt_session *s) {
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  struct mqtt_smsg *m;
+  bool ok = mg_iobuf_add(&io, 0, "MQS1", 4) > 0;
+  for (m = (struct mqtt_smsg *) s->head; ok && m != NULL; m = m->next) {
+    uint8_t hdr[7];
+    hdr[0] = (uint8_t) (m->id >> 8), hdr[1] = (uint8_t) m->id;
+    hdr[2] = (uint8_t) (m->flags & MQTT_SMSG_REL);
+    hdr[3] = (uint8_t) (m->len >> 24), hdr[4] = (uint8_t) (m->len >> 16);
+    hdr[5] = (uint8_t) (m->len >> 8), hdr[6] = (uint8_t) m->len;
+    if ((m->flags & MQTT_SMSG_DUP) != 0) hdr[2] |= MQTT_SMSG_DUP;
+    ok = mg_iobuf_add(&io, io.len, hdr, sizeof(hdr)) > 0 &&
+         mg_iobuf_add(&io, io.len, m + 1, m->len) > 0;
+  }
+  if (ok) ok = mg_file_write(s->fs, s->path, io.buf, io.len);
+  if (!ok) MG_ERROR(("%s: cannot save MQTT session", s->path));
+  s->dirty = !ok, s->saved_ms = mg_millis();
+  mg_iobuf_free(&io);
+}
+
+// Appends a message of len bytes, copied from pkt unless it's NULL
+static struct mqtt_smsg *mqtt_add(struct mg_mqtt_session *s, const void *pkt,
+                                  size_t len, uint16_t id, uint8_t flags) {
+  struct mqtt_smsg *m = (struct mqtt_smsg *) mg_calloc(1, sizeof(*m) + len);
+  if (m == NULL) return NULL;
+  if (pkt != NULL) memcpy(m + 1, pkt, len);
+  m->len = len, m->id = id, m->flags = flags;
+  if (s->tail != NULL) {
+    ((struct mqtt_smsg *) s->tail)->next = m;
+  } else {
+    s->head = m;
+  }
+  s->tail = m;
+  s->dirty = s->fs != NULL;
+  return m;
+}
+
+static void mqtt_load(struct mg_mqtt_session *s) {
+  struct mg_str data = mg_file_read(s->fs, s->path);
+  const uint8_t *p = (uint8_t *) data.buf, *end = p + data.len;
+  if (data.len >= 4 && memcmp(p, "MQS1", 4) == 0) {
+    for (p += 4; end - p >= 7;) {
+      uint16_t id = (uint16_t) ((p[0] << 8) | p[1]);
+      size_t len = ((size_t) p[3] << 24) | ((size_t) p[4] << 16) |
+                   ((size_t) p[5] << 8) | p[6];
+      uint8_t flags = (uint8_t) (p[2] & (MQTT_SMSG_DUP | MQTT_SMSG_REL));
+      if ((size_t) (end - p - 7) < len || !mqtt_add(s, p + 7, len, id, flags))
+        break;
+      p += 7 + len;
+    }
+  }
+  mg_free((void *) data.buf);
+  s->loaded = true, s->dirty = false;
+  mqtt_count(s);
+  MG_DEBUG(("%s: %lu unacknowledged messages", s->path,
+            (unsigned long) s->num_queued));
+}
+
+void mg_mqtt_session_free(struct mg_mqtt_session *s) {
+  if (s->dirty) mqtt_save(s);
+  while (s->head != NULL) {
+    struct mqtt_smsg *m = (struct mqtt_smsg *) s->head;
+    s->head = m->next;
+    mg_free(m);
+  }
+  s->tail = NULL;
+  if (s->c != NULL && mqtt_client(s->c) != NULL) {
+    mqtt_client(s->c)->session = NULL;
+  }
+  s->c = NULL, s->online = s->loaded = s->dirty = false;
+  s->num_inflight = s->num_queued = 0;
+}
+
+// Tracks acknowledgements of our PUBLISHes
+static void mqtt_session_cmd(struct mg_mqtt_session *s,
+                             struct mg_mqtt_message *mm) {
+  struct mqtt_smsg *m = mqtt_smsg(s, mm->id), *prev = NULL, **p;
+  if (mm->cmd == MQTT_CMD_CONNACK && mm->ack == 0) {
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      m->flags &= (uint8_t) ~MQTT_SMSG_SENT;  // Resend all, 4.4
+    }
+    s->online = true;
+    mqtt_pump(s);
+  } else if (m == NULL) {
+    // Not ours
+  } else if (mm->cmd == MQTT_CMD_PUBREC) {
+    m->flags |= MQTT_SMSG_REL;  // mqtt_cb() sends PUBREL
+    s->dirty = s->fs != NULL;
+  } else if (mm->cmd == MQTT_CMD_PUBACK || mm->cmd == MQTT_CMD_PUBCOMP) {
+    for (p = (struct mqtt_smsg **) &s->head; *p != m; p = &(*p)->next) {
+      prev = *p;
+    }
+    *p = m->next;
+    if (s->tail == m) s->tail = prev;
+    mg_free(m);
+    s->dirty = s->fs != NULL;
+    mqtt_pump(s);
+  }
+}
+
+// Reads the server's limits from MQTT5 CONNACK properties
+static void mqtt_connack(struct mqtt_client *cl, struct mg_mqtt_message *mm) {
+  struct mg_mqtt_message tmp = *mm;
+  struct mg_mqtt_prop prop;
+  uint32_t n = 0;
+  size_t ofs = 0, len;
+  if (cl->session != NULL) cl->session->server_max = 0;
+  if (mm->dgram.len > 4 &&
+      (len = decode_varint((uint8_t *) mm->dgram.buf + 4, mm->dgram.len - 4,
+                           &n)) > 0 &&
+      4 + len + n <= mm->dgram.len) {
+    tmp.props_start = 4 + len, tmp.props_size = n;
+    while ((ofs = mg_mqtt_next_prop(&tmp, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_RECEIVE_MAXIMUM && cl->session != NULL) {
+        cl->session->server_max = (uint16_t) prop.iv;
+      } else if (prop.id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM) {
+        cl->alias_max = (uint16_t) (prop.iv < MG_MQTT_TOPIC_ALIASES
+                                        ? prop.iv
+                                        : MG_MQTT_TOPIC_ALIASES);
+      }
+    }
+  }
+}
+
+static void mqtt_session_ev(struct mg_mqtt_session *s, int ev) {
+  if (ev == MG_EV_POLL && s->online && s->retransmit_ms > 0 &&
+      !s->c->is_mqtt5) {  // MQTT5 resends only on reconnect, 4.4
+    uint64_t now = mg_millis();
+    struct mqtt_smsg *m;
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      if (!(m->flags & MQTT_SMSG_SENT)) break;
+      if (now - m->sent_ms >= s->retransmit_ms) mqtt_resend(s->c, m);
+    }
+  }
+  if (ev == MG_EV_CLOSE) {
+    struct mqtt_smsg *m;
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      m->flags &= (uint8_t) ~MQTT_SMSG_SENT;
+    }
+    mqtt_count(s);
+    s->c = NULL, s->online = false;
+  }
+  // Changes are batched: the file is rewritten at most every MG_MQTT_SAVE_MS,
+  // and when the connection closes
+  if (s->dirty && (ev == MG_EV_CLOSE ||
+                   (ev == MG_EV_POLL &&
+                    mg_millis() - s->saved_ms >= MG_MQTT_SAVE_MS))) {
+    mqtt_save(s);
+  }
+}
+
+// Returns the longest PUBLISH that o can be encoded to
+static size_t mqtt_pub_max(bool v5, const struct mg_mqtt_opts *o) {
+  size_t n = 1 + 4 + 2 + o->topic.len + 2 + o->message.len;
+  if (v5) n += 4 + get_properties_length(o->props, o->num_props) + 3;
+  return n;
+}
+
+// Writes a PUBLISH to buf, with topic, which may be empty if alias is set.
+// Returns its length
+static size_t mqtt_pub_encode(uint8_t *buf, bool v5,
+                              const struct mg_mqtt_opts *o,
+                              struct mg_str topic, uint16_t alias,
+                              uint16_t id) {
+  uint8_t *p = buf, qos = (uint8_t) (o->qos & 3);
+  size_t plen = v5 ? get_properties_length(o->props, o->num_props) : 0,
+         n = 2 + topic.len + (qos > 0 ? 2U : 0U) + o->message.len;
+  if (alias > 0) plen += 3;
+  if (v5) n += varint_size(plen) + plen;
+  *p++ = (uint8_t) ((MQTT_CMD_PUBLISH << 4) | (qos << 1) |
+                    (qos > 0 && o->retransmit_id != 0 ? 8 : 0) |
+                    (o->retain ? 1 : 0));
+  p += encode_varint(p, n);
+  *p++ = (uint8_t) (topic.len >> 8), *p++ = (uint8_t) topic.len;
+  if (topic.len > 0) memcpy(p, topic.buf, topic.len);
+  p += topic.len;
+  if (qos > 0) *p++ = (uint8_t) (id >> 8), *p++ = (uint8_t) id;
+  if (v5) {
+    p += encode_varint(p, plen);
+    p = mqtt_props_encode(p, o->props, o->num_props);
+    if (alias > 0) {
+      *p++ = MQTT_PROP_TOPIC_ALIAS;
+      *p++ = (uint8_t) (alias >> 8), *p++ = (uint8_t) alias;
+    }
+  }
+  if (o->message.len > 0) memcpy(p, o->message.buf, o->message.len);
+  return (size_t) (p - buf) + o->message.len;
+}
+
+// Session keeps new QoS 1/2 messages, and sends them on its own
+static bool mqtt_kept(struct mg_mqtt_session *s, const struct mg_mqtt_opts *o) {
+  return s != NULL && (o->qos & 3) > 0 && o->retransmit_id == 0;
+}
+
+static bool mqtt_has_alias(const struct mg_mqtt_opts *o) {
+  size_t i;
+  for (i = 0; i < o->num_props; i++) {
+    if (o->props[i].id == MQTT_PROP_TOPIC_ALIAS) return true;
+  }
+  return false;
+}
+
+size_t mg_mqtt_pub_batch(struct mg_connection *c,
+                         const struct mg_mqtt_opts *opts, size_t n,
+                         uint16_t *ids) {
+  struct mqtt_client *cl = mqtt_client(c);
+  struct mg_mqtt_session *s = cl == NULL ? NULL : cl->session;
+  size_t i, total = 0, used = 0, ofs = c->send.len, done = 0;
+  bool v5 = c->is_mqtt5;
+  for (i = 0; i < n; i++) {
+    if (!mqtt_kept(s, &opts[i])) total += mqtt_pub_max(v5, &opts[i]);
+  }
+  if (total > 0 && !mg_send(c, NULL, total)) {  // Room for all, at once
+    mg_error(c, "OOM");
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    const struct mg_mqtt_opts *o = &opts[i];
+    uint16_t id = o->retransmit_id, alias = 0;
+    bool known = false;
+    MG_DEBUG(("%lu [%.*s] <- [%.*s%c", c->id, (int) o->topic.len,
+              (char *) o->topic.buf,
+              (int) (o->message.len <= 10 ? o->message.len : 10),
+              (char *) o->message.buf, o->message.len <= 10 ? ']' : ' '));
+    if ((o->qos & 3) > 0 && id == 0) {  // Generate a new one if not resending
+      do {
+        if (++c->mgr->mqtt_id == 0) ++c->mgr->mqtt_id;
+      } while (s != NULL && mqtt_smsg(s, c->mgr->mqtt_id) != NULL);
+      id = c->mgr->mqtt_id;
+    }
+    if (mqtt_kept(s, o)) {  // Full topic: may be resent on another connection
+      struct mqtt_smsg *m = s->num_queued >= MG_MQTT_QUEUE_MAX
+                                ? NULL
+                                : mqtt_add(s, NULL, mqtt_pub_max(v5, o), id, 0);
+      if (m == NULL) {
+        MG_ERROR(("%lu MQTT session full", c->id));
+        id = 0;
+      } else {
+        m->len = mqtt_pub_encode((uint8_t *) (m + 1), v5, o, o->topic, 0, id);
+        s->num_queued++, done++;
+      }
+    } else {
+      if (v5 && !mqtt_has_alias(o)) alias = mqtt_alias(cl, o->topic, &known);
+      used += mqtt_pub_encode(c->send.buf + ofs + used, v5, o,
+                              known ? mg_str_n("", 0) : o->topic, alias, id);
+      done++;
+    }
+    if (ids != NULL) ids[i] = id;
+  }
+  if (total > 0) c->send.len = ofs + used;
+  if (s != NULL) mqtt_pump(s);
+  return done;
+}
+
+uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts) {
+  uint16_t id = 0;
+  mg_mqtt_pub_batch(c, opts, 1, &id);
   return id;
 }
 
@@ -7721,7 +10416,7 @@ int mg_mqtt_parse(const uint8_t *buf, size_t len, uint8_t version,
         p += 2;
       }
       if (p > end) return MQTT_MALFORMED;
-      if (version == 5 && p + 2 < end) {
+      if (version == 5 && p < end) {
         len_len = (uint32_t) decode_varint(p, (size_t) (end - p), &tmp);
         if (!len_len) return MQTT_MALFORMED;
         m->props_size = (size_t) tmp;
@@ -7739,6 +10434,9 @@ int mg_mqtt_parse(const uint8_t *buf, size_t len, uint8_t version,
 }
 
 static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct mg_mqtt_session *s = mqtt_session(c);
+  if (s != NULL) mqtt_session_ev(s, ev);
+  if (ev == MG_EV_CLOSE) mqtt_client_free(c);
   if (ev == MG_EV_READ) {
     for (;;) {
       uint8_t version = c->is_mqtt5 ? 5 : 4;
@@ -7751,6 +10449,10 @@ static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data) {
       } else if (rc == MQTT_OK) {
         MG_VERBOSE(("%lu MQTT CMD %d len %d [%.*s]", c->id, mm.cmd,
                     (int) mm.dgram.len, (int) mm.data.len, mm.data.buf));
+        if (mm.cmd == MQTT_CMD_CONNACK && c->is_mqtt5 && mqtt_client(c)) {
+          mqtt_connack(mqtt_client(c), &mm);
+        }
+        if ((s = mqtt_session(c)) != NULL) mqtt_session_cmd(s, &mm);
         switch (mm.cmd) {
           case MQTT_CMD_CONNACK:
             mg_call(c, MG_EV_MQTT_OPEN, &mm.ack);
@@ -7849,7 +10551,23 @@ struct mg_connection *mg_mqtt_connect(struct mg_mgr *mgr, const char *url,
       mg_connect_svc(mgr, url, fn, fn_data, mqtt_cb, NULL);
   if (c != NULL) {
     struct mg_mqtt_opts empty;
+    struct mg_mqtt_session *s = opts == NULL ? NULL : opts->session;
+    struct mqtt_client *cl = NULL;
     memset(&empty, 0, sizeof(empty));
+    if ((s != NULL || (opts != NULL && opts->version == 5)) &&
+        (cl = (struct mqtt_client *) mg_calloc(1, sizeof(*cl))) == NULL) {
+      mg_error(c, "OOM");
+      return c;
+    }
+    c->pfn_data = cl;
+    if (s != NULL) {
+      if (!s->loaded && s->fs != NULL) mqtt_load(s);
+      if (s->c != NULL && mqtt_client(s->c) != NULL) {
+        mqtt_client(s->c)->session = NULL;
+      }
+      s->c = c, s->online = false, s->loaded = true;
+      cl->session = s, c->is_polled = 1;
+    }
     mg_mqtt_login(c, opts == NULL ? &empty : opts);
   }
   return c;
@@ -7862,6 +10580,980 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+#if MG_ENABLE_MQTT_BROKER
+// Broker. Topic trie nodes are found by (parent, level) in one hash table,
+// so a lookup costs the same with 10 or 10000 siblings. A PUBLISH is encoded
+// once, and all receivers reference it with mg_send_ref()
+
+struct brk_hent {  // Hash table entry
+  struct brk_hent *next;
+  size_t hash;
+};
+
+struct brk_htab {
+  struct brk_hent **tab;
+  size_t size, len;
+};
+
+struct brk_msg {        // PUBLISH packet with QoS 0, no retain, for MQTT 3.1.1
+  size_t refs;          // Holders: retain, queues, in-flight slots, sends
+  size_t len;           // Packet length. The packet follows this struct
+  size_t tofs, pofs;    // Offsets of the topic length and of the payload
+  uint8_t qos;          // QoS it was published with
+};
+
+struct brk_node {
+  struct brk_hent h;                              // In nodes table
+  struct brk_node *parent, *child, *prev, *next;  // Trie, list of siblings
+  struct brk_sub *subs;                           // Filter's subscriptions
+  struct brk_msg *retained;                       // Topic's retained message
+  size_t len;                                     // Level length, level follows
+};
+
+struct brk_sub {
+  struct brk_sub *prev, *next;  // List of node->subs
+  struct brk_sub *snext;        // List of session->subs
+  struct brk_node *node;
+  struct brk_session *s;
+  uint8_t opts;  // Maximum QoS and MQTT5 options, as in SUBSCRIBE
+  bool fresh;    // Added by the SUBSCRIBE being handled
+};
+
+struct brk_slot {       // Outbound QoS 1/2 PUBLISH awaiting acknowledgement
+  struct brk_msg *msg;  // NULL if the slot is free
+  uint16_t id;
+  uint8_t qos;
+  bool retain;
+  bool released;  // QoS 2: PUBREC received, PUBREL sent
+};
+
+struct brk_queued {  // QoS 1/2 message waiting for a free slot
+  struct brk_queued *next;
+  struct brk_msg *msg;
+  uint8_t qos;
+  bool retain;
+};
+
+struct brk_session {
+  struct brk_hent h;            // In clients table, by client ID
+  struct mg_mqtt_broker *b;
+  struct mg_connection *c;      // NULL when offline
+  struct brk_sub *subs;
+  struct brk_queued *head, *tail;
+  size_t queued;
+  struct brk_slot out[MG_MQTT_INFLIGHT];
+  uint16_t in[MG_MQTT_INFLIGHT];  // Inbound QoS 2 IDs awaiting PUBREL
+  uint16_t next_id, max_out;      // Last packet ID, client's receive maximum
+  struct mg_str id;               // Client ID, set by CONNECT
+  struct brk_msg *will;
+  bool will_retain, connected, persistent;
+  uint32_t will_delay;    // MQTT5 Will Delay Interval, seconds
+  uint64_t will_at;       // Offline: when to send a delayed will
+  uint16_t keepalive;     // Seconds, 0 for none
+  uint32_t expiry;        // Session Expiry Interval, seconds, or BRK_NEVER
+  uint64_t seen, expire;  // Last packet time; offline session's end, or 0
+  struct brk_session *fnext;  // Fan-out: next receiver
+  unsigned long gen;          // Fan-out: publish this session is listed for
+  uint8_t fopts;              // Fan-out: highest QoS, Retain As Published
+};
+
+struct brk_priv {
+  struct brk_node root;
+  struct brk_htab nodes, clients;
+  unsigned long gen;
+  uint64_t sweep;  // Next time to look for expired sessions
+};
+
+#define BRK_NEVER 0xffffffffU  // Session Expiry Interval: never expires
+
+static size_t brk_hash(const void *parent, struct mg_str s) {
+  size_t i, h = (size_t) parent ^ 2166136261U;  // FNV-1a
+  for (i = 0; i < s.len; i++) h = (h ^ (uint8_t) s.buf[i]) * 16777619U;
+  return h;
+}
+
+static bool brk_hadd(struct brk_htab *t, struct brk_hent *e) {
+  if (t->len >= t->size) {  // Grow, or keep chaining if that fails
+    size_t i, size = t->size == 0 ? 64 : t->size * 2;
+    struct brk_hent **tab =
+        (struct brk_hent **) mg_calloc(size, sizeof(*tab));
+    if (tab == NULL && t->tab == NULL) return false;
+    for (i = 0; tab != NULL && i < t->size; i++) {
+      while (t->tab[i] != NULL) {
+        struct brk_hent *x = t->tab[i];
+        t->tab[i] = x->next;
+        x->next = tab[x->hash % size], tab[x->hash % size] = x;
+      }
+    }
+    if (tab != NULL) mg_free(t->tab), t->tab = tab, t->size = size;
+  }
+  e->next = t->tab[e->hash % t->size], t->tab[e->hash % t->size] = e;
+  t->len++;
+  return true;
+}
+
+static void brk_hdel(struct brk_htab *t, struct brk_hent *e) {
+  struct brk_hent **p = &t->tab[e->hash % t->size];
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  t->len--;
+}
+
+static struct brk_priv *brk_priv(struct mg_mqtt_broker *b) {
+  if (b->priv == NULL) b->priv = mg_calloc(1, sizeof(struct brk_priv));
+  return (struct brk_priv *) b->priv;
+}
+
+// Returns the child of n for a topic level, creates it if add is true
+static struct brk_node *brk_child(struct brk_priv *p, struct brk_node *n,
+                                  struct mg_str level, bool add) {
+  size_t hash = brk_hash(n, level);
+  struct brk_hent *e =
+      p->nodes.size == 0 ? NULL : p->nodes.tab[hash % p->nodes.size];
+  struct brk_node *c;
+  for (; e != NULL; e = e->next) {
+    c = (struct brk_node *) e;
+    if (e->hash == hash && c->parent == n && c->len == level.len &&
+        memcmp(c + 1, level.buf, level.len) == 0)
+      return c;
+  }
+  if (!add) return NULL;
+  if ((c = (struct brk_node *) mg_calloc(1, sizeof(*c) + level.len)) == NULL)
+    return NULL;
+  c->h.hash = hash, c->parent = n, c->len = level.len;
+  if (level.len > 0) memcpy(c + 1, level.buf, level.len);
+  if (!brk_hadd(&p->nodes, &c->h)) {
+    mg_free(c);
+    return NULL;
+  }
+  if ((c->next = n->child) != NULL) c->next->prev = c;
+  n->child = c;
+  return c;
+}
+
+// Returns the node of a topic or a filter, creates it if add is true
+static struct brk_node *brk_node(struct brk_priv *p, struct mg_str t,
+                                 bool add) {
+  struct brk_node *n = &p->root;
+  size_t i = 0, j;
+  for (;;) {
+    for (j = i; j < t.len && t.buf[j] != '/'; j++) (void) 0;
+    n = brk_child(p, n, mg_str_n(t.buf + i, j - i), add);
+    if (n == NULL || j >= t.len) return n;
+    i = j + 1;
+  }
+}
+
+// Frees n and its ancestors while they hold nothing
+static void brk_prune(struct brk_priv *p, struct brk_node *n) {
+  while (n != &p->root && n->subs == NULL && n->retained == NULL &&
+         n->child == NULL) {
+    struct brk_node *parent = n->parent;
+    if (n->prev != NULL) {
+      n->prev->next = n->next;
+    } else {
+      parent->child = n->next;
+    }
+    if (n->next != NULL) n->next->prev = n->prev;
+    brk_hdel(&p->nodes, &n->h);
+    mg_free(n);
+    n = parent;
+  }
+}
+
+// Topics can't have wildcards. In filters, + is a whole level, # the last one
+static bool brk_valid(struct mg_str t, bool filter) {
+  size_t i, levels = 1;
+  if (t.len == 0) return false;
+  for (i = 0; i < t.len; i++) {
+    char ch = t.buf[i];
+    if (ch == '/') {
+      levels++;
+    } else if (ch == '+' || ch == '#') {
+      if (!filter || (i > 0 && t.buf[i - 1] != '/')) return false;
+      if (ch == '+' && i + 1 < t.len && t.buf[i + 1] != '/') return false;
+      if (ch == '#' && i + 1 < t.len) return false;
+    } else if (ch == '\0') {
+      return false;
+    }
+  }
+  return levels <= MG_MQTT_MAX_LEVELS;
+}
+
+static struct brk_msg *brk_msg(struct mg_str topic, struct mg_str data,
+                               uint8_t qos) {
+  size_t n = 2 + topic.len + data.len, hlen = 1 + (size_t) varint_size(n);
+  struct brk_msg *m = (struct brk_msg *) mg_calloc(1, sizeof(*m) + hlen + n);
+  uint8_t *buf = (uint8_t *) (m + 1);
+  if (m == NULL) return NULL;
+  buf[0] = MQTT_CMD_PUBLISH << 4;
+  encode_varint(buf + 1, n);
+  buf[hlen] = (uint8_t) (topic.len >> 8), buf[hlen + 1] = (uint8_t) topic.len;
+  memcpy(buf + hlen + 2, topic.buf, topic.len);
+  if (data.len > 0) memcpy(buf + hlen + 2 + topic.len, data.buf, data.len);
+  m->refs = 1, m->len = hlen + n, m->qos = qos;
+  m->tofs = hlen, m->pofs = hlen + 2 + topic.len;
+  return m;
+}
+
+static void brk_unref(void *arg) {
+  struct brk_msg *m = (struct brk_msg *) arg;
+  if (m != NULL && --m->refs == 0) mg_free(m);
+}
+
+static struct mg_str brk_topic(struct brk_msg *m) {
+  return mg_str_n((char *) (m + 1) + m->tofs + 2, m->pofs - m->tofs - 2);
+}
+
+// Queues a PUBLISH of m: one shared copy for MQTT 3.1.1 QoS 0 receivers,
+// otherwise a header of our own and the shared payload
+static void brk_send(struct brk_session *s, struct brk_msg *m, uint8_t qos,
+                     uint16_t id, bool dup, bool retain) {
+  struct mg_connection *c = s->c;
+  const char *buf = (const char *) (m + 1);
+  size_t tlen = m->pofs - m->tofs, plen = m->len - m->pofs;
+  uint8_t flags = (uint8_t) ((dup ? 8 : 0) | (qos << 1) | (retain ? 1 : 0));
+  bool ok = true;
+  if (flags != 0 || c->is_mqtt5) {
+    uint16_t nid = mg_htons(id);
+    uint8_t zero = 0;
+    size_t len = tlen + plen + (qos > 0 ? 2U : 0U) + (c->is_mqtt5 ? 1U : 0U);
+    ok = mqtt_send_header(c, MQTT_CMD_PUBLISH, flags, (uint32_t) len) &&
+         mg_send(c, buf + m->tofs, tlen) &&
+         (qos == 0 || mg_send(c, &nid, sizeof(nid))) &&
+         (!c->is_mqtt5 || mg_send(c, &zero, sizeof(zero)));
+    buf += m->pofs;
+  } else {
+    plen = m->len;
+  }
+  if (ok && plen > 0) {
+    m->refs++;
+    if (!mg_send_ref(c, buf, plen, brk_unref, m)) m->refs--, ok = false;
+  }
+  if (!ok) mg_error(c, "OOM");
+}
+
+static struct brk_slot *brk_slot(struct brk_session *s, uint16_t id) {
+  size_t i;
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    if (s->out[i].msg != NULL && s->out[i].id == id) return &s->out[i];
+  }
+  return NULL;
+}
+
+// Sends m with QoS 1 or 2 if the client's receive window has room
+static bool brk_send_qos(struct brk_session *s, struct brk_msg *m,
+                         uint8_t qos, bool retain) {
+  struct brk_slot *slot = NULL;
+  size_t i, used = 0;
+  if (s->c == NULL || !s->connected) return false;
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    if (s->out[i].msg != NULL) {
+      used++;
+    } else if (slot == NULL) {
+      slot = &s->out[i];
+    }
+  }
+  if (slot == NULL || used >= s->max_out) return false;
+  do {
+    if (++s->next_id == 0) s->next_id = 1;
+  } while (brk_slot(s, s->next_id) != NULL);
+  slot->id = s->next_id, slot->qos = qos, slot->retain = retain;
+  slot->released = false, slot->msg = m, m->refs++;
+  brk_send(s, m, qos, slot->id, false, retain);
+  return true;
+}
+
+static void brk_deliver(struct brk_session *s, struct brk_msg *m, uint8_t qos,
+                        bool retain) {
+  struct brk_queued *q;
+  if (qos == 0) {  // Not kept for offline clients
+    if (s->c != NULL && s->connected) brk_send(s, m, 0, 0, false, retain);
+  } else if (s->head != NULL || !brk_send_qos(s, m, qos, retain)) {
+    if (s->queued >= MG_MQTT_QUEUE_MAX ||
+        (q = (struct brk_queued *) mg_calloc(1, sizeof(*q))) == NULL) {
+      MG_ERROR(("[%.*s] queue full, message dropped", (int) s->id.len,
+                s->id.buf));
+      return;
+    }
+    q->msg = m, q->qos = qos, q->retain = retain, m->refs++;
+    if (s->tail != NULL) {
+      s->tail->next = q;
+    } else {
+      s->head = q;
+    }
+    s->tail = q, s->queued++;
+  }
+}
+
+// Moves queued messages to free in-flight slots
+static void brk_pump(struct brk_session *s) {
+  struct brk_queued *q;
+  while ((q = s->head) != NULL && brk_send_qos(s, q->msg, q->qos, q->retain)) {
+    if ((s->head = q->next) == NULL) s->tail = NULL;
+    s->queued--;
+    brk_unref(q->msg);
+    mg_free(q);
+  }
+}
+
+// Lists sessions subscribed with node n's filter for the publish being
+// fanned out. Overlapping subscriptions get one copy, with the highest QoS
+static void brk_collect(struct brk_priv *p, struct brk_node *n,
+                        struct brk_session **list, struct brk_session *from) {
+  struct brk_sub *sub;
+  for (sub = n == NULL ? NULL : n->subs; sub != NULL; sub = sub->next) {
+    struct brk_session *s = sub->s;
+    if ((sub->opts & 4) && s == from) continue;  // MQTT5 No Local
+    if (s->gen != p->gen) {  // First subscription of s that matches
+      s->gen = p->gen, s->fopts = 0, s->fnext = *list, *list = s;
+    }
+    if ((sub->opts & 3) > (s->fopts & 3)) {
+      s->fopts = (uint8_t) ((s->fopts & ~3U) | (sub->opts & 3U));
+    }
+    s->fopts |= (uint8_t) (sub->opts & 8);  // Retain As Published
+  }
+}
+
+// Lists subscribers of topic t, which continues at offset i below node n
+static void brk_match(struct brk_priv *p, struct brk_node *n, struct mg_str t,
+                      size_t i, struct brk_session **list,
+                      struct brk_session *from) {
+  bool wild = i > 0 || t.buf[0] != '$';  // Wildcards skip $SYS/..., 4.7.2
+  struct brk_node *next[2];
+  size_t j, k;
+  for (j = i; j < t.len && t.buf[j] != '/'; j++) (void) 0;
+  if (wild) brk_collect(p, brk_child(p, n, mg_str("#"), false), list, from);
+  next[0] = wild ? brk_child(p, n, mg_str("+"), false) : NULL;
+  next[1] = brk_child(p, n, mg_str_n(t.buf + i, j - i), false);
+  for (k = 0; k < 2; k++) {
+    if (next[k] == NULL) {
+      // No such level
+    } else if (j < t.len) {
+      brk_match(p, next[k], t, j + 1, list, from);
+    } else {  // Last level. a/# matches a, too
+      brk_collect(p, next[k], list, from);
+      brk_collect(p, brk_child(p, next[k], mg_str("#"), false), list, from);
+    }
+  }
+}
+
+// Stores m as the retained message of its topic, empty m deletes it
+static void brk_retain(struct mg_mqtt_broker *b, struct brk_msg *m) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  bool del = m->len == m->pofs;
+  struct brk_node *n = brk_node(p, brk_topic(m), !del);
+  if (n == NULL) return;
+  if (n->retained != NULL) brk_unref(n->retained), b->num_retained--;
+  n->retained = NULL;
+  if (del) {
+    brk_prune(p, n);
+  } else {
+    n->retained = m, m->refs++, b->num_retained++;
+  }
+}
+
+// Fans out m to all subscribers. Returns the number of receivers
+static size_t brk_publish(struct mg_mqtt_broker *b, struct brk_msg *m,
+                          bool retain, struct brk_session *from) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  struct brk_session *list = NULL, *s;
+  size_t n = 0;
+  if (retain) brk_retain(b, m);
+  p->gen++;
+  brk_match(p, &p->root, brk_topic(m), 0, &list, from);
+  for (s = list; s != NULL; s = s->fnext, n++) {
+    uint8_t qos = (uint8_t) (s->fopts & 3);
+    brk_deliver(s, m, qos < m->qos ? qos : m->qos, retain && (s->fopts & 8));
+  }
+  MG_DEBUG(("[%.*s] -> %lu", (int) (m->pofs - m->tofs - 2),
+            (char *) (m + 1) + m->tofs + 2, (unsigned long) n));
+  return n;
+}
+
+static void brk_send_retained(struct brk_session *s, struct brk_node *n,
+                              uint8_t qos) {
+  struct brk_msg *m = n == NULL ? NULL : n->retained;
+  if (m != NULL) brk_deliver(s, m, m->qos < qos ? m->qos : qos, true);
+}
+
+static bool brk_is_sys(struct brk_priv *p, struct brk_node *n) {
+  return n->parent == &p->root && n->len > 0 && *(char *) (n + 1) == '$';
+}
+
+// Sends retained messages of n, unless it's the root, and its descendants
+static void brk_retained_all(struct brk_session *s, struct brk_node *n,
+                             uint8_t qos) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *c;
+  brk_send_retained(s, n, qos);
+  for (c = n->child; c != NULL; c = c->next) {
+    if (!brk_is_sys(p, c)) brk_retained_all(s, c, qos);
+  }
+}
+
+// Sends retained messages matching filter f, which continues at offset i
+// below node n
+static void brk_retained(struct brk_session *s, struct brk_node *n,
+                         struct mg_str f, size_t i, uint8_t qos) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *c;
+  size_t j;
+  for (j = i; j < f.len && f.buf[j] != '/'; j++) (void) 0;
+  if (j == i + 1 && f.buf[i] == '#') {
+    brk_retained_all(s, n, qos);
+  } else if (j == i + 1 && f.buf[i] == '+') {
+    for (c = n->child; c != NULL; c = c->next) {
+      if (brk_is_sys(p, c)) continue;
+      if (j < f.len) {
+        brk_retained(s, c, f, j + 1, qos);
+      } else {
+        brk_send_retained(s, c, qos);
+      }
+    }
+  } else if ((c = brk_child(p, n, mg_str_n(f.buf + i, j - i), false)) !=
+             NULL) {
+    if (j < f.len) {
+      brk_retained(s, c, f, j + 1, qos);
+    } else {
+      brk_send_retained(s, c, qos);
+    }
+  }
+}
+
+static void brk_unsub(struct mg_mqtt_broker *b, struct brk_sub *sub) {
+  struct brk_node *n = sub->node;
+  if (sub->prev != NULL) {
+    sub->prev->next = sub->next;
+  } else {
+    n->subs = sub->next;
+  }
+  if (sub->next != NULL) sub->next->prev = sub->prev;
+  mg_free(sub);
+  b->num_subs--;
+  brk_prune((struct brk_priv *) b->priv, n);
+}
+
+// Drops subscriptions and undelivered messages
+static void brk_reset(struct brk_session *s) {
+  size_t i;
+  while (s->subs != NULL) {
+    struct brk_sub *sub = s->subs;
+    s->subs = sub->snext;
+    brk_unsub(s->b, sub);
+  }
+  while (s->head != NULL) {
+    struct brk_queued *q = s->head;
+    s->head = q->next;
+    brk_unref(q->msg);
+    mg_free(q);
+  }
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    brk_unref(s->out[i].msg);
+    s->out[i].msg = NULL;
+    s->in[i] = 0;
+  }
+  s->tail = NULL, s->queued = 0;
+}
+
+static void brk_free_session(struct brk_session *s) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  brk_reset(s);
+  brk_unref(s->will);
+  if (s->id.buf != NULL) {
+    brk_hdel(&p->clients, &s->h);
+    s->b->num_sessions = p->clients.len;
+    mg_free((char *) s->id.buf);
+  }
+  mg_free(s);
+}
+
+// Publishes a will, and drops the reference to it
+static void brk_will(struct mg_mqtt_broker *b, struct brk_msg *will,
+                     bool retain) {
+  if (will == NULL) return;
+  brk_publish(b, will, retain, NULL);
+  brk_unref(will);
+}
+
+// Session is over: frees it, then sends a will still held back
+static void brk_end(struct brk_session *s) {
+  struct mg_mqtt_broker *b = s->b;
+  struct brk_msg *will = s->will;
+  bool retain = s->will_retain;
+  s->will = NULL;
+  brk_free_session(s);
+  brk_will(b, will, retain);
+}
+
+// Client is gone: send its will, keep the session only if it's persistent.
+// A persistent MQTT5 session holds the will back for its Will Delay Interval
+static void brk_close(struct brk_session *s) {
+  s->c = NULL;
+  if (!s->connected || !s->persistent) {
+    brk_end(s);
+  } else {
+    s->connected = false;
+    if (s->expiry != BRK_NEVER) {
+      s->expire = mg_millis() + (uint64_t) s->expiry * 1000;
+    }
+    if (s->will != NULL && s->will_delay > 0) {
+      s->will_at = mg_millis() + (uint64_t) s->will_delay * 1000;
+    } else {
+      brk_will(s->b, s->will, s->will_retain);
+      s->will = NULL;
+    }
+  }
+}
+
+static struct brk_session *brk_lookup(struct brk_priv *p, struct mg_str id) {
+  size_t hash = brk_hash(NULL, id);
+  struct brk_hent *e =
+      p->clients.size == 0 ? NULL : p->clients.tab[hash % p->clients.size];
+  for (; e != NULL; e = e->next) {
+    struct brk_session *s = (struct brk_session *) e;
+    if (e->hash == hash && mg_strcmp(s->id, id) == 0) return s;
+  }
+  return NULL;
+}
+
+static size_t brk_hlen(struct mg_mqtt_message *mm) {  // Fixed header length
+  size_t n = 1;
+  while (n < mm->dgram.len && (mm->dgram.buf[n] & 0x80)) n++;
+  return n + 1;
+}
+
+static bool brk_u16(const uint8_t **p, const uint8_t *end, uint16_t *v) {
+  if (end - *p < 2) return false;
+  *v = (uint16_t) (((*p)[0] << 8) | (*p)[1]);
+  *p += 2;
+  return true;
+}
+
+static bool brk_str(const uint8_t **p, const uint8_t *end, struct mg_str *s) {
+  uint16_t n = 0;
+  if (!brk_u16(p, end, &n) || end - *p < n) return false;
+  *s = mg_str_n((const char *) *p, n);
+  *p += n;
+  return true;
+}
+
+// Skips MQTT5 properties, and makes them iterable with mg_mqtt_next_prop()
+static bool brk_props(const uint8_t **p, const uint8_t *end,
+                      struct mg_mqtt_message *mm) {
+  uint32_t n = 0;
+  size_t len = decode_varint(*p, (size_t) (end - *p), &n);
+  if (len == 0 || (size_t) (end - *p) - len < n) return false;
+  mm->props_start = (size_t) (*p + len - (const uint8_t *) mm->dgram.buf);
+  mm->props_size = n;
+  *p += len + n;
+  return true;
+}
+
+static void brk_connack(struct mg_connection *c, bool present, uint8_t rc,
+                        struct mg_str assigned) {
+  uint8_t buf[5] = {0, 0, 0, MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER, 0};
+  size_t n = c->is_mqtt5 ? 3 : 2, plen = c->is_mqtt5 ? assigned.len : 0;
+  buf[0] = present ? 1 : 0, buf[1] = rc;
+  if (plen > 0) {  // Assigned client ID: 0x12, then a string
+    buf[2] = (uint8_t) (3 + plen), buf[4] = (uint8_t) plen, n = 5;
+  }
+  if (!mqtt_send_header(c, MQTT_CMD_CONNACK, 0, (uint32_t) (n + plen)) ||
+      !mg_send(c, buf, n) || !mg_send(c, assigned.buf, plen)) {
+    mg_error(c, "OOM");
+  }
+}
+
+static void brk_connect(struct brk_session *s, struct mg_mqtt_message *mm) {
+  struct mg_connection *c = s->c;
+  struct mg_mqtt_broker *b = s->b;
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  const uint8_t *q = (uint8_t *) mm->dgram.buf + brk_hlen(mm),
+                *end = (uint8_t *) mm->dgram.buf + mm->dgram.len;
+  struct mg_str name, id, wtopic, wmsg, user, pass;
+  struct mg_mqtt_prop prop;
+  struct brk_session *old;
+  struct brk_msg *will = NULL;
+  char buf[21];
+  uint16_t keepalive = 0, rmax = MG_MQTT_INFLIGHT;
+  uint32_t expiry = 0, wdelay = 0;
+  uint8_t level, flags, rc = 0;
+  bool present = false, assigned = false;
+  size_t i, ofs = 0;
+
+  if (s->connected || !brk_str(&q, end, &name) || end - q < 4) goto malformed;
+  level = q[0], flags = q[1], q += 2;
+  brk_u16(&q, end, &keepalive);
+  if (mg_strcmp(name, mg_str("MQTT")) != 0 || (level != 4 && level != 5)) {
+    brk_connack(c, false, 1, mg_str(""));  // Unacceptable protocol version
+    c->is_draining = 1;
+    return;
+  }
+  if ((c->is_mqtt5 = level == 5 ? 1U : 0U) != 0) {
+    if (!brk_props(&q, end, mm)) goto malformed;
+    while ((ofs = mg_mqtt_next_prop(mm, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_RECEIVE_MAXIMUM && prop.iv > 0) {
+        rmax = prop.iv < rmax ? (uint16_t) prop.iv : rmax;
+      } else if (prop.id == MQTT_PROP_SESSION_EXPIRY_INTERVAL) {
+        expiry = prop.iv;
+      }
+    }
+  }
+  if (!brk_str(&q, end, &id)) goto malformed;
+  if (flags & MQTT_HAS_WILL) {
+    struct mg_mqtt_message tmp = *mm;
+    if ((c->is_mqtt5 && !brk_props(&q, end, &tmp)) ||
+        !brk_str(&q, end, &wtopic) || !brk_str(&q, end, &wmsg) ||
+        !brk_valid(wtopic, false) || ((flags >> 3) & 3) > 2)
+      goto malformed;
+    while (c->is_mqtt5 && (ofs = mg_mqtt_next_prop(&tmp, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_WILL_DELAY_INTERVAL) wdelay = prop.iv;
+    }
+  }
+  user = pass = mg_str_n(NULL, 0);
+  if (((flags & MQTT_HAS_USER_NAME) && !brk_str(&q, end, &user)) ||
+      ((flags & MQTT_HAS_PASSWORD) && !brk_str(&q, end, &pass)))
+    goto malformed;
+  // Refuse before touching any session, including one this client takes over
+  if (id.len == 0 && !c->is_mqtt5 && !(flags & MQTT_CLEAN_SESSION)) {
+    rc = 2;  // Identifier rejected, 3.1.3-8
+  } else if (b->auth != NULL && !b->auth(c, id, user, pass)) {
+    rc = c->is_mqtt5 ? 0x87 : 5;  // Not authorized
+  }
+  if (rc != 0) {
+    MG_DEBUG(("%lu [%.*s] refused: %d", c->id, (int) id.len, id.buf, rc));
+    brk_connack(c, false, rc, mg_str(""));
+    c->is_draining = 1;
+    return;
+  }
+  if (id.len == 0) {
+    mg_random_str(buf, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    id = mg_str(buf), assigned = true;
+  }
+  if ((old = brk_lookup(p, id)) != NULL && old->c == NULL &&
+      old->expire != 0 && mg_millis() >= old->expire) {
+    brk_end(old);  // Expired, not swept yet
+    old = NULL;
+  }
+  if (old != NULL && old->c != NULL) {  // Take over, 3.1.4-3
+    bool ends = !old->persistent;
+    MG_DEBUG(("%lu [%.*s] takes over %lu", c->id, (int) id.len, id.buf,
+              old->c->id));
+    old->c->pfn = NULL, old->c->pfn_data = NULL, old->c->is_closing = 1;
+    brk_close(old);        // As if the old connection was lost: its will
+    if (ends) old = NULL;  // Freed with it
+  }
+  if (old != NULL) {
+    if (flags & MQTT_CLEAN_SESSION) {
+      will = old->will, old->will = NULL;  // Session ends, send it now
+      brk_reset(old);
+    } else {
+      present = true;
+    }
+    brk_free_session(s);
+    s = old;
+  } else {
+    s->id = mg_strdup(id);
+    s->h.hash = brk_hash(NULL, id);
+    if (s->id.buf == NULL || !brk_hadd(&p->clients, &s->h)) {
+      mg_free((char *) s->id.buf);
+      s->id = mg_str_n(NULL, 0);
+      mg_error(c, "OOM");
+      return;
+    }
+    b->num_sessions = p->clients.len;
+  }
+  s->c = c, c->pfn_data = s, s->connected = true, s->max_out = rmax;
+  s->persistent = c->is_mqtt5 ? expiry > 0 : !(flags & MQTT_CLEAN_SESSION);
+  s->expiry = c->is_mqtt5 ? expiry : BRK_NEVER;
+  s->keepalive = keepalive, s->seen = mg_millis(), s->expire = 0;
+  if (keepalive > 0) c->is_polled = 1;  // Even with mgr->poll_opt_in
+  brk_will(b, will, s->will_retain);
+  brk_unref(s->will);  // A delayed will is not sent if back in time, 3.1.3-9
+  s->will = NULL;
+  if (flags & MQTT_HAS_WILL) {
+    s->will = brk_msg(wtopic, wmsg, (uint8_t) ((flags >> 3) & 3));
+    s->will_retain = flags & MQTT_WILL_RETAIN, s->will_delay = wdelay;
+  }
+  brk_connack(c, present, 0, assigned ? id : mg_str(""));
+  for (i = 0; present && i < MG_MQTT_INFLIGHT; i++) {  // Resend, 4.4
+    struct brk_slot *slot = &s->out[i];
+    if (slot->msg == NULL) {
+      // Free slot
+    } else if (slot->released) {
+      uint16_t nid = mg_htons(slot->id);
+      if (!mqtt_send_header(c, MQTT_CMD_PUBREL, 2, sizeof(nid)) ||
+          !mg_send(c, &nid, sizeof(nid)))
+        mg_error(c, "OOM");
+    } else {
+      brk_send(s, slot->msg, slot->qos, slot->id, true, slot->retain);
+    }
+  }
+  brk_pump(s);
+  return;
+malformed:
+  mg_error(c, "bad CONNECT");
+}
+
+static uint8_t brk_add_sub(struct brk_session *s, struct mg_str f,
+                           uint8_t opts) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *n;
+  struct brk_sub *sub;
+  uint8_t reserved = s->c->is_mqtt5 ? 0xc0 : 0xfc;
+  if ((opts & 3) > 2 || (opts & reserved) || ((opts >> 4) & 3) > 2 ||
+      !brk_valid(f, true) || (n = brk_node(p, f, true)) == NULL)
+    return 0x80;
+  for (sub = s->subs; sub != NULL && sub->node != n; sub = sub->snext) (void) 0;
+  if (sub == NULL) {
+    if ((sub = (struct brk_sub *) mg_calloc(1, sizeof(*sub))) == NULL) {
+      brk_prune(p, n);
+      return 0x80;
+    }
+    sub->node = n, sub->s = s, sub->fresh = true;
+    if ((sub->next = n->subs) != NULL) sub->next->prev = sub;
+    n->subs = sub;
+    sub->snext = s->subs, s->subs = sub;
+    s->b->num_subs++;
+  }
+  sub->opts = opts;
+  return (uint8_t) (opts & 3);
+}
+
+static void brk_subscribe(struct brk_session *s, struct mg_mqtt_message *mm,
+                          bool sub) {
+  struct mg_connection *c = s->c;
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  const uint8_t *start = (uint8_t *) mm->dgram.buf + brk_hlen(mm) + 2,
+                *end = (uint8_t *) mm->dgram.buf + mm->dgram.len, *q;
+  struct mg_mqtt_message tmp = *mm;
+  struct mg_str f;
+  uint16_t nid = mg_htons(mm->id);
+  size_t n = 0;
+  uint8_t zero = 0;
+
+  if ((mm->dgram.buf[0] & 15) != 2 ||
+      (c->is_mqtt5 && !brk_props(&start, end, &tmp)))
+    goto malformed;
+  for (q = start; q < end; n++) {
+    if (!brk_str(&q, end, &f) || (sub && q++ >= end)) goto malformed;
+  }
+  if (n == 0) goto malformed;  // 3.8.3-2, 3.10.3-2
+  if (!mqtt_send_header(c, sub ? MQTT_CMD_SUBACK : MQTT_CMD_UNSUBACK, 0,
+                        (uint32_t) (2 + (c->is_mqtt5 ? 1 + n : sub ? n : 0))) ||
+      !mg_send(c, &nid, sizeof(nid)) ||
+      (c->is_mqtt5 && !mg_send(c, &zero, sizeof(zero))))
+    goto oom;
+  for (q = start; q < end;) {  // Reason codes
+    uint8_t code = 0x11;       // No subscription existed
+    brk_str(&q, end, &f);
+    if (sub) {
+      code = brk_add_sub(s, f, *q++);
+    } else {
+      struct brk_node *node = brk_valid(f, true) ? brk_node(p, f, false) : NULL;
+      struct brk_sub **ps = &s->subs;
+      while (*ps != NULL && (*ps)->node != node) ps = &(*ps)->snext;
+      if (node != NULL && *ps != NULL) {
+        struct brk_sub *x = *ps;
+        *ps = x->snext;
+        brk_unsub(s->b, x);
+        code = 0;
+      }
+    }
+    if ((sub || c->is_mqtt5) && !mg_send(c, &code, sizeof(code))) goto oom;
+  }
+  for (q = start; sub && q < end;) {  // Retained messages, after SUBACK
+    struct brk_node *node;
+    struct brk_sub *x;
+    uint8_t opts, rh;
+    brk_str(&q, end, &f);
+    opts = *q++, rh = (uint8_t) ((opts >> 4) & 3);
+    node = brk_valid(f, true) ? brk_node(p, f, false) : NULL;
+    for (x = s->subs; x != NULL && x->node != node; x = x->snext) (void) 0;
+    if (node == NULL || x == NULL) continue;
+    if (rh == 0 || (rh == 1 && x->fresh)) {
+      brk_retained(s, &p->root, f, 0, (uint8_t) (x->opts & 3));
+    }
+    x->fresh = false;
+  }
+  return;
+malformed:
+  mg_error(c, "bad SUBSCRIBE");
+  return;
+oom:
+  mg_error(c, "OOM");
+}
+
+static void brk_cmd(struct brk_session *s, struct mg_mqtt_message *mm) {
+  struct mg_connection *c = s->c;
+  struct brk_slot *slot = brk_slot(s, mm->id);
+  size_t i;
+  if (c->is_closing || c->is_draining) {
+    // Don't act on the rest of the data
+  } else if (mm->cmd == MQTT_CMD_CONNECT) {
+    brk_connect(s, mm);
+  } else if (!s->connected) {
+    mg_error(c, "no CONNECT");
+  } else if (mm->cmd == MQTT_CMD_SUBSCRIBE) {
+    brk_subscribe(s, mm, true);
+  } else if (mm->cmd == MQTT_CMD_UNSUBSCRIBE) {
+    brk_subscribe(s, mm, false);
+  } else if (mm->cmd == MQTT_CMD_PUBLISH) {
+    struct brk_msg *m;
+    if (mm->qos > 2 || !brk_valid(mm->topic, false)) {
+      mg_error(c, "bad PUBLISH");
+      return;
+    }
+    if (mm->qos == 2) {  // Fan out once, even if the client sends it again
+      for (i = 0; i < MG_MQTT_INFLIGHT && s->in[i] != mm->id; i++) (void) 0;
+      if (i < MG_MQTT_INFLIGHT) return;
+      for (i = 0; i < MG_MQTT_INFLIGHT && s->in[i] != 0; i++) (void) 0;
+      if (i < MG_MQTT_INFLIGHT) s->in[i] = mm->id;
+    }
+    if ((m = brk_msg(mm->topic, mm->data, mm->qos)) == NULL) {
+      mg_error(c, "OOM");
+      return;
+    }
+    brk_publish(s->b, m, mm->dgram.buf[0] & 1, s);
+    brk_unref(m);
+  } else if (mm->cmd == MQTT_CMD_PUBREL) {
+    for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+      if (s->in[i] == mm->id) s->in[i] = 0;
+    }
+  } else if (mm->cmd == MQTT_CMD_PUBREC && slot != NULL && slot->qos == 2) {
+    slot->released = true;  // mqtt_cb() has sent PUBREL
+  } else if ((mm->cmd == MQTT_CMD_PUBACK && slot != NULL && slot->qos == 1) ||
+             (mm->cmd == MQTT_CMD_PUBCOMP && slot != NULL && slot->released)) {
+    brk_unref(slot->msg);
+    slot->msg = NULL;
+    brk_pump(s);
+  } else if (mm->cmd == MQTT_CMD_PINGREQ) {
+    mg_mqtt_pong(c);
+  } else if (mm->cmd == MQTT_CMD_DISCONNECT) {
+    // MQTT5 reason 4: disconnect with will message
+    if (!c->is_mqtt5 || mm->dgram.len < 3 || mm->dgram.buf[2] != 4) {
+      brk_unref(s->will);
+      s->will = NULL;
+    }
+    c->is_draining = 1;
+  }
+}
+
+// Frees offline sessions past their Session Expiry Interval, sends delayed
+// wills. Runs at most once a second, on the listeners' MG_EV_POLL
+static void brk_expire(struct mg_mqtt_broker *b, uint64_t now) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  size_t i;
+  if (now < p->sweep) return;
+  p->sweep = now + 1000;
+  for (i = 0; i < p->clients.size; i++) {
+    struct brk_hent *e = p->clients.tab[i], *next;
+    for (; e != NULL; e = next) {
+      struct brk_session *s = (struct brk_session *) e;
+      next = e->next;
+      if (s->c == NULL && s->expire != 0 && now >= s->expire) {
+        MG_DEBUG(("[%.*s] session expired", (int) s->id.len, s->id.buf));
+        brk_end(s);
+      } else if (s->c == NULL && s->will != NULL && now >= s->will_at) {
+        brk_will(b, s->will, s->will_retain);
+        s->will = NULL;
+      }
+    }
+  }
+}
+
+static void brk_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct brk_session *s = (struct brk_session *) c->pfn_data;
+  if (ev == MG_EV_POLL && c->is_listening) {
+    brk_expire((struct mg_mqtt_broker *) c->pfn_data, *(uint64_t *) ev_data);
+  } else if (ev == MG_EV_POLL) {
+    uint64_t now = *(uint64_t *) ev_data;
+    // No packet for 1.5 keep alive intervals: close, send the will, 3.1.2-24
+    if (s != NULL && s->connected && s->keepalive > 0 &&
+        now > s->seen + (uint64_t) s->keepalive * 1500) {
+      mg_error(c, "keepalive timeout");
+    }
+  } else if (c->is_listening || ev == MG_EV_OPEN) {
+    // Listener, or accepted connection with no session yet
+  } else if (ev == MG_EV_ACCEPT) {
+    struct mg_mqtt_broker *b = (struct mg_mqtt_broker *) c->pfn_data;
+    if ((s = (struct brk_session *) mg_calloc(1, sizeof(*s))) == NULL) {
+      c->pfn = NULL, c->pfn_data = NULL;
+      mg_error(c, "OOM");
+    } else {
+      s->b = b, s->c = c, s->max_out = MG_MQTT_INFLIGHT;
+      c->pfn_data = s;
+    }
+  } else if (ev == MG_EV_READ) {
+    mqtt_cb(c, ev, ev_data);
+  } else if (ev == MG_EV_MQTT_CMD) {
+    s->seen = mg_millis();
+    brk_cmd(s, (struct mg_mqtt_message *) ev_data);
+  } else if (ev == MG_EV_CLOSE) {
+    brk_close(s);
+    c->pfn_data = NULL;
+  }
+}
+
+struct mg_connection *mg_mqtt_broker_listen(struct mg_mgr *mgr,
+                                            const char *url,
+                                            struct mg_mqtt_broker *b,
+                                            mg_event_handler_t fn,
+                                            void *fn_data) {
+  struct mg_connection *c = NULL;
+  if (brk_priv(b) != NULL && (c = mg_listen(mgr, url, fn, fn_data)) != NULL) {
+    c->pfn = brk_cb, c->pfn_data = b, b->mgr = mgr;
+    c->is_polled = 1;  // Expire offline sessions
+  }
+  return c;
+}
+
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *b,
+                          const struct mg_mqtt_opts *opts) {
+  struct brk_msg *m;
+  size_t n;
+  uint8_t qos = opts->qos > 2 ? 2 : opts->qos;
+  if (brk_priv(b) == NULL || !brk_valid(opts->topic, false) ||
+      (m = brk_msg(opts->topic, opts->message, qos)) == NULL)
+    return 0;
+  n = brk_publish(b, m, opts->retain, NULL);
+  brk_unref(m);
+  return n;
+}
+
+void mg_mqtt_broker_free(struct mg_mqtt_broker *b) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  struct mg_connection *c;
+  size_t i;
+  if (p == NULL) return;
+  for (c = b->mgr == NULL ? NULL : b->mgr->conns; c != NULL; c = c->next) {
+    struct brk_session *s = (struct brk_session *) c->pfn_data;
+    if (c->pfn != brk_cb) continue;
+    if (c->is_listening ? c->pfn_data != (void *) b : s->b != b) continue;
+    if (!c->is_listening && s->id.buf == NULL) brk_free_session(s);
+    c->pfn = NULL, c->pfn_data = NULL, c->is_closing = 1;
+  }
+  for (i = 0; i < p->clients.size; i++) {
+    while (p->clients.tab[i] != NULL) {
+      brk_free_session((struct brk_session *) p->clients.tab[i]);
+    }
+  }
+  for (i = 0; i < p->nodes.size; i++) {  // What's left holds retained
+    while (p->nodes.tab[i] != NULL) {
+      struct brk_node *n = (struct brk_node *) p->nodes.tab[i];
+      p->nodes.tab[i] = n->h.next;
+      brk_unref(n->retained);
+      mg_free(n);
+    }
+  }
+  mg_free(p->nodes.tab);
+  mg_free(p->clients.tab);
+  mg_free(p);
+  memset(b, 0, sizeof(*b));
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/net.c"
 #endif
@@ -7875,15 +11567,20 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 
 
 
+
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
-  size_t old = c->send.len;
-  size_t expected = mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
-  size_t actual = c->send.len - old;
+  size_t old = c->send.len, expected, actual;
+  mg_pool_iobuf(c->mgr, &c->send);
+  expected = mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  actual = c->send.len - old;
   if (actual != expected) {
     mg_error(c, "OOM");
     c->send.len = old;
     actual = 0;
   }
+  if (actual > 0) {
+    MG_EPOLL_MOD(c, 1);
+  }
   return actual;
 }
 
@@ -7995,62 +11692,289 @@ static bool mg_aton6(struct mg_str str, struct mg_addr *addr) {
       addr->addr.ip[n + 1] = (uint8_t) val;
       val = 0, have = false;
     }
-    if (str.buf[i] == ':') {
-      j = i + 1;
-      if (i > 0 && str.buf[i - 1] == ':') {
-        if (dc != 42) return false;
-        dc = n;  // Double colon
-        if (i > 1 && str.buf[i - 2] == ':') return false;
-      } else if (i > 0) {
-        n += 2;
-      }
-      if (n > 14) return false;
-      addr->addr.ip[n] = addr->addr.ip[n + 1] = 0;  // For trailing ::
-    } else if (str.buf[i] == '%') {                 // Scope ID, last in string
-      if (mg_str_to_num(mg_str_n(&str.buf[i + 1], str.len - i - 1), 10,
-                        &addr->scope_id, sizeof(uint8_t))) {
-        addr->is_ip6 = true;
-        return true;
-      } else {
-        return false;
-      }
-    } else {
-      return false;
+    if (str.buf[i] == ':') {
+      j = i + 1;
+      if (i > 0 && str.buf[i - 1] == ':') {
+        if (dc != 42) return false;
+        dc = n;  // Double colon
+        if (i > 1 && str.buf[i - 2] == ':') return false;
+      } else if (i > 0) {
+        n += 2;
+      }
+      if (n > 14) return false;
+      addr->addr.ip[n] = addr->addr.ip[n + 1] = 0;  // For trailing ::
+    } else if (str.buf[i] == '%') {                 // Scope ID, last in string
+      if (mg_str_to_num(mg_str_n(&str.buf[i + 1], str.len - i - 1), 10,
+                        &addr->scope_id, sizeof(uint8_t))) {
+        addr->is_ip6 = true;
+        return true;
+      } else {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  if (have)
+    addr->addr.ip[n] = (uint8_t) (val >> 8),
+    addr->addr.ip[n + 1] = (uint8_t) val;
+  if (n < 14 && dc == 42) return false;
+  if (n < 14) {
+    memmove(&addr->addr.ip[dc + (14 - n)], &addr->addr.ip[dc], n - dc + 2);
+    memset(&addr->addr.ip[dc], 0, 14 - n);
+  }
+  addr->is_ip6 = true;
+  return true;
+}
+
+bool mg_aton(struct mg_str str, struct mg_addr *addr) {
+  // MG_INFO(("[%.*s]", (int) str.len, str.buf));
+  return mg_atone(str, addr) || mg_atonl(str, addr) || mg_aton4(str, addr) ||
+         mg_aton6(str, addr);
+}
+
+struct pool_entry {
+  struct pool_entry *next;
+};
+
+static void *pool_pop(void **list) {
+  struct pool_entry *e = (struct pool_entry *) *list;
+  if (e != NULL) *list = e->next, e->next = NULL;
+  return e;
+}
+
+static void pool_push(void **list, void *p) {
+  struct pool_entry *e = (struct pool_entry *) p;
+  e->next = (struct pool_entry *) *list;
+  *list = e;
+}
+
+static void pool_free(struct mg_pool *pool) {
+  void *p;
+  while ((p = pool_pop(&pool->conn_list)) != NULL) mg_free(p);
+  while ((p = pool_pop(&pool->buf_list)) != NULL) mg_free(p);
+  pool->free_conns = pool->free_bufs = 0;
+}
+
+// If io has no buffer yet, give it a zeroed MG_IO_SIZE one from the pool
+void mg_pool_iobuf(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  struct mg_pool *pool = mgr == NULL ? NULL : &mgr->pool;
+  if (pool != NULL && pool->free_bufs > 0 && io->buf == NULL &&
+      io->align == MG_IO_SIZE) {
+    io->buf = (unsigned char *) pool_pop(&pool->buf_list);
+    io->size = MG_IO_SIZE, io->len = io->head = 0;
+    pool->free_bufs--, pool->reused++;
+  }
+}
+
+// Return a single-block buffer to the pool, or free it
+static void pool_iobuf_put(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  struct mg_pool *pool = &mgr->pool;
+  unsigned char *base = io->buf == NULL ? NULL : io->buf - io->head;
+  if (base != NULL && io->size + io->head == MG_IO_SIZE &&
+      pool->free_bufs < pool->max) {
+    mg_bzero(base, MG_IO_SIZE);
+    pool_push(&pool->buf_list, base);
+    pool->free_bufs++;
+    io->buf = NULL, io->size = io->len = io->head = 0;
+  }
+  mg_iobuf_free(io);
+}
+
+// Connection lookup index: hash buckets by ID, for mg_wakeup(), and by TCP
+// 4-tuple, for the builtin TCP/IP stack. Buckets are chained through the
+// connections, and grow 2x when there are more connections than buckets
+struct conn_index {
+  size_t size;                     // Number of buckets, a power of 2
+  size_t count;                    // Number of indexed connections
+  struct mg_connection **ids;      // Chained by c->id_next
+#if MG_ENABLE_TCPIP
+  struct mg_connection **tuples;   // Chained by c->tuple_next
+#endif
+};
+
+#if MG_ENABLE_TCPIP
+static size_t tuple_hash(uint16_t port, const struct mg_addr *rem) {
+  const uint8_t *p = rem->addr.ip;
+  size_t i, n = rem->is_ip6 ? 16 : 4;
+  uint32_t h = 2166136261U ^ ((uint32_t) port << 16 | rem->port);  // FNV-1a
+  for (i = 0; i < n; i++) h = (h ^ p[i]) * 16777619U;
+  return (size_t) h;
+}
+
+static bool tuple_match(const struct mg_connection *c, uint16_t port,
+                        const struct mg_addr *rem) {
+  return !c->is_udp && !c->is_listening && c->loc.port == port &&
+         c->rem.port == rem->port && c->loc.is_ip6 == rem->is_ip6 &&
+         (rem->is_ip6 ? memcmp(c->rem.addr.ip, rem->addr.ip, 16) == 0
+                      : c->rem.addr.ip4 == rem->addr.ip4);
+}
+
+static struct mg_connection **tuple_bucket(struct conn_index *ix,
+                                           uint16_t port,
+                                           const struct mg_addr *rem) {
+  return &ix->tuples[tuple_hash(port, rem) & (ix->size - 1)];
+}
+#endif
+
+static struct conn_index *conn_index_new(size_t size) {
+  size_t n = sizeof(struct conn_index) +
+             (MG_ENABLE_TCPIP ? 2 : 1) * size * sizeof(void *);
+  struct conn_index *ix = (struct conn_index *) mg_calloc(1, n);
+  if (ix != NULL) {
+    ix->size = size;
+    ix->ids = (struct mg_connection **) (ix + 1);
+#if MG_ENABLE_TCPIP
+    ix->tuples = ix->ids + size;
+#endif
+  }
+  return ix;
+}
+
+// Rehash into 2x buckets, keeping the order of connections within a bucket
+static void conn_index_grow(struct mg_mgr *mgr) {
+  struct conn_index *old = (struct conn_index *) mgr->conn_index, *ix;
+  struct mg_connection *c, *next, **p;
+  size_t i;
+  if ((ix = conn_index_new(old == NULL ? 16 : old->size * 2)) == NULL) return;
+  for (i = 0; old != NULL && i < old->size; i++) {
+    for (c = old->ids[i]; c != NULL; c = next) {
+      next = c->id_next, c->id_next = NULL;
+      p = &ix->ids[c->id & (ix->size - 1)];
+      while (*p != NULL) p = &(*p)->id_next;
+      *p = c;
+    }
+#if MG_ENABLE_TCPIP
+    for (c = old->tuples[i]; c != NULL; c = next) {
+      next = c->tuple_next, c->tuple_next = NULL;
+      p = tuple_bucket(ix, c->loc.port, &c->rem);
+      while (*p != NULL) p = &(*p)->tuple_next;
+      *p = c;
+    }
+#endif
+  }
+  ix->count = old == NULL ? 0 : old->count;
+  mg_free(old);
+  mgr->conn_index = ix;
+}
+
+static void conn_index_add(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  if (ix == NULL || ix->count >= ix->size) conn_index_grow(c->mgr);
+  if ((ix = (struct conn_index *) c->mgr->conn_index) != NULL) {
+    struct mg_connection **p = &ix->ids[c->id & (ix->size - 1)];
+    c->id_next = *p, *p = c;
+    ix->count++;
+  }
+}
+
+void mg_conn_index_del(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  struct mg_connection **p;
+  if (ix == NULL) return;
+  for (p = &ix->ids[c->id & (ix->size - 1)]; *p != NULL; p = &(*p)->id_next) {
+    if (*p == c) {
+      *p = c->id_next;
+      ix->count--;
+      break;
+    }
+  }
+#if MG_ENABLE_TCPIP
+  for (p = tuple_bucket(ix, c->loc.port, &c->rem); *p != NULL;
+       p = &(*p)->tuple_next) {
+    if (*p == c) {
+      *p = c->tuple_next;
+      break;
     }
   }
-  if (have)
-    addr->addr.ip[n] = (uint8_t) (val >> 8),
-    addr->addr.ip[n + 1] = (uint8_t) val;
-  if (n < 14 && dc == 42) return false;
-  if (n < 14) {
-    memmove(&addr->addr.ip[dc + (14 - n)], &addr->addr.ip[dc], n - dc + 2);
-    memset(&addr->addr.ip[dc], 0, 14 - n);
+#endif
+}
+
+struct mg_connection *mg_conn_by_id(struct mg_mgr *mgr, unsigned long id) {
+  struct conn_index *ix = (struct conn_index *) mgr->conn_index;
+  struct mg_connection *c;
+  if (ix == NULL) {
+    for (c = mgr->conns; c != NULL && c->id != id;) c = c->next;
+  } else {
+    c = ix->ids[id & (ix->size - 1)];
+    while (c != NULL && c->id != id) c = c->id_next;
   }
-  addr->is_ip6 = true;
-  return true;
+  return c;
 }
 
-bool mg_aton(struct mg_str str, struct mg_addr *addr) {
-  // MG_INFO(("[%.*s]", (int) str.len, str.buf));
-  return mg_atone(str, addr) || mg_atonl(str, addr) || mg_aton4(str, addr) ||
-         mg_aton6(str, addr);
+#if MG_ENABLE_TCPIP
+// Index an established TCP connection by its local port and remote address
+void mg_conn_index_tuple(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  if (ix != NULL) {
+    struct mg_connection **p = tuple_bucket(ix, c->loc.port, &c->rem);
+    c->tuple_next = *p, *p = c;
+  }
+}
+
+// Return the newest established TCP connection for the given local port and
+// remote address
+struct mg_connection *mg_conn_by_tuple(struct mg_mgr *mgr, uint16_t port,
+                                       const struct mg_addr *rem) {
+  struct conn_index *ix = (struct conn_index *) mgr->conn_index;
+  struct mg_connection *c;
+  if (ix == NULL) {
+    for (c = mgr->conns; c != NULL && !tuple_match(c, port, rem);) c = c->next;
+  } else {
+    c = *tuple_bucket(ix, port, rem);
+    while (c != NULL && !tuple_match(c, port, rem)) c = c->tuple_next;
+  }
+  return c;
 }
+#endif
 
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
-  struct mg_connection *c =
-      (struct mg_connection *) mg_calloc(1, sizeof(*c) + mgr->extraconnsize);
+  struct mg_pool *pool = &mgr->pool;
+  size_t size = sizeof(struct mg_connection) + mgr->extraconnsize;
+  struct mg_connection *c = NULL;
+  if (pool->conn_size == 0) pool->conn_size = size;
+  if (pool->conn_size != size) {  // extraconnsize has changed: stop pooling
+    pool_free(pool);
+    pool->conn_size = (size_t) -1;
+  }
+  if ((c = (struct mg_connection *) pool_pop(&pool->conn_list)) != NULL) {
+    memset(c, 0, size);
+    pool->free_conns--, pool->reused++;
+  } else {
+    c = (struct mg_connection *) mg_calloc(1, size);
+  }
   if (c != NULL) {
+    if (++pool->conns > pool->conns_peak) pool->conns_peak = pool->conns;
     c->mgr = mgr;
     c->send.align = c->recv.align = c->rtls.align = MG_IO_SIZE;
     c->id = ++mgr->nextid;
+    conn_index_add(c);
     MG_PROF_INIT(c);
   }
   return c;
 }
 
+// Once a second, give memory of large, drained IO buffers back
+void mg_mgr_shrink(struct mg_mgr *mgr, uint64_t now) {
+  struct mg_connection *c;
+  size_t max = mgr->io_shrink;
+  if (max == 0 || now < mgr->io_shrink_ms) return;
+  mgr->io_shrink_ms = now + 1000;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    if (c->recv.len == 0 && c->recv.size + c->recv.head > max) {
+      mg_iobuf_free(&c->recv);
+    }
+    if (c->send.len == 0 && c->send.size + c->send.head > max) {
+      mg_iobuf_free(&c->send);
+    }
+  }
+}
+
 void mg_close_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
   mg_resolve_cancel(c);  // Close any pending DNS query
-  LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  if (!c->is_http2) LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  mg_conn_index_del(c);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
   // Order of operations is important. `MG_EV_CLOSE` event must be fired
@@ -8061,11 +11985,18 @@ void mg_close_conn(struct mg_connection *c) {
   MG_PROF_FREE(c);
 
   mg_tls_free(c);
-  mg_iobuf_free(&c->recv);
-  mg_iobuf_free(&c->send);
-  mg_iobuf_free(&c->rtls);
+  pool_iobuf_put(mgr, &c->recv);
+  pool_iobuf_put(mgr, &c->send);
+  pool_iobuf_put(mgr, &c->rtls);
   mg_bzero((unsigned char *) c, sizeof(*c));
-  mg_free(c);
+  mgr->pool.conns--;
+  if (mgr->pool.free_conns < mgr->pool.max &&
+      mgr->pool.conn_size == sizeof(*c) + mgr->extraconnsize) {
+    pool_push(&mgr->pool.conn_list, c);
+    mgr->pool.free_conns++;
+  } else {
+    mg_free(c);
+  }
 }
 
 struct mg_connection *mg_connect_svc(struct mg_mgr *mgr, const char *url,
@@ -8110,6 +12041,8 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   } else if (!mg_open_listener(c, url)) {
     MG_ERROR(("Failed: %s", url));
     MG_PROF_FREE(c);
+    mg_conn_index_del(c);
+    mgr->pool.conns--;
     mg_free(c);
     c = NULL;
   } else {
@@ -8162,6 +12095,9 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_timer *tmp, *t = mgr->timers;
   while (t != NULL) tmp = t->next, mg_free(t), t = tmp;
   mgr->timers = NULL;  // Important. Next call to poll won't touch timers
+#if MG_ENABLE_TIMER_WHEEL
+  memset(&mgr->wheel, 0, sizeof(mgr->wheel));
+#endif
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
@@ -8170,8 +12106,20 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   MG_DEBUG(("All connections closed"));
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+#endif
+#if MG_ENABLE_IOURING
+  mg_iouring_free(mgr);
 #endif
   mg_tls_ctx_free(mgr);
+  pool_free(&mgr->pool);
+  mg_free(mgr->conn_index);
+  mgr->conn_index = NULL;
+#if MG_HTTP_CACHE_SIZE > 0
+  mg_http_cache_free(mgr);
+#endif
+#if MG_ENABLE_DEFLATE
+  mg_http_gzip_free(mgr);
+#endif
 #if MG_ENABLE_TCPIP
   if (mgr->ifp) mg_tcpip_free(mgr->ifp);
 #endif
@@ -8185,6 +12133,9 @@ void mg_mgr_init(struct mg_mgr *mgr) {
 #else
   mgr->epoll_fd = -1;
 #endif
+#if MG_ENABLE_IOURING
+  mg_iouring_init(mgr);
+#endif
 #if MG_ARCH == MG_ARCH_WIN32 && MG_ENABLE_WINSOCK
   // clang-format off
   { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
@@ -8204,6 +12155,8 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   mgr->pipe.fd = MG_INVALID_SOCKET;
 #endif
   mgr->dnstimeout = 3000;
+  mgr->io_shrink = MG_IO_SHRINK;
+  mgr->pool.max = MG_POOL_SIZE;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
   mg_tls_ctx_init(mgr);
@@ -8789,6 +12742,19 @@ static void tx_dhcp_discover(struct mg_tcpip_if *ifp) {
 static struct mg_connection *getpeer(struct mg_mgr *mgr, struct pkt *pkt,
                                      bool lsn) {
   struct mg_connection *c = NULL;
+  if (pkt->tcp != NULL && !lsn) {  // Established TCP: look up by 4-tuple
+    struct mg_addr rem;
+    memset(&rem, 0, sizeof(rem));
+    rem.port = pkt->tcp->sport;
+#if MG_ENABLE_IPV6
+    if (pkt->ip6 != NULL) {
+      rem.addr.ip6[0] = pkt->ip6->src[0], rem.addr.ip6[1] = pkt->ip6->src[1];
+      rem.is_ip6 = true;
+    } else
+#endif
+      rem.addr.ip4 = pkt->ip->src;
+    return mg_conn_by_tuple(mgr, pkt->tcp->dport, &rem);
+  }
   for (c = mgr->conns; c != NULL; c = c->next) {
     if (c->is_arplooking && pkt->arp && pkt->arp->spa == c->rem.addr.ip4) break;
 #if MG_ENABLE_IPV6
@@ -9428,8 +13394,7 @@ static bool rx_udp(struct mg_tcpip_if *ifp, struct pkt *pkt) {
   memcpy(s->mac, l2addr, sizeof(s->mac));
   if (c->recv.len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "max_recv_buf_size reached");
-  } else if (c->recv.size - c->recv.len < pkt->pay.len &&
-             !mg_iobuf_resize(&c->recv, c->recv.len + pkt->pay.len)) {
+  } else if (!mg_iobuf_reserve(&c->recv, pkt->pay.len)) {
     mg_error(c, "oom");
   } else {
     memcpy(&c->recv.buf[c->recv.len], pkt->pay.buf, pkt->pay.len);
@@ -9564,13 +13529,16 @@ static struct mg_connection *accept_conn(struct mg_connection *lsn,
   c->loc.port = lsn->loc.port;
   if ((l2addr = get_return_l2addr(lsn->mgr->ifp, &c->rem, false, pkt)) ==
       NULL) {
-    free(c);      // safety net for lousy networks, not actually needed
+    mg_conn_index_del(c);
+    lsn->mgr->pool.conns--;
+    mg_free(c);   // safety net for lousy networks, not actually needed
     return NULL;  // as path has already been checked at SYN (sending SYN+ACK)
   }
   memcpy(s->mac, l2addr, sizeof(s->mac));
   settmout(c, MIP_TTYPE_KEEPALIVE);
   MG_DEBUG(("%lu accepted %M", c->id, mg_print_ip_port, &c->rem));
   LIST_ADD_HEAD(struct mg_connection, &lsn->mgr->conns, c);
+  mg_conn_index_tuple(c);
   c->is_accepted = 1;
   c->is_hexdumping = lsn->is_hexdumping;
   c->pfn = lsn->pfn;
@@ -9637,6 +13605,7 @@ static bool udp_send(struct mg_connection *c, const void *buf, size_t len) {
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   struct connstate *s = (struct connstate *) (c + 1);
   len = trim_len(c, len);
+  c->mgr->io.sends++;
   if (c->is_udp) {
     if (!udp_send(c, buf, len)) return MG_IO_WAIT;
   } else {  // TCP, cap to peer's MSS and check window
@@ -9657,6 +13626,7 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
       if (s->ttype == MIP_TTYPE_ACK) settmout(c, MIP_TTYPE_KEEPALIVE);
     }
   }
+  c->mgr->io.bytes += len;
   return (long) len;
 }
 
@@ -9664,7 +13634,7 @@ static void handle_tls_recv(struct mg_connection *c) {
   size_t avail = mg_tls_pending(c);  // will change after mg_tls_recv()
   size_t min = avail > MG_MAX_RECV_SIZE ? MG_MAX_RECV_SIZE : avail;
   struct mg_iobuf *io = &c->recv;  // allocated on first avail > 0
-  if (io->size - io->len < min && !mg_iobuf_resize(io, io->len + min)) {
+  if (!mg_iobuf_reserve(io, min)) {
     mg_error(c, "oom");
   } else {
     // Decrypt data directly into c->recv. If io->buf = NULL or
@@ -9743,8 +13713,7 @@ static void read_conn(struct mg_connection *c, struct pkt *pkt) {
              mg_htonl(s->seq), mg_htonl(s->ack), "", 0);
     }
     return;  // drop it
-  } else if (io->size - io->len < pkt->pay.len &&
-             !mg_iobuf_resize(io, io->len + pkt->pay.len)) {
+  } else if (!mg_iobuf_reserve(io, pkt->pay.len)) {
     mg_error(c, "oom");
     return;  // drop it
   }
@@ -10407,6 +14376,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   MG_DEBUG(("%lu %M -> %M", c->id, mg_print_ip_port, &c->loc, mg_print_ip_port,
             &c->rem));
   mg_call(c, MG_EV_RESOLVE, NULL);
+  if (!c->is_udp) mg_conn_index_tuple(c);
   c->is_connecting = 1;
   if (c->is_udp && (l2addr = tcpip_mapip(ifp, &c->rem)) != NULL) {
     struct connstate *s = (struct connstate *) (c + 1);
@@ -10466,7 +14436,7 @@ static void write_conn(struct mg_connection *c) {
   if (len == MG_IO_ERR) {
     mg_error(c, "tx err");
   } else if (len > 0) {
-    mg_iobuf_del(&c->send, 0, (size_t) len);
+    mg_iobuf_skip(&c->send, (size_t) len);
     mg_call(c, MG_EV_WRITE, &len);
   }
 }
@@ -10495,7 +14465,12 @@ static bool can_write(struct mg_connection *c) {
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now = mg_millis();
+#if MG_ENABLE_TIMER_WHEEL
+  mg_timer_wheel_poll(&mgr->wheel, &mgr->timers, now);
+#else
   mg_timer_poll(&mgr->timers, now);
+#endif
+  mg_mgr_shrink(mgr, now);
   mg_ota_poll(mgr);
   if (mgr->ifp == NULL || mgr->ifp->driver == NULL) return;
   mg_tcpip_poll(mgr->ifp, now);
@@ -10542,6 +14517,7 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     len = trim_len(c, len);  // Trimming length if necessary
     res = udp_send(c, buf, len);
   } else {
+    mg_pool_iobuf(c->mgr, &c->send);
     res = len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
     // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
     // so far recoverable, let the caller decide
@@ -10549,6 +14525,14 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
   return res;
 }
 
+// The built-in stack sends from c->send only, so take a copy
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data) {
+  bool res = mg_send(c, buf, len);
+  if (res && fn != NULL) fn(fn_data);
+  return res;
+}
+
 uint8_t mcast_addr[6] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0xfb};
 void mg_multicast_add(struct mg_connection *c, char *ip) {
   (void) ip;  // ip4/6_mcastmac(mcast_mac, &ip); ipv6 param
@@ -10714,6 +14698,7 @@ static void s_version_fn(struct mg_connection *c, int ev, void *ev_data) {
         s_ota = NULL;
       } else {
         *(uint64_t *) fc->data = mg_millis() + 5 * 1000;  // Set expiration
+        fc->is_polled = 1;
       }
     }
     c->is_closing = 1;
@@ -10792,6 +14777,7 @@ void mg_ota_url_check(struct mg_mgr *mgr, const char *json_url,
     } else {
       s_ota->fn = fn;
       *(uint64_t *) c->data = mg_millis() + 5 * 1000;  // Set expiration
+      c->is_polled = 1;
     }
   }
 }
@@ -13079,7 +17065,7 @@ size_t mg_queue_printf(struct mg_queue *q, const char *fmt, ...) {
 
 static void mg_pfn_iobuf_private(char ch, void *param, bool expand) {
   struct mg_iobuf *io = (struct mg_iobuf *) param;
-  if (expand && io->len + 2 > io->size) mg_iobuf_resize(io, io->len + 2);
+  if (expand && io->len + 2 > io->size) mg_iobuf_reserve(io, 2);
   if (io->len + 2 <= io->size) {
     io->buf[io->len++] = (uint8_t) ch;
     io->buf[io->len] = 0;
@@ -13097,7 +17083,7 @@ void mg_pfn_iobuf(char ch, void *param) {
 }
 
 size_t mg_vsnprintf(char *buf, size_t len, const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {0, 0, 0, 0};
+  struct mg_iobuf io = {0, 0, 0, 0, 0};
   size_t n;
   io.buf = (uint8_t *) buf, io.size = len;
   n = mg_vxprintf(mg_pfn_iobuf_noresize, &io, fmt, ap);
@@ -13115,7 +17101,7 @@ size_t mg_snprintf(char *buf, size_t len, const char *fmt, ...) {
 }
 
 char *mg_vmprintf(const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {0, 0, 0, 256};
+  struct mg_iobuf io = {0, 0, 0, 256, 0};
   mg_vxprintf(mg_pfn_iobuf, &io, fmt, ap);
   return (char *) io.buf;
 }
@@ -14173,8 +18159,11 @@ void mg_sntp_request(struct mg_connection *c) {
 
 struct mg_connection *mg_sntp_connect(struct mg_mgr *mgr, const char *url,
                                       mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c;
   if (url == NULL) url = "udp://time.google.com:123";
-  return mg_connect_svc(mgr, url, fn, fn_data, sntp_cb, NULL);
+  c = mg_connect_svc(mgr, url, fn, fn_data, sntp_cb, NULL);
+  if (c != NULL) c->is_polled = 1;  // sntp_cb expires requests on MG_EV_POLL
+  return c;
 }
 
 
@@ -14301,6 +18290,252 @@ void mg_getlocaddr(struct mg_connection *c, struct mg_addr *to,
   closesocket(fd);
 }
 
+#if MG_ENABLE_IOURING
+// io_uring backend. The kernel accepts connections and receives data by
+// itself (multishot operations), picking receive buffers from a shared ring.
+// Sends are queued and submitted in a batch, so mg_iotest() makes a single
+// io_uring_enter() call: submit everything queued, wait for completions.
+// Completions are copied to per-connection buffers, which recv_raw() and
+// mg_io_send() use instead of recv() and send()
+#define IOU_RECV 1
+#define IOU_SEND 2
+#define IOU_ACCEPT 3
+#define IOU_POLL 4
+#define IOU_QMAX (64 * 1024)  // Max data buffered per connection and direction
+
+struct iou_conn {           // Per-connection state. After the connection is
+  struct iou_conn *next;    // closed, lives in iou::closed until the kernel
+  struct mg_connection *c;  // completes all operations. NULL when closed
+  int fd;                   // Socket to close when refs drop to 0, or -1
+  int refs;                 // Operations in flight
+  unsigned ops;             // Armed operations, bitmask of 1 << IOU_*
+  bool eof;                 // Peer has closed, or receive has failed
+  bool cancelling;          // Multishot receive is being cancelled
+  struct mg_iobuf rx;       // Received by the kernel, read by recv_raw()
+  struct mg_iobuf tx;       // Being sent by the kernel
+  struct mg_iobuf txq;      // Queued by mg_io_send(), sent after tx
+};
+
+struct iou {
+  int fd;                       // io_uring file descriptor
+  unsigned sq_entries;          // Submission queue size
+  unsigned pending;             // Submissions queued, not yet submitted
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;        // Mapped rings
+  size_t sq_len, cq_len;        // Sizes of the mapped rings
+  struct io_uring_buf_ring *br;  // Provided receive buffers
+  uint16_t br_tail;             // Our copy of br->tail
+  uint8_t *bufs;                // MG_IOURING_BUFS * MG_IOURING_BUF_SIZE
+  struct iou_conn *closed;      // Closed connections with operations in flight
+};
+
+static int iou_enter(struct iou *r, bool wait, int ms) {
+  struct __kernel_timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+  struct io_uring_getevents_arg arg;
+  unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+  int n;
+  memset(&arg, 0, sizeof(arg));
+  if (ms >= 0) arg.ts = (uint64_t) (size_t) &ts;
+  n = (int) syscall(__NR_io_uring_enter, r->fd, r->pending, wait ? 1 : 0,
+                    flags, &arg, sizeof(arg));
+  if (n > 0) r->pending -= (unsigned) n;
+  if (n < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    MG_ERROR(("io_uring_enter: %d", errno));
+  }
+  return n;
+}
+
+// Get a zeroed submission entry. Operation op on st completes with a CQE
+static struct io_uring_sqe *iou_sqe(struct iou *r, struct iou_conn *st,
+                                    unsigned op) {
+  struct io_uring_sqe *sqe = NULL;
+  unsigned tail = *r->sq_tail, idx;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    iou_enter(r, false, 0);  // Queue is full, submit what we have
+  }
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) < r->sq_entries) {
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (size_t) st | op;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    if (st != NULL) st->refs++;
+  } else {
+    MG_ERROR(("io_uring submission queue is full"));
+  }
+  return sqe;
+}
+
+// Give a receive buffer back to the kernel
+static void iou_buf_add(struct iou *r, uint16_t bid) {
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & (MG_IOURING_BUFS - 1)];
+  b->addr = (uint64_t) (size_t) &r->bufs[(size_t) bid * MG_IOURING_BUF_SIZE];
+  b->len = MG_IOURING_BUF_SIZE;
+  b->bid = bid;
+  r->br_tail++;
+  __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void iou_arm(struct iou *r, struct iou_conn *st, unsigned op,
+                    unsigned events) {
+  struct io_uring_sqe *sqe = iou_sqe(r, st, op);
+  if (sqe == NULL) return;
+  sqe->fd = (int) (size_t) st->c->fd;
+  if (op == IOU_ACCEPT) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  } else if (op == IOU_RECV) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = events;
+  }
+  st->ops |= 1U << op;
+}
+
+static void iou_cancel(struct iou *r, struct iou_conn *st, unsigned op) {
+  struct io_uring_sqe *sqe;
+  if ((st->ops & (1U << op)) && (sqe = iou_sqe(r, NULL, 0)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (size_t) st | op;
+  }
+}
+
+// Send tx, or the queued data if tx is done. One send in flight at a time
+static void iou_flush(struct iou *r, struct iou_conn *st) {
+  struct io_uring_sqe *sqe;
+  if (st->ops & (1U << IOU_SEND)) return;
+  if (st->tx.len == 0) {
+    struct mg_iobuf tmp = st->tx;
+    st->tx = st->txq, st->txq = tmp;
+  }
+  if (st->tx.len > 0 && (sqe = iou_sqe(r, st, IOU_SEND)) != NULL) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = st->fd >= 0 ? st->fd : (int) (size_t) st->c->fd;
+    sqe->addr = (uint64_t) (size_t) st->tx.buf;
+    sqe->len = (uint32_t) st->tx.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    st->ops |= 1U << IOU_SEND;
+  }
+}
+
+static struct iou_conn *iou_conn(struct mg_connection *c) {
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  if (st == NULL && (st = (struct iou_conn *) mg_calloc(1, sizeof(*st)))) {
+    st->c = c;
+    st->fd = -1;
+    st->rx.align = st->tx.align = st->txq.align = MG_IO_SIZE;
+    c->iou = st;
+  }
+  return st;
+}
+
+// TCP connections receive with io_uring. Others, like UDP, are polled
+static bool iou_stream(const struct mg_connection *c) {
+  return c->mgr->iou != NULL && !c->is_udp && !c->is_listening &&
+         (c->is_accepted || c->is_client);
+}
+
+static long iou_recv(struct mg_connection *c, void *buf, size_t len) {
+  struct iou_conn *st = iou_conn(c);
+  if (st == NULL) return MG_IO_ERR;
+  if (st->rx.len == 0) return st->eof ? MG_IO_ERR : MG_IO_WAIT;
+  if (len > st->rx.len) len = st->rx.len;
+  memcpy(buf, st->rx.buf, len);
+  mg_iobuf_skip(&st->rx, len);
+  return (long) len;
+}
+
+static long iou_send(struct mg_connection *c, const void *buf, size_t len) {
+  struct iou_conn *st = iou_conn(c);
+  if (st == NULL) return MG_IO_ERR;
+  if (st->txq.len >= IOU_QMAX) return MG_IO_WAIT;
+  if (len > IOU_QMAX - st->txq.len) len = IOU_QMAX - st->txq.len;
+  if (mg_iobuf_add(&st->txq, st->txq.len, buf, len) == 0) return MG_IO_WAIT;
+  iou_flush((struct iou *) c->mgr->iou, st);
+  return (long) len;
+}
+
+static void iou_release(struct iou *r, struct iou_conn *st) {
+  LIST_DELETE(struct iou_conn, &r->closed, st);
+  if (st->fd >= 0) closesocket(st->fd);
+  mg_iobuf_free(&st->rx);
+  mg_iobuf_free(&st->tx);
+  mg_iobuf_free(&st->txq);
+  mg_free(st);
+}
+
+// Connection is closing: cancel receives. Returns true if the kernel is
+// still sending queued data. Then the socket is closed when it is done
+static bool iou_close(struct mg_connection *c) {
+  struct iou *r = (struct iou *) c->mgr->iou;
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  bool sending;
+  if (st == NULL || r == NULL) return false;
+  iou_cancel(r, st, IOU_RECV);
+  iou_cancel(r, st, IOU_ACCEPT);
+  iou_cancel(r, st, IOU_POLL);
+  c->iou = NULL;
+  st->c = NULL;
+  st->rx.len = 0;
+  sending = st->tx.len > 0 || st->txq.len > 0;
+  st->fd = sending ? (int) (size_t) c->fd : -1;
+  LIST_ADD_HEAD(struct iou_conn, &r->closed, st);
+  if (st->refs == 0) iou_release(r, st);
+  return sending;
+}
+#endif
+
+// mg_send_ref() buffer. Goes to the socket after pos bytes of c->send
+struct sref {
+  struct sref *next;
+  const char *buf;       // Caller-owned data
+  size_t len;            // Data length
+  size_t ofs;            // Bytes of buf already sent
+  size_t pos;            // Offset in c->send
+  void (*fn)(void *);    // Called when buf is no longer needed
+  void *fn_data;
+};
+
+static void sref_done(struct mg_connection *c, struct sref *r) {
+  c->send_refs = r->next;
+  c->send_refs_len -= r->len - r->ofs;
+  if (r->fn != NULL) r->fn(r->fn_data);
+  mg_free(r);
+}
+
+// n bytes got sent: drop them from c->send and the queued buffers
+static void sent(struct mg_connection *c, size_t n) {
+  struct sref *r;
+  while (n > 0 && (r = (struct sref *) c->send_refs) != NULL) {
+    if (r->pos > 0) {
+      size_t k = n < r->pos ? n : r->pos;
+      mg_iobuf_skip(&c->send, k);
+      for (; r != NULL; r = r->next) r->pos -= k;
+      n -= k;
+    } else {
+      size_t k = n < r->len - r->ofs ? n : r->len - r->ofs;
+      c->send_refs_len -= k;
+      if ((r->ofs += k) == r->len) sref_done(c, r);
+      n -= k;
+    }
+  }
+  if (n > 0) mg_iobuf_skip(&c->send, n);
+}
+
+static bool has_output(const struct mg_connection *c) {
+  return c->send.len > 0 || c->send_refs != NULL;
+}
+
 static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
   if (n == MG_IO_WAIT) {
     // Do nothing
@@ -14316,9 +18551,9 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
       c->recv.len += (size_t) n;
       mg_call(c, MG_EV_READ, &n);
     } else {
-      mg_iobuf_del(&c->send, 0, (size_t) n);
+      sent(c, (size_t) n);
       // if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
-      if (c->send.len == 0) {
+      if (!has_output(c)) {
         MG_EPOLL_MOD(c, 0);
       }
       mg_call(c, MG_EV_WRITE, &n);
@@ -14326,8 +18561,18 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
   }
 }
 
+// Count a send call and the bytes it took in mgr->io
+static long iostat(struct mg_connection *c, long n) {
+  c->mgr->io.sends++;
+  if (n > 0) c->mgr->io.bytes += (size_t) n;
+  return n;
+}
+
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   long n;
+#if MG_ENABLE_IOURING
+  if (iou_stream(c)) return iostat(c, iou_send(c, buf, len));
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -14336,6 +18581,7 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
+  iostat(c, n);
   MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
   if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
   if (MG_SOCK_RESET(n)) return MG_IO_ERR;  // See #1507, #3031
@@ -14343,6 +18589,18 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   return n;
 }
 
+#if MG_ENABLE_SENDFILE
+// Send up to len bytes of file fd, starting at its current offset, straight
+// from the page cache. Caller sets c->is_sendfile to wait for writability
+long mg_io_sendfile(struct mg_connection *c, int fd, size_t len) {
+  long n = iostat(c, (long) sendfile(FD(c), fd, NULL, len));
+  MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
+  if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
+  if (n < 0) return MG_IO_ERR;
+  return n;
+}
+#endif
+
 bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
   if (c->is_udp) {
     long n = mg_io_send(c, buf, len);
@@ -14351,12 +18609,37 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
-    return len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
+    bool ok;
+    mg_pool_iobuf(c->mgr, &c->send);
+    ok = len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
     // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
     // so far recoverable, let the caller decide
+    if (c->send.len > 0) {
+      MG_EPOLL_MOD(c, 1);
+    }
+    return ok;
   }
 }
 
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data) {
+  struct sref *r, **p;
+  if (c->is_udp || c->is_http2 || len == 0) {  // Datagrams, streams: copy
+    bool ok = mg_send(c, buf, len);
+    if (ok && fn != NULL) fn(fn_data);
+    return ok;
+  }
+  if ((r = (struct sref *) mg_calloc(1, sizeof(*r))) == NULL) return false;
+  r->buf = (const char *) buf, r->len = len, r->pos = c->send.len;
+  r->fn = fn, r->fn_data = fn_data;
+  c->send_refs_len += len;
+  p = (struct sref **) &c->send_refs;
+  while (*p != NULL) p = &(*p)->next;
+  *p = r;
+  MG_EPOLL_MOD(c, 1);
+  return true;
+}
+
 static void mg_set_non_blocking_mode(MG_SOCKET_TYPE fd) {
 #if defined(MG_CUSTOM_NONBLOCK)
   MG_CUSTOM_NONBLOCK(fd);
@@ -14449,6 +18732,13 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       // won't work! (setsockopt will return EINVAL)
       MG_ERROR(("setsockopt(SO_REUSEADDR): %d", MG_SOCK_ERR(rc)));
 #endif
+#if MG_ENABLE_REUSEPORT && defined(SO_REUSEPORT)
+    } else if ((rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                                sizeof(on))) != 0) {
+      // Several managers, each polled by its own thread, can listen on the
+      // same address. The kernel spreads incoming connections between them
+      MG_ERROR(("setsockopt(SO_REUSEPORT): %d", MG_SOCK_ERR(rc)));
+#endif
 #if MG_IPV6_V6ONLY
       // Bind only to the V6 address, not V4 address on this port
     } else if (c->loc.is_ip6 &&
@@ -14478,6 +18768,9 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
 
 static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
   long n = 0;
+#if MG_ENABLE_IOURING
+  if (iou_stream(c)) return iou_recv(c, buf, len);
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -14493,12 +18786,21 @@ static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
   return n;
 }
 
+// Grow a receive buffer, but not beyond MG_MAX_RECV_SIZE
+static bool iogrow(struct mg_iobuf *io) {
+  size_t max = MG_MAX_RECV_SIZE;
+  if (MG_IO_GROW_MAX > 0 && io->size < max && io->size >= max / 2) {
+    return mg_iobuf_resize(io, max);
+  }
+  return mg_iobuf_reserve(io, MG_IO_SIZE);
+}
+
 static bool ioalloc(struct mg_connection *c, struct mg_iobuf *io) {
   bool res = false;
+  mg_pool_iobuf(c->mgr, io);
   if (io->len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "MG_MAX_RECV_SIZE");
-  } else if (io->size <= io->len &&
-             !mg_iobuf_resize(io, io->size + MG_IO_SIZE)) {
+  } else if (io->size <= io->len && !iogrow(io)) {
     mg_error(c, "OOM");
   } else {
     res = true;
@@ -14545,10 +18847,71 @@ static void read_conn(struct mg_connection *c) {
   iolog(c, (char *) &c->recv.buf[c->recv.len], n, true);
 }
 
+#define MG_IOV_MAX 16
+
+// Split c->send and queued mg_send_ref() buffers into segments, in order
+static size_t segments(struct mg_connection *c, struct mg_str *seg) {
+  struct sref *r;
+  size_t n = 0, ofs = 0;
+  for (r = (struct sref *) c->send_refs; r != NULL; r = r->next) {
+    if (r->pos > ofs && n < MG_IOV_MAX) {
+      seg[n++] = mg_str_n((char *) c->send.buf + ofs, r->pos - ofs);
+    }
+    if (n < MG_IOV_MAX) seg[n++] = mg_str_n(r->buf + r->ofs, r->len - r->ofs);
+    ofs = r->pos;
+  }
+  if (c->send.len > ofs && n < MG_IOV_MAX) {
+    seg[n++] = mg_str_n((char *) c->send.buf + ofs, c->send.len - ofs);
+  }
+  return n;
+}
+
+// Send all segments with a single system call
+static long send_segments(struct mg_connection *c, struct mg_str *seg,
+                          size_t n) {
+#if MG_ARCH == MG_ARCH_UNIX
+  struct iovec iov[MG_IOV_MAX];
+  struct msghdr msg;
+  long res;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = seg[i].buf;
+    iov[i].iov_len = seg[i].len;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  res = iostat(c, (long) sendmsg(FD(c), &msg, MSG_NONBLOCKING));
+  MG_VERBOSE(("%lu %ld %d", c->id, res, MG_SOCK_ERR(res)));
+  if (MG_SOCK_PENDING(res)) return MG_IO_WAIT;
+  if (res <= 0) return MG_IO_ERR;
+  return res;
+#else
+  (void) n;
+  return mg_io_send(c, seg[0].buf, seg[0].len);
+#endif
+}
+
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+  long n;
+  if (c->send_refs != NULL) {
+    struct mg_str seg[MG_IOV_MAX];
+    size_t nseg;
+    seg[0] = mg_str_n(buf, len);
+    nseg = segments(c, seg);
+    buf = seg[0].buf, len = seg[0].len;
+#if MG_ENABLE_IOURING
+    if (iou_stream(c)) nseg = 1;  // io_uring copies data anyway
+#endif
+    if (c->is_tls || c->is_hexdumping) nseg = 1;
+    if (nseg > 1) {
+      iolog(c, buf, send_segments(c, seg, nseg), false);
+      return;
+    }
+  }
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
   // TODO(): mg_tls_send() may return 0 forever on steady OOM
   MG_DEBUG(("%lu %ld snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
@@ -14557,11 +18920,15 @@ static void write_conn(struct mg_connection *c) {
 }
 
 static void close_conn(struct mg_connection *c) {
+  while (c->send_refs != NULL) sref_done(c, (struct sref *) c->send_refs);
   if (FD(c) != MG_INVALID_SOCKET) {
 #if MG_ENABLE_EPOLL
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
 #endif
-    closesocket(FD(c));
+#if MG_ENABLE_IOURING
+    if (iou_close(c) == false)  // Otherwise, closed when data is sent
+#endif
+      closesocket(FD(c));
 #if MG_ENABLE_FREERTOS_TCP
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
 #endif
@@ -14637,6 +19004,7 @@ void mg_connect_resolved(struct mg_connection *c) {
     } else if (MG_SOCK_PENDING(rc)) {    // Need to wait for TCP handshake
       MG_DEBUG(("%lu %ld -> %M pend", c->id, c->fd, mg_print_ip_port, &c->rem));
       c->is_connecting = 1;
+      MG_EPOLL_MOD(c, 1);
     } else {
       mg_error(c, "connect: %d", MG_SOCK_ERR(rc));
     }
@@ -14661,30 +19029,24 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Set up a connection for the socket fd, accepted by the listener lsn
+static void accept_fd(struct mg_mgr *mgr, struct mg_connection *lsn,
+                      MG_SOCKET_TYPE fd, union usa *usa, socklen_t sa_len) {
   struct mg_connection *c = NULL;
-  union usa usa;
-  socklen_t sa_len = sizeof(usa);
-  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
-  if (fd == MG_INVALID_SOCKET) {
-#if MG_ARCH == MG_ARCH_THREADX || defined(__ECOS)
-    // NetxDuo, in non-block socket mode can mark listening socket readable
-    // even it is not. See comment for 'select' func implementation in
-    // nx_bsd.c That's not an error, just should try later
-    if (errno != EAGAIN)
-#endif
-      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
 #if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
-    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL
-  } else if ((long) fd >= FD_SETSIZE) {
+    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL && \
+    !MG_ENABLE_IOURING
+  if ((long) fd >= FD_SETSIZE) {
     MG_ERROR(("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
+    return;
+  }
 #endif
-  } else if ((c = mg_alloc_conn(mgr)) == NULL) {
+  if ((c = mg_alloc_conn(mgr)) == NULL) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
   } else {
-    tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
+    tomgaddr(usa, &c->rem, sa_len != sizeof(usa->sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
@@ -14706,12 +19068,30 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   }
 }
 
+static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  union usa usa;
+  socklen_t sa_len = sizeof(usa);
+  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
+  if (fd == MG_INVALID_SOCKET) {
+#if MG_ARCH == MG_ARCH_THREADX || defined(__ECOS)
+    // NetxDuo, in non-block socket mode can mark listening socket readable
+    // even it is not. See comment for 'select' func implementation in
+    // nx_bsd.c That's not an error, just should try later
+    if (errno != EAGAIN)
+#endif
+      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
+  } else {
+    accept_fd(mgr, lsn, fd, &usa, sa_len);
+  }
+}
+
 static bool can_read(const struct mg_connection *c) {
   return c->is_full == false;
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting || (has_output(c) && c->is_tls_hs == 0) ||
+         c->is_sendfile;
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -14719,6 +19099,197 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+#if MG_ENABLE_IOURING
+static void iou_cqe(struct mg_mgr *mgr, struct io_uring_cqe *cqe) {
+  struct iou *r = (struct iou *) mgr->iou;
+  struct iou_conn *st = (struct iou_conn *) (size_t) (cqe->user_data & ~(uint64_t) 7);
+  unsigned op = (unsigned) (cqe->user_data & 7);
+  struct mg_connection *c;
+  if (st == NULL) return;  // Cancel request done
+  c = st->c;
+  if (op == IOU_SEND) {
+    st->ops &= ~(1U << IOU_SEND);
+    if (cqe->res < 0) {
+      if (c != NULL) mg_error(c, "send: %d", -cqe->res);
+      st->tx.len = st->txq.len = 0;
+    } else {
+      mg_iobuf_skip(&st->tx, (size_t) cqe->res);  // Resend what's left
+    }
+    iou_flush(r, st);
+  } else {
+    if (op == IOU_RECV) {
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8_t *buf = &r->bufs[(size_t) bid * MG_IOURING_BUF_SIZE];
+        if (c != NULL && cqe->res > 0 &&
+            mg_iobuf_add(&st->rx, st->rx.len, buf, (size_t) cqe->res) == 0) {
+          mg_error(c, "OOM");
+        }
+        iou_buf_add(r, bid);
+      }
+      // -ENOBUFS: out of receive buffers, mg_mgr_poll() re-arms
+      if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                            cqe->res != -ECANCELED)) {
+        st->eof = true;
+      }
+      if (c != NULL && can_read(c)) c->is_readable = 1;
+    } else if (op == IOU_ACCEPT) {
+      if (cqe->res >= 0 && c != NULL && !c->is_closing) {
+        union usa usa;
+        socklen_t slen = sizeof(usa);
+        memset(&usa, 0, sizeof(usa));
+        getpeername(cqe->res, &usa.sa, &slen);
+        accept_fd(mgr, c, cqe->res, &usa, slen);
+      } else if (cqe->res >= 0) {
+        closesocket(cqe->res);
+      } else if (c != NULL && cqe->res != -ECANCELED) {
+        MG_ERROR(("%lu accept failed, errno %d", c->id, -cqe->res));
+      }
+    } else if (op == IOU_POLL && c != NULL && cqe->res > 0) {
+      if (cqe->res & POLLERR) {
+        mg_error(c, "socket error");
+      } else {
+        bool rd = cqe->res & (POLLIN | POLLHUP);
+        c->is_readable = can_read(c) && rd ? 1U : 0;
+        c->is_writable = cqe->res & POLLOUT ? 1U : 0;
+      }
+    }
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+      st->ops &= ~(1U << op);
+      if (op == IOU_RECV) st->cancelling = false;
+    }
+  }
+  if ((cqe->flags & IORING_CQE_F_MORE) == 0) st->refs--;
+  if (st->c == NULL && st->refs == 0) iou_release(r, st);
+}
+
+// TCP connections can send while there is room in the send queue
+static bool iou_writable(struct mg_connection *c) {
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  if (!iou_stream(c)) return c->is_writable;
+  return can_write(c) && (st == NULL || st->txq.len < IOU_QMAX);
+}
+
+// Called by mg_mgr_poll() for every connection it has processed: arm
+// operations that are not armed yet, and reset flags
+static void iou_sync(struct mg_connection *c) {
+  struct iou *r = (struct iou *) c->mgr->iou;
+  struct iou_conn *st;
+  c->is_readable = c->is_writable = 0;
+  if (r == NULL || c->is_resolving || FD(c) == MG_INVALID_SOCKET) return;
+  if ((st = iou_conn(c)) == NULL) return;
+  if (c->is_listening && !c->is_udp) {
+    if (!(st->ops & (1U << IOU_ACCEPT))) iou_arm(r, st, IOU_ACCEPT, 0);
+  } else if (c->is_connecting) {
+    if (!(st->ops & (1U << IOU_POLL))) iou_arm(r, st, IOU_POLL, POLLOUT);
+  } else if (!iou_stream(c)) {
+    if (!(st->ops & (1U << IOU_POLL)) && can_read(c)) {
+      iou_arm(r, st, IOU_POLL, POLLIN);
+    }
+  } else {
+    if (iou_writable(c)) c->mgr->epoll_busy = true;  // Send on next poll
+    if (!can_read(c) || st->rx.len >= IOU_QMAX) {
+      // Stop receiving until the application catches up
+      if ((st->ops & (1U << IOU_RECV)) && !st->cancelling) {
+        iou_cancel(r, st, IOU_RECV);
+        st->cancelling = true;
+      }
+    } else if (!(st->ops & (1U << IOU_RECV)) && !st->eof) {
+      iou_arm(r, st, IOU_RECV, 0);
+    }
+    if (can_read(c) && (st->rx.len > 0 || st->eof)) c->is_readable = 1;
+  }
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
+  if (c->is_readable) c->mgr->epoll_busy = true;  // Don't block
+}
+
+void mg_iouring_init(struct mg_mgr *mgr) {
+  struct iou *r = (struct iou *) mg_calloc(1, sizeof(*r));
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t brlen = MG_IOURING_BUFS * sizeof(struct io_uring_buf);
+  uint8_t *sq;
+  uint16_t i;
+  memset(&p, 0, sizeof(p));
+  memset(&reg, 0, sizeof(reg));
+  if (r == NULL) {
+    MG_ERROR(("OOM"));
+    return;
+  }
+  r->fd = (int) syscall(__NR_io_uring_setup, MG_IOURING_ENTRIES, &p);
+  if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+    MG_ERROR(("io_uring_setup: %d", errno));
+    if (r->fd >= 0) close(r->fd);
+    mg_free(r);
+    return;
+  }
+  r->sq_entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+                  ? r->sq_ptr
+                  : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe *) mmap(
+      NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  r->br = (struct io_uring_buf_ring *) mmap(NULL, brlen, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  r->bufs = (uint8_t *) mg_calloc(MG_IOURING_BUFS, MG_IOURING_BUF_SIZE);
+  mgr->iou = r;
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+      r->sqes == MAP_FAILED || r->br == MAP_FAILED || r->bufs == NULL) {
+    MG_ERROR(("io_uring init: %d", errno));
+    mg_iouring_free(mgr);
+    return;
+  }
+  sq = (uint8_t *) r->sq_ptr;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((uint8_t *) r->cq_ptr + p.cq_off.cqes);
+  reg.ring_addr = (uint64_t) (size_t) r->br;
+  reg.ring_entries = MG_IOURING_BUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) != 0) {
+    MG_ERROR(("io_uring buffer ring: %d", errno));
+    mg_iouring_free(mgr);
+    return;
+  }
+  for (i = 0; i < MG_IOURING_BUFS; i++) iou_buf_add(r, i);
+}
+
+void mg_iouring_free(struct mg_mgr *mgr) {
+  struct iou *r = (struct iou *) mgr->iou;
+  size_t brlen = MG_IOURING_BUFS * sizeof(struct io_uring_buf);
+  if (r == NULL) return;
+  close(r->fd);  // Cancels all operations in flight
+  while (r->closed != NULL) iou_release(r, r->closed);
+  if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+  }
+  if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+  if (r->br != NULL && r->br != MAP_FAILED) munmap(r->br, brlen);
+  mg_free(r->bufs);
+  mg_free(r);
+  mgr->iou = NULL;
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
@@ -14740,29 +19311,43 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                       eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
 #elif MG_ENABLE_EPOLL
-  size_t max = 1;
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
-    c->is_readable = c->is_writable = 0;
-    if (c->rtls.len > 0 || mg_tls_pending(c) > 0) ms = 1, c->is_readable = 1;
-    if (can_write(c)) MG_EPOLL_MOD(c, 1);
-    if (c->is_closing) ms = 1;
-    max++;
-  }
-  struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
-  int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
-  for (int i = 0; i < n; i++) {
+  // No walk over mgr->conns here. EPOLLOUT interest is kept in sync by
+  // MG_EPOLL_MOD() and flags are reset by mg_mgr_poll() after processing
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  int i, n;
+  if (mgr->epoll_busy) ms = 1;
+  n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms);
+  for (i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
     if (evs[i].events & EPOLLERR) {
       mg_error(c, "socket error");
-    } else if (c->is_readable == 0) {
-      bool rd = evs[i].events & (EPOLLIN | EPOLLHUP);
-      bool wr = evs[i].events & EPOLLOUT;
-      c->is_readable = can_read(c) && rd ? 1U : 0;
-      c->is_writable = can_write(c) && wr ? 1U : 0;
+    } else {  // Flags may be set already, e.g. by buffered TLS data
+      if ((evs[i].events & (EPOLLIN | EPOLLHUP)) && can_read(c)) {
+        c->is_readable = 1;
+      }
+      if ((evs[i].events & EPOLLOUT) && can_write(c)) c->is_writable = 1;
       if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
     }
   }
   (void) skip_iotest;
+#elif MG_ENABLE_IOURING
+  struct iou *r = (struct iou *) mgr->iou;
+  unsigned head, tail;
+  if (r == NULL) {
+    poll(NULL, 0, ms);  // io_uring init has failed
+    return;
+  }
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  if (mgr->epoll_busy || head != tail) ms = 0;
+  // Submit what has been queued and wait, all in one system call
+  if (ms != 0 || r->pending > 0) iou_enter(r, ms != 0, ms);
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    iou_cqe(mgr, &r->cqes[head & *r->cq_mask]);
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  (void) skip_iotest;
 #elif MG_ENABLE_POLL
   nfds_t n = 0;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) n++;
@@ -14892,13 +19477,11 @@ static void wufn(struct mg_connection *c, int ev, void *ev_data) {
     // MG_INFO(("Got data"));
     // mg_hexdump(c->recv.buf, c->recv.len);
     if (c->recv.len >= sizeof(*id)) {
-      struct mg_connection *t;
-      for (t = c->mgr->conns; t != NULL; t = t->next) {
-        if (t->id == *id) {
-          struct mg_str data = mg_str_n((char *) c->recv.buf + sizeof(*id),
-                                        c->recv.len - sizeof(*id));
-          mg_call(t, MG_EV_WAKEUP, &data);
-        }
+      struct mg_connection *t = mg_conn_by_id(c->mgr, *id);
+      if (t != NULL) {
+        struct mg_str data = mg_str_n((char *) c->recv.buf + sizeof(*id),
+                                      c->recv.len - sizeof(*id));
+        mg_call(t, MG_EV_WAKEUP, &data);
       }
     }
     c->recv.len = 0;  // Consume received data
@@ -14940,21 +19523,71 @@ bool mg_wakeup(struct mg_mgr *mgr, unsigned long conn_id, const void *buf,
     send(mgr->pipe.fd, extended_buf, len + sizeof(conn_id), MSG_NONBLOCKING);
     return true;
   }
-  return false;
+  return false;
+}
+
+// Nothing to read, write, flush or close, and no MG_EV_POLL requested
+static bool is_idle(const struct mg_connection *c) {
+#if MG_ENABLE_IOURING
+  if (c->iou == NULL) return false;  // New connection, nothing armed yet
+#endif
+  return c->is_polled == 0 && c->is_readable == 0 && c->is_writable == 0 &&
+         c->is_closing == 0 && c->is_draining == 0 && c->is_resp == 0 &&
+         c->is_tls_throttled == 0 && !has_output(c) && c->recv.len == 0 &&
+         c->rtls.len == 0;
+}
+
+// Write pending output, then close the connection or re-arm its events
+static void flush_conn(struct mg_connection *c, bool io) {
+  if (io) {
+#if MG_ENABLE_IOURING
+    c->is_writable = iou_writable(c) ? 1U : 0;
+#endif
+    if (c->is_writable && has_output(c)) write_conn(c);
+    if (c->is_tls && !c->is_tls_hs && !has_output(c)) mg_tls_flush(c);
+  }
+  if (c->is_draining && !has_output(c)) c->is_closing = 1;
+  if (c->is_closing) {
+    close_conn(c);
+    return;
+  }
+#if MG_ENABLE_EPOLL
+  MG_EPOLL_MOD(c, can_write(c));
+  c->is_readable = c->is_writable = 0;
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) {
+    c->is_readable = 1;
+    c->mgr->epoll_busy = true;  // Decrypted data is ready, don't block
+  }
+#elif MG_ENABLE_IOURING
+  iou_sync(c);
+#endif
 }
 
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
+  bool deferred = false;
   uint64_t now;
 
+#if MG_ENABLE_TIMER_WHEEL
+  ms = mg_timer_wheel_timeout(&mgr->wheel, mg_millis(), ms);  // Next timer
+#endif
   mg_iotest(mgr, ms);
   now = mg_millis();
+#if MG_ENABLE_TIMER_WHEEL
+  mg_timer_wheel_poll(&mgr->wheel, &mgr->timers, now);
+#else
   mg_timer_poll(&mgr->timers, now);
+#endif
+  mg_mgr_shrink(mgr, now);
   mg_ota_poll(mgr);
 
+#if MG_ENABLE_EPOLL || MG_ENABLE_IOURING
+  mgr->epoll_busy = false;
+#endif
   for (c = mgr->conns; c != NULL; c = tmp) {
-    bool is_resp = c->is_resp;
+    bool is_resp = c->is_resp, io = false, had_output = has_output(c);
     tmp = c->next;
+    if (mgr->poll_opt_in && is_idle(c)) continue;
     mg_call(c, MG_EV_POLL, &now);
     if (is_resp && !c->is_resp) {
       long n = 0;
@@ -14973,12 +19606,24 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_readable || c->is_writable) connect_conn(c);
     } else {
       if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
-      if (c->is_tls && !c->is_tls_hs && c->send.len == 0) mg_tls_flush(c);
+      io = true;
+    }
+    if (io && (mgr->coalesce || c->is_coalescing)) {
+      // Output queued during this iteration was not polled for, the socket
+      // is likely writable: try it. Otherwise, wait for the poller's word
+      if (!had_output && !c->is_tls_hs) c->is_writable = 1;
+      c->is_coalesced = 1;
+      deferred = true;
+    } else {
+      flush_conn(c, io);
     }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+  }
+  // Now all handlers have run, flush what they have queued
+  for (c = mgr->conns; deferred && c != NULL; c = tmp) {
+    tmp = c->next;
+    if (c->is_coalesced == 0) continue;
+    c->is_coalesced = 0;
+    flush_conn(c, true);
   }
 }
 #endif
@@ -15001,7 +19646,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE};
+  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE, 0};
   FILE *fp = fopen(path, "rb");
   if (fp != NULL) {
     char buf[MG_SSI_BUFSIZ], arg[sizeof(buf)];
@@ -15302,16 +19947,39 @@ bool mg_str_to_num(struct mg_str str, int base, void *val, size_t val_len) {
 
 
 
+#define MG_WHEEL_BITS 6  // 64 slots per level
+#define MG_WHEEL_MASK 63
+
 void mg_timer_init(struct mg_timer **head, struct mg_timer *t, uint64_t ms,
                    unsigned flags, void (*fn)(void *), void *arg) {
   t->period_ms = ms, t->expire = 0;
   t->flags = flags, t->fn = fn, t->arg = arg, t->next = *head;
+  t->prev = head, t->wnext = NULL, t->wprev = NULL;
+  if (*head != NULL) (*head)->prev = &t->next;
   *head = t;
 }
 
+static void wheel_link(struct mg_timer **slot, struct mg_timer *t) {
+  t->wnext = *slot, t->wprev = slot;
+  if (*slot != NULL) (*slot)->wprev = &t->wnext;
+  *slot = t;
+}
+
+static void wheel_unlink(struct mg_timer *t) {
+  if (t->wprev == NULL) return;
+  if (t->wnext != NULL) t->wnext->wprev = t->wprev;
+  *t->wprev = t->wnext;
+  t->wnext = NULL, t->wprev = NULL;
+}
+
 void mg_timer_free(struct mg_timer **head, struct mg_timer *t) {
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+  if (t->prev != NULL) {
+    if (t->next != NULL) t->next->prev = t->prev;
+    *t->prev = t->next;
+    t->prev = NULL;
+  }
+  wheel_unlink(t);
+  (void) head;
 }
 
 // t: expiration time, prd: period, now: current time. Return true if expired
@@ -15323,27 +19991,159 @@ bool mg_timer_expired(uint64_t *t, uint64_t prd, uint64_t now) {
   return true;                                   // Expired, return true
 }
 
+// Call timer function if timer has expired. Return false if timer is deleted
+static bool timer_run(struct mg_timer **head, struct mg_timer *t,
+                      uint64_t now_ms) {
+  bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
+              !(t->flags & MG_TIMER_CALLED);  // Handle MG_TIMER_NOW only once
+  bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
+  if (!once && !expired) return true;
+  if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+    t->fn(t->arg);
+  }
+  t->flags |= MG_TIMER_CALLED;
+
+  // If this timer is not repeating and marked AUTODELETE, remove it
+  if (!(t->flags & MG_TIMER_REPEAT) && (t->flags & MG_TIMER_AUTODELETE)) {
+    mg_timer_free(head, t);
+    mg_free(t);
+    return false;
+  }
+  return true;
+}
+
 void mg_timer_poll(struct mg_timer **head, uint64_t now_ms) {
   struct mg_timer *t, *tmp;
   for (t = *head; t != NULL; t = tmp) {
-    bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
-                !(t->flags & MG_TIMER_CALLED);  // Handle MG_TIMER_NOW only once
-    bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
     tmp = t->next;
-    if (!once && !expired) continue;
-    if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
-      t->fn(t->arg);
-    }
-    t->flags |= MG_TIMER_CALLED;
+    timer_run(head, t, now_ms);
+  }
+}
+
+static unsigned wheel_ctz(uint64_t x) {
+  unsigned n = 0;
+  if ((x & 0xffffffffU) == 0) n += 32, x >>= 32;
+  if ((x & 0xffffU) == 0) n += 16, x >>= 16;
+  if ((x & 0xffU) == 0) n += 8, x >>= 8;
+  if ((x & 0xfU) == 0) n += 4, x >>= 4;
+  if ((x & 0x3U) == 0) n += 2, x >>= 2;
+  if ((x & 0x1U) == 0) n += 1;
+  return n;
+}
 
-    // If this timer is not repeating and marked AUTODELETE, remove it
-    if (!(t->flags & MG_TIMER_REPEAT) && (t->flags & MG_TIMER_AUTODELETE)) {
-      mg_timer_free(head, t);
-      mg_free(t);
+// Put timer to the level whose slot span covers its expiration time. Timers
+// beyond the last level go to its farthest slot and get re-added on cascade
+static void wheel_add(struct mg_timer_wheel *w, struct mg_timer *t) {
+  uint64_t max = ((uint64_t) 1 << (MG_WHEEL_BITS * MG_TIMER_WHEEL_LEVELS)) - 1;
+  uint64_t when = t->expire < w->tick ? w->tick : t->expire;
+  unsigned level = 0, idx;
+  if (when - w->tick > max) when = w->tick + max;
+  while (level + 1 < MG_TIMER_WHEEL_LEVELS &&
+         when - w->tick >= ((uint64_t) 1 << (MG_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+  idx = (unsigned) (when >> (MG_WHEEL_BITS * level)) & MG_WHEEL_MASK;
+  wheel_link(&w->slots[level][idx], t);
+  w->bits[level] |= (uint64_t) 1 << idx;
+}
+
+static void wheel_take(struct mg_timer_wheel *w, unsigned level, unsigned idx,
+                       struct mg_timer **list) {
+  struct mg_timer *t;
+  while ((t = w->slots[level][idx]) != NULL) {
+    wheel_unlink(t);
+    wheel_link(list, t);
+  }
+  w->bits[level] &= ~((uint64_t) 1 << idx);
+}
+
+// Re-add timers of a coarse slot when the wheel reaches its span
+static void wheel_cascade(struct mg_timer_wheel *w, unsigned level,
+                          unsigned idx) {
+  struct mg_timer *t, *list = NULL;
+  wheel_take(w, level, idx, &list);
+  while ((t = list) != NULL) wheel_unlink(t), wheel_add(w, t);
+}
+
+// Return the first tick, starting from w->tick, when a non-empty slot is run
+// or cascaded. Return 0 if the wheel is empty
+static uint64_t wheel_next(struct mg_timer_wheel *w) {
+  uint64_t next = 0;
+  unsigned level;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    unsigned shift = MG_WHEEL_BITS * level;
+    uint64_t start = (w->tick + ((uint64_t) 1 << shift) - 1) >> shift;
+    uint64_t bits = w->bits[level], ahead, when;
+    unsigned idx = (unsigned) start & MG_WHEEL_MASK;
+    if (bits == 0) continue;
+    ahead = bits & (~(uint64_t) 0 << idx);
+    when = ahead ? start + wheel_ctz(ahead) - idx
+                 : start + MG_WHEEL_MASK + 1 - idx + wheel_ctz(bits);
+    when <<= shift;
+    if (next == 0 || when < next) next = when;
+  }
+  return next;
+}
+
+// Time went back. Re-add scheduled timers, resetting them as
+// mg_timer_expired() does
+static void wheel_rewind(struct mg_timer_wheel *w, struct mg_timer **head,
+                         uint64_t now) {
+  struct mg_timer *t;
+  memset(w, 0, sizeof(*w));
+  w->tick = now;
+  for (t = *head; t != NULL; t = t->next) {
+    if (t->wprev == NULL) continue;  // Not scheduled
+    t->wnext = NULL, t->wprev = NULL;
+    if (now + t->period_ms < t->expire) t->expire = 0;
+    wheel_add(w, t);
+  }
+}
+
+void mg_timer_wheel_poll(struct mg_timer_wheel *w, struct mg_timer **head,
+                         uint64_t now) {
+  struct mg_timer *t, *due = NULL;
+  if (now + 1 < w->tick) wheel_rewind(w, head, now);
+
+  // mg_timer_init() adds to the list head. New timers run on their first poll
+  for (t = *head; t != NULL && t->wprev == NULL && t->expire == 0 &&
+                  !(t->flags & MG_TIMER_CALLED);
+       t = t->next) {
+    wheel_link(&due, t);
+  }
+
+  // Advance the wheel, skipping ticks with nothing to run or cascade
+  while (w->tick <= now) {
+    uint64_t next, tick = w->tick;
+    unsigned level;
+    for (level = 1; level < MG_TIMER_WHEEL_LEVELS; level++) {
+      if ((tick >> (MG_WHEEL_BITS * (level - 1))) & MG_WHEEL_MASK) break;
+      wheel_cascade(w, level,
+                    (unsigned) (tick >> (MG_WHEEL_BITS * level)) & MG_WHEEL_MASK);
+    }
+    wheel_take(w, 0, (unsigned) tick & MG_WHEEL_MASK, &due);
+    w->tick = tick + 1;
+    next = wheel_next(w);
+    w->tick = next == 0 || next > now ? now + 1 : next;
+  }
+
+  while ((t = due) != NULL) {
+    wheel_unlink(t);
+    if (!timer_run(head, t, now) || t->prev == NULL) continue;  // Deleted
+    if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+      wheel_add(w, t);  // Called once-only timers stay in the list only
     }
   }
 }
 
+// Return ms, or less if a timer expires sooner
+int mg_timer_wheel_timeout(struct mg_timer_wheel *w, uint64_t now, int ms) {
+  uint64_t next = wheel_next(w), max = ms < 0 ? 0x7fffffffU : (uint64_t) ms;
+  if (next == 0) return ms;
+  if (next <= now) return 0;
+  return next - now < max ? (int) (next - now) : ms;
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/tls_aes128.c"
 #endif
@@ -16530,10 +21330,24 @@ static const uint8_t mg_secp256r1_oid[] = {
 #define MG_TLS_CERTIFICATE 11
 #define MG_TLS_CERTIFICATE_REQUEST 13
 #define MG_TLS_CERTIFICATE_VERIFY 15
+#define MG_TLS_NEW_SESSION_TICKET 4
 #define MG_TLS_FINISHED 20
 
 #define MG_TLS_RSA_USE_CRT 1  // CRT instead of naive RSA
 
+#ifndef MG_TLS_TICKET_LIFETIME
+#define MG_TLS_TICKET_LIFETIME 7200  // Session ticket lifetime, seconds
+#endif
+
+#define MG_TLS_TICKET_MAX 512  // Max size of a session ticket we keep
+
+// Server session ticket: AEAD nonce + sealed {issue time, cert binding, PSK}
+#define TLS_TICKET_PLAIN (8 + 16 + 32)
+#define TLS_TICKET_SIZE (12 + TLS_TICKET_PLAIN + 16)
+
+// Client session: PSK, age_add, lifetime, receive time, trust hash, ticket
+#define TLS_SESSION_HDR (32 + 4 + 4 + 8 + 32)
+
 // handshake is re-entrant, so we need to keep track of its state state names
 // refer to RFC8446#A.1
 enum mg_tls_hs_state {
@@ -16600,6 +21414,11 @@ struct tls_data {
   bool cert_requested;       // client received a CertificateRequest
   bool is_twoway;            // server is configured to authenticate clients
   bool is_sntp_pending;      // TLS handshake is waiting for wall-clock time
+  bool is_psk_offered;       // client sent a session ticket in ClientHello
+  bool is_resumed;           // PSK handshake, no certificates exchanged
+  uint8_t psk[32];           // resumption PSK, offered or accepted
+  uint8_t master_secret[32];  // to derive the resumption master secret
+  uint8_t res_secret[32];     // client resumption master secret
   struct mg_connection *timec;  // SNTP connection for wall-clock time
   struct mg_str cert_der;    // certificate in DER format
   struct mg_str ca_der;      // current CA certificate
@@ -16611,6 +21430,8 @@ struct tls_data {
   struct mg_rsa_key rsa;
   struct mg_str rsa_key_der;  // RSA private key in DER format
   char hostname[254];         // matching hostname
+  char alpn[64];              // server: accepted ALPN protocols, see opts
+  char protocol[32];          // server: selected ALPN protocol, or empty
 
   bool is_ec_pubkey;         // EC or RSA. TODO(): currently unused
   uint8_t pubkey[512 + 16];  // server EC (64) or RSA (512+exp) public key to
@@ -16625,6 +21446,29 @@ struct tls_data {
 #define TLS_RECHDR_SIZE 5  // 1 byte type, 2 bytes version, 2 bytes length
 #define TLS_MSGHDR_SIZE 4  // 1 byte type, 3 bytes length
 
+// Default session store entry, see mg_tls_set_session_store()
+struct tls_session {
+  char *name;          // Server name, followed by session data
+  size_t len;          // Session data length
+  unsigned long used;  // Last use stamp, for LRU eviction
+};
+
+// Verified peer certificate chain, see mg_tls_recv_cert()
+struct tls_chain {
+  uint8_t key[32];     // Hash of the peer name, trust anchors and chain
+  uint64_t expire;     // Earliest notAfter in the chain, seconds since epoch
+  unsigned long used;  // Last use stamp, for LRU eviction. 0: unused entry
+};
+
+// per-manager TLS data, mgr->tls_ctx
+struct tls_ctx {
+  uint8_t ticket_key[32];             // server: session ticket sealing key
+  struct mg_tls_session_store store;  // client: where session tickets go
+  struct tls_session sessions[MG_TLS_CTX_CACHE_SIZE];  // default store
+  struct tls_chain chains[MG_TLS_CERT_CACHE_SIZE];     // verified chains
+  unsigned long used;
+};
+
 #ifdef MG_TLS_SSLKEYLOGFILE
 #include <stdio.h>
 static void mg_ssl_key_log(const char *label, uint8_t client_random[32],
@@ -16822,7 +21666,8 @@ static void mg_tls_generate_handshake_keys(struct mg_connection *c) {
   const size_t keysz = 16;
 #endif
 
-  mg_hmac_sha256(early_secret, NULL, 0, zeros, sizeof(zeros));
+  mg_hmac_sha256(early_secret, NULL, 0, tls->is_resumed ? tls->psk : zeros,
+                 32);
   mg_tls_derive_secret("tls13 derived", early_secret, 32, zeros_sha256_digest,
                        32, pre_extract_secret, 32);
   mg_hmac_sha256(tls->enc.handshake_secret, pre_extract_secret,
@@ -16893,6 +21738,7 @@ static void mg_tls_generate_application_keys(struct mg_connection *c) {
   mg_tls_derive_secret("tls13 derived", tls->enc.handshake_secret, 32,
                        zeros_sha256_digest, 32, premaster_secret, 32);
   mg_hmac_sha256(master_secret, premaster_secret, 32, zeros, 32);
+  memmove(tls->master_secret, master_secret, sizeof(master_secret));
 
   mg_tls_derive_secret("tls13 s ap traffic", master_secret, 32, hash, 32,
                        server_secret, 32);
@@ -16961,7 +21807,7 @@ static bool mg_tls_encrypt(struct mg_connection *c, const uint8_t *msg,
   nonce[11] ^= (uint8_t) ((seq) & 255U);
 
   if (mg_iobuf_add(wio, wio->len, hdr, sizeof(hdr)) == 0 ||
-      !mg_iobuf_resize(wio, wio->len + encsz))
+      !mg_iobuf_reserve(wio, encsz))
     return false;
   outmsg = wio->buf + wio->len;
   tag = wio->buf + wio->len + msgsz + 1;
@@ -17133,7 +21979,133 @@ static void mg_tls_calc_cert_verify_hash(struct mg_connection *c,
   mg_sha256_final(hash, &sha256);
 }
 
+// PSK binder, RFC8446#4.2.11.2: HMAC of the ClientHello truncated before the
+// binders list, keyed with the binder key derived from the PSK
+static void mg_tls_psk_binder(uint8_t psk[32], const uint8_t *hello,
+                              size_t hellosz, uint8_t binder[32]) {
+  uint8_t early_secret[32];
+  uint8_t binder_key[32];
+  uint8_t finished_key[32];
+  uint8_t hash[32];
+  mg_sha256_ctx sha256;
+  mg_hmac_sha256(early_secret, NULL, 0, psk, 32);
+  mg_tls_derive_secret("tls13 res binder", early_secret, 32,
+                       zeros_sha256_digest, 32, binder_key, 32);
+  mg_tls_derive_secret("tls13 finished", binder_key, 32, NULL, 0,
+                       finished_key, 32);
+  mg_sha256_init(&sha256);
+  mg_sha256_update(&sha256, hello, hellosz);
+  mg_sha256_final(hash, &sha256);
+  mg_hmac_sha256(binder, finished_key, 32, hash, 32);
+}
+
+// resumption_master_secret, hash covers the handshake up to client Finished
+static void mg_tls_resumption_secret(struct tls_data *tls, uint8_t hash[32],
+                                     uint8_t secret[32]) {
+  mg_tls_derive_secret("tls13 res master", tls->master_secret, 32, hash, 32,
+                       secret, 32);
+}
+
+// Tickets are only accepted for the certificate and client CA they were
+// issued with, so a ticket from one listener does not skip another's checks
+static void mg_tls_ticket_binding(struct tls_data *tls, uint8_t binding[16]) {
+  mg_sha256_ctx sha256;
+  uint8_t hash[32];
+  mg_sha256_init(&sha256);
+  mg_sha256_update(&sha256, (uint8_t *) tls->cert_der.buf, tls->cert_der.len);
+  mg_sha256_update(&sha256, (uint8_t *) tls->ca_der.buf, tls->ca_der.len);
+  mg_sha256_final(hash, &sha256);
+  memmove(binding, hash, 16);
+}
+
+static bool mg_tls_ticket_seal(uint8_t key[32], uint8_t *plain,
+                               uint8_t ticket[TLS_TICKET_SIZE]) {
+  if (!mg_random(ticket, 12)) return false;  // nonce, also used as AAD
+#if MG_ENABLE_CHACHA20
+  return mg_chacha20_poly1305_encrypt(ticket + 12, key, ticket, ticket, 12,
+                                      plain, TLS_TICKET_PLAIN) ==
+         TLS_TICKET_PLAIN + 16;
+#else
+  mg_gcm_initialize();
+  return mg_aes_gcm_encrypt(ticket + 12, plain, TLS_TICKET_PLAIN, key, 16,
+                            ticket, 12, ticket, 12,
+                            ticket + 12 + TLS_TICKET_PLAIN, 16) == 0;
+#endif
+}
+
+static bool mg_tls_ticket_open(uint8_t key[32], uint8_t *ticket,
+                               uint8_t plain[TLS_TICKET_PLAIN]) {
+#if MG_ENABLE_CHACHA20
+  return mg_chacha20_poly1305_decrypt(plain, key, ticket, ticket, 12,
+                                      ticket + 12, TLS_TICKET_PLAIN + 16) ==
+         TLS_TICKET_PLAIN;
+#else
+  mg_gcm_initialize();
+  return mg_aes_gcm_decrypt(plain, ticket + 12, TLS_TICKET_PLAIN, key, 16,
+                            ticket, 12, ticket, 12,
+                            ticket + 12 + TLS_TICKET_PLAIN, 16) == 0;
+#endif
+}
+
+// Check the pre_shared_key extension, the last one in ClientHello. The first
+// identity is accepted if it is our unexpired ticket for this certificate and
+// its binder matches; otherwise, fall back to a full handshake
+static void mg_tls_server_recv_psk(struct mg_connection *c, uint8_t *hello,
+                                   uint8_t *ext, uint16_t extsz) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t plain[TLS_TICKET_PLAIN], binding[16], binder[32], diff = 0;
+  uint64_t now = mg_millis(), issued;
+  uint16_t ids_len, binders_len;
+  uint8_t *binders;
+  size_t i;
+  if (ctx == NULL || extsz < 2) return;
+  ids_len = MG_LOAD_BE16(ext);
+  if (ids_len < 2 + TLS_TICKET_SIZE + 4 || (uint32_t) ids_len + 5 > extsz ||
+      MG_LOAD_BE16(ext + 2) != TLS_TICKET_SIZE) {
+    return;  // Not our ticket
+  }
+  binders = ext + 2 + ids_len;
+  binders_len = MG_LOAD_BE16(binders);
+  if ((uint32_t) ids_len + 4 + binders_len != extsz || binders_len < 33 ||
+      binders[2] != 32) {
+    return;
+  }
+  if (!mg_tls_ticket_open(ctx->ticket_key, ext + 4, plain)) return;
+  issued = MG_LOAD_BE64(plain);
+  mg_tls_ticket_binding(tls, binding);
+  if (issued <= now && now - issued <= MG_TLS_TICKET_LIFETIME * 1000UL &&
+      memcmp(binding, plain + 8, sizeof(binding)) == 0) {
+    mg_tls_psk_binder(plain + 24, hello, (size_t) (binders - hello), binder);
+    for (i = 0; i < sizeof(binder); i++) diff |= binder[i] ^ binders[3 + i];
+    if (diff == 0) {
+      memmove(tls->psk, plain + 24, sizeof(tls->psk));
+      tls->is_resumed = true;
+      MG_VERBOSE(("%lu resuming session", c->id));
+    }
+  }
+  mg_bzero(plain, sizeof(plain));
+}
+
 // read and parse ClientHello record
+// Select the first of our protocols that the client offers, RFC 7301
+static void mg_tls_server_alpn(struct tls_data *tls, const uint8_t *p,
+                               uint16_t n) {
+  struct mg_str k, s = mg_str(tls->alpn);
+  while (mg_span(s, &k, &s, ',')) {
+    uint16_t i = 2;  // Skip protocol name list length
+    while (i < n && (uint32_t) i + 1 + p[i] <= n) {
+      if (p[i] == k.len && k.len < sizeof(tls->protocol) &&
+          memcmp(p + i + 1, k.buf, k.len) == 0) {
+        memcpy(tls->protocol, k.buf, k.len);
+        tls->protocol[k.len] = '\0';
+        return;
+      }
+      i = (uint16_t) (i + 1 + p[i]);
+    }
+  }
+}
+
 static int mg_tls_server_recv_hello(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   struct mg_iobuf *rio = &c->rtls;
@@ -17142,7 +22114,10 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
   uint16_t cipher_suites_len;
   uint16_t ext_len;
   uint8_t *ext;
+  uint8_t *psk = NULL;
+  uint16_t psk_len = 0;
   uint16_t msgsz;
+  bool has_key_share = false, has_psk_dhe = false;
 
   if (!mg_tls_got_record(c)) {
     return MG_IO_WAIT;
@@ -17177,10 +22152,22 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
     uint16_t k;
     uint16_t key_exchange_len;
     uint8_t *key_exchange;
-    uint16_t n = MG_LOAD_BE16(ext + j + 2);
+    uint16_t n;
+    if (ext_len - j < 4) goto fail;
+    n = MG_LOAD_BE16(ext + j + 2);
     if (((uint32_t) n + j + 4) > ext_len) goto fail;
-    if (MG_LOAD_BE16(ext + j) != 0x0033) {  // not a key share extension, ignore
-      j += (uint16_t) (n + 4);
+    if (MG_LOAD_BE16(ext + j) == 0x002d) {  // psk_key_exchange_modes
+      for (k = 1; k < n && k <= ext[j + 4]; k++) {
+        if (ext[j + 4 + k] == 1) has_psk_dhe = true;  // psk_dhe_ke
+      }
+    } else if (MG_LOAD_BE16(ext + j) == 0x0029) {  // pre_shared_key, last
+      psk = ext + j + 4, psk_len = n;
+      if (((uint32_t) n + j + 4) != ext_len) goto fail;
+    } else if (MG_LOAD_BE16(ext + j) == 0x0010) {  // ALPN
+      mg_tls_server_alpn(tls, ext + j + 4, n);
+    }
+    if (MG_LOAD_BE16(ext + j) != 0x0033 || has_key_share) {
+      j += (uint16_t) (n + 4);  // not a key share extension, ignore
       continue;
     }
     key_exchange_len = MG_LOAD_BE16(ext + j + 4);
@@ -17192,13 +22179,19 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
       if (((uint32_t) m + k + 4) > key_exchange_len) goto fail;
       if (m == 32 && key_exchange[k] == 0x00 && key_exchange[k + 1] == 0x1d) {
         memmove(tls->x25519_cli, key_exchange + k + 4, m);
-        mg_tls_drop_record(c);
-        return 0;
+        has_key_share = true;
+        break;
       }
       k += (uint16_t) (m + 4);
     }
     j += (uint16_t) (n + 4);
   }
+  if (!has_key_share) goto fail;
+  if (psk != NULL && has_psk_dhe) {
+    mg_tls_server_recv_psk(c, rio->buf + 5, psk, psk_len);
+  }
+  mg_tls_drop_record(c);
+  return 0;
 fail:
   mg_error(c, "bad client hello");
   return -1;
@@ -17214,7 +22207,7 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
   struct mg_iobuf *wio = &tls->send;
 
   // clang-format off
-  uint8_t msg_server_hello[122] = {
+  uint8_t msg_server_hello[128] = {
       // server hello, tls 1.2
       0x02, 0x00, 0x00, 0x76, 0x03, 0x03,
       // random (32 bytes)
@@ -17233,8 +22226,12 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
       // x25519 keyshare
       PLACEHOLDER_32B,
       // supported versions (tls1.3 == 0x304)
-      0x00, 0x2b, 0x00, 0x02, 0x03, 0x04};
+      0x00, 0x2b, 0x00, 0x02, 0x03, 0x04,
+      // pre-shared key, selected identity 0 (only if resumed)
+      0x00, 0x29, 0x00, 0x02, 0x00, 0x00};
   // clang-format on
+  size_t n = tls->is_resumed ? sizeof(msg_server_hello) : 122;
+  uint8_t hdr[5] = {MG_TLS_HANDSHAKE, 0x03, 0x03, 0, (uint8_t) n};
 
   // calculate keyshare
   uint8_t x25519_pub[X25519_BYTES];
@@ -17250,13 +22247,14 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
   memmove(msg_server_hello + 6, tls->random, sizeof(tls->random));
   memmove(msg_server_hello + 39, tls->session_id, sizeof(tls->session_id));
   memmove(msg_server_hello + 84, x25519_pub, sizeof(x25519_pub));
+  MG_STORE_BE24(msg_server_hello + 1, n - 4);   // message length
+  MG_STORE_BE16(msg_server_hello + 74, n - 76);  // extensions length
 
   // server hello message
-  if (mg_iobuf_add(wio, wio->len, "\x16\x03\x03\x00\x7a", 5) == 0 ||
-      mg_iobuf_add(wio, wio->len, msg_server_hello, sizeof(msg_server_hello)) ==
-          0)
+  if (mg_iobuf_add(wio, wio->len, hdr, sizeof(hdr)) == 0 ||
+      mg_iobuf_add(wio, wio->len, msg_server_hello, n) == 0)
     return false;
-  mg_sha256_update(&tls->sha256, msg_server_hello, sizeof(msg_server_hello));
+  mg_sha256_update(&tls->sha256, msg_server_hello, n);
 
   // change cipher message
   if (mg_iobuf_add(wio, wio->len, "\x14\x03\x03\x00\x01\x01", 6) == 0)
@@ -17266,10 +22264,21 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
 
 static bool mg_tls_server_send_ext(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
-  // server extensions
-  uint8_t ext[6] = {0x08, 0, 0, 2, 0, 0};
-  mg_sha256_update(&tls->sha256, ext, sizeof(ext));
-  return mg_tls_encrypt(c, ext, sizeof(ext), MG_TLS_HANDSHAKE);
+  // server extensions: none, or the selected ALPN protocol
+  uint8_t ext[13 + sizeof(tls->protocol)] = {0x08, 0, 0, 2, 0, 0};
+  size_t n = strlen(tls->protocol), len = 6;
+  if (n > 0) {
+    MG_STORE_BE24(ext + 1, n + 9);  // message length
+    MG_STORE_BE16(ext + 4, n + 7);  // extensions length
+    MG_STORE_BE16(ext + 6, 0x0010);
+    MG_STORE_BE16(ext + 8, n + 3);  // extension length
+    MG_STORE_BE16(ext + 10, n + 1);  // protocol name list length
+    ext[12] = (uint8_t) n;
+    memcpy(ext + 13, tls->protocol, n);
+    len = n + 13;
+  }
+  mg_sha256_update(&tls->sha256, ext, len);
+  return mg_tls_encrypt(c, ext, len, MG_TLS_HANDSHAKE);
 }
 
 // signature algorithms we actually support:
@@ -17656,7 +22665,9 @@ static bool mg_tls_server_send_finish(struct mg_connection *c) {
   return true;
 }
 
-static int mg_tls_server_recv_finish(struct mg_connection *c) {
+// hash receives the handshake hash including client Finished
+static int mg_tls_server_recv_finish(struct mg_connection *c,
+                                     uint8_t hash[32]) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   unsigned char *recv_buf;
   // we have to backup sha256 value to restore it later, since Finished record
@@ -17672,12 +22683,137 @@ static int mg_tls_server_recv_finish(struct mg_connection *c) {
     return -1;
   }
   mg_tls_drop_message(c);
+  mg_sha256_final(hash, &tls->sha256);
 
   // restore hash
   tls->sha256 = sha256;
   return 0;
 }
 
+// Send a NewSessionTicket: the resumption PSK, sealed with the manager key
+static bool mg_tls_server_send_ticket(struct mg_connection *c,
+                                      uint8_t hash[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t msg[18 + TLS_TICKET_SIZE] = {MG_TLS_NEW_SESSION_TICKET};
+  uint8_t plain[TLS_TICKET_PLAIN], secret[32], nonce = 0;
+  bool ok;
+  if (ctx == NULL) return true;
+  mg_tls_resumption_secret(tls, hash, secret);
+  MG_STORE_BE64(plain, mg_millis());
+  mg_tls_ticket_binding(tls, plain + 8);
+  mg_tls_derive_secret("tls13 resumption", secret, 32, &nonce, 1, plain + 24,
+                       32);
+  MG_STORE_BE24(msg + 1, sizeof(msg) - 4);
+  MG_STORE_BE32(msg + 4, MG_TLS_TICKET_LIFETIME);  // ticket_lifetime
+  msg[12] = 1, msg[13] = nonce;                    // ticket_nonce
+  MG_STORE_BE16(msg + 14, TLS_TICKET_SIZE);        // ticket, no extensions
+  ok = mg_random(msg + 8, 4) &&  // ticket_age_add
+       mg_tls_ticket_seal(ctx->ticket_key, plain, msg + 16);
+  mg_bzero(plain, sizeof(plain));
+  mg_bzero(secret, sizeof(secret));
+  if (!ok) return true;  // No ticket, no resumption
+  return mg_tls_encrypt(c, msg, sizeof(msg), MG_TLS_HANDSHAKE);
+}
+
+static void tls_chain_hash(mg_sha256_ctx *sha, const void *buf, size_t len) {
+  uint8_t n[4];
+  MG_STORE_BE32(n, len);
+  mg_sha256_update(sha, n, sizeof(n));
+  mg_sha256_update(sha, (const unsigned char *) buf, len);
+}
+
+// Sessions are saved under the server name and port, or its address
+static void mg_tls_session_name(struct mg_connection *c, char *buf,
+                                size_t len) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  if (tls->hostname[0] != '\0') {
+    mg_snprintf(buf, len, "%s:%d", tls->hostname, (int) mg_ntohs(c->rem.port));
+  } else {
+    mg_snprintf(buf, len, "%M", mg_print_ip_port, &c->rem);
+  }
+}
+
+// A resumed session skips certificate checks, so it is bound to how the
+// server was verified: the server name and the trust anchors, if any
+static void mg_tls_session_trust(struct mg_connection *c, uint8_t hash[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t verify = !tls->skip_verification &&
+                   (tls->ca_bundle_len > 0 || tls->ca_der.len > 0);
+  mg_sha256_ctx sha;
+  size_t i;
+  mg_sha256_init(&sha);
+  tls_chain_hash(&sha, &verify, sizeof(verify));
+  tls_chain_hash(&sha, tls->hostname, strlen(tls->hostname));
+  if (verify) {
+    tls_chain_hash(&sha, tls->ca_der.buf, tls->ca_der.len);
+    for (i = 0; i < tls->ca_bundle_len; i++) {
+      tls_chain_hash(&sha, tls->ca_bundle_der[i].buf,
+                     tls->ca_bundle_der[i].len);
+    }
+  }
+  mg_sha256_final(hash, &sha);
+}
+
+// A session is usable if it is not expired, and if it was verified the way
+// this connection would verify the server
+static size_t mg_tls_session_load(struct mg_connection *c, uint8_t *buf,
+                                  size_t len) {
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint64_t now = mg_millis(), received;
+  uint8_t trust[32];
+  char name[300];
+  size_t n;
+  if (ctx == NULL || ctx->store.load == NULL) return 0;
+  mg_tls_session_name(c, name, sizeof(name));
+  n = ctx->store.load(ctx->store.arg, name, buf, len);
+  if (n <= TLS_SESSION_HDR || n > len) return 0;
+  received = MG_LOAD_BE64(buf + 40);
+  if (received <= now && now - received > MG_LOAD_BE32(buf + 36) * 1000ULL) {
+    return 0;  // Expired
+  }
+  mg_tls_session_trust(c, trust);
+  if (memcmp(buf + 48, trust, sizeof(trust)) != 0) {
+    MG_DEBUG(("%lu session for %s verified differently, skipped", c->id, name));
+    return 0;
+  }
+  return n;
+}
+
+// Parse NewSessionTicket messages received after the handshake
+static void mg_tls_client_recv_ticket(struct mg_connection *c, uint8_t *msg,
+                                      size_t len) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t buf[TLS_SESSION_HDR + MG_TLS_TICKET_MAX];
+  char name[300];
+  uint32_t msglen, nonce_len, ticket_len;
+  for (; len >= TLS_MSGHDR_SIZE; msg += msglen, len -= msglen) {
+    msglen = MG_LOAD_BE24(msg + 1) + TLS_MSGHDR_SIZE;
+    if (msglen > len) break;
+    if (msg[0] != MG_TLS_NEW_SESSION_TICKET || msglen < 4 + 13) continue;
+    nonce_len = msg[12];
+    if (nonce_len > 32 || 4 + 13 + nonce_len > msglen) continue;
+    ticket_len = MG_LOAD_BE16(msg + 13 + nonce_len);
+    if (ticket_len == 0 || ticket_len > MG_TLS_TICKET_MAX ||
+        4 + 13 + nonce_len + ticket_len > msglen || MG_LOAD_BE32(msg + 4) == 0) {
+      continue;
+    }
+    if (ctx == NULL || ctx->store.save == NULL) return;
+    mg_tls_derive_secret("tls13 resumption", tls->res_secret, 32, msg + 13,
+                         nonce_len, buf, 32);
+    memmove(buf + 32, msg + 8, 4);   // ticket_age_add
+    memmove(buf + 36, msg + 4, 4);   // ticket_lifetime
+    MG_STORE_BE64(buf + 40, mg_millis());
+    mg_tls_session_trust(c, buf + 48);
+    memmove(buf + TLS_SESSION_HDR, msg + 15 + nonce_len, ticket_len);
+    mg_tls_session_name(c, name, sizeof(name));
+    ctx->store.save(ctx->store.arg, name, buf, TLS_SESSION_HDR + ticket_len);
+    mg_bzero(buf, 32);
+    MG_VERBOSE(("%lu saved session ticket for %s", c->id, name));
+  }
+}
+
 static bool mg_tls_client_send_hello(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   struct mg_iobuf *wio = &tls->send;
@@ -17693,6 +22829,15 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
       0x08, 0x05, 0x08, 0x06, 0x04, 0x01, 0x05, 0x01, 0x06, 0x01};
   uint8_t server_name_ext[9] = {0x00, 0x00, 0x00, 0xfe, 0x00,
                                 0xfe, 0x00, 0x00, 0xfe};
+  // psk_key_exchange_modes (psk_dhe_ke) + pre_shared_key header
+  uint8_t psk_ext[14] = {0x00, 0x2d, 0x00, 0x02, 0x01, 0x01, 0x00, 0x29};
+  uint8_t ticket_age[4];
+  uint8_t binders[35] = {0x00, 0x21, 0x20};
+  uint8_t session[TLS_SESSION_HDR + MG_TLS_TICKET_MAX];
+  size_t sessionsz = mg_tls_session_load(c, session, sizeof(session));
+  size_t ticketsz = sessionsz > 0 ? sessionsz - TLS_SESSION_HDR : 0;
+  size_t psk_extsz = sessionsz > 0 ? sizeof(psk_ext) + ticketsz + 4 + 35 : 0;
+  size_t start = wio->len;
 
   // clang-format off
   uint8_t msg_client_hello[145] = {
@@ -17735,13 +22880,13 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
   size_t sig_alg_sz = tls->skip_verification ? sizeof(all_sig_algs)
                                              : sizeof(secp256r1_sig_algs);
 
-  // patch ClientHello with correct hostname ext length (if any)
+  // patch ClientHello with correct hostname and PSK ext length (if any)
   MG_STORE_BE16(msg_client_hello + 3,
-                hostname_extsz + 183 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 183 - 9 - 34 + sig_alg_sz);
   MG_STORE_BE16(msg_client_hello + 7,
-                hostname_extsz + 179 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 179 - 9 - 34 + sig_alg_sz);
   MG_STORE_BE16(msg_client_hello + 82,
-                hostname_extsz + 104 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 104 - 9 - 34 + sig_alg_sz);
 
   if (hostnamesz > 0) {
     MG_STORE_BE16(server_name_ext + 2, hostnamesz + 5);
@@ -17777,6 +22922,31 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
     mg_sha256_update(&tls->sha256, (uint8_t *) hostname, hostnamesz);
   }
 
+  // offer a saved session: one ticket identity, its binder goes last
+  if (sessionsz > 0) {
+    uint32_t age = (uint32_t) (mg_millis() - MG_LOAD_BE64(session + 40));
+    if (MG_LOAD_BE64(session + 40) > mg_millis()) age = 0;  // Reboot
+    MG_STORE_BE16(psk_ext + 8, psk_extsz - 10);     // extension length
+    MG_STORE_BE16(psk_ext + 10, ticketsz + 6);      // identities length
+    MG_STORE_BE16(psk_ext + 12, ticketsz);          // identity length
+    MG_STORE_BE32(ticket_age, age + MG_LOAD_BE32(session + 32));  // + age_add
+    if (mg_iobuf_add(wio, wio->len, psk_ext, sizeof(psk_ext)) == 0 ||
+        mg_iobuf_add(wio, wio->len, session + TLS_SESSION_HDR, ticketsz) ==
+            0 ||
+        mg_iobuf_add(wio, wio->len, ticket_age, sizeof(ticket_age)) == 0)
+      return false;
+    memmove(tls->psk, session, sizeof(tls->psk));
+    mg_tls_psk_binder(tls->psk, wio->buf + start + 5, wio->len - start - 5,
+                      binders + 3);
+    mg_sha256_update(&tls->sha256, wio->buf + wio->len - ticketsz - 18,
+                     ticketsz + 18);
+    if (mg_iobuf_add(wio, wio->len, binders, sizeof(binders)) == 0)
+      return false;
+    mg_sha256_update(&tls->sha256, binders, sizeof(binders));
+    tls->is_psk_offered = true;
+    mg_bzero(session, TLS_SESSION_HDR);
+  }
+
   // change cipher message
   if (mg_iobuf_add(wio, wio->len, (const char *) "\x14\x03\x03\x00\x01\x01",
                    6) == 0)
@@ -17789,6 +22959,7 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
   struct mg_iobuf *rio = &c->rtls;
   uint16_t msgsz;
   uint8_t *ext;
+  uint8_t *key_share = NULL;
   uint16_t ext_len;
   int j;
 
@@ -17822,6 +22993,14 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
     ext_type = MG_LOAD_BE16(ext + j);
     ext_len2 = MG_LOAD_BE16(ext + j + 2);
     if (ext_len2 > (ext_len - j - 4)) goto fail;
+    if (ext_type == 0x0029) {  // pre_shared_key, server accepted our ticket
+      if (!tls->is_psk_offered || ext_len2 != 2 ||
+          MG_LOAD_BE16(ext + j + 4) != 0) {
+        mg_error(c, "bad pre-shared key");
+        return -1;
+      }
+      tls->is_resumed = true;
+    }
     if (ext_type != 0x0033) {  // not a key share extension, ignore
       j += (uint16_t) (ext_len2 + 4);
       continue;
@@ -17834,10 +23013,15 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
     }
     key_exchange_len = MG_LOAD_BE16(ext + j + 6);
     key_exchange = ext + j + 8;
-    if (key_exchange_len != 32 || mg_tls_x25519(tls->x25519_sec, tls->x25519_cli, key_exchange, 1) < 0) {
+    if (key_exchange_len != 32) goto fail;
+    key_share = key_exchange;
+    j += (uint16_t) (ext_len2 + 4);
+  }
+  if (key_share != NULL) {
+    if (mg_tls_x25519(tls->x25519_sec, tls->x25519_cli, key_share, 1) < 0) {
       mg_error(c, "bad key");
       return -1;
-    }    
+    }
     mg_tls_hexdump("c x25519 sec", tls->x25519_sec, 32);
     mg_tls_drop_record(c);
     /* generate handshake keys */
@@ -17874,6 +23058,7 @@ struct mg_tls_cert {
   struct mg_str sig;    // signature
   uint8_t tbshash[48];  // 32B for sha256/secp256, 48B for sha384/secp384
   size_t tbshashsz;     // actual TBS hash size
+  uint64_t not_after;   // expiration time, seconds since epoch
 };
 
 static void mg_der_debug_cert_name(const char *name, struct mg_der_tlv *tlv) {
@@ -17999,6 +23184,7 @@ static int mg_tls_parse_cert_der(void *buf, size_t dersz,
       MG_ERROR(("cert is no longer valid: after=%.*s (%lu), now=%lu", after.len, after.value, t, now));
       return -1;
     }
+    cert->not_after = t;
   }
 
   // subject
@@ -18245,6 +23431,80 @@ static int tls_bundle_find(struct tls_data *tls, struct mg_der_tlv *name,
   return 0;
 }
 
+// A chain verifies the same way for the same peer name, peer IP (which can
+// match an IP SAN) and trust anchors
+static void tls_chain_key(struct mg_connection *c, const uint8_t *list,
+                          size_t len, uint8_t key[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  mg_sha256_ctx sha;
+  size_t i;
+  mg_sha256_init(&sha);
+  tls_chain_hash(&sha, tls->hostname, strlen(tls->hostname));
+  if (c->rem.is_ip6) {
+    tls_chain_hash(&sha, c->rem.addr.ip6, sizeof(c->rem.addr.ip6));
+  } else {
+    tls_chain_hash(&sha, &c->rem.addr.ip4, sizeof(c->rem.addr.ip4));
+  }
+  tls_chain_hash(&sha, tls->ca_der.buf, tls->ca_der.len);
+  for (i = 0; i < tls->ca_bundle_len; i++) {
+    tls_chain_hash(&sha, tls->ca_bundle_der[i].buf, tls->ca_bundle_der[i].len);
+  }
+  tls_chain_hash(&sha, list, len);
+  mg_sha256_final(key, &sha);
+}
+
+static struct tls_chain *tls_chain_find(struct tls_ctx *ctx,
+                                        const uint8_t key[32]) {
+  size_t i;
+  uint64_t now = mg_now() / 1000U;
+  for (i = 0; ctx != NULL && i < MG_TLS_CERT_CACHE_SIZE; i++) {
+    struct tls_chain *e = &ctx->chains[i];
+    if (e->used == 0 || memcmp(e->key, key, sizeof(e->key)) != 0) continue;
+    if (now > e->expire) break;  // Expired, verify again
+    e->used = ++ctx->used;
+    return e;
+  }
+  return NULL;
+}
+
+// Remember a verified chain, replacing the same, an unused or the least
+// recently used entry
+static void tls_chain_add(struct tls_ctx *ctx, const uint8_t key[32],
+                          uint64_t expire) {
+  struct tls_chain *e;
+  size_t i;
+  if (ctx == NULL) return;
+  for (e = &ctx->chains[0], i = 0; i < MG_TLS_CERT_CACHE_SIZE; i++) {
+    struct tls_chain *x = &ctx->chains[i];
+    if (x->used != 0 && memcmp(x->key, key, sizeof(x->key)) == 0) {
+      e = x;
+      break;
+    }
+    if (e->used != 0 && x->used < e->used) e = x;
+  }
+  memmove(e->key, key, sizeof(e->key));
+  e->expire = expire, e->used = ++ctx->used;
+}
+
+// Cached chain: parse the peer certificate for its public key only
+static int tls_recv_cert_cached(struct mg_connection *c, uint8_t *p,
+                                uint8_t *endp) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct mg_tls_cert cert;
+  uint32_t certsz = endp - p < 5 ? 0 : MG_LOAD_BE24(p);
+  memset(&cert, 0, sizeof(cert));
+  if (certsz == 0 || certsz + 5 > (size_t) (endp - p) ||
+      mg_tls_parse_cert_der(p + 3, certsz, &cert) < 0 ||
+      cert.pubkey.len > sizeof(tls->pubkey)) {
+    mg_error(c, "failed to parse certificate");
+    return -1;
+  }
+  MG_VERBOSE(("%lu verified chain cache hit", c->id));
+  memmove(tls->pubkey, cert.pubkey.buf, cert.pubkey.len);
+  tls->pubkeysz = cert.pubkey.len;
+  return 0;
+}
+
 static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   unsigned char *recv_buf;
@@ -18283,6 +23543,10 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
     uint8_t *endp = recv_buf + cert_chain_len + 8;
     bool found_ca = false;
     struct mg_tls_cert ca;
+    struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+    uint8_t key[32];
+    uint64_t expire;
+    int i;
 
     if (cert_chain_len != full_cert_chain_len - 4 || cert_chain_len > (tls->recv_len - 8)) {
       MG_ERROR(("full chain length: %d, chain length: %d, msg length: %d", full_cert_chain_len, cert_chain_len, tls->recv_len));
@@ -18290,6 +23554,14 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
       return -1;
     }
 
+    // Skip signature checks and the bundle search for a chain verified before
+    tls_chain_key(c, p, cert_chain_len, key);
+    if (tls_chain_find(ctx, key) != NULL) {
+      if (tls_recv_cert_cached(c, p, endp) < 0) return -1;
+      MG_DEBUG(("%lu peer chain verified before, checks skipped", c->id));
+      goto done;
+    }
+
     memset(certs, 0, sizeof(certs));
     memset(&ca, 0, sizeof(ca));
 
@@ -18391,7 +23663,17 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
         MG_VERBOSE(("no CA in chain; verification with builtin CA passed"));
       }
     }
+
+    // Verified until the first certificate, including the CA, expires
+    expire = ca.not_after;
+    for (i = 0; i < certnum; i++) {
+      if (expire == 0 || certs[i].not_after < expire) {
+        expire = certs[i].not_after;
+      }
+    }
+    tls_chain_add(ctx, key, expire);
   }
+done:
   mg_tls_drop_message(c);
   mg_tls_calc_cert_verify_hash(c, tls->sighash, !is_client);
   return 0;
@@ -18521,7 +23803,9 @@ static int mg_tls_client_recv_finish(struct mg_connection *c) {
   return 0;
 }
 
-static bool mg_tls_client_send_finish(struct mg_connection *c) {
+// res_hash receives the handshake hash including our Finished
+static bool mg_tls_client_send_finish(struct mg_connection *c,
+                                      uint8_t res_hash[32]) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   mg_sha256_ctx sha256;
   uint8_t hash[32];
@@ -18529,11 +23813,15 @@ static bool mg_tls_client_send_finish(struct mg_connection *c) {
   memmove(&sha256, &tls->sha256, sizeof(mg_sha256_ctx));
   mg_sha256_final(hash, &sha256);
   mg_hmac_sha256(finish + 4, tls->enc.client_finished_key, 32, hash, 32);
+  memmove(&sha256, &tls->sha256, sizeof(mg_sha256_ctx));
+  mg_sha256_update(&sha256, finish, sizeof(finish));
+  mg_sha256_final(res_hash, &sha256);
   return mg_tls_encrypt(c, finish, sizeof(finish), MG_TLS_HANDSHAKE);
 }
 
 static bool mg_tls_client_handshake(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t hash[32];
   switch (tls->state) {
     case MG_TLS_STATE_CLIENT_START:
       if (!mg_tls_client_send_hello(c)) return false;
@@ -18547,12 +23835,12 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
       if (mg_tls_client_recv_ext(c) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_CERT;
       // Fallthrough
-    case MG_TLS_STATE_CLIENT_WAIT_CERT:
-      if (mg_tls_recv_cert(c, true) < 0) break;
+    case MG_TLS_STATE_CLIENT_WAIT_CERT:  // resumed sessions skip certificates
+      if (!tls->is_resumed && mg_tls_recv_cert(c, true) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_CV;
       // Fallthrough
     case MG_TLS_STATE_CLIENT_WAIT_CV:
-      if (mg_tls_recv_cert_verify(c) < 0) break;
+      if (!tls->is_resumed && mg_tls_recv_cert_verify(c) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_FINISH;
       // Fallthrough
     case MG_TLS_STATE_CLIENT_WAIT_FINISH:
@@ -18564,13 +23852,14 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
         tls->app_keys = tls->enc;
         tls->enc = hs_keys;
         if (!mg_tls_send_cert(c, true) || !mg_tls_send_cert_verify(c, true) ||
-            !mg_tls_client_send_finish(c))
+            !mg_tls_client_send_finish(c, hash))
           return false;
         tls->enc = tls->app_keys;
       } else {
-        if (!mg_tls_client_send_finish(c)) return false;
+        if (!mg_tls_client_send_finish(c, hash)) return false;
         mg_tls_generate_application_keys(c);
       }
+      mg_tls_resumption_secret(tls, hash, tls->res_secret);
       tls->state = MG_TLS_STATE_CLIENT_CONNECTED;
       c->is_tls_hs = 0;
       mg_call(c, MG_EV_TLS_HS, NULL);
@@ -18584,16 +23873,19 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
 
 static bool mg_tls_server_handshake(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t hash[32];
   switch (tls->state) {
     case MG_TLS_STATE_SERVER_START:
       if (mg_tls_server_recv_hello(c) < 0) break;
+      if (tls->is_resumed) tls->is_twoway = false;  // client authenticated
       if (!mg_tls_server_send_hello(c)) return false;
       mg_tls_generate_handshake_keys(c);
       if (!mg_tls_server_send_ext(c)) return false;
       if (tls->is_twoway && !mg_tls_server_send_cert_request(c)) return false;
-      if (!mg_tls_send_cert(c, false) || !mg_tls_send_cert_verify(c, false) ||
-          !mg_tls_server_send_finish(c))
+      if (!tls->is_resumed &&
+          (!mg_tls_send_cert(c, false) || !mg_tls_send_cert_verify(c, false)))
         return false;
+      if (!mg_tls_server_send_finish(c)) return false;
       if (tls->is_twoway) {
         // generate application keys at this point, keep using handshake keys
         struct tls_enc hs_keys = tls->enc;
@@ -18606,12 +23898,13 @@ static bool mg_tls_server_handshake(struct mg_connection *c) {
       tls->state = MG_TLS_STATE_SERVER_NEGOTIATED;
       // fallthrough
     case MG_TLS_STATE_SERVER_NEGOTIATED:
-      if (mg_tls_server_recv_finish(c) < 0) break;
+      if (mg_tls_server_recv_finish(c, hash) < 0) break;
       if (tls->is_twoway) {  // use previously generated keys
         tls->enc = tls->app_keys;
       } else {  // generate keys now
         mg_tls_generate_application_keys(c);
       }
+      if (!mg_tls_server_send_ticket(c, hash)) return false;
       tls->state = MG_TLS_STATE_SERVER_CONNECTED;
       c->is_tls_hs = 0;
       break;
@@ -18648,7 +23941,7 @@ void mg_tls_handshake(struct mg_connection *c) {
   }
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
   }  // if last chunk fails to be sent, it will be sent with first app data,
      // otherwise, it needs to be flushed
 }
@@ -19094,8 +24387,9 @@ static void sync_time_cb(struct mg_connection *c, int ev, void *ev_data) {
 
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   struct mg_str key;
-  struct tls_data *tls =
-      (struct tls_data *) mg_calloc(1, sizeof(struct tls_data));
+  struct tls_data *tls;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  tls = (struct tls_data *) mg_calloc(1, sizeof(struct tls_data));
   if (tls == NULL) {
     mg_error(c, "tls oom");
     return;
@@ -19121,6 +24415,15 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
     tls->hostname[opts->name.len] = 0;
   }
 
+  // save accepted ALPN protocols (server extension)
+  if (opts->alpn.len > 0 && !c->is_client) {
+    if (opts->alpn.len >= sizeof(tls->alpn)) {
+      mg_error(c, "alpn too long");
+      return;
+    }
+    memcpy(tls->alpn, opts->alpn.buf, opts->alpn.len);
+  }
+
   // server CA certificate; parse PEM [bundle] or DER
   if (opts->ca.len > 0)  {
     struct mg_str *all_certs = NULL;
@@ -19284,15 +24587,26 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   long n = MG_IO_WAIT;
   bool was_throttled = c->is_tls_throttled;  // see #3074
   if (!was_throttled) {                      // encrypt new data
-    if (len > MG_IO_SIZE) len = MG_IO_SIZE;
-    if (len > 16384) len = 16384;
-    if (!mg_tls_encrypt(c, (const uint8_t *) buf, len, MG_TLS_APP_DATA))
+    // Coalescing: pack full-size records, and send them all at once
+    size_t ofs = 0, max = c->mgr->coalesce || c->is_coalescing
+                              ? MG_IO_COALESCE_MAX
+                              : MG_IO_SIZE;
+    if (len > max) len = max;
+    while (ofs < len) {
+      size_t k = len - ofs > 16384 ? 16384 : len - ofs;
+      if (!mg_tls_encrypt(c, (const uint8_t *) buf + ofs, k, MG_TLS_APP_DATA))
+        break;
+      c->mgr->io.records++;
+      ofs += k;
+    }
+    if (ofs == 0 && len > 0)
       return 0;  // returning 0 means an OOM condition (iobuf couldn't resize),
                  // yet this is so far recoverable, let the caller decide
+    len = ofs;
   }  // else, resend outstanding encrypted data in tls->send
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
   }  // if last chunk fails to be sent, it needs to be flushed
   c->is_tls_throttled = (tls->send.len > 0 && n == MG_IO_WAIT);
   MG_VERBOSE(("%lu %ld %ld %ld %c %c", c->id, (long) len, (long) tls->send.len,
@@ -19312,6 +24626,10 @@ long mg_tls_recv(struct mg_connection *c, void *buf, size_t len) {
     r = mg_tls_recv_record(c);
     if (r < 0) return r;
     if (tls->content_type == MG_TLS_APP_DATA) break;
+    if (tls->content_type == MG_TLS_HANDSHAKE && c->is_client) {
+      mg_tls_client_recv_ticket(c, &c->rtls.buf[tls->recv_offset],
+                                tls->recv_len);
+    }
     tls->recv_len = 0;
     mg_tls_drop_record(c);
   }
@@ -19336,16 +24654,99 @@ void mg_tls_flush(struct mg_connection *c) {
   long n;
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
+  }
+}
+
+// Default session store: keep the most recent sessions in memory. Tickets
+// are single-use, so a loaded session is removed
+static struct tls_session *tls_session_find(struct tls_ctx *ctx,
+                                            const char *name) {
+  size_t i;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    struct tls_session *s = &ctx->sessions[i];
+    if (s->name != NULL && strcmp(s->name, name) == 0) return s;
+  }
+  return NULL;
+}
+
+static void tls_session_free(struct tls_session *s) {
+  if (s->name == NULL) return;
+  mg_bzero((volatile unsigned char *) s->name, strlen(s->name) + 1 + s->len);
+  mg_free(s->name);
+  memset(s, 0, sizeof(*s));
+}
+
+static void tls_session_save(void *arg, const char *name, const void *buf,
+                             size_t len) {
+  struct tls_ctx *ctx = (struct tls_ctx *) arg;
+  struct tls_session *s = tls_session_find(ctx, name);
+  size_t i, n = strlen(name) + 1;
+  char *p = (char *) mg_calloc(1, n + len);
+  if (p == NULL) return;
+  if (s == NULL) {  // Replace an unused or the least recently used entry
+    for (s = &ctx->sessions[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+      if (s->name == NULL) break;
+      if (ctx->sessions[i].name == NULL ||
+          ctx->sessions[i].used < s->used) {
+        s = &ctx->sessions[i];
+      }
+    }
+  }
+  tls_session_free(s);
+  memmove(p, name, n);
+  memmove(p + n, buf, len);
+  s->name = p, s->len = len, s->used = ++ctx->used;
+}
+
+static size_t tls_session_load(void *arg, const char *name, void *buf,
+                               size_t len) {
+  struct tls_session *s = tls_session_find((struct tls_ctx *) arg, name);
+  size_t n = 0;
+  if (s != NULL && s->len <= len) {
+    memmove(buf, s->name + strlen(s->name) + 1, s->len);
+    n = s->len;
+  }
+  if (s != NULL) tls_session_free(s);
+  return n;
+}
+
+void mg_tls_set_session_store(struct mg_mgr *mgr,
+                              const struct mg_tls_session_store *store) {
+  struct tls_ctx *ctx = (struct tls_ctx *) mgr->tls_ctx;
+  if (ctx == NULL) return;
+  if (store != NULL) {
+    ctx->store = *store;
+  } else {
+    ctx->store.save = tls_session_save;
+    ctx->store.load = tls_session_load;
+    ctx->store.arg = ctx;
   }
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct tls_ctx *ctx = (struct tls_ctx *) mg_calloc(1, sizeof(*ctx));
+  if (ctx == NULL) {
+    MG_ERROR(("TLS context OOM"));  // No session resumption
+  } else if (!mg_random(ctx->ticket_key, sizeof(ctx->ticket_key))) {
+    MG_ERROR(("RNG"));
+    mg_free(ctx);
+  } else {
+    mgr->tls_ctx = ctx;
+    mg_tls_set_session_store(mgr, NULL);
+  }
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct tls_ctx *ctx = (struct tls_ctx *) mgr->tls_ctx;
+  size_t i;
+  if (ctx == NULL) return;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tls_session_free(&ctx->sessions[i]);
+  }
+  mg_bzero(ctx->ticket_key, sizeof(ctx->ticket_key));
+  mg_free(ctx);
+  mgr->tls_ctx = NULL;
 }
 #endif
 
@@ -20715,6 +26116,7 @@ PORTABLE_8439_DECL size_t mg_chacha20_poly1305_decrypt(
 #if MG_TLS == MG_TLS_NONE
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   (void) opts;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
   mg_error(c, "TLS is not enabled");
 }
 void mg_tls_handshake(struct mg_connection *c) {
@@ -20800,17 +26202,24 @@ static bool mg_load_key(struct mg_str str, mbedtls_pk_context *p) {
   return true;
 }
 
+static void tls_conf_unref(struct mg_tls_conf *tc) {
+  if (tc == NULL || --tc->refs > 0) return;
+  mbedtls_ssl_config_free(&tc->conf);
+  mbedtls_pk_free(&tc->pk);
+  mbedtls_x509_crt_free(&tc->ca);
+  mbedtls_x509_crt_free(&tc->cert);
+  mg_bzero((volatile unsigned char *) (tc + 1),
+           tc->ca_str.len + tc->cert_str.len + tc->key_str.len);
+  mg_free(tc);
+}
+
 void mg_tls_free(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   if (tls != NULL) {
+    if (tls->conf != NULL) tls->conf->c = c;
     mbedtls_ssl_free(&tls->ssl);
-    mbedtls_pk_free(&tls->pk);
-    mbedtls_x509_crt_free(&tls->ca);
-    mbedtls_x509_crt_free(&tls->cert);
-    mbedtls_ssl_config_free(&tls->conf);
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-    mbedtls_ssl_ticket_free(&tls->ticket);
-#endif
+    if (tls->conf != NULL) tls->conf->c = NULL;
+    tls_conf_unref(tls->conf);
     // PSA has global data. Do not call mbedtls_psa_crypto_free() here,
     // it will free all global resources. Call it when actually freeing all
     // application resources (main() exits)
@@ -20839,7 +26248,9 @@ static int mg_net_recv(void *ctx, unsigned char *buf, size_t len) {
 
 void mg_tls_handshake(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
-  int rc = mbedtls_ssl_handshake(&tls->ssl);
+  int rc;
+  tls->conf->c = c;  // Shared config: tell debug_cb() which connection it is
+  rc = mbedtls_ssl_handshake(&tls->ssl);
   if (rc == 0) {  // Success
     if (tls->check_name && (mbedtls_ssl_get_verify_result(&tls->ssl) &
                             MBEDTLS_X509_BADCERT_CN_MISMATCH)) {
@@ -20858,45 +26269,165 @@ void mg_tls_handshake(struct mg_connection *c) {
   }
 }
 
-static void debug_cb(void *c, int lev, const char *s, int n, const char *s2) {
+static void debug_cb(void *tc, int lev, const char *s, int n, const char *s2) {
+  struct mg_connection *c = ((struct mg_tls_conf *) tc)->c;
   n = (int) strlen(s2) - 1;
-  MG_INFO(("%lu %d %.*s", ((struct mg_connection *) c)->id, lev, n, s2));
+  MG_INFO(("%lu %d %.*s", c == NULL ? 0 : c->id, lev, n, s2));
   (void) s;
 }
 
-void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
-  struct mg_tls *tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
-  int rc = 0;
-  bool check_name = false;
-  c->tls = tls;
-  if (c->tls == NULL) {
+static struct mg_str tls_str_copy(char **p, struct mg_str s) {
+  struct mg_str copy = mg_str_n(*p, s.len);
+  if (s.len > 0) memcpy(*p, s.buf, s.len);
+  *p += s.len;
+  return copy;
+}
+
+static bool tls_str_eq(struct mg_str a, struct mg_str b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.buf, b.buf, a.len) == 0);
+}
+
+// Build a config with everything that does not depend on a peer: role,
+// authmode, CA chain, own certificate and key, ALPN, session tickets
+static struct mg_tls_conf *tls_conf_new(struct mg_connection *c,
+                                        const struct mg_tls_opts *opts,
+                                        bool check_name) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  size_t n = opts->ca.len + opts->cert.len + opts->key.len +
+             opts->alpn.len * 2 + 1;  // ALPN list, then NUL-terminated names
+  struct mg_tls_conf *tc =
+      (struct mg_tls_conf *) mg_calloc(1, sizeof(*tc) + n);
+  char *p = (char *) (tc + 1);
+  int rc;
+  if (tc == NULL) {
     mg_error(c, "TLS OOM");
-    goto fail;
+    return NULL;
   }
-  if (c->is_listening) goto fail;
-  MG_DEBUG(("%lu Setting TLS", c->id));
-  MG_PROF_ADD(c, "mbedtls_init_start");
-  mbedtls_ssl_init(&tls->ssl);
-  mbedtls_ssl_config_init(&tls->conf);
-  mbedtls_x509_crt_init(&tls->ca);
-  mbedtls_x509_crt_init(&tls->cert);
-  mbedtls_pk_init(&tls->pk);
-  mbedtls_ssl_conf_dbg(&tls->conf, debug_cb, c);
+  tc->refs = 1;
+  mbedtls_ssl_config_init(&tc->conf);
+  mbedtls_x509_crt_init(&tc->ca);
+  mbedtls_x509_crt_init(&tc->cert);
+  mbedtls_pk_init(&tc->pk);
+  tc->ca_str = tls_str_copy(&p, opts->ca);
+  tc->cert_str = tls_str_copy(&p, opts->cert);
+  tc->key_str = tls_str_copy(&p, opts->key);
+  tc->alpn_str = tls_str_copy(&p, opts->alpn);
+  tc->is_client = c->is_client;
+  tc->check_name = check_name;
+  mbedtls_ssl_conf_dbg(&tc->conf, debug_cb, tc);
 #if defined(MG_MBEDTLS_DEBUG_LEVEL)
   mbedtls_debug_set_threshold(MG_MBEDTLS_DEBUG_LEVEL);
 #endif
   if ((rc = mbedtls_ssl_config_defaults(
-           &tls->conf,
+           &tc->conf,
            c->is_client ? MBEDTLS_SSL_IS_CLIENT : MBEDTLS_SSL_IS_SERVER,
            MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
     mg_error(c, "tls defaults %#x", -mg_tls_err(c, rc));
     goto fail;
   }
-#if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x04000000
-  MG_INFO(("PSA is in control of random number generation"));
-#else
-  mbedtls_ssl_conf_rng(&tls->conf, mg_mbed_rng, c);
-#endif
+#if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x04000000
+  MG_INFO(("PSA is in control of random number generation"));
+#else
+  mbedtls_ssl_conf_rng(&tc->conf, mg_mbed_rng, NULL);
+#endif
+
+  if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
+    mbedtls_ssl_conf_authmode(&tc->conf, check_name  // see mg_tls_init()
+                                             ? MBEDTLS_SSL_VERIFY_OPTIONAL
+                                             : MBEDTLS_SSL_VERIFY_NONE);
+  } else {
+    if (mg_load_cert(opts->ca, &tc->ca) == false) goto fail;
+    mbedtls_ssl_conf_ca_chain(&tc->conf, &tc->ca, NULL);
+    mbedtls_ssl_conf_authmode(&tc->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  if (!mg_load_cert(opts->cert, &tc->cert)) goto fail;
+  if (!mg_load_key(opts->key, &tc->pk)) goto fail;
+  if (tc->cert.version &&
+      (rc = mbedtls_ssl_conf_own_cert(&tc->conf, &tc->cert, &tc->pk)) != 0) {
+    mg_error(c, "own cert %#x", -mg_tls_err(c, rc));
+    goto fail;
+  }
+#ifdef MBEDTLS_SSL_ALPN
+  if (!c->is_client && opts->alpn.len > 0) {
+    struct mg_str k, s = tc->alpn_str;
+    size_t i = 0, max = sizeof(tc->alpn) / sizeof(tc->alpn[0]) - 1;
+    while (i < max && mg_span(s, &k, &s, ',')) {
+      if (k.len == 0) continue;
+      tc->alpn[i++] = p;
+      memcpy(p, k.buf, k.len);
+      p += k.len + 1;  // Zeroed by mg_calloc(), so NUL-terminated
+    }
+    mbedtls_ssl_conf_alpn_protocols(&tc->conf, tc->alpn);
+  }
+#endif
+
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  if (!c->is_client && ctx != NULL && ctx->has_tickets) {
+    mbedtls_ssl_conf_session_tickets_cb(&tc->conf, mbedtls_ssl_ticket_write,
+                                        mbedtls_ssl_ticket_parse,
+                                        &ctx->tickets);
+  }
+#endif
+  (void) ctx;
+  return tc;
+fail:
+  tls_conf_unref(tc);
+  return NULL;
+}
+
+// Return a referenced config for the connection. Configs are cached in
+// mgr->tls_ctx by role, CA, cert and key, so that connections with the same
+// options skip parsing them
+static struct mg_tls_conf *tls_conf_get(struct mg_connection *c,
+                                        const struct mg_tls_opts *opts,
+                                        bool check_name) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  struct mg_tls_conf *tc, **slot;
+  size_t i;
+  if (ctx == NULL) return tls_conf_new(c, opts, check_name);
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tc = ctx->confs[i];
+    if (tc != NULL && tc->is_client == c->is_client &&
+        tc->check_name == check_name && tls_str_eq(tc->ca_str, opts->ca) &&
+        tls_str_eq(tc->cert_str, opts->cert) &&
+        tls_str_eq(tc->key_str, opts->key) &&
+        tls_str_eq(tc->alpn_str, opts->alpn)) {
+      tc->used = ++ctx->used;
+      tc->refs++;
+      return tc;
+    }
+  }
+  if ((tc = tls_conf_new(c, opts, check_name)) == NULL) return NULL;
+
+  // Replace an unused or the least recently used entry. Connections still
+  // using an evicted config keep it alive until they are freed
+  for (slot = &ctx->confs[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    if (*slot == NULL) break;
+    if (ctx->confs[i] == NULL || ctx->confs[i]->used < (*slot)->used) {
+      slot = &ctx->confs[i];
+    }
+  }
+  tls_conf_unref(*slot);
+  *slot = tc;
+  tc->used = ++ctx->used;
+  tc->refs++;
+  return tc;
+}
+
+void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
+  struct mg_tls *tls;
+  int rc = 0;
+  bool check_name = false;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  c->tls = tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+  if (c->tls == NULL) {
+    mg_error(c, "TLS OOM");
+    goto fail;
+  }
+  if (c->is_listening) goto fail;
+  MG_DEBUG(("%lu Setting TLS", c->id));
+  MG_PROF_ADD(c, "mbedtls_init_start");
+  mbedtls_ssl_init(&tls->ssl);
 
   if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 &&
       opts->name.buf[0] != '\0') {
@@ -20915,32 +26446,12 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
     mbedtls_ssl_set_hostname(&tls->ssl, NULL);
   }
   if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
-    mbedtls_ssl_conf_authmode(&tls->conf, check_name  // see set comment above
-                                              ? MBEDTLS_SSL_VERIFY_OPTIONAL
-                                              : MBEDTLS_SSL_VERIFY_NONE);
     tls->check_name = check_name; // host name set but no CA cert given
-  } else {
-    if (mg_load_cert(opts->ca, &tls->ca) == false) goto fail;
-    mbedtls_ssl_conf_ca_chain(&tls->conf, &tls->ca, NULL);
-    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-  }
-  if (!mg_load_cert(opts->cert, &tls->cert)) goto fail;
-  if (!mg_load_key(opts->key, &tls->pk)) goto fail;
-  if (tls->cert.version &&
-      (rc = mbedtls_ssl_conf_own_cert(&tls->conf, &tls->cert, &tls->pk)) != 0) {
-    mg_error(c, "own cert %#x", -mg_tls_err(c, rc));
-    goto fail;
-  }
-
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-  if (!c->is_client && c->mgr->tls_ctx != NULL) {
-    mbedtls_ssl_conf_session_tickets_cb(
-        &tls->conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse,
-        &((struct mg_tls_ctx *) c->mgr->tls_ctx)->tickets);
   }
-#endif
+  if ((tls->conf = tls_conf_get(c, opts, check_name)) == NULL) goto fail;
 
-  if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf)) != 0) {
+  tls->conf->c = c;
+  if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf->conf)) != 0) {
     mg_error(c, "setup err %#x", -mg_tls_err(c, rc));
     goto fail;
   }
@@ -20960,7 +26471,9 @@ size_t mg_tls_pending(struct mg_connection *c) {
 
 long mg_tls_recv(struct mg_connection *c, void *buf, size_t len) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
-  long n = mbedtls_ssl_read(&tls->ssl, (unsigned char *) buf, len);
+  long n;
+  tls->conf->c = c;
+  n = mbedtls_ssl_read(&tls->ssl, (unsigned char *) buf, len);
   if (!c->is_tls_hs && (buf == NULL || len == 0) && n == 0) return 0;  // MIP
   if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
     return MG_IO_WAIT;
@@ -20977,6 +26490,7 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   long n;
   bool was_throttled = c->is_tls_throttled;  // see #3074
+  tls->conf->c = c;
   n = was_throttled ? mbedtls_ssl_write(&tls->ssl, tls->throttled_buf,
                                         tls->throttled_len) /* flush old data */
                     : mbedtls_ssl_write(&tls->ssl, (unsigned char *) buf,
@@ -20995,14 +26509,16 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
     return MG_IO_WAIT;
   }
   if (n <= 0) return MG_IO_ERR;
+  c->mgr->io.records++;  // mbedtls_ssl_write() produces one record
   return n;
 }
 
 void mg_tls_flush(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   if (c->is_tls_throttled && c->is_draining) {
-    long n =
-        mbedtls_ssl_write(&tls->ssl, tls->throttled_buf, tls->throttled_len);
+    long n;
+    tls->conf->c = c;
+    n = mbedtls_ssl_write(&tls->ssl, tls->throttled_buf, tls->throttled_len);
 #if defined(MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
     if (n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) return;
 #endif
@@ -21012,42 +26528,41 @@ void mg_tls_flush(struct mg_connection *c) {
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*ctx));
 #if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x03000000 && \
     defined(MBEDTLS_PSA_CRYPTO_C)
   psa_crypto_init();  // Initializes global PSA resources, no-op if already done
 #endif
+  if (ctx == NULL) {
+    MG_ERROR(("TLS context init OOM"));  // Connections build their own config
+    return;
+  }
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
   {
-    struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*ctx));
-    if (ctx == NULL) {
-      MG_ERROR(("TLS context init OOM"));
-    } else {
-      int rc;
-      mbedtls_ssl_ticket_init(&ctx->tickets);
+    int rc;
+    mbedtls_ssl_ticket_init(&ctx->tickets);
 #if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x04000000
-      rc = mbedtls_ssl_ticket_setup(&ctx->tickets, PSA_ALG_GCM,
-                                    PSA_KEY_TYPE_AES, 128, 86400);
+    rc = mbedtls_ssl_ticket_setup(&ctx->tickets, PSA_ALG_GCM, PSA_KEY_TYPE_AES,
+                                  128, 86400);
 #else
-      rc = mbedtls_ssl_ticket_setup(&ctx->tickets, mg_mbed_rng, NULL,
-                                         MBEDTLS_CIPHER_AES_128_GCM, 86400);
+    rc = mbedtls_ssl_ticket_setup(&ctx->tickets, mg_mbed_rng, NULL,
+                                  MBEDTLS_CIPHER_AES_128_GCM, 86400);
 #endif
-      if (rc != 0) {
-        MG_ERROR((" mbedtls_ssl_ticket_setup %#x", -rc));
-        mbedtls_ssl_ticket_free(&ctx->tickets);
-        mg_free(ctx);
-      } else {
-        mgr->tls_ctx = ctx;
-      }
+    if (rc != 0) {
+      MG_ERROR((" mbedtls_ssl_ticket_setup %#x", -rc));
+    } else {
+      ctx->has_tickets = true;
     }
   }
-#else
-  (void) mgr;
 #endif
+  mgr->tls_ctx = ctx;
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
   struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mgr->tls_ctx;
   if (ctx != NULL) {
+    size_t i;
+    for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) tls_conf_unref(ctx->confs[i]);
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
     mbedtls_ssl_ticket_free(&ctx->tickets);
 #endif
@@ -21119,17 +26634,17 @@ static EVP_PKEY *load_key(struct mg_str s) {
   return key;
 }
 
-static int load_cert(SSL *ssl, struct mg_str s) {
+static int load_cert(SSL_CTX *ctx, struct mg_str s) {
   BIO *bio = BIO_new_mem_buf(s.buf, (int) (long) s.len);
   X509 *cert = NULL;
   int rc = 0;
   if (bio == NULL) return 0;
   if (MG_IS_DER(s.buf)) {
     cert = d2i_X509_bio(bio, NULL);
-    rc = cert == NULL ? 0 : SSL_use_certificate(ssl, cert);
+    rc = cert == NULL ? 0 : SSL_CTX_use_certificate(ctx, cert);
   } else {
     cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
-    rc = cert == NULL ? 0 : SSL_use_certificate(ssl, cert);
+    rc = cert == NULL ? 0 : SSL_CTX_use_certificate(ctx, cert);
 #if MG_TLS != MG_TLS_WOLFSSL
     X509_free(cert);
     while (rc == 1) {
@@ -21138,7 +26653,7 @@ static int load_cert(SSL *ssl, struct mg_str s) {
         ERR_clear_error();  // PEM_read_bio_X509 sets an error on EOF
         break;
       }
-      rc = (int) SSL_add1_chain_cert(ssl, cert);
+      rc = (int) SSL_CTX_add1_chain_cert(ctx, cert);
       X509_free(cert);
     }
     cert = NULL;
@@ -21180,6 +26695,27 @@ static int mg_bio_write(BIO *bio, const char *buf, int len) {
   return len;
 }
 
+#if (MG_TLS == MG_TLS_OPENSSL && OPENSSL_VERSION_NUMBER >= 0x10002000L) || \
+    defined(HAVE_ALPN)
+// Server: select the first of our ALPN protocols that the client offers
+static int tls_alpn_cb(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+  BIO *bio = SSL_get_rbio(ssl);
+  struct mg_connection *c = (struct mg_connection *) BIO_get_data(bio);
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  if (tls->alpn == NULL ||
+      SSL_select_next_proto((unsigned char **) out, outlen, tls->alpn,
+                            (unsigned int) tls->alpn_len, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  (void) arg;
+  return SSL_TLSEXT_ERR_OK;
+}
+#define MG_TLS_ALPN 1
+#endif
+
 #ifdef MG_TLS_SSLKEYLOGFILE
 static void ssl_keylog_cb(const SSL *ssl, const char *line) {
   FILE *f;
@@ -21197,85 +26733,76 @@ static void ssl_keylog_cb(const SSL *ssl, const char *line) {
 }
 #endif
 
-void mg_tls_free(struct mg_connection *c) {
-  struct mg_tls *tls = (struct mg_tls *) c->tls;
-  if (tls == NULL) return;
-  SSL_free(tls->ssl);
-  SSL_CTX_free(tls->ctx);
-  BIO_meth_free(tls->bm);
-  mg_free(tls->name);
-  mg_free(tls);
-  c->tls = NULL;
+static BIO_METHOD *tls_bio_method(void) {
+#if MG_TLS == MG_TLS_WOLFSSL
+  BIO_METHOD *bm = BIO_meth_new(0, "bio_mg");
+#else
+  BIO_METHOD *bm =
+      BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "bio_mg");
+#endif
+  if (bm != NULL) {
+    BIO_meth_set_write(bm, mg_bio_write);
+    BIO_meth_set_read(bm, mg_bio_read);
+    BIO_meth_set_ctrl(bm, mg_bio_ctrl);
+  }
+  return bm;
 }
 
-void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
-  struct mg_tls *tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+// Print and clear the error queue after a failed SSL_CTX call
+static unsigned long tls_ctx_err(struct mg_connection *c) {
+  unsigned long err = ERR_peek_last_error();
+  ERR_print_errors_cb(tls_err_cb, c);
+  ERR_clear_error();
+  return err;
+}
+
+// Build an SSL_CTX with everything that does not depend on a peer: protocols,
+// CA store, certificate chain and private key
+static SSL_CTX *tls_ctx_new(struct mg_connection *c,
+                            const struct mg_tls_opts *opts) {
+  SSL_CTX *ctx = c->is_client ? SSL_CTX_new(TLS_client_method())
+                              : SSL_CTX_new(TLS_server_method());
   const char *id = "mongoose";
-  bool check_name = false;
-  static unsigned char s_initialised = 0;
-  BIO *bio = NULL;
   int rc;
-  c->tls = tls;
-  if (tls == NULL) {
-    mg_error(c, "TLS OOM");
-    goto fail;
-  }
-
-  if (!s_initialised) {
-    SSL_library_init();
-    s_initialised++;
-  }
-  MG_DEBUG(("%lu Setting TLS", c->id));
-  tls->ctx = c->is_client ? SSL_CTX_new(TLS_client_method())
-                          : SSL_CTX_new(TLS_server_method());
-  if (tls->ctx == NULL) {
+  if (ctx == NULL) {
     mg_error(c, "SSL_CTX_new");
-    goto fail;
+    return NULL;
   }
 #ifdef MG_TLS_SSLKEYLOGFILE
-  SSL_CTX_set_keylog_callback(tls->ctx, ssl_keylog_cb);
+  SSL_CTX_set_keylog_callback(ctx, ssl_keylog_cb);
 #endif
-  if ((tls->ssl = SSL_new(tls->ctx)) == NULL) {
-    mg_error(c, "SSL_new");
-    goto fail;
-  }
-  SSL_set_session_id_context(tls->ssl, (const uint8_t *) id,
-                             (unsigned) strlen(id));
+#ifdef MG_TLS_ALPN
+  if (!c->is_client) SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_cb, NULL);
+#endif
+  SSL_CTX_set_session_id_context(ctx, (const uint8_t *) id,
+                                 (unsigned) strlen(id));
   // Disable deprecated protocols
-  SSL_set_options(tls->ssl, SSL_OP_NO_SSLv2);
-  SSL_set_options(tls->ssl, SSL_OP_NO_SSLv3);
-  SSL_set_options(tls->ssl, SSL_OP_NO_TLSv1);
-  SSL_set_options(tls->ssl, SSL_OP_NO_TLSv1_1);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_1);
 #ifdef MG_ENABLE_OPENSSL_NO_COMPRESSION
-  SSL_set_options(tls->ssl, SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 #endif
 #ifdef MG_ENABLE_OPENSSL_CIPHER_SERVER_PREFERENCE
-  SSL_set_options(tls->ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 #endif
 
-if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.buf[0] != '\0') {
-  tls->name = mg_mprintf("%.*s", (int) opts->name.len, opts->name.buf);
-  if (tls->name == NULL) {
-    mg_error(c, "TLS OOM");
-    goto fail;
-  }
-  check_name = true;
-}
 #if MG_TLS == MG_TLS_WOLFSSL && !defined(OPENSSL_COMPATIBLE_DEFAULTS)
   if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
     // Older versions require that either the CA is loaded or SSL_VERIFY_NONE
     // explicitly set
-    SSL_set_verify(tls->ssl, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
   }
 #endif
 
   if (opts->ca.buf != NULL && opts->ca.len > 0 && opts->ca.buf[0] != '\0') {
-    SSL_set_verify(tls->ssl, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
-                   NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                       NULL);
 #if MG_TLS == MG_TLS_WOLFSSL
     extern int wolfSSL_CTX_load_verify_buffer(SSL_CTX *, const unsigned char *,
                                               long, int);
-    rc = wolfSSL_CTX_load_verify_buffer(tls->ctx,
+    rc = wolfSSL_CTX_load_verify_buffer(ctx,
                                         (const unsigned char *) opts->ca.buf,
                                         (long) opts->ca.len, SSL_FILETYPE_PEM);
     if (rc != 1) {
@@ -21284,38 +26811,165 @@ if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.b
     }
 #else
     STACK_OF(X509_INFO) *certs = load_ca_certs(opts->ca);
-    rc = add_ca_certs(tls->ctx, certs);
+    rc = add_ca_certs(ctx, certs);
     sk_X509_INFO_pop_free(certs, X509_INFO_free);
     if (!rc) {
       mg_error(c, "CA err");
       goto fail;
     }
 #endif
-  } else {
-    tls->check_name = check_name; // host name set but no CA cert given
   }
 
   if (opts->cert.buf != NULL && opts->cert.buf[0] != '\0') {
-    rc = load_cert(tls->ssl, opts->cert);
+    rc = load_cert(ctx, opts->cert);
     if (rc != 1) {
-      mg_error(c, "CERT err %d", mg_tls_err(c, tls, rc));
+      mg_error(c, "CERT err %lu", tls_ctx_err(c));
       goto fail;
     }
   }
   if (opts->key.buf != NULL && opts->key.buf[0] != '\0') {
     EVP_PKEY *key = load_key(opts->key);
-    rc = key == NULL ? 0 : SSL_use_PrivateKey(tls->ssl, key);
+    rc = key == NULL ? 0 : SSL_CTX_use_PrivateKey(ctx, key);
     EVP_PKEY_free(key);
     if (key == NULL || rc != 1) {
-      mg_error(c, "KEY err %d", mg_tls_err(c, tls, rc));
+      mg_error(c, "KEY err %lu", tls_ctx_err(c));
       goto fail;
     }
   }
 
-  SSL_set_mode(tls->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 #if MG_TLS == MG_TLS_OPENSSL && OPENSSL_VERSION_NUMBER > 0x10002000L
-  (void) SSL_set_ecdh_auto(tls->ssl, 1);
+  (void) SSL_CTX_set_ecdh_auto(ctx, 1);
 #endif
+  return ctx;
+fail:
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+static bool tls_str_eq(struct mg_str a, struct mg_str b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.buf, b.buf, a.len) == 0);
+}
+
+static void tls_ctx_entry_free(struct mg_tls_ctx_entry *e) {
+  if (e->ctx == NULL) return;
+  SSL_CTX_free(e->ctx);
+  mg_bzero((volatile unsigned char *) e->ca.buf,
+           e->ca.len + e->cert.len + e->key.len);
+  mg_free(e->ca.buf);  // Holds cert and key, too
+  memset(e, 0, sizeof(*e));
+}
+
+// Return an SSL_CTX for the connection, referenced for the caller. Contexts
+// are cached in mgr->tls_ctx by role, CA, cert and key, so that connections
+// with the same options skip parsing and loading them, and share a session
+// cache
+static SSL_CTX *tls_ctx_get(struct mg_connection *c,
+                            const struct mg_tls_opts *opts) {
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  struct mg_tls_ctx_entry *e;
+  SSL_CTX *ctx;
+  size_t i, n = opts->ca.len + opts->cert.len + opts->key.len;
+  char *buf;
+  if (tc == NULL) return tls_ctx_new(c, opts);
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    e = &tc->entries[i];
+    if (e->ctx != NULL && e->is_client == c->is_client &&
+        tls_str_eq(e->ca, opts->ca) && tls_str_eq(e->cert, opts->cert) &&
+        tls_str_eq(e->key, opts->key)) {
+      e->used = ++tc->used;
+      SSL_CTX_up_ref(e->ctx);
+      return e->ctx;
+    }
+  }
+  if ((ctx = tls_ctx_new(c, opts)) == NULL) return NULL;
+  if ((buf = (char *) mg_calloc(1, n + 1)) == NULL) return ctx;  // Uncached
+
+  // Replace an unused or the least recently used entry
+  for (e = &tc->entries[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    if (e->ctx == NULL) break;
+    if (tc->entries[i].ctx == NULL || tc->entries[i].used < e->used) {
+      e = &tc->entries[i];
+    }
+  }
+  tls_ctx_entry_free(e);
+  if (opts->ca.len > 0) memcpy(buf, opts->ca.buf, opts->ca.len);
+  if (opts->cert.len > 0) {
+    memcpy(buf + opts->ca.len, opts->cert.buf, opts->cert.len);
+  }
+  if (opts->key.len > 0) {
+    memcpy(buf + opts->ca.len + opts->cert.len, opts->key.buf, opts->key.len);
+  }
+  e->ca = mg_str_n(buf, opts->ca.len);
+  e->cert = mg_str_n(buf + opts->ca.len, opts->cert.len);
+  e->key = mg_str_n(buf + opts->ca.len + opts->cert.len, opts->key.len);
+  e->is_client = c->is_client;
+  e->used = ++tc->used;
+  e->ctx = ctx;
+  SSL_CTX_up_ref(ctx);
+  return ctx;
+}
+
+void mg_tls_free(struct mg_connection *c) {
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  if (tls == NULL) return;
+  SSL_free(tls->ssl);
+  SSL_CTX_free(tls->ctx);
+  if (tls->bm != NULL) BIO_meth_free(tls->bm);
+  mg_free(tls->name);
+  mg_free(tls->alpn);
+  mg_free(tls);
+  c->tls = NULL;
+}
+
+void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
+  struct mg_tls *tls;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  static unsigned char s_initialised = 0;
+  BIO_METHOD *bm = tc == NULL ? NULL : tc->bm;
+  BIO *bio = NULL;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  c->tls = tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+  if (tls == NULL) {
+    mg_error(c, "TLS OOM");
+    goto fail;
+  }
+
+  if (!s_initialised) {
+    SSL_library_init();
+    s_initialised++;
+  }
+  MG_DEBUG(("%lu Setting TLS", c->id));
+  if ((tls->ctx = tls_ctx_get(c, opts)) == NULL) goto fail;
+  if ((tls->ssl = SSL_new(tls->ctx)) == NULL) {
+    mg_error(c, "SSL_new");
+    goto fail;
+  }
+
+  if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 &&
+      opts->name.buf[0] != '\0') {
+    tls->name = mg_mprintf("%.*s", (int) opts->name.len, opts->name.buf);
+    if (tls->name == NULL) {
+      mg_error(c, "TLS OOM");
+      goto fail;
+    }
+    // Host name set but no CA cert given
+    tls->check_name = opts->ca.buf == NULL || opts->ca.len == 0 ||
+                      opts->ca.buf[0] == '\0';
+  }
+  if (!c->is_client && opts->alpn.len > 0) {  // "h2,http/1.1" -> wire format
+    struct mg_str k, s = opts->alpn;
+    if ((tls->alpn = (unsigned char *) mg_calloc(1, s.len + 1)) == NULL) {
+      mg_error(c, "TLS OOM");
+      goto fail;
+    }
+    while (mg_span(s, &k, &s, ',')) {
+      if (k.len == 0 || k.len > 255) continue;
+      tls->alpn[tls->alpn_len++] = (unsigned char) k.len;
+      memcpy(tls->alpn + tls->alpn_len, k.buf, k.len);
+      tls->alpn_len += k.len;
+    }
+  }
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
   if (tls->name != NULL) {
 #if MG_TLS != MG_TLS_WOLFSSL || LIBWOLFSSL_VERSION_HEX >= 0x05005002
@@ -21326,16 +26980,11 @@ if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.b
     SSL_set_tlsext_host_name(tls->ssl, tls->name);
   }
 #endif
-#if MG_TLS == MG_TLS_WOLFSSL
-  tls->bm = BIO_meth_new(0, "bio_mg");
-#else
-  tls->bm = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "bio_mg");
-#endif
-  BIO_meth_set_write(tls->bm, mg_bio_write);
-  BIO_meth_set_read(tls->bm, mg_bio_read);
-  BIO_meth_set_ctrl(tls->bm, mg_bio_ctrl);
-
-  bio = BIO_new(tls->bm);
+  if (bm == NULL && (bm = tls->bm = tls_bio_method()) == NULL) {
+    mg_error(c, "BIO_meth_new");
+    goto fail;
+  }
+  bio = BIO_new(bm);
   BIO_set_data(bio, c);
   SSL_set_bio(tls->ssl, bio, bio);
 
@@ -21394,6 +27043,7 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   int n = SSL_write(tls->ssl, buf, (int) len);
   if (n < 0 && mg_tls_err(c, tls, n) == 0) return MG_IO_WAIT;
   if (n <= 0) return MG_IO_ERR;
+  c->mgr->io.records += ((size_t) n + 16383) / 16384;  // Full-size records
   return n;
 }
 
@@ -21402,11 +27052,25 @@ void mg_tls_flush(struct mg_connection *c) {
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*tc));
+  if (tc == NULL) {
+    MG_ERROR(("TLS context OOM"));  // Connections build their own SSL_CTX
+  } else {
+    tc->bm = tls_bio_method();
+    mgr->tls_ctx = tc;
+  }
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) mgr->tls_ctx;
+  size_t i;
+  if (tc == NULL) return;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tls_ctx_entry_free(&tc->entries[i]);
+  }
+  if (tc->bm != NULL) BIO_meth_free(tc->bm);
+  mg_free(tc);
+  mgr->tls_ctx = NULL;
 }
 #endif
 
@@ -26396,12 +32060,170 @@ bool mg_wifi_ap_stop(void) {
 
 
 
+
 struct ws_msg {
   uint8_t flags;
   size_t header_len;
   size_t data_len;
 };
 
+#define WS_RSV1 0x40  // First frame of a compressed message, RFC 7692
+
+#if MG_ENABLE_DEFLATE
+// permessage-deflate state. Peers must not keep context for messages they
+// send us: each received message is inflated on its own
+struct ws_deflate {
+  struct mg_deflate d;  // Compressor for outgoing messages
+  bool takeover;        // Keep d between messages
+};
+
+static struct mg_str ws_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t')) {
+    s.len--;
+  }
+  return s;
+}
+
+// Find an acceptable permessage-deflate offer (server) or response (client)
+// in a Sec-WebSocket-Extensions header value. Our parameters are server_*
+// ones for a server, client_* for a client. Set *takeover to whether we can
+// keep context, and *fresh to whether the peer said it won't
+static bool ws_deflate_parse(struct mg_str s, bool is_client, bool *takeover,
+                             bool *fresh) {
+  const char *me = is_client ? "client_" : "server_";
+  const char *peer = is_client ? "server_" : "client_";
+  struct mg_str ext, name, param, k, v;
+  while (mg_span(s, &ext, &s, ',')) {
+    bool ok = true;
+    mg_span(ext, &name, &ext, ';');
+    if (mg_strcasecmp(ws_trim(name), mg_str("permessage-deflate")) != 0) {
+      continue;
+    }
+    *takeover = MG_WS_DEFLATE_TAKEOVER, *fresh = false;
+    while (ok && mg_span(ext, &param, &ext, ';')) {
+      char key[32];
+      mg_span(param, &k, &v, '=');
+      k = ws_trim(k), v = ws_trim(v);
+      if (v.len >= 2 && v.buf[0] == '"') v.buf++, v.len -= 2;
+      if (k.len < 8 || k.len >= sizeof(key)) {
+        ok = false;
+        continue;
+      }
+      mg_snprintf(key, sizeof(key), "%.*s", (int) k.len - 7, k.buf + 7);
+      if (strncmp(k.buf, me, 7) == 0 &&
+          strcmp(key, "no_context_takeover") == 0) {
+        *takeover = false;
+      } else if (strncmp(k.buf, peer, 7) == 0 &&
+                 strcmp(key, "no_context_takeover") == 0) {
+        *fresh = true;
+      } else if (strcmp(key, "max_window_bits") == 0) {
+        // Our matches go up to 32K back: we can only take a 15-bit limit
+        if (strncmp(k.buf, me, 7) == 0 && v.len > 0) {
+          ok = mg_strcmp(v, mg_str("15")) == 0;
+        } else if (strncmp(k.buf, peer, 7) != 0) {
+          ok = false;
+        }
+      } else {
+        ok = false;
+      }
+    }
+    if (ok) return true;
+  }
+  return false;
+}
+
+static void ws_deflate_start(struct mg_connection *c, bool takeover) {
+  struct ws_deflate *w = (struct ws_deflate *) mg_calloc(1, sizeof(*w));
+  if (w == NULL) return;
+  w->takeover = takeover;
+  c->ws_deflate = w;
+  c->is_ws_deflate = 1;
+}
+
+static void ws_deflate_end(struct mg_connection *c) {
+  struct ws_deflate *w = (struct ws_deflate *) c->ws_deflate;
+  if (w == NULL) return;
+  mg_deflate_free(&w->d);
+  mg_free(w);
+  c->ws_deflate = NULL;
+  c->is_ws_deflate = 0;
+}
+
+// Compress an outgoing message into io. Returns false if it goes as is
+static bool ws_deflate(struct mg_connection *c, const void *buf, size_t len,
+                       int op, struct mg_iobuf *io) {
+  struct ws_deflate *w = (struct ws_deflate *) c->ws_deflate;
+  bool ok;
+  if (w == NULL || !c->is_ws_deflate || len < MG_WS_DEFLATE_MIN ||
+      (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)) {
+    return false;
+  }
+  // On OOM, history is not updated either: an uncompressed message is fine
+  ok = mg_deflate(&w->d, (const char *) buf, len, false, io) && io->len >= 4;
+  if (!w->takeover) mg_deflate_free(&w->d);
+  if (ok) {
+    io->len -= 4;  // Strip 00 00 ff ff of the sync flush, RFC 7692 7.2.1
+  } else {
+    mg_iobuf_free(io);
+  }
+  return ok;
+}
+
+// Compress a message once for many connections, without context
+static bool ws_deflate_once(const void *buf, size_t len, int op,
+                            struct mg_iobuf *io) {
+  struct mg_deflate d;
+  bool ok;
+  if (len < MG_WS_DEFLATE_MIN ||
+      (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)) {
+    return false;
+  }
+  memset(&d, 0, sizeof(d));
+  ok = mg_deflate(&d, (const char *) buf, len, false, io) && io->len >= 4;
+  mg_deflate_free(&d);
+  if (ok) {
+    io->len -= 4;
+  } else {
+    mg_iobuf_free(io);
+  }
+  return ok;
+}
+
+// Check RSV bits of a received frame. Only the first frame of a data
+// message can have RSV1, and only if permessage-deflate is negotiated
+static bool ws_rsv_ok(struct mg_connection *c, uint8_t flags) {
+  uint8_t op = flags & 15;
+  if ((flags & WS_RSV1) == 0) return true;
+  return c->ws_deflate != NULL &&
+         (op == WEBSOCKET_OP_TEXT || op == WEBSOCKET_OP_BINARY);
+}
+#else
+static bool ws_rsv_ok(struct mg_connection *c, uint8_t flags) {
+  (void) c, (void) flags;
+  return true;
+}
+#endif
+
+// Deliver a complete data message, inflating it if it is compressed
+static void ws_message(struct mg_connection *c, struct mg_ws_message *m) {
+#if MG_ENABLE_DEFLATE
+  if (m->flags & WS_RSV1) {
+    struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+    if (mg_inflate(m->data.buf, m->data.len, MG_MAX_RECV_SIZE, &io)) {
+      m->data = mg_str_n(io.buf == NULL ? "" : (char *) io.buf, io.len);
+      m->flags &= (uint8_t) ~WS_RSV1;
+      mg_call(c, MG_EV_WS_MSG, m);
+    } else {
+      mg_error(c, "WS inflate error");
+    }
+    mg_iobuf_free(&io);
+    return;
+  }
+#endif
+  mg_call(c, MG_EV_WS_MSG, m);
+}
+
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list *ap) {
   size_t len = c->send.len;
@@ -26420,8 +32242,8 @@ size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...) {
 }
 
 static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
-                         const struct mg_str *wsproto, const char *fmt,
-                         va_list *ap) {
+                         const struct mg_str *wsproto, const char *ext,
+                         const char *fmt, va_list *ap) {
   const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   unsigned char sha[20], b64_sha[30];
 
@@ -26442,6 +32264,7 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
               wsproto->buf);
   }
+  if (ext != NULL) mg_printf(c, "Sec-WebSocket-Extensions: %s\r\n", ext);
   if (!mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
 }
 
@@ -26519,14 +32342,43 @@ static void mg_ws_mask(struct mg_connection *c, size_t len) {
 size_t mg_ws_send(struct mg_connection *c, const void *buf, size_t len,
                   int op) {
   uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
-  if (!mg_send(c, header, header_len)) return 0;
-  if (!mg_send(c, buf, len)) return header_len;
+  size_t header_len;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
-  mg_ws_mask(c, len);
+#if MG_ENABLE_DEFLATE
+  if (ws_deflate(c, buf, len, op, &io)) {
+    buf = io.buf, len = io.len, op |= WS_RSV1;
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
+  if (!mg_send(c, header, header_len)) {
+    header_len = len = 0;
+  } else if (!mg_send(c, buf, len)) {
+    len = 0;
+  } else {
+    mg_ws_mask(c, len);
+  }
+  mg_iobuf_free(&io);
   return header_len + len;
 }
 
+// Accept the server's permessage-deflate response, if any. We have asked
+// the server not to keep context: it must agree
+static bool ws_client_extensions(struct mg_connection *c,
+                                 struct mg_http_message *hm) {
+#if MG_ENABLE_DEFLATE
+  struct mg_str *ext = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  bool takeover = false, fresh = false;
+  if (ext == NULL) return true;
+  if (!ws_deflate_parse(*ext, true, &takeover, &fresh) || !fresh) return false;
+  ws_deflate_start(c, takeover);
+  return c->ws_deflate != NULL;
+#else
+  (void) c, (void) hm;
+  return true;
+#endif
+}
+
 static bool mg_ws_client_handshake(struct mg_connection *c) {
   int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
   if (n < 0) {
@@ -26536,7 +32388,8 @@ static bool mg_ws_client_handshake(struct mg_connection *c) {
       mg_error(c, "ws handshake error");
     } else {
       struct mg_http_message hm;
-      if (mg_http_parse((char *) c->recv.buf, c->recv.len, &hm)) {
+      if (mg_http_parse((char *) c->recv.buf, c->recv.len, &hm) &&
+          ws_client_extensions(c, &hm)) {
         c->is_websocket = 1;
         mg_call(c, MG_EV_WS_OPEN, &hm);
       } else {
@@ -26555,6 +32408,9 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
   size_t ofs = (size_t) c->pfn_data;
 
   // assert(ofs < c->recv.len);
+#if MG_ENABLE_DEFLATE
+  if (ev == MG_EV_CLOSE) ws_deflate_end(c);
+#endif
   if (ev == MG_EV_READ) {
     if (c->is_client && !c->is_websocket && mg_ws_client_handshake(c)) return;
 
@@ -26567,6 +32423,10 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
       len = msg.header_len + msg.data_len;
       final = msg.flags & 128;
       op = msg.flags & 15;
+      if ((msg.flags & 0x30) != 0 || !ws_rsv_ok(c, msg.flags)) {
+        mg_error(c, "WS RSV bits %x", msg.flags);
+        break;
+      }
       // MG_VERBOSE ("fin %d op %d len %d [%.*s]", final, op,
       //                       (int) m.data.len, (int) m.data.len, m.data.buf));
       switch (op) {
@@ -26583,7 +32443,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final) ws_message(c, &m);
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu WS CLOSE", c->id));
@@ -26613,7 +32473,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
       if (final && !op && (ofs > 0)) {
         m.flags = c->recv.buf[0];
         m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
+        ws_message(c, &m);
         mg_iobuf_del(&c->recv, 0, ofs);
         ofs = 0;
         c->pfn_data = NULL;
@@ -26640,6 +32500,12 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *mgr, const char *url,
                "Sec-WebSocket-Version: 13\r\n"
                "Sec-WebSocket-Key: %s\r\n",
                mg_url_uri(url), (int) host.len, host.buf, key);
+#if MG_ENABLE_DEFLATE
+    mg_xprintf(mg_pfn_iobuf, &c->send,
+               "Sec-WebSocket-Extensions: permessage-deflate; "
+               "server_no_context_takeover%s\r\n",
+               MG_WS_DEFLATE_TAKEOVER ? "" : "; client_no_context_takeover");
+#endif
     if (fmt != NULL) {
       va_list ap;
       va_start(ap, fmt);
@@ -26655,17 +32521,33 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *mgr, const char *url,
 
 void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
                    const char *fmt, ...) {
-  struct mg_str *wskey = mg_http_get_header(hm, "Sec-WebSocket-Key");
+  struct mg_str *wskey =
+      mg_http_get_header_id(hm, MG_HTTP_HDR_SEC_WEBSOCKET_KEY);
   c->pfn = mg_ws_cb;
   c->pfn_data = NULL;
   if (wskey == NULL) {
     mg_http_reply(c, 426, "", "WS upgrade expected\n");
     c->is_draining = 1;
   } else {
-    struct mg_str *wsproto = mg_http_get_header(hm, "Sec-WebSocket-Protocol");
+    struct mg_str *wsproto =
+        mg_http_get_header_id(hm, MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL);
+    const char *ext = NULL;
     va_list ap;
+#if MG_ENABLE_DEFLATE
+    struct mg_str *offer = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+    bool takeover = false, fresh = false;
+    if (offer != NULL && ws_deflate_parse(*offer, false, &takeover, &fresh)) {
+      // Always ask the client not to keep context, RFC 7692 7.1.1.2
+      ws_deflate_start(c, takeover);
+      if (c->ws_deflate != NULL) {
+        ext = takeover ? "permessage-deflate; client_no_context_takeover"
+                       : "permessage-deflate; client_no_context_takeover; "
+                         "server_no_context_takeover";
+      }
+    }
+#endif
     va_start(ap, fmt);
-    ws_handshake(c, wskey, wsproto, fmt, &ap);
+    ws_handshake(c, wskey, wsproto, ext, fmt, &ap);
     va_end(ap);
     c->is_websocket = 1;
     c->is_resp = 0;
@@ -26675,7 +32557,22 @@ void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
 
 size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   uint8_t header[14], *p;
-  size_t header_len = mkhdr(len, op, c->is_client, header);
+  size_t header_len;
+#if MG_ENABLE_DEFLATE
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  if (ws_deflate(c, c->send.buf + c->send.len - len, len, op, &io)) {
+    bool ok;
+    c->send.len -= len;  // Replace data with its compressed version
+    ok = mg_iobuf_add(&c->send, c->send.len, io.buf, io.len) > 0;
+    len = io.len, op |= WS_RSV1;
+    mg_iobuf_free(&io);
+    if (!ok) {
+      mg_error(c, "OOM");
+      return c->send.len;
+    }
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
 
   // NOTE: order of operations is important!
   if (mg_iobuf_add(&c->send, c->send.len, NULL, header_len) != 0) {
@@ -26683,10 +32580,81 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
     memmove(p, p - header_len, len);             // Shift data
     memcpy(p - header_len, header, header_len);  // Prepend header
     mg_ws_mask(c, len);                          // Mask data
+    MG_EPOLL_MOD(c, 1);
   }  // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
   return c->send.len;  // so far recoverable, let the caller decide
 }
 
+// Frame shared by many connections. Frame bytes follow this struct
+struct ws_bcast {
+  size_t refs;  // Holders: queued sends and mg_ws_broadcast() itself
+  size_t len;   // Frame length
+};
+
+static struct ws_bcast *ws_bcast_new(const void *buf, size_t len, int op) {
+  uint8_t header[14];
+  size_t n = mkhdr(len, op, false, header);
+  struct ws_bcast *m = (struct ws_bcast *) mg_calloc(1, sizeof(*m) + n + len);
+  if (m != NULL) {
+    m->refs = 1, m->len = n + len;
+    memcpy(m + 1, header, n);
+    if (len > 0) memcpy((char *) (m + 1) + n, buf, len);
+  }
+  return m;
+}
+
+static void ws_bcast_unref(void *arg) {
+  struct ws_bcast *m = (struct ws_bcast *) arg;
+  if (m != NULL && --m->refs == 0) mg_free(m);
+}
+
+static bool ws_bcast_send(struct mg_connection *c, struct ws_bcast *m) {
+  m->refs++;
+  if (mg_send_ref(c, m + 1, m->len, ws_bcast_unref, m)) return true;
+  m->refs--;
+  mg_error(c, "OOM");
+  return false;
+}
+
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const void *buf, size_t len, int op,
+                       bool (*fn)(struct mg_connection *, void *),
+                       void *fn_data) {
+  struct ws_bcast *plain = NULL, *packed = NULL;
+  struct mg_connection *c;
+  size_t n = 0;
+#if MG_ENABLE_DEFLATE
+  bool tried = false;
+#endif
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    if (!c->is_websocket || c->is_client || c->is_closing || c->is_draining ||
+        c->send.len + c->send_refs_len > MG_WS_BROADCAST_MAX ||
+        (fn != NULL && !fn(c, fn_data))) {
+      continue;
+    }
+#if MG_ENABLE_DEFLATE
+    if (c->is_ws_deflate && !tried) {  // Compress on first use
+      struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+      tried = true;
+      if (ws_deflate_once(buf, len, op, &io)) {
+        packed = ws_bcast_new(io.buf, io.len, op | WS_RSV1);
+      }
+      mg_iobuf_free(&io);
+    }
+    if (c->is_ws_deflate && packed != NULL) {
+      // Our context lacks this message, and the peer's has it: drop ours
+      mg_deflate_free(&((struct ws_deflate *) c->ws_deflate)->d);
+      if (ws_bcast_send(c, packed)) n++;
+      continue;
+    }
+#endif
+    if (plain == NULL && (plain = ws_bcast_new(buf, len, op)) == NULL) break;
+    if (ws_bcast_send(c, plain)) n++;
+  }
+  ws_bcast_unref(plain);
+  ws_bcast_unref(packed);
+  return n;
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/drivers/at_cmd.c"
 #endif
@@ -767,7 +767,9 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #include <mach/mach_time.h>
 #endif
 
-#if !defined(MG_ENABLE_EPOLL) && defined(__linux__)
+#if defined(MG_ENABLE_IOURING) && MG_ENABLE_IOURING
+// io_uring backend replaces epoll, see mg_iotest()
+#elif !defined(MG_ENABLE_EPOLL) && defined(__linux__)
 #define MG_ENABLE_EPOLL 1
 #elif !defined(MG_ENABLE_POLL)
 #define MG_ENABLE_POLL 1
@@ -794,7 +796,16 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #include <stdlib.h>
 #include <string.h>
 
-#if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
+#if defined(MG_ENABLE_SENDFILE) && MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if defined(MG_ENABLE_IOURING) && MG_ENABLE_IOURING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#elif defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
 #include <sys/epoll.h>
 #elif defined(MG_ENABLE_POLL) && MG_ENABLE_POLL
 #include <poll.h>
@@ -806,6 +817,7 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -825,6 +837,10 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #define MG_IO_SIZE 16384
 #endif
 
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 1
+#endif
+
 #endif
 
 
@@ -1010,6 +1026,10 @@ typedef int socklen_t;
 #define MG_IO_SIZE 16384
 #endif
 
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 1
+#endif
+
 #endif
 
 
@@ -1252,6 +1272,39 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 64  // epoll: max ready events per epoll_wait()
+#endif
+
+#ifndef MG_ENABLE_IOURING
+#define MG_ENABLE_IOURING 0  // Linux 6.0+ io_uring backend, replaces epoll
+#endif
+
+#ifndef MG_ENABLE_SENDFILE
+#define MG_ENABLE_SENDFILE 0  // Linux: serve HTTP files with sendfile()
+#endif
+
+#ifndef MG_ENABLE_SIMD
+#if defined(__GNUC__) && (defined(__SSE2__) || (defined(__ARM_NEON) && \
+                           !defined(__ARM_BIG_ENDIAN)))
+#define MG_ENABLE_SIMD 1  // Scan HTTP headers with SSE2 or NEON
+#else
+#define MG_ENABLE_SIMD 0
+#endif
+#endif
+
+#ifndef MG_IOURING_ENTRIES
+#define MG_IOURING_ENTRIES 256  // io_uring: submission queue size
+#endif
+
+#ifndef MG_IOURING_BUFS
+#define MG_IOURING_BUFS 256  // io_uring: receive buffers, power of 2
+#endif
+
+#ifndef MG_IOURING_BUF_SIZE
+#define MG_IOURING_BUF_SIZE 2048  // io_uring: size of each receive buffer
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -1272,6 +1325,10 @@ struct timeval {
 #define MG_IPV6_V6ONLY 0  // IPv6 socket binds only to V6, not V4 address
 #endif
 
+#ifndef MG_ENABLE_REUSEPORT
+#define MG_ENABLE_REUSEPORT 0  // Listeners set SO_REUSEPORT: one per event loop
+#endif
+
 #ifndef MG_ENABLE_MD5
 #define MG_ENABLE_MD5 1
 #endif
@@ -1302,6 +1359,35 @@ struct timeval {
 #define MG_IO_SIZE 512  // Granularity of the send/recv IO buffer growth
 #endif
 
+// Max step of 2x IO buffer growth. 0: grow as needed, which saves RAM
+#ifndef MG_IO_GROW_MAX
+#if MG_ARCH == MG_ARCH_UNIX || MG_ARCH == MG_ARCH_WIN32
+#define MG_IO_GROW_MAX (256UL * 1024UL)
+#else
+#define MG_IO_GROW_MAX 0
+#endif
+#endif
+
+#ifndef MG_IO_REALLOC
+#define MG_IO_REALLOC 0  // Resize IO buffers with realloc(), don't zero old ones
+#endif
+
+#ifndef MG_IO_SHRINK
+#define MG_IO_SHRINK (MG_IO_SIZE * 16)  // Free larger empty conn IO buffers
+#endif
+
+#ifndef MG_IO_COALESCE_MAX
+#define MG_IO_COALESCE_MAX 65536  // Built-in TLS: max bytes per coalesced write
+#endif
+
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 0  // Schedule mg_mgr timers on a timer wheel
+#endif
+
+#ifndef MG_POOL_SIZE
+#define MG_POOL_SIZE 0  // Default mgr->pool.max: free connections kept for reuse
+#endif
+
 #ifndef MG_MAX_RECV_SIZE
 #define MG_MAX_RECV_SIZE (3UL * 1024UL * 1024UL)  // Maximum recv IO buffer size
 #endif
@@ -1318,6 +1404,95 @@ struct timeval {
 #define MG_HTTP_INDEX "index.html"
 #endif
 
+#ifndef MG_TLS_CTX_CACHE_SIZE
+#define MG_TLS_CTX_CACHE_SIZE 4  // Shared OpenSSL/mbedTLS contexts per manager
+#endif
+
+#ifndef MG_TLS_CERT_CACHE_SIZE
+#define MG_TLS_CERT_CACHE_SIZE 8  // Verified peer certificate chains, builtin
+#endif
+
+#ifndef MG_HTTP_CACHE_SIZE
+#define MG_HTTP_CACHE_SIZE 0  // mg_http_serve_dir() file cache entries, 0 = off
+#endif
+
+#ifndef MG_HTTP_CACHE_MAX_FILE
+#define MG_HTTP_CACHE_MAX_FILE 16384  // Cache content of files up to this size
+#endif
+
+#ifndef MG_HTTP_CACHE_TTL
+#define MG_HTTP_CACHE_TTL 1000  // Milliseconds before rechecking file mtime
+#endif
+
+#ifndef MG_ENABLE_DEFLATE
+#define MG_ENABLE_DEFLATE 0  // Deflate, gzip HTTP, WebSocket permessage-deflate
+#endif
+
+#ifndef MG_DEFLATE_WINDOW
+#define MG_DEFLATE_WINDOW 4096  // Input kept for matches by next mg_deflate()
+#endif
+
+#ifndef MG_HTTP_GZIP_MIN
+#define MG_HTTP_GZIP_MIN 256  // Don't compress smaller HTTP responses
+#endif
+
+#ifndef MG_HTTP_GZIP_TYPES  // Compressible Content-Type patterns
+#define MG_HTTP_GZIP_TYPES \
+  "text/#,application/json#,application/javascript#,application/xml#,*/#+xml#"
+#endif
+
+#ifndef MG_HTTP_GZIP_CACHE_SIZE
+#define MG_HTTP_GZIP_CACHE_SIZE 8  // Compressed static files kept in memory
+#endif
+
+#ifndef MG_HTTP_GZIP_MAX_FILE
+#define MG_HTTP_GZIP_MAX_FILE 262144  // Compress static files up to this size
+#endif
+
+#ifndef MG_WS_BROADCAST_MAX
+#define MG_WS_BROADCAST_MAX 262144  // mg_ws_broadcast() skips busier conns
+#endif
+
+#ifndef MG_WS_DEFLATE_MIN
+#define MG_WS_DEFLATE_MIN 128  // Don't compress smaller WebSocket messages
+#endif
+
+#ifndef MG_WS_DEFLATE_TAKEOVER
+#define MG_WS_DEFLATE_TAKEOVER 1  // Match WS messages against earlier ones
+#endif
+
+#ifndef MG_ENABLE_HTTP2
+#define MG_ENABLE_HTTP2 0  // HTTP/2 server, see mg_http_listen()
+#endif
+
+#ifndef MG_HTTP2_MAX_STREAMS
+#define MG_HTTP2_MAX_STREAMS 16  // Concurrent HTTP/2 streams per connection
+#endif
+
+#ifndef MG_ENABLE_MQTT_BROKER
+#define MG_ENABLE_MQTT_BROKER 0  // MQTT broker, see mg_mqtt_broker_listen()
+#endif
+
+#ifndef MG_MQTT_INFLIGHT
+#define MG_MQTT_INFLIGHT 16  // Unacknowledged QoS 1/2 msgs per MQTT session
+#endif
+
+#ifndef MG_MQTT_QUEUE_MAX
+#define MG_MQTT_QUEUE_MAX 1000  // QoS 1/2 msgs queued per MQTT session
+#endif
+
+#ifndef MG_MQTT_SAVE_MS
+#define MG_MQTT_SAVE_MS 1000  // MQTT session: min time between file saves
+#endif
+
+#ifndef MG_MQTT_TOPIC_ALIASES
+#define MG_MQTT_TOPIC_ALIASES 16  // MQTT5 client: topic aliases per connection
+#endif
+
+#ifndef MG_MQTT_MAX_LEVELS
+#define MG_MQTT_MAX_LEVELS 32  // Broker: topic levels, e.g. a/b/c has 3
+#endif
+
 #ifndef MG_PATH_MAX
 #ifdef PATH_MAX
 #define MG_PATH_MAX PATH_MAX
@@ -1355,12 +1530,25 @@ struct timeval {
   do {                                                                     \
     struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
+    c->is_epollout = 0;                                                    \
   } while (0)
+// Change EPOLLOUT interest only when it differs from the registered one
 #define MG_EPOLL_MOD(c, wr)                                                \
   do {                                                                     \
     struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    if (c->is_epollout == ((wr) ? 1U : 0U) || c->mgr == NULL ||            \
+        c->fd == (void *) (size_t) MG_INVALID_SOCKET)                      \
+      break;                                                               \
     if (wr) ev.events |= EPOLLOUT;                                         \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
+    c->is_epollout = (wr) ? 1U : 0U;                                       \
+  } while (0)
+#elif MG_ENABLE_IOURING
+// io_uring operations are armed by mg_mgr_poll(): make it come round soon
+#define MG_EPOLL_ADD(c) (c)->mgr->epoll_busy = true
+#define MG_EPOLL_MOD(c, wr)                                    \
+  do {                                                         \
+    if ((wr) && (c)->mgr != NULL) (c)->mgr->epoll_busy = true; \
   } while (0)
 #else
 #define MG_EPOLL_ADD(c)
@@ -1822,7 +2010,7 @@ void mg_log_set_fn(mg_pfn_t fn, void *param);
 
 struct mg_timer {
   uint64_t period_ms;          // Timer period in milliseconds
-  uint64_t expire;             // Expiration timestamp in milliseconds
+  uint64_t expire;             // Expiration timestamp in milliseconds. See below
   unsigned flags;              // Possible flags values below
 #define MG_TIMER_ONCE 0        // Call function once
 #define MG_TIMER_REPEAT 1      // Call function periodically
@@ -1832,13 +2020,37 @@ struct mg_timer {
   void (*fn)(void *);          // Function to call
   void *arg;                   // Function argument
   struct mg_timer *next;       // Linkage
+  struct mg_timer **prev;      // Pointer to us in the list, for O(1) free
+  struct mg_timer *wnext;      // Timer wheel slot linkage
+  struct mg_timer **wprev;     // Pointer to us in a timer wheel slot
+};
+
+// Hierarchical timer wheel with 1 ms resolution: MG_TIMER_WHEEL_LEVELS levels
+// of 64 slots, each level 64 times coarser than the previous. Timers are
+// scheduled and cancelled in O(1), and polling touches only expired timers
+#define MG_TIMER_WHEEL_LEVELS 4
+struct mg_timer_wheel {
+  uint64_t tick;                                   // Next millisecond to run
+  uint64_t bits[MG_TIMER_WHEEL_LEVELS];            // Non-empty slots bitmap
+  struct mg_timer *slots[MG_TIMER_WHEEL_LEVELS][64];  // Scheduled timers
 };
 
+// Timers of a struct mg_mgr run off its timer wheel, which files a timer
+// under its expire time when it is scheduled. Setting expire to a later time
+// is honoured: the timer is filed again when its old slot comes due. Setting
+// it to an earlier time takes effect only then; to fire sooner, free the
+// timer and add a new one
+
 void mg_timer_init(struct mg_timer **head, struct mg_timer *timer,
                    uint64_t milliseconds, unsigned flags, void (*fn)(void *),
                    void *arg);
+// Unlinks the timer from its list and wheel. head is unused: timers know
+// their list position. Kept for API compatibility, pass the list head
 void mg_timer_free(struct mg_timer **head, struct mg_timer *);
 void mg_timer_poll(struct mg_timer **head, uint64_t new_ms);
+void mg_timer_wheel_poll(struct mg_timer_wheel *, struct mg_timer **head,
+                         uint64_t now);
+int mg_timer_wheel_timeout(struct mg_timer_wheel *, uint64_t now, int ms);
 
 
 
@@ -2169,6 +2381,7 @@ struct mg_iobuf {
   size_t size;         // Allocated capacity (rounded up to align)
   size_t len;          // Number of bytes currently stored
   size_t align;        // Allocation granularity; capacity is always a multiple of this
+  size_t head;         // Bytes deleted from the front; allocation is at buf - head
 };
 
 // Initializes io to empty, then allocates size bytes with the given alignment.
@@ -2176,13 +2389,19 @@ struct mg_iobuf {
 bool mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align);
 
 // Resizes the buffer to new_size (rounded up to io->align). new_size=0 frees
-// the buffer. Uses mg_calloc+mg_free (not realloc) so old memory is zeroed on release.
+// the buffer. Uses mg_calloc+mg_free (not realloc) so old memory is zeroed on release,
+// unless built with MG_IO_REALLOC=1.
 // Returns false on allocation failure.
 bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size);
 
 // Frees the buffer and zeroes the struct. Equivalent to mg_iobuf_resize(io, 0).
 void mg_iobuf_free(struct mg_iobuf *io);
 
+// Makes room for len more bytes. The buffer doubles, but grows by no more than
+// MG_IO_GROW_MAX at a time unless len needs more, so appending in small pieces
+// is not quadratic. Returns false on allocation failure.
+bool mg_iobuf_reserve(struct mg_iobuf *io, size_t len);
+
 // Inserts len bytes from buf at offset ofs, shifting existing data right.
 // Pass buf=NULL to reserve space without writing. Returns bytes inserted, 0 on OOM.
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf, size_t len);
@@ -2191,6 +2410,13 @@ size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf, size_t len
 // Returns bytes actually removed.
 size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len);
 
+// Removes len bytes from the front without moving the rest: buf moves forward
+// instead, and io->head grows. Consuming a large buffer in small pieces, like
+// sent data, is then linear rather than quadratic. Once the skipped space
+// exceeds half of the allocation, the data is moved back to its start so that
+// a buffer which never fully drains keeps its capacity. Returns bytes removed.
+size_t mg_iobuf_skip(struct mg_iobuf *io, size_t len);
+
 
 size_t mg_base64_update(unsigned char input_byte, char *buf, size_t len);
 size_t mg_base64_final(char *buf, size_t len);
@@ -2263,6 +2489,42 @@ void mg_sha384(uint8_t dst[48], uint8_t *data, size_t datasz);
 
 
 
+
+
+
+// Deflate (RFC 1951) compressor. Zero-initialise before the first call.
+// Data compressed by one call can be matched by the next ones, within the
+// last MG_DEFLATE_WINDOW input bytes
+struct mg_deflate {
+  char *win;      // Recent input (internal)
+  size_t wlen;    // Bytes in win (internal)
+  uint32_t crc;   // gzip: CRC32 of the input so far
+  uint32_t size;  // gzip: input length so far, modulo 2^32
+  bool started;   // gzip: header is written (internal)
+};
+
+// Compresses len bytes of buf and appends the result to io. Unless last is
+// true, output ends with a sync flush: a receiver can decode all the data
+// given so far, and the output ends with 00 00 ff ff. If last is true, the
+// stream is finished and d is freed. Returns false on OOM
+bool mg_deflate(struct mg_deflate *d, const char *buf, size_t len, bool last,
+                struct mg_iobuf *io);
+
+// Same as mg_deflate(), but produces a gzip (RFC 1952) stream
+bool mg_gzip(struct mg_deflate *d, const char *buf, size_t len, bool last,
+             struct mg_iobuf *io);
+
+// Frees the compressor state, e.g. if the stream is abandoned
+void mg_deflate_free(struct mg_deflate *d);
+
+// Decompresses len bytes of raw deflate data and appends the result to io.
+// Each call decodes a stream of its own: data may not refer to the output
+// of earlier calls. Input can end with a final block, or after a sync flush,
+// with or without its trailing 00 00 ff ff. Returns false on malformed or
+// truncated input, on OOM, or if the output exceeds max bytes
+bool mg_inflate(const char *buf, size_t len, size_t max, struct mg_iobuf *io);
+
+
 struct mg_connection;
 
 // User-supplied event handler. ev is enum mg_event; ev_data type depends on
@@ -2304,6 +2566,7 @@ enum mg_event {
   MG_EV_MDNS_REQ,   // mDNS request                 struct mg_mdns_req *
   MG_EV_MDNS_RESP,  // mDNS response                struct mg_mdns_resp *
   MG_EV_MODBUS_REQ, // Modbus TCP request            struct mg_modbus_req *
+  MG_EV_HTTP_BODY,  // HTTP body fragment           struct mg_http_message *
   MG_EV_USER        // Starting ID for user events
 };
 
@@ -2339,6 +2602,29 @@ union mg_pipe {
   void *q;
 };
 
+// Per-manager pool of free connections and MG_IO_SIZE IO buffers. Closed
+// connections and their single-block buffers go to the pool, and new ones
+// come from it, instead of mg_calloc() / mg_free() on every connection
+struct mg_pool {
+  size_t max;         // Max free connections, and free buffers, kept. 0: off
+  size_t conns;       // Connections in use
+  size_t conns_peak;  // High watermark of conns
+  size_t free_conns;  // Free connections in the pool
+  size_t free_bufs;   // Free IO buffers in the pool
+  size_t reused;      // Connections and buffers taken from the pool
+  void *conn_list;    // Free connections (internal)
+  void *buf_list;     // Free IO buffers (internal)
+  size_t conn_size;   // Size of a pooled connection (internal)
+};
+
+// Send counters, e.g. to compare syscalls and TLS records per response with
+// and without mgr->coalesce. Read and reset freely
+struct mg_io_stats {
+  size_t sends;    // Calls into the network stack, e.g. send() syscalls
+  size_t records;  // TLS application data records produced
+  size_t bytes;    // Bytes accepted by the network stack
+};
+
 // Central event manager. Zero-initialise with mg_mgr_init() before use.
 struct mg_mgr {
   struct mg_connection *conns;  // Linked list of all open connections
@@ -2353,14 +2639,30 @@ struct mg_mgr {
   uint16_t mqtt_id;             // Packet ID counter for MQTT pub/sub
   void *active_dns_requests;    // Pending DNS queries (internal)
   void *active_mdns_requests;   // Pending mDNS resolver queries (internal)
+  void *http_cache;             // mg_http_serve_dir() file cache (internal)
+  void *http_gzip;              // Compressed static files cache (internal)
+  void *conn_index;             // Connection hash index by ID and 4-tuple (internal)
   struct mg_timer *timers;      // Linked list of active timers
   int epoll_fd;                 // epoll file descriptor; -1 when unused (MG_EPOLL_ENABLE=1)
+  bool epoll_busy;              // epoll, io_uring: work pending, don't block
+  bool poll_opt_in;             // MG_EV_POLL only for busy or is_polled connections
+  bool coalesce;                // Flush all connections once per poll, see c->is_coalescing
+  struct mg_io_stats io;        // Send counters
+  size_t io_shrink;             // Free idle conn IO buffers larger than this, 0: keep
+  uint64_t io_shrink_ms;        // Time of the next io_shrink check (internal)
+  struct mg_pool pool;          // Connection and IO buffer pool, see MG_POOL_SIZE
   struct mg_tcpip_if *ifp;      // Builtin TCP/IP stack: network interface pointer
   size_t extraconnsize;         // Builtin TCP/IP stack: extra bytes allocated per connection
   union mg_pipe pipe;           // Socketpair write-end / queue, used by mg_wakeup()
+#if MG_ENABLE_TIMER_WHEEL
+  struct mg_timer_wheel wheel;  // Expiration schedule of 'timers' (internal)
+#endif
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;               // FreeRTOS-TCP socket set
 #endif
+#if MG_ENABLE_IOURING
+  void *iou;                    // io_uring rings and receive buffers (internal)
+#endif
 };
 
 // A single network connection. Do not allocate directly; use mg_connect() or
@@ -2382,6 +2684,21 @@ struct mg_connection {
   void *pfn_data;                 // Protocol-level handler argument
   char data[MG_DATA_SIZE];        // Scratch space for protocol state; freely readable
   void *tls;                      // TLS state (internal)
+  void *send_refs;                // Buffers queued by mg_send_ref() (internal)
+  size_t send_refs_len;           // Bytes in send_refs, not yet sent (internal)
+  size_t http_head;               // HTTP: pending message header length (internal)
+  size_t http_scan;               // HTTP: pending message bytes scanned (internal)
+  struct mg_connection *id_next;  // Next in mgr->conn_index ID bucket (internal)
+#if MG_ENABLE_DEFLATE
+  void *http_gzip;                // HTTP: chunked response compressor (internal)
+  void *ws_deflate;               // WebSocket: permessage-deflate state (internal)
+#endif
+#if MG_ENABLE_TCPIP
+  struct mg_connection *tuple_next;  // Next in 4-tuple bucket (internal)
+#endif
+#if MG_ENABLE_IOURING
+  void *iou;                      // io_uring: in-flight I/O state (internal)
+#endif
   unsigned dscp : 6;              // Differentiated Services Code Point
 #define MG_DSCP_CS(class_) ((class_) << 3)
 #define MG_DSCP_AF(class_, drop_) (((class_) << 3) | ((drop_) << 1))
@@ -2403,8 +2720,19 @@ struct mg_connection {
   unsigned is_full : 1;           // Pause incoming reads until cleared
   unsigned is_tls_throttled : 1;  // TLS write was throttled; retry pending
   unsigned is_resp : 1;           // HTTP: response is still being generated
+  unsigned is_http_stream : 1;    // HTTP: deliver bodies as MG_EV_HTTP_BODY
+  unsigned is_http_body : 1;      // HTTP: streaming a body (internal)
+  unsigned is_http_eof : 1;       // HTTP: streamed body ends on close (internal)
+  unsigned is_http_gzip : 1;      // HTTP: compress response, peer accepts gzip
+  unsigned is_ws_deflate : 1;     // WebSocket: compress messages, see ws.h
+  unsigned is_http2 : 1;          // HTTP/2 stream: no socket, uses parent's
   unsigned is_readable : 1;       // Socket is ready to read (epoll/select)
   unsigned is_writable : 1;       // Socket is ready to write (epoll/select)
+  unsigned is_polled : 1;         // Always get MG_EV_POLL, see mgr->poll_opt_in
+  unsigned is_epollout : 1;       // epoll: EPOLLOUT interest is registered
+  unsigned is_sendfile : 1;       // Wait for writability: sending a file
+  unsigned is_coalescing : 1;     // Flush once per poll, see mgr->coalesce
+  unsigned is_coalesced : 1;      // Flush is deferred to the end of poll (internal)
 };
 
 // Runs one iteration of the event loop.
@@ -2420,6 +2748,19 @@ struct mg_connection {
 //   Waits up to ms milliseconds for I/O events; use ms=0 to return
 //   immediately. Calls event handlers for ready connections and fires expired
 //   timers. Call repeatedly from the main loop or a dedicated network task.
+//   By default, every connection gets MG_EV_POLL on every call. With many
+//   idle sockets, set mgr->poll_opt_in: then idle connections - nothing
+//   to read, write or close - are skipped entirely, and only those with
+//   c->is_polled set keep getting MG_EV_POLL, e.g. to run their timeouts.
+//   With MG_ENABLE_EPOLL=1, only ready sockets are reported by the kernel,
+//   and EPOLLOUT interest is changed only when the send buffer becomes
+//   empty or non-empty, so the cost of an idle connection is a few flag tests
+//   Set mgr->coalesce, or c->is_coalescing for a single connection, to batch
+//   small writes: output of such connections is flushed after all handlers
+//   of the iteration have run, with one send call, even if it was produced
+//   by other connections' handlers, and the built-in TLS stack packs it in
+//   records of up to 16K instead of MG_IO_SIZE. mgr->io counts send calls
+//   and TLS records. The built-in TCP/IP stack always flushes last
 void mg_mgr_poll(struct mg_mgr *, int ms);
 
 // Initialises an event manager before use.
@@ -2449,6 +2790,8 @@ void mg_mgr_free(struct mg_mgr *);
 
 // Creates a listening connection on url (e.g. "tcp://0.0.0.0:8080").
 // Fires MG_EV_OPEN on the listener, then MG_EV_ACCEPT for each new client.
+// With MG_ENABLE_REUSEPORT=1, several managers may listen on the same url;
+// the OS then distributes accepted connections between them.
 // Returns NULL on error.
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
@@ -2480,6 +2823,14 @@ void mg_connect_resolved(struct mg_connection *);
 // Data is sent asynchronously by the next mg_mgr_poll() call.
 bool mg_send(struct mg_connection *, const void *, size_t);
 
+// Like mg_send(), but queues buf/len without copying it. buf must stay valid
+// until fn(fn_data) is called: when the data is sent, or the connection is
+// closed. fn may be NULL. Data sent later with mg_send() / mg_printf() goes
+// after buf. Plain TCP sockets flush c->send and queued buffers with one
+// writev()-style call. Returns false on OOM; then fn is not called.
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data);
+
 // Formats data and appends it to a connection send buffer.
 //
 // Returns:
@@ -2519,11 +2870,24 @@ void mg_close_conn(struct mg_connection *c);
 // Returns false on error.
 bool mg_open_listener(struct mg_connection *c, const char *url);
 
+// Internal: housekeeping used by the network stacks. Not for application use.
+struct mg_connection *mg_conn_by_id(struct mg_mgr *, unsigned long id);
+struct mg_connection *mg_conn_by_tuple(struct mg_mgr *, uint16_t port,
+                                       const struct mg_addr *rem);
+void mg_conn_index_tuple(struct mg_connection *);
+void mg_conn_index_del(struct mg_connection *);
+void mg_pool_iobuf(struct mg_mgr *, struct mg_iobuf *);
+void mg_mgr_shrink(struct mg_mgr *, uint64_t now);
+void mg_iouring_init(struct mg_mgr *);
+void mg_iouring_free(struct mg_mgr *);
+
 // Thread-safe wakeup: fires MG_EV_WAKEUP on the connection whose id matches,
 // with ev_data pointing to an mg_str containing buf/len.
 // Requires mg_wakeup_init() to have been called first.
 // Returns false if the pipe is not initialised or conn_id is 0.
-// Safe to call from any thread or interrupt context.
+// Safe to call from any thread or interrupt context, including an event
+// handler of another manager: that is how event loops running in different
+// threads pass messages to each other, see tutorials/core/multi-reactor.
 bool mg_wakeup(struct mg_mgr *, unsigned long id, const void *buf, size_t len);
 
 // Initialises the internal socketpair used by mg_wakeup(). Call once after
@@ -2559,6 +2923,25 @@ struct mg_http_header {
   struct mg_str value;  // Header value, e.g. "text/html"
 };
 
+// Well-known headers. mg_http_parse() indexes them, so that
+// mg_http_get_header_id() finds them without scanning headers[]
+enum {
+  MG_HTTP_HDR_CONTENT_LENGTH,     // Headers up to Cookie must not repeat:
+  MG_HTTP_HDR_TRANSFER_ENCODING,  // mg_http_parse() rejects messages
+  MG_HTTP_HDR_CONNECTION,         // that repeat them
+  MG_HTTP_HDR_AUTHORIZATION,
+  MG_HTTP_HDR_COOKIE,
+  MG_HTTP_HDR_HOST,
+  MG_HTTP_HDR_CONTENT_TYPE,
+  MG_HTTP_HDR_ACCEPT_ENCODING,
+  MG_HTTP_HDR_IF_NONE_MATCH,
+  MG_HTTP_HDR_RANGE,
+  MG_HTTP_HDR_UPGRADE,
+  MG_HTTP_HDR_SEC_WEBSOCKET_KEY,
+  MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL,
+  MG_HTTP_HDR_MAX
+};
+
 // Parsed HTTP request or response.
 // Passed as ev_data in MG_EV_HTTP_MSG and MG_EV_HTTP_HDRS.
 // For requests:  method="GET", uri="/path", proto="a=1&b=2", proto="HTTP/1.1"
@@ -2566,6 +2949,7 @@ struct mg_http_header {
 struct mg_http_message {
   struct mg_str method, uri, query, proto;             // Request/response line
   struct mg_http_header headers[MG_MAX_HTTP_HEADERS];  // Parsed headers array
+  uint16_t hdr_index[MG_HTTP_HDR_MAX];  // Well-known: 1 + headers[] index, or 0
   struct mg_str body;     // Request or response body
   struct mg_str head;     // Raw bytes: request/status line + headers, no body
   struct mg_str message;  // Raw bytes: head + body
@@ -2602,6 +2986,9 @@ void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 
 // Sends one chunk in HTTP chunked transfer encoding from a raw buffer.
 // Call with len=0 to send the terminating zero-length chunk.
+// With MG_ENABLE_DEFLATE=1, chunks are gzip-compressed if c->is_http_gzip is
+// set and the response headers, sent just before the first chunk, have a
+// Content-Type matching MG_HTTP_GZIP_TYPES and no Content-Encoding.
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 
 // Creates an HTTP server on url, e.g. "http://0.0.0.0:8000".
@@ -2619,6 +3006,19 @@ void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 //   receives normal connection events. It also receives MG_EV_HTTP_HDRS when
 //   headers are received and MG_EV_HTTP_MSG when the full request is received.
 //   ev_data for both HTTP events is struct mg_http_message *.
+//   To receive large bodies in constant memory, set c->is_http_stream, e.g.
+//   on MG_EV_HTTP_HDRS. The body then arrives, de-chunked, as a sequence of
+//   MG_EV_HTTP_BODY events with hm->body set to the fragment, followed by
+//   MG_EV_HTTP_MSG with an empty hm->body. Set c->is_full to pause delivery,
+//   clear it to resume.
+//   With MG_ENABLE_HTTP2=1, clients can also speak HTTP/2: over TLS, set
+//   opts.alpn = mg_str("h2,http/1.1") in mg_tls_init(); in plain text,
+//   clients must use prior knowledge. Each request stream gets a connection
+//   of its own, c->is_http2 set, that receives MG_EV_OPEN, MG_EV_ACCEPT,
+//   then MG_EV_HTTP_MSG with hm->proto "HTTP/2.0" and takes a reply the
+//   usual way. Stream connections use the parent's TLS session and have
+//   c->is_tls clear; mg_tls_init() on them does nothing. Up to
+//   MG_HTTP2_MAX_STREAMS requests per connection are served concurrently
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
 
@@ -2653,11 +3053,21 @@ struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
 // Notes:
 //   Call from an MG_EV_HTTP_MSG handler. The uri in hm is mapped under
 //   opts->root_dir. Directory listing depends on MG_ENABLE_DIRLIST; SSI uses
-//   opts->ssi_pattern when configured.
+//   opts->ssi_pattern when configured. With MG_HTTP_CACHE_SIZE > 0, each
+//   manager caches metadata of served files, and content of files up to
+//   MG_HTTP_CACHE_MAX_FILE bytes: repeated requests don't touch the
+//   filesystem. File changes are noticed within MG_HTTP_CACHE_TTL ms.
+//   With MG_ENABLE_DEFLATE=1, files matching MG_HTTP_GZIP_TYPES with no .gz
+//   sibling are compressed on the fly for clients that accept gzip. The last
+//   MG_HTTP_GZIP_CACHE_SIZE compressed files are kept in memory by path and
+//   ETag, so each file version is compressed once.
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *);
 
 // Serves a single file at path. Call from an MG_EV_HTTP_MSG handler.
+// With MG_ENABLE_SENDFILE=1 (Linux, not with io_uring; off by default), files
+// from mg_fs_posix are sent over plain TCP connections with sendfile(),
+// without copying to c->send.
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
 
@@ -2675,6 +3085,10 @@ void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
 //   headers must end with "\r\n"; pass "" or NULL for no extra headers.
 //   body_fmt is printf-style and supports %M/%m custom printers. Use MG_ESC
 //   when printing JSON strings.
+//   With MG_ENABLE_DEFLATE=1, the body is gzip-compressed if the request
+//   accepts gzip, headers set a Content-Type matching MG_HTTP_GZIP_TYPES, and
+//   the body is at least MG_HTTP_GZIP_MIN bytes. c->is_http_gzip is set for
+//   each request that accepts gzip; clear it to send a response as is.
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
 
@@ -2682,6 +3096,12 @@ void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
 // Returns a pointer to the mg_str value, or NULL if not found.
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
 
+// Looks up a well-known header, e.g. MG_HTTP_HDR_RANGE, in the index built
+// by mg_http_parse(). Returns a pointer to the first such header's value, or
+// NULL if not found. Unlike mg_http_get_header(), does not scan headers[],
+// unless nothing is indexed, e.g. for a message filled in by hand
+struct mg_str *mg_http_get_header_id(struct mg_http_message *, int id);
+
 // Extracts a named variable from a query string or form-encoded body (buf).
 // Returns the raw (URL-encoded) value as mg_str, or an empty mg_str if not found.
 // Not NUL-terminated. Use mg_url_decode() to get a decoded string.
@@ -2749,6 +3169,12 @@ size_t mg_http_next_multipart(struct mg_str, size_t, struct mg_http_part *);
 // Returns the HTTP status code from a parsed response message (e.g. 200, 404).
 int mg_http_status(const struct mg_http_message *hm);
 
+// Internal: frees manager-wide HTTP caches, and switches an accepted
+// connection to HTTP/2. Not for application use.
+void mg_http_cache_free(struct mg_mgr *);
+void mg_http_gzip_free(struct mg_mgr *);
+bool mg_http2_accept(struct mg_connection *c);
+
 
 void mg_http_serve_ssi(struct mg_connection *c, const char *root,
                        const char *fullpath);
@@ -2792,12 +3218,16 @@ void mg_http_serve_ssi(struct mg_connection *c, const char *root,
 //   Empty disables hostname verification.
 // - `skip_verification`: Skip certificate and hostname verification.
 //   Useful during development; do not use in production.
+// - `alpn`: Application protocols a server accepts, comma-separated, in
+//   order of preference, e.g. "h2,http/1.1". Set on servers. The first one
+//   the client also offers is selected; empty disables ALPN.
 struct mg_tls_opts {
   struct mg_str ca;       // CA certificate, PEM or DER
   struct mg_str cert;     // Our certificate, PEM or DER
   struct mg_str key;      // Our private key, PEM or DER
   struct mg_str name;     // Server name for SNI + hostname verification
   bool skip_verification;  // Skip certificate and hostname verification
+  struct mg_str alpn;     // Server: accepted ALPN protocols, e.g. "h2,http/1.1"
 };
 
 // Initialises TLS on a connection.
@@ -2827,7 +3257,8 @@ struct mg_tls_opts {
 //   Call from the user-supplied event handler on MG_EV_ACCEPT for servers or
 //   MG_EV_CONNECT for clients, before application data is sent. Servers usually
 //   set cert and key. Clients usually set ca and name; name enables SNI and
-//   hostname verification.
+//   hostname verification. Does nothing on HTTP/2 stream connections, which
+//   use the parent connection's TLS session.
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts);
 
 // Private API, do not expose
@@ -2845,12 +3276,33 @@ void mg_tls_ctx_free(struct mg_mgr *);
 // Extracts a 32-byte P-256 private scalar from EC PRIVATE KEY or PKCS#8 PRIVATE
 // KEY input. Accepts PEM or DER. Returns key size, or 0 on error.
 size_t mg_uecc_parse_private_key(struct mg_str key, uint8_t *buf, size_t len);
+
+// TLS 1.3 session store for client-side resumption. A session is an opaque
+// blob, saved under the server "name:port" (or IP:port when no name is set)
+// when the server issues a session ticket, and loaded before ClientHello.
+// Tickets are single-use: load() should remove the session it returns.
+// - `save`: store `len` bytes of `buf` for `name`, replacing an older session
+// - `load`: copy the session for `name` into `buf`, return its length, or 0
+//   if there is none or it does not fit in `len` bytes
+struct mg_tls_session_store {
+  void (*save)(void *arg, const char *name, const void *buf, size_t len);
+  size_t (*load)(void *arg, const char *name, void *buf, size_t len);
+  void *arg;  // Passed to save() and load()
+};
+
+// Sets the session store for client connections of a manager, e.g. to keep
+// sessions in flash across reboots. NULL restores the default in-memory
+// store, which keeps up to MG_TLS_CTX_CACHE_SIZE sessions. A store with NULL
+// functions disables resumption.
+void mg_tls_set_session_store(struct mg_mgr *,
+                              const struct mg_tls_session_store *);
 #endif
 
 // Low-level IO primitives used by TLS layer
 enum { MG_IO_ERR = -1, MG_IO_WAIT = -2 };
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len);
 long mg_io_recv(struct mg_connection *c, void *buf, size_t len);
+long mg_io_sendfile(struct mg_connection *c, int fd, size_t len);
 #ifndef TLS_X15519_H
 #define TLS_X15519_H
 
@@ -3735,22 +4187,35 @@ bool mg_rsa_verify(const uint8_t *em, size_t nlen, const uint8_t *mhash);
 #include <mbedtls/ssl.h>
 #include <mbedtls/ssl_ticket.h>
 
+// SSL config with the parsed CA, cert and key, shared by connections with
+// the same options. Referenced by the cache and by each connection using it
+struct mg_tls_conf {
+  mbedtls_ssl_config conf;  // SSL/TLS config
+  mbedtls_x509_crt ca;      // Parsed CA certificate
+  mbedtls_x509_crt cert;    // Parsed certificate
+  mbedtls_pk_context pk;    // Private key context
+  struct mg_str ca_str, cert_str, key_str;  // Copies of the options
+  struct mg_str alpn_str;   // Copy of the options, too
+  const char *alpn[5];      // Server: ALPN protocols, NULL-terminated
+  bool is_client;           // Client or server config
+  bool check_name;          // Host name given, affects authmode without CA
+  struct mg_connection *c;  // Connection in an mbedTLS call, for debug_cb()
+  unsigned long used;       // Last use stamp, for LRU eviction
+  int refs;                 // Reference count
+};
+
 struct mg_tls_ctx {
-  int dummy;
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
   mbedtls_ssl_ticket_context tickets;
+  bool has_tickets;  // Ticket keys set up, servers issue session tickets
 #endif
+  unsigned long used;
+  struct mg_tls_conf *confs[MG_TLS_CTX_CACHE_SIZE];
 };
 
 struct mg_tls {
-  mbedtls_x509_crt ca;      // Parsed CA certificate
-  mbedtls_x509_crt cert;    // Parsed certificate
-  mbedtls_pk_context pk;    // Private key context
-  mbedtls_ssl_context ssl;  // SSL/TLS context
-  mbedtls_ssl_config conf;  // SSL/TLS config
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-  mbedtls_ssl_ticket_context ticket;  // Session tickets context
-#endif
+  mbedtls_ssl_context ssl;    // SSL/TLS context
+  struct mg_tls_conf *conf;   // Shared SSL/TLS config
   // https://github.com/Mbed-TLS/mbedtls/blob/3b3c652d/include/mbedtls/ssl.h#L5071C18-L5076C29
   unsigned char *throttled_buf;  // see #3074
   size_t throttled_len;
@@ -3765,12 +4230,28 @@ struct mg_tls {
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+// SSL_CTX built once for a role, CA, cert and key, see mg_tls_init()
+struct mg_tls_ctx_entry {
+  SSL_CTX *ctx;                  // NULL if the entry is unused
+  bool is_client;                // Client or server context
+  struct mg_str ca, cert, key;   // Copies of the options it was built from
+  unsigned long used;            // Last use stamp, for LRU eviction
+};
+
+struct mg_tls_ctx {
+  BIO_METHOD *bm;  // Shared by all connections
+  unsigned long used;
+  struct mg_tls_ctx_entry entries[MG_TLS_CTX_CACHE_SIZE];
+};
+
 struct mg_tls {
-  BIO_METHOD *bm;
-  SSL_CTX *ctx;
+  BIO_METHOD *bm;   // Own BIO method if the manager has none
+  SSL_CTX *ctx;     // Referenced, possibly shared context
   SSL *ssl;
   char *name;       // matching hostname
   bool check_name;  // set when hostname was set, but no CA certificate given
+  unsigned char *alpn;  // Server: accepted ALPN protocols, wire format
+  size_t alpn_len;      // Length of alpn
 };
 #endif
 
@@ -3809,7 +4290,9 @@ struct mg_ws_message {
 //   fmt is a printf-style string for extra HTTP request headers; each header
 //   must end with "\r\n". The user-supplied fn event handler receives
 //   MG_EV_WS_OPEN on handshake success, MG_EV_WS_MSG for messages, and
-//   MG_EV_WS_CTL for control frames.
+//   MG_EV_WS_CTL for control frames. With MG_ENABLE_DEFLATE, offers
+//   permessage-deflate (RFC 7692) and asks the server not to keep context
+//   between messages; the connection fails if the server accepts otherwise.
 struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
                                     mg_event_handler_t fn, void *fn_data,
                                     const char *fmt, ...);
@@ -3829,7 +4312,10 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
 //   Call from an MG_EV_HTTP_MSG handler and pass that event's hm. fmt is a
 //   printf-style string for extra response headers; each header must end with
 //   "\r\n". Fires MG_EV_WS_OPEN immediately on success. Sends HTTP 426 and
-//   drains the connection if the request lacks Sec-WebSocket-Key.
+//   drains the connection if the request lacks Sec-WebSocket-Key. With
+//   MG_ENABLE_DEFLATE, accepts a permessage-deflate offer and sets
+//   c->is_ws_deflate. Messages to the client keep context, unless it asks
+//   otherwise or MG_WS_DEFLATE_TAKEOVER is 0; the client is asked not to.
 void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 
@@ -3849,14 +4335,41 @@ void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
 //   op is one of WEBSOCKET_OP_*. Client connections are automatically masked
 //   per RFC 6455. On OOM, the return value can be smaller than header + len.
 //   Data is appended to c->send and sent by a later mg_mgr_poll() call.
+//   If c->is_ws_deflate is set, TEXT and BINARY messages of MG_WS_DEFLATE_MIN
+//   bytes or more are compressed, and the return value counts compressed
+//   bytes. Clear c->is_ws_deflate to stop compressing; received compressed
+//   messages are still inflated before MG_EV_WS_MSG.
 size_t mg_ws_send(struct mg_connection *, const void *buf, size_t len, int op);
 
 // Wraps the last len bytes already in c->send with a WebSocket frame header
 // and opcode op. Used internally by mg_ws_printf(); call it directly when you
-// have written data into c->send manually and need to frame it.
+// have written data into c->send manually and need to frame it. Compresses
+// data like mg_ws_send() does.
 // Returns c->send.len (total buffer size after the operation).
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
 
+// Sends one message to many server-side WebSocket connections of mgr.
+//
+// Returns:
+//   Number of connections the message was queued to.
+// Example:
+//   static bool is_dash(struct mg_connection *c, void *arg) {
+//     return c->data[0] == 'D';  // Marked on MG_EV_WS_OPEN
+//   }
+//   mg_ws_broadcast(&mgr, json, len, WEBSOCKET_OP_TEXT, is_dash, NULL);
+// Related APIs:
+//   mg_ws_send(), mg_ws_upgrade(), mg_send_ref()
+// Notes:
+//   fn selects receivers, e.g. members of a group; NULL selects all. The
+//   frame is built once, and each connection queues a reference to it with
+//   mg_send_ref() instead of a copy. Connections with permessage-deflate get
+//   a frame compressed once, without context. Connections that have more
+//   than MG_WS_BROADCAST_MAX bytes queued are skipped: slow receivers miss
+//   messages instead of buffering them without limit.
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const void *buf, size_t len, int op,
+                       bool (*fn)(struct mg_connection *, void *),
+                       void *fn_data);
+
 // Formats a WebSocket message using printf-style fmt and sends it with
 // opcode op (WEBSOCKET_OP_TEXT or WEBSOCKET_OP_BINARY).
 // Returns the number of payload bytes written, or 0 on OOM.
@@ -4001,6 +4514,26 @@ struct mg_mqtt_prop {
   struct mg_str val;  // String/binary value; set for STRING, BINARY_DATA, and USER_PROPERTY
 };
 
+// Client session: QoS 1/2 PUBLISHes sent with mg_mqtt_pub() and not yet
+// acknowledged. Zero-initialise, set the public fields, and pass it as
+// mg_mqtt_opts.session to every mg_mqtt_connect() of the same client.
+// With fs set, changes are saved at most every MG_MQTT_SAVE_MS, when the
+// connection closes, and by mg_mqtt_session_free().
+struct mg_mqtt_session {
+  struct mg_fs *fs;            // Save messages to a file, or NULL: memory only
+  const char *path;            // File to save to, if fs is set
+  uint16_t receive_max;        // Max in-flight messages, 0: MG_MQTT_INFLIGHT
+  uint64_t retransmit_ms;      // MQTT 3.1.1: resend after that, 0: on reconnect
+  size_t num_inflight;         // Sent, awaiting acknowledgement
+  size_t num_queued;           // Waiting to be sent
+  struct mg_connection *c;     // Current connection, or NULL
+  void *head;                  // Messages, oldest first (internal)
+  void *tail;                  // Newest message, where to append (internal)
+  uint16_t server_max;         // MQTT5 server's Receive Maximum (internal)
+  bool loaded, online, dirty;  // (internal)
+  uint64_t saved_ms;           // Last save to fs (internal)
+};
+
 // Options passed to mg_mqtt_connect(), mg_mqtt_pub(), mg_mqtt_sub(),
 // mg_mqtt_unsub(), and mg_mqtt_disconnect(). Zero-initialise and set only
 // the fields relevant to the operation being called.
@@ -4020,6 +4553,7 @@ struct mg_mqtt_opts {
   size_t num_props;                 // MQTT5: number of entries in props
   struct mg_mqtt_prop *will_props;  // MQTT5 CONNECT: will properties; NULL if none
   size_t num_will_props;            // MQTT5: number of entries in will_props
+  struct mg_mqtt_session *session;  // CONNECT: track QoS 1/2 PUBLISHes
 };
 
 // Received MQTT message. Passed as ev_data for MG_EV_MQTT_MSG (PUBLISH),
@@ -4090,8 +4624,40 @@ void mg_mqtt_login(struct mg_connection *c, const struct mg_mqtt_opts *opts);
 //   On success, opts.topic and opts.message are copied into c->send before the
 //   function returns. To retransmit a QoS message, set opts.retransmit_id to the
 //   packet ID returned by the previous call; use 0 for a new message.
+//   If c was opened with mg_mqtt_opts.session, QoS 1/2 messages are kept
+//   until acknowledged, sent when fewer than session.receive_max are in
+//   flight, and resent with the DUP flag after a reconnect. Then 0 is
+//   returned if the session holds MG_MQTT_QUEUE_MAX unsent messages
 uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts);
 
+// Sends n PUBLISH packets, like n mg_mqtt_pub() calls with opts[0] ...
+// opts[n - 1], but encodes them straight into c->send, grown once for all.
+//
+// Returns:
+//   Number of messages sent or queued. If ids is not NULL, ids[i] is set to
+//   the packet ID of opts[i], as mg_mqtt_pub() would return it.
+// Example:
+//   struct mg_mqtt_opts msgs[2] = {
+//       {.topic = mg_str("t/1"), .message = mg_str("1")},
+//       {.topic = mg_str("t/2"), .message = mg_str("2"), .qos = 1},
+//   };
+//   mg_mqtt_pub_batch(c, msgs, 2, NULL);
+// Related APIs:
+//   mg_mqtt_pub()
+// Notes:
+//   On MQTT5 connections, topics get aliases (property 0x23) if the server
+//   allows it with Topic Alias Maximum, up to MG_MQTT_TOPIC_ALIASES of them.
+//   A topic is sent with its alias once, then only the alias is sent.
+//   This applies to mg_mqtt_pub() too, unless opts.props has a topic alias
+//   or the message is kept by a session
+size_t mg_mqtt_pub_batch(struct mg_connection *c,
+                         const struct mg_mqtt_opts *opts, size_t n,
+                         uint16_t *ids);
+
+// Frees messages kept by a session, e.g. before exiting. Messages saved to
+// s->fs stay there, and are sent after the next mg_mqtt_connect() with s
+void mg_mqtt_session_free(struct mg_mqtt_session *s);
+
 // Sends an MQTT SUBSCRIBE packet.
 //
 // Example:
@@ -4138,6 +4704,60 @@ void mg_mqtt_disconnect(struct mg_connection *, const struct mg_mqtt_opts *);
 size_t mg_mqtt_next_prop(struct mg_mqtt_message *, struct mg_mqtt_prop *,
                          size_t ofs);
 
+// MQTT broker state. Zero-initialise, then pass to mg_mqtt_broker_listen().
+// One broker can serve several listeners, e.g. mqtt:// and mqtts://
+struct mg_mqtt_broker {
+  struct mg_mgr *mgr;   // Manager of the listeners
+  size_t num_sessions;  // Client sessions, including offline persistent ones
+  size_t num_subs;      // Subscriptions
+  size_t num_retained;  // Retained messages
+  void *priv;           // Topic tree and sessions (internal)
+  // Optional. Called for each CONNECT, before the broker touches any session.
+  // Return false to refuse the client: CONNACK 5, or 0x87 for MQTT5
+  bool (*auth)(struct mg_connection *c, struct mg_str client_id,
+               struct mg_str user, struct mg_str pass);
+};
+
+// Creates an MQTT broker listener on url. The broker handles CONNECT,
+// SUBSCRIBE, UNSUBSCRIBE, PUBLISH with QoS 0, 1 and 2, retained messages,
+// will messages and persistent sessions, for MQTT 3.1.1 and MQTT5 clients.
+//
+// Returns:
+//   Listening connection, or NULL on error.
+// Example:
+//   static struct mg_mqtt_broker s_broker;
+//   mg_mqtt_broker_listen(&mgr, "mqtt://0.0.0.0:1883", &s_broker, fn, NULL);
+// Full examples:
+//   tutorials/mqtt/mqtt-server
+// Related APIs:
+//   mg_mqtt_broker_pub(), mg_mqtt_broker_free(), mg_mqtt_listen()
+// Notes:
+//   Requires MG_ENABLE_MQTT_BROKER=1. fn receives MG_EV_MQTT_CMD for each
+//   packet, after the broker has handled it. To check credentials, set
+//   auth in the broker: a refused client takes over no session and gets no
+//   messages. Clients silent for 1.5 times their keep alive are
+//   disconnected, and their will is sent. Offline MQTT5 sessions are freed
+//   after their Session Expiry Interval. Subscribers to a topic
+//   are found in a topic tree, in time that does not depend on the number
+//   of subscriptions. Each message is stored once, and all subscribers'
+//   connections reference it instead of copying it. Up to MG_MQTT_INFLIGHT
+//   QoS 1/2 messages per client await acknowledgement, the rest are queued,
+//   up to MG_MQTT_QUEUE_MAX.
+struct mg_connection *mg_mqtt_broker_listen(struct mg_mgr *, const char *url,
+                                            struct mg_mqtt_broker *,
+                                            mg_event_handler_t fn,
+                                            void *fn_data);
+
+// Publishes opts.topic / opts.message with opts.qos and opts.retain to the
+// broker's subscribers, as if a client sent it.
+// Returns the number of subscribers the message was delivered or queued to
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *,
+                          const struct mg_mqtt_opts *opts);
+
+// Frees the broker's sessions, subscriptions and retained messages, and
+// closes its connections. Call before or after mg_mgr_free()
+void mg_mqtt_broker_free(struct mg_mqtt_broker *);
+
 
 
 
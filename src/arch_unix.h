@@ -8,7 +8,9 @@
 #include <mach/mach_time.h>
 #endif
 
-#if !defined(MG_ENABLE_EPOLL) && defined(__linux__)
+#if defined(MG_ENABLE_IOURING) && MG_ENABLE_IOURING
+// io_uring backend replaces epoll, see mg_iotest()
+#elif !defined(MG_ENABLE_EPOLL) && defined(__linux__)
 #define MG_ENABLE_EPOLL 1
 #elif !defined(MG_ENABLE_POLL)
 #define MG_ENABLE_POLL 1
@@ -35,7 +37,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
+#if defined(MG_ENABLE_SENDFILE) && MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if defined(MG_ENABLE_IOURING) && MG_ENABLE_IOURING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#elif defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
 #include <sys/epoll.h>
 #elif defined(MG_ENABLE_POLL) && MG_ENABLE_POLL
 #include <poll.h>
@@ -47,6 +58,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -66,4 +78,8 @@
 #define MG_IO_SIZE 16384
 #endif
 
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 1
+#endif
+
 #endif
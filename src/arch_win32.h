@@ -182,4 +182,8 @@ typedef int socklen_t;
 #define MG_IO_SIZE 16384
 #endif
 
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 1
+#endif
+
 #endif
@@ -737,13 +737,10 @@ static void wufn(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_POLL) {
     struct wumsg *m;
     if (xQueueReceive(q, &m, 0) == pdTRUE) {
-      struct mg_connection *t;
-      for (t = c->mgr->conns; t != NULL; t = t->next) {
-        if (t->id == m->id) {
-          struct mg_str data = mg_str_n((char *) m->data, m->len);
-          mg_call(t, MG_EV_WAKEUP, &data);
-          break;
-        }
+      struct mg_connection *t = mg_conn_by_id(c->mgr, m->id);
+      if (t != NULL) {
+        struct mg_str data = mg_str_n((char *) m->data, m->len);
+        mg_call(t, MG_EV_WAKEUP, &data);
       }
       free(m);
     }
@@ -52,6 +52,39 @@
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 64  // epoll: max ready events per epoll_wait()
+#endif
+
+#ifndef MG_ENABLE_IOURING
+#define MG_ENABLE_IOURING 0  // Linux 6.0+ io_uring backend, replaces epoll
+#endif
+
+#ifndef MG_ENABLE_SENDFILE
+#define MG_ENABLE_SENDFILE 0  // Linux: serve HTTP files with sendfile()
+#endif
+
+#ifndef MG_ENABLE_SIMD
+#if defined(__GNUC__) && (defined(__SSE2__) || (defined(__ARM_NEON) && \
+                           !defined(__ARM_BIG_ENDIAN)))
+#define MG_ENABLE_SIMD 1  // Scan HTTP headers with SSE2 or NEON
+#else
+#define MG_ENABLE_SIMD 0
+#endif
+#endif
+
+#ifndef MG_IOURING_ENTRIES
+#define MG_IOURING_ENTRIES 256  // io_uring: submission queue size
+#endif
+
+#ifndef MG_IOURING_BUFS
+#define MG_IOURING_BUFS 256  // io_uring: receive buffers, power of 2
+#endif
+
+#ifndef MG_IOURING_BUF_SIZE
+#define MG_IOURING_BUF_SIZE 2048  // io_uring: size of each receive buffer
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -72,6 +105,10 @@
 #define MG_IPV6_V6ONLY 0  // IPv6 socket binds only to V6, not V4 address
 #endif
 
+#ifndef MG_ENABLE_REUSEPORT
+#define MG_ENABLE_REUSEPORT 0  // Listeners set SO_REUSEPORT: one per event loop
+#endif
+
 #ifndef MG_ENABLE_MD5
 #define MG_ENABLE_MD5 1
 #endif
@@ -102,6 +139,35 @@
 #define MG_IO_SIZE 512  // Granularity of the send/recv IO buffer growth
 #endif
 
+// Max step of 2x IO buffer growth. 0: grow as needed, which saves RAM
+#ifndef MG_IO_GROW_MAX
+#if MG_ARCH == MG_ARCH_UNIX || MG_ARCH == MG_ARCH_WIN32
+#define MG_IO_GROW_MAX (256UL * 1024UL)
+#else
+#define MG_IO_GROW_MAX 0
+#endif
+#endif
+
+#ifndef MG_IO_REALLOC
+#define MG_IO_REALLOC 0  // Resize IO buffers with realloc(), don't zero old ones
+#endif
+
+#ifndef MG_IO_SHRINK
+#define MG_IO_SHRINK (MG_IO_SIZE * 16)  // Free larger empty conn IO buffers
+#endif
+
+#ifndef MG_IO_COALESCE_MAX
+#define MG_IO_COALESCE_MAX 65536  // Built-in TLS: max bytes per coalesced write
+#endif
+
+#ifndef MG_ENABLE_TIMER_WHEEL
+#define MG_ENABLE_TIMER_WHEEL 0  // Schedule mg_mgr timers on a timer wheel
+#endif
+
+#ifndef MG_POOL_SIZE
+#define MG_POOL_SIZE 0  // Default mgr->pool.max: free connections kept for reuse
+#endif
+
 #ifndef MG_MAX_RECV_SIZE
 #define MG_MAX_RECV_SIZE (3UL * 1024UL * 1024UL)  // Maximum recv IO buffer size
 #endif
@@ -118,6 +184,95 @@
 #define MG_HTTP_INDEX "index.html"
 #endif
 
+#ifndef MG_TLS_CTX_CACHE_SIZE
+#define MG_TLS_CTX_CACHE_SIZE 4  // Shared OpenSSL/mbedTLS contexts per manager
+#endif
+
+#ifndef MG_TLS_CERT_CACHE_SIZE
+#define MG_TLS_CERT_CACHE_SIZE 8  // Verified peer certificate chains, builtin
+#endif
+
+#ifndef MG_HTTP_CACHE_SIZE
+#define MG_HTTP_CACHE_SIZE 0  // mg_http_serve_dir() file cache entries, 0 = off
+#endif
+
+#ifndef MG_HTTP_CACHE_MAX_FILE
+#define MG_HTTP_CACHE_MAX_FILE 16384  // Cache content of files up to this size
+#endif
+
+#ifndef MG_HTTP_CACHE_TTL
+#define MG_HTTP_CACHE_TTL 1000  // Milliseconds before rechecking file mtime
+#endif
+
+#ifndef MG_ENABLE_DEFLATE
+#define MG_ENABLE_DEFLATE 0  // Deflate, gzip HTTP, WebSocket permessage-deflate
+#endif
+
+#ifndef MG_DEFLATE_WINDOW
+#define MG_DEFLATE_WINDOW 4096  // Input kept for matches by next mg_deflate()
+#endif
+
+#ifndef MG_HTTP_GZIP_MIN
+#define MG_HTTP_GZIP_MIN 256  // Don't compress smaller HTTP responses
+#endif
+
+#ifndef MG_HTTP_GZIP_TYPES  // Compressible Content-Type patterns
+#define MG_HTTP_GZIP_TYPES \
+  "text/#,application/json#,application/javascript#,application/xml#,*/#+xml#"
+#endif
+
+#ifndef MG_HTTP_GZIP_CACHE_SIZE
+#define MG_HTTP_GZIP_CACHE_SIZE 8  // Compressed static files kept in memory
+#endif
+
+#ifndef MG_HTTP_GZIP_MAX_FILE
+#define MG_HTTP_GZIP_MAX_FILE 262144  // Compress static files up to this size
+#endif
+
+#ifndef MG_WS_BROADCAST_MAX
+#define MG_WS_BROADCAST_MAX 262144  // mg_ws_broadcast() skips busier conns
+#endif
+
+#ifndef MG_WS_DEFLATE_MIN
+#define MG_WS_DEFLATE_MIN 128  // Don't compress smaller WebSocket messages
+#endif
+
+#ifndef MG_WS_DEFLATE_TAKEOVER
+#define MG_WS_DEFLATE_TAKEOVER 1  // Match WS messages against earlier ones
+#endif
+
+#ifndef MG_ENABLE_HTTP2
+#define MG_ENABLE_HTTP2 0  // HTTP/2 server, see mg_http_listen()
+#endif
+
+#ifndef MG_HTTP2_MAX_STREAMS
+#define MG_HTTP2_MAX_STREAMS 16  // Concurrent HTTP/2 streams per connection
+#endif
+
+#ifndef MG_ENABLE_MQTT_BROKER
+#define MG_ENABLE_MQTT_BROKER 0  // MQTT broker, see mg_mqtt_broker_listen()
+#endif
+
+#ifndef MG_MQTT_INFLIGHT
+#define MG_MQTT_INFLIGHT 16  // Unacknowledged QoS 1/2 msgs per MQTT session
+#endif
+
+#ifndef MG_MQTT_QUEUE_MAX
+#define MG_MQTT_QUEUE_MAX 1000  // QoS 1/2 msgs queued per MQTT session
+#endif
+
+#ifndef MG_MQTT_SAVE_MS
+#define MG_MQTT_SAVE_MS 1000  // MQTT session: min time between file saves
+#endif
+
+#ifndef MG_MQTT_TOPIC_ALIASES
+#define MG_MQTT_TOPIC_ALIASES 16  // MQTT5 client: topic aliases per connection
+#endif
+
+#ifndef MG_MQTT_MAX_LEVELS
+#define MG_MQTT_MAX_LEVELS 32  // Broker: topic levels, e.g. a/b/c has 3
+#endif
+
 #ifndef MG_PATH_MAX
 #ifdef PATH_MAX
 #define MG_PATH_MAX PATH_MAX
@@ -155,12 +310,25 @@
   do {                                                                     \
     struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
+    c->is_epollout = 0;                                                    \
   } while (0)
+// Change EPOLLOUT interest only when it differs from the registered one
 #define MG_EPOLL_MOD(c, wr)                                                \
   do {                                                                     \
     struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    if (c->is_epollout == ((wr) ? 1U : 0U) || c->mgr == NULL ||            \
+        c->fd == (void *) (size_t) MG_INVALID_SOCKET)                      \
+      break;                                                               \
     if (wr) ev.events |= EPOLLOUT;                                         \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
+    c->is_epollout = (wr) ? 1U : 0U;                                       \
+  } while (0)
+#elif MG_ENABLE_IOURING
+// io_uring operations are armed by mg_mgr_poll(): make it come round soon
+#define MG_EPOLL_ADD(c) (c)->mgr->epoll_busy = true
+#define MG_EPOLL_MOD(c, wr)                                    \
+  do {                                                         \
+    if ((wr) && (c)->mgr != NULL) (c)->mgr->epoll_busy = true; \
   } while (0)
 #else
 #define MG_EPOLL_ADD(c)
@@ -477,7 +477,7 @@ static struct mg_dash_user *mg_dash_authenticate(struct mg_connection *c,
     return dash->guest;
   }
   mg_http_creds(hm, user, sizeof(user), pass, sizeof(pass));
-  ah = mg_http_get_header(hm, "Authorization");
+  ah = mg_http_get_header_id(hm, MG_HTTP_HDR_AUTHORIZATION);
   // MG_DEBUG(("user [%s], pass: [%s], h: %.*s", user, pass, hm->head.len,
   // hm->head.buf));
 
@@ -0,0 +1,567 @@
+#include "deflate.h"
+#include "util.h"
+
+#if MG_ENABLE_DEFLATE
+#define MG_DEFLATE_HASH_BITS 12
+#define MG_DEFLATE_MAX_DIST 32768
+#define MG_DEFLATE_MAX_LEN 258
+#define MG_DEFLATE_MAX_SYMS 8192  // LZ77 symbols per block
+#define MG_DEFLATE_LAZY 32        // Look for a longer match after shorter ones
+
+// Huffman code: bit-reversed codes and their lengths
+struct deflate_tree {
+  uint16_t code[288];
+  uint8_t len[288];
+};
+
+// One compression call: bit writer, match finder and current block
+struct deflate_ctx {
+  unsigned char *out;                        // Next output byte
+  uint32_t bits;                             // Pending output bits
+  unsigned nbits;                            // Number of pending bits
+  uint32_t head[1 << MG_DEFLATE_HASH_BITS];  // Last position + 1 of a hash
+  uint32_t lfreq[288], dfreq[30];            // Block symbol frequencies
+  struct deflate_tree lt, dt;                // Block codes
+  struct deflate_tree ft, fd;                // Fixed codes
+  uint32_t *syms;  // Block symbols: distance << 9 | length, or a literal
+  size_t nsyms;    // Number of symbols in the block
+  size_t maxsyms;  // Block size limit
+};
+
+// Code lengths of both dynamic codes, run-length encoded
+struct deflate_hdr {
+  unsigned hlit, hdist, hclen, n;
+  uint8_t sym[288 + 30], extra[288 + 30];
+  uint32_t freq[19];
+  struct deflate_tree ct;
+};
+
+// Length and distance codes: base values and numbers of extra bits
+static const uint16_t s_lbase[29] = {3,  4,  5,  6,  7,  8,  9,  10,
+                                     11, 13, 15, 17, 19, 23, 27, 31,
+                                     35, 43, 51, 59, 67, 83, 99, 115,
+                                     131, 163, 195, 227, 258};
+static const uint8_t s_lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                   1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                   4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dbase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,   17,   25,
+    33,   49,   65,   97,   129,  193,   257,   385,  513,  769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t s_dext[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                   4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                   9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order of code length code lengths in a dynamic block header
+static const uint8_t s_clorder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+static void put_bits(struct deflate_ctx *x, uint32_t v, unsigned n) {
+  x->bits |= v << x->nbits, x->nbits += n;
+  while (x->nbits >= 8) {
+    *x->out++ = (unsigned char) x->bits;
+    x->bits >>= 8, x->nbits -= 8;
+  }
+}
+
+static void put_code(struct deflate_ctx *x, const struct deflate_tree *t,
+                     unsigned sym) {
+  put_bits(x, t->code[sym], t->len[sym]);
+}
+
+// Stored blocks of len bytes. An empty non-final one is a sync flush
+static void put_stored(struct deflate_ctx *x, const unsigned char *s,
+                       size_t len, bool last) {
+  do {
+    size_t n = len > 65535 ? 65535 : len;
+    put_bits(x, last && n == len ? 1U : 0U, 3);
+    if (x->nbits > 0) put_bits(x, 0, 8 - x->nbits);
+    put_bits(x, (uint32_t) n, 16);
+    put_bits(x, (uint32_t) n ^ 0xffffU, 16);
+    if (n > 0) memcpy(x->out, s, n);
+    x->out += n, s += n, len -= n;
+  } while (len > 0);
+}
+
+// Canonical codes for the lengths in t. Huffman codes go MSB first, unlike
+// everything else: store them reversed
+static void huff_codes(struct deflate_tree *t, unsigned n) {
+  unsigned count[16], next[16], i, j, c = 0;
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) count[t->len[i]]++;
+  for (count[0] = 0, i = 1; i < 16; i++) next[i] = c = (c + count[i - 1]) << 1;
+  for (i = 0; i < n; i++) {
+    unsigned len = t->len[i], code, r = 0;
+    if (len == 0) continue;
+    code = next[len]++;
+    for (j = 0; j < len; j++) r |= ((code >> j) & 1U) << (len - 1 - j);
+    t->code[i] = (uint16_t) r;
+  }
+}
+
+// Huffman code lengths, at most max bits, for n symbols with frequencies freq
+static void huff_build(struct deflate_tree *t, const uint32_t *freq,
+                       unsigned n, unsigned max) {
+  uint16_t sym[288], parent[576], depth[576];
+  uint32_t w[576];
+  unsigned count[16], i, j, k, a, b, m = 0, total = 0;
+  memset(t->len, 0, n);
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) {  // Used symbols, sorted by frequency
+    if (freq[i] == 0) continue;
+    for (j = m++; j > 0 && freq[sym[j - 1]] > freq[i]; j--) sym[j] = sym[j - 1];
+    sym[j] = (uint16_t) i;
+  }
+  if (m == 1) t->len[sym[0]] = 1;
+  if (m > 1) {
+    // Merge two lightest nodes, taken from leaves or from merged nodes,
+    // which come in order of weight
+    for (i = 0; i < m; i++) w[i] = freq[sym[i]];
+    for (i = 0, j = k = m; k < 2 * m - 1; k++) {
+      a = i < m && (j >= k || w[i] <= w[j]) ? i++ : j++;
+      b = i < m && (j >= k || w[i] <= w[j]) ? i++ : j++;
+      w[k] = w[a] + w[b], parent[a] = parent[b] = (uint16_t) k;
+    }
+    for (depth[2 * m - 2] = 0, k = 2 * m - 2; k-- > 0;) {
+      depth[k] = (uint16_t) (depth[parent[k]] + 1);
+    }
+    for (i = 0; i < m; i++) count[depth[i] > max ? max : depth[i]]++;
+    // Clamped long codes overflow the code space. Make them fit again
+    for (i = 1; i <= max; i++) total += count[i] << (max - i);
+    while (total > (1U << max)) {
+      count[max]--;
+      for (i = max - 1; count[i] == 0; i--) continue;
+      count[i]--, count[i + 1] += 2, total--;
+    }
+    for (i = max, k = 0; i > 0; i--) {  // Shorter codes to frequent symbols
+      for (j = count[i]; j > 0; j--) t->len[sym[k++]] = (uint8_t) i;
+    }
+  }
+  huff_codes(t, n);
+}
+
+static size_t huff_cost(const struct deflate_tree *t, const uint32_t *freq,
+                        unsigned n) {
+  size_t i, bits = 0;
+  for (i = 0; i < n; i++) bits += (size_t) freq[i] * t->len[i];
+  return bits;
+}
+
+static void hdr_add(struct deflate_hdr *h, unsigned sym, unsigned extra) {
+  h->sym[h->n] = (uint8_t) sym, h->extra[h->n] = (uint8_t) extra;
+  h->freq[sym]++, h->n++;
+}
+
+// Make dynamic block header for block codes. Return its size in bits
+static size_t hdr_build(struct deflate_ctx *x, struct deflate_hdr *h) {
+  uint8_t lens[288 + 30];
+  size_t bits;
+  unsigned i, n, run;
+  memset(h, 0, sizeof(*h));
+  for (h->hlit = 286; h->hlit > 257 && x->lt.len[h->hlit - 1] == 0;) h->hlit--;
+  for (h->hdist = 30; h->hdist > 1 && x->dt.len[h->hdist - 1] == 0;) h->hdist--;
+  memcpy(lens, x->lt.len, h->hlit);
+  memcpy(lens + h->hlit, x->dt.len, h->hdist);
+  for (n = h->hlit + h->hdist, i = 0; i < n; i += run) {
+    for (run = 1; i + run < n && lens[i + run] == lens[i];) run++;
+    if (lens[i] == 0 && run >= 11) {
+      if (run > 138) run = 138;
+      hdr_add(h, 18, run - 11);
+    } else if (lens[i] == 0 && run >= 3) {
+      hdr_add(h, 17, run - 3);
+    } else if (run >= 4) {
+      if (run > 7) run = 7;
+      hdr_add(h, lens[i], 0);
+      hdr_add(h, 16, run - 4);
+    } else {
+      run = 1;
+      hdr_add(h, lens[i], 0);
+    }
+  }
+  huff_build(&h->ct, h->freq, 19, 7);
+  for (h->hclen = 19; h->hclen > 4 && h->ct.len[s_clorder[h->hclen - 1]] == 0;)
+    h->hclen--;
+  bits = 5 + 5 + 4 + 3 * h->hclen + huff_cost(&h->ct, h->freq, 19);
+  return bits + h->freq[16] * 2 + h->freq[17] * 3 + h->freq[18] * 7;
+}
+
+static void hdr_put(struct deflate_ctx *x, const struct deflate_hdr *h) {
+  static const uint8_t ext[3] = {2, 3, 7};  // Extra bits of codes 16, 17, 18
+  unsigned i;
+  put_bits(x, h->hlit - 257, 5);
+  put_bits(x, h->hdist - 1, 5);
+  put_bits(x, h->hclen - 4, 4);
+  for (i = 0; i < h->hclen; i++) put_bits(x, h->ct.len[s_clorder[i]], 3);
+  for (i = 0; i < h->n; i++) {
+    put_code(x, &h->ct, h->sym[i]);
+    if (h->sym[i] >= 16) put_bits(x, h->extra[i], ext[h->sym[i] - 16]);
+  }
+}
+
+static unsigned len_code(size_t len) {
+  unsigned i = 28;
+  while (s_lbase[i] > len) i--;
+  return i;
+}
+
+static unsigned dist_code(size_t dist) {
+  unsigned i = 29;
+  while (s_dbase[i] > dist) i--;
+  return i;
+}
+
+static void put_syms(struct deflate_ctx *x, const struct deflate_tree *lt,
+                     const struct deflate_tree *dt) {
+  size_t i;
+  for (i = 0; i < x->nsyms; i++) {
+    uint32_t len = x->syms[i] & 511U, dist = x->syms[i] >> 9;
+    if (dist == 0) {
+      put_code(x, lt, len);
+    } else {
+      unsigned lc = len_code(len), dc = dist_code(dist);
+      put_code(x, lt, 257 + lc);
+      put_bits(x, len - s_lbase[lc], s_lext[lc]);
+      put_code(x, dt, dc);
+      put_bits(x, dist - s_dbase[dc], s_dext[dc]);
+    }
+  }
+  put_code(x, lt, 256);
+}
+
+// Output the block made from s[start, end) with fixed codes, dynamic codes,
+// or stored as is: whichever is shorter
+static void put_block(struct deflate_ctx *x, const unsigned char *s,
+                      size_t start, size_t end, bool last) {
+  struct deflate_hdr h;
+  size_t i, extra = 0, fixed, dynamic, stored;
+  x->lfreq[256]++;  // End of block
+  for (i = 0; i < 29; i++) extra += (size_t) x->lfreq[257 + i] * s_lext[i];
+  for (i = 0; i < 30; i++) extra += (size_t) x->dfreq[i] * s_dext[i];
+  huff_build(&x->lt, x->lfreq, 286, 15);
+  huff_build(&x->dt, x->dfreq, 30, 15);
+  dynamic = hdr_build(x, &h) + huff_cost(&x->lt, x->lfreq, 286) +
+            huff_cost(&x->dt, x->dfreq, 30) + extra;
+  fixed = huff_cost(&x->ft, x->lfreq, 286) + huff_cost(&x->fd, x->dfreq, 30) +
+          extra;
+  stored = (end - start + 5 * ((end - start) / 65535 + 1)) * 8;
+  if (stored < fixed && stored < dynamic) {
+    put_stored(x, s + start, end - start, last);
+  } else if (fixed <= dynamic) {
+    put_bits(x, last ? 3U : 2U, 3);  // BFINAL, BTYPE 01: fixed codes
+    put_syms(x, &x->ft, &x->fd);
+  } else {
+    put_bits(x, last ? 5U : 4U, 3);  // BFINAL, BTYPE 10: dynamic codes
+    hdr_put(x, &h);
+    put_syms(x, &x->lt, &x->dt);
+  }
+  memset(x->lfreq, 0, sizeof(x->lfreq));
+  memset(x->dfreq, 0, sizeof(x->dfreq));
+  x->nsyms = 0;
+}
+
+static uint32_t hash3(const unsigned char *p) {
+  uint32_t v = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16;
+  return (v * 2654435761U) >> (32 - MG_DEFLATE_HASH_BITS);
+}
+
+// Find the latest earlier occurrence of s[i..], and remember this one
+static size_t find_match(struct deflate_ctx *x, const unsigned char *s,
+                         size_t i, size_t end, size_t *dist) {
+  size_t n = 0, max = end - i;
+  uint32_t h, pos;
+  if (max > MG_DEFLATE_MAX_LEN) max = MG_DEFLATE_MAX_LEN;
+  if (max < 3) return 0;
+  h = hash3(s + i), pos = x->head[h];
+  x->head[h] = (uint32_t) (i + 1);
+  if (pos > 0 && i + 1 - pos <= MG_DEFLATE_MAX_DIST) {
+    const unsigned char *p = s + pos - 1;
+    while (n < max && p[n] == s[i + n]) n++;
+    *dist = i + 1 - pos;
+  }
+  return n;
+}
+
+static void add_literal(struct deflate_ctx *x, unsigned char c) {
+  x->syms[x->nsyms++] = c;
+  x->lfreq[c]++;
+}
+
+// Compress s[start, end). s[0, start) is earlier input matches can refer to
+static void deflate_run(struct deflate_ctx *x, const unsigned char *s,
+                        size_t start, size_t end, bool last) {
+  size_t i, k, from = start;
+  for (i = 0; i < start && i + 3 <= end; i++) {
+    x->head[hash3(s + i)] = (uint32_t) (i + 1);
+  }
+  for (i = start; i < end;) {
+    size_t dist = 0, n = find_match(x, s, i, end, &dist);
+    if (n >= 3 && n < MG_DEFLATE_LAZY && i + 1 < end) {
+      size_t dist2 = 0, n2 = find_match(x, s, i + 1, end, &dist2);
+      if (n2 > n) add_literal(x, s[i++]), n = n2, dist = dist2;
+    }
+    if (n >= 3) {
+      x->syms[x->nsyms++] = (uint32_t) (dist << 9 | n);
+      x->lfreq[257 + len_code(n)]++, x->dfreq[dist_code(dist)]++;
+      for (k = i + 1; k < i + n && k + 3 <= end; k++) {
+        x->head[hash3(s + k)] = (uint32_t) (k + 1);
+      }
+      i += n;
+    } else {
+      add_literal(x, s[i++]);
+    }
+    if (x->nsyms + 2 > x->maxsyms) put_block(x, s, from, i, false), from = i;
+  }
+  if (x->nsyms > 0 || last) put_block(x, s, from, end, last);
+}
+
+// Remember the input tail for the next call. On OOM, just forget history
+static void deflate_keep(struct mg_deflate *d, const unsigned char *s,
+                         size_t n) {
+  size_t keep = n > MG_DEFLATE_WINDOW ? MG_DEFLATE_WINDOW : n;
+  if (d->win == NULL) d->win = (char *) mg_calloc(1, MG_DEFLATE_WINDOW);
+  d->wlen = d->win == NULL ? 0 : keep;
+  if (d->wlen > 0) memcpy(d->win, s + n - keep, keep);
+}
+
+bool mg_deflate(struct mg_deflate *d, const char *buf, size_t len, bool last,
+                struct mg_iobuf *io) {
+  size_t i, n = d->wlen + len, maxsyms = len + 2;
+  const unsigned char *s = (const unsigned char *) (buf == NULL ? "" : buf);
+  struct deflate_ctx *x;
+  bool ok;
+  if (maxsyms > MG_DEFLATE_MAX_SYMS) maxsyms = MG_DEFLATE_MAX_SYMS;
+  x = (struct deflate_ctx *) mg_calloc(
+      1, sizeof(*x) + maxsyms * sizeof(uint32_t) + d->wlen + len);
+  ok = x != NULL && mg_iobuf_reserve(io, len + len / 8 + 64);
+  if (ok) {
+    unsigned char *p = (unsigned char *) (x + 1) + maxsyms * sizeof(uint32_t);
+    x->syms = (uint32_t *) (x + 1), x->maxsyms = maxsyms;
+    x->out = io->buf + io->len;
+    if (d->wlen > 0) {  // Put history and input together
+      memcpy(p, d->win, d->wlen);
+      if (len > 0) memcpy(p + d->wlen, s, len);
+      s = p;
+    }
+    for (i = 0; i < 288; i++) {
+      x->ft.len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    for (i = 0; i < 30; i++) x->fd.len[i] = 5;
+    huff_codes(&x->ft, 288);
+    huff_codes(&x->fd, 30);
+    deflate_run(x, s, d->wlen, n, last);
+    if (!last) put_stored(x, s, 0, false);  // Sync flush
+    if (x->nbits > 0) put_bits(x, 0, 8 - x->nbits);
+    io->len = (size_t) (x->out - io->buf);
+    if (!last) deflate_keep(d, s, n);
+  }
+  mg_free(x);
+  if (last) mg_deflate_free(d);
+  return ok;
+}
+
+bool mg_gzip(struct mg_deflate *d, const char *buf, size_t len, bool last,
+             struct mg_iobuf *io) {
+  static const unsigned char hdr[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+  if (!d->started && mg_iobuf_add(io, io->len, hdr, sizeof(hdr)) == 0) {
+    return false;
+  }
+  d->started = true;
+  d->crc = mg_crc32(d->crc, buf, len), d->size += (uint32_t) len;
+  if (!mg_deflate(d, buf, len, last, io)) return false;
+  if (last) {  // Trailer: CRC32 and input size, little endian
+    unsigned char t[8];
+    size_t i;
+    for (i = 0; i < 4; i++) {
+      t[i] = (unsigned char) (d->crc >> (8 * i));
+      t[i + 4] = (unsigned char) (d->size >> (8 * i));
+    }
+    if (mg_iobuf_add(io, io->len, t, sizeof(t)) == 0) return false;
+  }
+  return true;
+}
+
+void mg_deflate_free(struct mg_deflate *d) {
+  mg_free(d->win);
+  d->win = NULL, d->wlen = 0;
+}
+
+// Decoder: bit reader over the input, and output limits
+struct inflate_ctx {
+  const unsigned char *in;  // Input
+  size_t len, pos;          // Input length and next byte
+  uint32_t bits;            // Pending input bits
+  unsigned nbits;           // Number of pending bits
+  bool err;                 // Truncated input
+  struct mg_iobuf *io;      // Output
+  size_t start, max;        // Output offset of this call, and its size limit
+};
+
+// Canonical Huffman code: number of codes of each length, symbols by code
+struct inflate_huff {
+  uint16_t count[16];
+  uint16_t sym[288];
+};
+
+static unsigned get_bits(struct inflate_ctx *x, unsigned n) {
+  uint32_t v;
+  while (x->nbits < n) {
+    if (x->pos >= x->len) {
+      x->err = true;
+      return 0;
+    }
+    x->bits |= (uint32_t) x->in[x->pos++] << x->nbits, x->nbits += 8;
+  }
+  v = x->bits & ((1U << n) - 1), x->bits >>= n, x->nbits -= n;
+  return (unsigned) v;
+}
+
+// Codes for the n symbol lengths in len. Incomplete codes are fine, like
+// a single distance code, oversubscribed ones are not
+static bool huff_load(struct inflate_huff *h, const uint8_t *len, unsigned n) {
+  uint16_t offs[16];
+  unsigned i;
+  int left = 1;
+  memset(h->count, 0, sizeof(h->count));
+  for (i = 0; i < n; i++) h->count[len[i]]++;
+  for (i = 1; i < 16; i++) {
+    left = (left << 1) - h->count[i];
+    if (left < 0) return false;
+  }
+  for (offs[1] = 0, i = 1; i < 15; i++) {
+    offs[i + 1] = (uint16_t) (offs[i] + h->count[i]);
+  }
+  for (i = 0; i < n; i++) {
+    if (len[i] != 0) h->sym[offs[len[i]]++] = (uint16_t) i;
+  }
+  return true;
+}
+
+// Read one symbol, MSB first. Returns -1 on an unused code
+static int huff_decode(struct inflate_ctx *x, const struct inflate_huff *h) {
+  int code = 0, first = 0, index = 0, len;
+  for (len = 1; len < 16 && !x->err; len++) {
+    int count = h->count[len];
+    code |= (int) get_bits(x, 1);
+    if (code - count < first) return h->sym[index + (code - first)];
+    index += count, first = (first + count) << 1, code <<= 1;
+  }
+  return -1;
+}
+
+static bool inflate_out(struct inflate_ctx *x, size_t n) {
+  return x->io->len - x->start + n <= x->max && mg_iobuf_reserve(x->io, n);
+}
+
+static bool inflate_stored(struct inflate_ctx *x) {
+  size_t n;
+  x->bits = 0, x->nbits = 0;  // Skip to a byte boundary
+  if (x->pos + 4 > x->len) return false;
+  n = (size_t) x->in[x->pos] | (size_t) x->in[x->pos + 1] << 8;
+  if ((n ^ 0xffffU) != ((size_t) x->in[x->pos + 2] |
+                        (size_t) x->in[x->pos + 3] << 8)) {
+    return false;
+  }
+  x->pos += 4;
+  if (x->pos + n > x->len || !inflate_out(x, n)) return false;
+  if (n > 0) memcpy(x->io->buf + x->io->len, x->in + x->pos, n);
+  x->io->len += n, x->pos += n;
+  return true;
+}
+
+static bool inflate_codes(struct inflate_ctx *x, const struct inflate_huff *lh,
+                          const struct inflate_huff *dh) {
+  for (;;) {
+    int sym = huff_decode(x, lh);
+    if (sym < 0 || x->err) return false;
+    if (sym < 256) {
+      if (!inflate_out(x, 1)) return false;
+      x->io->buf[x->io->len++] = (unsigned char) sym;
+    } else if (sym == 256) {
+      return true;
+    } else {
+      size_t len, dist, i;
+      unsigned char *p, *q;
+      if (sym > 285) return false;
+      len = s_lbase[sym - 257] + get_bits(x, s_lext[sym - 257]);
+      sym = huff_decode(x, dh);
+      if (sym < 0 || sym > 29 || x->err) return false;
+      dist = s_dbase[sym] + get_bits(x, s_dext[sym]);
+      if (x->err || dist > x->io->len - x->start || !inflate_out(x, len)) {
+        return false;
+      }
+      p = x->io->buf + x->io->len, q = p - dist;
+      for (i = 0; i < len; i++) p[i] = q[i];  // Can overlap
+      x->io->len += len;
+    }
+  }
+}
+
+static bool inflate_fixed(struct inflate_ctx *x) {
+  struct inflate_huff lh, dh;
+  uint8_t len[288];
+  unsigned i;
+  for (i = 0; i < 288; i++) {
+    len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  }
+  huff_load(&lh, len, 288);
+  memset(len, 5, 30);
+  huff_load(&dh, len, 30);
+  return inflate_codes(x, &lh, &dh);
+}
+
+static bool inflate_dynamic(struct inflate_ctx *x) {
+  struct inflate_huff lh, dh;
+  uint8_t len[288 + 30];
+  unsigned i, n, hlit = get_bits(x, 5) + 257, hdist = get_bits(x, 5) + 1,
+                 hclen = get_bits(x, 4) + 4;
+  if (hlit > 286 || hdist > 30) return false;
+  memset(len, 0, 19);
+  for (i = 0; i < hclen; i++) len[s_clorder[i]] = (uint8_t) get_bits(x, 3);
+  if (x->err || !huff_load(&lh, len, 19)) return false;
+  for (i = 0; i < hlit + hdist;) {
+    int sym = huff_decode(x, &lh);
+    uint8_t v = 0;
+    if (sym < 0 || x->err) return false;
+    if (sym < 16) {
+      len[i++] = (uint8_t) sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (i == 0) return false;
+      v = len[i - 1], n = 3 + get_bits(x, 2);
+    } else {
+      n = sym == 17 ? 3 + get_bits(x, 3) : 11 + get_bits(x, 7);
+    }
+    if (i + n > hlit + hdist) return false;
+    while (n-- > 0) len[i++] = v;
+  }
+  if (x->err || len[256] == 0) return false;
+  return huff_load(&lh, len, hlit) && huff_load(&dh, len + hlit, hdist) &&
+         inflate_codes(x, &lh, &dh);
+}
+
+bool mg_inflate(const char *buf, size_t len, size_t max, struct mg_iobuf *io) {
+  struct inflate_ctx x;
+  bool ok = true, last = false;
+  memset(&x, 0, sizeof(x));
+  x.in = (const unsigned char *) buf, x.len = len;
+  x.io = io, x.start = io->len, x.max = max;
+  while (ok && !last && x.pos < x.len) {
+    unsigned type;
+    last = get_bits(&x, 1) != 0, type = get_bits(&x, 2);
+    if (x.err) {
+      ok = false;
+    } else if (type == 0) {
+      // A sync flush with its 00 00 ff ff stripped ends right here
+      ok = (!last && x.pos == x.len) || inflate_stored(&x);
+    } else if (type == 1) {
+      ok = inflate_fixed(&x);
+    } else if (type == 2) {
+      ok = inflate_dynamic(&x);
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok) io->len = x.start;
+  return ok;
+}
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "arch.h"
+#include "iobuf.h"
+
+// Deflate (RFC 1951) compressor. Zero-initialise before the first call.
+// Data compressed by one call can be matched by the next ones, within the
+// last MG_DEFLATE_WINDOW input bytes
+struct mg_deflate {
+  char *win;      // Recent input (internal)
+  size_t wlen;    // Bytes in win (internal)
+  uint32_t crc;   // gzip: CRC32 of the input so far
+  uint32_t size;  // gzip: input length so far, modulo 2^32
+  bool started;   // gzip: header is written (internal)
+};
+
+// Compresses len bytes of buf and appends the result to io. Unless last is
+// true, output ends with a sync flush: a receiver can decode all the data
+// given so far, and the output ends with 00 00 ff ff. If last is true, the
+// stream is finished and d is freed. Returns false on OOM
+bool mg_deflate(struct mg_deflate *d, const char *buf, size_t len, bool last,
+                struct mg_iobuf *io);
+
+// Same as mg_deflate(), but produces a gzip (RFC 1952) stream
+bool mg_gzip(struct mg_deflate *d, const char *buf, size_t len, bool last,
+             struct mg_iobuf *io);
+
+// Frees the compressor state, e.g. if the stream is abandoned
+void mg_deflate_free(struct mg_deflate *d);
+
+// Decompresses len bytes of raw deflate data and appends the result to io.
+// Each call decodes a stream of its own: data may not refer to the output
+// of earlier calls. Input can end with a final block, or after a sync flush,
+// with or without its trailing 00 00 ff ff. Returns false on malformed or
+// truncated input, on OOM, or if the output exceeds max bytes
+bool mg_inflate(const char *buf, size_t len, size_t max, struct mg_iobuf *io);
@@ -270,6 +270,7 @@ bool mg_dnsc_init(struct mg_mgr *mgr, struct mg_dns *dnsc) {
     dnsc->c = mg_connect(mgr, dnsc->url, NULL, NULL);
     if (dnsc->c == NULL) return false;
     dnsc->c->pfn = dns_cb;
+    dnsc->c->is_polled = 1;  // Expire requests even when no data comes
   }
   return true;
 }
@@ -787,6 +788,7 @@ struct mg_connection *mg_mdns_listen(struct mg_mgr *mgr, mg_event_handler_t fn,
   if (c == NULL) return NULL;
   c->mgr->mdns = c;  // Add mDNS entry to enable resolver to use it
   c->pfn = mdns_cb, c->pfn_data = fn_data;
+  c->is_polled = 1;  // Expire resolver requests
   mg_multicast_add(c, (char *) "224.0.0.251");
   return c;
 }
@@ -41,5 +41,6 @@ enum mg_event {
   MG_EV_MDNS_REQ,   // mDNS request                 struct mg_mdns_req *
   MG_EV_MDNS_RESP,  // mDNS response                struct mg_mdns_resp *
   MG_EV_MODBUS_REQ, // Modbus TCP request            struct mg_modbus_req *
+  MG_EV_HTTP_BODY,  // HTTP body fragment           struct mg_http_message *
   MG_EV_USER        // Starting ID for user events
 };
@@ -1,5 +1,6 @@
 #include "http.h"
 #include "base64.h"
+#include "deflate.h"
 #include "fmt.h"
 #include "log.h"
 #include "net.h"
@@ -9,6 +10,120 @@
 #include "util.h"
 #include "version.h"
 
+// 16-byte blocks only: header lines are short, and 32-byte AVX2 blocks left
+// more of each line to the scalar code, which made AVX2 builds slower
+#if MG_ENABLE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#define MG_SIMD_N 16
+#elif MG_ENABLE_SIMD && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MG_SIMD_N 16
+#else
+#define MG_SIMD_N 0
+#endif
+
+#if MG_SIMD_N
+// Vector header scanning. Each function checks a block of MG_SIMD_N bytes,
+// and returns the index of the first byte that matches, or MG_SIMD_N
+#if defined(__SSE2__)
+typedef __m128i mg_simd_t;
+#define simd_load(p) _mm_loadu_si128((const __m128i *) (p))
+#define simd_set(c) _mm_set1_epi8((char) (c))
+#define simd_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define simd_or(a, b) _mm_or_si128((a), (b))
+#define simd_and(a, b) _mm_and_si128((a), (b))
+#define simd_gt(a, b) _mm_cmpgt_epi8((a), (b))  // Signed
+#define simd_max(a, b) _mm_max_epu8((a), (b))
+#define simd_bits(a) ((uint32_t) _mm_movemask_epi8(a))
+#endif
+
+#if defined(__ARM_NEON)
+// NEON has no movemask: narrow each byte to a nibble, 4 bits per byte
+static size_t simd_first(uint8x16_t hit) {
+  uint64_t m = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+  return m == 0 ? MG_SIMD_N : (size_t) __builtin_ctzll(m) / 4;
+}
+
+// Control character: < 0x20
+static size_t simd_ctl(const uint8_t *p) {
+  return simd_first(vcleq_u8(vld1q_u8(p), vdupq_n_u8(0x1f)));
+}
+
+static size_t simd_crlf(const uint8_t *p) {
+  uint8x16_t v = vld1q_u8(p);
+  return simd_first(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')),
+                             vceqq_u8(v, vdupq_n_u8('\n'))));
+}
+
+// Not a printable ASCII character (see clen()), or a stop character
+static size_t simd_text(const uint8_t *p, uint8_t stop) {
+  uint8x16_t v = vld1q_u8(p);
+  uint8x16_t ok = vandq_u8(vcgtq_u8(v, vdupq_n_u8(' ')),
+                           vcltq_u8(v, vdupq_n_u8(0x7f)));
+  return simd_first(vorrq_u8(vmvnq_u8(ok), vceqq_u8(v, vdupq_n_u8(stop))));
+}
+#else
+static size_t simd_first(uint32_t bits) {
+  return bits == 0 ? MG_SIMD_N : (size_t) __builtin_ctz(bits);
+}
+
+static size_t simd_ctl(const uint8_t *p) {
+  mg_simd_t v = simd_load(p), x = simd_set(0x1f);
+  return simd_first(simd_bits(simd_eq(simd_max(v, x), x)));
+}
+
+static size_t simd_crlf(const uint8_t *p) {
+  mg_simd_t v = simd_load(p);
+  return simd_first(simd_bits(
+      simd_or(simd_eq(v, simd_set('\r')), simd_eq(v, simd_set('\n')))));
+}
+
+// Bytes >= 0x80 are negative, so signed comparisons leave UTF-8 to clen()
+static size_t simd_text(const uint8_t *p, uint8_t stop) {
+  mg_simd_t v = simd_load(p);
+  mg_simd_t ok =
+      simd_and(simd_gt(v, simd_set(' ')), simd_gt(simd_set(0x7f), v));
+  uint32_t bits = simd_bits(ok) & ~simd_bits(simd_eq(v, simd_set(stop)));
+  return simd_first(~bits & (uint32_t) (((uint64_t) 1 << MG_SIMD_N) - 1));
+}
+#endif
+#endif
+
+// Skip bytes that are not control characters, a block at a time
+static const uint8_t *skip_ctl(const uint8_t *p, const uint8_t *end) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - p >= MG_SIMD_N) p += (n = simd_ctl(p));
+#endif
+  (void) end;
+  return p;
+}
+
+// Skip bytes that are not CR or LF, a block at a time
+static const char *skip_line(const char *s, const char *end) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - s >= MG_SIMD_N) {
+    s += (n = simd_crlf((const uint8_t *) s));
+  }
+#endif
+  (void) end;
+  return s;
+}
+
+// Skip printable ASCII characters other than `stop`, a block at a time
+static const char *skip_text(const char *s, const char *end, char stop) {
+#if MG_SIMD_N
+  size_t n = MG_SIMD_N;
+  while (n == MG_SIMD_N && end - s >= MG_SIMD_N) {
+    s += (n = simd_text((const uint8_t *) s, (uint8_t) stop));
+  }
+#endif
+  (void) end, (void) stop;
+  return s;
+}
+
 static int mg_ncasecmp(const char *s1, const char *s2, size_t len) {
   int diff = 0;
   if (len > 0) do {
@@ -186,9 +301,13 @@ static bool isok(uint8_t c) {
   return c == '\n' || c == '\r' || c == '\t' || c >= ' ';
 }
 
-int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+// Find the end of headers, resuming the scan at `ofs`: bytes before it are
+// known to be valid and contain no terminator
+static int http_req_len(const unsigned char *buf, size_t buf_len, size_t ofs) {
   size_t i;
-  for (i = 0; i < buf_len; i++) {
+  for (i = ofs; i < buf_len; i++) {
+    i = (size_t) (skip_ctl(buf + i, buf + buf_len) - buf);  // Printable run
+    if (i >= buf_len) break;
     if (!isok(buf[i])) return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
@@ -196,6 +315,11 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   }
   return 0;
 }
+
+int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+  return http_req_len(buf, buf_len, 0);
+}
+
 struct mg_str *mg_http_get_header(struct mg_http_message *h, const char *name) {
   size_t i, n = strlen(name), max = sizeof(h->headers) / sizeof(h->headers[0]);
   for (i = 0; i < max && h->headers[i].name.len > 0; i++) {
@@ -222,27 +346,87 @@ static size_t clen(const char *s, const char *end) {
   return 0;
 }
 
+// Skip valid characters up to `stop`. Return advanced `s`
+static const char *skipchars(const char *s, const char *end, char stop) {
+  size_t n;
+  while ((s = skip_text(s, end, stop)) < end && s[0] != stop &&
+         (n = clen(s, end)) > 0) {
+    s += n;
+  }
+  return s;
+}
+
 // Skip until the newline. Return advanced `s`, or NULL on error
 static const char *skiptorn(const char *s, const char *end, struct mg_str *v) {
   v->buf = (char *) s;
-  while (s < end && s[0] != '\n' && s[0] != '\r') s++, v->len++;  // To newline
+  s = skip_line(s, end);
+  while (s < end && s[0] != '\n' && s[0] != '\r') s++;  // To newline
+  v->len = (size_t) (s - v->buf);
   if (s >= end || (s[0] == '\r' && s[1] != '\n')) return NULL;    // Stray \r
   if (s < end && s[0] == '\r') s++;                               // Skip \r
   if (s >= end || *s++ != '\n') return NULL;                      // Skip \n
   return s;
 }
 
+// Well-known header names, in MG_HTTP_HDR_* order
+static const char *s_http_headers[MG_HTTP_HDR_MAX] = {
+    "Content-Length",  "Transfer-Encoding", "Connection",
+    "Authorization",   "Cookie",            "Host",
+    "Content-Type",    "Accept-Encoding",   "If-None-Match",
+    "Range",           "Upgrade",           "Sec-WebSocket-Key",
+    "Sec-WebSocket-Protocol"};
+
+// Classify a header name by its length, with at most two comparisons.
+// Return MG_HTTP_HDR_*, or -1 if it is not a well-known header
+static int http_header_id(struct mg_str k) {
+  int a, b = -1;
+  switch (k.len) {
+    case 4: a = MG_HTTP_HDR_HOST; break;
+    case 5: a = MG_HTTP_HDR_RANGE; break;
+    case 6: a = MG_HTTP_HDR_COOKIE; break;
+    case 7: a = MG_HTTP_HDR_UPGRADE; break;
+    case 10: a = MG_HTTP_HDR_CONNECTION; break;
+    case 12: a = MG_HTTP_HDR_CONTENT_TYPE; break;
+    case 13:
+      a = MG_HTTP_HDR_AUTHORIZATION, b = MG_HTTP_HDR_IF_NONE_MATCH;
+      break;
+    case 14: a = MG_HTTP_HDR_CONTENT_LENGTH; break;
+    case 15: a = MG_HTTP_HDR_ACCEPT_ENCODING; break;
+    case 17:
+      a = MG_HTTP_HDR_TRANSFER_ENCODING, b = MG_HTTP_HDR_SEC_WEBSOCKET_KEY;
+      break;
+    case 22: a = MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL; break;
+    default: return -1;
+  }
+  if (mg_ncasecmp(k.buf, s_http_headers[a], k.len) == 0) return a;
+  if (b >= 0 && mg_ncasecmp(k.buf, s_http_headers[b], k.len) == 0) return b;
+  return -1;
+}
+
+struct mg_str *mg_http_get_header_id(struct mg_http_message *hm, int id) {
+  size_t i;
+  if (id < 0 || id >= MG_HTTP_HDR_MAX) return NULL;
+  if ((i = hm->hdr_index[id]) != 0) return &hm->headers[i - 1].value;
+  for (i = 0; i < MG_HTTP_HDR_MAX; i++) {
+    if (hm->hdr_index[i] != 0) return NULL;  // Indexed, header not there
+  }
+  // Nothing indexed: no well-known headers, or hm was not built by
+  // mg_http_parse(). Look it up by name
+  return mg_http_get_header(hm, s_http_headers[id]);
+}
+
 static bool mg_http_parse_headers(const char *s, const char *end,
-                                  struct mg_http_header *h, size_t max_hdrs) {
-  size_t i, n;
-  int cl_count = 0, te_count = 0, auth_count = 0;
-  int conn_count = 0, cookie_count = 0;
+                                  struct mg_http_message *hm) {
+  struct mg_http_header *h = hm->headers;
+  size_t i, max_hdrs = sizeof(hm->headers) / sizeof(hm->headers[0]);
+  int id;
   for (i = 0; i < max_hdrs; i++) {
     struct mg_str k = {NULL, 0}, v = {NULL, 0};
     if (s >= end) return false;
     if (s[0] == '\n' || (s[0] == '\r' && s[1] == '\n')) break;
     k.buf = (char *) s;
-    while (s < end && s[0] != ':' && (n = clen(s, end)) > 0) s += n, k.len += n;
+    s = skipchars(s, end, ':');
+    k.len = (size_t) (s - k.buf);
     if (k.len == 0) return false;                     // Empty name
     if (s >= end || clen(s, end) == 0) return false;  // Invalid UTF-8
     if (*s++ != ':') return false;  // Invalid, not followed by :
@@ -252,27 +436,24 @@ static bool mg_http_parse_headers(const char *s, const char *end,
     while (v.len > 0 && (v.buf[v.len - 1] == ' ' || v.buf[v.len - 1] == '\t')) {
       v.len--;  // Trim spaces
     }
-    // detect duplicated headers -> discard
-    if (((mg_strcasecmp(k, mg_str("Content-Length")) == 0) &&
-         (++cl_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Transfer-Encoding")) == 0) &&
-         (++te_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Authorization")) == 0) &&
-         (++auth_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Cookie")) == 0) && (++cookie_count > 1)) ||
-        ((mg_strcasecmp(k, mg_str("Connection")) == 0) && (++conn_count > 1)))
+    // Index well-known headers, detect duplicated ones -> discard
+    id = http_header_id(k);
+    if (id >= 0 && hm->hdr_index[id] == 0) {
+      hm->hdr_index[id] = (uint16_t) (i + 1);
+    } else if (id >= 0 && id <= MG_HTTP_HDR_COOKIE) {
       return false;
+    }
     // MG_INFO(("--HH [%.*s] [%.*s]", (int) k.len, k.buf, (int) v.len, v.buf));
     h[i].name = k, h[i].value = v;  // Success. Assign values
   }
   return true;
 }
 
-int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
-  int is_response, req_len = mg_http_get_request_len((unsigned char *) s, len);
+// Parse a message whose headers are known to be `req_len` bytes long
+static int http_parse(const char *s, int req_len, struct mg_http_message *hm) {
+  int is_response;
   const char *end = s == NULL ? NULL : s + req_len, *qs;  // Cannot add to NULL
   const struct mg_str *cl;
-  size_t n;
   bool version_prefix_valid;
 
   memset(hm, 0, sizeof(*hm));
@@ -285,10 +466,12 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
 
   // Parse request line
   hm->method.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->method.len += n;
+  s = skipchars(s, end, ' ');
+  hm->method.len = (size_t) (s - hm->method.buf);
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   hm->uri.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->uri.len += n;
+  s = skipchars(s, end, ' ');
+  hm->uri.len = (size_t) (s - hm->uri.buf);
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   is_response =
       hm->method.len > 5 && (mg_ncasecmp(hm->method.buf, "HTTP/", 5) == 0);
@@ -317,11 +500,10 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   // Do this check after hm->method.len and hm->uri.len are finalised
   if (hm->method.len == 0 || hm->uri.len == 0) return -1;
 
-  if (!mg_http_parse_headers(s, end, hm->headers,
-                             sizeof(hm->headers) / sizeof(hm->headers[0])))
-    return -1;  // error when parsing
-  cl = mg_http_get_header(hm, "Content-Length");
-  if (cl != NULL && mg_http_get_header(hm, "Transfer-Encoding") != NULL)
+  if (!mg_http_parse_headers(s, end, hm)) return -1;  // error when parsing
+  cl = mg_http_get_header_id(hm, MG_HTTP_HDR_CONTENT_LENGTH);
+  if (cl != NULL &&
+      mg_http_get_header_id(hm, MG_HTTP_HDR_TRANSFER_ENCODING) != NULL)
     return -1; // cannot contain both CL and TE
   if (cl != NULL) {
     if (mg_to_size_t(*cl, &hm->body.len) == false) return -1;
@@ -350,9 +532,254 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   return req_len;
 }
 
+int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
+  return http_parse(s, mg_http_get_request_len((unsigned char *) s, len), hm);
+}
+
+static void http_cb(struct mg_connection *, int, void *);
+
+static struct mg_str http_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t')) {
+    s.len--;
+  }
+  return s;
+}
+
+// Return whether an Accept-Encoding header value allows gzip: "gzip" or
+// "x-gzip", else "*", listed without "q=0". Returns false for NULL
+static bool http_accepts_gzip(const struct mg_str *ae) {
+  struct mg_str s = ae == NULL ? mg_str_n(NULL, 0) : *ae, k, coding, params;
+  int gzip = -1, any = -1;  // -1: not listed, 0: refused, 1: accepted
+  while (mg_span(s, &k, &s, ',')) {
+    struct mg_str p, v;
+    int ok = 1;
+    if (!mg_span(k, &coding, &params, ';')) continue;  // Empty element
+    coding = http_trim(coding);
+    while (mg_span(params, &p, &params, ';')) {
+      mg_span(http_trim(p), &p, &v, '=');
+      if (mg_strcasecmp(p, mg_str("q")) == 0) {
+        size_t i;
+        v = http_trim(v);
+        for (i = 0; i < v.len && (v.buf[i] == '0' || v.buf[i] == '.');) i++;
+        if (v.len > 0 && v.buf[0] == '0' && i == v.len) ok = 0;  // q=0, 0.000
+      }
+    }
+    if (mg_strcasecmp(coding, mg_str("gzip")) == 0 ||
+        mg_strcasecmp(coding, mg_str("x-gzip")) == 0) {
+      gzip = ok;
+    } else if (mg_strcmp(coding, mg_str("*")) == 0) {
+      any = ok;
+    }
+  }
+  return gzip >= 0 ? gzip == 1 : any == 1;
+}
+
+#if MG_ENABLE_DEFLATE
+static const char s_gzip_hdrs[] =
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+
+// Compressed static file, see http_gzip_file()
+struct http_gzip {
+  uint32_t hash;  // Hash of the key; 0 for an unused entry
+  char *key;      // File path and ETag
+  char *data;     // Compressed content; NULL if the file does not compress
+  size_t len;     // Compressed content length
+  char etag[72];  // ETag of the compressed content
+  uint64_t used;  // When last used, for eviction
+};
+
+void mg_http_gzip_free(struct mg_mgr *mgr) {
+  struct http_gzip *cache = (struct http_gzip *) mgr->http_gzip;
+  size_t i;
+  for (i = 0; cache != NULL && i < MG_HTTP_GZIP_CACHE_SIZE; i++) {
+    mg_free(cache[i].key), mg_free(cache[i].data);
+  }
+  mg_free(cache);
+  mgr->http_gzip = NULL;
+}
+
+static bool http_gzip_type(struct mg_str mime) {
+  struct mg_str k, s = mg_str(MG_HTTP_GZIP_TYPES);
+  while (mg_span(s, &k, &s, ',')) {
+    if (mg_match(mime, k, NULL)) return true;
+  }
+  return false;
+}
+
+// Check response headers: compress allowed content types, only once.
+// Chunked responses must be chunked, others must not
+static bool http_gzip_hdrs(struct mg_str s, bool chunked) {
+  struct mg_str line, k, v;
+  bool ok = false, te = false;
+  while (mg_span(s, &line, &s, '\n')) {
+    if (!mg_span(line, &k, &v, ':')) continue;
+    while (v.len > 0 && v.buf[0] == ' ') v.buf++, v.len--;
+    while (v.len > 0 && (v.buf[v.len - 1] == '\r' || v.buf[v.len - 1] == ' ')) {
+      v.len--;
+    }
+    if (mg_strcasecmp(k, mg_str("Content-Encoding")) == 0) return false;
+    if (mg_strcasecmp(k, mg_str("Content-Type")) == 0) ok = http_gzip_type(v);
+    if (mg_strcasecmp(k, mg_str("Transfer-Encoding")) == 0) {
+      te = mg_strcasecmp(v, mg_str("chunked")) == 0;
+    }
+  }
+  return ok && te == chunked;
+}
+
+// Compress mg_http_reply() body at ofs. The headers end with hl bytes of
+// Content-Length placeholder, insert ours before it. Return new body offset
+static size_t http_gzip_reply(struct mg_connection *c, const char *headers,
+                              size_t ofs, size_t hl) {
+  struct mg_deflate d;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  size_t len = c->send.len - ofs, n = sizeof(s_gzip_hdrs) - 1;
+  memset(&d, 0, sizeof(d));
+  if (len >= MG_HTTP_GZIP_MIN && http_gzip_hdrs(mg_str(headers), false) &&
+      mg_gzip(&d, (char *) c->send.buf + ofs, len, true, &io) &&
+      io.len + n < len &&
+      mg_iobuf_add(&c->send, ofs - hl, s_gzip_hdrs, n) > 0) {
+    ofs += n;
+    memcpy(c->send.buf + ofs, io.buf, io.len);
+    c->send.len = ofs + io.len;
+  }
+  mg_iobuf_free(&io);
+  return ofs;
+}
+
+// Start compressing a chunked response, if its headers allow. They must be
+// the last thing in c->send
+static struct mg_deflate *http_gzip_start(struct mg_connection *c) {
+  char *s = (char *) c->send.buf;
+  size_t n = c->send.len, i = n < 9 ? 0 : n - 9;
+  struct mg_deflate *d;
+  if (n < 9 || memcmp(s + n - 4, "\r\n\r\n", 4) != 0) return NULL;
+  while (i > 0 && (s[i - 1] != '\n' || memcmp(s + i, "HTTP/", 5) != 0)) i--;
+  if (memcmp(s + i, "HTTP/", 5) != 0) return NULL;
+  if (!http_gzip_hdrs(mg_str_n(s + i, n - i), true)) return NULL;
+  if ((d = (struct mg_deflate *) mg_calloc(1, sizeof(*d))) == NULL) return NULL;
+  if (mg_iobuf_add(&c->send, n - 2, s_gzip_hdrs, sizeof(s_gzip_hdrs) - 1) ==
+      0) {
+    mg_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+static void http_gzip_end(struct mg_connection *c) {
+  mg_deflate_free((struct mg_deflate *) c->http_gzip);
+  mg_free(c->http_gzip);
+  c->http_gzip = NULL;
+  c->is_http_gzip = 0;
+}
+
+static void http_write_chunk(struct mg_connection *, const char *, size_t);
+
+// Compress a chunk. Return false if the response goes uncompressed
+static bool http_gzip_chunk(struct mg_connection *c, const char *buf,
+                            size_t len) {
+  struct mg_deflate *d = (struct mg_deflate *) c->http_gzip;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  if (d == NULL && (c->pfn != http_cb || (d = http_gzip_start(c)) == NULL)) {
+    c->is_http_gzip = 0;  // Decided for this response
+    return false;
+  }
+  c->http_gzip = d;
+  if (!mg_gzip(d, buf, len, len == 0, &io)) mg_error(c, "OOM");
+  if (io.len > 0) http_write_chunk(c, (char *) io.buf, io.len);
+  mg_iobuf_free(&io);
+  if (len == 0) {
+    http_write_chunk(c, "", 0);
+    http_gzip_end(c);
+    c->is_resp = 0;
+  }
+  return true;
+}
+
+// Find or make a compressed copy of a static file, either open (fd) or
+// cached in memory (data). Return NULL if the file does not compress
+static struct http_gzip *http_gzip_file(struct mg_mgr *mgr, const char *path,
+                                        const char *etag, struct mg_fd *fd,
+                                        const char *data, size_t size) {
+  struct http_gzip *e, *cache = (struct http_gzip *) mgr->http_gzip;
+  struct mg_deflate d;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  char key[MG_PATH_MAX + 80], *buf = NULL;
+  size_t i, len = 0, n = mg_snprintf(key, sizeof(key), "%s %s", path, etag);
+  uint32_t hash = mg_crc32(0, key, n);
+  bool ok;
+  if (n >= sizeof(key)) return NULL;
+  if (hash == 0) hash = 1;
+  if (cache == NULL) {
+    cache = (struct http_gzip *) mg_calloc(MG_HTTP_GZIP_CACHE_SIZE, sizeof(*e));
+    if ((mgr->http_gzip = cache) == NULL) return NULL;
+  }
+  for (i = 0; i < MG_HTTP_GZIP_CACHE_SIZE; i++) {
+    if (cache[i].hash != hash || strcmp(cache[i].key, key) != 0) continue;
+    cache[i].used = mg_millis();
+    return cache[i].data == NULL ? NULL : &cache[i];
+  }
+  if (data == NULL) {  // Not cached, read the file
+    if ((buf = (char *) mg_calloc(1, size)) == NULL) return NULL;
+    while (len < size && (i = fd->fs->rd(fd->fd, buf + len, size - len)) > 0) {
+      len += i;
+    }
+    fd->fs->sk(fd->fd, 0);
+    if (len != size) {  // Changed while we read it
+      mg_free(buf);
+      return NULL;
+    }
+    data = buf;
+  }
+  memset(&d, 0, sizeof(d));
+  ok = mg_gzip(&d, data, size, true, &io);
+  mg_free(buf);
+  if (!ok) {
+    mg_iobuf_free(&io);
+    return NULL;
+  }
+  for (e = &cache[0], i = 1; i < MG_HTTP_GZIP_CACHE_SIZE && e->hash != 0; i++) {
+    if (cache[i].hash == 0 || cache[i].used < e->used) e = &cache[i];
+  }
+  mg_free(e->key), mg_free(e->data);
+  memset(e, 0, sizeof(*e));
+  if ((e->key = (char *) mg_calloc(1, n + 1)) == NULL) {
+    mg_iobuf_free(&io);
+    return NULL;
+  }
+  memcpy(e->key, key, n);
+  if (io.len < size) {  // Worth it. Keep the data, trim the allocation
+    mg_iobuf_resize(&io, io.len);
+    e->data = (char *) io.buf, e->len = io.len;
+  } else {  // Does not compress: remember that, send as is
+    mg_iobuf_free(&io);
+  }
+  n = strlen(etag);
+  mg_snprintf(e->etag, sizeof(e->etag), "%.*s.gz\"", (int) (n - 1), etag);
+  e->used = mg_millis();
+  e->hash = hash;
+  return e->data == NULL ? NULL : e;
+}
+#endif
+
+static void http_write_chunk(struct mg_connection *c, const char *buf,
+                             size_t len) {
+  mg_printf(c, "%lx\r\n", (unsigned long) len);
+  if (!mg_send(c, buf, len) || !mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list *ap) {
   size_t len = c->send.len;
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip) {  // Format, then compress
+    struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+    mg_vxprintf(mg_pfn_iobuf, &io, fmt, ap);
+    mg_http_write_chunk(c, (char *) io.buf, io.len);
+    mg_iobuf_free(&io);
+    return;
+  }
+#endif
   if (!mg_send(c, "        \r\n", 10)) mg_error(c, "OOM");
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
   if (c->send.len >= len + 10) {
@@ -371,8 +798,10 @@ void mg_http_printf_chunk(struct mg_connection *c, const char *fmt, ...) {
 }
 
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len) {
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  if (!mg_send(c, buf, len) || !mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip && http_gzip_chunk(c, buf, len)) return;
+#endif
+  http_write_chunk(c, buf, len);
   if (len == 0) c->is_resp = 0;
 }
 
@@ -447,16 +876,24 @@ static const char *mg_http_status_code_str(int status_code) {
 }
 // clang-format on
 
+// Content-Length header of mg_http_reply(), filled in once the body is known
+static const char s_cl_placeholder[] = "Content-Length:            \r\n\r\n";
+
 void mg_http_reply(struct mg_connection *c, int code, const char *headers,
                    const char *fmt, ...) {
   va_list ap;
   size_t len;
-  mg_printf(c, "HTTP/1.1 %d %s\r\n%sContent-Length:            \r\n\r\n", code,
-            mg_http_status_code_str(code), headers == NULL ? "" : headers);
+  mg_printf(c, "HTTP/1.1 %d %s\r\n%s%s", code, mg_http_status_code_str(code),
+            headers == NULL ? "" : headers, s_cl_placeholder);
   len = c->send.len;
   va_start(ap, fmt);
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, &ap);
   va_end(ap);
+#if MG_ENABLE_DEFLATE
+  if (c->is_http_gzip) {
+    len = http_gzip_reply(c, headers, len, sizeof(s_cl_placeholder) - 1);
+  }
+#endif
   if (c->send.len > 16) {
     size_t n = mg_snprintf((char *) &c->send.buf[len - 15], 11, "%-10lu",
                            (unsigned long) (c->send.len - len));
@@ -465,12 +902,12 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   c->is_resp = 0;
 }
 
-static void http_cb(struct mg_connection *, int, void *);
 static void restore_http_cb(struct mg_connection *c) {
   mg_fs_close((struct mg_fd *) c->pfn_data);
   c->pfn_data = NULL;
   c->pfn = http_cb;
   c->is_resp = 0;
+  c->is_sendfile = 0;
 }
 
 char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime);
@@ -479,6 +916,26 @@ char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime) {
   return buf;
 }
 
+#if MG_ENABLE_SENDFILE && MG_ENABLE_SOCKET
+
+// Plain TCP and a POSIX file: let the kernel copy file data to the socket.
+// Return false to fall back to reading the file into c->send
+static bool static_sendfile(struct mg_connection *c, struct mg_fd *fd,
+                            size_t *cl) {
+  long n;
+  if (fd->fs != &mg_fs_posix || c->is_tls || c->is_udp || c->is_http2) {
+    return false;
+  }
+  c->is_sendfile = 1;
+  if (c->send.len > 0 || c->send_refs != NULL) return true;  // Headers first
+  n = *cl == 0 ? 0 : mg_io_sendfile(c, fileno((FILE *) fd->fd), *cl);
+  if (n > 0) *cl -= (size_t) n;
+  if (n == MG_IO_ERR) c->is_closing = 1;
+  if (*cl == 0 || n == 0) restore_http_cb(c);  // Done, or file got shorter
+  return true;
+}
+#endif
+
 static void static_cb(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
     struct mg_fd *fd = (struct mg_fd *) c->pfn_data;
@@ -486,7 +943,10 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data) {
     size_t n, max = MG_IO_SIZE, space;
     size_t *cl = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
                                      sizeof(size_t) * sizeof(size_t)];
-    if (c->send.size < max) mg_iobuf_resize(&c->send, max);
+#if MG_ENABLE_SENDFILE && MG_ENABLE_SOCKET
+    if (static_sendfile(c, fd, cl)) return;
+#endif
+    if (c->send.size + c->send.head < max) mg_iobuf_resize(&c->send, max);
     if (c->send.len >= c->send.size) return;  // Rate limit
     if ((space = c->send.size - c->send.len) > *cl) space = *cl;
     n = fd->fs->rd(fd->fd, c->send.buf + c->send.len, space);
@@ -579,48 +1039,25 @@ static int getrange(struct mg_str *s, size_t *a, size_t *b) {
   return (int) numparsed;
 }
 
-void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
-                        const char *path,
-                        const struct mg_http_serve_opts *opts) {
-  char etag[64], tmp[MG_PATH_MAX];
-  struct mg_fs *fs = opts && opts->fs ? opts->fs : &mg_fs_posix;
-  struct mg_fd *fd = NULL;
-  size_t size = 0;
-  time_t mtime = 0;
-  const char *mime_types = opts && opts->mime_types ? opts->mime_types : NULL;
-  const char *hdrs = opts && opts->extra_headers ? opts->extra_headers : "";
-  struct mg_str *inm = NULL;
-  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
-  bool gzip = false;
-
-  if (path != NULL) {
-    // If a browser sends us "Accept-Encoding: gzip", try to open .gz first
-    struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
-    if (ae != NULL) {
-      if (mg_match(*ae, mg_str("*gzip*"), NULL)) {
-        mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
-        fd = mg_fs_open(fs, tmp, MG_FS_READ);
-        if (fd != NULL) gzip = true, path = tmp;
-      }
-    }
-    // No luck opening .gz? Open what we've told to open
-    if (fd == NULL) fd = mg_fs_open(fs, path, MG_FS_READ);
-  }
-
-  // Failed to open, and page404 is configured? Open it, then
-  if (fd == NULL && opts && opts->page404) {
-    fd = mg_fs_open(fs, opts->page404, MG_FS_READ);
-    path = opts->page404;
-    mime = guess_content_type(mg_str(path), mime_types);
+// Respond with a file that is either open (fd), or cached in memory (data)
+static void http_send_file(struct mg_connection *c, struct mg_http_message *hm,
+                           const char *hdrs, const char *path,
+                           struct mg_fd *fd, const char *data, size_t size,
+                           const char *etag, struct mg_str mime, bool gzip) {
+  struct mg_str *inm;
+#if MG_ENABLE_DEFLATE
+  struct http_gzip *gz = NULL;
+  if (!gzip && c->is_http_gzip && size >= MG_HTTP_GZIP_MIN &&
+      size <= MG_HTTP_GZIP_MAX_FILE && http_gzip_type(mime) &&
+      (gz = http_gzip_file(c->mgr, path, etag, fd, data, size)) != NULL) {
+    mg_fs_close(fd);  // Send the compressed copy instead
+    fd = NULL, data = gz->data, size = gz->len, etag = gz->etag, gzip = true;
   }
-
-  if (fd == NULL || fs->st(path, &size, &mtime) == 0) {
-    mg_http_reply(c, 404, hdrs, "Not found\n");
-    mg_fs_close(fd);
-    // NOTE: mg_http_etag() call should go first!
-  } else if (mg_http_etag(etag, sizeof(etag), size, mtime) != NULL &&
-             (inm = mg_http_get_header(hm, "If-None-Match")) != NULL &&
-             mg_strcasecmp(*inm, mg_str(etag)) == 0) {
+#else
+  (void) path;
+#endif
+  inm = mg_http_get_header_id(hm, MG_HTTP_HDR_IF_NONE_MATCH);
+  if (inm != NULL && mg_strcasecmp(*inm, mg_str(etag)) == 0) {
     mg_fs_close(fd);
     mg_http_reply(c, 304, hdrs, "");
   } else {
@@ -629,7 +1066,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     size_t r1 = 0, r2 = 0, cl = size;
 
     // Handle Range header
-    struct mg_str *rh = mg_http_get_header(hm, "Range");
+    struct mg_str *rh = mg_http_get_header_id(hm, MG_HTTP_HDR_RANGE);
     range[0] = '\0';
     if (rh != NULL && (n = getrange(rh, &r1, &r2)) > 0) {
       // If range is specified like "400-", set second limit to content len
@@ -645,7 +1082,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
         mg_snprintf(range, sizeof(range),
                     "Content-Range: bytes %llu-%llu/%llu\r\n", (uint64_t) r1,
                     (uint64_t) (r1 + cl - 1), (uint64_t) size);
-        fs->sk(fd->fd, r1);
+        if (fd != NULL) fd->fs->sk(fd->fd, r1);
       }
     }
     mg_printf(c,
@@ -655,11 +1092,16 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
               "Content-Length: %llu\r\n"
               "%s%s%s\r\n",
               status, mg_http_status_code_str(status), (int) mime.len, mime.buf,
-              etag, (uint64_t) cl, gzip ? "Content-Encoding: gzip\r\n" : "",
+              etag, (uint64_t) cl,
+              gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+                   : "",
               range, hdrs);
     if (mg_strcasecmp(hm->method, mg_str("HEAD")) == 0 || c->is_closing) {
       c->is_resp = 0;
       mg_fs_close(fd);
+    } else if (fd == NULL) {
+      mg_send(c, data + r1, cl);
+      c->is_resp = 0;
     } else {  // start serving static content only if not closing, see #3354
       // Track to-be-sent content length at the end of c->data, aligned
       size_t *clp = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
@@ -671,6 +1113,48 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
   }
 }
 
+void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
+                        const char *path,
+                        const struct mg_http_serve_opts *opts) {
+  char etag[64], tmp[MG_PATH_MAX];
+  struct mg_fs *fs = opts && opts->fs ? opts->fs : &mg_fs_posix;
+  struct mg_fd *fd = NULL;
+  size_t size = 0;
+  time_t mtime = 0;
+  const char *mime_types = opts && opts->mime_types ? opts->mime_types : NULL;
+  const char *hdrs = opts && opts->extra_headers ? opts->extra_headers : "";
+  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
+  bool gzip = false;
+
+  if (path != NULL) {
+    // If a browser sends us "Accept-Encoding: gzip", try to open .gz first
+    struct mg_str *ae =
+        mg_http_get_header_id(hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+    if (http_accepts_gzip(ae)) {
+      mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
+      fd = mg_fs_open(fs, tmp, MG_FS_READ);
+      if (fd != NULL) gzip = true, path = tmp;
+    }
+    // No luck opening .gz? Open what we've told to open
+    if (fd == NULL) fd = mg_fs_open(fs, path, MG_FS_READ);
+  }
+
+  // Failed to open, and page404 is configured? Open it, then
+  if (fd == NULL && opts && opts->page404) {
+    fd = mg_fs_open(fs, opts->page404, MG_FS_READ);
+    path = opts->page404;
+    mime = guess_content_type(mg_str(path), mime_types);
+  }
+
+  if (fd == NULL || fs->st(path, &size, &mtime) == 0) {
+    mg_http_reply(c, 404, hdrs, "Not found\n");
+    mg_fs_close(fd);
+  } else {
+    mg_http_etag(etag, sizeof(etag), size, mtime);
+    http_send_file(c, hm, hdrs, path, fd, NULL, size, etag, mime, gzip);
+  }
+}
+
 struct printdirentrydata {
   struct mg_connection *c;
   struct mg_http_message *hm;
@@ -880,11 +1364,155 @@ static int uri_to_path(struct mg_connection *c, struct mg_http_message *hm,
   return uri_to_path2(c, hm, fs, u, p, path, path_size);
 }
 
+#if MG_HTTP_CACHE_SIZE > 0
+// Static file cache entry: all that's needed to respond without fs calls
+struct http_cache {
+  uint32_t hash;       // Hash of the key; 0 for an unused entry
+  char *key;           // Options and URI. Also holds path and mime strings
+  char *path;          // Resolved path of the file being sent
+  struct mg_str mime;  // Content type
+  char etag[64];       // ETag, as made by mg_http_etag()
+  size_t size;         // File size
+  time_t mtime;        // File modification time
+  bool gzip;           // The file is the .gz variant
+  char *data;          // File content, if size <= MG_HTTP_CACHE_MAX_FILE
+  uint64_t checked;    // When size and mtime were last checked
+  uint64_t used;       // When last used, for eviction
+};
+
+static void http_cache_drop(struct http_cache *e) {
+  mg_free(e->key);
+  mg_free(e->data);
+  memset(e, 0, sizeof(*e));
+}
+
+void mg_http_cache_free(struct mg_mgr *mgr) {
+  struct http_cache *cache = (struct http_cache *) mgr->http_cache;
+  size_t i;
+  for (i = 0; cache != NULL && i < MG_HTTP_CACHE_SIZE; i++) {
+    http_cache_drop(&cache[i]);
+  }
+  mg_free(cache);
+  mgr->http_cache = NULL;
+}
+
+// Find a cached file. Once in MG_HTTP_CACHE_TTL, check it is unchanged
+static struct http_cache *http_cache_find(struct mg_mgr *mgr, struct mg_fs *fs,
+                                          uint32_t hash, const char *key) {
+  struct http_cache *e = (struct http_cache *) mgr->http_cache, *end;
+  uint64_t now = mg_millis();
+  for (end = e + MG_HTTP_CACHE_SIZE; e != NULL && e < end; e++) {
+    size_t size = 0;
+    time_t mtime = 0;
+    if (e->hash != hash || strcmp(e->key, key) != 0) continue;
+    if (now - e->checked > MG_HTTP_CACHE_TTL) {
+      if (fs->st(e->path, &size, &mtime) == 0 || size != e->size ||
+          mtime != e->mtime) {
+        http_cache_drop(e);  // Modified or gone
+        return NULL;
+      }
+      e->checked = now;
+    }
+    e->used = now;
+    return e;
+  }
+  return NULL;
+}
+
+// Cache a regular file that path was resolved to, replacing the LRU entry
+static struct http_cache *http_cache_add(struct mg_mgr *mgr, struct mg_fs *fs,
+                                         uint32_t hash, const char *key,
+                                         const char *path, bool gzip,
+                                         const char *mime_types) {
+  struct http_cache *e, *cache = (struct http_cache *) mgr->http_cache;
+  struct mg_str mime = guess_content_type(mg_str(path), mime_types);
+  char tmp[MG_PATH_MAX];
+  size_t i, size = 0, klen = strlen(key), plen;
+  time_t mtime = 0;
+  int flags = 0;
+  if (gzip) {
+    mg_snprintf(tmp, sizeof(tmp), "%s.gz", path);
+    flags = fs->st(tmp, &size, &mtime);
+    if (flags != 0) path = tmp;
+  }
+  if (flags == 0) gzip = false, flags = fs->st(path, &size, &mtime);
+  if (flags == 0 || (flags & MG_FS_DIR)) return NULL;
+  if (cache == NULL) {
+    cache = (struct http_cache *) mg_calloc(MG_HTTP_CACHE_SIZE, sizeof(*e));
+    if ((mgr->http_cache = cache) == NULL) return NULL;
+  }
+  for (e = &cache[0], i = 1; i < MG_HTTP_CACHE_SIZE && e->hash != 0; i++) {
+    if (cache[i].hash == 0 || cache[i].used < e->used) e = &cache[i];
+  }
+  http_cache_drop(e);
+  plen = strlen(path);
+  if ((e->key = (char *) mg_calloc(1, klen + plen + mime.len + 3)) == NULL) {
+    return NULL;
+  }
+  memcpy(e->key, key, klen);
+  e->path = e->key + klen + 1;
+  memcpy(e->path, path, plen);
+  e->mime = mg_str_n(e->path + plen + 1, mime.len);
+  memcpy((char *) e->mime.buf, mime.buf, mime.len);
+  if (size <= MG_HTTP_CACHE_MAX_FILE) {
+    struct mg_str data = mg_file_read(fs, path);
+    if (data.buf == NULL || data.len != size) {  // Changed while we read it
+      mg_free((void *) data.buf);
+      http_cache_drop(e);
+      return NULL;
+    }
+    e->data = (char *) data.buf;
+  }
+  mg_http_etag(e->etag, sizeof(e->etag), size, mtime);
+  e->size = size, e->mtime = mtime, e->gzip = gzip;
+  e->checked = e->used = mg_millis();
+  e->hash = hash;
+  return e;
+}
+
+// Respond from the cache. Called with path == NULL before the URI is
+// resolved, then with the resolved path to add the file to the cache
+static bool http_cache_serve(struct mg_connection *c,
+                             struct mg_http_message *hm,
+                             const struct mg_http_serve_opts *opts,
+                             const char *path) {
+  char key[MG_PATH_MAX + 100];
+  struct mg_fs *fs = opts->fs == NULL ? &mg_fs_posix : opts->fs;
+  struct mg_str *ae = mg_http_get_header_id(hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+  bool gzip = http_accepts_gzip(ae);
+  struct mg_fd *fd = NULL;
+  struct http_cache *e;
+  uint32_t hash;
+  size_t n = mg_snprintf(key, sizeof(key), "%p %d %s %s %s %.*s", fs, gzip,
+                         opts->root_dir ? opts->root_dir : "",
+                         opts->mime_types ? opts->mime_types : "",
+                         opts->ssi_pattern ? opts->ssi_pattern : "",
+                         (int) hm->uri.len, hm->uri.buf);
+  if (n >= sizeof(key)) return false;  // Too long, don't cache
+  if ((hash = mg_crc32(0, key, n)) == 0) hash = 1;
+  e = path == NULL ? http_cache_find(c->mgr, fs, hash, key)
+                   : http_cache_add(c->mgr, fs, hash, key, path, gzip,
+                                    opts->mime_types);
+  if (e == NULL) return false;
+  if (e->data == NULL && (fd = mg_fs_open(fs, e->path, MG_FS_READ)) == NULL) {
+    http_cache_drop(e);
+    return false;
+  }
+  http_send_file(c, hm, opts->extra_headers ? opts->extra_headers : "",
+                 e->path, fd, e->data, e->size, e->etag, e->mime, e->gzip);
+  return true;
+}
+#endif
+
 void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *opts) {
   char path[MG_PATH_MAX];
   const char *sp = opts->ssi_pattern;
-  int flags = uri_to_path(c, hm, opts, path, sizeof(path));
+  int flags;
+#if MG_HTTP_CACHE_SIZE > 0
+  if (http_cache_serve(c, hm, opts, NULL)) return;  // Hot file, no fs calls
+#endif
+  flags = uri_to_path(c, hm, opts, path, sizeof(path));
   if (flags < 0) {
     // Do nothing: the response has already been sent by uri_to_path()
   } else if (flags & MG_FS_DIR) {
@@ -896,6 +1524,9 @@ void mg_http_serve_dir(struct mg_connection *c, struct mg_http_message *hm,
   } else if (flags && sp != NULL && mg_match(mg_str(path), mg_str(sp), NULL)) {
     mg_http_serve_ssi(c, opts->root_dir, path);
   } else {
+#if MG_HTTP_CACHE_SIZE > 0
+    if (flags != 0 && http_cache_serve(c, hm, opts, path)) return;
+#endif
     mg_http_serve_file(c, hm, path, opts);
   }
 }
@@ -924,7 +1555,7 @@ size_t mg_url_encode(const char *s, size_t sl, char *buf, size_t len) {
 
 void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
                    char *pass, size_t passlen) {
-  struct mg_str *v = mg_http_get_header(hm, "Authorization");
+  struct mg_str *v = mg_http_get_header_id(hm, MG_HTTP_HDR_AUTHORIZATION);
   user[0] = pass[0] = '\0';
   if (v != NULL && v->len > 6 && memcmp(v->buf, "Basic ", 6) == 0) {
     char buf[256];
@@ -936,7 +1567,7 @@ void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
     }
   } else if (v != NULL && v->len > 7 && memcmp(v->buf, "Bearer ", 7) == 0) {
     mg_snprintf(pass, passlen, "%.*s", (int) v->len - 7, v->buf + 7);
-  } else if ((v = mg_http_get_header(hm, "Cookie")) != NULL) {
+  } else if ((v = mg_http_get_header_id(hm, MG_HTTP_HDR_COOKIE)) != NULL) {
     struct mg_str t = mg_http_get_header_var(*v, mg_str_n("access_token", 12));
     if (t.len > 0) mg_snprintf(pass, passlen, "%.*s", (int) t.len, t.buf);
   } else {
@@ -1128,15 +1759,131 @@ static int skip_chunk(const char *buf, int len, int *pl, int *dl) {
   return i + 2 + n + 2;
 }
 
+// Remember how far the message being parsed was scanned: its header length
+// once known, and how many header or chunked body bytes were examined
+static void http_set_scan(struct mg_connection *c, size_t head, size_t scan) {
+  c->http_head = head, c->http_scan = scan;
+}
+
+// Parse a message at `ofs`. A partially buffered message stays buffered at
+// the start of c->recv, so resume its header scan where the previous read
+// stopped, and once its headers are found, do not scan for them again
+static int http_parse_conn(struct mg_connection *c, size_t ofs,
+                           struct mg_http_message *hm) {
+  const char *buf = (char *) c->recv.buf + ofs;
+  size_t len = c->recv.len - ofs;
+  int n = (int) c->http_head;
+  if (n == 0) {
+    n = http_req_len((uint8_t *) buf, len, c->http_scan);
+    if (n >= 0) http_set_scan(c, (size_t) n, n > 0 ? 0 : len);
+  }
+  return http_parse(buf, n, hm);
+}
+
+// Deliver a body fragment at `ofs` in streaming mode
+static void http_body(struct mg_connection *c, struct mg_http_message *hm,
+                      size_t ofs, size_t len) {
+  hm->body = mg_str_n((char *) c->recv.buf + ofs, len);
+  mg_call(c, MG_EV_HTTP_BODY, hm);
+}
+
+// Parse chunk size line at `s`. Return its length, 0 if not buffered yet,
+// or -1 on error
+static int http_chunk_size(const char *s, size_t len, size_t *size) {
+  size_t i = 0;
+  int n = 0;  // pass int to mg_str_to_num, treats as unsigned
+  while (i < len && is_hex_digit(s[i])) i++;
+  if (i == len || (i + 1 == len && s[i] == '\r')) return 0;
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') return -1;
+  if (!mg_str_to_num(mg_str_n(s, i), 16, &n, sizeof(n)) || n < 0) return -1;
+  *size = (size_t) n;
+  return (int) i + 2;
+}
+
+// Streaming mode: deliver the body of the message at `ofs` as it arrives,
+// removing delivered bytes from c->recv. The headers stay buffered until the
+// message is complete. c->http_scan holds the number of body bytes left for
+// Content-Length, or data + CRLF bytes left of the current chunk. A body
+// without either, c->is_http_eof set, ends when the connection closes.
+// Return true when the body is complete
+static bool http_stream(struct mg_connection *c, struct mg_http_message *hm,
+                        size_t ofs, bool is_chunked, bool is_closing) {
+  size_t start = ofs + hm->head.len, pos = start, left, n;
+  bool done = false;
+  if (!c->is_http_body) {  // First fragment of this message
+    c->is_http_body = 1;
+    c->is_http_eof = !is_chunked && hm->body.len == (size_t) ~0;
+    c->http_scan = is_chunked ? 0 : hm->body.len;
+  }
+  left = c->http_scan;
+  if (!is_chunked) {
+    n = c->recv.len - pos < left ? c->recv.len - pos : left;
+    if (n > 0 && !c->is_full) {
+      http_body(c, hm, pos, n), pos += n;
+      if (!c->is_http_eof) left -= n;
+    }
+    done = c->is_http_eof ? is_closing : left == 0;
+  }
+  while (is_chunked && !done && !c->is_full && c->is_closing == 0) {
+    const char *s = (char *) c->recv.buf + pos;
+    size_t avail = c->recv.len - pos, size = 0;
+    int k;
+    if (left == 0) {  // Chunk size line
+      if ((k = http_chunk_size(s, avail, &size)) <= 0) {
+        if (k < 0) mg_error(c, "Invalid chunk");
+        break;
+      }
+      if (size == 0) {  // Last chunk, followed by an empty line
+        if (avail < (size_t) k + 2) break;
+        if (s[k] != '\r' || s[k + 1] != '\n') {
+          mg_error(c, "Invalid chunk");
+          break;
+        }
+        pos += (size_t) k + 2, done = true;
+      } else {
+        pos += (size_t) k, left = size + 2;
+      }
+    } else if (left > 2) {  // Chunk data
+      if ((n = avail < left - 2 ? avail : left - 2) == 0) break;
+      http_body(c, hm, pos, n);
+      pos += n, left -= n;
+    } else {  // CRLF after chunk data
+      if (avail == 0) break;
+      if (s[0] != (left == 2 ? '\r' : '\n')) {
+        mg_error(c, "Invalid chunk");
+        break;
+      }
+      pos++, left--;
+    }
+  }
+  mg_iobuf_del(&c->recv, start, pos - start);
+  c->http_scan = left;
+  return done;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
+#if MG_ENABLE_DEFLATE
+  if (ev == MG_EV_CLOSE && c->http_gzip != NULL) http_gzip_end(c);
+#endif
+#if MG_ENABLE_HTTP2
+  if (ev == MG_EV_READ && c->is_accepted && !c->is_http2 &&
+      mg_http2_accept(c)) {
+    return;  // Got HTTP/2 client preface, or a part of it
+  }
+#endif
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE ||
-      (ev == MG_EV_POLL && c->is_accepted && !c->is_draining &&
-       c->recv.len > 0)) {  // see #2796
+      (ev == MG_EV_POLL && (c->is_accepted || c->is_http_stream) &&
+       !c->is_draining && c->recv.len > 0)) {  // see #2796
     struct mg_http_message hm;
     size_t ofs = 0;  // Parsing offset
+    if (c->http_head > c->recv.len ||
+        (c->http_scan > c->recv.len && !c->is_http_body)) {
+      http_set_scan(c, 0, 0);  // Received data was consumed elsewhere
+      c->is_http_body = 0;
+    }
     while (c->is_resp == 0 && ofs < c->recv.len) {
       const char *buf = (char *) c->recv.buf + ofs;
-      int n = mg_http_parse(buf, c->recv.len - ofs, &hm);
+      int n = http_parse_conn(c, ofs, &hm);
       struct mg_str *te;  // Transfer - encoding header
       bool is_chunked = false, is_http_1_0 = false;
       size_t old_len = c->recv.len;
@@ -1147,13 +1894,16 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         c->is_draining = 1;
         mg_hexdump(buf, c->recv.len - ofs > 16 ? 16 : c->recv.len - ofs);
         c->recv.len = 0;
+        http_set_scan(c, 0, 0);
         return;
       }
-      if (n == 0) break;                 // Request is not buffered yet
-      mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Got all HTTP headers
+      if (n == 0) break;  // Request is not buffered yet
+      // Got all HTTP headers. When streaming, report them once
+      if (!c->is_http_body) mg_call(c, MG_EV_HTTP_HDRS, &hm);
       if (c->recv.len != old_len) {
         // User manipulated received data. Wash our hands
         MG_DEBUG(("%lu detaching HTTP handler", c->id));
+        http_set_scan(c, 0, 0);
         c->pfn = NULL;
         return;
       }
@@ -1165,14 +1915,16 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
           hm.proto.len == 8 && mg_ncasecmp(hm.proto.buf, "HTTP/1.0", 8) == 0;
       // HTTP/1.0 does not use "Transfer-Encoding: chunked"
       if (!is_http_1_0 &&
-          (te = mg_http_get_header(&hm, "Transfer-Encoding")) != NULL) {
+          (te = mg_http_get_header_id(&hm, MG_HTTP_HDR_TRANSFER_ENCODING)) !=
+              NULL) {
         if (mg_strcasecmp(*te, mg_str("chunked")) == 0) {
           is_chunked = true;
         } else {
           mg_error(c, "Invalid Transfer-Encoding");  // See #2460
           return;
         }
-      } else if (mg_http_get_header(&hm, "Content-length") == NULL) {
+      } else if (mg_http_get_header_id(&hm, MG_HTTP_HDR_CONTENT_LENGTH) ==
+                 NULL) {
         // #2593: HTTP packets must contain either Transfer-Encoding or
         // Content-length
         bool is_response = mg_ncasecmp(hm.method.buf, "HTTP/", 5) == 0;
@@ -1198,15 +1950,29 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         }
       }
 
-      if (is_chunked) {
+      if (c->is_http_stream || c->is_http_body) {
+        // Streaming mode: deliver the body as it arrives, then report an
+        // empty-bodied message
+        size_t mofs = (size_t) (buf - (char *) c->recv.buf);
+        if (!http_stream(c, &hm, mofs, is_chunked, ev == MG_EV_CLOSE)) break;
+        c->is_http_body = 0;
+        hm.body = mg_str_n((char *) c->recv.buf + mofs + n, 0);
+        hm.message.len = (size_t) n;
+        ofs = mofs + (size_t) n;
+      } else if (is_chunked) {
         // For chunked data, strip off prefixes and suffixes from chunks
         // and relocate them right after the headers, then report a message
         char *s = (char *) c->recv.buf + ofs + n;
         int o = 0, pl, dl, cl, len = (int) (c->recv.len - ofs - (size_t) n);
 
-        // Find zero-length chunk (the end of the body)
+        // Find zero-length chunk (the end of the body), skipping the chunks
+        // already found on previous reads
+        if (c->http_scan <= (size_t) len) o = (int) c->http_scan;
         while ((cl = skip_chunk(s + o, len - o, &pl, &dl)) > 0 && dl) o += cl;
-        if (cl == 0) break;  // No zero-len chunk, buffer more data
+        if (cl == 0) {  // No zero-len chunk, buffer more data
+          http_set_scan(c, (size_t) n, (size_t) o);
+          break;
+        }
         if (cl < 0) {
           mg_error(c, "Invalid chunk");
           break;
@@ -1225,11 +1991,20 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         if (hm.body.len > len) break;  // Buffer more data
         ofs += (size_t) n + hm.body.len;
       }
+      http_set_scan(c, 0, 0);  // Message is complete
 
       if (c->is_accepted) c->is_resp = 1;  // Start generating response
+#if MG_ENABLE_DEFLATE
+      if (c->is_accepted) {  // Compress the response if the peer accepts it
+        struct mg_str *ae =
+            mg_http_get_header_id(&hm, MG_HTTP_HDR_ACCEPT_ENCODING);
+        c->is_http_gzip = http_accepts_gzip(ae);
+      }
+#endif
       mg_call(c, MG_EV_HTTP_MSG, &hm);     // User handler can clear is_resp
       if (c->is_accepted && !c->is_resp) {
-        struct mg_str *cc = mg_http_get_header(&hm, "Connection");
+        struct mg_str *cc =
+            mg_http_get_header_id(&hm, MG_HTTP_HDR_CONNECTION);
         if (cc != NULL && mg_strcasecmp(*cc, mg_str("close")) == 0) {
           c->is_draining = 1;  // honor "Connection: close"
           break;
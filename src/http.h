@@ -12,6 +12,25 @@ struct mg_http_header {
   struct mg_str value;  // Header value, e.g. "text/html"
 };
 
+// Well-known headers. mg_http_parse() indexes them, so that
+// mg_http_get_header_id() finds them without scanning headers[]
+enum {
+  MG_HTTP_HDR_CONTENT_LENGTH,     // Headers up to Cookie must not repeat:
+  MG_HTTP_HDR_TRANSFER_ENCODING,  // mg_http_parse() rejects messages
+  MG_HTTP_HDR_CONNECTION,         // that repeat them
+  MG_HTTP_HDR_AUTHORIZATION,
+  MG_HTTP_HDR_COOKIE,
+  MG_HTTP_HDR_HOST,
+  MG_HTTP_HDR_CONTENT_TYPE,
+  MG_HTTP_HDR_ACCEPT_ENCODING,
+  MG_HTTP_HDR_IF_NONE_MATCH,
+  MG_HTTP_HDR_RANGE,
+  MG_HTTP_HDR_UPGRADE,
+  MG_HTTP_HDR_SEC_WEBSOCKET_KEY,
+  MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL,
+  MG_HTTP_HDR_MAX
+};
+
 // Parsed HTTP request or response.
 // Passed as ev_data in MG_EV_HTTP_MSG and MG_EV_HTTP_HDRS.
 // For requests:  method="GET", uri="/path", proto="a=1&b=2", proto="HTTP/1.1"
@@ -19,6 +38,7 @@ struct mg_http_header {
 struct mg_http_message {
   struct mg_str method, uri, query, proto;             // Request/response line
   struct mg_http_header headers[MG_MAX_HTTP_HEADERS];  // Parsed headers array
+  uint16_t hdr_index[MG_HTTP_HDR_MAX];  // Well-known: 1 + headers[] index, or 0
   struct mg_str body;     // Request or response body
   struct mg_str head;     // Raw bytes: request/status line + headers, no body
   struct mg_str message;  // Raw bytes: head + body
@@ -55,6 +75,9 @@ void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 
 // Sends one chunk in HTTP chunked transfer encoding from a raw buffer.
 // Call with len=0 to send the terminating zero-length chunk.
+// With MG_ENABLE_DEFLATE=1, chunks are gzip-compressed if c->is_http_gzip is
+// set and the response headers, sent just before the first chunk, have a
+// Content-Type matching MG_HTTP_GZIP_TYPES and no Content-Encoding.
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 
 // Creates an HTTP server on url, e.g. "http://0.0.0.0:8000".
@@ -72,6 +95,19 @@ void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 //   receives normal connection events. It also receives MG_EV_HTTP_HDRS when
 //   headers are received and MG_EV_HTTP_MSG when the full request is received.
 //   ev_data for both HTTP events is struct mg_http_message *.
+//   To receive large bodies in constant memory, set c->is_http_stream, e.g.
+//   on MG_EV_HTTP_HDRS. The body then arrives, de-chunked, as a sequence of
+//   MG_EV_HTTP_BODY events with hm->body set to the fragment, followed by
+//   MG_EV_HTTP_MSG with an empty hm->body. Set c->is_full to pause delivery,
+//   clear it to resume.
+//   With MG_ENABLE_HTTP2=1, clients can also speak HTTP/2: over TLS, set
+//   opts.alpn = mg_str("h2,http/1.1") in mg_tls_init(); in plain text,
+//   clients must use prior knowledge. Each request stream gets a connection
+//   of its own, c->is_http2 set, that receives MG_EV_OPEN, MG_EV_ACCEPT,
+//   then MG_EV_HTTP_MSG with hm->proto "HTTP/2.0" and takes a reply the
+//   usual way. Stream connections use the parent's TLS session and have
+//   c->is_tls clear; mg_tls_init() on them does nothing. Up to
+//   MG_HTTP2_MAX_STREAMS requests per connection are served concurrently
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
 
@@ -106,11 +142,21 @@ struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
 // Notes:
 //   Call from an MG_EV_HTTP_MSG handler. The uri in hm is mapped under
 //   opts->root_dir. Directory listing depends on MG_ENABLE_DIRLIST; SSI uses
-//   opts->ssi_pattern when configured.
+//   opts->ssi_pattern when configured. With MG_HTTP_CACHE_SIZE > 0, each
+//   manager caches metadata of served files, and content of files up to
+//   MG_HTTP_CACHE_MAX_FILE bytes: repeated requests don't touch the
+//   filesystem. File changes are noticed within MG_HTTP_CACHE_TTL ms.
+//   With MG_ENABLE_DEFLATE=1, files matching MG_HTTP_GZIP_TYPES with no .gz
+//   sibling are compressed on the fly for clients that accept gzip. The last
+//   MG_HTTP_GZIP_CACHE_SIZE compressed files are kept in memory by path and
+//   ETag, so each file version is compressed once.
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *);
 
 // Serves a single file at path. Call from an MG_EV_HTTP_MSG handler.
+// With MG_ENABLE_SENDFILE=1 (Linux, not with io_uring; off by default), files
+// from mg_fs_posix are sent over plain TCP connections with sendfile(),
+// without copying to c->send.
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
 
@@ -128,6 +174,10 @@ void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
 //   headers must end with "\r\n"; pass "" or NULL for no extra headers.
 //   body_fmt is printf-style and supports %M/%m custom printers. Use MG_ESC
 //   when printing JSON strings.
+//   With MG_ENABLE_DEFLATE=1, the body is gzip-compressed if the request
+//   accepts gzip, headers set a Content-Type matching MG_HTTP_GZIP_TYPES, and
+//   the body is at least MG_HTTP_GZIP_MIN bytes. c->is_http_gzip is set for
+//   each request that accepts gzip; clear it to send a response as is.
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
 
@@ -135,6 +185,12 @@ void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
 // Returns a pointer to the mg_str value, or NULL if not found.
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
 
+// Looks up a well-known header, e.g. MG_HTTP_HDR_RANGE, in the index built
+// by mg_http_parse(). Returns a pointer to the first such header's value, or
+// NULL if not found. Unlike mg_http_get_header(), does not scan headers[],
+// unless nothing is indexed, e.g. for a message filled in by hand
+struct mg_str *mg_http_get_header_id(struct mg_http_message *, int id);
+
 // Extracts a named variable from a query string or form-encoded body (buf).
 // Returns the raw (URL-encoded) value as mg_str, or an empty mg_str if not found.
 // Not NUL-terminated. Use mg_url_decode() to get a decoded string.
@@ -201,3 +257,9 @@ size_t mg_http_next_multipart(struct mg_str, size_t, struct mg_http_part *);
 
 // Returns the HTTP status code from a parsed response message (e.g. 200, 404).
 int mg_http_status(const struct mg_http_message *hm);
+
+// Internal: frees manager-wide HTTP caches, and switches an accepted
+// connection to HTTP/2. Not for application use.
+void mg_http_cache_free(struct mg_mgr *);
+void mg_http_gzip_free(struct mg_mgr *);
+bool mg_http2_accept(struct mg_connection *c);
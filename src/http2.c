@@ -0,0 +1,980 @@
+#include "http.h"
+#include "log.h"
+#include "printf.h"
+#include "util.h"
+
+#if MG_ENABLE_HTTP2
+// HTTP/2 server, RFC 9113. Every request stream gets a connection of its
+// own, which is not in mgr->conns and has no socket. The request is written
+// to its recv buffer as HTTP/1 text, so the usual HTTP handler parses it and
+// fires MG_EV_HTTP_MSG. The HTTP/1 response written to its send buffer, e.g.
+// by mg_http_reply() or mg_http_serve_dir(), is converted back to frames
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_WINDOW 65535     // Initial flow control window, the default
+#define H2_FRAME_MAX 16384  // Largest frame, the default for both sides
+#define H2_TABLE_MAX 4096   // HPACK dynamic table size, the default
+#define H2_BLOCK_MAX 32768  // Largest request header block we accept
+#define H2_LIST_MAX 16384   // Largest decoded header list, RFC 9113 6.5.2
+
+// Frame types
+enum {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+// Error codes
+enum {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_STREAM_CLOSED = 5,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_ENHANCE_YOUR_CALM = 11
+};
+
+// Frame flags
+#define H2_END_STREAM 1  // Also ACK, for SETTINGS and PING
+#define H2_END_HEADERS 4
+#define H2_PADDED 8
+#define H2_PRIO 0x20
+
+// How the stream response, sent by the HTTP/1 code, is being converted
+enum {
+  H2_RESP_HEAD,     // Waiting for the status line and headers
+  H2_RESP_LEN,      // Body has Content-Length
+  H2_RESP_CHUNKED,  // Chunked body
+  H2_RESP_CLOSE,    // Body ends when the stream connection closes
+  H2_RESP_DONE      // Response is complete
+};
+
+struct h2_stream {
+  struct h2_stream *next;   // Next stream, in ID order
+  struct mg_connection *c;  // Stream connection
+  uint32_t id;              // Stream ID
+  int64_t swin;             // Send window
+  size_t rwin;              // Receive window, left to the peer
+  size_t left;              // Response body left: Content-Length or chunk
+  size_t req_left;          // Request body left, if Content-Length is set
+  unsigned long stamp;      // When a DATA frame was sent last, round robin
+  uint8_t state;            // Response conversion state, H2_RESP_*
+  uint8_t urgency;          // Priority, 0 is the highest (RFC 9218)
+  bool incremental;         // Priority: share bandwidth, same urgency
+  bool has_prio;            // Priority header is set, ignore PRIORITY frames
+  bool is_head;             // HEAD request, the response has no body
+  bool is_blocked;          // Has nothing to send in this round
+  bool crlf;                // Response chunk data is sent, CRLF is due
+  bool req_len;             // Request has Content-Length
+  bool req_chunked;         // Request body is relayed in chunks
+  bool req_done;            // Request is complete: got END_STREAM
+};
+
+struct h2_conn {
+  struct h2_stream *streams;  // Open streams
+  mg_event_handler_t pfn;     // HTTP/1 handler, for stream connections
+  struct mg_iobuf block;      // Header block being received
+  struct mg_iobuf table;      // HPACK dynamic table, newest entry first
+  size_t table_size;          // Dynamic table size, RFC 7541 section 4.1
+  size_t table_max;           // Dynamic table size limit
+  size_t nstreams;            // Number of open streams
+  size_t rwin;                // Connection receive window, left to the peer
+  int64_t swin;               // Connection send window
+  int64_t init_win;           // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  uint32_t last_id;           // Highest stream ID seen
+  uint32_t block_id;          // Stream of the header block, 0 if none
+  uint8_t block_flags;        // HEADERS frame flags
+  unsigned block_weight;      // HEADERS frame priority weight, 0 if none
+  unsigned long stamp;        // DATA frames sent, round robin clock
+  bool is_goaway;             // Accept no new streams
+};
+
+// HPACK static table, RFC 7541 appendix A
+static const char *const s_h2_static[][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+
+#define H2_STATIC_SIZE (sizeof(s_h2_static) / sizeof(s_h2_static[0]))
+
+// HPACK Huffman code, RFC 7541 appendix B. The code is canonical, so it is
+// enough to know how many codes there are of each length, and the symbols
+// in code order. EOS, the last code, is not listed
+static const uint8_t s_h2_huff_count[31] = {
+    0, 0, 0, 0, 0,  10, 26, 32, 6,  0,  5,  3,  2,  6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+static const uint8_t s_h2_huff_sym[256] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,
+    51,  52,  53,  54,  55,  56,  57,  61,  65,  95,  98,  100, 102, 103, 104,
+    108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,  73,
+    74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38,  42,  44,  59,  88,  90,  33,
+    34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,  93,  126,
+    94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224,
+    226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181,
+    185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139,
+    140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174,
+    175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202,
+    205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2,
+    3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,
+    21,  23,  24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,
+    22};
+
+// Decode an integer with an n-bit prefix, RFC 7541 section 5.1
+static bool hp_int(const uint8_t **p, const uint8_t *end, int n, size_t *v) {
+  size_t max = (size_t) ((1U << n) - 1), shift = 0;
+  uint8_t b = 0x80;
+  if (*p >= end) return false;
+  if ((*v = *(*p)++ & max) < max) return true;
+  while (b & 0x80) {
+    if (*p >= end || shift > 21) return false;  // Up to 2^28, plenty
+    b = *(*p)++;
+    *v += (size_t) (b & 0x7f) << shift;
+    shift += 7;
+  }
+  return true;
+}
+
+// Decode a Huffman-coded string, append it to io
+static bool hp_huff(const uint8_t *s, size_t n, struct mg_iobuf *io) {
+  uint32_t code = 0, first = 0, index = 0, len = 0;
+  bool ones = true;  // Padding must be the most significant bits of EOS
+  size_t i;
+  if (!mg_iobuf_reserve(io, n * 8 / 5 + 1)) return false;
+  for (i = 0; i < n * 8; i++) {
+    uint32_t bit = (uint32_t) (s[i / 8] >> (7 - i % 8)) & 1U;
+    uint32_t count = s_h2_huff_count[++len];
+    code |= bit, ones = ones && bit;
+    if (code < first + count) {  // Got a symbol, canonical decoding
+      if (index + code - first >= 256) return false;  // EOS is an error
+      if ((io->buf[io->len++] = s_h2_huff_sym[index + code - first]) == 0) {
+        return false;  // We use NUL as a delimiter, and it is invalid anyway
+      }
+      code = first = index = len = 0, ones = true;
+    } else if (len >= 30) {
+      return false;
+    } else {
+      index += count, first = (first + count) << 1, code <<= 1;
+    }
+  }
+  return len < 8 && ones;
+}
+
+// Decode a string literal, append it to io, NUL-terminated
+static bool hp_str(const uint8_t **p, const uint8_t *end, struct mg_iobuf *io) {
+  bool huff = *p < end && (**p & 0x80);
+  size_t len;
+  if (!hp_int(p, end, 7, &len) || len > (size_t) (end - *p)) return false;
+  if (huff) {
+    if (!hp_huff(*p, len, io)) return false;
+  } else if (memchr(*p, 0, len) != NULL ||
+             mg_iobuf_add(io, io->len, *p, len) < len) {
+    return false;
+  }
+  *p += len;
+  return mg_iobuf_add(io, io->len, "", 1) == 1;
+}
+
+// Dynamic table entries are "name\0value\0", size is as per RFC 7541 4.1
+static size_t hp_entry(const uint8_t *p, size_t *size) {
+  size_t n = strlen((char *) p) + 1, v = strlen((char *) p + n) + 1;
+  if (size != NULL) *size = n + v - 2 + 32;
+  return n + v;
+}
+
+static void hp_evict(struct h2_conn *h, size_t max) {
+  while (h->table_size > max) {
+    size_t ofs = 0, last = 0, size = 0;
+    while (ofs < h->table.len) {
+      last = ofs, ofs += hp_entry(h->table.buf + ofs, &size);
+    }
+    h->table.len = last;
+    h->table_size -= size;
+  }
+}
+
+// Add an entry, which io has at ofs, to the dynamic table
+static bool hp_add(struct h2_conn *h, struct mg_iobuf *io, size_t ofs) {
+  size_t size, len = hp_entry(io->buf + ofs, &size);
+  if (size > h->table_max) {
+    hp_evict(h, 0);  // Too large: the table just gets empty
+  } else {
+    hp_evict(h, h->table_max - size);
+    if (mg_iobuf_add(&h->table, 0, io->buf + ofs, len) == 0) return false;
+    h->table_size += size;
+  }
+  return true;
+}
+
+// Append a name, and a value if val is true, of a table entry to io
+static bool hp_index(struct h2_conn *h, size_t idx, bool val,
+                     struct mg_iobuf *io) {
+  const char *name, *value;
+  if (idx == 0) return false;
+  if (idx <= H2_STATIC_SIZE) {
+    name = s_h2_static[idx - 1][0], value = s_h2_static[idx - 1][1];
+  } else {
+    size_t ofs = 0;
+    for (idx -= H2_STATIC_SIZE + 1; idx > 0 && ofs < h->table.len; idx--) {
+      ofs += hp_entry(h->table.buf + ofs, NULL);
+    }
+    if (ofs >= h->table.len) return false;
+    name = (char *) h->table.buf + ofs, value = name + strlen(name) + 1;
+  }
+  return mg_iobuf_add(io, io->len, name, strlen(name) + 1) > 0 &&
+         (!val || mg_iobuf_add(io, io->len, value, strlen(value) + 1) > 0);
+}
+
+// Decode a header block into io, as "name\0value\0" pairs. Indexed fields
+// make a small block expand a lot, so the decoded list size is capped
+static bool hp_decode(struct h2_conn *h, const uint8_t *p, size_t len,
+                      struct mg_iobuf *io) {
+  const uint8_t *end = p + len;
+  size_t size = 0;  // Header list size, as per RFC 9113 6.5.2
+  while (p < end) {
+    size_t idx, ofs = io->len;
+    uint8_t b = *p;
+    if (b & 0x80) {  // Indexed field
+      if (!hp_int(&p, end, 7, &idx) || !hp_index(h, idx, true, io)) {
+        return false;
+      }
+    } else if ((b & 0xe0) == 0x20) {  // Dynamic table size update
+      if (!hp_int(&p, end, 5, &idx) || idx > H2_TABLE_MAX) return false;
+      hp_evict(h, h->table_max = idx);
+    } else {  // Literal, with incremental indexing (01), or without it
+      bool add = (b & 0x40) != 0;
+      if (!hp_int(&p, end, add ? 6 : 4, &idx)) return false;
+      if (idx == 0 ? !hp_str(&p, end, io) : !hp_index(h, idx, false, io)) {
+        return false;
+      }
+      if (!hp_str(&p, end, io) || (add && !hp_add(h, io, ofs))) return false;
+    }
+    if (io->len > ofs && (size += io->len - ofs - 2 + 32) > H2_LIST_MAX) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void hp_put_int(struct mg_iobuf *io, uint8_t flags, int n, size_t v) {
+  uint8_t buf[8];
+  size_t len = 0, max = (size_t) ((1U << n) - 1);
+  if (v < max) {
+    buf[len++] = (uint8_t) (flags | v);
+  } else {
+    buf[len++] = (uint8_t) (flags | max);
+    for (v -= max; v >= 128; v >>= 7) buf[len++] = (uint8_t) (v | 128);
+    buf[len++] = (uint8_t) v;
+  }
+  mg_iobuf_add(io, io->len, buf, len);
+}
+
+static void hp_put_str(struct mg_iobuf *io, struct mg_str s, bool lower) {
+  size_t i, ofs;
+  hp_put_int(io, 0, 7, s.len);
+  ofs = io->len;
+  if (mg_iobuf_add(io, ofs, s.buf, s.len) == 0) return;
+  for (i = 0; lower && i < s.len; i++) {
+    if (io->buf[ofs + i] >= 'A' && io->buf[ofs + i] <= 'Z') {
+      io->buf[ofs + i] = (uint8_t) (io->buf[ofs + i] + 'a' - 'A');
+    }
+  }
+}
+
+// Encode a field as a literal without indexing. The encoder does not use the
+// dynamic table, so it keeps no state
+static void hp_put(struct mg_iobuf *io, struct mg_str name, struct mg_str val) {
+  size_t i;
+  for (i = 15; i <= H2_STATIC_SIZE; i++) {
+    if (mg_strcasecmp(name, mg_str(s_h2_static[i - 1][0])) == 0) break;
+  }
+  if (i <= H2_STATIC_SIZE) {
+    hp_put_int(io, 0, 4, i);
+  } else {
+    hp_put_int(io, 0, 4, 0);
+    hp_put_str(io, name, true);
+  }
+  hp_put_str(io, val, false);
+}
+
+static void h2_frame(struct mg_connection *c, uint8_t type, uint8_t flags,
+                     uint32_t id, const void *buf, size_t len) {
+  uint8_t hdr[9];
+  MG_STORE_BE24(hdr, len);
+  hdr[3] = type, hdr[4] = flags;
+  MG_STORE_BE32(hdr + 5, id);
+  mg_send(c, hdr, sizeof(hdr));
+  if (len > 0) mg_send(c, buf, len);
+}
+
+// Send a frame with a 32-bit payload: RST_STREAM, WINDOW_UPDATE
+static void h2_frame32(struct mg_connection *c, uint8_t type, uint32_t id,
+                       uint32_t val) {
+  uint8_t buf[4];
+  MG_STORE_BE32(buf, val);
+  h2_frame(c, type, 0, id, buf, sizeof(buf));
+}
+
+// Connection error: say why, and close once that is sent
+static void h2_goaway(struct mg_connection *c, struct h2_conn *h,
+                      uint32_t code) {
+  uint8_t buf[8];
+  MG_STORE_BE32(buf, h->last_id);
+  MG_STORE_BE32(buf + 4, code);
+  h2_frame(c, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+  MG_ERROR(("%lu HTTP/2 error %lu", c->id, (unsigned long) code));
+  h->is_goaway = true;
+  c->is_draining = 1;
+}
+
+static struct h2_stream *h2_find(struct h2_conn *h, uint32_t id) {
+  struct h2_stream *s = h->streams;
+  while (s != NULL && s->id != id) s = s->next;
+  return s;
+}
+
+static struct h2_stream *h2_open(struct mg_connection *c, struct h2_conn *h,
+                                 uint32_t id) {
+  struct h2_stream *s = (struct h2_stream *) mg_calloc(1, sizeof(*s)), **p;
+  struct mg_connection *sc = s == NULL ? NULL : mg_alloc_conn(c->mgr);
+  if (sc == NULL) {
+    mg_free(s);
+    return NULL;
+  }
+  sc->fd = (void *) (size_t) MG_INVALID_SOCKET;
+  sc->loc = c->loc, sc->rem = c->rem;
+  sc->fn = c->fn, sc->fn_data = c->fn_data, sc->pfn = h->pfn;
+  sc->is_accepted = sc->is_http2 = 1;
+  s->c = sc, s->id = id, s->swin = h->init_win, s->rwin = H2_WINDOW;
+  s->urgency = 3;  // The default, RFC 9218
+  for (p = &h->streams; *p != NULL;) p = &(*p)->next;
+  *p = s;
+  h->nstreams++;
+  MG_DEBUG(("%lu stream %lu: %lu", c->id, (unsigned long) id, sc->id));
+  mg_call(sc, MG_EV_OPEN, NULL);
+  mg_call(sc, MG_EV_ACCEPT, NULL);  // mg_tls_init() ignores stream connections
+  return s;
+}
+
+static void h2_close(struct h2_conn *h, struct h2_stream *s) {
+  struct h2_stream **p = &h->streams;
+  while (*p != s) p = &(*p)->next;
+  *p = s->next;
+  s->c->recv.len = 0;  // Do not deliver an incomplete request on close
+  mg_close_conn(s->c);
+  mg_free(s);
+  h->nstreams--;
+}
+
+static void h2_reset(struct mg_connection *c, struct h2_conn *h,
+                     struct h2_stream *s, uint32_t code) {
+  h2_frame32(c, H2_RST_STREAM, s->id, code);
+  h2_close(h, s);
+}
+
+// Relay request data to the stream connection, let it parse what it has
+static void h2_relay(struct h2_stream *s, const void *buf, size_t len,
+                     bool end) {
+  struct mg_iobuf *io = &s->c->recv;
+  long n = (long) io->len;
+  if (s->req_chunked && len > 0) {
+    mg_xprintf(mg_pfn_iobuf, io, "%lx\r\n", (unsigned long) len);
+  }
+  mg_iobuf_add(io, io->len, buf, len);
+  if (s->req_chunked && len > 0) mg_iobuf_add(io, io->len, "\r\n", 2);
+  if (s->req_chunked && end) mg_iobuf_add(io, io->len, "0\r\n\r\n", 5);
+  if (end) s->req_done = true;
+  n = (long) io->len - n;
+  if (n > 0 && !s->c->is_full) mg_call(s->c, MG_EV_READ, &n);
+}
+
+// RFC 9218 priority field value, e.g. "u=1, i"
+static void h2_prio(struct h2_stream *s, struct mg_str v) {
+  struct mg_str k;
+  while (mg_span(v, &k, &v, ',')) {
+    while (k.len > 0 && k.buf[0] == ' ') k.buf++, k.len--;
+    while (k.len > 0 && k.buf[k.len - 1] == ' ') k.len--;
+    if (k.len == 3 && k.buf[0] == 'u' && k.buf[1] == '=' && k.buf[2] >= '0' &&
+        k.buf[2] <= '7') {
+      s->urgency = (uint8_t) (k.buf[2] - '0');
+    } else if (mg_strcmp(k, mg_str("i")) == 0 ||
+               mg_strcmp(k, mg_str("i=?1")) == 0) {
+      s->incremental = true;
+    }
+  }
+  s->has_prio = true;
+}
+
+// RFC 7540 priority weight, 1..256, maps to urgency 7..0
+static void h2_weight(struct h2_stream *s, unsigned weight) {
+  if (!s->has_prio) s->urgency = (uint8_t) ((256 - weight) * 8 / 256);
+}
+
+static bool h2_is_hop(struct mg_str name) {
+  return mg_strcasecmp(name, mg_str("connection")) == 0 ||
+         mg_strcasecmp(name, mg_str("keep-alive")) == 0 ||
+         mg_strcasecmp(name, mg_str("proxy-connection")) == 0 ||
+         mg_strcasecmp(name, mg_str("transfer-encoding")) == 0 ||
+         mg_strcasecmp(name, mg_str("upgrade")) == 0;
+}
+
+// Get the next "name\0value\0" pair of a decoded header block
+static bool h2_next(struct mg_iobuf *io, size_t *ofs, struct mg_str *name,
+                    struct mg_str *val) {
+  if (*ofs >= io->len) return false;
+  *name = mg_str((char *) io->buf + *ofs);
+  *val = mg_str(name->buf + name->len + 1);
+  *ofs += name->len + val->len + 2;
+  return true;
+}
+
+// Write the request to the stream connection as HTTP/1 text. The important
+// headers go first, as the HTTP/1 parser keeps MG_MAX_HTTP_HEADERS only
+bool mg_to_size_t(struct mg_str str, size_t *val);
+static bool h2_request(struct h2_stream *s, struct mg_iobuf *hdrs, bool end) {
+  struct mg_str k, v, method = {0, 0}, path = {0, 0}, auth = {0, 0};
+  struct mg_iobuf *io = &s->c->recv;
+  size_t i, ofs = 0, cookies = 0;
+  bool has_host = false, has_scheme = false, regular = false;
+  while (h2_next(hdrs, &ofs, &k, &v)) {
+    if (k.len == 0 || memchr(v.buf, '\r', v.len) || memchr(v.buf, '\n', v.len)) {
+      return false;
+    }
+    if (k.buf[0] == ':') {  // Pseudo-headers must go first
+      if (regular) return false;
+      if (mg_strcmp(k, mg_str(":method")) == 0) {
+        method = v;
+      } else if (mg_strcmp(k, mg_str(":path")) == 0) {
+        path = v;
+      } else if (mg_strcmp(k, mg_str(":authority")) == 0) {
+        auth = v;
+      } else if (mg_strcmp(k, mg_str(":scheme")) == 0) {
+        has_scheme = true;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    for (i = 0; i < k.len; i++) {  // Names are lowercase tokens
+      if (k.buf[i] <= ' ' || k.buf[i] >= 127 || k.buf[i] == ':' ||
+          (k.buf[i] >= 'A' && k.buf[i] <= 'Z')) {
+        return false;
+      }
+    }
+    regular = true;
+    if (mg_strcmp(k, mg_str("host")) == 0) has_host = true;
+    if (mg_strcmp(k, mg_str("cookie")) == 0) cookies++;
+    if (mg_strcmp(k, mg_str("priority")) == 0) h2_prio(s, v);
+    if (mg_strcmp(k, mg_str("content-length")) == 0) {
+      if (s->req_len || !mg_to_size_t(v, &s->req_left)) return false;
+      s->req_len = true;
+    }
+  }
+  if (method.len == 0 || path.len == 0 || !has_scheme) return false;
+  if (end && s->req_len && s->req_left > 0) return false;
+  s->is_head = mg_strcmp(method, mg_str("HEAD")) == 0;
+  s->req_chunked = !end && !s->req_len;
+  mg_xprintf(mg_pfn_iobuf, io, "%.*s %.*s HTTP/2.0\r\n", (int) method.len,
+             method.buf, (int) path.len, path.buf);
+  if (auth.len > 0 && !has_host) {
+    mg_xprintf(mg_pfn_iobuf, io, "Host: %.*s\r\n", (int) auth.len, auth.buf);
+  }
+  if (s->req_chunked) {
+    mg_xprintf(mg_pfn_iobuf, io, "Transfer-Encoding: chunked\r\n");
+  }
+  for (i = 0; i < 2; i++) {  // Host and Content-Length first, then the rest
+    for (ofs = 0; h2_next(hdrs, &ofs, &k, &v);) {
+      bool first = mg_strcmp(k, mg_str("host")) == 0 ||
+                   mg_strcmp(k, mg_str("content-length")) == 0;
+      if (k.buf[0] == ':' || first != (i == 0) || h2_is_hop(k)) continue;
+      if (mg_strcmp(k, mg_str("cookie")) == 0 && cookies > 1) continue;
+      mg_xprintf(mg_pfn_iobuf, io, "%.*s: %.*s\r\n", (int) k.len, k.buf,
+                 (int) v.len, v.buf);
+    }
+  }
+  if (cookies > 1) {  // Cookies may come split, join them, RFC 9113 8.2.3
+    const char *sep = "cookie: ";
+    for (ofs = 0; h2_next(hdrs, &ofs, &k, &v);) {
+      if (mg_strcmp(k, mg_str("cookie")) != 0) continue;
+      mg_xprintf(mg_pfn_iobuf, io, "%s%.*s", sep, (int) v.len, v.buf);
+      sep = "; ";
+    }
+    mg_xprintf(mg_pfn_iobuf, io, "\r\n");
+  }
+  mg_xprintf(mg_pfn_iobuf, io, "\r\n");
+  return true;
+}
+
+// A complete header block: a new request, or trailers. Return a connection
+// error code, 0 if none
+static uint32_t h2_block(struct mg_connection *c, struct h2_conn *h) {
+  struct mg_iobuf hdrs = {0, 0, 0, 256, 0};
+  struct h2_stream *s = h2_find(h, h->block_id);
+  uint32_t id = h->block_id, err = 0;
+  bool end = (h->block_flags & H2_END_STREAM) != 0;
+  h->block_id = 0;
+  if (!hp_decode(h, h->block.buf, h->block.len, &hdrs)) {
+    err = H2_COMPRESSION_ERROR;
+  } else if (s != NULL) {  // Trailers, which we do not relay
+    if (!end || s->req_done || (s->req_len && s->req_left > 0)) {
+      h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+    } else {
+      h2_relay(s, NULL, 0, true);
+    }
+  } else if ((id & 1) == 0) {
+    err = H2_PROTOCOL_ERROR;  // Not a client stream
+  } else if (id <= h->last_id || h->is_goaway) {
+    // A stream we have closed, or we are shutting down: ignore
+  } else if (h->nstreams >= MG_HTTP2_MAX_STREAMS ||
+             (s = h2_open(c, h, id)) == NULL) {
+    h->last_id = id;
+    h2_frame32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+  } else {
+    h->last_id = id;
+    if (!h2_request(s, &hdrs, end)) {
+      h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+    } else {
+      if (h->block_weight > 0) h2_weight(s, h->block_weight);
+      h2_relay(s, NULL, 0, end);
+    }
+  }
+  mg_iobuf_free(&hdrs);
+  mg_iobuf_free(&h->block);
+  return err;
+}
+
+// Strip padding. Return false if malformed
+static bool h2_unpad(uint8_t flags, const uint8_t **p, size_t *len) {
+  if (flags & H2_PADDED) {
+    size_t pad = *len > 0 ? **p : 0;
+    if (*len == 0 || pad >= *len) return false;
+    *p += 1, *len -= pad + 1;
+  }
+  return true;
+}
+
+static uint32_t h2_settings(struct mg_connection *c, struct h2_conn *h,
+                            const uint8_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i + 6 <= len; i += 6) {
+    uint16_t k = MG_LOAD_BE16(p + i);
+    uint32_t v = MG_LOAD_BE32(p + i + 2);
+    if (k == 2 && v > 1) return H2_PROTOCOL_ERROR;  // SETTINGS_ENABLE_PUSH
+    if (k == 4) {  // SETTINGS_INITIAL_WINDOW_SIZE, applies to open streams
+      struct h2_stream *s;
+      if (v > 0x7fffffff) return H2_FLOW_CONTROL_ERROR;
+      for (s = h->streams; s != NULL; s = s->next) s->swin += v - h->init_win;
+      h->init_win = v;
+    }
+    if (k == 5 && (v < H2_FRAME_MAX || v > 0xffffff)) {
+      return H2_PROTOCOL_ERROR;  // SETTINGS_MAX_FRAME_SIZE
+    }
+  }
+  h2_frame(c, H2_SETTINGS, H2_END_STREAM, 0, NULL, 0);  // ACK
+  return 0;
+}
+
+static uint32_t h2_window(struct mg_connection *c, struct h2_conn *h,
+                          struct h2_stream *s, uint32_t id, uint32_t inc) {
+  inc &= 0x7fffffff;
+  if (id == 0) {
+    if (inc == 0) return H2_PROTOCOL_ERROR;
+    if ((h->swin += inc) > 0x7fffffff) return H2_FLOW_CONTROL_ERROR;
+  } else if (s != NULL && inc == 0) {
+    h2_reset(c, h, s, H2_PROTOCOL_ERROR);
+  } else if (s != NULL && (s->swin += inc) > 0x7fffffff) {
+    h2_reset(c, h, s, H2_FLOW_CONTROL_ERROR);
+  }
+  return 0;
+}
+
+static uint32_t h2_data(struct mg_connection *c, struct h2_conn *h,
+                        struct h2_stream *s, uint8_t flags, const uint8_t *p,
+                        size_t len) {
+  bool end = (flags & H2_END_STREAM) != 0;
+  size_t n = len;
+  if (len > h->rwin) return H2_FLOW_CONTROL_ERROR;
+  if ((h->rwin -= len) < H2_WINDOW / 2) {  // Credit the connection right away
+    h2_frame32(c, H2_WINDOW_UPDATE, 0, (uint32_t) (H2_WINDOW - h->rwin));
+    h->rwin = H2_WINDOW;
+  }
+  if (!h2_unpad(flags, &p, &n)) return H2_PROTOCOL_ERROR;
+  if (s == NULL || s->req_done) {
+    // We have closed it, or the request is complete: ignore
+  } else if (len > s->rwin) {
+    h2_reset(c, h, s, H2_FLOW_CONTROL_ERROR);
+  } else if (s->req_len && (n > s->req_left || (end && n < s->req_left))) {
+    h2_reset(c, h, s, H2_PROTOCOL_ERROR);  // Does not match Content-Length
+  } else {
+    s->rwin -= len;
+    if (s->req_len) s->req_left -= n;
+    h2_relay(s, p, n, end);
+  }
+  return 0;
+}
+
+// Handle a frame. Return a connection error code, 0 if none
+static uint32_t h2_frame_in(struct mg_connection *c, struct h2_conn *h,
+                            uint8_t type, uint8_t flags, uint32_t id,
+                            const uint8_t *p, size_t len) {
+  struct h2_stream *s = id == 0 ? NULL : h2_find(h, id);
+  MG_VERBOSE(("%lu type %d flags %x id %lu len %lu", c->id, type, flags,
+              (unsigned long) id, (unsigned long) len));
+  if (h->block_id != 0 && (type != H2_CONTINUATION || id != h->block_id)) {
+    return H2_PROTOCOL_ERROR;  // Header blocks must not be interleaved
+  }
+  if (type == H2_DATA) {
+    if (id == 0 || id > h->last_id) return H2_PROTOCOL_ERROR;
+    return h2_data(c, h, s, flags, p, len);
+  } else if (type == H2_HEADERS || type == H2_CONTINUATION) {
+    if (id == 0 || (type == H2_CONTINUATION && h->block_id == 0)) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (type == H2_HEADERS) {
+      if (!h2_unpad(flags, &p, &len)) return H2_PROTOCOL_ERROR;
+      h->block_flags = flags, h->block_weight = 0;
+      if (flags & H2_PRIO) {  // Dependency and weight
+        if (len < 5) return H2_PROTOCOL_ERROR;
+        h->block_weight = p[4] + 1U, p += 5, len -= 5;
+      }
+    }
+    if (h->block.len + len > H2_BLOCK_MAX) return H2_ENHANCE_YOUR_CALM;
+    if (mg_iobuf_add(&h->block, h->block.len, p, len) < len) {
+      return H2_INTERNAL_ERROR;
+    }
+    h->block_id = id;
+    if (flags & H2_END_HEADERS) return h2_block(c, h);
+  } else if (type == H2_PRIORITY) {
+    if (id == 0) return H2_PROTOCOL_ERROR;
+    if (len != 5) return H2_FRAME_SIZE_ERROR;
+    if (s != NULL) h2_weight(s, p[4] + 1U);
+  } else if (type == H2_RST_STREAM) {
+    if (id == 0 || id > h->last_id) return H2_PROTOCOL_ERROR;
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    if (s != NULL) h2_close(h, s);
+  } else if (type == H2_SETTINGS) {
+    if (id != 0) return H2_PROTOCOL_ERROR;
+    if (len % 6 != 0 || ((flags & H2_END_STREAM) && len != 0)) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if ((flags & H2_END_STREAM) == 0) return h2_settings(c, h, p, len);
+  } else if (type == H2_PING) {
+    if (id != 0) return H2_PROTOCOL_ERROR;
+    if (len != 8) return H2_FRAME_SIZE_ERROR;
+    if ((flags & H2_END_STREAM) == 0) h2_frame(c, H2_PING, 1, 0, p, len);
+  } else if (type == H2_GOAWAY) {
+    h->is_goaway = true;  // Finish open streams, then close
+  } else if (type == H2_WINDOW_UPDATE) {
+    if (len != 4) return H2_FRAME_SIZE_ERROR;
+    return h2_window(c, h, s, id, MG_LOAD_BE32(p));
+  } else if (type == H2_PUSH_PROMISE) {
+    return H2_PROTOCOL_ERROR;  // Clients must not push
+  }
+  return 0;  // Unknown frame types are ignored
+}
+
+// Convert the HTTP/1 response head, if there is one, to a HEADERS frame
+static bool h2_resp_head(struct mg_connection *c, struct h2_stream *s) {
+  struct mg_iobuf *io = &s->c->send, hdrs = {0, 0, 0, 256, 0};
+  int n = mg_http_get_request_len(io->buf, io->len);
+  const char *p = (char *) io->buf, *end = p + (n > 0 ? n : 0);
+  struct mg_str st = {0, 0};
+  size_t i, ofs, cl = 0;
+  uint8_t flags = 0;
+  bool has_cl = false, chunked = false;
+  if (n <= 0) return false;
+  while (p < end && *p != ' ') p++;  // Status line: "HTTP/1.1 200 OK"
+  while (p < end && *p == ' ') p++;
+  st.buf = (char *) p;
+  while (p < end && *p >= '0' && *p <= '9') p++, st.len++;
+  while (p < end && *p != '\n') p++;
+  for (i = 8; i <= 14; i++) {
+    if (mg_strcmp(st, mg_str(s_h2_static[i - 1][1])) == 0) break;
+  }
+  if (i <= 14) {
+    hp_put_int(&hdrs, 0x80, 7, i);
+  } else {
+    hp_put_int(&hdrs, 0, 4, 8);
+    hp_put_str(&hdrs, st, false);
+  }
+  for (p++; p < end;) {  // Header lines
+    struct mg_str k, v;
+    const char *eol = p;
+    while (eol < end && *eol != '\n') eol++;
+    k = mg_str_n(p, (size_t) (eol - p));
+    p = eol + 1;
+    if (k.len > 0 && k.buf[k.len - 1] == '\r') k.len--;
+    if (!mg_span(k, &k, &v, ':')) continue;
+    while (v.len > 0 && (v.buf[0] == ' ' || v.buf[0] == '\t')) v.buf++, v.len--;
+    while (v.len > 0 && (v.buf[v.len - 1] == ' ' || v.buf[v.len - 1] == '\t'))
+      v.len--;
+    if (mg_strcasecmp(k, mg_str("content-length")) == 0) {
+      has_cl = mg_to_size_t(v, &cl);
+    } else if (mg_strcasecmp(k, mg_str("transfer-encoding")) == 0) {
+      chunked = mg_strcasecmp(v, mg_str("chunked")) == 0;
+    }
+    if (!h2_is_hop(k)) hp_put(&hdrs, k, v);
+  }
+  mg_iobuf_del(io, 0, (size_t) n);
+  if (st.len == 3 && st.buf[0] == '1') {
+    // Interim response, the final one follows
+  } else if (s->is_head || mg_strcmp(st, mg_str("204")) == 0 ||
+             mg_strcmp(st, mg_str("304")) == 0 || (has_cl && cl == 0)) {
+    flags = H2_END_STREAM, s->state = H2_RESP_DONE;
+  } else if (has_cl) {
+    s->state = H2_RESP_LEN, s->left = cl;
+  } else {
+    s->state = chunked ? H2_RESP_CHUNKED : H2_RESP_CLOSE, s->left = 0;
+  }
+  for (ofs = 0; ofs == 0 || ofs < hdrs.len; ofs += H2_FRAME_MAX) {
+    size_t len = hdrs.len - ofs > H2_FRAME_MAX ? H2_FRAME_MAX : hdrs.len - ofs;
+    uint8_t f = ofs + len >= hdrs.len ? H2_END_HEADERS : 0;
+    h2_frame(c, ofs == 0 ? H2_HEADERS : H2_CONTINUATION,
+             (uint8_t) (f | (ofs == 0 ? flags : 0)), s->id, hdrs.buf + ofs,
+             len);
+  }
+  mg_iobuf_free(&hdrs);
+  return true;
+}
+
+// Take a chunk header, or the CRLF after chunk data, off the response.
+// Return false if more data is needed
+static bool h2_resp_chunk(struct h2_stream *s, bool *end) {
+  struct mg_iobuf *io = &s->c->send;
+  size_t i = 0, size = 0;
+  if (s->crlf) {
+    if (io->len < 2) return false;
+    mg_iobuf_del(io, 0, 2);
+    s->crlf = false;
+  }
+  if (s->left > 0) return true;
+  while (i < io->len && io->buf[i] != '\n') i++;  // Chunk header: "size\r\n"
+  if (i >= io->len) return false;
+  for (i = 0; i < io->len; i++) {
+    int ch = io->buf[i], d = ch >= '0' && ch <= '9'   ? ch - '0'
+                             : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                             : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+                                                      : -1;
+    if (d < 0) break;
+    size = size * 16 + (size_t) d;
+  }
+  while (io->buf[i] != '\n') i++;
+  if (size == 0) {  // Last chunk, then an empty line. We send no trailers
+    if (io->len < i + 3) return false;
+    i += 2, *end = true;
+  }
+  mg_iobuf_del(io, 0, i + 1);
+  s->left = size;
+  return true;
+}
+
+// Send a DATA frame of the response. Return false if there is nothing to
+// send now
+static bool h2_resp_body(struct mg_connection *c, struct h2_conn *h,
+                         struct h2_stream *s) {
+  struct mg_iobuf *io = &s->c->send;
+  size_t n = io->len;
+  bool end = false;
+  if (s->state == H2_RESP_CHUNKED && !h2_resp_chunk(s, &end)) return false;
+  if (s->state == H2_RESP_CLOSE) {
+    end = n == 0 && (s->c->is_draining || s->c->is_closing);
+  } else if (n > s->left) {
+    n = s->left;
+  }
+  if (n > H2_FRAME_MAX) n = H2_FRAME_MAX;
+  if ((int64_t) n > h->swin) n = h->swin > 0 ? (size_t) h->swin : 0;
+  if ((int64_t) n > s->swin) n = s->swin > 0 ? (size_t) s->swin : 0;
+  if (s->state == H2_RESP_LEN) end = n == s->left;
+  if (n == 0 && !end) return false;
+  h2_frame(c, H2_DATA, end ? H2_END_STREAM : 0, s->id, io->buf, n);
+  mg_iobuf_del(io, 0, n);
+  h->swin -= (int64_t) n, s->swin -= (int64_t) n;
+  if (s->state != H2_RESP_CLOSE) s->left -= n;
+  if (s->state == H2_RESP_CHUNKED && s->left == 0 && n > 0) s->crlf = true;
+  if (end) s->state = H2_RESP_DONE;
+  s->stamp = ++h->stamp;
+  return true;
+}
+
+// Which stream sends first: higher urgency, then, for the same urgency,
+// non-incremental streams one by one, then incremental ones in turn
+static bool h2_before(const struct h2_stream *a, const struct h2_stream *b) {
+  if (a->urgency != b->urgency) return a->urgency < b->urgency;
+  if (a->incremental != b->incremental) return !a->incremental;
+  return a->incremental ? a->stamp < b->stamp : a->id < b->id;
+}
+
+// Move responses from stream connections to the connection
+static void h2_pump(struct mg_connection *c, struct h2_conn *h) {
+  struct h2_stream *s, *next;
+  for (s = h->streams; s != NULL; s = s->next) {
+    size_t used = H2_WINDOW - s->rwin;
+    while (s->state == H2_RESP_HEAD && h2_resp_head(c, s)) continue;
+    if (s->state == H2_RESP_DONE) s->c->send.len = 0;  // E.g. body of HEAD
+    s->is_blocked = s->state == H2_RESP_HEAD || s->state == H2_RESP_DONE;
+    if (s->req_done || s->c->is_full || used < H2_WINDOW / 2) continue;
+    if (s->c->recv.len + H2_WINDOW <= MG_MAX_RECV_SIZE) {  // Credit stream
+      h2_frame32(c, H2_WINDOW_UPDATE, s->id, (uint32_t) used);
+      s->rwin = H2_WINDOW;
+    } else if (s->rwin == 0) {
+      mg_error(s->c, "MG_MAX_RECV_SIZE");
+    }
+  }
+  while (c->send.len < H2_FRAME_MAX) {  // Send DATA, by priority
+    struct h2_stream *best = NULL;
+    for (s = h->streams; s != NULL; s = s->next) {
+      if (!s->is_blocked && (best == NULL || h2_before(s, best))) best = s;
+    }
+    if (best == NULL) break;
+    if (!h2_resp_body(c, h, best)) best->is_blocked = true;
+  }
+  for (s = h->streams; s != NULL; s = next) {
+    next = s->next;
+    if (s->state == H2_RESP_DONE) {
+      // Response is complete. If the request is not, tell to stop sending
+      if (!s->req_done) h2_frame32(c, H2_RST_STREAM, s->id, H2_NO_ERROR);
+      h2_close(h, s);
+    } else if (s->c->is_closing ||
+               (s->c->is_draining && s->c->send.len == 0 &&
+                s->state != H2_RESP_CLOSE)) {
+      h2_reset(c, h, s, H2_INTERNAL_ERROR);  // Gave up on the response
+    }
+  }
+  if (h->nstreams > 0) c->is_polled = 1;
+  if (h->is_goaway && h->nstreams == 0) c->is_draining = 1;
+}
+
+static void h2_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct h2_conn *h = (struct h2_conn *) c->pfn_data;
+  if (ev == MG_EV_READ) {
+    size_t ofs = 0;
+    uint32_t err;
+    while (!c->is_draining && c->recv.len - ofs >= 9) {
+      const uint8_t *p = c->recv.buf + ofs;
+      size_t len = MG_LOAD_BE24(p);
+      if (len > H2_FRAME_MAX) h2_goaway(c, h, H2_FRAME_SIZE_ERROR);
+      if (c->is_draining || c->recv.len - ofs < 9 + len) break;
+      err = h2_frame_in(c, h, p[3], p[4], MG_LOAD_BE32(p + 5) & 0x7fffffff,
+                        p + 9, len);
+      if (err != 0) h2_goaway(c, h, err);
+      ofs += 9 + len;
+    }
+    mg_iobuf_del(&c->recv, 0, c->is_draining ? c->recv.len : ofs);
+    h2_pump(c, h);
+  } else if (ev == MG_EV_POLL || ev == MG_EV_WRITE) {
+    // Stream connections get polled: that is how files are served
+    uint64_t now = ev == MG_EV_POLL ? *(uint64_t *) ev_data : mg_millis();
+    struct h2_stream *s;
+    for (s = h->streams; s != NULL; s = s->next) {
+      mg_call(s->c, MG_EV_POLL, &now);
+    }
+    h2_pump(c, h);
+  } else if (ev == MG_EV_CLOSE) {
+    while (h->streams != NULL) h2_close(h, h->streams);
+    mg_iobuf_free(&h->block);
+    mg_iobuf_free(&h->table);
+    mg_free(h);
+    c->pfn_data = NULL;
+  }
+}
+
+// Switch an accepted HTTP connection to HTTP/2, if it has got the client
+// preface. Return true if it has, or may have: then the HTTP/1 handler waits
+bool mg_http2_accept(struct mg_connection *c) {
+  size_t n = c->recv.len < 24 ? c->recv.len : 24;
+  uint8_t settings[12] = {0, 3, 0, 0, 0, 0,   // SETTINGS_MAX_CONCURRENT_STREAMS
+                          0, 6, 0, 0, 0, 0};  // SETTINGS_MAX_HEADER_LIST_SIZE
+  struct h2_conn *h;
+  if (n == 0 || memcmp(c->recv.buf, H2_PREFACE, n) != 0) return false;
+  if (n < 24) return true;
+  if ((h = (struct h2_conn *) mg_calloc(1, sizeof(*h))) == NULL) {
+    mg_error(c, "OOM");
+    return true;
+  }
+  h->pfn = c->pfn;
+  h->swin = h->init_win = H2_WINDOW;
+  h->rwin = H2_WINDOW;
+  h->table_max = H2_TABLE_MAX;
+  h->table.align = h->block.align = 256;
+  c->pfn = h2_cb, c->pfn_data = h;
+  MG_STORE_BE32(settings + 2, MG_HTTP2_MAX_STREAMS);
+  MG_STORE_BE32(settings + 8, H2_LIST_MAX);
+  h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  mg_iobuf_del(&c->recv, 0, 24);
+  MG_DEBUG(("%lu HTTP/2", c->id));
+  h2_cb(c, MG_EV_READ, NULL);
+  return true;
+}
+#endif
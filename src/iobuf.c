@@ -9,23 +9,39 @@ static size_t roundup(size_t size, size_t align) {
 
 bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   bool ok = true;
+  unsigned char *base = io->buf == NULL ? NULL : io->buf - io->head;
   new_size = roundup(new_size, io->align);
   if (new_size == 0) {
-    mg_bzero(io->buf, io->size);
-    mg_free(io->buf);
+    mg_bzero(base, io->size + io->head);
+    mg_free(base);
     io->buf = NULL;
-    io->len = io->size = 0;
+    io->len = io->size = io->head = 0;
+#if MG_IO_REALLOC && !MG_ENABLE_CUSTOM_CALLOC
+  } else if (new_size != io->size && io->head == 0 && io->buf != NULL) {
+    // Opted out of zeroing: realloc() may grow the buffer in place
+    unsigned char *p = (unsigned char *) realloc(io->buf, new_size);
+    if (p != NULL) {
+      if (new_size > io->size) memset(p + io->size, 0, new_size - io->size);
+      if (io->len > new_size) io->len = new_size;
+      io->buf = p;
+      io->size = new_size;
+    } else {
+      ok = false;
+      MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
+    }
+#endif
   } else if (new_size != io->size) {
     // NOTE(lsm): do not use realloc here. Use mg_calloc/mg_free only
     void *p = mg_calloc(1, new_size);
     if (p != NULL) {
       size_t len = new_size < io->len ? new_size : io->len;
       if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
-      mg_bzero(io->buf, io->size);
-      mg_free(io->buf);
+      mg_bzero(base, io->size + io->head);
+      mg_free(base);
       io->buf = (unsigned char *) p;
       io->size = new_size;
       io->len = len;
+      io->head = 0;
     } else {
       ok = false;
       MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
@@ -37,19 +53,25 @@ bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
 bool mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
   io->buf = NULL;
   io->align = align;
-  io->size = io->len = 0;
+  io->size = io->len = io->head = 0;
   return mg_iobuf_resize(io, size);
 }
 
+bool mg_iobuf_reserve(struct mg_iobuf *io, size_t len) {
+  size_t step = io->size, max = MG_IO_GROW_MAX;
+  if (io->len + len <= io->size) return true;
+  if (step > max) step = max;
+  if (step < io->len + len - io->size) step = io->len + len - io->size;
+  return mg_iobuf_resize(io, io->size + step);
+}
+
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
                     size_t len) {
-  size_t new_size = roundup(io->len + len, io->align);
-  mg_iobuf_resize(io, new_size);      // Attempt to resize
-  if (new_size != io->size) len = 0;  // Resize failure, append nothing
+  size_t gap = ofs > io->len ? ofs - io->len : 0;
+  if (!mg_iobuf_reserve(io, gap + len)) return 0;  // OOM, append nothing
   if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
-  if (buf != NULL) memmove(io->buf + ofs, buf, len);
-  if (ofs > io->len) io->len += ofs - io->len;
-  io->len += len;
+  if (buf != NULL && len > 0) memmove(io->buf + ofs, buf, len);
+  io->len += gap + len;
   return len;
 }
 
@@ -59,6 +81,22 @@ size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
   if (io->buf) memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
   if (io->buf) mg_bzero(io->buf + io->len - len, len);
   io->len -= len;
+  if (io->len == 0 && io->head > 0) {  // Empty: rewind to the allocation start
+    io->buf -= io->head, io->size += io->head, io->head = 0;
+  }
+  return len;
+}
+
+size_t mg_iobuf_skip(struct mg_iobuf *io, size_t len) {
+  if (len >= io->len || io->buf == NULL) return mg_iobuf_del(io, 0, len);
+  mg_bzero(io->buf, len);
+  io->buf += len, io->size -= len, io->head += len, io->len -= len;
+  if (io->head > io->size) {  // Over half the allocation is dead: compact
+    unsigned char *base = io->buf - io->head;
+    memmove(base, io->buf, io->len);  // Moves fewer bytes than were skipped
+    mg_bzero(base + io->len, io->head);
+    io->buf = base, io->size += io->head, io->head = 0;
+  }
   return len;
 }
 
@@ -8,6 +8,7 @@ struct mg_iobuf {
   size_t size;         // Allocated capacity (rounded up to align)
   size_t len;          // Number of bytes currently stored
   size_t align;        // Allocation granularity; capacity is always a multiple of this
+  size_t head;         // Bytes deleted from the front; allocation is at buf - head
 };
 
 // Initializes io to empty, then allocates size bytes with the given alignment.
@@ -15,13 +16,19 @@ struct mg_iobuf {
 bool mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align);
 
 // Resizes the buffer to new_size (rounded up to io->align). new_size=0 frees
-// the buffer. Uses mg_calloc+mg_free (not realloc) so old memory is zeroed on release.
+// the buffer. Uses mg_calloc+mg_free (not realloc) so old memory is zeroed on release,
+// unless built with MG_IO_REALLOC=1.
 // Returns false on allocation failure.
 bool mg_iobuf_resize(struct mg_iobuf *io, size_t new_size);
 
 // Frees the buffer and zeroes the struct. Equivalent to mg_iobuf_resize(io, 0).
 void mg_iobuf_free(struct mg_iobuf *io);
 
+// Makes room for len more bytes. The buffer doubles, but grows by no more than
+// MG_IO_GROW_MAX at a time unless len needs more, so appending in small pieces
+// is not quadratic. Returns false on allocation failure.
+bool mg_iobuf_reserve(struct mg_iobuf *io, size_t len);
+
 // Inserts len bytes from buf at offset ofs, shifting existing data right.
 // Pass buf=NULL to reserve space without writing. Returns bytes inserted, 0 on OOM.
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf, size_t len);
@@ -29,3 +36,10 @@ size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf, size_t len
 // Removes len bytes at ofs, shifting remaining data left. Clamps to available data.
 // Returns bytes actually removed.
 size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len);
+
+// Removes len bytes from the front without moving the rest: buf moves forward
+// instead, and io->head grows. Consuming a large buffer in small pieces, like
+// sent data, is then linear rather than quadratic. Once the skipped space
+// exceeds half of the allocation, the data is moved back to its start so that
+// a buffer which never fully drains keeps its capacity. Returns bytes removed.
+size_t mg_iobuf_skip(struct mg_iobuf *io, size_t len);
@@ -1,6 +1,7 @@
 #include "arch.h"
 #include "base64.h"
 #include "event.h"
+#include "fs.h"
 #include "log.h"
 #include "mqtt.h"
 #include "url.h"
@@ -68,10 +69,6 @@ static bool mg_send_u16(struct mg_connection *c, uint16_t value) {
   return mg_send(c, &value, sizeof(value));
 }
 
-static bool mg_send_u32(struct mg_connection *c, uint32_t value) {
-  return mg_send(c, &value, sizeof(value));
-}
-
 static uint8_t varint_size(size_t length) {
   uint8_t bytes_needed = 0;
   do {
@@ -150,49 +147,46 @@ static size_t get_props_size(struct mg_mqtt_prop *props, size_t count) {
   return size;
 }
 
-static bool mg_send_mqtt_properties(struct mg_connection *c,
-                                    struct mg_mqtt_prop *props, size_t nprops) {
-  size_t total_size = get_properties_length(props, nprops);
-  uint8_t buf_v[4] = {0, 0, 0, 0};
-  uint8_t buf[4] = {0, 0, 0, 0};
-  size_t i, len = encode_varint(buf, total_size);
-
-  if (!mg_send(c, buf, (size_t) len)) return false;
+// Writes properties, without their length, to buf. Returns the end
+static uint8_t *mqtt_props_encode(uint8_t *buf, struct mg_mqtt_prop *props,
+                                  size_t nprops) {
+  size_t i;
   for (i = 0; i < nprops; i++) {
-    if (!mg_send(c, &props[i].id, sizeof(props[i].id))) return false;
-    switch (mqtt_prop_type_by_id(props[i].id)) {
-      case MQTT_PROP_TYPE_STRING_PAIR:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].key.len)) ||
-            !mg_send(c, props[i].key.buf, props[i].key.len) ||
-            !mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_BYTE:
-        if (!mg_send(c, &props[i].iv, sizeof(uint8_t))) return false;
-        break;
-      case MQTT_PROP_TYPE_SHORT:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].iv))) return false;
-        break;
-      case MQTT_PROP_TYPE_INT:
-        if (!mg_send_u32(c, mg_htonl((uint32_t) props[i].iv))) return false;
-        break;
-      case MQTT_PROP_TYPE_STRING:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_BINARY_DATA:
-        if (!mg_send_u16(c, mg_htons((uint16_t) props[i].val.len)) ||
-            !mg_send(c, props[i].val.buf, props[i].val.len))
-          return false;
-        break;
-      case MQTT_PROP_TYPE_VARIABLE_INT:
-        len = encode_varint(buf_v, props[i].iv);
-        if (!mg_send(c, buf_v, (size_t) len)) return false;
-        break;
+    struct mg_mqtt_prop *p = &props[i];
+    int type = mqtt_prop_type_by_id(p->id);
+    if (type < 0) break;  // get_properties_length() stops there, too
+    *buf++ = p->id;
+    if (type == MQTT_PROP_TYPE_STRING_PAIR) {
+      *buf++ = (uint8_t) (p->key.len >> 8), *buf++ = (uint8_t) p->key.len;
+      if (p->key.len > 0) memcpy(buf, p->key.buf, p->key.len);
+      buf += p->key.len;
+    }
+    if (type == MQTT_PROP_TYPE_STRING_PAIR || type == MQTT_PROP_TYPE_STRING ||
+        type == MQTT_PROP_TYPE_BINARY_DATA) {
+      *buf++ = (uint8_t) (p->val.len >> 8), *buf++ = (uint8_t) p->val.len;
+      if (p->val.len > 0) memcpy(buf, p->val.buf, p->val.len);
+      buf += p->val.len;
+    } else if (type == MQTT_PROP_TYPE_VARIABLE_INT) {
+      buf += encode_varint(buf, p->iv);
+    } else if (type == MQTT_PROP_TYPE_INT) {
+      *buf++ = (uint8_t) (p->iv >> 24), *buf++ = (uint8_t) (p->iv >> 16);
+      *buf++ = (uint8_t) (p->iv >> 8), *buf++ = (uint8_t) p->iv;
+    } else if (type == MQTT_PROP_TYPE_SHORT) {
+      *buf++ = (uint8_t) (p->iv >> 8), *buf++ = (uint8_t) p->iv;
+    } else if (type == MQTT_PROP_TYPE_BYTE) {
+      *buf++ = (uint8_t) p->iv;
     }
   }
+  return buf;
+}
+
+static bool mg_send_mqtt_properties(struct mg_connection *c,
+                                    struct mg_mqtt_prop *props, size_t nprops) {
+  size_t ofs = c->send.len, len = get_properties_length(props, nprops);
+  uint8_t *p;
+  if (!mg_send(c, NULL, varint_size(len) + len)) return false;
+  p = c->send.buf + ofs;
+  mqtt_props_encode(p + encode_varint(p, len), props, nprops);
   return true;
 }
 
@@ -342,40 +336,374 @@ fail:
   mg_error(c, "OOM");
 }
 
-uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts) {
-  uint16_t id = opts->retransmit_id;
-  uint8_t flags = (uint8_t) (((opts->qos & 3) << 1) | (opts->retain ? 1 : 0));
-  size_t len = 2 + opts->topic.len + opts->message.len;
-  MG_DEBUG(("%lu [%.*s] <- [%.*s%c", c->id, (int) opts->topic.len,
-            (char *) opts->topic.buf,
-            (int) (opts->message.len <= 10 ? opts->message.len : 10),
-            (char *) opts->message.buf, opts->message.len <= 10 ? ']' : ' '));
-  if (opts->qos > 0) len += 2;
-  if (c->is_mqtt5) len += get_props_size(opts->props, opts->num_props);
-
-  if (opts->qos > 0 && id != 0) flags |= 1 << 3;
-  if (!mqtt_send_header(c, MQTT_CMD_PUBLISH, flags, (uint32_t) len) ||
-      !mg_send_u16(c, mg_htons((uint16_t) opts->topic.len)) ||
-      !mg_send(c, opts->topic.buf, opts->topic.len))
-    goto fail;
-  if (opts->qos > 0) {  // need to send 'id' field
-    if (id == 0) {      // generate new one if not resending
-      if (++c->mgr->mqtt_id == 0) ++c->mgr->mqtt_id;
-      id = c->mgr->mqtt_id;
+// Session: QoS 1/2 PUBLISHes we sent, in order, until they are acknowledged
+#define MQTT_SMSG_SENT 1  // In flight on the current connection
+#define MQTT_SMSG_DUP 2   // Sent before, resend with DUP
+#define MQTT_SMSG_REL 4   // PUBREC received, PUBREL sent
+
+struct mqtt_smsg {
+  struct mqtt_smsg *next;
+  uint64_t sent_ms;  // When it was last sent
+  size_t len;        // PUBLISH packet length, the packet follows
+  uint16_t id;
+  uint8_t flags;  // MQTT_SMSG_*
+};
+
+struct mqtt_client {  // Client connection state, in c->pfn_data
+  struct mg_mqtt_session *session;
+  uint16_t alias_max;  // Server's Topic Alias Maximum, capped
+  uint16_t num_aliases;
+  struct mg_str aliases[MG_MQTT_TOPIC_ALIASES];  // Topic of alias i + 1
+};
+
+static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data);
+
+static struct mqtt_client *mqtt_client(struct mg_connection *c) {
+  return c->is_client && c->pfn == mqtt_cb ? (struct mqtt_client *) c->pfn_data
+                                           : NULL;
+}
+
+static struct mg_mqtt_session *mqtt_session(struct mg_connection *c) {
+  struct mqtt_client *cl = mqtt_client(c);
+  return cl == NULL ? NULL : cl->session;
+}
+
+static void mqtt_client_free(struct mg_connection *c) {
+  struct mqtt_client *cl = mqtt_client(c);
+  size_t i;
+  if (cl == NULL) return;
+  for (i = 0; i < cl->num_aliases; i++) mg_free((void *) cl->aliases[i].buf);
+  mg_free(cl);
+  c->pfn_data = NULL;
+}
+
+// Returns the topic alias to use, or 0. Sets *known if the server knows it,
+// so that the topic can be omitted. Topics get aliases first come, first
+// served, until the server's limit
+static uint16_t mqtt_alias(struct mqtt_client *cl, struct mg_str topic,
+                           bool *known) {
+  uint16_t i;
+  *known = false;
+  if (cl == NULL || topic.len <= 3) return 0;  // Alias takes 3 bytes
+  for (i = 0; i < cl->num_aliases; i++) {
+    if (mg_strcmp(cl->aliases[i], topic) == 0) {
+      *known = true;
+      return (uint16_t) (i + 1);
     }
-    if (!mg_send_u16(c, mg_htons(id))) goto fail;
   }
+  if (cl->num_aliases >= cl->alias_max) return 0;
+  cl->aliases[i] = mg_strdup(topic);
+  if (cl->aliases[i].buf == NULL) return 0;
+  return ++cl->num_aliases;
+}
 
-  if (c->is_mqtt5 && !mg_send_mqtt_properties(c, opts->props, opts->num_props))
-    goto fail;
+static struct mqtt_smsg *mqtt_smsg(struct mg_mqtt_session *s, uint16_t id) {
+  struct mqtt_smsg *m = (struct mqtt_smsg *) s->head;
+  while (m != NULL && m->id != id) m = m->next;
+  return m;
+}
 
-  if (opts->message.len > 0 &&
-      !mg_send(c, opts->message.buf, opts->message.len))
-    goto fail;
-  return id;
+static void mqtt_count(struct mg_mqtt_session *s) {
+  struct mqtt_smsg *m;
+  s->num_inflight = s->num_queued = 0;
+  for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+    if (m->flags & MQTT_SMSG_SENT) {
+      s->num_inflight++;
+    } else {
+      s->num_queued++;
+    }
+  }
+}
 
-fail:
-  mg_error(c, "OOM");
+static void mqtt_resend(struct mg_connection *c, struct mqtt_smsg *m) {
+  uint8_t *pkt = (uint8_t *) (m + 1);
+  bool ok;
+  if (m->flags & MQTT_SMSG_REL) {
+    uint16_t id = mg_htons(m->id);
+    ok = mqtt_send_header(c, MQTT_CMD_PUBREL, 2, sizeof(id)) &&
+         mg_send(c, &id, sizeof(id));
+  } else {
+    size_t ofs = c->send.len;
+    ok = mg_send(c, pkt, m->len);
+    if (ok && (m->flags & MQTT_SMSG_DUP)) c->send.buf[ofs] |= 8;  // DUP
+  }
+  if (!ok) mg_error(c, "OOM");
+  m->flags |= MQTT_SMSG_SENT | MQTT_SMSG_DUP;
+  m->sent_ms = mg_millis();
+}
+
+// Sends queued messages while the in-flight window has room
+static void mqtt_pump(struct mg_mqtt_session *s) {
+  struct mqtt_smsg *m;
+  size_t window = s->receive_max > 0 ? s->receive_max : MG_MQTT_INFLIGHT;
+  if (s->server_max > 0 && s->server_max < window) window = s->server_max;
+  mqtt_count(s);
+  for (m = (struct mqtt_smsg *) s->head; s->online && m != NULL; m = m->next) {
+    if (m->flags & MQTT_SMSG_SENT) continue;
+    if (s->num_inflight >= window) break;
+    mqtt_resend(s->c, m);
+    s->num_inflight++, s->num_queued--;
+  }
+}
+
+// File: "MQS1", then for each message: ID, flags, length, PUBLISH packet
+static void mqtt_save(struct mg_mqtt_session *s) {
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  struct mqtt_smsg *m;
+  bool ok = mg_iobuf_add(&io, 0, "MQS1", 4) > 0;
+  for (m = (struct mqtt_smsg *) s->head; ok && m != NULL; m = m->next) {
+    uint8_t hdr[7];
+    hdr[0] = (uint8_t) (m->id >> 8), hdr[1] = (uint8_t) m->id;
+    hdr[2] = (uint8_t) (m->flags & MQTT_SMSG_REL);
+    hdr[3] = (uint8_t) (m->len >> 24), hdr[4] = (uint8_t) (m->len >> 16);
+    hdr[5] = (uint8_t) (m->len >> 8), hdr[6] = (uint8_t) m->len;
+    if ((m->flags & MQTT_SMSG_DUP) != 0) hdr[2] |= MQTT_SMSG_DUP;
+    ok = mg_iobuf_add(&io, io.len, hdr, sizeof(hdr)) > 0 &&
+         mg_iobuf_add(&io, io.len, m + 1, m->len) > 0;
+  }
+  if (ok) ok = mg_file_write(s->fs, s->path, io.buf, io.len);
+  if (!ok) MG_ERROR(("%s: cannot save MQTT session", s->path));
+  s->dirty = !ok, s->saved_ms = mg_millis();
+  mg_iobuf_free(&io);
+}
+
+// Appends a message of len bytes, copied from pkt unless it's NULL
+static struct mqtt_smsg *mqtt_add(struct mg_mqtt_session *s, const void *pkt,
+                                  size_t len, uint16_t id, uint8_t flags) {
+  struct mqtt_smsg *m = (struct mqtt_smsg *) mg_calloc(1, sizeof(*m) + len);
+  if (m == NULL) return NULL;
+  if (pkt != NULL) memcpy(m + 1, pkt, len);
+  m->len = len, m->id = id, m->flags = flags;
+  if (s->tail != NULL) {
+    ((struct mqtt_smsg *) s->tail)->next = m;
+  } else {
+    s->head = m;
+  }
+  s->tail = m;
+  s->dirty = s->fs != NULL;
+  return m;
+}
+
+static void mqtt_load(struct mg_mqtt_session *s) {
+  struct mg_str data = mg_file_read(s->fs, s->path);
+  const uint8_t *p = (uint8_t *) data.buf, *end = p + data.len;
+  if (data.len >= 4 && memcmp(p, "MQS1", 4) == 0) {
+    for (p += 4; end - p >= 7;) {
+      uint16_t id = (uint16_t) ((p[0] << 8) | p[1]);
+      size_t len = ((size_t) p[3] << 24) | ((size_t) p[4] << 16) |
+                   ((size_t) p[5] << 8) | p[6];
+      uint8_t flags = (uint8_t) (p[2] & (MQTT_SMSG_DUP | MQTT_SMSG_REL));
+      if ((size_t) (end - p - 7) < len || !mqtt_add(s, p + 7, len, id, flags))
+        break;
+      p += 7 + len;
+    }
+  }
+  mg_free((void *) data.buf);
+  s->loaded = true, s->dirty = false;
+  mqtt_count(s);
+  MG_DEBUG(("%s: %lu unacknowledged messages", s->path,
+            (unsigned long) s->num_queued));
+}
+
+void mg_mqtt_session_free(struct mg_mqtt_session *s) {
+  if (s->dirty) mqtt_save(s);
+  while (s->head != NULL) {
+    struct mqtt_smsg *m = (struct mqtt_smsg *) s->head;
+    s->head = m->next;
+    mg_free(m);
+  }
+  s->tail = NULL;
+  if (s->c != NULL && mqtt_client(s->c) != NULL) {
+    mqtt_client(s->c)->session = NULL;
+  }
+  s->c = NULL, s->online = s->loaded = s->dirty = false;
+  s->num_inflight = s->num_queued = 0;
+}
+
+// Tracks acknowledgements of our PUBLISHes
+static void mqtt_session_cmd(struct mg_mqtt_session *s,
+                             struct mg_mqtt_message *mm) {
+  struct mqtt_smsg *m = mqtt_smsg(s, mm->id), *prev = NULL, **p;
+  if (mm->cmd == MQTT_CMD_CONNACK && mm->ack == 0) {
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      m->flags &= (uint8_t) ~MQTT_SMSG_SENT;  // Resend all, 4.4
+    }
+    s->online = true;
+    mqtt_pump(s);
+  } else if (m == NULL) {
+    // Not ours
+  } else if (mm->cmd == MQTT_CMD_PUBREC) {
+    m->flags |= MQTT_SMSG_REL;  // mqtt_cb() sends PUBREL
+    s->dirty = s->fs != NULL;
+  } else if (mm->cmd == MQTT_CMD_PUBACK || mm->cmd == MQTT_CMD_PUBCOMP) {
+    for (p = (struct mqtt_smsg **) &s->head; *p != m; p = &(*p)->next) {
+      prev = *p;
+    }
+    *p = m->next;
+    if (s->tail == m) s->tail = prev;
+    mg_free(m);
+    s->dirty = s->fs != NULL;
+    mqtt_pump(s);
+  }
+}
+
+// Reads the server's limits from MQTT5 CONNACK properties
+static void mqtt_connack(struct mqtt_client *cl, struct mg_mqtt_message *mm) {
+  struct mg_mqtt_message tmp = *mm;
+  struct mg_mqtt_prop prop;
+  uint32_t n = 0;
+  size_t ofs = 0, len;
+  if (cl->session != NULL) cl->session->server_max = 0;
+  if (mm->dgram.len > 4 &&
+      (len = decode_varint((uint8_t *) mm->dgram.buf + 4, mm->dgram.len - 4,
+                           &n)) > 0 &&
+      4 + len + n <= mm->dgram.len) {
+    tmp.props_start = 4 + len, tmp.props_size = n;
+    while ((ofs = mg_mqtt_next_prop(&tmp, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_RECEIVE_MAXIMUM && cl->session != NULL) {
+        cl->session->server_max = (uint16_t) prop.iv;
+      } else if (prop.id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM) {
+        cl->alias_max = (uint16_t) (prop.iv < MG_MQTT_TOPIC_ALIASES
+                                        ? prop.iv
+                                        : MG_MQTT_TOPIC_ALIASES);
+      }
+    }
+  }
+}
+
+static void mqtt_session_ev(struct mg_mqtt_session *s, int ev) {
+  if (ev == MG_EV_POLL && s->online && s->retransmit_ms > 0 &&
+      !s->c->is_mqtt5) {  // MQTT5 resends only on reconnect, 4.4
+    uint64_t now = mg_millis();
+    struct mqtt_smsg *m;
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      if (!(m->flags & MQTT_SMSG_SENT)) break;
+      if (now - m->sent_ms >= s->retransmit_ms) mqtt_resend(s->c, m);
+    }
+  }
+  if (ev == MG_EV_CLOSE) {
+    struct mqtt_smsg *m;
+    for (m = (struct mqtt_smsg *) s->head; m != NULL; m = m->next) {
+      m->flags &= (uint8_t) ~MQTT_SMSG_SENT;
+    }
+    mqtt_count(s);
+    s->c = NULL, s->online = false;
+  }
+  // Changes are batched: the file is rewritten at most every MG_MQTT_SAVE_MS,
+  // and when the connection closes
+  if (s->dirty && (ev == MG_EV_CLOSE ||
+                   (ev == MG_EV_POLL &&
+                    mg_millis() - s->saved_ms >= MG_MQTT_SAVE_MS))) {
+    mqtt_save(s);
+  }
+}
+
+// Returns the longest PUBLISH that o can be encoded to
+static size_t mqtt_pub_max(bool v5, const struct mg_mqtt_opts *o) {
+  size_t n = 1 + 4 + 2 + o->topic.len + 2 + o->message.len;
+  if (v5) n += 4 + get_properties_length(o->props, o->num_props) + 3;
+  return n;
+}
+
+// Writes a PUBLISH to buf, with topic, which may be empty if alias is set.
+// Returns its length
+static size_t mqtt_pub_encode(uint8_t *buf, bool v5,
+                              const struct mg_mqtt_opts *o,
+                              struct mg_str topic, uint16_t alias,
+                              uint16_t id) {
+  uint8_t *p = buf, qos = (uint8_t) (o->qos & 3);
+  size_t plen = v5 ? get_properties_length(o->props, o->num_props) : 0,
+         n = 2 + topic.len + (qos > 0 ? 2U : 0U) + o->message.len;
+  if (alias > 0) plen += 3;
+  if (v5) n += varint_size(plen) + plen;
+  *p++ = (uint8_t) ((MQTT_CMD_PUBLISH << 4) | (qos << 1) |
+                    (qos > 0 && o->retransmit_id != 0 ? 8 : 0) |
+                    (o->retain ? 1 : 0));
+  p += encode_varint(p, n);
+  *p++ = (uint8_t) (topic.len >> 8), *p++ = (uint8_t) topic.len;
+  if (topic.len > 0) memcpy(p, topic.buf, topic.len);
+  p += topic.len;
+  if (qos > 0) *p++ = (uint8_t) (id >> 8), *p++ = (uint8_t) id;
+  if (v5) {
+    p += encode_varint(p, plen);
+    p = mqtt_props_encode(p, o->props, o->num_props);
+    if (alias > 0) {
+      *p++ = MQTT_PROP_TOPIC_ALIAS;
+      *p++ = (uint8_t) (alias >> 8), *p++ = (uint8_t) alias;
+    }
+  }
+  if (o->message.len > 0) memcpy(p, o->message.buf, o->message.len);
+  return (size_t) (p - buf) + o->message.len;
+}
+
+// Session keeps new QoS 1/2 messages, and sends them on its own
+static bool mqtt_kept(struct mg_mqtt_session *s, const struct mg_mqtt_opts *o) {
+  return s != NULL && (o->qos & 3) > 0 && o->retransmit_id == 0;
+}
+
+static bool mqtt_has_alias(const struct mg_mqtt_opts *o) {
+  size_t i;
+  for (i = 0; i < o->num_props; i++) {
+    if (o->props[i].id == MQTT_PROP_TOPIC_ALIAS) return true;
+  }
+  return false;
+}
+
+size_t mg_mqtt_pub_batch(struct mg_connection *c,
+                         const struct mg_mqtt_opts *opts, size_t n,
+                         uint16_t *ids) {
+  struct mqtt_client *cl = mqtt_client(c);
+  struct mg_mqtt_session *s = cl == NULL ? NULL : cl->session;
+  size_t i, total = 0, used = 0, ofs = c->send.len, done = 0;
+  bool v5 = c->is_mqtt5;
+  for (i = 0; i < n; i++) {
+    if (!mqtt_kept(s, &opts[i])) total += mqtt_pub_max(v5, &opts[i]);
+  }
+  if (total > 0 && !mg_send(c, NULL, total)) {  // Room for all, at once
+    mg_error(c, "OOM");
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    const struct mg_mqtt_opts *o = &opts[i];
+    uint16_t id = o->retransmit_id, alias = 0;
+    bool known = false;
+    MG_DEBUG(("%lu [%.*s] <- [%.*s%c", c->id, (int) o->topic.len,
+              (char *) o->topic.buf,
+              (int) (o->message.len <= 10 ? o->message.len : 10),
+              (char *) o->message.buf, o->message.len <= 10 ? ']' : ' '));
+    if ((o->qos & 3) > 0 && id == 0) {  // Generate a new one if not resending
+      do {
+        if (++c->mgr->mqtt_id == 0) ++c->mgr->mqtt_id;
+      } while (s != NULL && mqtt_smsg(s, c->mgr->mqtt_id) != NULL);
+      id = c->mgr->mqtt_id;
+    }
+    if (mqtt_kept(s, o)) {  // Full topic: may be resent on another connection
+      struct mqtt_smsg *m = s->num_queued >= MG_MQTT_QUEUE_MAX
+                                ? NULL
+                                : mqtt_add(s, NULL, mqtt_pub_max(v5, o), id, 0);
+      if (m == NULL) {
+        MG_ERROR(("%lu MQTT session full", c->id));
+        id = 0;
+      } else {
+        m->len = mqtt_pub_encode((uint8_t *) (m + 1), v5, o, o->topic, 0, id);
+        s->num_queued++, done++;
+      }
+    } else {
+      if (v5 && !mqtt_has_alias(o)) alias = mqtt_alias(cl, o->topic, &known);
+      used += mqtt_pub_encode(c->send.buf + ofs + used, v5, o,
+                              known ? mg_str_n("", 0) : o->topic, alias, id);
+      done++;
+    }
+    if (ids != NULL) ids[i] = id;
+  }
+  if (total > 0) c->send.len = ofs + used;
+  if (s != NULL) mqtt_pump(s);
+  return done;
+}
+
+uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts) {
+  uint16_t id = 0;
+  mg_mqtt_pub_batch(c, opts, 1, &id);
   return id;
 }
 
@@ -463,7 +791,7 @@ int mg_mqtt_parse(const uint8_t *buf, size_t len, uint8_t version,
         p += 2;
       }
       if (p > end) return MQTT_MALFORMED;
-      if (version == 5 && p + 2 < end) {
+      if (version == 5 && p < end) {
         len_len = (uint32_t) decode_varint(p, (size_t) (end - p), &tmp);
         if (!len_len) return MQTT_MALFORMED;
         m->props_size = (size_t) tmp;
@@ -481,6 +809,9 @@ int mg_mqtt_parse(const uint8_t *buf, size_t len, uint8_t version,
 }
 
 static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct mg_mqtt_session *s = mqtt_session(c);
+  if (s != NULL) mqtt_session_ev(s, ev);
+  if (ev == MG_EV_CLOSE) mqtt_client_free(c);
   if (ev == MG_EV_READ) {
     for (;;) {
       uint8_t version = c->is_mqtt5 ? 5 : 4;
@@ -493,6 +824,10 @@ static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data) {
       } else if (rc == MQTT_OK) {
         MG_VERBOSE(("%lu MQTT CMD %d len %d [%.*s]", c->id, mm.cmd,
                     (int) mm.dgram.len, (int) mm.data.len, mm.data.buf));
+        if (mm.cmd == MQTT_CMD_CONNACK && c->is_mqtt5 && mqtt_client(c)) {
+          mqtt_connack(mqtt_client(c), &mm);
+        }
+        if ((s = mqtt_session(c)) != NULL) mqtt_session_cmd(s, &mm);
         switch (mm.cmd) {
           case MQTT_CMD_CONNACK:
             mg_call(c, MG_EV_MQTT_OPEN, &mm.ack);
@@ -591,7 +926,23 @@ struct mg_connection *mg_mqtt_connect(struct mg_mgr *mgr, const char *url,
       mg_connect_svc(mgr, url, fn, fn_data, mqtt_cb, NULL);
   if (c != NULL) {
     struct mg_mqtt_opts empty;
+    struct mg_mqtt_session *s = opts == NULL ? NULL : opts->session;
+    struct mqtt_client *cl = NULL;
     memset(&empty, 0, sizeof(empty));
+    if ((s != NULL || (opts != NULL && opts->version == 5)) &&
+        (cl = (struct mqtt_client *) mg_calloc(1, sizeof(*cl))) == NULL) {
+      mg_error(c, "OOM");
+      return c;
+    }
+    c->pfn_data = cl;
+    if (s != NULL) {
+      if (!s->loaded && s->fs != NULL) mqtt_load(s);
+      if (s->c != NULL && mqtt_client(s->c) != NULL) {
+        mqtt_client(s->c)->session = NULL;
+      }
+      s->c = c, s->online = false, s->loaded = true;
+      cl->session = s, c->is_polled = 1;
+    }
     mg_mqtt_login(c, opts == NULL ? &empty : opts);
   }
   return c;
@@ -603,3 +954,977 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
   if (c != NULL) c->pfn = mqtt_cb, c->pfn_data = mgr;
   return c;
 }
+
+#if MG_ENABLE_MQTT_BROKER
+// Broker. Topic trie nodes are found by (parent, level) in one hash table,
+// so a lookup costs the same with 10 or 10000 siblings. A PUBLISH is encoded
+// once, and all receivers reference it with mg_send_ref()
+
+struct brk_hent {  // Hash table entry
+  struct brk_hent *next;
+  size_t hash;
+};
+
+struct brk_htab {
+  struct brk_hent **tab;
+  size_t size, len;
+};
+
+struct brk_msg {        // PUBLISH packet with QoS 0, no retain, for MQTT 3.1.1
+  size_t refs;          // Holders: retain, queues, in-flight slots, sends
+  size_t len;           // Packet length. The packet follows this struct
+  size_t tofs, pofs;    // Offsets of the topic length and of the payload
+  uint8_t qos;          // QoS it was published with
+};
+
+struct brk_node {
+  struct brk_hent h;                              // In nodes table
+  struct brk_node *parent, *child, *prev, *next;  // Trie, list of siblings
+  struct brk_sub *subs;                           // Filter's subscriptions
+  struct brk_msg *retained;                       // Topic's retained message
+  size_t len;                                     // Level length, level follows
+};
+
+struct brk_sub {
+  struct brk_sub *prev, *next;  // List of node->subs
+  struct brk_sub *snext;        // List of session->subs
+  struct brk_node *node;
+  struct brk_session *s;
+  uint8_t opts;  // Maximum QoS and MQTT5 options, as in SUBSCRIBE
+  bool fresh;    // Added by the SUBSCRIBE being handled
+};
+
+struct brk_slot {       // Outbound QoS 1/2 PUBLISH awaiting acknowledgement
+  struct brk_msg *msg;  // NULL if the slot is free
+  uint16_t id;
+  uint8_t qos;
+  bool retain;
+  bool released;  // QoS 2: PUBREC received, PUBREL sent
+};
+
+struct brk_queued {  // QoS 1/2 message waiting for a free slot
+  struct brk_queued *next;
+  struct brk_msg *msg;
+  uint8_t qos;
+  bool retain;
+};
+
+struct brk_session {
+  struct brk_hent h;            // In clients table, by client ID
+  struct mg_mqtt_broker *b;
+  struct mg_connection *c;      // NULL when offline
+  struct brk_sub *subs;
+  struct brk_queued *head, *tail;
+  size_t queued;
+  struct brk_slot out[MG_MQTT_INFLIGHT];
+  uint16_t in[MG_MQTT_INFLIGHT];  // Inbound QoS 2 IDs awaiting PUBREL
+  uint16_t next_id, max_out;      // Last packet ID, client's receive maximum
+  struct mg_str id;               // Client ID, set by CONNECT
+  struct brk_msg *will;
+  bool will_retain, connected, persistent;
+  uint32_t will_delay;    // MQTT5 Will Delay Interval, seconds
+  uint64_t will_at;       // Offline: when to send a delayed will
+  uint16_t keepalive;     // Seconds, 0 for none
+  uint32_t expiry;        // Session Expiry Interval, seconds, or BRK_NEVER
+  uint64_t seen, expire;  // Last packet time; offline session's end, or 0
+  struct brk_session *fnext;  // Fan-out: next receiver
+  unsigned long gen;          // Fan-out: publish this session is listed for
+  uint8_t fopts;              // Fan-out: highest QoS, Retain As Published
+};
+
+struct brk_priv {
+  struct brk_node root;
+  struct brk_htab nodes, clients;
+  unsigned long gen;
+  uint64_t sweep;  // Next time to look for expired sessions
+};
+
+#define BRK_NEVER 0xffffffffU  // Session Expiry Interval: never expires
+
+static size_t brk_hash(const void *parent, struct mg_str s) {
+  size_t i, h = (size_t) parent ^ 2166136261U;  // FNV-1a
+  for (i = 0; i < s.len; i++) h = (h ^ (uint8_t) s.buf[i]) * 16777619U;
+  return h;
+}
+
+static bool brk_hadd(struct brk_htab *t, struct brk_hent *e) {
+  if (t->len >= t->size) {  // Grow, or keep chaining if that fails
+    size_t i, size = t->size == 0 ? 64 : t->size * 2;
+    struct brk_hent **tab =
+        (struct brk_hent **) mg_calloc(size, sizeof(*tab));
+    if (tab == NULL && t->tab == NULL) return false;
+    for (i = 0; tab != NULL && i < t->size; i++) {
+      while (t->tab[i] != NULL) {
+        struct brk_hent *x = t->tab[i];
+        t->tab[i] = x->next;
+        x->next = tab[x->hash % size], tab[x->hash % size] = x;
+      }
+    }
+    if (tab != NULL) mg_free(t->tab), t->tab = tab, t->size = size;
+  }
+  e->next = t->tab[e->hash % t->size], t->tab[e->hash % t->size] = e;
+  t->len++;
+  return true;
+}
+
+static void brk_hdel(struct brk_htab *t, struct brk_hent *e) {
+  struct brk_hent **p = &t->tab[e->hash % t->size];
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  t->len--;
+}
+
+static struct brk_priv *brk_priv(struct mg_mqtt_broker *b) {
+  if (b->priv == NULL) b->priv = mg_calloc(1, sizeof(struct brk_priv));
+  return (struct brk_priv *) b->priv;
+}
+
+// Returns the child of n for a topic level, creates it if add is true
+static struct brk_node *brk_child(struct brk_priv *p, struct brk_node *n,
+                                  struct mg_str level, bool add) {
+  size_t hash = brk_hash(n, level);
+  struct brk_hent *e =
+      p->nodes.size == 0 ? NULL : p->nodes.tab[hash % p->nodes.size];
+  struct brk_node *c;
+  for (; e != NULL; e = e->next) {
+    c = (struct brk_node *) e;
+    if (e->hash == hash && c->parent == n && c->len == level.len &&
+        memcmp(c + 1, level.buf, level.len) == 0)
+      return c;
+  }
+  if (!add) return NULL;
+  if ((c = (struct brk_node *) mg_calloc(1, sizeof(*c) + level.len)) == NULL)
+    return NULL;
+  c->h.hash = hash, c->parent = n, c->len = level.len;
+  if (level.len > 0) memcpy(c + 1, level.buf, level.len);
+  if (!brk_hadd(&p->nodes, &c->h)) {
+    mg_free(c);
+    return NULL;
+  }
+  if ((c->next = n->child) != NULL) c->next->prev = c;
+  n->child = c;
+  return c;
+}
+
+// Returns the node of a topic or a filter, creates it if add is true
+static struct brk_node *brk_node(struct brk_priv *p, struct mg_str t,
+                                 bool add) {
+  struct brk_node *n = &p->root;
+  size_t i = 0, j;
+  for (;;) {
+    for (j = i; j < t.len && t.buf[j] != '/'; j++) (void) 0;
+    n = brk_child(p, n, mg_str_n(t.buf + i, j - i), add);
+    if (n == NULL || j >= t.len) return n;
+    i = j + 1;
+  }
+}
+
+// Frees n and its ancestors while they hold nothing
+static void brk_prune(struct brk_priv *p, struct brk_node *n) {
+  while (n != &p->root && n->subs == NULL && n->retained == NULL &&
+         n->child == NULL) {
+    struct brk_node *parent = n->parent;
+    if (n->prev != NULL) {
+      n->prev->next = n->next;
+    } else {
+      parent->child = n->next;
+    }
+    if (n->next != NULL) n->next->prev = n->prev;
+    brk_hdel(&p->nodes, &n->h);
+    mg_free(n);
+    n = parent;
+  }
+}
+
+// Topics can't have wildcards. In filters, + is a whole level, # the last one
+static bool brk_valid(struct mg_str t, bool filter) {
+  size_t i, levels = 1;
+  if (t.len == 0) return false;
+  for (i = 0; i < t.len; i++) {
+    char ch = t.buf[i];
+    if (ch == '/') {
+      levels++;
+    } else if (ch == '+' || ch == '#') {
+      if (!filter || (i > 0 && t.buf[i - 1] != '/')) return false;
+      if (ch == '+' && i + 1 < t.len && t.buf[i + 1] != '/') return false;
+      if (ch == '#' && i + 1 < t.len) return false;
+    } else if (ch == '\0') {
+      return false;
+    }
+  }
+  return levels <= MG_MQTT_MAX_LEVELS;
+}
+
+static struct brk_msg *brk_msg(struct mg_str topic, struct mg_str data,
+                               uint8_t qos) {
+  size_t n = 2 + topic.len + data.len, hlen = 1 + (size_t) varint_size(n);
+  struct brk_msg *m = (struct brk_msg *) mg_calloc(1, sizeof(*m) + hlen + n);
+  uint8_t *buf = (uint8_t *) (m + 1);
+  if (m == NULL) return NULL;
+  buf[0] = MQTT_CMD_PUBLISH << 4;
+  encode_varint(buf + 1, n);
+  buf[hlen] = (uint8_t) (topic.len >> 8), buf[hlen + 1] = (uint8_t) topic.len;
+  memcpy(buf + hlen + 2, topic.buf, topic.len);
+  if (data.len > 0) memcpy(buf + hlen + 2 + topic.len, data.buf, data.len);
+  m->refs = 1, m->len = hlen + n, m->qos = qos;
+  m->tofs = hlen, m->pofs = hlen + 2 + topic.len;
+  return m;
+}
+
+static void brk_unref(void *arg) {
+  struct brk_msg *m = (struct brk_msg *) arg;
+  if (m != NULL && --m->refs == 0) mg_free(m);
+}
+
+static struct mg_str brk_topic(struct brk_msg *m) {
+  return mg_str_n((char *) (m + 1) + m->tofs + 2, m->pofs - m->tofs - 2);
+}
+
+// Queues a PUBLISH of m: one shared copy for MQTT 3.1.1 QoS 0 receivers,
+// otherwise a header of our own and the shared payload
+static void brk_send(struct brk_session *s, struct brk_msg *m, uint8_t qos,
+                     uint16_t id, bool dup, bool retain) {
+  struct mg_connection *c = s->c;
+  const char *buf = (const char *) (m + 1);
+  size_t tlen = m->pofs - m->tofs, plen = m->len - m->pofs;
+  uint8_t flags = (uint8_t) ((dup ? 8 : 0) | (qos << 1) | (retain ? 1 : 0));
+  bool ok = true;
+  if (flags != 0 || c->is_mqtt5) {
+    uint16_t nid = mg_htons(id);
+    uint8_t zero = 0;
+    size_t len = tlen + plen + (qos > 0 ? 2U : 0U) + (c->is_mqtt5 ? 1U : 0U);
+    ok = mqtt_send_header(c, MQTT_CMD_PUBLISH, flags, (uint32_t) len) &&
+         mg_send(c, buf + m->tofs, tlen) &&
+         (qos == 0 || mg_send(c, &nid, sizeof(nid))) &&
+         (!c->is_mqtt5 || mg_send(c, &zero, sizeof(zero)));
+    buf += m->pofs;
+  } else {
+    plen = m->len;
+  }
+  if (ok && plen > 0) {
+    m->refs++;
+    if (!mg_send_ref(c, buf, plen, brk_unref, m)) m->refs--, ok = false;
+  }
+  if (!ok) mg_error(c, "OOM");
+}
+
+static struct brk_slot *brk_slot(struct brk_session *s, uint16_t id) {
+  size_t i;
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    if (s->out[i].msg != NULL && s->out[i].id == id) return &s->out[i];
+  }
+  return NULL;
+}
+
+// Sends m with QoS 1 or 2 if the client's receive window has room
+static bool brk_send_qos(struct brk_session *s, struct brk_msg *m,
+                         uint8_t qos, bool retain) {
+  struct brk_slot *slot = NULL;
+  size_t i, used = 0;
+  if (s->c == NULL || !s->connected) return false;
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    if (s->out[i].msg != NULL) {
+      used++;
+    } else if (slot == NULL) {
+      slot = &s->out[i];
+    }
+  }
+  if (slot == NULL || used >= s->max_out) return false;
+  do {
+    if (++s->next_id == 0) s->next_id = 1;
+  } while (brk_slot(s, s->next_id) != NULL);
+  slot->id = s->next_id, slot->qos = qos, slot->retain = retain;
+  slot->released = false, slot->msg = m, m->refs++;
+  brk_send(s, m, qos, slot->id, false, retain);
+  return true;
+}
+
+static void brk_deliver(struct brk_session *s, struct brk_msg *m, uint8_t qos,
+                        bool retain) {
+  struct brk_queued *q;
+  if (qos == 0) {  // Not kept for offline clients
+    if (s->c != NULL && s->connected) brk_send(s, m, 0, 0, false, retain);
+  } else if (s->head != NULL || !brk_send_qos(s, m, qos, retain)) {
+    if (s->queued >= MG_MQTT_QUEUE_MAX ||
+        (q = (struct brk_queued *) mg_calloc(1, sizeof(*q))) == NULL) {
+      MG_ERROR(("[%.*s] queue full, message dropped", (int) s->id.len,
+                s->id.buf));
+      return;
+    }
+    q->msg = m, q->qos = qos, q->retain = retain, m->refs++;
+    if (s->tail != NULL) {
+      s->tail->next = q;
+    } else {
+      s->head = q;
+    }
+    s->tail = q, s->queued++;
+  }
+}
+
+// Moves queued messages to free in-flight slots
+static void brk_pump(struct brk_session *s) {
+  struct brk_queued *q;
+  while ((q = s->head) != NULL && brk_send_qos(s, q->msg, q->qos, q->retain)) {
+    if ((s->head = q->next) == NULL) s->tail = NULL;
+    s->queued--;
+    brk_unref(q->msg);
+    mg_free(q);
+  }
+}
+
+// Lists sessions subscribed with node n's filter for the publish being
+// fanned out. Overlapping subscriptions get one copy, with the highest QoS
+static void brk_collect(struct brk_priv *p, struct brk_node *n,
+                        struct brk_session **list, struct brk_session *from) {
+  struct brk_sub *sub;
+  for (sub = n == NULL ? NULL : n->subs; sub != NULL; sub = sub->next) {
+    struct brk_session *s = sub->s;
+    if ((sub->opts & 4) && s == from) continue;  // MQTT5 No Local
+    if (s->gen != p->gen) {  // First subscription of s that matches
+      s->gen = p->gen, s->fopts = 0, s->fnext = *list, *list = s;
+    }
+    if ((sub->opts & 3) > (s->fopts & 3)) {
+      s->fopts = (uint8_t) ((s->fopts & ~3U) | (sub->opts & 3U));
+    }
+    s->fopts |= (uint8_t) (sub->opts & 8);  // Retain As Published
+  }
+}
+
+// Lists subscribers of topic t, which continues at offset i below node n
+static void brk_match(struct brk_priv *p, struct brk_node *n, struct mg_str t,
+                      size_t i, struct brk_session **list,
+                      struct brk_session *from) {
+  bool wild = i > 0 || t.buf[0] != '$';  // Wildcards skip $SYS/..., 4.7.2
+  struct brk_node *next[2];
+  size_t j, k;
+  for (j = i; j < t.len && t.buf[j] != '/'; j++) (void) 0;
+  if (wild) brk_collect(p, brk_child(p, n, mg_str("#"), false), list, from);
+  next[0] = wild ? brk_child(p, n, mg_str("+"), false) : NULL;
+  next[1] = brk_child(p, n, mg_str_n(t.buf + i, j - i), false);
+  for (k = 0; k < 2; k++) {
+    if (next[k] == NULL) {
+      // No such level
+    } else if (j < t.len) {
+      brk_match(p, next[k], t, j + 1, list, from);
+    } else {  // Last level. a/# matches a, too
+      brk_collect(p, next[k], list, from);
+      brk_collect(p, brk_child(p, next[k], mg_str("#"), false), list, from);
+    }
+  }
+}
+
+// Stores m as the retained message of its topic, empty m deletes it
+static void brk_retain(struct mg_mqtt_broker *b, struct brk_msg *m) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  bool del = m->len == m->pofs;
+  struct brk_node *n = brk_node(p, brk_topic(m), !del);
+  if (n == NULL) return;
+  if (n->retained != NULL) brk_unref(n->retained), b->num_retained--;
+  n->retained = NULL;
+  if (del) {
+    brk_prune(p, n);
+  } else {
+    n->retained = m, m->refs++, b->num_retained++;
+  }
+}
+
+// Fans out m to all subscribers. Returns the number of receivers
+static size_t brk_publish(struct mg_mqtt_broker *b, struct brk_msg *m,
+                          bool retain, struct brk_session *from) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  struct brk_session *list = NULL, *s;
+  size_t n = 0;
+  if (retain) brk_retain(b, m);
+  p->gen++;
+  brk_match(p, &p->root, brk_topic(m), 0, &list, from);
+  for (s = list; s != NULL; s = s->fnext, n++) {
+    uint8_t qos = (uint8_t) (s->fopts & 3);
+    brk_deliver(s, m, qos < m->qos ? qos : m->qos, retain && (s->fopts & 8));
+  }
+  MG_DEBUG(("[%.*s] -> %lu", (int) (m->pofs - m->tofs - 2),
+            (char *) (m + 1) + m->tofs + 2, (unsigned long) n));
+  return n;
+}
+
+static void brk_send_retained(struct brk_session *s, struct brk_node *n,
+                              uint8_t qos) {
+  struct brk_msg *m = n == NULL ? NULL : n->retained;
+  if (m != NULL) brk_deliver(s, m, m->qos < qos ? m->qos : qos, true);
+}
+
+static bool brk_is_sys(struct brk_priv *p, struct brk_node *n) {
+  return n->parent == &p->root && n->len > 0 && *(char *) (n + 1) == '$';
+}
+
+// Sends retained messages of n, unless it's the root, and its descendants
+static void brk_retained_all(struct brk_session *s, struct brk_node *n,
+                             uint8_t qos) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *c;
+  brk_send_retained(s, n, qos);
+  for (c = n->child; c != NULL; c = c->next) {
+    if (!brk_is_sys(p, c)) brk_retained_all(s, c, qos);
+  }
+}
+
+// Sends retained messages matching filter f, which continues at offset i
+// below node n
+static void brk_retained(struct brk_session *s, struct brk_node *n,
+                         struct mg_str f, size_t i, uint8_t qos) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *c;
+  size_t j;
+  for (j = i; j < f.len && f.buf[j] != '/'; j++) (void) 0;
+  if (j == i + 1 && f.buf[i] == '#') {
+    brk_retained_all(s, n, qos);
+  } else if (j == i + 1 && f.buf[i] == '+') {
+    for (c = n->child; c != NULL; c = c->next) {
+      if (brk_is_sys(p, c)) continue;
+      if (j < f.len) {
+        brk_retained(s, c, f, j + 1, qos);
+      } else {
+        brk_send_retained(s, c, qos);
+      }
+    }
+  } else if ((c = brk_child(p, n, mg_str_n(f.buf + i, j - i), false)) !=
+             NULL) {
+    if (j < f.len) {
+      brk_retained(s, c, f, j + 1, qos);
+    } else {
+      brk_send_retained(s, c, qos);
+    }
+  }
+}
+
+static void brk_unsub(struct mg_mqtt_broker *b, struct brk_sub *sub) {
+  struct brk_node *n = sub->node;
+  if (sub->prev != NULL) {
+    sub->prev->next = sub->next;
+  } else {
+    n->subs = sub->next;
+  }
+  if (sub->next != NULL) sub->next->prev = sub->prev;
+  mg_free(sub);
+  b->num_subs--;
+  brk_prune((struct brk_priv *) b->priv, n);
+}
+
+// Drops subscriptions and undelivered messages
+static void brk_reset(struct brk_session *s) {
+  size_t i;
+  while (s->subs != NULL) {
+    struct brk_sub *sub = s->subs;
+    s->subs = sub->snext;
+    brk_unsub(s->b, sub);
+  }
+  while (s->head != NULL) {
+    struct brk_queued *q = s->head;
+    s->head = q->next;
+    brk_unref(q->msg);
+    mg_free(q);
+  }
+  for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+    brk_unref(s->out[i].msg);
+    s->out[i].msg = NULL;
+    s->in[i] = 0;
+  }
+  s->tail = NULL, s->queued = 0;
+}
+
+static void brk_free_session(struct brk_session *s) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  brk_reset(s);
+  brk_unref(s->will);
+  if (s->id.buf != NULL) {
+    brk_hdel(&p->clients, &s->h);
+    s->b->num_sessions = p->clients.len;
+    mg_free((char *) s->id.buf);
+  }
+  mg_free(s);
+}
+
+// Publishes a will, and drops the reference to it
+static void brk_will(struct mg_mqtt_broker *b, struct brk_msg *will,
+                     bool retain) {
+  if (will == NULL) return;
+  brk_publish(b, will, retain, NULL);
+  brk_unref(will);
+}
+
+// Session is over: frees it, then sends a will still held back
+static void brk_end(struct brk_session *s) {
+  struct mg_mqtt_broker *b = s->b;
+  struct brk_msg *will = s->will;
+  bool retain = s->will_retain;
+  s->will = NULL;
+  brk_free_session(s);
+  brk_will(b, will, retain);
+}
+
+// Client is gone: send its will, keep the session only if it's persistent.
+// A persistent MQTT5 session holds the will back for its Will Delay Interval
+static void brk_close(struct brk_session *s) {
+  s->c = NULL;
+  if (!s->connected || !s->persistent) {
+    brk_end(s);
+  } else {
+    s->connected = false;
+    if (s->expiry != BRK_NEVER) {
+      s->expire = mg_millis() + (uint64_t) s->expiry * 1000;
+    }
+    if (s->will != NULL && s->will_delay > 0) {
+      s->will_at = mg_millis() + (uint64_t) s->will_delay * 1000;
+    } else {
+      brk_will(s->b, s->will, s->will_retain);
+      s->will = NULL;
+    }
+  }
+}
+
+static struct brk_session *brk_lookup(struct brk_priv *p, struct mg_str id) {
+  size_t hash = brk_hash(NULL, id);
+  struct brk_hent *e =
+      p->clients.size == 0 ? NULL : p->clients.tab[hash % p->clients.size];
+  for (; e != NULL; e = e->next) {
+    struct brk_session *s = (struct brk_session *) e;
+    if (e->hash == hash && mg_strcmp(s->id, id) == 0) return s;
+  }
+  return NULL;
+}
+
+static size_t brk_hlen(struct mg_mqtt_message *mm) {  // Fixed header length
+  size_t n = 1;
+  while (n < mm->dgram.len && (mm->dgram.buf[n] & 0x80)) n++;
+  return n + 1;
+}
+
+static bool brk_u16(const uint8_t **p, const uint8_t *end, uint16_t *v) {
+  if (end - *p < 2) return false;
+  *v = (uint16_t) (((*p)[0] << 8) | (*p)[1]);
+  *p += 2;
+  return true;
+}
+
+static bool brk_str(const uint8_t **p, const uint8_t *end, struct mg_str *s) {
+  uint16_t n = 0;
+  if (!brk_u16(p, end, &n) || end - *p < n) return false;
+  *s = mg_str_n((const char *) *p, n);
+  *p += n;
+  return true;
+}
+
+// Skips MQTT5 properties, and makes them iterable with mg_mqtt_next_prop()
+static bool brk_props(const uint8_t **p, const uint8_t *end,
+                      struct mg_mqtt_message *mm) {
+  uint32_t n = 0;
+  size_t len = decode_varint(*p, (size_t) (end - *p), &n);
+  if (len == 0 || (size_t) (end - *p) - len < n) return false;
+  mm->props_start = (size_t) (*p + len - (const uint8_t *) mm->dgram.buf);
+  mm->props_size = n;
+  *p += len + n;
+  return true;
+}
+
+static void brk_connack(struct mg_connection *c, bool present, uint8_t rc,
+                        struct mg_str assigned) {
+  uint8_t buf[5] = {0, 0, 0, MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER, 0};
+  size_t n = c->is_mqtt5 ? 3 : 2, plen = c->is_mqtt5 ? assigned.len : 0;
+  buf[0] = present ? 1 : 0, buf[1] = rc;
+  if (plen > 0) {  // Assigned client ID: 0x12, then a string
+    buf[2] = (uint8_t) (3 + plen), buf[4] = (uint8_t) plen, n = 5;
+  }
+  if (!mqtt_send_header(c, MQTT_CMD_CONNACK, 0, (uint32_t) (n + plen)) ||
+      !mg_send(c, buf, n) || !mg_send(c, assigned.buf, plen)) {
+    mg_error(c, "OOM");
+  }
+}
+
+static void brk_connect(struct brk_session *s, struct mg_mqtt_message *mm) {
+  struct mg_connection *c = s->c;
+  struct mg_mqtt_broker *b = s->b;
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  const uint8_t *q = (uint8_t *) mm->dgram.buf + brk_hlen(mm),
+                *end = (uint8_t *) mm->dgram.buf + mm->dgram.len;
+  struct mg_str name, id, wtopic, wmsg, user, pass;
+  struct mg_mqtt_prop prop;
+  struct brk_session *old;
+  struct brk_msg *will = NULL;
+  char buf[21];
+  uint16_t keepalive = 0, rmax = MG_MQTT_INFLIGHT;
+  uint32_t expiry = 0, wdelay = 0;
+  uint8_t level, flags, rc = 0;
+  bool present = false, assigned = false;
+  size_t i, ofs = 0;
+
+  if (s->connected || !brk_str(&q, end, &name) || end - q < 4) goto malformed;
+  level = q[0], flags = q[1], q += 2;
+  brk_u16(&q, end, &keepalive);
+  if (mg_strcmp(name, mg_str("MQTT")) != 0 || (level != 4 && level != 5)) {
+    brk_connack(c, false, 1, mg_str(""));  // Unacceptable protocol version
+    c->is_draining = 1;
+    return;
+  }
+  if ((c->is_mqtt5 = level == 5 ? 1U : 0U) != 0) {
+    if (!brk_props(&q, end, mm)) goto malformed;
+    while ((ofs = mg_mqtt_next_prop(mm, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_RECEIVE_MAXIMUM && prop.iv > 0) {
+        rmax = prop.iv < rmax ? (uint16_t) prop.iv : rmax;
+      } else if (prop.id == MQTT_PROP_SESSION_EXPIRY_INTERVAL) {
+        expiry = prop.iv;
+      }
+    }
+  }
+  if (!brk_str(&q, end, &id)) goto malformed;
+  if (flags & MQTT_HAS_WILL) {
+    struct mg_mqtt_message tmp = *mm;
+    if ((c->is_mqtt5 && !brk_props(&q, end, &tmp)) ||
+        !brk_str(&q, end, &wtopic) || !brk_str(&q, end, &wmsg) ||
+        !brk_valid(wtopic, false) || ((flags >> 3) & 3) > 2)
+      goto malformed;
+    while (c->is_mqtt5 && (ofs = mg_mqtt_next_prop(&tmp, &prop, ofs)) > 0) {
+      if (prop.id == MQTT_PROP_WILL_DELAY_INTERVAL) wdelay = prop.iv;
+    }
+  }
+  user = pass = mg_str_n(NULL, 0);
+  if (((flags & MQTT_HAS_USER_NAME) && !brk_str(&q, end, &user)) ||
+      ((flags & MQTT_HAS_PASSWORD) && !brk_str(&q, end, &pass)))
+    goto malformed;
+  // Refuse before touching any session, including one this client takes over
+  if (id.len == 0 && !c->is_mqtt5 && !(flags & MQTT_CLEAN_SESSION)) {
+    rc = 2;  // Identifier rejected, 3.1.3-8
+  } else if (b->auth != NULL && !b->auth(c, id, user, pass)) {
+    rc = c->is_mqtt5 ? 0x87 : 5;  // Not authorized
+  }
+  if (rc != 0) {
+    MG_DEBUG(("%lu [%.*s] refused: %d", c->id, (int) id.len, id.buf, rc));
+    brk_connack(c, false, rc, mg_str(""));
+    c->is_draining = 1;
+    return;
+  }
+  if (id.len == 0) {
+    mg_random_str(buf, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    id = mg_str(buf), assigned = true;
+  }
+  if ((old = brk_lookup(p, id)) != NULL && old->c == NULL &&
+      old->expire != 0 && mg_millis() >= old->expire) {
+    brk_end(old);  // Expired, not swept yet
+    old = NULL;
+  }
+  if (old != NULL && old->c != NULL) {  // Take over, 3.1.4-3
+    bool ends = !old->persistent;
+    MG_DEBUG(("%lu [%.*s] takes over %lu", c->id, (int) id.len, id.buf,
+              old->c->id));
+    old->c->pfn = NULL, old->c->pfn_data = NULL, old->c->is_closing = 1;
+    brk_close(old);        // As if the old connection was lost: its will
+    if (ends) old = NULL;  // Freed with it
+  }
+  if (old != NULL) {
+    if (flags & MQTT_CLEAN_SESSION) {
+      will = old->will, old->will = NULL;  // Session ends, send it now
+      brk_reset(old);
+    } else {
+      present = true;
+    }
+    brk_free_session(s);
+    s = old;
+  } else {
+    s->id = mg_strdup(id);
+    s->h.hash = brk_hash(NULL, id);
+    if (s->id.buf == NULL || !brk_hadd(&p->clients, &s->h)) {
+      mg_free((char *) s->id.buf);
+      s->id = mg_str_n(NULL, 0);
+      mg_error(c, "OOM");
+      return;
+    }
+    b->num_sessions = p->clients.len;
+  }
+  s->c = c, c->pfn_data = s, s->connected = true, s->max_out = rmax;
+  s->persistent = c->is_mqtt5 ? expiry > 0 : !(flags & MQTT_CLEAN_SESSION);
+  s->expiry = c->is_mqtt5 ? expiry : BRK_NEVER;
+  s->keepalive = keepalive, s->seen = mg_millis(), s->expire = 0;
+  if (keepalive > 0) c->is_polled = 1;  // Even with mgr->poll_opt_in
+  brk_will(b, will, s->will_retain);
+  brk_unref(s->will);  // A delayed will is not sent if back in time, 3.1.3-9
+  s->will = NULL;
+  if (flags & MQTT_HAS_WILL) {
+    s->will = brk_msg(wtopic, wmsg, (uint8_t) ((flags >> 3) & 3));
+    s->will_retain = flags & MQTT_WILL_RETAIN, s->will_delay = wdelay;
+  }
+  brk_connack(c, present, 0, assigned ? id : mg_str(""));
+  for (i = 0; present && i < MG_MQTT_INFLIGHT; i++) {  // Resend, 4.4
+    struct brk_slot *slot = &s->out[i];
+    if (slot->msg == NULL) {
+      // Free slot
+    } else if (slot->released) {
+      uint16_t nid = mg_htons(slot->id);
+      if (!mqtt_send_header(c, MQTT_CMD_PUBREL, 2, sizeof(nid)) ||
+          !mg_send(c, &nid, sizeof(nid)))
+        mg_error(c, "OOM");
+    } else {
+      brk_send(s, slot->msg, slot->qos, slot->id, true, slot->retain);
+    }
+  }
+  brk_pump(s);
+  return;
+malformed:
+  mg_error(c, "bad CONNECT");
+}
+
+static uint8_t brk_add_sub(struct brk_session *s, struct mg_str f,
+                           uint8_t opts) {
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  struct brk_node *n;
+  struct brk_sub *sub;
+  uint8_t reserved = s->c->is_mqtt5 ? 0xc0 : 0xfc;
+  if ((opts & 3) > 2 || (opts & reserved) || ((opts >> 4) & 3) > 2 ||
+      !brk_valid(f, true) || (n = brk_node(p, f, true)) == NULL)
+    return 0x80;
+  for (sub = s->subs; sub != NULL && sub->node != n; sub = sub->snext) (void) 0;
+  if (sub == NULL) {
+    if ((sub = (struct brk_sub *) mg_calloc(1, sizeof(*sub))) == NULL) {
+      brk_prune(p, n);
+      return 0x80;
+    }
+    sub->node = n, sub->s = s, sub->fresh = true;
+    if ((sub->next = n->subs) != NULL) sub->next->prev = sub;
+    n->subs = sub;
+    sub->snext = s->subs, s->subs = sub;
+    s->b->num_subs++;
+  }
+  sub->opts = opts;
+  return (uint8_t) (opts & 3);
+}
+
+static void brk_subscribe(struct brk_session *s, struct mg_mqtt_message *mm,
+                          bool sub) {
+  struct mg_connection *c = s->c;
+  struct brk_priv *p = (struct brk_priv *) s->b->priv;
+  const uint8_t *start = (uint8_t *) mm->dgram.buf + brk_hlen(mm) + 2,
+                *end = (uint8_t *) mm->dgram.buf + mm->dgram.len, *q;
+  struct mg_mqtt_message tmp = *mm;
+  struct mg_str f;
+  uint16_t nid = mg_htons(mm->id);
+  size_t n = 0;
+  uint8_t zero = 0;
+
+  if ((mm->dgram.buf[0] & 15) != 2 ||
+      (c->is_mqtt5 && !brk_props(&start, end, &tmp)))
+    goto malformed;
+  for (q = start; q < end; n++) {
+    if (!brk_str(&q, end, &f) || (sub && q++ >= end)) goto malformed;
+  }
+  if (n == 0) goto malformed;  // 3.8.3-2, 3.10.3-2
+  if (!mqtt_send_header(c, sub ? MQTT_CMD_SUBACK : MQTT_CMD_UNSUBACK, 0,
+                        (uint32_t) (2 + (c->is_mqtt5 ? 1 + n : sub ? n : 0))) ||
+      !mg_send(c, &nid, sizeof(nid)) ||
+      (c->is_mqtt5 && !mg_send(c, &zero, sizeof(zero))))
+    goto oom;
+  for (q = start; q < end;) {  // Reason codes
+    uint8_t code = 0x11;       // No subscription existed
+    brk_str(&q, end, &f);
+    if (sub) {
+      code = brk_add_sub(s, f, *q++);
+    } else {
+      struct brk_node *node = brk_valid(f, true) ? brk_node(p, f, false) : NULL;
+      struct brk_sub **ps = &s->subs;
+      while (*ps != NULL && (*ps)->node != node) ps = &(*ps)->snext;
+      if (node != NULL && *ps != NULL) {
+        struct brk_sub *x = *ps;
+        *ps = x->snext;
+        brk_unsub(s->b, x);
+        code = 0;
+      }
+    }
+    if ((sub || c->is_mqtt5) && !mg_send(c, &code, sizeof(code))) goto oom;
+  }
+  for (q = start; sub && q < end;) {  // Retained messages, after SUBACK
+    struct brk_node *node;
+    struct brk_sub *x;
+    uint8_t opts, rh;
+    brk_str(&q, end, &f);
+    opts = *q++, rh = (uint8_t) ((opts >> 4) & 3);
+    node = brk_valid(f, true) ? brk_node(p, f, false) : NULL;
+    for (x = s->subs; x != NULL && x->node != node; x = x->snext) (void) 0;
+    if (node == NULL || x == NULL) continue;
+    if (rh == 0 || (rh == 1 && x->fresh)) {
+      brk_retained(s, &p->root, f, 0, (uint8_t) (x->opts & 3));
+    }
+    x->fresh = false;
+  }
+  return;
+malformed:
+  mg_error(c, "bad SUBSCRIBE");
+  return;
+oom:
+  mg_error(c, "OOM");
+}
+
+static void brk_cmd(struct brk_session *s, struct mg_mqtt_message *mm) {
+  struct mg_connection *c = s->c;
+  struct brk_slot *slot = brk_slot(s, mm->id);
+  size_t i;
+  if (c->is_closing || c->is_draining) {
+    // Don't act on the rest of the data
+  } else if (mm->cmd == MQTT_CMD_CONNECT) {
+    brk_connect(s, mm);
+  } else if (!s->connected) {
+    mg_error(c, "no CONNECT");
+  } else if (mm->cmd == MQTT_CMD_SUBSCRIBE) {
+    brk_subscribe(s, mm, true);
+  } else if (mm->cmd == MQTT_CMD_UNSUBSCRIBE) {
+    brk_subscribe(s, mm, false);
+  } else if (mm->cmd == MQTT_CMD_PUBLISH) {
+    struct brk_msg *m;
+    if (mm->qos > 2 || !brk_valid(mm->topic, false)) {
+      mg_error(c, "bad PUBLISH");
+      return;
+    }
+    if (mm->qos == 2) {  // Fan out once, even if the client sends it again
+      for (i = 0; i < MG_MQTT_INFLIGHT && s->in[i] != mm->id; i++) (void) 0;
+      if (i < MG_MQTT_INFLIGHT) return;
+      for (i = 0; i < MG_MQTT_INFLIGHT && s->in[i] != 0; i++) (void) 0;
+      if (i < MG_MQTT_INFLIGHT) s->in[i] = mm->id;
+    }
+    if ((m = brk_msg(mm->topic, mm->data, mm->qos)) == NULL) {
+      mg_error(c, "OOM");
+      return;
+    }
+    brk_publish(s->b, m, mm->dgram.buf[0] & 1, s);
+    brk_unref(m);
+  } else if (mm->cmd == MQTT_CMD_PUBREL) {
+    for (i = 0; i < MG_MQTT_INFLIGHT; i++) {
+      if (s->in[i] == mm->id) s->in[i] = 0;
+    }
+  } else if (mm->cmd == MQTT_CMD_PUBREC && slot != NULL && slot->qos == 2) {
+    slot->released = true;  // mqtt_cb() has sent PUBREL
+  } else if ((mm->cmd == MQTT_CMD_PUBACK && slot != NULL && slot->qos == 1) ||
+             (mm->cmd == MQTT_CMD_PUBCOMP && slot != NULL && slot->released)) {
+    brk_unref(slot->msg);
+    slot->msg = NULL;
+    brk_pump(s);
+  } else if (mm->cmd == MQTT_CMD_PINGREQ) {
+    mg_mqtt_pong(c);
+  } else if (mm->cmd == MQTT_CMD_DISCONNECT) {
+    // MQTT5 reason 4: disconnect with will message
+    if (!c->is_mqtt5 || mm->dgram.len < 3 || mm->dgram.buf[2] != 4) {
+      brk_unref(s->will);
+      s->will = NULL;
+    }
+    c->is_draining = 1;
+  }
+}
+
+// Frees offline sessions past their Session Expiry Interval, sends delayed
+// wills. Runs at most once a second, on the listeners' MG_EV_POLL
+static void brk_expire(struct mg_mqtt_broker *b, uint64_t now) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  size_t i;
+  if (now < p->sweep) return;
+  p->sweep = now + 1000;
+  for (i = 0; i < p->clients.size; i++) {
+    struct brk_hent *e = p->clients.tab[i], *next;
+    for (; e != NULL; e = next) {
+      struct brk_session *s = (struct brk_session *) e;
+      next = e->next;
+      if (s->c == NULL && s->expire != 0 && now >= s->expire) {
+        MG_DEBUG(("[%.*s] session expired", (int) s->id.len, s->id.buf));
+        brk_end(s);
+      } else if (s->c == NULL && s->will != NULL && now >= s->will_at) {
+        brk_will(b, s->will, s->will_retain);
+        s->will = NULL;
+      }
+    }
+  }
+}
+
+static void brk_cb(struct mg_connection *c, int ev, void *ev_data) {
+  struct brk_session *s = (struct brk_session *) c->pfn_data;
+  if (ev == MG_EV_POLL && c->is_listening) {
+    brk_expire((struct mg_mqtt_broker *) c->pfn_data, *(uint64_t *) ev_data);
+  } else if (ev == MG_EV_POLL) {
+    uint64_t now = *(uint64_t *) ev_data;
+    // No packet for 1.5 keep alive intervals: close, send the will, 3.1.2-24
+    if (s != NULL && s->connected && s->keepalive > 0 &&
+        now > s->seen + (uint64_t) s->keepalive * 1500) {
+      mg_error(c, "keepalive timeout");
+    }
+  } else if (c->is_listening || ev == MG_EV_OPEN) {
+    // Listener, or accepted connection with no session yet
+  } else if (ev == MG_EV_ACCEPT) {
+    struct mg_mqtt_broker *b = (struct mg_mqtt_broker *) c->pfn_data;
+    if ((s = (struct brk_session *) mg_calloc(1, sizeof(*s))) == NULL) {
+      c->pfn = NULL, c->pfn_data = NULL;
+      mg_error(c, "OOM");
+    } else {
+      s->b = b, s->c = c, s->max_out = MG_MQTT_INFLIGHT;
+      c->pfn_data = s;
+    }
+  } else if (ev == MG_EV_READ) {
+    mqtt_cb(c, ev, ev_data);
+  } else if (ev == MG_EV_MQTT_CMD) {
+    s->seen = mg_millis();
+    brk_cmd(s, (struct mg_mqtt_message *) ev_data);
+  } else if (ev == MG_EV_CLOSE) {
+    brk_close(s);
+    c->pfn_data = NULL;
+  }
+}
+
+struct mg_connection *mg_mqtt_broker_listen(struct mg_mgr *mgr,
+                                            const char *url,
+                                            struct mg_mqtt_broker *b,
+                                            mg_event_handler_t fn,
+                                            void *fn_data) {
+  struct mg_connection *c = NULL;
+  if (brk_priv(b) != NULL && (c = mg_listen(mgr, url, fn, fn_data)) != NULL) {
+    c->pfn = brk_cb, c->pfn_data = b, b->mgr = mgr;
+    c->is_polled = 1;  // Expire offline sessions
+  }
+  return c;
+}
+
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *b,
+                          const struct mg_mqtt_opts *opts) {
+  struct brk_msg *m;
+  size_t n;
+  uint8_t qos = opts->qos > 2 ? 2 : opts->qos;
+  if (brk_priv(b) == NULL || !brk_valid(opts->topic, false) ||
+      (m = brk_msg(opts->topic, opts->message, qos)) == NULL)
+    return 0;
+  n = brk_publish(b, m, opts->retain, NULL);
+  brk_unref(m);
+  return n;
+}
+
+void mg_mqtt_broker_free(struct mg_mqtt_broker *b) {
+  struct brk_priv *p = (struct brk_priv *) b->priv;
+  struct mg_connection *c;
+  size_t i;
+  if (p == NULL) return;
+  for (c = b->mgr == NULL ? NULL : b->mgr->conns; c != NULL; c = c->next) {
+    struct brk_session *s = (struct brk_session *) c->pfn_data;
+    if (c->pfn != brk_cb) continue;
+    if (c->is_listening ? c->pfn_data != (void *) b : s->b != b) continue;
+    if (!c->is_listening && s->id.buf == NULL) brk_free_session(s);
+    c->pfn = NULL, c->pfn_data = NULL, c->is_closing = 1;
+  }
+  for (i = 0; i < p->clients.size; i++) {
+    while (p->clients.tab[i] != NULL) {
+      brk_free_session((struct brk_session *) p->clients.tab[i]);
+    }
+  }
+  for (i = 0; i < p->nodes.size; i++) {  // What's left holds retained
+    while (p->nodes.tab[i] != NULL) {
+      struct brk_node *n = (struct brk_node *) p->nodes.tab[i];
+      p->nodes.tab[i] = n->h.next;
+      brk_unref(n->retained);
+      mg_free(n);
+    }
+  }
+  mg_free(p->nodes.tab);
+  mg_free(p->clients.tab);
+  mg_free(p);
+  memset(b, 0, sizeof(*b));
+}
+#endif
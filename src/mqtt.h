@@ -72,6 +72,26 @@ struct mg_mqtt_prop {
   struct mg_str val;  // String/binary value; set for STRING, BINARY_DATA, and USER_PROPERTY
 };
 
+// Client session: QoS 1/2 PUBLISHes sent with mg_mqtt_pub() and not yet
+// acknowledged. Zero-initialise, set the public fields, and pass it as
+// mg_mqtt_opts.session to every mg_mqtt_connect() of the same client.
+// With fs set, changes are saved at most every MG_MQTT_SAVE_MS, when the
+// connection closes, and by mg_mqtt_session_free().
+struct mg_mqtt_session {
+  struct mg_fs *fs;            // Save messages to a file, or NULL: memory only
+  const char *path;            // File to save to, if fs is set
+  uint16_t receive_max;        // Max in-flight messages, 0: MG_MQTT_INFLIGHT
+  uint64_t retransmit_ms;      // MQTT 3.1.1: resend after that, 0: on reconnect
+  size_t num_inflight;         // Sent, awaiting acknowledgement
+  size_t num_queued;           // Waiting to be sent
+  struct mg_connection *c;     // Current connection, or NULL
+  void *head;                  // Messages, oldest first (internal)
+  void *tail;                  // Newest message, where to append (internal)
+  uint16_t server_max;         // MQTT5 server's Receive Maximum (internal)
+  bool loaded, online, dirty;  // (internal)
+  uint64_t saved_ms;           // Last save to fs (internal)
+};
+
 // Options passed to mg_mqtt_connect(), mg_mqtt_pub(), mg_mqtt_sub(),
 // mg_mqtt_unsub(), and mg_mqtt_disconnect(). Zero-initialise and set only
 // the fields relevant to the operation being called.
@@ -91,6 +111,7 @@ struct mg_mqtt_opts {
   size_t num_props;                 // MQTT5: number of entries in props
   struct mg_mqtt_prop *will_props;  // MQTT5 CONNECT: will properties; NULL if none
   size_t num_will_props;            // MQTT5: number of entries in will_props
+  struct mg_mqtt_session *session;  // CONNECT: track QoS 1/2 PUBLISHes
 };
 
 // Received MQTT message. Passed as ev_data for MG_EV_MQTT_MSG (PUBLISH),
@@ -161,8 +182,40 @@ void mg_mqtt_login(struct mg_connection *c, const struct mg_mqtt_opts *opts);
 //   On success, opts.topic and opts.message are copied into c->send before the
 //   function returns. To retransmit a QoS message, set opts.retransmit_id to the
 //   packet ID returned by the previous call; use 0 for a new message.
+//   If c was opened with mg_mqtt_opts.session, QoS 1/2 messages are kept
+//   until acknowledged, sent when fewer than session.receive_max are in
+//   flight, and resent with the DUP flag after a reconnect. Then 0 is
+//   returned if the session holds MG_MQTT_QUEUE_MAX unsent messages
 uint16_t mg_mqtt_pub(struct mg_connection *c, const struct mg_mqtt_opts *opts);
 
+// Sends n PUBLISH packets, like n mg_mqtt_pub() calls with opts[0] ...
+// opts[n - 1], but encodes them straight into c->send, grown once for all.
+//
+// Returns:
+//   Number of messages sent or queued. If ids is not NULL, ids[i] is set to
+//   the packet ID of opts[i], as mg_mqtt_pub() would return it.
+// Example:
+//   struct mg_mqtt_opts msgs[2] = {
+//       {.topic = mg_str("t/1"), .message = mg_str("1")},
+//       {.topic = mg_str("t/2"), .message = mg_str("2"), .qos = 1},
+//   };
+//   mg_mqtt_pub_batch(c, msgs, 2, NULL);
+// Related APIs:
+//   mg_mqtt_pub()
+// Notes:
+//   On MQTT5 connections, topics get aliases (property 0x23) if the server
+//   allows it with Topic Alias Maximum, up to MG_MQTT_TOPIC_ALIASES of them.
+//   A topic is sent with its alias once, then only the alias is sent.
+//   This applies to mg_mqtt_pub() too, unless opts.props has a topic alias
+//   or the message is kept by a session
+size_t mg_mqtt_pub_batch(struct mg_connection *c,
+                         const struct mg_mqtt_opts *opts, size_t n,
+                         uint16_t *ids);
+
+// Frees messages kept by a session, e.g. before exiting. Messages saved to
+// s->fs stay there, and are sent after the next mg_mqtt_connect() with s
+void mg_mqtt_session_free(struct mg_mqtt_session *s);
+
 // Sends an MQTT SUBSCRIBE packet.
 //
 // Example:
@@ -208,3 +261,57 @@ void mg_mqtt_disconnect(struct mg_connection *, const struct mg_mqtt_opts *);
 // Fills *prop with each property; key and val are zero-copy slices into msg->dgram.
 size_t mg_mqtt_next_prop(struct mg_mqtt_message *, struct mg_mqtt_prop *,
                          size_t ofs);
+
+// MQTT broker state. Zero-initialise, then pass to mg_mqtt_broker_listen().
+// One broker can serve several listeners, e.g. mqtt:// and mqtts://
+struct mg_mqtt_broker {
+  struct mg_mgr *mgr;   // Manager of the listeners
+  size_t num_sessions;  // Client sessions, including offline persistent ones
+  size_t num_subs;      // Subscriptions
+  size_t num_retained;  // Retained messages
+  void *priv;           // Topic tree and sessions (internal)
+  // Optional. Called for each CONNECT, before the broker touches any session.
+  // Return false to refuse the client: CONNACK 5, or 0x87 for MQTT5
+  bool (*auth)(struct mg_connection *c, struct mg_str client_id,
+               struct mg_str user, struct mg_str pass);
+};
+
+// Creates an MQTT broker listener on url. The broker handles CONNECT,
+// SUBSCRIBE, UNSUBSCRIBE, PUBLISH with QoS 0, 1 and 2, retained messages,
+// will messages and persistent sessions, for MQTT 3.1.1 and MQTT5 clients.
+//
+// Returns:
+//   Listening connection, or NULL on error.
+// Example:
+//   static struct mg_mqtt_broker s_broker;
+//   mg_mqtt_broker_listen(&mgr, "mqtt://0.0.0.0:1883", &s_broker, fn, NULL);
+// Full examples:
+//   tutorials/mqtt/mqtt-server
+// Related APIs:
+//   mg_mqtt_broker_pub(), mg_mqtt_broker_free(), mg_mqtt_listen()
+// Notes:
+//   Requires MG_ENABLE_MQTT_BROKER=1. fn receives MG_EV_MQTT_CMD for each
+//   packet, after the broker has handled it. To check credentials, set
+//   auth in the broker: a refused client takes over no session and gets no
+//   messages. Clients silent for 1.5 times their keep alive are
+//   disconnected, and their will is sent. Offline MQTT5 sessions are freed
+//   after their Session Expiry Interval. Subscribers to a topic
+//   are found in a topic tree, in time that does not depend on the number
+//   of subscriptions. Each message is stored once, and all subscribers'
+//   connections reference it instead of copying it. Up to MG_MQTT_INFLIGHT
+//   QoS 1/2 messages per client await acknowledgement, the rest are queued,
+//   up to MG_MQTT_QUEUE_MAX.
+struct mg_connection *mg_mqtt_broker_listen(struct mg_mgr *, const char *url,
+                                            struct mg_mqtt_broker *,
+                                            mg_event_handler_t fn,
+                                            void *fn_data);
+
+// Publishes opts.topic / opts.message with opts.qos and opts.retain to the
+// broker's subscribers, as if a client sent it.
+// Returns the number of subscribers the message was delivered or queued to
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *,
+                          const struct mg_mqtt_opts *opts);
+
+// Frees the broker's sessions, subscriptions and retained messages, and
+// closes its connections. Call before or after mg_mgr_free()
+void mg_mqtt_broker_free(struct mg_mqtt_broker *);
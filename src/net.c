@@ -1,6 +1,7 @@
 #include "net.h"
 #include "dns.h"
 #include "fmt.h"
+#include "http.h"
 #include "log.h"
 #include "ota.h"
 #include "printf.h"
@@ -9,14 +10,18 @@
 #include "tls.h"
 
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
-  size_t old = c->send.len;
-  size_t expected = mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
-  size_t actual = c->send.len - old;
+  size_t old = c->send.len, expected, actual;
+  mg_pool_iobuf(c->mgr, &c->send);
+  expected = mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  actual = c->send.len - old;
   if (actual != expected) {
     mg_error(c, "OOM");
     c->send.len = old;
     actual = 0;
   }
+  if (actual > 0) {
+    MG_EPOLL_MOD(c, 1);
+  }
   return actual;
 }
 
@@ -169,21 +174,248 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
          mg_aton6(str, addr);
 }
 
+struct pool_entry {
+  struct pool_entry *next;
+};
+
+static void *pool_pop(void **list) {
+  struct pool_entry *e = (struct pool_entry *) *list;
+  if (e != NULL) *list = e->next, e->next = NULL;
+  return e;
+}
+
+static void pool_push(void **list, void *p) {
+  struct pool_entry *e = (struct pool_entry *) p;
+  e->next = (struct pool_entry *) *list;
+  *list = e;
+}
+
+static void pool_free(struct mg_pool *pool) {
+  void *p;
+  while ((p = pool_pop(&pool->conn_list)) != NULL) mg_free(p);
+  while ((p = pool_pop(&pool->buf_list)) != NULL) mg_free(p);
+  pool->free_conns = pool->free_bufs = 0;
+}
+
+// If io has no buffer yet, give it a zeroed MG_IO_SIZE one from the pool
+void mg_pool_iobuf(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  struct mg_pool *pool = mgr == NULL ? NULL : &mgr->pool;
+  if (pool != NULL && pool->free_bufs > 0 && io->buf == NULL &&
+      io->align == MG_IO_SIZE) {
+    io->buf = (unsigned char *) pool_pop(&pool->buf_list);
+    io->size = MG_IO_SIZE, io->len = io->head = 0;
+    pool->free_bufs--, pool->reused++;
+  }
+}
+
+// Return a single-block buffer to the pool, or free it
+static void pool_iobuf_put(struct mg_mgr *mgr, struct mg_iobuf *io) {
+  struct mg_pool *pool = &mgr->pool;
+  unsigned char *base = io->buf == NULL ? NULL : io->buf - io->head;
+  if (base != NULL && io->size + io->head == MG_IO_SIZE &&
+      pool->free_bufs < pool->max) {
+    mg_bzero(base, MG_IO_SIZE);
+    pool_push(&pool->buf_list, base);
+    pool->free_bufs++;
+    io->buf = NULL, io->size = io->len = io->head = 0;
+  }
+  mg_iobuf_free(io);
+}
+
+// Connection lookup index: hash buckets by ID, for mg_wakeup(), and by TCP
+// 4-tuple, for the builtin TCP/IP stack. Buckets are chained through the
+// connections, and grow 2x when there are more connections than buckets
+struct conn_index {
+  size_t size;                     // Number of buckets, a power of 2
+  size_t count;                    // Number of indexed connections
+  struct mg_connection **ids;      // Chained by c->id_next
+#if MG_ENABLE_TCPIP
+  struct mg_connection **tuples;   // Chained by c->tuple_next
+#endif
+};
+
+#if MG_ENABLE_TCPIP
+static size_t tuple_hash(uint16_t port, const struct mg_addr *rem) {
+  const uint8_t *p = rem->addr.ip;
+  size_t i, n = rem->is_ip6 ? 16 : 4;
+  uint32_t h = 2166136261U ^ ((uint32_t) port << 16 | rem->port);  // FNV-1a
+  for (i = 0; i < n; i++) h = (h ^ p[i]) * 16777619U;
+  return (size_t) h;
+}
+
+static bool tuple_match(const struct mg_connection *c, uint16_t port,
+                        const struct mg_addr *rem) {
+  return !c->is_udp && !c->is_listening && c->loc.port == port &&
+         c->rem.port == rem->port && c->loc.is_ip6 == rem->is_ip6 &&
+         (rem->is_ip6 ? memcmp(c->rem.addr.ip, rem->addr.ip, 16) == 0
+                      : c->rem.addr.ip4 == rem->addr.ip4);
+}
+
+static struct mg_connection **tuple_bucket(struct conn_index *ix,
+                                           uint16_t port,
+                                           const struct mg_addr *rem) {
+  return &ix->tuples[tuple_hash(port, rem) & (ix->size - 1)];
+}
+#endif
+
+static struct conn_index *conn_index_new(size_t size) {
+  size_t n = sizeof(struct conn_index) +
+             (MG_ENABLE_TCPIP ? 2 : 1) * size * sizeof(void *);
+  struct conn_index *ix = (struct conn_index *) mg_calloc(1, n);
+  if (ix != NULL) {
+    ix->size = size;
+    ix->ids = (struct mg_connection **) (ix + 1);
+#if MG_ENABLE_TCPIP
+    ix->tuples = ix->ids + size;
+#endif
+  }
+  return ix;
+}
+
+// Rehash into 2x buckets, keeping the order of connections within a bucket
+static void conn_index_grow(struct mg_mgr *mgr) {
+  struct conn_index *old = (struct conn_index *) mgr->conn_index, *ix;
+  struct mg_connection *c, *next, **p;
+  size_t i;
+  if ((ix = conn_index_new(old == NULL ? 16 : old->size * 2)) == NULL) return;
+  for (i = 0; old != NULL && i < old->size; i++) {
+    for (c = old->ids[i]; c != NULL; c = next) {
+      next = c->id_next, c->id_next = NULL;
+      p = &ix->ids[c->id & (ix->size - 1)];
+      while (*p != NULL) p = &(*p)->id_next;
+      *p = c;
+    }
+#if MG_ENABLE_TCPIP
+    for (c = old->tuples[i]; c != NULL; c = next) {
+      next = c->tuple_next, c->tuple_next = NULL;
+      p = tuple_bucket(ix, c->loc.port, &c->rem);
+      while (*p != NULL) p = &(*p)->tuple_next;
+      *p = c;
+    }
+#endif
+  }
+  ix->count = old == NULL ? 0 : old->count;
+  mg_free(old);
+  mgr->conn_index = ix;
+}
+
+static void conn_index_add(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  if (ix == NULL || ix->count >= ix->size) conn_index_grow(c->mgr);
+  if ((ix = (struct conn_index *) c->mgr->conn_index) != NULL) {
+    struct mg_connection **p = &ix->ids[c->id & (ix->size - 1)];
+    c->id_next = *p, *p = c;
+    ix->count++;
+  }
+}
+
+void mg_conn_index_del(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  struct mg_connection **p;
+  if (ix == NULL) return;
+  for (p = &ix->ids[c->id & (ix->size - 1)]; *p != NULL; p = &(*p)->id_next) {
+    if (*p == c) {
+      *p = c->id_next;
+      ix->count--;
+      break;
+    }
+  }
+#if MG_ENABLE_TCPIP
+  for (p = tuple_bucket(ix, c->loc.port, &c->rem); *p != NULL;
+       p = &(*p)->tuple_next) {
+    if (*p == c) {
+      *p = c->tuple_next;
+      break;
+    }
+  }
+#endif
+}
+
+struct mg_connection *mg_conn_by_id(struct mg_mgr *mgr, unsigned long id) {
+  struct conn_index *ix = (struct conn_index *) mgr->conn_index;
+  struct mg_connection *c;
+  if (ix == NULL) {
+    for (c = mgr->conns; c != NULL && c->id != id;) c = c->next;
+  } else {
+    c = ix->ids[id & (ix->size - 1)];
+    while (c != NULL && c->id != id) c = c->id_next;
+  }
+  return c;
+}
+
+#if MG_ENABLE_TCPIP
+// Index an established TCP connection by its local port and remote address
+void mg_conn_index_tuple(struct mg_connection *c) {
+  struct conn_index *ix = (struct conn_index *) c->mgr->conn_index;
+  if (ix != NULL) {
+    struct mg_connection **p = tuple_bucket(ix, c->loc.port, &c->rem);
+    c->tuple_next = *p, *p = c;
+  }
+}
+
+// Return the newest established TCP connection for the given local port and
+// remote address
+struct mg_connection *mg_conn_by_tuple(struct mg_mgr *mgr, uint16_t port,
+                                       const struct mg_addr *rem) {
+  struct conn_index *ix = (struct conn_index *) mgr->conn_index;
+  struct mg_connection *c;
+  if (ix == NULL) {
+    for (c = mgr->conns; c != NULL && !tuple_match(c, port, rem);) c = c->next;
+  } else {
+    c = *tuple_bucket(ix, port, rem);
+    while (c != NULL && !tuple_match(c, port, rem)) c = c->tuple_next;
+  }
+  return c;
+}
+#endif
+
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
-  struct mg_connection *c =
-      (struct mg_connection *) mg_calloc(1, sizeof(*c) + mgr->extraconnsize);
+  struct mg_pool *pool = &mgr->pool;
+  size_t size = sizeof(struct mg_connection) + mgr->extraconnsize;
+  struct mg_connection *c = NULL;
+  if (pool->conn_size == 0) pool->conn_size = size;
+  if (pool->conn_size != size) {  // extraconnsize has changed: stop pooling
+    pool_free(pool);
+    pool->conn_size = (size_t) -1;
+  }
+  if ((c = (struct mg_connection *) pool_pop(&pool->conn_list)) != NULL) {
+    memset(c, 0, size);
+    pool->free_conns--, pool->reused++;
+  } else {
+    c = (struct mg_connection *) mg_calloc(1, size);
+  }
   if (c != NULL) {
+    if (++pool->conns > pool->conns_peak) pool->conns_peak = pool->conns;
     c->mgr = mgr;
     c->send.align = c->recv.align = c->rtls.align = MG_IO_SIZE;
     c->id = ++mgr->nextid;
+    conn_index_add(c);
     MG_PROF_INIT(c);
   }
   return c;
 }
 
+// Once a second, give memory of large, drained IO buffers back
+void mg_mgr_shrink(struct mg_mgr *mgr, uint64_t now) {
+  struct mg_connection *c;
+  size_t max = mgr->io_shrink;
+  if (max == 0 || now < mgr->io_shrink_ms) return;
+  mgr->io_shrink_ms = now + 1000;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    if (c->recv.len == 0 && c->recv.size + c->recv.head > max) {
+      mg_iobuf_free(&c->recv);
+    }
+    if (c->send.len == 0 && c->send.size + c->send.head > max) {
+      mg_iobuf_free(&c->send);
+    }
+  }
+}
+
 void mg_close_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
   mg_resolve_cancel(c);  // Close any pending DNS query
-  LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  if (!c->is_http2) LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  mg_conn_index_del(c);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
   // Order of operations is important. `MG_EV_CLOSE` event must be fired
@@ -194,11 +426,18 @@ void mg_close_conn(struct mg_connection *c) {
   MG_PROF_FREE(c);
 
   mg_tls_free(c);
-  mg_iobuf_free(&c->recv);
-  mg_iobuf_free(&c->send);
-  mg_iobuf_free(&c->rtls);
+  pool_iobuf_put(mgr, &c->recv);
+  pool_iobuf_put(mgr, &c->send);
+  pool_iobuf_put(mgr, &c->rtls);
   mg_bzero((unsigned char *) c, sizeof(*c));
-  mg_free(c);
+  mgr->pool.conns--;
+  if (mgr->pool.free_conns < mgr->pool.max &&
+      mgr->pool.conn_size == sizeof(*c) + mgr->extraconnsize) {
+    pool_push(&mgr->pool.conn_list, c);
+    mgr->pool.free_conns++;
+  } else {
+    mg_free(c);
+  }
 }
 
 struct mg_connection *mg_connect_svc(struct mg_mgr *mgr, const char *url,
@@ -243,6 +482,8 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   } else if (!mg_open_listener(c, url)) {
     MG_ERROR(("Failed: %s", url));
     MG_PROF_FREE(c);
+    mg_conn_index_del(c);
+    mgr->pool.conns--;
     mg_free(c);
     c = NULL;
   } else {
@@ -295,6 +536,9 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_timer *tmp, *t = mgr->timers;
   while (t != NULL) tmp = t->next, mg_free(t), t = tmp;
   mgr->timers = NULL;  // Important. Next call to poll won't touch timers
+#if MG_ENABLE_TIMER_WHEEL
+  memset(&mgr->wheel, 0, sizeof(mgr->wheel));
+#endif
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
@@ -303,8 +547,20 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   MG_DEBUG(("All connections closed"));
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+#endif
+#if MG_ENABLE_IOURING
+  mg_iouring_free(mgr);
 #endif
   mg_tls_ctx_free(mgr);
+  pool_free(&mgr->pool);
+  mg_free(mgr->conn_index);
+  mgr->conn_index = NULL;
+#if MG_HTTP_CACHE_SIZE > 0
+  mg_http_cache_free(mgr);
+#endif
+#if MG_ENABLE_DEFLATE
+  mg_http_gzip_free(mgr);
+#endif
 #if MG_ENABLE_TCPIP
   if (mgr->ifp) mg_tcpip_free(mgr->ifp);
 #endif
@@ -318,6 +574,9 @@ void mg_mgr_init(struct mg_mgr *mgr) {
 #else
   mgr->epoll_fd = -1;
 #endif
+#if MG_ENABLE_IOURING
+  mg_iouring_init(mgr);
+#endif
 #if MG_ARCH == MG_ARCH_WIN32 && MG_ENABLE_WINSOCK
   // clang-format off
   { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
@@ -337,6 +596,8 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   mgr->pipe.fd = MG_INVALID_SOCKET;
 #endif
   mgr->dnstimeout = 3000;
+  mgr->io_shrink = MG_IO_SHRINK;
+  mgr->pool.max = MG_POOL_SIZE;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
   mg_tls_ctx_init(mgr);
@@ -31,6 +31,29 @@ union mg_pipe {
   void *q;
 };
 
+// Per-manager pool of free connections and MG_IO_SIZE IO buffers. Closed
+// connections and their single-block buffers go to the pool, and new ones
+// come from it, instead of mg_calloc() / mg_free() on every connection
+struct mg_pool {
+  size_t max;         // Max free connections, and free buffers, kept. 0: off
+  size_t conns;       // Connections in use
+  size_t conns_peak;  // High watermark of conns
+  size_t free_conns;  // Free connections in the pool
+  size_t free_bufs;   // Free IO buffers in the pool
+  size_t reused;      // Connections and buffers taken from the pool
+  void *conn_list;    // Free connections (internal)
+  void *buf_list;     // Free IO buffers (internal)
+  size_t conn_size;   // Size of a pooled connection (internal)
+};
+
+// Send counters, e.g. to compare syscalls and TLS records per response with
+// and without mgr->coalesce. Read and reset freely
+struct mg_io_stats {
+  size_t sends;    // Calls into the network stack, e.g. send() syscalls
+  size_t records;  // TLS application data records produced
+  size_t bytes;    // Bytes accepted by the network stack
+};
+
 // Central event manager. Zero-initialise with mg_mgr_init() before use.
 struct mg_mgr {
   struct mg_connection *conns;  // Linked list of all open connections
@@ -45,14 +68,30 @@ struct mg_mgr {
   uint16_t mqtt_id;             // Packet ID counter for MQTT pub/sub
   void *active_dns_requests;    // Pending DNS queries (internal)
   void *active_mdns_requests;   // Pending mDNS resolver queries (internal)
+  void *http_cache;             // mg_http_serve_dir() file cache (internal)
+  void *http_gzip;              // Compressed static files cache (internal)
+  void *conn_index;             // Connection hash index by ID and 4-tuple (internal)
   struct mg_timer *timers;      // Linked list of active timers
   int epoll_fd;                 // epoll file descriptor; -1 when unused (MG_EPOLL_ENABLE=1)
+  bool epoll_busy;              // epoll, io_uring: work pending, don't block
+  bool poll_opt_in;             // MG_EV_POLL only for busy or is_polled connections
+  bool coalesce;                // Flush all connections once per poll, see c->is_coalescing
+  struct mg_io_stats io;        // Send counters
+  size_t io_shrink;             // Free idle conn IO buffers larger than this, 0: keep
+  uint64_t io_shrink_ms;        // Time of the next io_shrink check (internal)
+  struct mg_pool pool;          // Connection and IO buffer pool, see MG_POOL_SIZE
   struct mg_tcpip_if *ifp;      // Builtin TCP/IP stack: network interface pointer
   size_t extraconnsize;         // Builtin TCP/IP stack: extra bytes allocated per connection
   union mg_pipe pipe;           // Socketpair write-end / queue, used by mg_wakeup()
+#if MG_ENABLE_TIMER_WHEEL
+  struct mg_timer_wheel wheel;  // Expiration schedule of 'timers' (internal)
+#endif
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;               // FreeRTOS-TCP socket set
 #endif
+#if MG_ENABLE_IOURING
+  void *iou;                    // io_uring rings and receive buffers (internal)
+#endif
 };
 
 // A single network connection. Do not allocate directly; use mg_connect() or
@@ -74,6 +113,21 @@ struct mg_connection {
   void *pfn_data;                 // Protocol-level handler argument
   char data[MG_DATA_SIZE];        // Scratch space for protocol state; freely readable
   void *tls;                      // TLS state (internal)
+  void *send_refs;                // Buffers queued by mg_send_ref() (internal)
+  size_t send_refs_len;           // Bytes in send_refs, not yet sent (internal)
+  size_t http_head;               // HTTP: pending message header length (internal)
+  size_t http_scan;               // HTTP: pending message bytes scanned (internal)
+  struct mg_connection *id_next;  // Next in mgr->conn_index ID bucket (internal)
+#if MG_ENABLE_DEFLATE
+  void *http_gzip;                // HTTP: chunked response compressor (internal)
+  void *ws_deflate;               // WebSocket: permessage-deflate state (internal)
+#endif
+#if MG_ENABLE_TCPIP
+  struct mg_connection *tuple_next;  // Next in 4-tuple bucket (internal)
+#endif
+#if MG_ENABLE_IOURING
+  void *iou;                      // io_uring: in-flight I/O state (internal)
+#endif
   unsigned dscp : 6;              // Differentiated Services Code Point
 #define MG_DSCP_CS(class_) ((class_) << 3)
 #define MG_DSCP_AF(class_, drop_) (((class_) << 3) | ((drop_) << 1))
@@ -95,8 +149,19 @@ struct mg_connection {
   unsigned is_full : 1;           // Pause incoming reads until cleared
   unsigned is_tls_throttled : 1;  // TLS write was throttled; retry pending
   unsigned is_resp : 1;           // HTTP: response is still being generated
+  unsigned is_http_stream : 1;    // HTTP: deliver bodies as MG_EV_HTTP_BODY
+  unsigned is_http_body : 1;      // HTTP: streaming a body (internal)
+  unsigned is_http_eof : 1;       // HTTP: streamed body ends on close (internal)
+  unsigned is_http_gzip : 1;      // HTTP: compress response, peer accepts gzip
+  unsigned is_ws_deflate : 1;     // WebSocket: compress messages, see ws.h
+  unsigned is_http2 : 1;          // HTTP/2 stream: no socket, uses parent's
   unsigned is_readable : 1;       // Socket is ready to read (epoll/select)
   unsigned is_writable : 1;       // Socket is ready to write (epoll/select)
+  unsigned is_polled : 1;         // Always get MG_EV_POLL, see mgr->poll_opt_in
+  unsigned is_epollout : 1;       // epoll: EPOLLOUT interest is registered
+  unsigned is_sendfile : 1;       // Wait for writability: sending a file
+  unsigned is_coalescing : 1;     // Flush once per poll, see mgr->coalesce
+  unsigned is_coalesced : 1;      // Flush is deferred to the end of poll (internal)
 };
 
 // Runs one iteration of the event loop.
@@ -112,6 +177,19 @@ struct mg_connection {
 //   Waits up to ms milliseconds for I/O events; use ms=0 to return
 //   immediately. Calls event handlers for ready connections and fires expired
 //   timers. Call repeatedly from the main loop or a dedicated network task.
+//   By default, every connection gets MG_EV_POLL on every call. With many
+//   idle sockets, set mgr->poll_opt_in: then idle connections - nothing
+//   to read, write or close - are skipped entirely, and only those with
+//   c->is_polled set keep getting MG_EV_POLL, e.g. to run their timeouts.
+//   With MG_ENABLE_EPOLL=1, only ready sockets are reported by the kernel,
+//   and EPOLLOUT interest is changed only when the send buffer becomes
+//   empty or non-empty, so the cost of an idle connection is a few flag tests
+//   Set mgr->coalesce, or c->is_coalescing for a single connection, to batch
+//   small writes: output of such connections is flushed after all handlers
+//   of the iteration have run, with one send call, even if it was produced
+//   by other connections' handlers, and the built-in TLS stack packs it in
+//   records of up to 16K instead of MG_IO_SIZE. mgr->io counts send calls
+//   and TLS records. The built-in TCP/IP stack always flushes last
 void mg_mgr_poll(struct mg_mgr *, int ms);
 
 // Initialises an event manager before use.
@@ -141,6 +219,8 @@ void mg_mgr_free(struct mg_mgr *);
 
 // Creates a listening connection on url (e.g. "tcp://0.0.0.0:8080").
 // Fires MG_EV_OPEN on the listener, then MG_EV_ACCEPT for each new client.
+// With MG_ENABLE_REUSEPORT=1, several managers may listen on the same url;
+// the OS then distributes accepted connections between them.
 // Returns NULL on error.
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
@@ -172,6 +252,14 @@ void mg_connect_resolved(struct mg_connection *);
 // Data is sent asynchronously by the next mg_mgr_poll() call.
 bool mg_send(struct mg_connection *, const void *, size_t);
 
+// Like mg_send(), but queues buf/len without copying it. buf must stay valid
+// until fn(fn_data) is called: when the data is sent, or the connection is
+// closed. fn may be NULL. Data sent later with mg_send() / mg_printf() goes
+// after buf. Plain TCP sockets flush c->send and queued buffers with one
+// writev()-style call. Returns false on OOM; then fn is not called.
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data);
+
 // Formats data and appends it to a connection send buffer.
 //
 // Returns:
@@ -211,11 +299,24 @@ void mg_close_conn(struct mg_connection *c);
 // Returns false on error.
 bool mg_open_listener(struct mg_connection *c, const char *url);
 
+// Internal: housekeeping used by the network stacks. Not for application use.
+struct mg_connection *mg_conn_by_id(struct mg_mgr *, unsigned long id);
+struct mg_connection *mg_conn_by_tuple(struct mg_mgr *, uint16_t port,
+                                       const struct mg_addr *rem);
+void mg_conn_index_tuple(struct mg_connection *);
+void mg_conn_index_del(struct mg_connection *);
+void mg_pool_iobuf(struct mg_mgr *, struct mg_iobuf *);
+void mg_mgr_shrink(struct mg_mgr *, uint64_t now);
+void mg_iouring_init(struct mg_mgr *);
+void mg_iouring_free(struct mg_mgr *);
+
 // Thread-safe wakeup: fires MG_EV_WAKEUP on the connection whose id matches,
 // with ev_data pointing to an mg_str containing buf/len.
 // Requires mg_wakeup_init() to have been called first.
 // Returns false if the pipe is not initialised or conn_id is 0.
-// Safe to call from any thread or interrupt context.
+// Safe to call from any thread or interrupt context, including an event
+// handler of another manager: that is how event loops running in different
+// threads pass messages to each other, see tutorials/core/multi-reactor.
 bool mg_wakeup(struct mg_mgr *, unsigned long id, const void *buf, size_t len);
 
 // Initialises the internal socketpair used by mg_wakeup(). Call once after
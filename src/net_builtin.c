@@ -558,6 +558,19 @@ static void tx_dhcp_discover(struct mg_tcpip_if *ifp) {
 static struct mg_connection *getpeer(struct mg_mgr *mgr, struct pkt *pkt,
                                      bool lsn) {
   struct mg_connection *c = NULL;
+  if (pkt->tcp != NULL && !lsn) {  // Established TCP: look up by 4-tuple
+    struct mg_addr rem;
+    memset(&rem, 0, sizeof(rem));
+    rem.port = pkt->tcp->sport;
+#if MG_ENABLE_IPV6
+    if (pkt->ip6 != NULL) {
+      rem.addr.ip6[0] = pkt->ip6->src[0], rem.addr.ip6[1] = pkt->ip6->src[1];
+      rem.is_ip6 = true;
+    } else
+#endif
+      rem.addr.ip4 = pkt->ip->src;
+    return mg_conn_by_tuple(mgr, pkt->tcp->dport, &rem);
+  }
   for (c = mgr->conns; c != NULL; c = c->next) {
     if (c->is_arplooking && pkt->arp && pkt->arp->spa == c->rem.addr.ip4) break;
 #if MG_ENABLE_IPV6
@@ -1197,8 +1210,7 @@ static bool rx_udp(struct mg_tcpip_if *ifp, struct pkt *pkt) {
   memcpy(s->mac, l2addr, sizeof(s->mac));
   if (c->recv.len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "max_recv_buf_size reached");
-  } else if (c->recv.size - c->recv.len < pkt->pay.len &&
-             !mg_iobuf_resize(&c->recv, c->recv.len + pkt->pay.len)) {
+  } else if (!mg_iobuf_reserve(&c->recv, pkt->pay.len)) {
     mg_error(c, "oom");
   } else {
     memcpy(&c->recv.buf[c->recv.len], pkt->pay.buf, pkt->pay.len);
@@ -1333,13 +1345,16 @@ static struct mg_connection *accept_conn(struct mg_connection *lsn,
   c->loc.port = lsn->loc.port;
   if ((l2addr = get_return_l2addr(lsn->mgr->ifp, &c->rem, false, pkt)) ==
       NULL) {
-    free(c);      // safety net for lousy networks, not actually needed
+    mg_conn_index_del(c);
+    lsn->mgr->pool.conns--;
+    mg_free(c);   // safety net for lousy networks, not actually needed
     return NULL;  // as path has already been checked at SYN (sending SYN+ACK)
   }
   memcpy(s->mac, l2addr, sizeof(s->mac));
   settmout(c, MIP_TTYPE_KEEPALIVE);
   MG_DEBUG(("%lu accepted %M", c->id, mg_print_ip_port, &c->rem));
   LIST_ADD_HEAD(struct mg_connection, &lsn->mgr->conns, c);
+  mg_conn_index_tuple(c);
   c->is_accepted = 1;
   c->is_hexdumping = lsn->is_hexdumping;
   c->pfn = lsn->pfn;
@@ -1406,6 +1421,7 @@ static bool udp_send(struct mg_connection *c, const void *buf, size_t len) {
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   struct connstate *s = (struct connstate *) (c + 1);
   len = trim_len(c, len);
+  c->mgr->io.sends++;
   if (c->is_udp) {
     if (!udp_send(c, buf, len)) return MG_IO_WAIT;
   } else {  // TCP, cap to peer's MSS and check window
@@ -1426,6 +1442,7 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
       if (s->ttype == MIP_TTYPE_ACK) settmout(c, MIP_TTYPE_KEEPALIVE);
     }
   }
+  c->mgr->io.bytes += len;
   return (long) len;
 }
 
@@ -1433,7 +1450,7 @@ static void handle_tls_recv(struct mg_connection *c) {
   size_t avail = mg_tls_pending(c);  // will change after mg_tls_recv()
   size_t min = avail > MG_MAX_RECV_SIZE ? MG_MAX_RECV_SIZE : avail;
   struct mg_iobuf *io = &c->recv;  // allocated on first avail > 0
-  if (io->size - io->len < min && !mg_iobuf_resize(io, io->len + min)) {
+  if (!mg_iobuf_reserve(io, min)) {
     mg_error(c, "oom");
   } else {
     // Decrypt data directly into c->recv. If io->buf = NULL or
@@ -1512,8 +1529,7 @@ static void read_conn(struct mg_connection *c, struct pkt *pkt) {
              mg_htonl(s->seq), mg_htonl(s->ack), "", 0);
     }
     return;  // drop it
-  } else if (io->size - io->len < pkt->pay.len &&
-             !mg_iobuf_resize(io, io->len + pkt->pay.len)) {
+  } else if (!mg_iobuf_reserve(io, pkt->pay.len)) {
     mg_error(c, "oom");
     return;  // drop it
   }
@@ -2176,6 +2192,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   MG_DEBUG(("%lu %M -> %M", c->id, mg_print_ip_port, &c->loc, mg_print_ip_port,
             &c->rem));
   mg_call(c, MG_EV_RESOLVE, NULL);
+  if (!c->is_udp) mg_conn_index_tuple(c);
   c->is_connecting = 1;
   if (c->is_udp && (l2addr = tcpip_mapip(ifp, &c->rem)) != NULL) {
     struct connstate *s = (struct connstate *) (c + 1);
@@ -2235,7 +2252,7 @@ static void write_conn(struct mg_connection *c) {
   if (len == MG_IO_ERR) {
     mg_error(c, "tx err");
   } else if (len > 0) {
-    mg_iobuf_del(&c->send, 0, (size_t) len);
+    mg_iobuf_skip(&c->send, (size_t) len);
     mg_call(c, MG_EV_WRITE, &len);
   }
 }
@@ -2264,7 +2281,12 @@ static bool can_write(struct mg_connection *c) {
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now = mg_millis();
+#if MG_ENABLE_TIMER_WHEEL
+  mg_timer_wheel_poll(&mgr->wheel, &mgr->timers, now);
+#else
   mg_timer_poll(&mgr->timers, now);
+#endif
+  mg_mgr_shrink(mgr, now);
   mg_ota_poll(mgr);
   if (mgr->ifp == NULL || mgr->ifp->driver == NULL) return;
   mg_tcpip_poll(mgr->ifp, now);
@@ -2311,6 +2333,7 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     len = trim_len(c, len);  // Trimming length if necessary
     res = udp_send(c, buf, len);
   } else {
+    mg_pool_iobuf(c->mgr, &c->send);
     res = len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
     // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
     // so far recoverable, let the caller decide
@@ -2318,6 +2341,14 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
   return res;
 }
 
+// The built-in stack sends from c->send only, so take a copy
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data) {
+  bool res = mg_send(c, buf, len);
+  if (res && fn != NULL) fn(fn_data);
+  return res;
+}
+
 uint8_t mcast_addr[6] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0xfb};
 void mg_multicast_add(struct mg_connection *c, char *ip) {
   (void) ip;  // ip4/6_mcastmac(mcast_mac, &ip); ipv6 param
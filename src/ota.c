@@ -129,6 +129,7 @@ static void s_version_fn(struct mg_connection *c, int ev, void *ev_data) {
         s_ota = NULL;
       } else {
         *(uint64_t *) fc->data = mg_millis() + 5 * 1000;  // Set expiration
+        fc->is_polled = 1;
       }
     }
     c->is_closing = 1;
@@ -207,6 +208,7 @@ void mg_ota_url_check(struct mg_mgr *mgr, const char *json_url,
     } else {
       s_ota->fn = fn;
       *(uint64_t *) c->data = mg_millis() + 5 * 1000;  // Set expiration
+      c->is_polled = 1;
     }
   }
 }
@@ -83,7 +83,10 @@ void mg_sntp_request(struct mg_connection *c) {
 
 struct mg_connection *mg_sntp_connect(struct mg_mgr *mgr, const char *url,
                                       mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c;
   if (url == NULL) url = "udp://time.google.com:123";
-  return mg_connect_svc(mgr, url, fn, fn_data, sntp_cb, NULL);
+  c = mg_connect_svc(mgr, url, fn, fn_data, sntp_cb, NULL);
+  if (c != NULL) c->is_polled = 1;  // sntp_cb expires requests on MG_EV_POLL
+  return c;
 }
 
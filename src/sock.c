@@ -118,6 +118,252 @@ void mg_getlocaddr(struct mg_connection *c, struct mg_addr *to,
   closesocket(fd);
 }
 
+#if MG_ENABLE_IOURING
+// io_uring backend. The kernel accepts connections and receives data by
+// itself (multishot operations), picking receive buffers from a shared ring.
+// Sends are queued and submitted in a batch, so mg_iotest() makes a single
+// io_uring_enter() call: submit everything queued, wait for completions.
+// Completions are copied to per-connection buffers, which recv_raw() and
+// mg_io_send() use instead of recv() and send()
+#define IOU_RECV 1
+#define IOU_SEND 2
+#define IOU_ACCEPT 3
+#define IOU_POLL 4
+#define IOU_QMAX (64 * 1024)  // Max data buffered per connection and direction
+
+struct iou_conn {           // Per-connection state. After the connection is
+  struct iou_conn *next;    // closed, lives in iou::closed until the kernel
+  struct mg_connection *c;  // completes all operations. NULL when closed
+  int fd;                   // Socket to close when refs drop to 0, or -1
+  int refs;                 // Operations in flight
+  unsigned ops;             // Armed operations, bitmask of 1 << IOU_*
+  bool eof;                 // Peer has closed, or receive has failed
+  bool cancelling;          // Multishot receive is being cancelled
+  struct mg_iobuf rx;       // Received by the kernel, read by recv_raw()
+  struct mg_iobuf tx;       // Being sent by the kernel
+  struct mg_iobuf txq;      // Queued by mg_io_send(), sent after tx
+};
+
+struct iou {
+  int fd;                       // io_uring file descriptor
+  unsigned sq_entries;          // Submission queue size
+  unsigned pending;             // Submissions queued, not yet submitted
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;        // Mapped rings
+  size_t sq_len, cq_len;        // Sizes of the mapped rings
+  struct io_uring_buf_ring *br;  // Provided receive buffers
+  uint16_t br_tail;             // Our copy of br->tail
+  uint8_t *bufs;                // MG_IOURING_BUFS * MG_IOURING_BUF_SIZE
+  struct iou_conn *closed;      // Closed connections with operations in flight
+};
+
+static int iou_enter(struct iou *r, bool wait, int ms) {
+  struct __kernel_timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+  struct io_uring_getevents_arg arg;
+  unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+  int n;
+  memset(&arg, 0, sizeof(arg));
+  if (ms >= 0) arg.ts = (uint64_t) (size_t) &ts;
+  n = (int) syscall(__NR_io_uring_enter, r->fd, r->pending, wait ? 1 : 0,
+                    flags, &arg, sizeof(arg));
+  if (n > 0) r->pending -= (unsigned) n;
+  if (n < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    MG_ERROR(("io_uring_enter: %d", errno));
+  }
+  return n;
+}
+
+// Get a zeroed submission entry. Operation op on st completes with a CQE
+static struct io_uring_sqe *iou_sqe(struct iou *r, struct iou_conn *st,
+                                    unsigned op) {
+  struct io_uring_sqe *sqe = NULL;
+  unsigned tail = *r->sq_tail, idx;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    iou_enter(r, false, 0);  // Queue is full, submit what we have
+  }
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) < r->sq_entries) {
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (size_t) st | op;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    if (st != NULL) st->refs++;
+  } else {
+    MG_ERROR(("io_uring submission queue is full"));
+  }
+  return sqe;
+}
+
+// Give a receive buffer back to the kernel
+static void iou_buf_add(struct iou *r, uint16_t bid) {
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & (MG_IOURING_BUFS - 1)];
+  b->addr = (uint64_t) (size_t) &r->bufs[(size_t) bid * MG_IOURING_BUF_SIZE];
+  b->len = MG_IOURING_BUF_SIZE;
+  b->bid = bid;
+  r->br_tail++;
+  __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void iou_arm(struct iou *r, struct iou_conn *st, unsigned op,
+                    unsigned events) {
+  struct io_uring_sqe *sqe = iou_sqe(r, st, op);
+  if (sqe == NULL) return;
+  sqe->fd = (int) (size_t) st->c->fd;
+  if (op == IOU_ACCEPT) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  } else if (op == IOU_RECV) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = events;
+  }
+  st->ops |= 1U << op;
+}
+
+static void iou_cancel(struct iou *r, struct iou_conn *st, unsigned op) {
+  struct io_uring_sqe *sqe;
+  if ((st->ops & (1U << op)) && (sqe = iou_sqe(r, NULL, 0)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (size_t) st | op;
+  }
+}
+
+// Send tx, or the queued data if tx is done. One send in flight at a time
+static void iou_flush(struct iou *r, struct iou_conn *st) {
+  struct io_uring_sqe *sqe;
+  if (st->ops & (1U << IOU_SEND)) return;
+  if (st->tx.len == 0) {
+    struct mg_iobuf tmp = st->tx;
+    st->tx = st->txq, st->txq = tmp;
+  }
+  if (st->tx.len > 0 && (sqe = iou_sqe(r, st, IOU_SEND)) != NULL) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = st->fd >= 0 ? st->fd : (int) (size_t) st->c->fd;
+    sqe->addr = (uint64_t) (size_t) st->tx.buf;
+    sqe->len = (uint32_t) st->tx.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    st->ops |= 1U << IOU_SEND;
+  }
+}
+
+static struct iou_conn *iou_conn(struct mg_connection *c) {
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  if (st == NULL && (st = (struct iou_conn *) mg_calloc(1, sizeof(*st)))) {
+    st->c = c;
+    st->fd = -1;
+    st->rx.align = st->tx.align = st->txq.align = MG_IO_SIZE;
+    c->iou = st;
+  }
+  return st;
+}
+
+// TCP connections receive with io_uring. Others, like UDP, are polled
+static bool iou_stream(const struct mg_connection *c) {
+  return c->mgr->iou != NULL && !c->is_udp && !c->is_listening &&
+         (c->is_accepted || c->is_client);
+}
+
+static long iou_recv(struct mg_connection *c, void *buf, size_t len) {
+  struct iou_conn *st = iou_conn(c);
+  if (st == NULL) return MG_IO_ERR;
+  if (st->rx.len == 0) return st->eof ? MG_IO_ERR : MG_IO_WAIT;
+  if (len > st->rx.len) len = st->rx.len;
+  memcpy(buf, st->rx.buf, len);
+  mg_iobuf_skip(&st->rx, len);
+  return (long) len;
+}
+
+static long iou_send(struct mg_connection *c, const void *buf, size_t len) {
+  struct iou_conn *st = iou_conn(c);
+  if (st == NULL) return MG_IO_ERR;
+  if (st->txq.len >= IOU_QMAX) return MG_IO_WAIT;
+  if (len > IOU_QMAX - st->txq.len) len = IOU_QMAX - st->txq.len;
+  if (mg_iobuf_add(&st->txq, st->txq.len, buf, len) == 0) return MG_IO_WAIT;
+  iou_flush((struct iou *) c->mgr->iou, st);
+  return (long) len;
+}
+
+static void iou_release(struct iou *r, struct iou_conn *st) {
+  LIST_DELETE(struct iou_conn, &r->closed, st);
+  if (st->fd >= 0) closesocket(st->fd);
+  mg_iobuf_free(&st->rx);
+  mg_iobuf_free(&st->tx);
+  mg_iobuf_free(&st->txq);
+  mg_free(st);
+}
+
+// Connection is closing: cancel receives. Returns true if the kernel is
+// still sending queued data. Then the socket is closed when it is done
+static bool iou_close(struct mg_connection *c) {
+  struct iou *r = (struct iou *) c->mgr->iou;
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  bool sending;
+  if (st == NULL || r == NULL) return false;
+  iou_cancel(r, st, IOU_RECV);
+  iou_cancel(r, st, IOU_ACCEPT);
+  iou_cancel(r, st, IOU_POLL);
+  c->iou = NULL;
+  st->c = NULL;
+  st->rx.len = 0;
+  sending = st->tx.len > 0 || st->txq.len > 0;
+  st->fd = sending ? (int) (size_t) c->fd : -1;
+  LIST_ADD_HEAD(struct iou_conn, &r->closed, st);
+  if (st->refs == 0) iou_release(r, st);
+  return sending;
+}
+#endif
+
+// mg_send_ref() buffer. Goes to the socket after pos bytes of c->send
+struct sref {
+  struct sref *next;
+  const char *buf;       // Caller-owned data
+  size_t len;            // Data length
+  size_t ofs;            // Bytes of buf already sent
+  size_t pos;            // Offset in c->send
+  void (*fn)(void *);    // Called when buf is no longer needed
+  void *fn_data;
+};
+
+static void sref_done(struct mg_connection *c, struct sref *r) {
+  c->send_refs = r->next;
+  c->send_refs_len -= r->len - r->ofs;
+  if (r->fn != NULL) r->fn(r->fn_data);
+  mg_free(r);
+}
+
+// n bytes got sent: drop them from c->send and the queued buffers
+static void sent(struct mg_connection *c, size_t n) {
+  struct sref *r;
+  while (n > 0 && (r = (struct sref *) c->send_refs) != NULL) {
+    if (r->pos > 0) {
+      size_t k = n < r->pos ? n : r->pos;
+      mg_iobuf_skip(&c->send, k);
+      for (; r != NULL; r = r->next) r->pos -= k;
+      n -= k;
+    } else {
+      size_t k = n < r->len - r->ofs ? n : r->len - r->ofs;
+      c->send_refs_len -= k;
+      if ((r->ofs += k) == r->len) sref_done(c, r);
+      n -= k;
+    }
+  }
+  if (n > 0) mg_iobuf_skip(&c->send, n);
+}
+
+static bool has_output(const struct mg_connection *c) {
+  return c->send.len > 0 || c->send_refs != NULL;
+}
+
 static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
   if (n == MG_IO_WAIT) {
     // Do nothing
@@ -133,9 +379,9 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
       c->recv.len += (size_t) n;
       mg_call(c, MG_EV_READ, &n);
     } else {
-      mg_iobuf_del(&c->send, 0, (size_t) n);
+      sent(c, (size_t) n);
       // if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
-      if (c->send.len == 0) {
+      if (!has_output(c)) {
         MG_EPOLL_MOD(c, 0);
       }
       mg_call(c, MG_EV_WRITE, &n);
@@ -143,8 +389,18 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
   }
 }
 
+// Count a send call and the bytes it took in mgr->io
+static long iostat(struct mg_connection *c, long n) {
+  c->mgr->io.sends++;
+  if (n > 0) c->mgr->io.bytes += (size_t) n;
+  return n;
+}
+
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   long n;
+#if MG_ENABLE_IOURING
+  if (iou_stream(c)) return iostat(c, iou_send(c, buf, len));
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -153,6 +409,7 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
+  iostat(c, n);
   MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
   if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
   if (MG_SOCK_RESET(n)) return MG_IO_ERR;  // See #1507, #3031
@@ -160,6 +417,18 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   return n;
 }
 
+#if MG_ENABLE_SENDFILE
+// Send up to len bytes of file fd, starting at its current offset, straight
+// from the page cache. Caller sets c->is_sendfile to wait for writability
+long mg_io_sendfile(struct mg_connection *c, int fd, size_t len) {
+  long n = iostat(c, (long) sendfile(FD(c), fd, NULL, len));
+  MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
+  if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
+  if (n < 0) return MG_IO_ERR;
+  return n;
+}
+#endif
+
 bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
   if (c->is_udp) {
     long n = mg_io_send(c, buf, len);
@@ -168,10 +437,35 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
-    return len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
+    bool ok;
+    mg_pool_iobuf(c->mgr, &c->send);
+    ok = len == 0 || mg_iobuf_add(&c->send, c->send.len, buf, len) > 0;
     // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
     // so far recoverable, let the caller decide
+    if (c->send.len > 0) {
+      MG_EPOLL_MOD(c, 1);
+    }
+    return ok;
+  }
+}
+
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *fn_data) {
+  struct sref *r, **p;
+  if (c->is_udp || c->is_http2 || len == 0) {  // Datagrams, streams: copy
+    bool ok = mg_send(c, buf, len);
+    if (ok && fn != NULL) fn(fn_data);
+    return ok;
   }
+  if ((r = (struct sref *) mg_calloc(1, sizeof(*r))) == NULL) return false;
+  r->buf = (const char *) buf, r->len = len, r->pos = c->send.len;
+  r->fn = fn, r->fn_data = fn_data;
+  c->send_refs_len += len;
+  p = (struct sref **) &c->send_refs;
+  while (*p != NULL) p = &(*p)->next;
+  *p = r;
+  MG_EPOLL_MOD(c, 1);
+  return true;
 }
 
 static void mg_set_non_blocking_mode(MG_SOCKET_TYPE fd) {
@@ -266,6 +560,13 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       // won't work! (setsockopt will return EINVAL)
       MG_ERROR(("setsockopt(SO_REUSEADDR): %d", MG_SOCK_ERR(rc)));
 #endif
+#if MG_ENABLE_REUSEPORT && defined(SO_REUSEPORT)
+    } else if ((rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                                sizeof(on))) != 0) {
+      // Several managers, each polled by its own thread, can listen on the
+      // same address. The kernel spreads incoming connections between them
+      MG_ERROR(("setsockopt(SO_REUSEPORT): %d", MG_SOCK_ERR(rc)));
+#endif
 #if MG_IPV6_V6ONLY
       // Bind only to the V6 address, not V4 address on this port
     } else if (c->loc.is_ip6 &&
@@ -295,6 +596,9 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
 
 static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
   long n = 0;
+#if MG_ENABLE_IOURING
+  if (iou_stream(c)) return iou_recv(c, buf, len);
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -310,12 +614,21 @@ static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
   return n;
 }
 
+// Grow a receive buffer, but not beyond MG_MAX_RECV_SIZE
+static bool iogrow(struct mg_iobuf *io) {
+  size_t max = MG_MAX_RECV_SIZE;
+  if (MG_IO_GROW_MAX > 0 && io->size < max && io->size >= max / 2) {
+    return mg_iobuf_resize(io, max);
+  }
+  return mg_iobuf_reserve(io, MG_IO_SIZE);
+}
+
 static bool ioalloc(struct mg_connection *c, struct mg_iobuf *io) {
   bool res = false;
+  mg_pool_iobuf(c->mgr, io);
   if (io->len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "MG_MAX_RECV_SIZE");
-  } else if (io->size <= io->len &&
-             !mg_iobuf_resize(io, io->size + MG_IO_SIZE)) {
+  } else if (io->size <= io->len && !iogrow(io)) {
     mg_error(c, "OOM");
   } else {
     res = true;
@@ -362,10 +675,71 @@ static void read_conn(struct mg_connection *c) {
   iolog(c, (char *) &c->recv.buf[c->recv.len], n, true);
 }
 
+#define MG_IOV_MAX 16
+
+// Split c->send and queued mg_send_ref() buffers into segments, in order
+static size_t segments(struct mg_connection *c, struct mg_str *seg) {
+  struct sref *r;
+  size_t n = 0, ofs = 0;
+  for (r = (struct sref *) c->send_refs; r != NULL; r = r->next) {
+    if (r->pos > ofs && n < MG_IOV_MAX) {
+      seg[n++] = mg_str_n((char *) c->send.buf + ofs, r->pos - ofs);
+    }
+    if (n < MG_IOV_MAX) seg[n++] = mg_str_n(r->buf + r->ofs, r->len - r->ofs);
+    ofs = r->pos;
+  }
+  if (c->send.len > ofs && n < MG_IOV_MAX) {
+    seg[n++] = mg_str_n((char *) c->send.buf + ofs, c->send.len - ofs);
+  }
+  return n;
+}
+
+// Send all segments with a single system call
+static long send_segments(struct mg_connection *c, struct mg_str *seg,
+                          size_t n) {
+#if MG_ARCH == MG_ARCH_UNIX
+  struct iovec iov[MG_IOV_MAX];
+  struct msghdr msg;
+  long res;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = seg[i].buf;
+    iov[i].iov_len = seg[i].len;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  res = iostat(c, (long) sendmsg(FD(c), &msg, MSG_NONBLOCKING));
+  MG_VERBOSE(("%lu %ld %d", c->id, res, MG_SOCK_ERR(res)));
+  if (MG_SOCK_PENDING(res)) return MG_IO_WAIT;
+  if (res <= 0) return MG_IO_ERR;
+  return res;
+#else
+  (void) n;
+  return mg_io_send(c, seg[0].buf, seg[0].len);
+#endif
+}
+
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+  long n;
+  if (c->send_refs != NULL) {
+    struct mg_str seg[MG_IOV_MAX];
+    size_t nseg;
+    seg[0] = mg_str_n(buf, len);
+    nseg = segments(c, seg);
+    buf = seg[0].buf, len = seg[0].len;
+#if MG_ENABLE_IOURING
+    if (iou_stream(c)) nseg = 1;  // io_uring copies data anyway
+#endif
+    if (c->is_tls || c->is_hexdumping) nseg = 1;
+    if (nseg > 1) {
+      iolog(c, buf, send_segments(c, seg, nseg), false);
+      return;
+    }
+  }
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
   // TODO(): mg_tls_send() may return 0 forever on steady OOM
   MG_DEBUG(("%lu %ld snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
@@ -374,11 +748,15 @@ static void write_conn(struct mg_connection *c) {
 }
 
 static void close_conn(struct mg_connection *c) {
+  while (c->send_refs != NULL) sref_done(c, (struct sref *) c->send_refs);
   if (FD(c) != MG_INVALID_SOCKET) {
 #if MG_ENABLE_EPOLL
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
 #endif
-    closesocket(FD(c));
+#if MG_ENABLE_IOURING
+    if (iou_close(c) == false)  // Otherwise, closed when data is sent
+#endif
+      closesocket(FD(c));
 #if MG_ENABLE_FREERTOS_TCP
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
 #endif
@@ -454,6 +832,7 @@ void mg_connect_resolved(struct mg_connection *c) {
     } else if (MG_SOCK_PENDING(rc)) {    // Need to wait for TCP handshake
       MG_DEBUG(("%lu %ld -> %M pend", c->id, c->fd, mg_print_ip_port, &c->rem));
       c->is_connecting = 1;
+      MG_EPOLL_MOD(c, 1);
     } else {
       mg_error(c, "connect: %d", MG_SOCK_ERR(rc));
     }
@@ -478,30 +857,24 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Set up a connection for the socket fd, accepted by the listener lsn
+static void accept_fd(struct mg_mgr *mgr, struct mg_connection *lsn,
+                      MG_SOCKET_TYPE fd, union usa *usa, socklen_t sa_len) {
   struct mg_connection *c = NULL;
-  union usa usa;
-  socklen_t sa_len = sizeof(usa);
-  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
-  if (fd == MG_INVALID_SOCKET) {
-#if MG_ARCH == MG_ARCH_THREADX || defined(__ECOS)
-    // NetxDuo, in non-block socket mode can mark listening socket readable
-    // even it is not. See comment for 'select' func implementation in
-    // nx_bsd.c That's not an error, just should try later
-    if (errno != EAGAIN)
-#endif
-      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
 #if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
-    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL
-  } else if ((long) fd >= FD_SETSIZE) {
+    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL && \
+    !MG_ENABLE_IOURING
+  if ((long) fd >= FD_SETSIZE) {
     MG_ERROR(("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
+    return;
+  }
 #endif
-  } else if ((c = mg_alloc_conn(mgr)) == NULL) {
+  if ((c = mg_alloc_conn(mgr)) == NULL) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
   } else {
-    tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
+    tomgaddr(usa, &c->rem, sa_len != sizeof(usa->sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
@@ -523,12 +896,30 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   }
 }
 
+static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  union usa usa;
+  socklen_t sa_len = sizeof(usa);
+  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
+  if (fd == MG_INVALID_SOCKET) {
+#if MG_ARCH == MG_ARCH_THREADX || defined(__ECOS)
+    // NetxDuo, in non-block socket mode can mark listening socket readable
+    // even it is not. See comment for 'select' func implementation in
+    // nx_bsd.c That's not an error, just should try later
+    if (errno != EAGAIN)
+#endif
+      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
+  } else {
+    accept_fd(mgr, lsn, fd, &usa, sa_len);
+  }
+}
+
 static bool can_read(const struct mg_connection *c) {
   return c->is_full == false;
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting || (has_output(c) && c->is_tls_hs == 0) ||
+         c->is_sendfile;
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -536,6 +927,197 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+#if MG_ENABLE_IOURING
+static void iou_cqe(struct mg_mgr *mgr, struct io_uring_cqe *cqe) {
+  struct iou *r = (struct iou *) mgr->iou;
+  struct iou_conn *st = (struct iou_conn *) (size_t) (cqe->user_data & ~(uint64_t) 7);
+  unsigned op = (unsigned) (cqe->user_data & 7);
+  struct mg_connection *c;
+  if (st == NULL) return;  // Cancel request done
+  c = st->c;
+  if (op == IOU_SEND) {
+    st->ops &= ~(1U << IOU_SEND);
+    if (cqe->res < 0) {
+      if (c != NULL) mg_error(c, "send: %d", -cqe->res);
+      st->tx.len = st->txq.len = 0;
+    } else {
+      mg_iobuf_skip(&st->tx, (size_t) cqe->res);  // Resend what's left
+    }
+    iou_flush(r, st);
+  } else {
+    if (op == IOU_RECV) {
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8_t *buf = &r->bufs[(size_t) bid * MG_IOURING_BUF_SIZE];
+        if (c != NULL && cqe->res > 0 &&
+            mg_iobuf_add(&st->rx, st->rx.len, buf, (size_t) cqe->res) == 0) {
+          mg_error(c, "OOM");
+        }
+        iou_buf_add(r, bid);
+      }
+      // -ENOBUFS: out of receive buffers, mg_mgr_poll() re-arms
+      if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                            cqe->res != -ECANCELED)) {
+        st->eof = true;
+      }
+      if (c != NULL && can_read(c)) c->is_readable = 1;
+    } else if (op == IOU_ACCEPT) {
+      if (cqe->res >= 0 && c != NULL && !c->is_closing) {
+        union usa usa;
+        socklen_t slen = sizeof(usa);
+        memset(&usa, 0, sizeof(usa));
+        getpeername(cqe->res, &usa.sa, &slen);
+        accept_fd(mgr, c, cqe->res, &usa, slen);
+      } else if (cqe->res >= 0) {
+        closesocket(cqe->res);
+      } else if (c != NULL && cqe->res != -ECANCELED) {
+        MG_ERROR(("%lu accept failed, errno %d", c->id, -cqe->res));
+      }
+    } else if (op == IOU_POLL && c != NULL && cqe->res > 0) {
+      if (cqe->res & POLLERR) {
+        mg_error(c, "socket error");
+      } else {
+        bool rd = cqe->res & (POLLIN | POLLHUP);
+        c->is_readable = can_read(c) && rd ? 1U : 0;
+        c->is_writable = cqe->res & POLLOUT ? 1U : 0;
+      }
+    }
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+      st->ops &= ~(1U << op);
+      if (op == IOU_RECV) st->cancelling = false;
+    }
+  }
+  if ((cqe->flags & IORING_CQE_F_MORE) == 0) st->refs--;
+  if (st->c == NULL && st->refs == 0) iou_release(r, st);
+}
+
+// TCP connections can send while there is room in the send queue
+static bool iou_writable(struct mg_connection *c) {
+  struct iou_conn *st = (struct iou_conn *) c->iou;
+  if (!iou_stream(c)) return c->is_writable;
+  return can_write(c) && (st == NULL || st->txq.len < IOU_QMAX);
+}
+
+// Called by mg_mgr_poll() for every connection it has processed: arm
+// operations that are not armed yet, and reset flags
+static void iou_sync(struct mg_connection *c) {
+  struct iou *r = (struct iou *) c->mgr->iou;
+  struct iou_conn *st;
+  c->is_readable = c->is_writable = 0;
+  if (r == NULL || c->is_resolving || FD(c) == MG_INVALID_SOCKET) return;
+  if ((st = iou_conn(c)) == NULL) return;
+  if (c->is_listening && !c->is_udp) {
+    if (!(st->ops & (1U << IOU_ACCEPT))) iou_arm(r, st, IOU_ACCEPT, 0);
+  } else if (c->is_connecting) {
+    if (!(st->ops & (1U << IOU_POLL))) iou_arm(r, st, IOU_POLL, POLLOUT);
+  } else if (!iou_stream(c)) {
+    if (!(st->ops & (1U << IOU_POLL)) && can_read(c)) {
+      iou_arm(r, st, IOU_POLL, POLLIN);
+    }
+  } else {
+    if (iou_writable(c)) c->mgr->epoll_busy = true;  // Send on next poll
+    if (!can_read(c) || st->rx.len >= IOU_QMAX) {
+      // Stop receiving until the application catches up
+      if ((st->ops & (1U << IOU_RECV)) && !st->cancelling) {
+        iou_cancel(r, st, IOU_RECV);
+        st->cancelling = true;
+      }
+    } else if (!(st->ops & (1U << IOU_RECV)) && !st->eof) {
+      iou_arm(r, st, IOU_RECV, 0);
+    }
+    if (can_read(c) && (st->rx.len > 0 || st->eof)) c->is_readable = 1;
+  }
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
+  if (c->is_readable) c->mgr->epoll_busy = true;  // Don't block
+}
+
+void mg_iouring_init(struct mg_mgr *mgr) {
+  struct iou *r = (struct iou *) mg_calloc(1, sizeof(*r));
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t brlen = MG_IOURING_BUFS * sizeof(struct io_uring_buf);
+  uint8_t *sq;
+  uint16_t i;
+  memset(&p, 0, sizeof(p));
+  memset(&reg, 0, sizeof(reg));
+  if (r == NULL) {
+    MG_ERROR(("OOM"));
+    return;
+  }
+  r->fd = (int) syscall(__NR_io_uring_setup, MG_IOURING_ENTRIES, &p);
+  if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+    MG_ERROR(("io_uring_setup: %d", errno));
+    if (r->fd >= 0) close(r->fd);
+    mg_free(r);
+    return;
+  }
+  r->sq_entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+                  ? r->sq_ptr
+                  : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe *) mmap(
+      NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  r->br = (struct io_uring_buf_ring *) mmap(NULL, brlen, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  r->bufs = (uint8_t *) mg_calloc(MG_IOURING_BUFS, MG_IOURING_BUF_SIZE);
+  mgr->iou = r;
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+      r->sqes == MAP_FAILED || r->br == MAP_FAILED || r->bufs == NULL) {
+    MG_ERROR(("io_uring init: %d", errno));
+    mg_iouring_free(mgr);
+    return;
+  }
+  sq = (uint8_t *) r->sq_ptr;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((uint8_t *) r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((uint8_t *) r->cq_ptr + p.cq_off.cqes);
+  reg.ring_addr = (uint64_t) (size_t) r->br;
+  reg.ring_entries = MG_IOURING_BUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) != 0) {
+    MG_ERROR(("io_uring buffer ring: %d", errno));
+    mg_iouring_free(mgr);
+    return;
+  }
+  for (i = 0; i < MG_IOURING_BUFS; i++) iou_buf_add(r, i);
+}
+
+void mg_iouring_free(struct mg_mgr *mgr) {
+  struct iou *r = (struct iou *) mgr->iou;
+  size_t brlen = MG_IOURING_BUFS * sizeof(struct io_uring_buf);
+  if (r == NULL) return;
+  close(r->fd);  // Cancels all operations in flight
+  while (r->closed != NULL) iou_release(r, r->closed);
+  if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+  }
+  if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+  if (r->br != NULL && r->br != MAP_FAILED) munmap(r->br, brlen);
+  mg_free(r->bufs);
+  mg_free(r);
+  mgr->iou = NULL;
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
@@ -557,29 +1139,43 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                       eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
 #elif MG_ENABLE_EPOLL
-  size_t max = 1;
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
-    c->is_readable = c->is_writable = 0;
-    if (c->rtls.len > 0 || mg_tls_pending(c) > 0) ms = 1, c->is_readable = 1;
-    if (can_write(c)) MG_EPOLL_MOD(c, 1);
-    if (c->is_closing) ms = 1;
-    max++;
-  }
-  struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
-  int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
-  for (int i = 0; i < n; i++) {
+  // No walk over mgr->conns here. EPOLLOUT interest is kept in sync by
+  // MG_EPOLL_MOD() and flags are reset by mg_mgr_poll() after processing
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  int i, n;
+  if (mgr->epoll_busy) ms = 1;
+  n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms);
+  for (i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
     if (evs[i].events & EPOLLERR) {
       mg_error(c, "socket error");
-    } else if (c->is_readable == 0) {
-      bool rd = evs[i].events & (EPOLLIN | EPOLLHUP);
-      bool wr = evs[i].events & EPOLLOUT;
-      c->is_readable = can_read(c) && rd ? 1U : 0;
-      c->is_writable = can_write(c) && wr ? 1U : 0;
+    } else {  // Flags may be set already, e.g. by buffered TLS data
+      if ((evs[i].events & (EPOLLIN | EPOLLHUP)) && can_read(c)) {
+        c->is_readable = 1;
+      }
+      if ((evs[i].events & EPOLLOUT) && can_write(c)) c->is_writable = 1;
       if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
     }
   }
   (void) skip_iotest;
+#elif MG_ENABLE_IOURING
+  struct iou *r = (struct iou *) mgr->iou;
+  unsigned head, tail;
+  if (r == NULL) {
+    poll(NULL, 0, ms);  // io_uring init has failed
+    return;
+  }
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  if (mgr->epoll_busy || head != tail) ms = 0;
+  // Submit what has been queued and wait, all in one system call
+  if (ms != 0 || r->pending > 0) iou_enter(r, ms != 0, ms);
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    iou_cqe(mgr, &r->cqes[head & *r->cq_mask]);
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  (void) skip_iotest;
 #elif MG_ENABLE_POLL
   nfds_t n = 0;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) n++;
@@ -709,13 +1305,11 @@ static void wufn(struct mg_connection *c, int ev, void *ev_data) {
     // MG_INFO(("Got data"));
     // mg_hexdump(c->recv.buf, c->recv.len);
     if (c->recv.len >= sizeof(*id)) {
-      struct mg_connection *t;
-      for (t = c->mgr->conns; t != NULL; t = t->next) {
-        if (t->id == *id) {
-          struct mg_str data = mg_str_n((char *) c->recv.buf + sizeof(*id),
-                                        c->recv.len - sizeof(*id));
-          mg_call(t, MG_EV_WAKEUP, &data);
-        }
+      struct mg_connection *t = mg_conn_by_id(c->mgr, *id);
+      if (t != NULL) {
+        struct mg_str data = mg_str_n((char *) c->recv.buf + sizeof(*id),
+                                      c->recv.len - sizeof(*id));
+        mg_call(t, MG_EV_WAKEUP, &data);
       }
     }
     c->recv.len = 0;  // Consume received data
@@ -760,18 +1354,68 @@ bool mg_wakeup(struct mg_mgr *mgr, unsigned long conn_id, const void *buf,
   return false;
 }
 
+// Nothing to read, write, flush or close, and no MG_EV_POLL requested
+static bool is_idle(const struct mg_connection *c) {
+#if MG_ENABLE_IOURING
+  if (c->iou == NULL) return false;  // New connection, nothing armed yet
+#endif
+  return c->is_polled == 0 && c->is_readable == 0 && c->is_writable == 0 &&
+         c->is_closing == 0 && c->is_draining == 0 && c->is_resp == 0 &&
+         c->is_tls_throttled == 0 && !has_output(c) && c->recv.len == 0 &&
+         c->rtls.len == 0;
+}
+
+// Write pending output, then close the connection or re-arm its events
+static void flush_conn(struct mg_connection *c, bool io) {
+  if (io) {
+#if MG_ENABLE_IOURING
+    c->is_writable = iou_writable(c) ? 1U : 0;
+#endif
+    if (c->is_writable && has_output(c)) write_conn(c);
+    if (c->is_tls && !c->is_tls_hs && !has_output(c)) mg_tls_flush(c);
+  }
+  if (c->is_draining && !has_output(c)) c->is_closing = 1;
+  if (c->is_closing) {
+    close_conn(c);
+    return;
+  }
+#if MG_ENABLE_EPOLL
+  MG_EPOLL_MOD(c, can_write(c));
+  c->is_readable = c->is_writable = 0;
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) {
+    c->is_readable = 1;
+    c->mgr->epoll_busy = true;  // Decrypted data is ready, don't block
+  }
+#elif MG_ENABLE_IOURING
+  iou_sync(c);
+#endif
+}
+
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
+  bool deferred = false;
   uint64_t now;
 
+#if MG_ENABLE_TIMER_WHEEL
+  ms = mg_timer_wheel_timeout(&mgr->wheel, mg_millis(), ms);  // Next timer
+#endif
   mg_iotest(mgr, ms);
   now = mg_millis();
+#if MG_ENABLE_TIMER_WHEEL
+  mg_timer_wheel_poll(&mgr->wheel, &mgr->timers, now);
+#else
   mg_timer_poll(&mgr->timers, now);
+#endif
+  mg_mgr_shrink(mgr, now);
   mg_ota_poll(mgr);
 
+#if MG_ENABLE_EPOLL || MG_ENABLE_IOURING
+  mgr->epoll_busy = false;
+#endif
   for (c = mgr->conns; c != NULL; c = tmp) {
-    bool is_resp = c->is_resp;
+    bool is_resp = c->is_resp, io = false, had_output = has_output(c);
     tmp = c->next;
+    if (mgr->poll_opt_in && is_idle(c)) continue;
     mg_call(c, MG_EV_POLL, &now);
     if (is_resp && !c->is_resp) {
       long n = 0;
@@ -790,12 +1434,24 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_readable || c->is_writable) connect_conn(c);
     } else {
       if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
-      if (c->is_tls && !c->is_tls_hs && c->send.len == 0) mg_tls_flush(c);
+      io = true;
     }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+    if (io && (mgr->coalesce || c->is_coalescing)) {
+      // Output queued during this iteration was not polled for, the socket
+      // is likely writable: try it. Otherwise, wait for the poller's word
+      if (!had_output && !c->is_tls_hs) c->is_writable = 1;
+      c->is_coalesced = 1;
+      deferred = true;
+    } else {
+      flush_conn(c, io);
+    }
+  }
+  // Now all handlers have run, flush what they have queued
+  for (c = mgr->conns; deferred && c != NULL; c = tmp) {
+    tmp = c->next;
+    if (c->is_coalesced == 0) continue;
+    c->is_coalesced = 0;
+    flush_conn(c, true);
   }
 }
 #endif
@@ -2,16 +2,39 @@
 #include "timer.h"
 #include "util.h"
 
+#define MG_WHEEL_BITS 6  // 64 slots per level
+#define MG_WHEEL_MASK 63
+
 void mg_timer_init(struct mg_timer **head, struct mg_timer *t, uint64_t ms,
                    unsigned flags, void (*fn)(void *), void *arg) {
   t->period_ms = ms, t->expire = 0;
   t->flags = flags, t->fn = fn, t->arg = arg, t->next = *head;
+  t->prev = head, t->wnext = NULL, t->wprev = NULL;
+  if (*head != NULL) (*head)->prev = &t->next;
   *head = t;
 }
 
+static void wheel_link(struct mg_timer **slot, struct mg_timer *t) {
+  t->wnext = *slot, t->wprev = slot;
+  if (*slot != NULL) (*slot)->wprev = &t->wnext;
+  *slot = t;
+}
+
+static void wheel_unlink(struct mg_timer *t) {
+  if (t->wprev == NULL) return;
+  if (t->wnext != NULL) t->wnext->wprev = t->wprev;
+  *t->wprev = t->wnext;
+  t->wnext = NULL, t->wprev = NULL;
+}
+
 void mg_timer_free(struct mg_timer **head, struct mg_timer *t) {
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+  if (t->prev != NULL) {
+    if (t->next != NULL) t->next->prev = t->prev;
+    *t->prev = t->next;
+    t->prev = NULL;
+  }
+  wheel_unlink(t);
+  (void) head;
 }
 
 // t: expiration time, prd: period, now: current time. Return true if expired
@@ -23,23 +46,155 @@ bool mg_timer_expired(uint64_t *t, uint64_t prd, uint64_t now) {
   return true;                                   // Expired, return true
 }
 
+// Call timer function if timer has expired. Return false if timer is deleted
+static bool timer_run(struct mg_timer **head, struct mg_timer *t,
+                      uint64_t now_ms) {
+  bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
+              !(t->flags & MG_TIMER_CALLED);  // Handle MG_TIMER_NOW only once
+  bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
+  if (!once && !expired) return true;
+  if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+    t->fn(t->arg);
+  }
+  t->flags |= MG_TIMER_CALLED;
+
+  // If this timer is not repeating and marked AUTODELETE, remove it
+  if (!(t->flags & MG_TIMER_REPEAT) && (t->flags & MG_TIMER_AUTODELETE)) {
+    mg_timer_free(head, t);
+    mg_free(t);
+    return false;
+  }
+  return true;
+}
+
 void mg_timer_poll(struct mg_timer **head, uint64_t now_ms) {
   struct mg_timer *t, *tmp;
   for (t = *head; t != NULL; t = tmp) {
-    bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
-                !(t->flags & MG_TIMER_CALLED);  // Handle MG_TIMER_NOW only once
-    bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
     tmp = t->next;
-    if (!once && !expired) continue;
-    if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
-      t->fn(t->arg);
+    timer_run(head, t, now_ms);
+  }
+}
+
+static unsigned wheel_ctz(uint64_t x) {
+  unsigned n = 0;
+  if ((x & 0xffffffffU) == 0) n += 32, x >>= 32;
+  if ((x & 0xffffU) == 0) n += 16, x >>= 16;
+  if ((x & 0xffU) == 0) n += 8, x >>= 8;
+  if ((x & 0xfU) == 0) n += 4, x >>= 4;
+  if ((x & 0x3U) == 0) n += 2, x >>= 2;
+  if ((x & 0x1U) == 0) n += 1;
+  return n;
+}
+
+// Put timer to the level whose slot span covers its expiration time. Timers
+// beyond the last level go to its farthest slot and get re-added on cascade
+static void wheel_add(struct mg_timer_wheel *w, struct mg_timer *t) {
+  uint64_t max = ((uint64_t) 1 << (MG_WHEEL_BITS * MG_TIMER_WHEEL_LEVELS)) - 1;
+  uint64_t when = t->expire < w->tick ? w->tick : t->expire;
+  unsigned level = 0, idx;
+  if (when - w->tick > max) when = w->tick + max;
+  while (level + 1 < MG_TIMER_WHEEL_LEVELS &&
+         when - w->tick >= ((uint64_t) 1 << (MG_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+  idx = (unsigned) (when >> (MG_WHEEL_BITS * level)) & MG_WHEEL_MASK;
+  wheel_link(&w->slots[level][idx], t);
+  w->bits[level] |= (uint64_t) 1 << idx;
+}
+
+static void wheel_take(struct mg_timer_wheel *w, unsigned level, unsigned idx,
+                       struct mg_timer **list) {
+  struct mg_timer *t;
+  while ((t = w->slots[level][idx]) != NULL) {
+    wheel_unlink(t);
+    wheel_link(list, t);
+  }
+  w->bits[level] &= ~((uint64_t) 1 << idx);
+}
+
+// Re-add timers of a coarse slot when the wheel reaches its span
+static void wheel_cascade(struct mg_timer_wheel *w, unsigned level,
+                          unsigned idx) {
+  struct mg_timer *t, *list = NULL;
+  wheel_take(w, level, idx, &list);
+  while ((t = list) != NULL) wheel_unlink(t), wheel_add(w, t);
+}
+
+// Return the first tick, starting from w->tick, when a non-empty slot is run
+// or cascaded. Return 0 if the wheel is empty
+static uint64_t wheel_next(struct mg_timer_wheel *w) {
+  uint64_t next = 0;
+  unsigned level;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    unsigned shift = MG_WHEEL_BITS * level;
+    uint64_t start = (w->tick + ((uint64_t) 1 << shift) - 1) >> shift;
+    uint64_t bits = w->bits[level], ahead, when;
+    unsigned idx = (unsigned) start & MG_WHEEL_MASK;
+    if (bits == 0) continue;
+    ahead = bits & (~(uint64_t) 0 << idx);
+    when = ahead ? start + wheel_ctz(ahead) - idx
+                 : start + MG_WHEEL_MASK + 1 - idx + wheel_ctz(bits);
+    when <<= shift;
+    if (next == 0 || when < next) next = when;
+  }
+  return next;
+}
+
+// Time went back. Re-add scheduled timers, resetting them as
+// mg_timer_expired() does
+static void wheel_rewind(struct mg_timer_wheel *w, struct mg_timer **head,
+                         uint64_t now) {
+  struct mg_timer *t;
+  memset(w, 0, sizeof(*w));
+  w->tick = now;
+  for (t = *head; t != NULL; t = t->next) {
+    if (t->wprev == NULL) continue;  // Not scheduled
+    t->wnext = NULL, t->wprev = NULL;
+    if (now + t->period_ms < t->expire) t->expire = 0;
+    wheel_add(w, t);
+  }
+}
+
+void mg_timer_wheel_poll(struct mg_timer_wheel *w, struct mg_timer **head,
+                         uint64_t now) {
+  struct mg_timer *t, *due = NULL;
+  if (now + 1 < w->tick) wheel_rewind(w, head, now);
+
+  // mg_timer_init() adds to the list head. New timers run on their first poll
+  for (t = *head; t != NULL && t->wprev == NULL && t->expire == 0 &&
+                  !(t->flags & MG_TIMER_CALLED);
+       t = t->next) {
+    wheel_link(&due, t);
+  }
+
+  // Advance the wheel, skipping ticks with nothing to run or cascade
+  while (w->tick <= now) {
+    uint64_t next, tick = w->tick;
+    unsigned level;
+    for (level = 1; level < MG_TIMER_WHEEL_LEVELS; level++) {
+      if ((tick >> (MG_WHEEL_BITS * (level - 1))) & MG_WHEEL_MASK) break;
+      wheel_cascade(w, level,
+                    (unsigned) (tick >> (MG_WHEEL_BITS * level)) & MG_WHEEL_MASK);
     }
-    t->flags |= MG_TIMER_CALLED;
+    wheel_take(w, 0, (unsigned) tick & MG_WHEEL_MASK, &due);
+    w->tick = tick + 1;
+    next = wheel_next(w);
+    w->tick = next == 0 || next > now ? now + 1 : next;
+  }
 
-    // If this timer is not repeating and marked AUTODELETE, remove it
-    if (!(t->flags & MG_TIMER_REPEAT) && (t->flags & MG_TIMER_AUTODELETE)) {
-      mg_timer_free(head, t);
-      mg_free(t);
+  while ((t = due) != NULL) {
+    wheel_unlink(t);
+    if (!timer_run(head, t, now) || t->prev == NULL) continue;  // Deleted
+    if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+      wheel_add(w, t);  // Called once-only timers stay in the list only
     }
   }
 }
+
+// Return ms, or less if a timer expires sooner
+int mg_timer_wheel_timeout(struct mg_timer_wheel *w, uint64_t now, int ms) {
+  uint64_t next = wheel_next(w), max = ms < 0 ? 0x7fffffffU : (uint64_t) ms;
+  if (next == 0) return ms;
+  if (next <= now) return 0;
+  return next - now < max ? (int) (next - now) : ms;
+}
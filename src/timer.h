@@ -4,7 +4,7 @@
 
 struct mg_timer {
   uint64_t period_ms;          // Timer period in milliseconds
-  uint64_t expire;             // Expiration timestamp in milliseconds
+  uint64_t expire;             // Expiration timestamp in milliseconds. See below
   unsigned flags;              // Possible flags values below
 #define MG_TIMER_ONCE 0        // Call function once
 #define MG_TIMER_REPEAT 1      // Call function periodically
@@ -14,10 +14,34 @@ struct mg_timer {
   void (*fn)(void *);          // Function to call
   void *arg;                   // Function argument
   struct mg_timer *next;       // Linkage
+  struct mg_timer **prev;      // Pointer to us in the list, for O(1) free
+  struct mg_timer *wnext;      // Timer wheel slot linkage
+  struct mg_timer **wprev;     // Pointer to us in a timer wheel slot
 };
 
+// Hierarchical timer wheel with 1 ms resolution: MG_TIMER_WHEEL_LEVELS levels
+// of 64 slots, each level 64 times coarser than the previous. Timers are
+// scheduled and cancelled in O(1), and polling touches only expired timers
+#define MG_TIMER_WHEEL_LEVELS 4
+struct mg_timer_wheel {
+  uint64_t tick;                                   // Next millisecond to run
+  uint64_t bits[MG_TIMER_WHEEL_LEVELS];            // Non-empty slots bitmap
+  struct mg_timer *slots[MG_TIMER_WHEEL_LEVELS][64];  // Scheduled timers
+};
+
+// Timers of a struct mg_mgr run off its timer wheel, which files a timer
+// under its expire time when it is scheduled. Setting expire to a later time
+// is honoured: the timer is filed again when its old slot comes due. Setting
+// it to an earlier time takes effect only then; to fire sooner, free the
+// timer and add a new one
+
 void mg_timer_init(struct mg_timer **head, struct mg_timer *timer,
                    uint64_t milliseconds, unsigned flags, void (*fn)(void *),
                    void *arg);
+// Unlinks the timer from its list and wheel. head is unused: timers know
+// their list position. Kept for API compatibility, pass the list head
 void mg_timer_free(struct mg_timer **head, struct mg_timer *);
 void mg_timer_poll(struct mg_timer **head, uint64_t new_ms);
+void mg_timer_wheel_poll(struct mg_timer_wheel *, struct mg_timer **head,
+                         uint64_t now);
+int mg_timer_wheel_timeout(struct mg_timer_wheel *, uint64_t now, int ms);
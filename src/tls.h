@@ -38,12 +38,16 @@
 //   Empty disables hostname verification.
 // - `skip_verification`: Skip certificate and hostname verification.
 //   Useful during development; do not use in production.
+// - `alpn`: Application protocols a server accepts, comma-separated, in
+//   order of preference, e.g. "h2,http/1.1". Set on servers. The first one
+//   the client also offers is selected; empty disables ALPN.
 struct mg_tls_opts {
   struct mg_str ca;       // CA certificate, PEM or DER
   struct mg_str cert;     // Our certificate, PEM or DER
   struct mg_str key;      // Our private key, PEM or DER
   struct mg_str name;     // Server name for SNI + hostname verification
   bool skip_verification;  // Skip certificate and hostname verification
+  struct mg_str alpn;     // Server: accepted ALPN protocols, e.g. "h2,http/1.1"
 };
 
 // Initialises TLS on a connection.
@@ -73,7 +77,8 @@ struct mg_tls_opts {
 //   Call from the user-supplied event handler on MG_EV_ACCEPT for servers or
 //   MG_EV_CONNECT for clients, before application data is sent. Servers usually
 //   set cert and key. Clients usually set ca and name; name enables SNI and
-//   hostname verification.
+//   hostname verification. Does nothing on HTTP/2 stream connections, which
+//   use the parent connection's TLS session.
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts);
 
 // Private API, do not expose
@@ -91,9 +96,30 @@ void mg_tls_ctx_free(struct mg_mgr *);
 // Extracts a 32-byte P-256 private scalar from EC PRIVATE KEY or PKCS#8 PRIVATE
 // KEY input. Accepts PEM or DER. Returns key size, or 0 on error.
 size_t mg_uecc_parse_private_key(struct mg_str key, uint8_t *buf, size_t len);
+
+// TLS 1.3 session store for client-side resumption. A session is an opaque
+// blob, saved under the server "name:port" (or IP:port when no name is set)
+// when the server issues a session ticket, and loaded before ClientHello.
+// Tickets are single-use: load() should remove the session it returns.
+// - `save`: store `len` bytes of `buf` for `name`, replacing an older session
+// - `load`: copy the session for `name` into `buf`, return its length, or 0
+//   if there is none or it does not fit in `len` bytes
+struct mg_tls_session_store {
+  void (*save)(void *arg, const char *name, const void *buf, size_t len);
+  size_t (*load)(void *arg, const char *name, void *buf, size_t len);
+  void *arg;  // Passed to save() and load()
+};
+
+// Sets the session store for client connections of a manager, e.g. to keep
+// sessions in flash across reboots. NULL restores the default in-memory
+// store, which keeps up to MG_TLS_CTX_CACHE_SIZE sessions. A store with NULL
+// functions disables resumption.
+void mg_tls_set_session_store(struct mg_mgr *,
+                              const struct mg_tls_session_store *);
 #endif
 
 // Low-level IO primitives used by TLS layer
 enum { MG_IO_ERR = -1, MG_IO_WAIT = -2 };
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len);
 long mg_io_recv(struct mg_connection *c, void *buf, size_t len);
+long mg_io_sendfile(struct mg_connection *c, int fd, size_t len);
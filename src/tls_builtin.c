@@ -43,10 +43,24 @@ static const uint8_t mg_secp256r1_oid[] = {
 #define MG_TLS_CERTIFICATE 11
 #define MG_TLS_CERTIFICATE_REQUEST 13
 #define MG_TLS_CERTIFICATE_VERIFY 15
+#define MG_TLS_NEW_SESSION_TICKET 4
 #define MG_TLS_FINISHED 20
 
 #define MG_TLS_RSA_USE_CRT 1  // CRT instead of naive RSA
 
+#ifndef MG_TLS_TICKET_LIFETIME
+#define MG_TLS_TICKET_LIFETIME 7200  // Session ticket lifetime, seconds
+#endif
+
+#define MG_TLS_TICKET_MAX 512  // Max size of a session ticket we keep
+
+// Server session ticket: AEAD nonce + sealed {issue time, cert binding, PSK}
+#define TLS_TICKET_PLAIN (8 + 16 + 32)
+#define TLS_TICKET_SIZE (12 + TLS_TICKET_PLAIN + 16)
+
+// Client session: PSK, age_add, lifetime, receive time, trust hash, ticket
+#define TLS_SESSION_HDR (32 + 4 + 4 + 8 + 32)
+
 // handshake is re-entrant, so we need to keep track of its state state names
 // refer to RFC8446#A.1
 enum mg_tls_hs_state {
@@ -113,6 +127,11 @@ struct tls_data {
   bool cert_requested;       // client received a CertificateRequest
   bool is_twoway;            // server is configured to authenticate clients
   bool is_sntp_pending;      // TLS handshake is waiting for wall-clock time
+  bool is_psk_offered;       // client sent a session ticket in ClientHello
+  bool is_resumed;           // PSK handshake, no certificates exchanged
+  uint8_t psk[32];           // resumption PSK, offered or accepted
+  uint8_t master_secret[32];  // to derive the resumption master secret
+  uint8_t res_secret[32];     // client resumption master secret
   struct mg_connection *timec;  // SNTP connection for wall-clock time
   struct mg_str cert_der;    // certificate in DER format
   struct mg_str ca_der;      // current CA certificate
@@ -124,6 +143,8 @@ struct tls_data {
   struct mg_rsa_key rsa;
   struct mg_str rsa_key_der;  // RSA private key in DER format
   char hostname[254];         // matching hostname
+  char alpn[64];              // server: accepted ALPN protocols, see opts
+  char protocol[32];          // server: selected ALPN protocol, or empty
 
   bool is_ec_pubkey;         // EC or RSA. TODO(): currently unused
   uint8_t pubkey[512 + 16];  // server EC (64) or RSA (512+exp) public key to
@@ -138,6 +159,29 @@ struct tls_data {
 #define TLS_RECHDR_SIZE 5  // 1 byte type, 2 bytes version, 2 bytes length
 #define TLS_MSGHDR_SIZE 4  // 1 byte type, 3 bytes length
 
+// Default session store entry, see mg_tls_set_session_store()
+struct tls_session {
+  char *name;          // Server name, followed by session data
+  size_t len;          // Session data length
+  unsigned long used;  // Last use stamp, for LRU eviction
+};
+
+// Verified peer certificate chain, see mg_tls_recv_cert()
+struct tls_chain {
+  uint8_t key[32];     // Hash of the peer name, trust anchors and chain
+  uint64_t expire;     // Earliest notAfter in the chain, seconds since epoch
+  unsigned long used;  // Last use stamp, for LRU eviction. 0: unused entry
+};
+
+// per-manager TLS data, mgr->tls_ctx
+struct tls_ctx {
+  uint8_t ticket_key[32];             // server: session ticket sealing key
+  struct mg_tls_session_store store;  // client: where session tickets go
+  struct tls_session sessions[MG_TLS_CTX_CACHE_SIZE];  // default store
+  struct tls_chain chains[MG_TLS_CERT_CACHE_SIZE];     // verified chains
+  unsigned long used;
+};
+
 #ifdef MG_TLS_SSLKEYLOGFILE
 #include <stdio.h>
 static void mg_ssl_key_log(const char *label, uint8_t client_random[32],
@@ -335,7 +379,8 @@ static void mg_tls_generate_handshake_keys(struct mg_connection *c) {
   const size_t keysz = 16;
 #endif
 
-  mg_hmac_sha256(early_secret, NULL, 0, zeros, sizeof(zeros));
+  mg_hmac_sha256(early_secret, NULL, 0, tls->is_resumed ? tls->psk : zeros,
+                 32);
   mg_tls_derive_secret("tls13 derived", early_secret, 32, zeros_sha256_digest,
                        32, pre_extract_secret, 32);
   mg_hmac_sha256(tls->enc.handshake_secret, pre_extract_secret,
@@ -406,6 +451,7 @@ static void mg_tls_generate_application_keys(struct mg_connection *c) {
   mg_tls_derive_secret("tls13 derived", tls->enc.handshake_secret, 32,
                        zeros_sha256_digest, 32, premaster_secret, 32);
   mg_hmac_sha256(master_secret, premaster_secret, 32, zeros, 32);
+  memmove(tls->master_secret, master_secret, sizeof(master_secret));
 
   mg_tls_derive_secret("tls13 s ap traffic", master_secret, 32, hash, 32,
                        server_secret, 32);
@@ -474,7 +520,7 @@ static bool mg_tls_encrypt(struct mg_connection *c, const uint8_t *msg,
   nonce[11] ^= (uint8_t) ((seq) & 255U);
 
   if (mg_iobuf_add(wio, wio->len, hdr, sizeof(hdr)) == 0 ||
-      !mg_iobuf_resize(wio, wio->len + encsz))
+      !mg_iobuf_reserve(wio, encsz))
     return false;
   outmsg = wio->buf + wio->len;
   tag = wio->buf + wio->len + msgsz + 1;
@@ -646,7 +692,133 @@ static void mg_tls_calc_cert_verify_hash(struct mg_connection *c,
   mg_sha256_final(hash, &sha256);
 }
 
+// PSK binder, RFC8446#4.2.11.2: HMAC of the ClientHello truncated before the
+// binders list, keyed with the binder key derived from the PSK
+static void mg_tls_psk_binder(uint8_t psk[32], const uint8_t *hello,
+                              size_t hellosz, uint8_t binder[32]) {
+  uint8_t early_secret[32];
+  uint8_t binder_key[32];
+  uint8_t finished_key[32];
+  uint8_t hash[32];
+  mg_sha256_ctx sha256;
+  mg_hmac_sha256(early_secret, NULL, 0, psk, 32);
+  mg_tls_derive_secret("tls13 res binder", early_secret, 32,
+                       zeros_sha256_digest, 32, binder_key, 32);
+  mg_tls_derive_secret("tls13 finished", binder_key, 32, NULL, 0,
+                       finished_key, 32);
+  mg_sha256_init(&sha256);
+  mg_sha256_update(&sha256, hello, hellosz);
+  mg_sha256_final(hash, &sha256);
+  mg_hmac_sha256(binder, finished_key, 32, hash, 32);
+}
+
+// resumption_master_secret, hash covers the handshake up to client Finished
+static void mg_tls_resumption_secret(struct tls_data *tls, uint8_t hash[32],
+                                     uint8_t secret[32]) {
+  mg_tls_derive_secret("tls13 res master", tls->master_secret, 32, hash, 32,
+                       secret, 32);
+}
+
+// Tickets are only accepted for the certificate and client CA they were
+// issued with, so a ticket from one listener does not skip another's checks
+static void mg_tls_ticket_binding(struct tls_data *tls, uint8_t binding[16]) {
+  mg_sha256_ctx sha256;
+  uint8_t hash[32];
+  mg_sha256_init(&sha256);
+  mg_sha256_update(&sha256, (uint8_t *) tls->cert_der.buf, tls->cert_der.len);
+  mg_sha256_update(&sha256, (uint8_t *) tls->ca_der.buf, tls->ca_der.len);
+  mg_sha256_final(hash, &sha256);
+  memmove(binding, hash, 16);
+}
+
+static bool mg_tls_ticket_seal(uint8_t key[32], uint8_t *plain,
+                               uint8_t ticket[TLS_TICKET_SIZE]) {
+  if (!mg_random(ticket, 12)) return false;  // nonce, also used as AAD
+#if MG_ENABLE_CHACHA20
+  return mg_chacha20_poly1305_encrypt(ticket + 12, key, ticket, ticket, 12,
+                                      plain, TLS_TICKET_PLAIN) ==
+         TLS_TICKET_PLAIN + 16;
+#else
+  mg_gcm_initialize();
+  return mg_aes_gcm_encrypt(ticket + 12, plain, TLS_TICKET_PLAIN, key, 16,
+                            ticket, 12, ticket, 12,
+                            ticket + 12 + TLS_TICKET_PLAIN, 16) == 0;
+#endif
+}
+
+static bool mg_tls_ticket_open(uint8_t key[32], uint8_t *ticket,
+                               uint8_t plain[TLS_TICKET_PLAIN]) {
+#if MG_ENABLE_CHACHA20
+  return mg_chacha20_poly1305_decrypt(plain, key, ticket, ticket, 12,
+                                      ticket + 12, TLS_TICKET_PLAIN + 16) ==
+         TLS_TICKET_PLAIN;
+#else
+  mg_gcm_initialize();
+  return mg_aes_gcm_decrypt(plain, ticket + 12, TLS_TICKET_PLAIN, key, 16,
+                            ticket, 12, ticket, 12,
+                            ticket + 12 + TLS_TICKET_PLAIN, 16) == 0;
+#endif
+}
+
+// Check the pre_shared_key extension, the last one in ClientHello. The first
+// identity is accepted if it is our unexpired ticket for this certificate and
+// its binder matches; otherwise, fall back to a full handshake
+static void mg_tls_server_recv_psk(struct mg_connection *c, uint8_t *hello,
+                                   uint8_t *ext, uint16_t extsz) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t plain[TLS_TICKET_PLAIN], binding[16], binder[32], diff = 0;
+  uint64_t now = mg_millis(), issued;
+  uint16_t ids_len, binders_len;
+  uint8_t *binders;
+  size_t i;
+  if (ctx == NULL || extsz < 2) return;
+  ids_len = MG_LOAD_BE16(ext);
+  if (ids_len < 2 + TLS_TICKET_SIZE + 4 || (uint32_t) ids_len + 5 > extsz ||
+      MG_LOAD_BE16(ext + 2) != TLS_TICKET_SIZE) {
+    return;  // Not our ticket
+  }
+  binders = ext + 2 + ids_len;
+  binders_len = MG_LOAD_BE16(binders);
+  if ((uint32_t) ids_len + 4 + binders_len != extsz || binders_len < 33 ||
+      binders[2] != 32) {
+    return;
+  }
+  if (!mg_tls_ticket_open(ctx->ticket_key, ext + 4, plain)) return;
+  issued = MG_LOAD_BE64(plain);
+  mg_tls_ticket_binding(tls, binding);
+  if (issued <= now && now - issued <= MG_TLS_TICKET_LIFETIME * 1000UL &&
+      memcmp(binding, plain + 8, sizeof(binding)) == 0) {
+    mg_tls_psk_binder(plain + 24, hello, (size_t) (binders - hello), binder);
+    for (i = 0; i < sizeof(binder); i++) diff |= binder[i] ^ binders[3 + i];
+    if (diff == 0) {
+      memmove(tls->psk, plain + 24, sizeof(tls->psk));
+      tls->is_resumed = true;
+      MG_VERBOSE(("%lu resuming session", c->id));
+    }
+  }
+  mg_bzero(plain, sizeof(plain));
+}
+
 // read and parse ClientHello record
+// Select the first of our protocols that the client offers, RFC 7301
+static void mg_tls_server_alpn(struct tls_data *tls, const uint8_t *p,
+                               uint16_t n) {
+  struct mg_str k, s = mg_str(tls->alpn);
+  while (mg_span(s, &k, &s, ',')) {
+    uint16_t i = 2;  // Skip protocol name list length
+    while (i < n && (uint32_t) i + 1 + p[i] <= n) {
+      if (p[i] == k.len && k.len < sizeof(tls->protocol) &&
+          memcmp(p + i + 1, k.buf, k.len) == 0) {
+        memcpy(tls->protocol, k.buf, k.len);
+        tls->protocol[k.len] = '\0';
+        return;
+      }
+      i = (uint16_t) (i + 1 + p[i]);
+    }
+  }
+}
+
 static int mg_tls_server_recv_hello(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   struct mg_iobuf *rio = &c->rtls;
@@ -655,7 +827,10 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
   uint16_t cipher_suites_len;
   uint16_t ext_len;
   uint8_t *ext;
+  uint8_t *psk = NULL;
+  uint16_t psk_len = 0;
   uint16_t msgsz;
+  bool has_key_share = false, has_psk_dhe = false;
 
   if (!mg_tls_got_record(c)) {
     return MG_IO_WAIT;
@@ -690,10 +865,22 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
     uint16_t k;
     uint16_t key_exchange_len;
     uint8_t *key_exchange;
-    uint16_t n = MG_LOAD_BE16(ext + j + 2);
+    uint16_t n;
+    if (ext_len - j < 4) goto fail;
+    n = MG_LOAD_BE16(ext + j + 2);
     if (((uint32_t) n + j + 4) > ext_len) goto fail;
-    if (MG_LOAD_BE16(ext + j) != 0x0033) {  // not a key share extension, ignore
-      j += (uint16_t) (n + 4);
+    if (MG_LOAD_BE16(ext + j) == 0x002d) {  // psk_key_exchange_modes
+      for (k = 1; k < n && k <= ext[j + 4]; k++) {
+        if (ext[j + 4 + k] == 1) has_psk_dhe = true;  // psk_dhe_ke
+      }
+    } else if (MG_LOAD_BE16(ext + j) == 0x0029) {  // pre_shared_key, last
+      psk = ext + j + 4, psk_len = n;
+      if (((uint32_t) n + j + 4) != ext_len) goto fail;
+    } else if (MG_LOAD_BE16(ext + j) == 0x0010) {  // ALPN
+      mg_tls_server_alpn(tls, ext + j + 4, n);
+    }
+    if (MG_LOAD_BE16(ext + j) != 0x0033 || has_key_share) {
+      j += (uint16_t) (n + 4);  // not a key share extension, ignore
       continue;
     }
     key_exchange_len = MG_LOAD_BE16(ext + j + 4);
@@ -705,13 +892,19 @@ static int mg_tls_server_recv_hello(struct mg_connection *c) {
       if (((uint32_t) m + k + 4) > key_exchange_len) goto fail;
       if (m == 32 && key_exchange[k] == 0x00 && key_exchange[k + 1] == 0x1d) {
         memmove(tls->x25519_cli, key_exchange + k + 4, m);
-        mg_tls_drop_record(c);
-        return 0;
+        has_key_share = true;
+        break;
       }
       k += (uint16_t) (m + 4);
     }
     j += (uint16_t) (n + 4);
   }
+  if (!has_key_share) goto fail;
+  if (psk != NULL && has_psk_dhe) {
+    mg_tls_server_recv_psk(c, rio->buf + 5, psk, psk_len);
+  }
+  mg_tls_drop_record(c);
+  return 0;
 fail:
   mg_error(c, "bad client hello");
   return -1;
@@ -727,7 +920,7 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
   struct mg_iobuf *wio = &tls->send;
 
   // clang-format off
-  uint8_t msg_server_hello[122] = {
+  uint8_t msg_server_hello[128] = {
       // server hello, tls 1.2
       0x02, 0x00, 0x00, 0x76, 0x03, 0x03,
       // random (32 bytes)
@@ -746,8 +939,12 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
       // x25519 keyshare
       PLACEHOLDER_32B,
       // supported versions (tls1.3 == 0x304)
-      0x00, 0x2b, 0x00, 0x02, 0x03, 0x04};
+      0x00, 0x2b, 0x00, 0x02, 0x03, 0x04,
+      // pre-shared key, selected identity 0 (only if resumed)
+      0x00, 0x29, 0x00, 0x02, 0x00, 0x00};
   // clang-format on
+  size_t n = tls->is_resumed ? sizeof(msg_server_hello) : 122;
+  uint8_t hdr[5] = {MG_TLS_HANDSHAKE, 0x03, 0x03, 0, (uint8_t) n};
 
   // calculate keyshare
   uint8_t x25519_pub[X25519_BYTES];
@@ -763,13 +960,14 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
   memmove(msg_server_hello + 6, tls->random, sizeof(tls->random));
   memmove(msg_server_hello + 39, tls->session_id, sizeof(tls->session_id));
   memmove(msg_server_hello + 84, x25519_pub, sizeof(x25519_pub));
+  MG_STORE_BE24(msg_server_hello + 1, n - 4);   // message length
+  MG_STORE_BE16(msg_server_hello + 74, n - 76);  // extensions length
 
   // server hello message
-  if (mg_iobuf_add(wio, wio->len, "\x16\x03\x03\x00\x7a", 5) == 0 ||
-      mg_iobuf_add(wio, wio->len, msg_server_hello, sizeof(msg_server_hello)) ==
-          0)
+  if (mg_iobuf_add(wio, wio->len, hdr, sizeof(hdr)) == 0 ||
+      mg_iobuf_add(wio, wio->len, msg_server_hello, n) == 0)
     return false;
-  mg_sha256_update(&tls->sha256, msg_server_hello, sizeof(msg_server_hello));
+  mg_sha256_update(&tls->sha256, msg_server_hello, n);
 
   // change cipher message
   if (mg_iobuf_add(wio, wio->len, "\x14\x03\x03\x00\x01\x01", 6) == 0)
@@ -779,10 +977,21 @@ static bool mg_tls_server_send_hello(struct mg_connection *c) {
 
 static bool mg_tls_server_send_ext(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
-  // server extensions
-  uint8_t ext[6] = {0x08, 0, 0, 2, 0, 0};
-  mg_sha256_update(&tls->sha256, ext, sizeof(ext));
-  return mg_tls_encrypt(c, ext, sizeof(ext), MG_TLS_HANDSHAKE);
+  // server extensions: none, or the selected ALPN protocol
+  uint8_t ext[13 + sizeof(tls->protocol)] = {0x08, 0, 0, 2, 0, 0};
+  size_t n = strlen(tls->protocol), len = 6;
+  if (n > 0) {
+    MG_STORE_BE24(ext + 1, n + 9);  // message length
+    MG_STORE_BE16(ext + 4, n + 7);  // extensions length
+    MG_STORE_BE16(ext + 6, 0x0010);
+    MG_STORE_BE16(ext + 8, n + 3);  // extension length
+    MG_STORE_BE16(ext + 10, n + 1);  // protocol name list length
+    ext[12] = (uint8_t) n;
+    memcpy(ext + 13, tls->protocol, n);
+    len = n + 13;
+  }
+  mg_sha256_update(&tls->sha256, ext, len);
+  return mg_tls_encrypt(c, ext, len, MG_TLS_HANDSHAKE);
 }
 
 // signature algorithms we actually support:
@@ -1169,7 +1378,9 @@ static bool mg_tls_server_send_finish(struct mg_connection *c) {
   return true;
 }
 
-static int mg_tls_server_recv_finish(struct mg_connection *c) {
+// hash receives the handshake hash including client Finished
+static int mg_tls_server_recv_finish(struct mg_connection *c,
+                                     uint8_t hash[32]) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   unsigned char *recv_buf;
   // we have to backup sha256 value to restore it later, since Finished record
@@ -1185,12 +1396,137 @@ static int mg_tls_server_recv_finish(struct mg_connection *c) {
     return -1;
   }
   mg_tls_drop_message(c);
+  mg_sha256_final(hash, &tls->sha256);
 
   // restore hash
   tls->sha256 = sha256;
   return 0;
 }
 
+// Send a NewSessionTicket: the resumption PSK, sealed with the manager key
+static bool mg_tls_server_send_ticket(struct mg_connection *c,
+                                      uint8_t hash[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t msg[18 + TLS_TICKET_SIZE] = {MG_TLS_NEW_SESSION_TICKET};
+  uint8_t plain[TLS_TICKET_PLAIN], secret[32], nonce = 0;
+  bool ok;
+  if (ctx == NULL) return true;
+  mg_tls_resumption_secret(tls, hash, secret);
+  MG_STORE_BE64(plain, mg_millis());
+  mg_tls_ticket_binding(tls, plain + 8);
+  mg_tls_derive_secret("tls13 resumption", secret, 32, &nonce, 1, plain + 24,
+                       32);
+  MG_STORE_BE24(msg + 1, sizeof(msg) - 4);
+  MG_STORE_BE32(msg + 4, MG_TLS_TICKET_LIFETIME);  // ticket_lifetime
+  msg[12] = 1, msg[13] = nonce;                    // ticket_nonce
+  MG_STORE_BE16(msg + 14, TLS_TICKET_SIZE);        // ticket, no extensions
+  ok = mg_random(msg + 8, 4) &&  // ticket_age_add
+       mg_tls_ticket_seal(ctx->ticket_key, plain, msg + 16);
+  mg_bzero(plain, sizeof(plain));
+  mg_bzero(secret, sizeof(secret));
+  if (!ok) return true;  // No ticket, no resumption
+  return mg_tls_encrypt(c, msg, sizeof(msg), MG_TLS_HANDSHAKE);
+}
+
+static void tls_chain_hash(mg_sha256_ctx *sha, const void *buf, size_t len) {
+  uint8_t n[4];
+  MG_STORE_BE32(n, len);
+  mg_sha256_update(sha, n, sizeof(n));
+  mg_sha256_update(sha, (const unsigned char *) buf, len);
+}
+
+// Sessions are saved under the server name and port, or its address
+static void mg_tls_session_name(struct mg_connection *c, char *buf,
+                                size_t len) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  if (tls->hostname[0] != '\0') {
+    mg_snprintf(buf, len, "%s:%d", tls->hostname, (int) mg_ntohs(c->rem.port));
+  } else {
+    mg_snprintf(buf, len, "%M", mg_print_ip_port, &c->rem);
+  }
+}
+
+// A resumed session skips certificate checks, so it is bound to how the
+// server was verified: the server name and the trust anchors, if any
+static void mg_tls_session_trust(struct mg_connection *c, uint8_t hash[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t verify = !tls->skip_verification &&
+                   (tls->ca_bundle_len > 0 || tls->ca_der.len > 0);
+  mg_sha256_ctx sha;
+  size_t i;
+  mg_sha256_init(&sha);
+  tls_chain_hash(&sha, &verify, sizeof(verify));
+  tls_chain_hash(&sha, tls->hostname, strlen(tls->hostname));
+  if (verify) {
+    tls_chain_hash(&sha, tls->ca_der.buf, tls->ca_der.len);
+    for (i = 0; i < tls->ca_bundle_len; i++) {
+      tls_chain_hash(&sha, tls->ca_bundle_der[i].buf,
+                     tls->ca_bundle_der[i].len);
+    }
+  }
+  mg_sha256_final(hash, &sha);
+}
+
+// A session is usable if it is not expired, and if it was verified the way
+// this connection would verify the server
+static size_t mg_tls_session_load(struct mg_connection *c, uint8_t *buf,
+                                  size_t len) {
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint64_t now = mg_millis(), received;
+  uint8_t trust[32];
+  char name[300];
+  size_t n;
+  if (ctx == NULL || ctx->store.load == NULL) return 0;
+  mg_tls_session_name(c, name, sizeof(name));
+  n = ctx->store.load(ctx->store.arg, name, buf, len);
+  if (n <= TLS_SESSION_HDR || n > len) return 0;
+  received = MG_LOAD_BE64(buf + 40);
+  if (received <= now && now - received > MG_LOAD_BE32(buf + 36) * 1000ULL) {
+    return 0;  // Expired
+  }
+  mg_tls_session_trust(c, trust);
+  if (memcmp(buf + 48, trust, sizeof(trust)) != 0) {
+    MG_DEBUG(("%lu session for %s verified differently, skipped", c->id, name));
+    return 0;
+  }
+  return n;
+}
+
+// Parse NewSessionTicket messages received after the handshake
+static void mg_tls_client_recv_ticket(struct mg_connection *c, uint8_t *msg,
+                                      size_t len) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+  uint8_t buf[TLS_SESSION_HDR + MG_TLS_TICKET_MAX];
+  char name[300];
+  uint32_t msglen, nonce_len, ticket_len;
+  for (; len >= TLS_MSGHDR_SIZE; msg += msglen, len -= msglen) {
+    msglen = MG_LOAD_BE24(msg + 1) + TLS_MSGHDR_SIZE;
+    if (msglen > len) break;
+    if (msg[0] != MG_TLS_NEW_SESSION_TICKET || msglen < 4 + 13) continue;
+    nonce_len = msg[12];
+    if (nonce_len > 32 || 4 + 13 + nonce_len > msglen) continue;
+    ticket_len = MG_LOAD_BE16(msg + 13 + nonce_len);
+    if (ticket_len == 0 || ticket_len > MG_TLS_TICKET_MAX ||
+        4 + 13 + nonce_len + ticket_len > msglen || MG_LOAD_BE32(msg + 4) == 0) {
+      continue;
+    }
+    if (ctx == NULL || ctx->store.save == NULL) return;
+    mg_tls_derive_secret("tls13 resumption", tls->res_secret, 32, msg + 13,
+                         nonce_len, buf, 32);
+    memmove(buf + 32, msg + 8, 4);   // ticket_age_add
+    memmove(buf + 36, msg + 4, 4);   // ticket_lifetime
+    MG_STORE_BE64(buf + 40, mg_millis());
+    mg_tls_session_trust(c, buf + 48);
+    memmove(buf + TLS_SESSION_HDR, msg + 15 + nonce_len, ticket_len);
+    mg_tls_session_name(c, name, sizeof(name));
+    ctx->store.save(ctx->store.arg, name, buf, TLS_SESSION_HDR + ticket_len);
+    mg_bzero(buf, 32);
+    MG_VERBOSE(("%lu saved session ticket for %s", c->id, name));
+  }
+}
+
 static bool mg_tls_client_send_hello(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   struct mg_iobuf *wio = &tls->send;
@@ -1206,6 +1542,15 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
       0x08, 0x05, 0x08, 0x06, 0x04, 0x01, 0x05, 0x01, 0x06, 0x01};
   uint8_t server_name_ext[9] = {0x00, 0x00, 0x00, 0xfe, 0x00,
                                 0xfe, 0x00, 0x00, 0xfe};
+  // psk_key_exchange_modes (psk_dhe_ke) + pre_shared_key header
+  uint8_t psk_ext[14] = {0x00, 0x2d, 0x00, 0x02, 0x01, 0x01, 0x00, 0x29};
+  uint8_t ticket_age[4];
+  uint8_t binders[35] = {0x00, 0x21, 0x20};
+  uint8_t session[TLS_SESSION_HDR + MG_TLS_TICKET_MAX];
+  size_t sessionsz = mg_tls_session_load(c, session, sizeof(session));
+  size_t ticketsz = sessionsz > 0 ? sessionsz - TLS_SESSION_HDR : 0;
+  size_t psk_extsz = sessionsz > 0 ? sizeof(psk_ext) + ticketsz + 4 + 35 : 0;
+  size_t start = wio->len;
 
   // clang-format off
   uint8_t msg_client_hello[145] = {
@@ -1248,13 +1593,13 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
   size_t sig_alg_sz = tls->skip_verification ? sizeof(all_sig_algs)
                                              : sizeof(secp256r1_sig_algs);
 
-  // patch ClientHello with correct hostname ext length (if any)
+  // patch ClientHello with correct hostname and PSK ext length (if any)
   MG_STORE_BE16(msg_client_hello + 3,
-                hostname_extsz + 183 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 183 - 9 - 34 + sig_alg_sz);
   MG_STORE_BE16(msg_client_hello + 7,
-                hostname_extsz + 179 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 179 - 9 - 34 + sig_alg_sz);
   MG_STORE_BE16(msg_client_hello + 82,
-                hostname_extsz + 104 - 9 - 34 + sig_alg_sz);
+                hostname_extsz + psk_extsz + 104 - 9 - 34 + sig_alg_sz);
 
   if (hostnamesz > 0) {
     MG_STORE_BE16(server_name_ext + 2, hostnamesz + 5);
@@ -1290,6 +1635,31 @@ static bool mg_tls_client_send_hello(struct mg_connection *c) {
     mg_sha256_update(&tls->sha256, (uint8_t *) hostname, hostnamesz);
   }
 
+  // offer a saved session: one ticket identity, its binder goes last
+  if (sessionsz > 0) {
+    uint32_t age = (uint32_t) (mg_millis() - MG_LOAD_BE64(session + 40));
+    if (MG_LOAD_BE64(session + 40) > mg_millis()) age = 0;  // Reboot
+    MG_STORE_BE16(psk_ext + 8, psk_extsz - 10);     // extension length
+    MG_STORE_BE16(psk_ext + 10, ticketsz + 6);      // identities length
+    MG_STORE_BE16(psk_ext + 12, ticketsz);          // identity length
+    MG_STORE_BE32(ticket_age, age + MG_LOAD_BE32(session + 32));  // + age_add
+    if (mg_iobuf_add(wio, wio->len, psk_ext, sizeof(psk_ext)) == 0 ||
+        mg_iobuf_add(wio, wio->len, session + TLS_SESSION_HDR, ticketsz) ==
+            0 ||
+        mg_iobuf_add(wio, wio->len, ticket_age, sizeof(ticket_age)) == 0)
+      return false;
+    memmove(tls->psk, session, sizeof(tls->psk));
+    mg_tls_psk_binder(tls->psk, wio->buf + start + 5, wio->len - start - 5,
+                      binders + 3);
+    mg_sha256_update(&tls->sha256, wio->buf + wio->len - ticketsz - 18,
+                     ticketsz + 18);
+    if (mg_iobuf_add(wio, wio->len, binders, sizeof(binders)) == 0)
+      return false;
+    mg_sha256_update(&tls->sha256, binders, sizeof(binders));
+    tls->is_psk_offered = true;
+    mg_bzero(session, TLS_SESSION_HDR);
+  }
+
   // change cipher message
   if (mg_iobuf_add(wio, wio->len, (const char *) "\x14\x03\x03\x00\x01\x01",
                    6) == 0)
@@ -1302,6 +1672,7 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
   struct mg_iobuf *rio = &c->rtls;
   uint16_t msgsz;
   uint8_t *ext;
+  uint8_t *key_share = NULL;
   uint16_t ext_len;
   int j;
 
@@ -1335,6 +1706,14 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
     ext_type = MG_LOAD_BE16(ext + j);
     ext_len2 = MG_LOAD_BE16(ext + j + 2);
     if (ext_len2 > (ext_len - j - 4)) goto fail;
+    if (ext_type == 0x0029) {  // pre_shared_key, server accepted our ticket
+      if (!tls->is_psk_offered || ext_len2 != 2 ||
+          MG_LOAD_BE16(ext + j + 4) != 0) {
+        mg_error(c, "bad pre-shared key");
+        return -1;
+      }
+      tls->is_resumed = true;
+    }
     if (ext_type != 0x0033) {  // not a key share extension, ignore
       j += (uint16_t) (ext_len2 + 4);
       continue;
@@ -1347,10 +1726,15 @@ static int mg_tls_client_recv_hello(struct mg_connection *c) {
     }
     key_exchange_len = MG_LOAD_BE16(ext + j + 6);
     key_exchange = ext + j + 8;
-    if (key_exchange_len != 32 || mg_tls_x25519(tls->x25519_sec, tls->x25519_cli, key_exchange, 1) < 0) {
+    if (key_exchange_len != 32) goto fail;
+    key_share = key_exchange;
+    j += (uint16_t) (ext_len2 + 4);
+  }
+  if (key_share != NULL) {
+    if (mg_tls_x25519(tls->x25519_sec, tls->x25519_cli, key_share, 1) < 0) {
       mg_error(c, "bad key");
       return -1;
-    }    
+    }
     mg_tls_hexdump("c x25519 sec", tls->x25519_sec, 32);
     mg_tls_drop_record(c);
     /* generate handshake keys */
@@ -1387,6 +1771,7 @@ struct mg_tls_cert {
   struct mg_str sig;    // signature
   uint8_t tbshash[48];  // 32B for sha256/secp256, 48B for sha384/secp384
   size_t tbshashsz;     // actual TBS hash size
+  uint64_t not_after;   // expiration time, seconds since epoch
 };
 
 static void mg_der_debug_cert_name(const char *name, struct mg_der_tlv *tlv) {
@@ -1512,6 +1897,7 @@ static int mg_tls_parse_cert_der(void *buf, size_t dersz,
       MG_ERROR(("cert is no longer valid: after=%.*s (%lu), now=%lu", after.len, after.value, t, now));
       return -1;
     }
+    cert->not_after = t;
   }
 
   // subject
@@ -1758,6 +2144,80 @@ static int tls_bundle_find(struct tls_data *tls, struct mg_der_tlv *name,
   return 0;
 }
 
+// A chain verifies the same way for the same peer name, peer IP (which can
+// match an IP SAN) and trust anchors
+static void tls_chain_key(struct mg_connection *c, const uint8_t *list,
+                          size_t len, uint8_t key[32]) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  mg_sha256_ctx sha;
+  size_t i;
+  mg_sha256_init(&sha);
+  tls_chain_hash(&sha, tls->hostname, strlen(tls->hostname));
+  if (c->rem.is_ip6) {
+    tls_chain_hash(&sha, c->rem.addr.ip6, sizeof(c->rem.addr.ip6));
+  } else {
+    tls_chain_hash(&sha, &c->rem.addr.ip4, sizeof(c->rem.addr.ip4));
+  }
+  tls_chain_hash(&sha, tls->ca_der.buf, tls->ca_der.len);
+  for (i = 0; i < tls->ca_bundle_len; i++) {
+    tls_chain_hash(&sha, tls->ca_bundle_der[i].buf, tls->ca_bundle_der[i].len);
+  }
+  tls_chain_hash(&sha, list, len);
+  mg_sha256_final(key, &sha);
+}
+
+static struct tls_chain *tls_chain_find(struct tls_ctx *ctx,
+                                        const uint8_t key[32]) {
+  size_t i;
+  uint64_t now = mg_now() / 1000U;
+  for (i = 0; ctx != NULL && i < MG_TLS_CERT_CACHE_SIZE; i++) {
+    struct tls_chain *e = &ctx->chains[i];
+    if (e->used == 0 || memcmp(e->key, key, sizeof(e->key)) != 0) continue;
+    if (now > e->expire) break;  // Expired, verify again
+    e->used = ++ctx->used;
+    return e;
+  }
+  return NULL;
+}
+
+// Remember a verified chain, replacing the same, an unused or the least
+// recently used entry
+static void tls_chain_add(struct tls_ctx *ctx, const uint8_t key[32],
+                          uint64_t expire) {
+  struct tls_chain *e;
+  size_t i;
+  if (ctx == NULL) return;
+  for (e = &ctx->chains[0], i = 0; i < MG_TLS_CERT_CACHE_SIZE; i++) {
+    struct tls_chain *x = &ctx->chains[i];
+    if (x->used != 0 && memcmp(x->key, key, sizeof(x->key)) == 0) {
+      e = x;
+      break;
+    }
+    if (e->used != 0 && x->used < e->used) e = x;
+  }
+  memmove(e->key, key, sizeof(e->key));
+  e->expire = expire, e->used = ++ctx->used;
+}
+
+// Cached chain: parse the peer certificate for its public key only
+static int tls_recv_cert_cached(struct mg_connection *c, uint8_t *p,
+                                uint8_t *endp) {
+  struct tls_data *tls = (struct tls_data *) c->tls;
+  struct mg_tls_cert cert;
+  uint32_t certsz = endp - p < 5 ? 0 : MG_LOAD_BE24(p);
+  memset(&cert, 0, sizeof(cert));
+  if (certsz == 0 || certsz + 5 > (size_t) (endp - p) ||
+      mg_tls_parse_cert_der(p + 3, certsz, &cert) < 0 ||
+      cert.pubkey.len > sizeof(tls->pubkey)) {
+    mg_error(c, "failed to parse certificate");
+    return -1;
+  }
+  MG_VERBOSE(("%lu verified chain cache hit", c->id));
+  memmove(tls->pubkey, cert.pubkey.buf, cert.pubkey.len);
+  tls->pubkeysz = cert.pubkey.len;
+  return 0;
+}
+
 static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   unsigned char *recv_buf;
@@ -1796,6 +2256,10 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
     uint8_t *endp = recv_buf + cert_chain_len + 8;
     bool found_ca = false;
     struct mg_tls_cert ca;
+    struct tls_ctx *ctx = (struct tls_ctx *) c->mgr->tls_ctx;
+    uint8_t key[32];
+    uint64_t expire;
+    int i;
 
     if (cert_chain_len != full_cert_chain_len - 4 || cert_chain_len > (tls->recv_len - 8)) {
       MG_ERROR(("full chain length: %d, chain length: %d, msg length: %d", full_cert_chain_len, cert_chain_len, tls->recv_len));
@@ -1803,6 +2267,14 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
       return -1;
     }
 
+    // Skip signature checks and the bundle search for a chain verified before
+    tls_chain_key(c, p, cert_chain_len, key);
+    if (tls_chain_find(ctx, key) != NULL) {
+      if (tls_recv_cert_cached(c, p, endp) < 0) return -1;
+      MG_DEBUG(("%lu peer chain verified before, checks skipped", c->id));
+      goto done;
+    }
+
     memset(certs, 0, sizeof(certs));
     memset(&ca, 0, sizeof(ca));
 
@@ -1904,7 +2376,17 @@ static int mg_tls_recv_cert(struct mg_connection *c, bool is_client) {
         MG_VERBOSE(("no CA in chain; verification with builtin CA passed"));
       }
     }
+
+    // Verified until the first certificate, including the CA, expires
+    expire = ca.not_after;
+    for (i = 0; i < certnum; i++) {
+      if (expire == 0 || certs[i].not_after < expire) {
+        expire = certs[i].not_after;
+      }
+    }
+    tls_chain_add(ctx, key, expire);
   }
+done:
   mg_tls_drop_message(c);
   mg_tls_calc_cert_verify_hash(c, tls->sighash, !is_client);
   return 0;
@@ -2034,7 +2516,9 @@ static int mg_tls_client_recv_finish(struct mg_connection *c) {
   return 0;
 }
 
-static bool mg_tls_client_send_finish(struct mg_connection *c) {
+// res_hash receives the handshake hash including our Finished
+static bool mg_tls_client_send_finish(struct mg_connection *c,
+                                      uint8_t res_hash[32]) {
   struct tls_data *tls = (struct tls_data *) c->tls;
   mg_sha256_ctx sha256;
   uint8_t hash[32];
@@ -2042,11 +2526,15 @@ static bool mg_tls_client_send_finish(struct mg_connection *c) {
   memmove(&sha256, &tls->sha256, sizeof(mg_sha256_ctx));
   mg_sha256_final(hash, &sha256);
   mg_hmac_sha256(finish + 4, tls->enc.client_finished_key, 32, hash, 32);
+  memmove(&sha256, &tls->sha256, sizeof(mg_sha256_ctx));
+  mg_sha256_update(&sha256, finish, sizeof(finish));
+  mg_sha256_final(res_hash, &sha256);
   return mg_tls_encrypt(c, finish, sizeof(finish), MG_TLS_HANDSHAKE);
 }
 
 static bool mg_tls_client_handshake(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t hash[32];
   switch (tls->state) {
     case MG_TLS_STATE_CLIENT_START:
       if (!mg_tls_client_send_hello(c)) return false;
@@ -2060,12 +2548,12 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
       if (mg_tls_client_recv_ext(c) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_CERT;
       // Fallthrough
-    case MG_TLS_STATE_CLIENT_WAIT_CERT:
-      if (mg_tls_recv_cert(c, true) < 0) break;
+    case MG_TLS_STATE_CLIENT_WAIT_CERT:  // resumed sessions skip certificates
+      if (!tls->is_resumed && mg_tls_recv_cert(c, true) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_CV;
       // Fallthrough
     case MG_TLS_STATE_CLIENT_WAIT_CV:
-      if (mg_tls_recv_cert_verify(c) < 0) break;
+      if (!tls->is_resumed && mg_tls_recv_cert_verify(c) < 0) break;
       tls->state = MG_TLS_STATE_CLIENT_WAIT_FINISH;
       // Fallthrough
     case MG_TLS_STATE_CLIENT_WAIT_FINISH:
@@ -2077,13 +2565,14 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
         tls->app_keys = tls->enc;
         tls->enc = hs_keys;
         if (!mg_tls_send_cert(c, true) || !mg_tls_send_cert_verify(c, true) ||
-            !mg_tls_client_send_finish(c))
+            !mg_tls_client_send_finish(c, hash))
           return false;
         tls->enc = tls->app_keys;
       } else {
-        if (!mg_tls_client_send_finish(c)) return false;
+        if (!mg_tls_client_send_finish(c, hash)) return false;
         mg_tls_generate_application_keys(c);
       }
+      mg_tls_resumption_secret(tls, hash, tls->res_secret);
       tls->state = MG_TLS_STATE_CLIENT_CONNECTED;
       c->is_tls_hs = 0;
       mg_call(c, MG_EV_TLS_HS, NULL);
@@ -2097,16 +2586,19 @@ static bool mg_tls_client_handshake(struct mg_connection *c) {
 
 static bool mg_tls_server_handshake(struct mg_connection *c) {
   struct tls_data *tls = (struct tls_data *) c->tls;
+  uint8_t hash[32];
   switch (tls->state) {
     case MG_TLS_STATE_SERVER_START:
       if (mg_tls_server_recv_hello(c) < 0) break;
+      if (tls->is_resumed) tls->is_twoway = false;  // client authenticated
       if (!mg_tls_server_send_hello(c)) return false;
       mg_tls_generate_handshake_keys(c);
       if (!mg_tls_server_send_ext(c)) return false;
       if (tls->is_twoway && !mg_tls_server_send_cert_request(c)) return false;
-      if (!mg_tls_send_cert(c, false) || !mg_tls_send_cert_verify(c, false) ||
-          !mg_tls_server_send_finish(c))
+      if (!tls->is_resumed &&
+          (!mg_tls_send_cert(c, false) || !mg_tls_send_cert_verify(c, false)))
         return false;
+      if (!mg_tls_server_send_finish(c)) return false;
       if (tls->is_twoway) {
         // generate application keys at this point, keep using handshake keys
         struct tls_enc hs_keys = tls->enc;
@@ -2119,12 +2611,13 @@ static bool mg_tls_server_handshake(struct mg_connection *c) {
       tls->state = MG_TLS_STATE_SERVER_NEGOTIATED;
       // fallthrough
     case MG_TLS_STATE_SERVER_NEGOTIATED:
-      if (mg_tls_server_recv_finish(c) < 0) break;
+      if (mg_tls_server_recv_finish(c, hash) < 0) break;
       if (tls->is_twoway) {  // use previously generated keys
         tls->enc = tls->app_keys;
       } else {  // generate keys now
         mg_tls_generate_application_keys(c);
       }
+      if (!mg_tls_server_send_ticket(c, hash)) return false;
       tls->state = MG_TLS_STATE_SERVER_CONNECTED;
       c->is_tls_hs = 0;
       break;
@@ -2161,7 +2654,7 @@ void mg_tls_handshake(struct mg_connection *c) {
   }
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
   }  // if last chunk fails to be sent, it will be sent with first app data,
      // otherwise, it needs to be flushed
 }
@@ -2607,8 +3100,9 @@ static void sync_time_cb(struct mg_connection *c, int ev, void *ev_data) {
 
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   struct mg_str key;
-  struct tls_data *tls =
-      (struct tls_data *) mg_calloc(1, sizeof(struct tls_data));
+  struct tls_data *tls;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  tls = (struct tls_data *) mg_calloc(1, sizeof(struct tls_data));
   if (tls == NULL) {
     mg_error(c, "tls oom");
     return;
@@ -2634,6 +3128,15 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
     tls->hostname[opts->name.len] = 0;
   }
 
+  // save accepted ALPN protocols (server extension)
+  if (opts->alpn.len > 0 && !c->is_client) {
+    if (opts->alpn.len >= sizeof(tls->alpn)) {
+      mg_error(c, "alpn too long");
+      return;
+    }
+    memcpy(tls->alpn, opts->alpn.buf, opts->alpn.len);
+  }
+
   // server CA certificate; parse PEM [bundle] or DER
   if (opts->ca.len > 0)  {
     struct mg_str *all_certs = NULL;
@@ -2797,15 +3300,26 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   long n = MG_IO_WAIT;
   bool was_throttled = c->is_tls_throttled;  // see #3074
   if (!was_throttled) {                      // encrypt new data
-    if (len > MG_IO_SIZE) len = MG_IO_SIZE;
-    if (len > 16384) len = 16384;
-    if (!mg_tls_encrypt(c, (const uint8_t *) buf, len, MG_TLS_APP_DATA))
+    // Coalescing: pack full-size records, and send them all at once
+    size_t ofs = 0, max = c->mgr->coalesce || c->is_coalescing
+                              ? MG_IO_COALESCE_MAX
+                              : MG_IO_SIZE;
+    if (len > max) len = max;
+    while (ofs < len) {
+      size_t k = len - ofs > 16384 ? 16384 : len - ofs;
+      if (!mg_tls_encrypt(c, (const uint8_t *) buf + ofs, k, MG_TLS_APP_DATA))
+        break;
+      c->mgr->io.records++;
+      ofs += k;
+    }
+    if (ofs == 0 && len > 0)
       return 0;  // returning 0 means an OOM condition (iobuf couldn't resize),
                  // yet this is so far recoverable, let the caller decide
+    len = ofs;
   }  // else, resend outstanding encrypted data in tls->send
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
   }  // if last chunk fails to be sent, it needs to be flushed
   c->is_tls_throttled = (tls->send.len > 0 && n == MG_IO_WAIT);
   MG_VERBOSE(("%lu %ld %ld %ld %c %c", c->id, (long) len, (long) tls->send.len,
@@ -2825,6 +3339,10 @@ long mg_tls_recv(struct mg_connection *c, void *buf, size_t len) {
     r = mg_tls_recv_record(c);
     if (r < 0) return r;
     if (tls->content_type == MG_TLS_APP_DATA) break;
+    if (tls->content_type == MG_TLS_HANDSHAKE && c->is_client) {
+      mg_tls_client_recv_ticket(c, &c->rtls.buf[tls->recv_offset],
+                                tls->recv_len);
+    }
     tls->recv_len = 0;
     mg_tls_drop_record(c);
   }
@@ -2849,15 +3367,98 @@ void mg_tls_flush(struct mg_connection *c) {
   long n;
   while (tls->send.len > 0 &&
          (n = mg_io_send(c, tls->send.buf, tls->send.len)) > 0) {
-    mg_iobuf_del(&tls->send, 0, (size_t) n);
+    mg_iobuf_skip(&tls->send, (size_t) n);
+  }
+}
+
+// Default session store: keep the most recent sessions in memory. Tickets
+// are single-use, so a loaded session is removed
+static struct tls_session *tls_session_find(struct tls_ctx *ctx,
+                                            const char *name) {
+  size_t i;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    struct tls_session *s = &ctx->sessions[i];
+    if (s->name != NULL && strcmp(s->name, name) == 0) return s;
+  }
+  return NULL;
+}
+
+static void tls_session_free(struct tls_session *s) {
+  if (s->name == NULL) return;
+  mg_bzero((volatile unsigned char *) s->name, strlen(s->name) + 1 + s->len);
+  mg_free(s->name);
+  memset(s, 0, sizeof(*s));
+}
+
+static void tls_session_save(void *arg, const char *name, const void *buf,
+                             size_t len) {
+  struct tls_ctx *ctx = (struct tls_ctx *) arg;
+  struct tls_session *s = tls_session_find(ctx, name);
+  size_t i, n = strlen(name) + 1;
+  char *p = (char *) mg_calloc(1, n + len);
+  if (p == NULL) return;
+  if (s == NULL) {  // Replace an unused or the least recently used entry
+    for (s = &ctx->sessions[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+      if (s->name == NULL) break;
+      if (ctx->sessions[i].name == NULL ||
+          ctx->sessions[i].used < s->used) {
+        s = &ctx->sessions[i];
+      }
+    }
+  }
+  tls_session_free(s);
+  memmove(p, name, n);
+  memmove(p + n, buf, len);
+  s->name = p, s->len = len, s->used = ++ctx->used;
+}
+
+static size_t tls_session_load(void *arg, const char *name, void *buf,
+                               size_t len) {
+  struct tls_session *s = tls_session_find((struct tls_ctx *) arg, name);
+  size_t n = 0;
+  if (s != NULL && s->len <= len) {
+    memmove(buf, s->name + strlen(s->name) + 1, s->len);
+    n = s->len;
+  }
+  if (s != NULL) tls_session_free(s);
+  return n;
+}
+
+void mg_tls_set_session_store(struct mg_mgr *mgr,
+                              const struct mg_tls_session_store *store) {
+  struct tls_ctx *ctx = (struct tls_ctx *) mgr->tls_ctx;
+  if (ctx == NULL) return;
+  if (store != NULL) {
+    ctx->store = *store;
+  } else {
+    ctx->store.save = tls_session_save;
+    ctx->store.load = tls_session_load;
+    ctx->store.arg = ctx;
   }
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct tls_ctx *ctx = (struct tls_ctx *) mg_calloc(1, sizeof(*ctx));
+  if (ctx == NULL) {
+    MG_ERROR(("TLS context OOM"));  // No session resumption
+  } else if (!mg_random(ctx->ticket_key, sizeof(ctx->ticket_key))) {
+    MG_ERROR(("RNG"));
+    mg_free(ctx);
+  } else {
+    mgr->tls_ctx = ctx;
+    mg_tls_set_session_store(mgr, NULL);
+  }
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct tls_ctx *ctx = (struct tls_ctx *) mgr->tls_ctx;
+  size_t i;
+  if (ctx == NULL) return;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tls_session_free(&ctx->sessions[i]);
+  }
+  mg_bzero(ctx->ticket_key, sizeof(ctx->ticket_key));
+  mg_free(ctx);
+  mgr->tls_ctx = NULL;
 }
 #endif
@@ -3,6 +3,7 @@
 #if MG_TLS == MG_TLS_NONE
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   (void) opts;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
   mg_error(c, "TLS is not enabled");
 }
 void mg_tls_handshake(struct mg_connection *c) {
@@ -51,17 +51,24 @@ static bool mg_load_key(struct mg_str str, mbedtls_pk_context *p) {
   return true;
 }
 
+static void tls_conf_unref(struct mg_tls_conf *tc) {
+  if (tc == NULL || --tc->refs > 0) return;
+  mbedtls_ssl_config_free(&tc->conf);
+  mbedtls_pk_free(&tc->pk);
+  mbedtls_x509_crt_free(&tc->ca);
+  mbedtls_x509_crt_free(&tc->cert);
+  mg_bzero((volatile unsigned char *) (tc + 1),
+           tc->ca_str.len + tc->cert_str.len + tc->key_str.len);
+  mg_free(tc);
+}
+
 void mg_tls_free(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   if (tls != NULL) {
+    if (tls->conf != NULL) tls->conf->c = c;
     mbedtls_ssl_free(&tls->ssl);
-    mbedtls_pk_free(&tls->pk);
-    mbedtls_x509_crt_free(&tls->ca);
-    mbedtls_x509_crt_free(&tls->cert);
-    mbedtls_ssl_config_free(&tls->conf);
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-    mbedtls_ssl_ticket_free(&tls->ticket);
-#endif
+    if (tls->conf != NULL) tls->conf->c = NULL;
+    tls_conf_unref(tls->conf);
     // PSA has global data. Do not call mbedtls_psa_crypto_free() here,
     // it will free all global resources. Call it when actually freeing all
     // application resources (main() exits)
@@ -90,7 +97,9 @@ static int mg_net_recv(void *ctx, unsigned char *buf, size_t len) {
 
 void mg_tls_handshake(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
-  int rc = mbedtls_ssl_handshake(&tls->ssl);
+  int rc;
+  tls->conf->c = c;  // Shared config: tell debug_cb() which connection it is
+  rc = mbedtls_ssl_handshake(&tls->ssl);
   if (rc == 0) {  // Success
     if (tls->check_name && (mbedtls_ssl_get_verify_result(&tls->ssl) &
                             MBEDTLS_X509_BADCERT_CN_MISMATCH)) {
@@ -109,35 +118,57 @@ void mg_tls_handshake(struct mg_connection *c) {
   }
 }
 
-static void debug_cb(void *c, int lev, const char *s, int n, const char *s2) {
+static void debug_cb(void *tc, int lev, const char *s, int n, const char *s2) {
+  struct mg_connection *c = ((struct mg_tls_conf *) tc)->c;
   n = (int) strlen(s2) - 1;
-  MG_INFO(("%lu %d %.*s", ((struct mg_connection *) c)->id, lev, n, s2));
+  MG_INFO(("%lu %d %.*s", c == NULL ? 0 : c->id, lev, n, s2));
   (void) s;
 }
 
-void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
-  struct mg_tls *tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
-  int rc = 0;
-  bool check_name = false;
-  c->tls = tls;
-  if (c->tls == NULL) {
+static struct mg_str tls_str_copy(char **p, struct mg_str s) {
+  struct mg_str copy = mg_str_n(*p, s.len);
+  if (s.len > 0) memcpy(*p, s.buf, s.len);
+  *p += s.len;
+  return copy;
+}
+
+static bool tls_str_eq(struct mg_str a, struct mg_str b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.buf, b.buf, a.len) == 0);
+}
+
+// Build a config with everything that does not depend on a peer: role,
+// authmode, CA chain, own certificate and key, ALPN, session tickets
+static struct mg_tls_conf *tls_conf_new(struct mg_connection *c,
+                                        const struct mg_tls_opts *opts,
+                                        bool check_name) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  size_t n = opts->ca.len + opts->cert.len + opts->key.len +
+             opts->alpn.len * 2 + 1;  // ALPN list, then NUL-terminated names
+  struct mg_tls_conf *tc =
+      (struct mg_tls_conf *) mg_calloc(1, sizeof(*tc) + n);
+  char *p = (char *) (tc + 1);
+  int rc;
+  if (tc == NULL) {
     mg_error(c, "TLS OOM");
-    goto fail;
+    return NULL;
   }
-  if (c->is_listening) goto fail;
-  MG_DEBUG(("%lu Setting TLS", c->id));
-  MG_PROF_ADD(c, "mbedtls_init_start");
-  mbedtls_ssl_init(&tls->ssl);
-  mbedtls_ssl_config_init(&tls->conf);
-  mbedtls_x509_crt_init(&tls->ca);
-  mbedtls_x509_crt_init(&tls->cert);
-  mbedtls_pk_init(&tls->pk);
-  mbedtls_ssl_conf_dbg(&tls->conf, debug_cb, c);
+  tc->refs = 1;
+  mbedtls_ssl_config_init(&tc->conf);
+  mbedtls_x509_crt_init(&tc->ca);
+  mbedtls_x509_crt_init(&tc->cert);
+  mbedtls_pk_init(&tc->pk);
+  tc->ca_str = tls_str_copy(&p, opts->ca);
+  tc->cert_str = tls_str_copy(&p, opts->cert);
+  tc->key_str = tls_str_copy(&p, opts->key);
+  tc->alpn_str = tls_str_copy(&p, opts->alpn);
+  tc->is_client = c->is_client;
+  tc->check_name = check_name;
+  mbedtls_ssl_conf_dbg(&tc->conf, debug_cb, tc);
 #if defined(MG_MBEDTLS_DEBUG_LEVEL)
   mbedtls_debug_set_threshold(MG_MBEDTLS_DEBUG_LEVEL);
 #endif
   if ((rc = mbedtls_ssl_config_defaults(
-           &tls->conf,
+           &tc->conf,
            c->is_client ? MBEDTLS_SSL_IS_CLIENT : MBEDTLS_SSL_IS_SERVER,
            MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
     mg_error(c, "tls defaults %#x", -mg_tls_err(c, rc));
@@ -146,9 +177,107 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
 #if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x04000000
   MG_INFO(("PSA is in control of random number generation"));
 #else
-  mbedtls_ssl_conf_rng(&tls->conf, mg_mbed_rng, c);
+  mbedtls_ssl_conf_rng(&tc->conf, mg_mbed_rng, NULL);
 #endif
 
+  if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
+    mbedtls_ssl_conf_authmode(&tc->conf, check_name  // see mg_tls_init()
+                                             ? MBEDTLS_SSL_VERIFY_OPTIONAL
+                                             : MBEDTLS_SSL_VERIFY_NONE);
+  } else {
+    if (mg_load_cert(opts->ca, &tc->ca) == false) goto fail;
+    mbedtls_ssl_conf_ca_chain(&tc->conf, &tc->ca, NULL);
+    mbedtls_ssl_conf_authmode(&tc->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  if (!mg_load_cert(opts->cert, &tc->cert)) goto fail;
+  if (!mg_load_key(opts->key, &tc->pk)) goto fail;
+  if (tc->cert.version &&
+      (rc = mbedtls_ssl_conf_own_cert(&tc->conf, &tc->cert, &tc->pk)) != 0) {
+    mg_error(c, "own cert %#x", -mg_tls_err(c, rc));
+    goto fail;
+  }
+#ifdef MBEDTLS_SSL_ALPN
+  if (!c->is_client && opts->alpn.len > 0) {
+    struct mg_str k, s = tc->alpn_str;
+    size_t i = 0, max = sizeof(tc->alpn) / sizeof(tc->alpn[0]) - 1;
+    while (i < max && mg_span(s, &k, &s, ',')) {
+      if (k.len == 0) continue;
+      tc->alpn[i++] = p;
+      memcpy(p, k.buf, k.len);
+      p += k.len + 1;  // Zeroed by mg_calloc(), so NUL-terminated
+    }
+    mbedtls_ssl_conf_alpn_protocols(&tc->conf, tc->alpn);
+  }
+#endif
+
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  if (!c->is_client && ctx != NULL && ctx->has_tickets) {
+    mbedtls_ssl_conf_session_tickets_cb(&tc->conf, mbedtls_ssl_ticket_write,
+                                        mbedtls_ssl_ticket_parse,
+                                        &ctx->tickets);
+  }
+#endif
+  (void) ctx;
+  return tc;
+fail:
+  tls_conf_unref(tc);
+  return NULL;
+}
+
+// Return a referenced config for the connection. Configs are cached in
+// mgr->tls_ctx by role, CA, cert and key, so that connections with the same
+// options skip parsing them
+static struct mg_tls_conf *tls_conf_get(struct mg_connection *c,
+                                        const struct mg_tls_opts *opts,
+                                        bool check_name) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  struct mg_tls_conf *tc, **slot;
+  size_t i;
+  if (ctx == NULL) return tls_conf_new(c, opts, check_name);
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tc = ctx->confs[i];
+    if (tc != NULL && tc->is_client == c->is_client &&
+        tc->check_name == check_name && tls_str_eq(tc->ca_str, opts->ca) &&
+        tls_str_eq(tc->cert_str, opts->cert) &&
+        tls_str_eq(tc->key_str, opts->key) &&
+        tls_str_eq(tc->alpn_str, opts->alpn)) {
+      tc->used = ++ctx->used;
+      tc->refs++;
+      return tc;
+    }
+  }
+  if ((tc = tls_conf_new(c, opts, check_name)) == NULL) return NULL;
+
+  // Replace an unused or the least recently used entry. Connections still
+  // using an evicted config keep it alive until they are freed
+  for (slot = &ctx->confs[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    if (*slot == NULL) break;
+    if (ctx->confs[i] == NULL || ctx->confs[i]->used < (*slot)->used) {
+      slot = &ctx->confs[i];
+    }
+  }
+  tls_conf_unref(*slot);
+  *slot = tc;
+  tc->used = ++ctx->used;
+  tc->refs++;
+  return tc;
+}
+
+void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
+  struct mg_tls *tls;
+  int rc = 0;
+  bool check_name = false;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  c->tls = tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+  if (c->tls == NULL) {
+    mg_error(c, "TLS OOM");
+    goto fail;
+  }
+  if (c->is_listening) goto fail;
+  MG_DEBUG(("%lu Setting TLS", c->id));
+  MG_PROF_ADD(c, "mbedtls_init_start");
+  mbedtls_ssl_init(&tls->ssl);
+
   if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 &&
       opts->name.buf[0] != '\0') {
     char *host = mg_mprintf("%.*s", opts->name.len, opts->name.buf);
@@ -166,32 +295,12 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
     mbedtls_ssl_set_hostname(&tls->ssl, NULL);
   }
   if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
-    mbedtls_ssl_conf_authmode(&tls->conf, check_name  // see set comment above
-                                              ? MBEDTLS_SSL_VERIFY_OPTIONAL
-                                              : MBEDTLS_SSL_VERIFY_NONE);
     tls->check_name = check_name; // host name set but no CA cert given
-  } else {
-    if (mg_load_cert(opts->ca, &tls->ca) == false) goto fail;
-    mbedtls_ssl_conf_ca_chain(&tls->conf, &tls->ca, NULL);
-    mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-  }
-  if (!mg_load_cert(opts->cert, &tls->cert)) goto fail;
-  if (!mg_load_key(opts->key, &tls->pk)) goto fail;
-  if (tls->cert.version &&
-      (rc = mbedtls_ssl_conf_own_cert(&tls->conf, &tls->cert, &tls->pk)) != 0) {
-    mg_error(c, "own cert %#x", -mg_tls_err(c, rc));
-    goto fail;
   }
+  if ((tls->conf = tls_conf_get(c, opts, check_name)) == NULL) goto fail;
 
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-  if (!c->is_client && c->mgr->tls_ctx != NULL) {
-    mbedtls_ssl_conf_session_tickets_cb(
-        &tls->conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse,
-        &((struct mg_tls_ctx *) c->mgr->tls_ctx)->tickets);
-  }
-#endif
-
-  if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf)) != 0) {
+  tls->conf->c = c;
+  if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf->conf)) != 0) {
     mg_error(c, "setup err %#x", -mg_tls_err(c, rc));
     goto fail;
   }
@@ -211,7 +320,9 @@ size_t mg_tls_pending(struct mg_connection *c) {
 
 long mg_tls_recv(struct mg_connection *c, void *buf, size_t len) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
-  long n = mbedtls_ssl_read(&tls->ssl, (unsigned char *) buf, len);
+  long n;
+  tls->conf->c = c;
+  n = mbedtls_ssl_read(&tls->ssl, (unsigned char *) buf, len);
   if (!c->is_tls_hs && (buf == NULL || len == 0) && n == 0) return 0;  // MIP
   if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
     return MG_IO_WAIT;
@@ -228,6 +339,7 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   long n;
   bool was_throttled = c->is_tls_throttled;  // see #3074
+  tls->conf->c = c;
   n = was_throttled ? mbedtls_ssl_write(&tls->ssl, tls->throttled_buf,
                                         tls->throttled_len) /* flush old data */
                     : mbedtls_ssl_write(&tls->ssl, (unsigned char *) buf,
@@ -246,14 +358,16 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
     return MG_IO_WAIT;
   }
   if (n <= 0) return MG_IO_ERR;
+  c->mgr->io.records++;  // mbedtls_ssl_write() produces one record
   return n;
 }
 
 void mg_tls_flush(struct mg_connection *c) {
   struct mg_tls *tls = (struct mg_tls *) c->tls;
   if (c->is_tls_throttled && c->is_draining) {
-    long n =
-        mbedtls_ssl_write(&tls->ssl, tls->throttled_buf, tls->throttled_len);
+    long n;
+    tls->conf->c = c;
+    n = mbedtls_ssl_write(&tls->ssl, tls->throttled_buf, tls->throttled_len);
 #if defined(MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
     if (n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) return;
 #endif
@@ -263,42 +377,41 @@ void mg_tls_flush(struct mg_connection *c) {
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
+  struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*ctx));
 #if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x03000000 && \
     defined(MBEDTLS_PSA_CRYPTO_C)
   psa_crypto_init();  // Initializes global PSA resources, no-op if already done
 #endif
+  if (ctx == NULL) {
+    MG_ERROR(("TLS context init OOM"));  // Connections build their own config
+    return;
+  }
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
   {
-    struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*ctx));
-    if (ctx == NULL) {
-      MG_ERROR(("TLS context init OOM"));
-    } else {
-      int rc;
-      mbedtls_ssl_ticket_init(&ctx->tickets);
+    int rc;
+    mbedtls_ssl_ticket_init(&ctx->tickets);
 #if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x04000000
-      rc = mbedtls_ssl_ticket_setup(&ctx->tickets, PSA_ALG_GCM,
-                                    PSA_KEY_TYPE_AES, 128, 86400);
+    rc = mbedtls_ssl_ticket_setup(&ctx->tickets, PSA_ALG_GCM, PSA_KEY_TYPE_AES,
+                                  128, 86400);
 #else
-      rc = mbedtls_ssl_ticket_setup(&ctx->tickets, mg_mbed_rng, NULL,
-                                         MBEDTLS_CIPHER_AES_128_GCM, 86400);
+    rc = mbedtls_ssl_ticket_setup(&ctx->tickets, mg_mbed_rng, NULL,
+                                  MBEDTLS_CIPHER_AES_128_GCM, 86400);
 #endif
-      if (rc != 0) {
-        MG_ERROR((" mbedtls_ssl_ticket_setup %#x", -rc));
-        mbedtls_ssl_ticket_free(&ctx->tickets);
-        mg_free(ctx);
-      } else {
-        mgr->tls_ctx = ctx;
-      }
+    if (rc != 0) {
+      MG_ERROR((" mbedtls_ssl_ticket_setup %#x", -rc));
+    } else {
+      ctx->has_tickets = true;
     }
   }
-#else
-  (void) mgr;
 #endif
+  mgr->tls_ctx = ctx;
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
   struct mg_tls_ctx *ctx = (struct mg_tls_ctx *) mgr->tls_ctx;
   if (ctx != NULL) {
+    size_t i;
+    for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) tls_conf_unref(ctx->confs[i]);
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
     mbedtls_ssl_ticket_free(&ctx->tickets);
 #endif
@@ -12,22 +12,35 @@
 #include <mbedtls/ssl.h>
 #include <mbedtls/ssl_ticket.h>
 
+// SSL config with the parsed CA, cert and key, shared by connections with
+// the same options. Referenced by the cache and by each connection using it
+struct mg_tls_conf {
+  mbedtls_ssl_config conf;  // SSL/TLS config
+  mbedtls_x509_crt ca;      // Parsed CA certificate
+  mbedtls_x509_crt cert;    // Parsed certificate
+  mbedtls_pk_context pk;    // Private key context
+  struct mg_str ca_str, cert_str, key_str;  // Copies of the options
+  struct mg_str alpn_str;   // Copy of the options, too
+  const char *alpn[5];      // Server: ALPN protocols, NULL-terminated
+  bool is_client;           // Client or server config
+  bool check_name;          // Host name given, affects authmode without CA
+  struct mg_connection *c;  // Connection in an mbedTLS call, for debug_cb()
+  unsigned long used;       // Last use stamp, for LRU eviction
+  int refs;                 // Reference count
+};
+
 struct mg_tls_ctx {
-  int dummy;
 #ifdef MBEDTLS_SSL_SESSION_TICKETS
   mbedtls_ssl_ticket_context tickets;
+  bool has_tickets;  // Ticket keys set up, servers issue session tickets
 #endif
+  unsigned long used;
+  struct mg_tls_conf *confs[MG_TLS_CTX_CACHE_SIZE];
 };
 
 struct mg_tls {
-  mbedtls_x509_crt ca;      // Parsed CA certificate
-  mbedtls_x509_crt cert;    // Parsed certificate
-  mbedtls_pk_context pk;    // Private key context
-  mbedtls_ssl_context ssl;  // SSL/TLS context
-  mbedtls_ssl_config conf;  // SSL/TLS config
-#ifdef MBEDTLS_SSL_SESSION_TICKETS
-  mbedtls_ssl_ticket_context ticket;  // Session tickets context
-#endif
+  mbedtls_ssl_context ssl;    // SSL/TLS context
+  struct mg_tls_conf *conf;   // Shared SSL/TLS config
   // https://github.com/Mbed-TLS/mbedtls/blob/3b3c652d/include/mbedtls/ssl.h#L5071C18-L5076C29
   unsigned char *throttled_buf;  // see #3074
   size_t throttled_len;
@@ -57,17 +57,17 @@ static EVP_PKEY *load_key(struct mg_str s) {
   return key;
 }
 
-static int load_cert(SSL *ssl, struct mg_str s) {
+static int load_cert(SSL_CTX *ctx, struct mg_str s) {
   BIO *bio = BIO_new_mem_buf(s.buf, (int) (long) s.len);
   X509 *cert = NULL;
   int rc = 0;
   if (bio == NULL) return 0;
   if (MG_IS_DER(s.buf)) {
     cert = d2i_X509_bio(bio, NULL);
-    rc = cert == NULL ? 0 : SSL_use_certificate(ssl, cert);
+    rc = cert == NULL ? 0 : SSL_CTX_use_certificate(ctx, cert);
   } else {
     cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
-    rc = cert == NULL ? 0 : SSL_use_certificate(ssl, cert);
+    rc = cert == NULL ? 0 : SSL_CTX_use_certificate(ctx, cert);
 #if MG_TLS != MG_TLS_WOLFSSL
     X509_free(cert);
     while (rc == 1) {
@@ -76,7 +76,7 @@ static int load_cert(SSL *ssl, struct mg_str s) {
         ERR_clear_error();  // PEM_read_bio_X509 sets an error on EOF
         break;
       }
-      rc = (int) SSL_add1_chain_cert(ssl, cert);
+      rc = (int) SSL_CTX_add1_chain_cert(ctx, cert);
       X509_free(cert);
     }
     cert = NULL;
@@ -118,6 +118,27 @@ static int mg_bio_write(BIO *bio, const char *buf, int len) {
   return len;
 }
 
+#if (MG_TLS == MG_TLS_OPENSSL && OPENSSL_VERSION_NUMBER >= 0x10002000L) || \
+    defined(HAVE_ALPN)
+// Server: select the first of our ALPN protocols that the client offers
+static int tls_alpn_cb(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+  BIO *bio = SSL_get_rbio(ssl);
+  struct mg_connection *c = (struct mg_connection *) BIO_get_data(bio);
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  if (tls->alpn == NULL ||
+      SSL_select_next_proto((unsigned char **) out, outlen, tls->alpn,
+                            (unsigned int) tls->alpn_len, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  (void) arg;
+  return SSL_TLSEXT_ERR_OK;
+}
+#define MG_TLS_ALPN 1
+#endif
+
 #ifdef MG_TLS_SSLKEYLOGFILE
 static void ssl_keylog_cb(const SSL *ssl, const char *line) {
   FILE *f;
@@ -135,85 +156,76 @@ static void ssl_keylog_cb(const SSL *ssl, const char *line) {
 }
 #endif
 
-void mg_tls_free(struct mg_connection *c) {
-  struct mg_tls *tls = (struct mg_tls *) c->tls;
-  if (tls == NULL) return;
-  SSL_free(tls->ssl);
-  SSL_CTX_free(tls->ctx);
-  BIO_meth_free(tls->bm);
-  mg_free(tls->name);
-  mg_free(tls);
-  c->tls = NULL;
+static BIO_METHOD *tls_bio_method(void) {
+#if MG_TLS == MG_TLS_WOLFSSL
+  BIO_METHOD *bm = BIO_meth_new(0, "bio_mg");
+#else
+  BIO_METHOD *bm =
+      BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "bio_mg");
+#endif
+  if (bm != NULL) {
+    BIO_meth_set_write(bm, mg_bio_write);
+    BIO_meth_set_read(bm, mg_bio_read);
+    BIO_meth_set_ctrl(bm, mg_bio_ctrl);
+  }
+  return bm;
 }
 
-void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
-  struct mg_tls *tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+// Print and clear the error queue after a failed SSL_CTX call
+static unsigned long tls_ctx_err(struct mg_connection *c) {
+  unsigned long err = ERR_peek_last_error();
+  ERR_print_errors_cb(tls_err_cb, c);
+  ERR_clear_error();
+  return err;
+}
+
+// Build an SSL_CTX with everything that does not depend on a peer: protocols,
+// CA store, certificate chain and private key
+static SSL_CTX *tls_ctx_new(struct mg_connection *c,
+                            const struct mg_tls_opts *opts) {
+  SSL_CTX *ctx = c->is_client ? SSL_CTX_new(TLS_client_method())
+                              : SSL_CTX_new(TLS_server_method());
   const char *id = "mongoose";
-  bool check_name = false;
-  static unsigned char s_initialised = 0;
-  BIO *bio = NULL;
   int rc;
-  c->tls = tls;
-  if (tls == NULL) {
-    mg_error(c, "TLS OOM");
-    goto fail;
-  }
-
-  if (!s_initialised) {
-    SSL_library_init();
-    s_initialised++;
-  }
-  MG_DEBUG(("%lu Setting TLS", c->id));
-  tls->ctx = c->is_client ? SSL_CTX_new(TLS_client_method())
-                          : SSL_CTX_new(TLS_server_method());
-  if (tls->ctx == NULL) {
+  if (ctx == NULL) {
     mg_error(c, "SSL_CTX_new");
-    goto fail;
+    return NULL;
   }
 #ifdef MG_TLS_SSLKEYLOGFILE
-  SSL_CTX_set_keylog_callback(tls->ctx, ssl_keylog_cb);
+  SSL_CTX_set_keylog_callback(ctx, ssl_keylog_cb);
 #endif
-  if ((tls->ssl = SSL_new(tls->ctx)) == NULL) {
-    mg_error(c, "SSL_new");
-    goto fail;
-  }
-  SSL_set_session_id_context(tls->ssl, (const uint8_t *) id,
-                             (unsigned) strlen(id));
+#ifdef MG_TLS_ALPN
+  if (!c->is_client) SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_cb, NULL);
+#endif
+  SSL_CTX_set_session_id_context(ctx, (const uint8_t *) id,
+                                 (unsigned) strlen(id));
   // Disable deprecated protocols
-  SSL_set_options(tls->ssl, SSL_OP_NO_SSLv2);
-  SSL_set_options(tls->ssl, SSL_OP_NO_SSLv3);
-  SSL_set_options(tls->ssl, SSL_OP_NO_TLSv1);
-  SSL_set_options(tls->ssl, SSL_OP_NO_TLSv1_1);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_1);
 #ifdef MG_ENABLE_OPENSSL_NO_COMPRESSION
-  SSL_set_options(tls->ssl, SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 #endif
 #ifdef MG_ENABLE_OPENSSL_CIPHER_SERVER_PREFERENCE
-  SSL_set_options(tls->ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 #endif
 
-if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.buf[0] != '\0') {
-  tls->name = mg_mprintf("%.*s", (int) opts->name.len, opts->name.buf);
-  if (tls->name == NULL) {
-    mg_error(c, "TLS OOM");
-    goto fail;
-  }
-  check_name = true;
-}
 #if MG_TLS == MG_TLS_WOLFSSL && !defined(OPENSSL_COMPATIBLE_DEFAULTS)
   if (opts->ca.len == 0 || mg_strcmp(opts->ca, mg_str("*")) == 0) {
     // Older versions require that either the CA is loaded or SSL_VERIFY_NONE
     // explicitly set
-    SSL_set_verify(tls->ssl, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
   }
 #endif
 
   if (opts->ca.buf != NULL && opts->ca.len > 0 && opts->ca.buf[0] != '\0') {
-    SSL_set_verify(tls->ssl, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
-                   NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                       NULL);
 #if MG_TLS == MG_TLS_WOLFSSL
     extern int wolfSSL_CTX_load_verify_buffer(SSL_CTX *, const unsigned char *,
                                               long, int);
-    rc = wolfSSL_CTX_load_verify_buffer(tls->ctx,
+    rc = wolfSSL_CTX_load_verify_buffer(ctx,
                                         (const unsigned char *) opts->ca.buf,
                                         (long) opts->ca.len, SSL_FILETYPE_PEM);
     if (rc != 1) {
@@ -222,38 +234,165 @@ if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.b
     }
 #else
     STACK_OF(X509_INFO) *certs = load_ca_certs(opts->ca);
-    rc = add_ca_certs(tls->ctx, certs);
+    rc = add_ca_certs(ctx, certs);
     sk_X509_INFO_pop_free(certs, X509_INFO_free);
     if (!rc) {
       mg_error(c, "CA err");
       goto fail;
     }
 #endif
-  } else {
-    tls->check_name = check_name; // host name set but no CA cert given
   }
 
   if (opts->cert.buf != NULL && opts->cert.buf[0] != '\0') {
-    rc = load_cert(tls->ssl, opts->cert);
+    rc = load_cert(ctx, opts->cert);
     if (rc != 1) {
-      mg_error(c, "CERT err %d", mg_tls_err(c, tls, rc));
+      mg_error(c, "CERT err %lu", tls_ctx_err(c));
       goto fail;
     }
   }
   if (opts->key.buf != NULL && opts->key.buf[0] != '\0') {
     EVP_PKEY *key = load_key(opts->key);
-    rc = key == NULL ? 0 : SSL_use_PrivateKey(tls->ssl, key);
+    rc = key == NULL ? 0 : SSL_CTX_use_PrivateKey(ctx, key);
     EVP_PKEY_free(key);
     if (key == NULL || rc != 1) {
-      mg_error(c, "KEY err %d", mg_tls_err(c, tls, rc));
+      mg_error(c, "KEY err %lu", tls_ctx_err(c));
       goto fail;
     }
   }
 
-  SSL_set_mode(tls->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 #if MG_TLS == MG_TLS_OPENSSL && OPENSSL_VERSION_NUMBER > 0x10002000L
-  (void) SSL_set_ecdh_auto(tls->ssl, 1);
+  (void) SSL_CTX_set_ecdh_auto(ctx, 1);
 #endif
+  return ctx;
+fail:
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+static bool tls_str_eq(struct mg_str a, struct mg_str b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.buf, b.buf, a.len) == 0);
+}
+
+static void tls_ctx_entry_free(struct mg_tls_ctx_entry *e) {
+  if (e->ctx == NULL) return;
+  SSL_CTX_free(e->ctx);
+  mg_bzero((volatile unsigned char *) e->ca.buf,
+           e->ca.len + e->cert.len + e->key.len);
+  mg_free(e->ca.buf);  // Holds cert and key, too
+  memset(e, 0, sizeof(*e));
+}
+
+// Return an SSL_CTX for the connection, referenced for the caller. Contexts
+// are cached in mgr->tls_ctx by role, CA, cert and key, so that connections
+// with the same options skip parsing and loading them, and share a session
+// cache
+static SSL_CTX *tls_ctx_get(struct mg_connection *c,
+                            const struct mg_tls_opts *opts) {
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  struct mg_tls_ctx_entry *e;
+  SSL_CTX *ctx;
+  size_t i, n = opts->ca.len + opts->cert.len + opts->key.len;
+  char *buf;
+  if (tc == NULL) return tls_ctx_new(c, opts);
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    e = &tc->entries[i];
+    if (e->ctx != NULL && e->is_client == c->is_client &&
+        tls_str_eq(e->ca, opts->ca) && tls_str_eq(e->cert, opts->cert) &&
+        tls_str_eq(e->key, opts->key)) {
+      e->used = ++tc->used;
+      SSL_CTX_up_ref(e->ctx);
+      return e->ctx;
+    }
+  }
+  if ((ctx = tls_ctx_new(c, opts)) == NULL) return NULL;
+  if ((buf = (char *) mg_calloc(1, n + 1)) == NULL) return ctx;  // Uncached
+
+  // Replace an unused or the least recently used entry
+  for (e = &tc->entries[0], i = 1; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    if (e->ctx == NULL) break;
+    if (tc->entries[i].ctx == NULL || tc->entries[i].used < e->used) {
+      e = &tc->entries[i];
+    }
+  }
+  tls_ctx_entry_free(e);
+  if (opts->ca.len > 0) memcpy(buf, opts->ca.buf, opts->ca.len);
+  if (opts->cert.len > 0) {
+    memcpy(buf + opts->ca.len, opts->cert.buf, opts->cert.len);
+  }
+  if (opts->key.len > 0) {
+    memcpy(buf + opts->ca.len + opts->cert.len, opts->key.buf, opts->key.len);
+  }
+  e->ca = mg_str_n(buf, opts->ca.len);
+  e->cert = mg_str_n(buf + opts->ca.len, opts->cert.len);
+  e->key = mg_str_n(buf + opts->ca.len + opts->cert.len, opts->key.len);
+  e->is_client = c->is_client;
+  e->used = ++tc->used;
+  e->ctx = ctx;
+  SSL_CTX_up_ref(ctx);
+  return ctx;
+}
+
+void mg_tls_free(struct mg_connection *c) {
+  struct mg_tls *tls = (struct mg_tls *) c->tls;
+  if (tls == NULL) return;
+  SSL_free(tls->ssl);
+  SSL_CTX_free(tls->ctx);
+  if (tls->bm != NULL) BIO_meth_free(tls->bm);
+  mg_free(tls->name);
+  mg_free(tls->alpn);
+  mg_free(tls);
+  c->tls = NULL;
+}
+
+void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
+  struct mg_tls *tls;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) c->mgr->tls_ctx;
+  static unsigned char s_initialised = 0;
+  BIO_METHOD *bm = tc == NULL ? NULL : tc->bm;
+  BIO *bio = NULL;
+  if (c->is_http2) return;  // HTTP/2 streams use the parent's TLS session
+  c->tls = tls = (struct mg_tls *) mg_calloc(1, sizeof(*tls));
+  if (tls == NULL) {
+    mg_error(c, "TLS OOM");
+    goto fail;
+  }
+
+  if (!s_initialised) {
+    SSL_library_init();
+    s_initialised++;
+  }
+  MG_DEBUG(("%lu Setting TLS", c->id));
+  if ((tls->ctx = tls_ctx_get(c, opts)) == NULL) goto fail;
+  if ((tls->ssl = SSL_new(tls->ctx)) == NULL) {
+    mg_error(c, "SSL_new");
+    goto fail;
+  }
+
+  if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 &&
+      opts->name.buf[0] != '\0') {
+    tls->name = mg_mprintf("%.*s", (int) opts->name.len, opts->name.buf);
+    if (tls->name == NULL) {
+      mg_error(c, "TLS OOM");
+      goto fail;
+    }
+    // Host name set but no CA cert given
+    tls->check_name = opts->ca.buf == NULL || opts->ca.len == 0 ||
+                      opts->ca.buf[0] == '\0';
+  }
+  if (!c->is_client && opts->alpn.len > 0) {  // "h2,http/1.1" -> wire format
+    struct mg_str k, s = opts->alpn;
+    if ((tls->alpn = (unsigned char *) mg_calloc(1, s.len + 1)) == NULL) {
+      mg_error(c, "TLS OOM");
+      goto fail;
+    }
+    while (mg_span(s, &k, &s, ',')) {
+      if (k.len == 0 || k.len > 255) continue;
+      tls->alpn[tls->alpn_len++] = (unsigned char) k.len;
+      memcpy(tls->alpn + tls->alpn_len, k.buf, k.len);
+      tls->alpn_len += k.len;
+    }
+  }
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
   if (tls->name != NULL) {
 #if MG_TLS != MG_TLS_WOLFSSL || LIBWOLFSSL_VERSION_HEX >= 0x05005002
@@ -264,16 +403,11 @@ if (c->is_client && opts->name.buf != NULL && opts->name.len > 0 && opts->name.b
     SSL_set_tlsext_host_name(tls->ssl, tls->name);
   }
 #endif
-#if MG_TLS == MG_TLS_WOLFSSL
-  tls->bm = BIO_meth_new(0, "bio_mg");
-#else
-  tls->bm = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "bio_mg");
-#endif
-  BIO_meth_set_write(tls->bm, mg_bio_write);
-  BIO_meth_set_read(tls->bm, mg_bio_read);
-  BIO_meth_set_ctrl(tls->bm, mg_bio_ctrl);
-
-  bio = BIO_new(tls->bm);
+  if (bm == NULL && (bm = tls->bm = tls_bio_method()) == NULL) {
+    mg_error(c, "BIO_meth_new");
+    goto fail;
+  }
+  bio = BIO_new(bm);
   BIO_set_data(bio, c);
   SSL_set_bio(tls->ssl, bio, bio);
 
@@ -332,6 +466,7 @@ long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
   int n = SSL_write(tls->ssl, buf, (int) len);
   if (n < 0 && mg_tls_err(c, tls, n) == 0) return MG_IO_WAIT;
   if (n <= 0) return MG_IO_ERR;
+  c->mgr->io.records += ((size_t) n + 16383) / 16384;  // Full-size records
   return n;
 }
 
@@ -340,10 +475,24 @@ void mg_tls_flush(struct mg_connection *c) {
 }
 
 void mg_tls_ctx_init(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) mg_calloc(1, sizeof(*tc));
+  if (tc == NULL) {
+    MG_ERROR(("TLS context OOM"));  // Connections build their own SSL_CTX
+  } else {
+    tc->bm = tls_bio_method();
+    mgr->tls_ctx = tc;
+  }
 }
 
 void mg_tls_ctx_free(struct mg_mgr *mgr) {
-  (void) mgr;
+  struct mg_tls_ctx *tc = (struct mg_tls_ctx *) mgr->tls_ctx;
+  size_t i;
+  if (tc == NULL) return;
+  for (i = 0; i < MG_TLS_CTX_CACHE_SIZE; i++) {
+    tls_ctx_entry_free(&tc->entries[i]);
+  }
+  if (tc->bm != NULL) BIO_meth_free(tc->bm);
+  mg_free(tc);
+  mgr->tls_ctx = NULL;
 }
 #endif
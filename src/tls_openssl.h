@@ -6,11 +6,27 @@
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+// SSL_CTX built once for a role, CA, cert and key, see mg_tls_init()
+struct mg_tls_ctx_entry {
+  SSL_CTX *ctx;                  // NULL if the entry is unused
+  bool is_client;                // Client or server context
+  struct mg_str ca, cert, key;   // Copies of the options it was built from
+  unsigned long used;            // Last use stamp, for LRU eviction
+};
+
+struct mg_tls_ctx {
+  BIO_METHOD *bm;  // Shared by all connections
+  unsigned long used;
+  struct mg_tls_ctx_entry entries[MG_TLS_CTX_CACHE_SIZE];
+};
+
 struct mg_tls {
-  BIO_METHOD *bm;
-  SSL_CTX *ctx;
+  BIO_METHOD *bm;   // Own BIO method if the manager has none
+  SSL_CTX *ctx;     // Referenced, possibly shared context
   SSL *ssl;
   char *name;       // matching hostname
   bool check_name;  // set when hostname was set, but no CA certificate given
+  unsigned char *alpn;  // Server: accepted ALPN protocols, wire format
+  size_t alpn_len;      // Length of alpn
 };
 #endif
@@ -1,6 +1,7 @@
 #include "ws.h"
 
 #include "base64.h"
+#include "deflate.h"
 #include "fmt.h"
 #include "http.h"
 #include "log.h"
@@ -15,6 +16,163 @@ struct ws_msg {
   size_t data_len;
 };
 
+#define WS_RSV1 0x40  // First frame of a compressed message, RFC 7692
+
+#if MG_ENABLE_DEFLATE
+// permessage-deflate state. Peers must not keep context for messages they
+// send us: each received message is inflated on its own
+struct ws_deflate {
+  struct mg_deflate d;  // Compressor for outgoing messages
+  bool takeover;        // Keep d between messages
+};
+
+static struct mg_str ws_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t')) {
+    s.len--;
+  }
+  return s;
+}
+
+// Find an acceptable permessage-deflate offer (server) or response (client)
+// in a Sec-WebSocket-Extensions header value. Our parameters are server_*
+// ones for a server, client_* for a client. Set *takeover to whether we can
+// keep context, and *fresh to whether the peer said it won't
+static bool ws_deflate_parse(struct mg_str s, bool is_client, bool *takeover,
+                             bool *fresh) {
+  const char *me = is_client ? "client_" : "server_";
+  const char *peer = is_client ? "server_" : "client_";
+  struct mg_str ext, name, param, k, v;
+  while (mg_span(s, &ext, &s, ',')) {
+    bool ok = true;
+    mg_span(ext, &name, &ext, ';');
+    if (mg_strcasecmp(ws_trim(name), mg_str("permessage-deflate")) != 0) {
+      continue;
+    }
+    *takeover = MG_WS_DEFLATE_TAKEOVER, *fresh = false;
+    while (ok && mg_span(ext, &param, &ext, ';')) {
+      char key[32];
+      mg_span(param, &k, &v, '=');
+      k = ws_trim(k), v = ws_trim(v);
+      if (v.len >= 2 && v.buf[0] == '"') v.buf++, v.len -= 2;
+      if (k.len < 8 || k.len >= sizeof(key)) {
+        ok = false;
+        continue;
+      }
+      mg_snprintf(key, sizeof(key), "%.*s", (int) k.len - 7, k.buf + 7);
+      if (strncmp(k.buf, me, 7) == 0 &&
+          strcmp(key, "no_context_takeover") == 0) {
+        *takeover = false;
+      } else if (strncmp(k.buf, peer, 7) == 0 &&
+                 strcmp(key, "no_context_takeover") == 0) {
+        *fresh = true;
+      } else if (strcmp(key, "max_window_bits") == 0) {
+        // Our matches go up to 32K back: we can only take a 15-bit limit
+        if (strncmp(k.buf, me, 7) == 0 && v.len > 0) {
+          ok = mg_strcmp(v, mg_str("15")) == 0;
+        } else if (strncmp(k.buf, peer, 7) != 0) {
+          ok = false;
+        }
+      } else {
+        ok = false;
+      }
+    }
+    if (ok) return true;
+  }
+  return false;
+}
+
+static void ws_deflate_start(struct mg_connection *c, bool takeover) {
+  struct ws_deflate *w = (struct ws_deflate *) mg_calloc(1, sizeof(*w));
+  if (w == NULL) return;
+  w->takeover = takeover;
+  c->ws_deflate = w;
+  c->is_ws_deflate = 1;
+}
+
+static void ws_deflate_end(struct mg_connection *c) {
+  struct ws_deflate *w = (struct ws_deflate *) c->ws_deflate;
+  if (w == NULL) return;
+  mg_deflate_free(&w->d);
+  mg_free(w);
+  c->ws_deflate = NULL;
+  c->is_ws_deflate = 0;
+}
+
+// Compress an outgoing message into io. Returns false if it goes as is
+static bool ws_deflate(struct mg_connection *c, const void *buf, size_t len,
+                       int op, struct mg_iobuf *io) {
+  struct ws_deflate *w = (struct ws_deflate *) c->ws_deflate;
+  bool ok;
+  if (w == NULL || !c->is_ws_deflate || len < MG_WS_DEFLATE_MIN ||
+      (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)) {
+    return false;
+  }
+  // On OOM, history is not updated either: an uncompressed message is fine
+  ok = mg_deflate(&w->d, (const char *) buf, len, false, io) && io->len >= 4;
+  if (!w->takeover) mg_deflate_free(&w->d);
+  if (ok) {
+    io->len -= 4;  // Strip 00 00 ff ff of the sync flush, RFC 7692 7.2.1
+  } else {
+    mg_iobuf_free(io);
+  }
+  return ok;
+}
+
+// Compress a message once for many connections, without context
+static bool ws_deflate_once(const void *buf, size_t len, int op,
+                            struct mg_iobuf *io) {
+  struct mg_deflate d;
+  bool ok;
+  if (len < MG_WS_DEFLATE_MIN ||
+      (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)) {
+    return false;
+  }
+  memset(&d, 0, sizeof(d));
+  ok = mg_deflate(&d, (const char *) buf, len, false, io) && io->len >= 4;
+  mg_deflate_free(&d);
+  if (ok) {
+    io->len -= 4;
+  } else {
+    mg_iobuf_free(io);
+  }
+  return ok;
+}
+
+// Check RSV bits of a received frame. Only the first frame of a data
+// message can have RSV1, and only if permessage-deflate is negotiated
+static bool ws_rsv_ok(struct mg_connection *c, uint8_t flags) {
+  uint8_t op = flags & 15;
+  if ((flags & WS_RSV1) == 0) return true;
+  return c->ws_deflate != NULL &&
+         (op == WEBSOCKET_OP_TEXT || op == WEBSOCKET_OP_BINARY);
+}
+#else
+static bool ws_rsv_ok(struct mg_connection *c, uint8_t flags) {
+  (void) c, (void) flags;
+  return true;
+}
+#endif
+
+// Deliver a complete data message, inflating it if it is compressed
+static void ws_message(struct mg_connection *c, struct mg_ws_message *m) {
+#if MG_ENABLE_DEFLATE
+  if (m->flags & WS_RSV1) {
+    struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+    if (mg_inflate(m->data.buf, m->data.len, MG_MAX_RECV_SIZE, &io)) {
+      m->data = mg_str_n(io.buf == NULL ? "" : (char *) io.buf, io.len);
+      m->flags &= (uint8_t) ~WS_RSV1;
+      mg_call(c, MG_EV_WS_MSG, m);
+    } else {
+      mg_error(c, "WS inflate error");
+    }
+    mg_iobuf_free(&io);
+    return;
+  }
+#endif
+  mg_call(c, MG_EV_WS_MSG, m);
+}
+
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list *ap) {
   size_t len = c->send.len;
@@ -33,8 +191,8 @@ size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...) {
 }
 
 static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
-                         const struct mg_str *wsproto, const char *fmt,
-                         va_list *ap) {
+                         const struct mg_str *wsproto, const char *ext,
+                         const char *fmt, va_list *ap) {
   const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   unsigned char sha[20], b64_sha[30];
 
@@ -55,6 +213,7 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
               wsproto->buf);
   }
+  if (ext != NULL) mg_printf(c, "Sec-WebSocket-Extensions: %s\r\n", ext);
   if (!mg_send(c, "\r\n", 2)) mg_error(c, "OOM");
 }
 
@@ -132,14 +291,43 @@ static void mg_ws_mask(struct mg_connection *c, size_t len) {
 size_t mg_ws_send(struct mg_connection *c, const void *buf, size_t len,
                   int op) {
   uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
-  if (!mg_send(c, header, header_len)) return 0;
-  if (!mg_send(c, buf, len)) return header_len;
+  size_t header_len;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
-  mg_ws_mask(c, len);
+#if MG_ENABLE_DEFLATE
+  if (ws_deflate(c, buf, len, op, &io)) {
+    buf = io.buf, len = io.len, op |= WS_RSV1;
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
+  if (!mg_send(c, header, header_len)) {
+    header_len = len = 0;
+  } else if (!mg_send(c, buf, len)) {
+    len = 0;
+  } else {
+    mg_ws_mask(c, len);
+  }
+  mg_iobuf_free(&io);
   return header_len + len;
 }
 
+// Accept the server's permessage-deflate response, if any. We have asked
+// the server not to keep context: it must agree
+static bool ws_client_extensions(struct mg_connection *c,
+                                 struct mg_http_message *hm) {
+#if MG_ENABLE_DEFLATE
+  struct mg_str *ext = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  bool takeover = false, fresh = false;
+  if (ext == NULL) return true;
+  if (!ws_deflate_parse(*ext, true, &takeover, &fresh) || !fresh) return false;
+  ws_deflate_start(c, takeover);
+  return c->ws_deflate != NULL;
+#else
+  (void) c, (void) hm;
+  return true;
+#endif
+}
+
 static bool mg_ws_client_handshake(struct mg_connection *c) {
   int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
   if (n < 0) {
@@ -149,7 +337,8 @@ static bool mg_ws_client_handshake(struct mg_connection *c) {
       mg_error(c, "ws handshake error");
     } else {
       struct mg_http_message hm;
-      if (mg_http_parse((char *) c->recv.buf, c->recv.len, &hm)) {
+      if (mg_http_parse((char *) c->recv.buf, c->recv.len, &hm) &&
+          ws_client_extensions(c, &hm)) {
         c->is_websocket = 1;
         mg_call(c, MG_EV_WS_OPEN, &hm);
       } else {
@@ -168,6 +357,9 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
   size_t ofs = (size_t) c->pfn_data;
 
   // assert(ofs < c->recv.len);
+#if MG_ENABLE_DEFLATE
+  if (ev == MG_EV_CLOSE) ws_deflate_end(c);
+#endif
   if (ev == MG_EV_READ) {
     if (c->is_client && !c->is_websocket && mg_ws_client_handshake(c)) return;
 
@@ -180,6 +372,10 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
       len = msg.header_len + msg.data_len;
       final = msg.flags & 128;
       op = msg.flags & 15;
+      if ((msg.flags & 0x30) != 0 || !ws_rsv_ok(c, msg.flags)) {
+        mg_error(c, "WS RSV bits %x", msg.flags);
+        break;
+      }
       // MG_VERBOSE ("fin %d op %d len %d [%.*s]", final, op,
       //                       (int) m.data.len, (int) m.data.len, m.data.buf));
       switch (op) {
@@ -196,7 +392,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final) ws_message(c, &m);
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu WS CLOSE", c->id));
@@ -226,7 +422,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
       if (final && !op && (ofs > 0)) {
         m.flags = c->recv.buf[0];
         m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
+        ws_message(c, &m);
         mg_iobuf_del(&c->recv, 0, ofs);
         ofs = 0;
         c->pfn_data = NULL;
@@ -253,6 +449,12 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *mgr, const char *url,
                "Sec-WebSocket-Version: 13\r\n"
                "Sec-WebSocket-Key: %s\r\n",
                mg_url_uri(url), (int) host.len, host.buf, key);
+#if MG_ENABLE_DEFLATE
+    mg_xprintf(mg_pfn_iobuf, &c->send,
+               "Sec-WebSocket-Extensions: permessage-deflate; "
+               "server_no_context_takeover%s\r\n",
+               MG_WS_DEFLATE_TAKEOVER ? "" : "; client_no_context_takeover");
+#endif
     if (fmt != NULL) {
       va_list ap;
       va_start(ap, fmt);
@@ -268,17 +470,33 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *mgr, const char *url,
 
 void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
                    const char *fmt, ...) {
-  struct mg_str *wskey = mg_http_get_header(hm, "Sec-WebSocket-Key");
+  struct mg_str *wskey =
+      mg_http_get_header_id(hm, MG_HTTP_HDR_SEC_WEBSOCKET_KEY);
   c->pfn = mg_ws_cb;
   c->pfn_data = NULL;
   if (wskey == NULL) {
     mg_http_reply(c, 426, "", "WS upgrade expected\n");
     c->is_draining = 1;
   } else {
-    struct mg_str *wsproto = mg_http_get_header(hm, "Sec-WebSocket-Protocol");
+    struct mg_str *wsproto =
+        mg_http_get_header_id(hm, MG_HTTP_HDR_SEC_WEBSOCKET_PROTOCOL);
+    const char *ext = NULL;
     va_list ap;
+#if MG_ENABLE_DEFLATE
+    struct mg_str *offer = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+    bool takeover = false, fresh = false;
+    if (offer != NULL && ws_deflate_parse(*offer, false, &takeover, &fresh)) {
+      // Always ask the client not to keep context, RFC 7692 7.1.1.2
+      ws_deflate_start(c, takeover);
+      if (c->ws_deflate != NULL) {
+        ext = takeover ? "permessage-deflate; client_no_context_takeover"
+                       : "permessage-deflate; client_no_context_takeover; "
+                         "server_no_context_takeover";
+      }
+    }
+#endif
     va_start(ap, fmt);
-    ws_handshake(c, wskey, wsproto, fmt, &ap);
+    ws_handshake(c, wskey, wsproto, ext, fmt, &ap);
     va_end(ap);
     c->is_websocket = 1;
     c->is_resp = 0;
@@ -288,7 +506,22 @@ void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
 
 size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   uint8_t header[14], *p;
-  size_t header_len = mkhdr(len, op, c->is_client, header);
+  size_t header_len;
+#if MG_ENABLE_DEFLATE
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  if (ws_deflate(c, c->send.buf + c->send.len - len, len, op, &io)) {
+    bool ok;
+    c->send.len -= len;  // Replace data with its compressed version
+    ok = mg_iobuf_add(&c->send, c->send.len, io.buf, io.len) > 0;
+    len = io.len, op |= WS_RSV1;
+    mg_iobuf_free(&io);
+    if (!ok) {
+      mg_error(c, "OOM");
+      return c->send.len;
+    }
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
 
   // NOTE: order of operations is important!
   if (mg_iobuf_add(&c->send, c->send.len, NULL, header_len) != 0) {
@@ -296,6 +529,77 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
     memmove(p, p - header_len, len);             // Shift data
     memcpy(p - header_len, header, header_len);  // Prepend header
     mg_ws_mask(c, len);                          // Mask data
+    MG_EPOLL_MOD(c, 1);
   }  // returning 0 means an OOM condition (iobuf couldn't resize), yet this is
   return c->send.len;  // so far recoverable, let the caller decide
 }
+
+// Frame shared by many connections. Frame bytes follow this struct
+struct ws_bcast {
+  size_t refs;  // Holders: queued sends and mg_ws_broadcast() itself
+  size_t len;   // Frame length
+};
+
+static struct ws_bcast *ws_bcast_new(const void *buf, size_t len, int op) {
+  uint8_t header[14];
+  size_t n = mkhdr(len, op, false, header);
+  struct ws_bcast *m = (struct ws_bcast *) mg_calloc(1, sizeof(*m) + n + len);
+  if (m != NULL) {
+    m->refs = 1, m->len = n + len;
+    memcpy(m + 1, header, n);
+    if (len > 0) memcpy((char *) (m + 1) + n, buf, len);
+  }
+  return m;
+}
+
+static void ws_bcast_unref(void *arg) {
+  struct ws_bcast *m = (struct ws_bcast *) arg;
+  if (m != NULL && --m->refs == 0) mg_free(m);
+}
+
+static bool ws_bcast_send(struct mg_connection *c, struct ws_bcast *m) {
+  m->refs++;
+  if (mg_send_ref(c, m + 1, m->len, ws_bcast_unref, m)) return true;
+  m->refs--;
+  mg_error(c, "OOM");
+  return false;
+}
+
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const void *buf, size_t len, int op,
+                       bool (*fn)(struct mg_connection *, void *),
+                       void *fn_data) {
+  struct ws_bcast *plain = NULL, *packed = NULL;
+  struct mg_connection *c;
+  size_t n = 0;
+#if MG_ENABLE_DEFLATE
+  bool tried = false;
+#endif
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    if (!c->is_websocket || c->is_client || c->is_closing || c->is_draining ||
+        c->send.len + c->send_refs_len > MG_WS_BROADCAST_MAX ||
+        (fn != NULL && !fn(c, fn_data))) {
+      continue;
+    }
+#if MG_ENABLE_DEFLATE
+    if (c->is_ws_deflate && !tried) {  // Compress on first use
+      struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+      tried = true;
+      if (ws_deflate_once(buf, len, op, &io)) {
+        packed = ws_bcast_new(io.buf, io.len, op | WS_RSV1);
+      }
+      mg_iobuf_free(&io);
+    }
+    if (c->is_ws_deflate && packed != NULL) {
+      // Our context lacks this message, and the peer's has it: drop ours
+      mg_deflate_free(&((struct ws_deflate *) c->ws_deflate)->d);
+      if (ws_bcast_send(c, packed)) n++;
+      continue;
+    }
+#endif
+    if (plain == NULL && (plain = ws_bcast_new(buf, len, op)) == NULL) break;
+    if (ws_bcast_send(c, plain)) n++;
+  }
+  ws_bcast_unref(plain);
+  ws_bcast_unref(packed);
+  return n;
+}
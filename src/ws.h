@@ -34,7 +34,9 @@ struct mg_ws_message {
 //   fmt is a printf-style string for extra HTTP request headers; each header
 //   must end with "\r\n". The user-supplied fn event handler receives
 //   MG_EV_WS_OPEN on handshake success, MG_EV_WS_MSG for messages, and
-//   MG_EV_WS_CTL for control frames.
+//   MG_EV_WS_CTL for control frames. With MG_ENABLE_DEFLATE, offers
+//   permessage-deflate (RFC 7692) and asks the server not to keep context
+//   between messages; the connection fails if the server accepts otherwise.
 struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
                                     mg_event_handler_t fn, void *fn_data,
                                     const char *fmt, ...);
@@ -54,7 +56,10 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
 //   Call from an MG_EV_HTTP_MSG handler and pass that event's hm. fmt is a
 //   printf-style string for extra response headers; each header must end with
 //   "\r\n". Fires MG_EV_WS_OPEN immediately on success. Sends HTTP 426 and
-//   drains the connection if the request lacks Sec-WebSocket-Key.
+//   drains the connection if the request lacks Sec-WebSocket-Key. With
+//   MG_ENABLE_DEFLATE, accepts a permessage-deflate offer and sets
+//   c->is_ws_deflate. Messages to the client keep context, unless it asks
+//   otherwise or MG_WS_DEFLATE_TAKEOVER is 0; the client is asked not to.
 void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 
@@ -74,14 +79,41 @@ void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
 //   op is one of WEBSOCKET_OP_*. Client connections are automatically masked
 //   per RFC 6455. On OOM, the return value can be smaller than header + len.
 //   Data is appended to c->send and sent by a later mg_mgr_poll() call.
+//   If c->is_ws_deflate is set, TEXT and BINARY messages of MG_WS_DEFLATE_MIN
+//   bytes or more are compressed, and the return value counts compressed
+//   bytes. Clear c->is_ws_deflate to stop compressing; received compressed
+//   messages are still inflated before MG_EV_WS_MSG.
 size_t mg_ws_send(struct mg_connection *, const void *buf, size_t len, int op);
 
 // Wraps the last len bytes already in c->send with a WebSocket frame header
 // and opcode op. Used internally by mg_ws_printf(); call it directly when you
-// have written data into c->send manually and need to frame it.
+// have written data into c->send manually and need to frame it. Compresses
+// data like mg_ws_send() does.
 // Returns c->send.len (total buffer size after the operation).
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
 
+// Sends one message to many server-side WebSocket connections of mgr.
+//
+// Returns:
+//   Number of connections the message was queued to.
+// Example:
+//   static bool is_dash(struct mg_connection *c, void *arg) {
+//     return c->data[0] == 'D';  // Marked on MG_EV_WS_OPEN
+//   }
+//   mg_ws_broadcast(&mgr, json, len, WEBSOCKET_OP_TEXT, is_dash, NULL);
+// Related APIs:
+//   mg_ws_send(), mg_ws_upgrade(), mg_send_ref()
+// Notes:
+//   fn selects receivers, e.g. members of a group; NULL selects all. The
+//   frame is built once, and each connection queues a reference to it with
+//   mg_send_ref() instead of a copy. Connections with permessage-deflate get
+//   a frame compressed once, without context. Connections that have more
+//   than MG_WS_BROADCAST_MAX bytes queued are skipped: slow receivers miss
+//   messages instead of buffering them without limit.
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const void *buf, size_t len, int op,
+                       bool (*fn)(struct mg_connection *, void *),
+                       void *fn_data);
+
 // Formats a WebSocket message using printf-style fmt and sends it with
 // opcode op (WEBSOCKET_OP_TEXT or WEBSOCKET_OP_BINARY).
 // Returns the number of payload bytes written, or 0 on OOM.
@@ -178,6 +178,56 @@ static void test_poll(void) {
   mg_mgr_free(&mgr);
 }
 
+// Connections are found by ID and by TCP 4-tuple until removed from the index
+static void test_conn_index(void) {
+  struct mg_connection *cs[40];
+  struct mg_addr rem;
+  struct mg_mgr mgr;
+  size_t i;
+  mg_mgr_init(&mgr);
+  memset(&rem, 0, sizeof(rem));
+  rem.addr.ip4 = mg_htonl(0x0a000001);
+  for (i = 0; i < 40; i++) {  // More than the initial 16 buckets: rehashes
+    ASSERT((cs[i] = mg_alloc_conn(&mgr)) != NULL);
+    cs[i]->loc.port = mg_htons(80);
+    cs[i]->rem = rem;
+    cs[i]->rem.port = mg_htons((uint16_t) (1000 + i));
+    mg_conn_index_tuple(cs[i]);
+  }
+  for (i = 0; i < 40; i++) {
+    rem.port = mg_htons((uint16_t) (1000 + i));
+    ASSERT(mg_conn_by_id(&mgr, cs[i]->id) == cs[i]);
+    ASSERT(mg_conn_by_tuple(&mgr, mg_htons(80), &rem) == cs[i]);
+  }
+  rem.port = mg_htons(999);
+  ASSERT(mg_conn_by_tuple(&mgr, mg_htons(80), &rem) == NULL);
+  rem.port = mg_htons(1000);
+  ASSERT(mg_conn_by_tuple(&mgr, mg_htons(81), &rem) == NULL);
+  ASSERT(mg_conn_by_id(&mgr, mgr.nextid + 1) == NULL);
+
+  for (i = 0; i < 40; i += 2) mg_conn_index_del(cs[i]);
+  for (i = 0; i < 40; i++) {
+    struct mg_connection *c = i % 2 ? cs[i] : NULL;
+    rem.port = mg_htons((uint16_t) (1000 + i));
+    ASSERT(mg_conn_by_id(&mgr, cs[i]->id) == c);
+    ASSERT(mg_conn_by_tuple(&mgr, mg_htons(80), &rem) == c);
+  }
+
+  // The newest connection with a given 4-tuple comes first
+  rem.port = mg_htons(1001);
+  cs[0]->loc.port = mg_htons(80), cs[0]->rem = rem;
+  mg_conn_index_tuple(cs[0]);
+  ASSERT(mg_conn_by_tuple(&mgr, mg_htons(80), &rem) == cs[0]);
+  mg_conn_index_del(cs[0]);
+  ASSERT(mg_conn_by_tuple(&mgr, mg_htons(80), &rem) == cs[1]);
+
+  for (i = 0; i < 40; i++) {
+    if (i % 2) mg_conn_index_del(cs[i]);
+    mg_free(cs[i]);
+  }
+  mg_mgr_free(&mgr);
+}
+
 #define DRIVER_BUF_SIZE 1540
 
 struct driver_data {
@@ -1425,6 +1475,10 @@ int main(void) {
   test_poll();
   DASHBOARD("poll");
 
+  s_error = false;
+  test_conn_index();
+  DASHBOARD("conn_index");
+
   s_error = false;
   test_icmp();
   DASHBOARD("icmp");
@@ -311,7 +311,9 @@ static void test_base64(void) {
 }
 
 static void test_iobuf(void) {
-  struct mg_iobuf io = {0, 0, 0, 10};
+  struct mg_iobuf io = {0, 0, 0, 10, 0};
+  unsigned char *p;
+  size_t i, n;
   ASSERT(io.buf == NULL && io.size == 0 && io.len == 0);
   mg_iobuf_resize(&io, 1);
   ASSERT(io.buf != NULL && io.size == 10 && io.len == 0);
@@ -339,6 +341,53 @@ static void test_iobuf(void) {
   mg_iobuf_resize(&io, 1);
   ASSERT(io.buf != NULL && io.size == 10 && io.len == 10);
   mg_iobuf_free(&io);
+
+  // Skipping from the front moves buf, not data
+  ASSERT(mg_iobuf_init(&io, 0, 10) == true);
+  mg_iobuf_add(&io, 0, "abcdef", 6);
+  p = io.buf;
+  ASSERT(mg_iobuf_skip(&io, 2) == 2);
+  ASSERT(io.buf == p + 2 && io.size == 8 && io.len == 4 && io.head == 2);
+  ASSERT(memcmp(io.buf, "cdef", 4) == 0);
+  mg_iobuf_add(&io, io.len, "gh", 2);  // Fits
+  ASSERT(io.buf == p + 2 && io.size == 8 && io.len == 6);
+  ASSERT(memcmp(io.buf, "cdefgh", 6) == 0);
+  mg_iobuf_add(&io, io.len, "ijk", 3);  // Does not fit: compacts
+  ASSERT(io.head == 0 && io.size >= 10 && io.len == 9);
+  ASSERT(memcmp(io.buf, "cdefghijk", 9) == 0);
+  ASSERT(mg_iobuf_skip(&io, 4) == 4 && io.head == 4);
+  ASSERT(mg_iobuf_del(&io, 1, 2) == 2 && io.len == 3 && io.head == 4);
+  ASSERT(memcmp(io.buf, "gjk", 3) == 0);
+  p = io.buf - io.head;
+  ASSERT(mg_iobuf_skip(&io, 100) == 3);  // Empty: rewinds
+  ASSERT(io.buf == p && io.head == 0 && io.size >= 10 && io.len == 0);
+  mg_iobuf_free(&io);
+  ASSERT(io.buf == NULL && io.head == 0);
+
+  // A buffer that never drains compacts once half of it is skipped
+  ASSERT(mg_iobuf_init(&io, 0, 10) == true);
+  mg_iobuf_add(&io, 0, "abcdefghij", 10);
+  p = io.buf;
+  ASSERT(mg_iobuf_skip(&io, 5) == 5);
+  ASSERT(io.buf == p + 5 && io.head == 5 && io.size == 5 && io.len == 5);
+  ASSERT(mg_iobuf_skip(&io, 1) == 1);  // Head passes the half: compacts
+  ASSERT(io.buf == p && io.head == 0 && io.size == 10 && io.len == 4);
+  ASSERT(memcmp(io.buf, "ghij\0\0\0\0\0\0", 10) == 0);
+  mg_iobuf_free(&io);
+
+  // Appending byte by byte reallocates a logarithmic number of times
+  ASSERT(mg_iobuf_init(&io, 0, 16) == true);
+  for (i = 0, n = 0; i < 100000; i++) {
+    p = io.buf;
+    if (mg_iobuf_add(&io, io.len, "x", 1) != 1) break;
+    if (io.buf != p) n++;
+  }
+  ASSERT(io.len == 100000 && io.size >= io.len);
+  ASSERT(MG_IO_GROW_MAX == 0 || n < 20);
+  ASSERT(mg_iobuf_reserve(&io, io.size) == true);
+  ASSERT(io.size >= 200000 && io.len == 100000);
+  ASSERT(mg_iobuf_reserve(&io, 5) == true && io.size >= 200000);
+  mg_iobuf_free(&io);
 }
 
 static void sntp_cb(struct mg_connection *c, int ev, void *ev_data) {
@@ -819,6 +868,458 @@ static void test_mqtt(void) {
 #endif
 }
 
+// MQTT client fixture: records what a client gets
+struct bcli {
+  char msgs[300];  // Received messages, "topic=data,"
+  int opened, present, subacks, n, qos, retain;
+  uint8_t code;  // Last SUBACK reason code
+  uint8_t ack;   // CONNACK reason code
+};
+
+static void ebroker(struct mg_connection *c, int ev, void *ev_data) {
+  struct bcli *b = (struct bcli *) c->fn_data;
+  struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+  if (ev == MG_EV_MQTT_OPEN) {
+    b->opened = 1, b->ack = *(uint8_t *) ev_data;
+  } else if (ev == MG_EV_MQTT_CMD && mm->cmd == MQTT_CMD_CONNACK) {
+    b->present = mm->dgram.buf[2];
+  } else if (ev == MG_EV_MQTT_CMD && mm->cmd == MQTT_CMD_SUBACK) {
+    b->subacks++, b->code = (uint8_t) mm->dgram.buf[mm->dgram.len - 1];
+  } else if (ev == MG_EV_MQTT_MSG) {
+    size_t len = strlen(b->msgs);
+    mg_snprintf(b->msgs + len, sizeof(b->msgs) - len, "%.*s=%.*s,",
+                mm->topic.len, mm->topic.buf, mm->data.len, mm->data.buf);
+    b->n++, b->qos = mm->qos, b->retain = mm->dgram.buf[0] & 1;
+  }
+}
+
+#if MG_ENABLE_MQTT_BROKER
+static struct mg_connection *bopen(struct mg_mgr *mgr,
+                                   const struct mg_mqtt_opts *opts,
+                                   struct bcli *b) {
+  struct mg_connection *c;
+  int i;
+  memset(b, 0, sizeof(*b));
+  c = mg_mqtt_connect(mgr, "mqtt://127.0.0.1:12384", opts, ebroker, b);
+  for (i = 0; i < 100 && !b->opened; i++) mg_mgr_poll(mgr, 1);
+  ASSERT(b->opened == 1);
+  return c;
+}
+
+static struct mg_connection *bconnect(struct mg_mgr *mgr, const char *id,
+                                      uint8_t version, bool clean,
+                                      struct bcli *b) {
+  struct mg_mqtt_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.client_id = mg_str(id), opts.version = version, opts.clean = clean;
+  if (strcmp(id, "will") == 0) {
+    opts.topic = mg_str("w"), opts.message = mg_str("bye"), opts.qos = 1;
+  }
+  return bopen(mgr, &opts, b);
+}
+
+static bool bauth(struct mg_connection *c, struct mg_str id, struct mg_str user,
+                  struct mg_str pass) {
+  (void) c, (void) id;
+  return mg_strcmp(user, mg_str("bad")) != 0 && pass.len == 0;
+}
+
+static void bsub(struct mg_mgr *mgr, struct mg_connection *c, const char *t,
+                 uint8_t qos) {
+  struct bcli *b = (struct bcli *) c->fn_data;
+  struct mg_mqtt_opts opts;
+  int i, n = b->subacks;
+  memset(&opts, 0, sizeof(opts));
+  opts.topic = mg_str(t), opts.qos = qos;
+  mg_mqtt_sub(c, &opts);
+  for (i = 0; i < 100 && b->subacks == n; i++) mg_mgr_poll(mgr, 1);
+  ASSERT(b->subacks == n + 1);
+}
+
+static void bpub(struct mg_connection *c, const char *t, const char *msg,
+                 uint8_t qos, bool retain) {
+  struct mg_mqtt_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.topic = mg_str(t), opts.message = mg_str(msg);
+  opts.qos = qos, opts.retain = retain;
+  mg_mqtt_pub(c, &opts);
+}
+
+static void test_mqtt_broker(void) {
+  struct mg_mgr mgr;
+  struct mg_mqtt_broker broker;
+  struct mg_connection *c1, *c2, *c3, *c;
+  struct bcli b1, b2, b3, b4, b5, b6;
+  char expected[300], buf[10];
+  size_t len = 0;
+  int i;
+
+  mg_mgr_init(&mgr);
+  memset(&broker, 0, sizeof(broker));
+  ASSERT(mg_mqtt_broker_listen(&mgr, "mqtt://127.0.0.1:12384", &broker, NULL,
+                               NULL) != NULL);
+  c1 = bconnect(&mgr, "c1", 4, true, &b1);
+  c2 = bconnect(&mgr, "c2", 5, true, &b2);
+  c3 = bconnect(&mgr, "c3", 4, true, &b3);
+  ASSERT(broker.num_sessions == 3);
+
+  // Overlapping subscriptions get one copy, with the highest QoS
+  bsub(&mgr, c1, "a/+/c", 1);
+  bsub(&mgr, c1, "a/#", 0);
+  bsub(&mgr, c2, "#", 0);
+  bsub(&mgr, c2, "$SYS/#", 0);
+  ASSERT(broker.num_subs == 4);
+  bpub(c3, "a/b/c", "x", 1, false);
+  bpub(c3, "$SYS/up", "1", 0, false);
+  bpub(c3, "b", "2", 0, false);
+  for (i = 0; i < 100 && b2.n < 3; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "a/b/c=x,") == 0 && b1.qos == 1);
+  ASSERT(strcmp(b2.msgs, "a/b/c=x,$SYS/up=1,b=2,") == 0 && b2.qos == 0);
+
+  // Invalid filter
+  bsub(&mgr, c1, "a/b#", 0);
+  ASSERT(b1.code == 0x80 && broker.num_subs == 4);
+
+  // Retained message is sent to new subscribers, with the retain flag
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  {
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.topic = mg_str("r/1"), opts.message = mg_str("keep");
+    opts.retain = true;
+    ASSERT(mg_mqtt_broker_pub(&broker, &opts) == 1);  // c2, on #
+  }
+  ASSERT(broker.num_retained == 1);
+  bsub(&mgr, c1, "r/+", 1);
+  for (i = 0; i < 100 && b1.msgs[0] == '\0'; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "r/1=keep,") == 0 && b1.retain == 1);
+  ASSERT(b1.qos == 0);  // Retained with QoS 0
+  bpub(c3, "r/1", "", 0, true);  // Delete it
+  for (i = 0; i < 100 && b1.n < 3; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(broker.num_retained == 0 && b1.n == 3);
+
+  // QoS 2, end to end
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bsub(&mgr, c1, "q2", 2);
+  bpub(c3, "q2", "y", 2, false);
+  for (i = 0; i < 100 && b1.msgs[0] == '\0'; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "q2=y,") == 0 && b1.qos == 2 && b1.retain == 0);
+
+  // More QoS 1 messages than the in-flight window, in order
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bsub(&mgr, c1, "o/#", 1);
+  for (i = 0; i < 40; i++) {
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    mg_snprintf(buf, sizeof(buf), "%d", i);
+    opts.topic = mg_str("o/1"), opts.message = mg_str(buf), opts.qos = 1;
+    ASSERT(mg_mqtt_broker_pub(&broker, &opts) == 2);  // c1 and c2
+    len += mg_snprintf(expected + len, sizeof(expected) - len, "o/1=%s,", buf);
+  }
+  for (i = 0; i < 1000 && strlen(b1.msgs) < len; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, expected) == 0);
+
+  // Will message, sent when a client is gone without a DISCONNECT
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bsub(&mgr, c1, "w", 1);
+  c = bconnect(&mgr, "will", 4, true, &b4);
+  c->is_closing = 1;
+  for (i = 0; i < 100 && b1.msgs[0] == '\0'; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "w=bye,") == 0);
+  ASSERT(broker.num_sessions == 3);
+
+  // Taking a session over sends the old connection's will, 3.1.4-3
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bconnect(&mgr, "will", 4, true, &b4);
+  c = bconnect(&mgr, "will", 4, true, &b4);
+  for (i = 0; i < 100 && b1.msgs[0] == '\0'; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "w=bye,") == 0);
+  c->is_closing = 1;
+  for (i = 0; i < 100 && strlen(b1.msgs) < 12; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "w=bye,w=bye,") == 0);
+  ASSERT(broker.num_sessions == 3);
+
+  // Unsubscribe
+  {
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.topic = mg_str("w");
+    mg_mqtt_unsub(c1, &opts);
+    for (i = 0; i < 100 && broker.num_subs == 8; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(broker.num_subs == 7);
+    opts.message = mg_str("z");
+    ASSERT(mg_mqtt_broker_pub(&broker, &opts) == 1);  // c2 only
+  }
+
+  // Persistent session gets messages published while it was offline
+  c = bconnect(&mgr, "p", 4, false, &b4);
+  ASSERT(b4.present == 0);
+  bsub(&mgr, c, "p/t", 1);
+  mg_mqtt_disconnect(c, NULL);
+  c->is_draining = 1;
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(broker.num_sessions == 4 && broker.num_subs == 8);
+  {
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.topic = mg_str("p/t"), opts.message = mg_str("off"), opts.qos = 1;
+    ASSERT(mg_mqtt_broker_pub(&broker, &opts) == 2);  // p, offline, and c2
+  }
+  c = bconnect(&mgr, "p", 4, false, &b4);
+  ASSERT(b4.present == 1);
+  for (i = 0; i < 100 && b4.n == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b4.msgs, "p/t=off,") == 0 && b4.qos == 1);
+
+  // Clean session drops it
+  c->is_closing = 1;
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  c = bconnect(&mgr, "p", 4, true, &b4);
+  ASSERT(b4.present == 0 && broker.num_subs == 7);
+
+  // Refused CONNECT takes nothing over: c1 keeps its connection
+  broker.auth = bauth;
+  {
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.client_id = mg_str("c1"), opts.user = mg_str("bad");
+    bopen(&mgr, &opts, &b5);
+    ASSERT(b5.ack == 5 && broker.num_sessions == 4);
+    opts.version = 5;
+    bopen(&mgr, &opts, &b5);
+    ASSERT(b5.ack == 0x87 && broker.num_sessions == 4);
+  }
+  broker.auth = NULL;
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bpub(c3, "a/b/c", "still", 0, false);
+  for (i = 0; i < 100 && b1.msgs[0] == '\0'; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(b1.msgs, "a/b/c=still,") == 0);
+
+  // MQTT 3.1.1: empty client ID needs a clean session, 3.1.3-8
+  c = mg_connect(&mgr, "tcp://127.0.0.1:12384", NULL, NULL);
+  mg_send(c, "\x10\x0c\x00\x04MQTT\x04\x00\x00\x00\x00\x00", 14);
+  for (i = 0; i < 100 && c->recv.len < 4; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(c->recv.len == 4);
+  ASSERT(memcmp(c->recv.buf, "\x20\x02\x00\x02", 4) == 0);  // Rejected
+  ASSERT(broker.num_sessions == 4);
+
+  // A client silent for 1.5 keep alive intervals is dropped, with its will.
+  // An offline MQTT5 session is freed after its expiry interval. A will
+  // with a delay is not sent on a takeover, only after the delay, 3.1.3-9
+  memset(&b1.msgs, 0, sizeof(b1.msgs));
+  bsub(&mgr, c1, "w", 1);
+  {
+    struct mg_mqtt_opts opts;
+    struct mg_mqtt_prop prop, wprop;
+    uint64_t start = mg_millis(), end = start + 3000;
+    memset(&opts, 0, sizeof(opts));
+    memset(&prop, 0, sizeof(prop));
+    memset(&wprop, 0, sizeof(wprop));
+    prop.id = MQTT_PROP_SESSION_EXPIRY_INTERVAL, prop.iv = 1;
+    wprop.id = MQTT_PROP_WILL_DELAY_INTERVAL, wprop.iv = 1;
+    opts.client_id = mg_str("wd"), opts.version = 5;
+    opts.props = &prop, opts.num_props = 1;
+    opts.will_props = &wprop, opts.num_will_props = 1;
+    opts.topic = mg_str("w"), opts.message = mg_str("late"), opts.qos = 1;
+    bopen(&mgr, &opts, &b6);
+    c = bopen(&mgr, &opts, &b6);
+    for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(b1.msgs[0] == '\0' && b6.present == 1);
+    c->is_closing = 1;
+    memset(&opts, 0, sizeof(opts));
+    opts.client_id = mg_str("ka"), opts.keepalive = 1, opts.clean = true;
+    opts.topic = mg_str("w"), opts.message = mg_str("gone"), opts.qos = 1;
+    bopen(&mgr, &opts, &b6);
+    memset(&opts, 0, sizeof(opts));
+    memset(&prop, 0, sizeof(prop));
+    prop.id = MQTT_PROP_SESSION_EXPIRY_INTERVAL, prop.iv = 1;
+    opts.client_id = mg_str("exp"), opts.version = 5;
+    opts.props = &prop, opts.num_props = 1;
+    c = bopen(&mgr, &opts, &b5);
+    opts.num_props = 0;
+    mg_mqtt_disconnect(c, &opts);
+    c->is_draining = 1;
+    for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(broker.num_sessions == 7 && b1.msgs[0] == '\0');
+    while (mg_millis() < end &&
+           (broker.num_sessions > 4 || strlen(b1.msgs) < 14)) {
+      mg_mgr_poll(&mgr, 10);
+    }
+    ASSERT(strstr(b1.msgs, "w=gone,") != NULL && broker.num_sessions == 4);
+    ASSERT(strstr(b1.msgs, "w=late,") != NULL && strlen(b1.msgs) == 14);
+    ASSERT(mg_millis() - start >= 1000);
+  }
+
+  mg_mgr_free(&mgr);
+  ASSERT(broker.num_sessions == 0);
+  mg_mqtt_broker_free(&broker);
+  ASSERT(mgr.conns == NULL && broker.priv == NULL);
+  (void) c2;
+}
+#endif
+
+struct ssrv {
+  bool connack, ack;  // Reply to CONNECT, to PUBLISH
+  bool v5;            // MQTT5, allow 4 topic aliases
+  int pubs, dups;
+  char msgs[50];  // Payloads of PUBLISHes without DUP flag
+};
+
+static void esrv(struct mg_connection *c, int ev, void *ev_data) {
+  struct ssrv *d = (struct ssrv *) c->fn_data;
+  struct mg_mqtt_message mm;
+  while (ev == MG_EV_READ &&
+         mg_mqtt_parse(c->recv.buf, c->recv.len, d->v5 ? 5 : 4, &mm) ==
+             MQTT_OK) {
+    uint16_t id = mg_htons(mm.id);
+    uint8_t ack[6] = {0, 0, 3, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, 0, 4};
+    if (mm.cmd == MQTT_CMD_CONNECT && d->connack) {
+      size_t n = d->v5 ? sizeof(ack) : 2;
+      mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, (uint32_t) n);
+      mg_send(c, ack, n);
+    } else if (mm.cmd == MQTT_CMD_PUBLISH) {
+      size_t len = strlen(d->msgs);
+      struct mg_mqtt_prop prop;
+      unsigned alias = 0;
+      d->pubs++;
+      if (d->v5 && mg_mqtt_next_prop(&mm, &prop, 0) > 0) alias = prop.iv;
+      if (mm.dgram.buf[0] & 8) {
+        d->dups++;
+      } else if (d->v5) {
+        mg_snprintf(d->msgs + len, sizeof(d->msgs) - len, "%.*s|%u=%.*s,",
+                    mm.topic.len, mm.topic.buf, alias, mm.data.len,
+                    mm.data.buf);
+      } else {
+        mg_snprintf(d->msgs + len, sizeof(d->msgs) - len, "%.*s,",
+                    mm.data.len, mm.data.buf);
+      }
+      if (d->ack) mg_mqtt_send_header(c, MQTT_CMD_PUBACK, 0, sizeof(id));
+      if (d->ack) mg_send(c, &id, sizeof(id));
+    }
+    mg_iobuf_del(&c->recv, 0, mm.dgram.len);
+  }
+  (void) ev_data;
+}
+
+// Counts session saves: mg_file_write() renames a temporary file into place
+static int s_session_saves;
+static bool smv(const char *from, const char *to) {
+  s_session_saves++;
+  return mg_fs_posix.mv(from, to);
+}
+
+static void test_mqtt_session(void) {
+  struct mg_fs fs = mg_fs_posix;
+  struct mg_mgr mgr;
+  struct mg_mqtt_session s;
+  struct mg_mqtt_opts opts;
+  struct mg_connection *c;
+  struct ssrv srv;
+  struct mg_str data;
+  const char *path = "mqtt_session.tmp";
+  char buf[10];
+  int i;
+
+  mg_mgr_init(&mgr);
+  memset(&srv, 0, sizeof(srv));
+  memset(&s, 0, sizeof(s));
+  memset(&opts, 0, sizeof(opts));
+  mg_fs_posix.rm(path);
+  ASSERT(mg_listen(&mgr, "tcp://127.0.0.1:12385", esrv, &srv) != NULL);
+  fs.mv = smv, s_session_saves = 0;
+  s.fs = &fs, s.path = path, s.receive_max = 2;
+  opts.session = &s, opts.client_id = mg_str("s");
+
+  // Not connected yet: messages are kept, and saved
+  c = mg_mqtt_connect(&mgr, "mqtt://127.0.0.1:12385", &opts, NULL, NULL);
+  for (i = 0; i < 3; i++) {
+    mg_snprintf(buf, sizeof(buf), "%d", i);
+    opts.topic = mg_str("t"), opts.message = mg_str(buf), opts.qos = 1;
+    ASSERT(mg_mqtt_pub(c, &opts) != 0);
+  }
+  ASSERT(s.num_queued == 3 && s.num_inflight == 0);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(srv.pubs == 0 && s_session_saves == 1);  // Once for all three
+  data = mg_file_read(&mg_fs_posix, path);
+  ASSERT(data.len > 4);
+  mg_free((void *) data.buf);
+  mg_mqtt_session_free(&s);
+  ASSERT(s.num_queued == 0 && s.head == NULL && s.tail == NULL);
+  c->is_closing = 1;
+
+  // Restart: saved messages are sent, two at a time, and resent with DUP
+  srv.connack = true, s.retransmit_ms = 20;
+  c = mg_mqtt_connect(&mgr, "mqtt://127.0.0.1:12385", &opts, NULL, NULL);
+  ASSERT(s.num_queued == 3);
+  for (i = 0; i < 100 && srv.pubs < 2; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(srv.pubs == 2 && s.num_inflight == 2 && s.num_queued == 1);
+  for (i = 0; i < 200 && srv.dups == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(srv.dups > 0 && strcmp(srv.msgs, "0,1,") == 0);
+
+  // Acknowledged messages are dropped, and the rest sent
+  srv.ack = true;
+  for (i = 0; i < 200 && s.num_inflight + s.num_queued > 0; i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(s.num_inflight == 0 && s.num_queued == 0);
+  ASSERT(strcmp(srv.msgs, "0,1,2,") == 0);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s_session_saves == 1 && s.dirty);  // Not on every acknowledgement
+  ASSERT(s.head == NULL && s.tail == NULL);
+
+  // Emptied by acknowledgements, the list takes new messages
+  opts.message = mg_str("3");
+  ASSERT(mg_mqtt_pub(c, &opts) != 0);
+  for (i = 0; i < 200 && s.num_inflight + s.num_queued > 0; i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(strcmp(srv.msgs, "0,1,2,3,") == 0 && s.head == NULL);
+
+  // Close saves what's left
+  mg_mgr_free(&mgr);
+  ASSERT(s.c == NULL && s_session_saves == 2 && !s.dirty);
+  data = mg_file_read(&mg_fs_posix, path);
+  ASSERT(data.len == 4);
+  mg_free((void *) data.buf);
+  mg_mqtt_session_free(&s);
+  mg_fs_posix.rm(path);
+}
+
+static void test_mqtt_pub_batch(void) {
+  struct mg_mqtt_opts opts, msgs[4];
+  struct mg_connection *c;
+  struct mg_mgr mgr;
+  struct ssrv srv;
+  struct bcli b;
+  uint16_t ids[4];
+  int i;
+
+  mg_mgr_init(&mgr);
+  memset(&srv, 0, sizeof(srv));
+  memset(&b, 0, sizeof(b));
+  memset(&opts, 0, sizeof(opts));
+  memset(msgs, 0, sizeof(msgs));
+  srv.connack = srv.ack = srv.v5 = true;
+  ASSERT(mg_listen(&mgr, "tcp://127.0.0.1:12386", esrv, &srv) != NULL);
+  opts.version = 5;
+  c = mg_mqtt_connect(&mgr, "mqtt://127.0.0.1:12386", &opts, ebroker, &b);
+  for (i = 0; i < 100 && !b.opened; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(b.opened);
+
+  // Long topics get an alias, then are sent as an alias only
+  msgs[0].topic = msgs[1].topic = msgs[3].topic = mg_str("long/topic");
+  msgs[2].topic = mg_str("x");
+  msgs[0].message = mg_str("a"), msgs[1].message = mg_str("b");
+  msgs[2].message = mg_str("c"), msgs[3].message = mg_str("d");
+  msgs[1].qos = 1;
+  ASSERT(mg_mqtt_pub_batch(c, msgs, 3, ids) == 3);
+  ASSERT(ids[0] == 0 && ids[1] != 0 && ids[2] == 0);
+  ASSERT(mg_mqtt_pub(c, &msgs[3]) == 0);
+  for (i = 0; i < 100 && srv.pubs < 4; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(strcmp(srv.msgs, "long/topic|1=a,|1=b,x|0=c,|1=d,") == 0);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
 static void eh1(struct mg_connection *c, int ev, void *ev_data) {
   struct mg_tls_opts *topts = (struct mg_tls_opts *) c->fn_data;
   if (ev == MG_EV_ACCEPT && topts != NULL) mg_tls_init(c, topts);
@@ -1543,6 +2044,218 @@ static void test_tls(void) {
 #endif
 }
 
+#if MG_TLS == MG_TLS_BUILTIN
+struct resume_data {
+  struct mg_str ca;  // CA to verify the server with
+  const char *name;  // Server name to verify
+  int status;        // HTTP status, or -1 on error
+  int saves, loads;  // Session store calls
+  bool resumed;      // Server logged a resumed session
+  bool cached;       // Client logged a peer chain found verified in cache
+  uint8_t session[1024];
+  size_t len;
+};
+
+static void resume_save(void *arg, const char *name, const void *buf,
+                        size_t len) {
+  struct resume_data *d = (struct resume_data *) arg;
+  ASSERT(strcmp(name, "localhost:12349") == 0);
+  ASSERT(strcmp(d->name, "localhost") == 0);
+  ASSERT(len <= sizeof(d->session));
+  memcpy(d->session, buf, len);
+  d->len = len;
+  d->saves++;
+}
+
+static size_t resume_load(void *arg, const char *name, void *buf, size_t len) {
+  struct resume_data *d = (struct resume_data *) arg;
+  size_t n = d->len;
+  ASSERT(strncmp(name, d->name, strlen(d->name)) == 0);
+  d->loads++;
+  if (n == 0 || n > len) return 0;
+  memcpy(buf, d->session, n);
+  d->len = 0;  // Single-use
+  return n;
+}
+
+static void fresume(struct mg_connection *c, int ev, void *ev_data) {
+  struct resume_data *d = (struct resume_data *) c->fn_data;
+  if (ev == MG_EV_CONNECT) {
+    struct mg_tls_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.ca = d->ca;
+    opts.name = mg_str(d->name);
+    mg_tls_init(c, &opts);
+  } else if (ev == MG_EV_TLS_HS) {
+    mg_printf(c, "GET /a.txt HTTP/1.0\r\n\r\n");
+  } else if (ev == MG_EV_HTTP_MSG) {
+    d->status = mg_http_status((struct mg_http_message *) ev_data);
+    c->is_draining = 1;
+  } else if (ev == MG_EV_ERROR) {
+    d->status = -1;
+  }
+}
+
+// Fetch with the log captured, to see what the TLS stack did
+static int resume_fetch(struct mg_mgr *mgr, struct resume_data *d,
+                        const char *ca) {
+  struct mg_iobuf log = {0, 0, 0, 256, 0};
+  int i, level = mg_log_level;
+  d->ca = mg_unpacked(ca);
+  if (d->name == NULL) d->name = "localhost";
+  d->status = 0;
+  mg_log_set_fn(mg_pfn_iobuf, &log);
+  mg_log_set(MG_LL_VERBOSE);
+  mg_http_connect(mgr, "https://localhost:12349", fresume, d);
+  for (i = 0; i < 500 && d->status == 0; i++) mg_mgr_poll(mgr, 1);
+  mg_log_set(level);
+  mg_log_set_fn(mg_pfn_stdout, NULL);
+  d->resumed = mgstrstr(mg_str_n((char *) log.buf, log.len),
+                        mg_str("resuming session")) != NULL;
+  d->cached = mgstrstr(mg_str_n((char *) log.buf, log.len),
+                       mg_str("chain verified before")) != NULL;
+  mg_iobuf_free(&log);
+  return d->status;
+}
+#endif
+
+static void test_tls_resume(void) {
+#if MG_TLS == MG_TLS_BUILTIN
+  struct mg_mgr mgr;
+  struct mg_tls_opts opts;
+  struct mg_tls_session_store store;
+  struct resume_data d;
+  memset(&d, 0, sizeof(d));
+  memset(&opts, 0, sizeof(opts));
+  opts.cert = mg_unpacked("/certs/server.crt");
+  opts.key = mg_unpacked("/certs/server.key");
+  store.save = resume_save, store.load = resume_load, store.arg = &d;
+  mg_mgr_init(&mgr);
+  mg_tls_set_session_store(&mgr, &store);
+  ASSERT(mg_http_listen(&mgr, "https://localhost:12349", eh1, &opts) != NULL);
+
+  // Full handshake, the server issues a ticket
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.loads == 1 && d.saves == 1 && d.len > 0 && !d.resumed);
+  // Resumed, and a new ticket is issued
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.loads == 2 && d.saves == 2 && d.len > 0 && d.resumed);
+  // Other trust anchors: the session is not offered, and the full handshake
+  // fails with the wrong CA
+  ASSERT(resume_fetch(&mgr, &d, "/certs/client.crt") == -1);
+  ASSERT(d.loads == 3 && d.saves == 2 && d.len == 0 && !d.resumed);
+  // No session: full handshake
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.loads == 4 && d.saves == 3 && d.len > 0 && !d.resumed);
+  // Corrupt ticket: full handshake
+  d.session[d.len - 1] ^= 1;
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.loads == 5 && d.saves == 4 && !d.resumed);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+#endif
+}
+
+static void test_tls_chain_cache(void) {
+#if MG_TLS == MG_TLS_BUILTIN
+  struct mg_mgr mgr;
+  struct mg_tls_opts opts;
+  struct mg_tls_session_store store;
+  struct resume_data d;
+  memset(&d, 0, sizeof(d));
+  memset(&opts, 0, sizeof(opts));
+  opts.cert = mg_unpacked("/certs/server.crt");
+  opts.key = mg_unpacked("/certs/server.key");
+  store.save = resume_save, store.load = resume_load, store.arg = &d;
+  mg_mgr_init(&mgr);
+  mg_tls_set_session_store(&mgr, &store);
+  ASSERT(mg_http_listen(&mgr, "https://localhost:12349", eh1, &opts) != NULL);
+
+  // Drop tickets so that every handshake receives the chain. The first one
+  // verifies it, the second one finds it in the cache
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(!d.cached);
+  d.len = 0;
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.cached);
+  d.len = 0;
+  // The same chain does not verify against other trust anchors
+  ASSERT(resume_fetch(&mgr, &d, "/certs/client.crt") == -1);
+  ASSERT(!d.cached);
+  // Nor for another server name
+  d.name = "example.org";
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == -1);
+  ASSERT(!d.cached);
+  d.name = "localhost";
+  ASSERT(resume_fetch(&mgr, &d, "/certs/ca.crt") == 200);
+  ASSERT(d.cached);
+  ASSERT(d.saves == 3);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+#endif
+}
+
+static void test_tls_ctx(void) {
+#if MG_TLS == MG_TLS_OPENSSL || MG_TLS == MG_TLS_WOLFSSL
+  struct mg_mgr mgr;
+  struct mg_connection *c1, *c2, *c3;
+  struct mg_tls_opts opts;
+  struct mg_tls_ctx *tc;
+  memset(&opts, 0, sizeof(opts));
+  opts.ca = mg_unpacked("/certs/ca.crt");
+  mg_mgr_init(&mgr);
+  tc = (struct mg_tls_ctx *) mgr.tls_ctx;
+  ASSERT(tc != NULL && tc->bm != NULL);
+  c1 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  c2 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  c3 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  ASSERT(c1 != NULL && c2 != NULL && c3 != NULL);
+  mg_tls_init(c1, &opts);
+  mg_tls_init(c2, &opts);  // Same options, same SSL_CTX
+  ASSERT(c1->tls != NULL && c2->tls != NULL);
+  ASSERT(((struct mg_tls *) c1->tls)->ctx == ((struct mg_tls *) c2->tls)->ctx);
+  ASSERT(((struct mg_tls *) c1->tls)->ctx == tc->entries[0].ctx);
+  ASSERT(((struct mg_tls *) c1->tls)->bm == NULL);  // Shared BIO method
+  opts.ca = mg_unpacked("/certs/server.crt");
+  mg_tls_init(c3, &opts);  // Different CA, new SSL_CTX
+  ASSERT(c3->tls != NULL);
+  ASSERT(((struct mg_tls *) c3->tls)->ctx != tc->entries[0].ctx);
+  ASSERT(((struct mg_tls *) c3->tls)->ctx == tc->entries[1].ctx);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL && mgr.tls_ctx == NULL);
+#elif MG_TLS == MG_TLS_MBED
+  struct mg_mgr mgr;
+  struct mg_connection *c1, *c2, *c3;
+  struct mg_tls_opts opts;
+  struct mg_tls_ctx *tc;
+  memset(&opts, 0, sizeof(opts));
+  opts.ca = mg_unpacked("/certs/ca.crt");
+  mg_mgr_init(&mgr);
+  tc = (struct mg_tls_ctx *) mgr.tls_ctx;
+  ASSERT(tc != NULL);
+  c1 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  c2 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  c3 = mg_connect(&mgr, "tcp://127.0.0.1:12348", NULL, NULL);
+  ASSERT(c1 != NULL && c2 != NULL && c3 != NULL);
+  mg_tls_init(c1, &opts);
+  mg_tls_init(c2, &opts);  // Same options, same parsed config
+  ASSERT(c1->tls != NULL && c2->tls != NULL);
+  ASSERT(((struct mg_tls *) c1->tls)->conf == tc->confs[0]);
+  ASSERT(((struct mg_tls *) c2->tls)->conf == tc->confs[0]);
+  ASSERT(tc->confs[0]->refs == 3);  // Cache, c1 and c2
+  opts.ca = mg_unpacked("/certs/server.crt");
+  mg_tls_init(c3, &opts);  // Different CA, new config
+  ASSERT(c3->tls != NULL);
+  ASSERT(((struct mg_tls *) c3->tls)->conf == tc->confs[1]);
+  mg_tls_free(c1);
+  ASSERT(c1->tls == NULL && tc->confs[0]->refs == 2);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL && mgr.tls_ctx == NULL);
+#endif
+}
+
 static void f3(struct mg_connection *c, int ev, void *ev_data) {
   int *ok = (int *) c->fn_data;
   // MG_INFO(("%d", ev));
@@ -1763,6 +2476,68 @@ static void test_http_pipeline(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+// Send a part of a request, poll until the server connection buffers it all
+static struct mg_connection *trickle(struct mg_mgr *mgr, struct mg_connection *c,
+                                     const char *s, size_t total) {
+  struct mg_connection *sc = NULL;
+  int i;
+  mg_printf(c, "%s", s);
+  for (i = 0; i < 100; i++) {
+    mg_mgr_poll(mgr, 1);
+    for (sc = mgr->conns; sc != NULL && !sc->is_accepted; sc = sc->next) (void) 0;
+    if (sc != NULL && sc->recv.len == total) break;
+  }
+  ASSERT(sc != NULL && sc->recv.len == total);
+  return sc;
+}
+
+// Record each request as "uri:body;"
+static void ftrickle(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_iobuf *io = (struct mg_iobuf *) c->fn_data;
+    char buf[100];
+    size_t n = mg_snprintf(buf, sizeof(buf), "%.*s:%.*s;", (int) hm->uri.len,
+                           hm->uri.buf, (int) hm->body.len, hm->body.buf);
+    mg_iobuf_add(io, io->len, buf, n);
+    mg_http_reply(c, 200, "", "");
+  }
+}
+
+static void test_http_trickle(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12378";
+  const char *h1 = "POST /foo HTTP/1.1\r\nTransfer-",
+             *h2 = "Encoding: chunked\r\n\r\n3\r\nabc\r\n2\r\nd",
+             *h3 = "e\r\n0\r\n\r\nGET /bar HTTP/1.1\r\nHost: x";
+  size_t n = strlen(h1);
+  struct mg_iobuf io = {NULL, 0, 0, 0, 0};
+  struct mg_connection *c, *sc;
+  int i;
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ftrickle, &io);
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL);
+
+  // A header split across reads is recognised once the rest arrives
+  sc = trickle(&mgr, c, h1, n);
+  ASSERT(io.len == 0);
+  // Headers complete, the last chunk is not: nothing is delivered yet
+  sc = trickle(&mgr, c, h2, n += strlen(h2));
+  ASSERT(io.len == 0);
+  // Message complete. The pipelined request stays buffered until complete
+  sc = trickle(&mgr, c, h3, strlen(h3) - 8);
+  ASSERT(io.len == 11 && memcmp(io.buf, "/foo:abcde;", 11) == 0);
+  mg_printf(c, "\r\n\r\n");
+  for (i = 0; i < 100 && io.len < 17; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(io.len == 17 && memcmp(io.buf, "/foo:abcde;/bar:;", 17) == 0);
+  ASSERT(sc->recv.len == 0);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  mg_iobuf_free(&io);
+}
+
 static void test_http_parse(void) {
   struct mg_str *v;
   struct mg_http_message req;
@@ -2035,6 +2810,67 @@ static void test_http_parse(void) {
         "Transfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n";
     ASSERT(mg_http_parse(s, strlen(s), &req) == -1);
   }
+
+  {
+    // Long tokens are scanned in blocks: check stops past block boundaries
+    struct mg_http_message hm;
+    const char *s;
+    s = "GET /0123456789abcdef0123456789abcdef0123456789\xc3\xa9x HTTP/1.1\r\n"
+        "X-0123456789abcdef0123456789abcdef0123456789: "
+        "0123456789abcdef0123456789abcdef0123456789\r\n"
+        "COOKIE: a\r\nconnection: b\r\n\r\n";
+    ASSERT(mg_http_parse(s, strlen(s), &hm) == (int) strlen(s));
+    ASSERT(hm.uri.len == 46 && hm.uri.buf[43] == '\xc3');
+    ASSERT(hm.headers[0].name.len == 44 && hm.headers[0].value.len == 42);
+    ASSERT((v = mg_http_get_header(&hm, "Connection")) != NULL);
+    ASSERT(vcmp(*v, "b"));
+    s = "GET /0123456789abcdef0123456789abcdef0123456789\xc3x HTTP/1.1\r\n\r\n";
+    ASSERT(mg_http_parse(s, strlen(s), &hm) == -1);  // Invalid UTF-8 in URI
+    s = "GET / HTTP/1.1\r\nX: 0123456789abcdef0123456789abcdef\x01\r\n\r\n";
+    ASSERT(mg_http_parse(s, strlen(s), &hm) == -1);  // Control character
+    s = "GET / HTTP/1.1\r\ncookie: a\r\nX-0123456789abcdef0123456789abcdef: "
+        "0123456789abcdef0123456789abcdef\r\nCookie: b\r\n\r\n";
+    ASSERT(mg_http_parse(s, strlen(s), &hm) == -1);  // Duplicate Cookie
+  }
+
+  {
+    // Well-known headers are indexed while parsing
+    struct mg_http_message hm;
+    const char *s = "GET / HTTP/1.1\r\nX: 1\r\nrange: bytes=1-\r\nHost: a\r\n"
+                    "If-None-Match: \"x\"\r\nSec-WebSocket-Key: k\r\n"
+                    "Content-Length: 0\r\nHOST: b\r\n\r\n";
+    ASSERT(mg_http_parse(s, strlen(s), &hm) == (int) strlen(s));
+    ASSERT((v = mg_http_get_header_id(&hm, MG_HTTP_HDR_RANGE)) != NULL);
+    ASSERT(v == mg_http_get_header(&hm, "Range") && vcmp(*v, "bytes=1-"));
+    ASSERT((v = mg_http_get_header_id(&hm, MG_HTTP_HDR_HOST)) != NULL);
+    ASSERT(vcmp(*v, "a"));  // First one wins, like mg_http_get_header()
+    v = mg_http_get_header_id(&hm, MG_HTTP_HDR_IF_NONE_MATCH);
+    ASSERT(v != NULL && vcmp(*v, "\"x\""));
+    v = mg_http_get_header_id(&hm, MG_HTTP_HDR_SEC_WEBSOCKET_KEY);
+    ASSERT(v != NULL && vcmp(*v, "k"));
+    v = mg_http_get_header_id(&hm, MG_HTTP_HDR_CONTENT_LENGTH);
+    ASSERT(v != NULL && vcmp(*v, "0"));
+    ASSERT(mg_http_get_header_id(&hm, MG_HTTP_HDR_AUTHORIZATION) == NULL);
+    ASSERT(mg_http_get_header_id(&hm, MG_HTTP_HDR_TRANSFER_ENCODING) == NULL);
+    ASSERT(mg_http_get_header_id(&hm, MG_HTTP_HDR_MAX) == NULL);
+    ASSERT(mg_http_get_header_id(&hm, -1) == NULL);
+  }
+
+  {
+    // Messages not built by mg_http_parse() have no index: look up by name
+    struct mg_http_message hm;
+    char user[20], pass[20];
+    memset(&hm, 0, sizeof(hm));
+    hm.headers[0].name = mg_str("X"), hm.headers[0].value = mg_str("1");
+    hm.headers[1].name = mg_str("range"), hm.headers[1].value = mg_str("a");
+    hm.headers[2].name = mg_str("Cookie");
+    hm.headers[2].value = mg_str("access_token=tok");
+    v = mg_http_get_header_id(&hm, MG_HTTP_HDR_RANGE);
+    ASSERT(v == &hm.headers[1].value);
+    ASSERT(mg_http_get_header_id(&hm, MG_HTTP_HDR_HOST) == NULL);
+    mg_http_creds(&hm, user, sizeof(user), pass, sizeof(pass));
+    ASSERT(user[0] == '\0' && strcmp(pass, "tok") == 0);
+  }
 }
 
 static void ehr(struct mg_connection *c, int ev, void *ev_data) {
@@ -2093,6 +2929,117 @@ static void test_http_range(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+// Serve a big file, record the most the send buffer has held
+static void ehbig(struct mg_connection *c, int ev, void *ev_data) {
+  size_t *max_send = (size_t *) c->fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_http_serve_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    mg_http_serve_file(c, hm, "big.bin", &opts);
+  }
+  if (c->send.len > *max_send) *max_send = c->send.len;
+}
+
+static void bigcb(struct mg_connection *c, int ev, void *ev_data) {
+  uint32_t *crc = (uint32_t *) c->fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    if (hm->body.len == MG_MAX_RECV_SIZE / 2) {
+      *crc = mg_crc32(0, hm->body.buf, hm->body.len);
+    }
+    c->is_closing = 1;
+  }
+}
+
+// Files larger than the socket buffer, sent in many writable rounds
+static void test_http_big_file(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12354";
+  struct mg_connection *c;
+  size_t i, len = MG_MAX_RECV_SIZE / 2, max_send = 0;
+  char *data = (char *) calloc(1, len);
+  uint32_t crc = 0;
+  ASSERT(data != NULL);
+  for (i = 0; i < len; i++) data[i] = (char) (i * 7 + i / 251);
+  ASSERT(mg_file_write(&mg_fs_posix, "big.bin", data, len) == true);
+
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehbig, &max_send);
+  c = mg_http_connect(&mgr, url, bigcb, &crc);
+  ASSERT(c != NULL);
+  mg_printf(c, "GET /big.bin HTTP/1.0\n\n");
+  for (i = 0; i < 1000 && crc == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(crc == mg_crc32(0, data, len));
+  // With sendfile(), file data never goes through c->send: only headers do
+  ASSERT(MG_ENABLE_SENDFILE ? max_send < 512 : max_send > 512);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  remove("big.bin");
+  free(data);
+}
+
+#if MG_HTTP_CACHE_SIZE > 0
+static void ehc(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_http_serve_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.root_dir = ".";
+    mg_http_serve_dir(c, hm, &opts);
+  }
+}
+
+static void test_http_cache(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12355";
+  struct mg_http_message hm;
+  char buf[FETCH_BUF_SIZE], etag[100];
+  uint64_t expire;
+
+  ASSERT(mg_file_printf(&mg_fs_posix, "cache.txt", "%s", "hello") == true);
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehc, NULL);
+  ASSERT(fetch(&mgr, buf, url, "GET /cache.txt HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "hello") == 0);
+  ASSERT(mgr.http_cache != NULL);
+  hm = gethm(buf);
+  mg_snprintf(etag, sizeof(etag), "%.*s",
+              (int) mg_http_get_header(&hm, "Etag")->len,
+              mg_http_get_header(&hm, "Etag")->buf);
+
+  // Served from memory: changes are not seen until MG_HTTP_CACHE_TTL passes
+  remove("cache.txt");
+  ASSERT(fetch(&mgr, buf, url, "GET /cache.txt HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "hello") == 0);
+  ASSERT(fetch(&mgr, buf, url,
+               "GET /cache.txt HTTP/1.0\nRange: bytes=1-2\n\n") == 206);
+  ASSERT(cmpbody(buf, "el") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET /cache.txt HTTP/1.0\nIf-None-Match: %s\n\n",
+               etag) == 304);
+  ASSERT(fetch(&mgr, buf, url, "HEAD /cache.txt HTTP/1.0\n\n") == 200);
+  hm = gethm(buf);
+  ASSERT(mg_strcmp(*mg_http_get_header(&hm, "Content-Length"), mg_str("5")) ==
+         0);
+
+  // After that, modified and removed files are noticed
+  ASSERT(mg_file_printf(&mg_fs_posix, "cache.txt", "%s", "world!") == true);
+  expire = mg_millis() + MG_HTTP_CACHE_TTL + 10;
+  while (mg_millis() < expire) mg_mgr_poll(&mgr, 10);
+  ASSERT(fetch(&mgr, buf, url, "GET /cache.txt HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "world!") == 0);
+  remove("cache.txt");
+  expire = mg_millis() + MG_HTTP_CACHE_TTL + 10;
+  while (mg_millis() < expire) mg_mgr_poll(&mgr, 10);
+  ASSERT(fetch(&mgr, buf, url, "GET /cache.txt HTTP/1.0\n\n") == 404);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  ASSERT(mgr.http_cache == NULL);
+}
+#endif
+
 static void f1(void *arg) {
   (*(int *) arg)++;
 }
@@ -2245,6 +3192,59 @@ static void test_timer(void) {
   }
 }
 
+// Timer wheel must call timers exactly like mg_timer_poll() does
+static void test_timer_wheel(void) {
+  uint64_t periods[] = {0, 1, 7, 64, 100, 5000, 300000, 20000000};
+  struct mg_timer lt[8], wt[8], *lh = NULL, *wh = NULL, *t;
+  struct mg_timer_wheel w;
+  int i, step, lv[8], wv[8], mismatches = 0, late = 0;
+  uint64_t now = 1000, x = 42;
+
+  memset(&w, 0, sizeof(w));
+  memset(lv, 0, sizeof(lv));
+  memset(wv, 0, sizeof(wv));
+  for (i = 0; i < 8; i++) {
+    unsigned flags = i == 3 ? MG_TIMER_ONCE : MG_TIMER_REPEAT;
+    if (i & 1) flags |= MG_TIMER_RUN_NOW;
+    mg_timer_init(&lh, &lt[i], periods[i], flags, f1, &lv[i]);
+    mg_timer_init(&wh, &wt[i], periods[i], flags, f1, &wv[i]);
+  }
+  ASSERT(mg_timer_wheel_timeout(&w, now, 500) == 500);
+
+  for (step = 0; step < 5000; step++) {
+    uint64_t r, next = 0;
+    int ms;
+    x = x * 6364136223846793005U + 1442695040888963407U;
+    r = x >> 33;
+    if (r % 100 < 90) {
+      now += 1 + r % 13;  // Busy loop
+    } else if (r % 100 < 98) {
+      now += (r >> 8) % 100000;  // Idle
+    } else if (r % 100 == 98) {
+      now += (r >> 8) % 30000000;  // Suspend
+    } else if (now > 10000) {
+      now -= (r >> 8) % 10000;  // Time goes back
+    }
+    if (step == 2500) mg_timer_free(&lh, &lt[2]), mg_timer_free(&wh, &wt[2]);
+    if (step % 500 == 250 && wt[5].expire > now + 1000) {  // Postpone
+      lt[5].expire = wt[5].expire = lt[5].expire + 1000;
+    }
+    mg_timer_poll(&lh, now);
+    mg_timer_wheel_poll(&w, &wh, now);
+    if (memcmp(lv, wv, sizeof(lv)) != 0) mismatches++;
+    for (t = wh; t != NULL; t = t->next) {
+      if (t->wprev != NULL && (next == 0 || t->expire < next)) next = t->expire;
+    }
+    ms = mg_timer_wheel_timeout(&w, now, -1);
+    if (ms < 0 || (uint64_t) ms > (next > now ? next - now : 1)) late++;
+  }
+  ASSERT(mismatches == 0);
+  ASSERT(late == 0);
+  ASSERT(wv[3] == 1);
+  ASSERT(wv[7] > 1);
+  ASSERT(wh == &wt[7] && wt[3].next == &wt[1]);
+}
+
 static bool sn(const char *fmt, ...) {
   char buf[100], tmp[1] = {0}, buf2[sizeof(buf)];
   size_t n, n2, n1;
@@ -2399,7 +3399,7 @@ static void test_str(void) {
   // Non-standard formatting
   {
     char buf[100], *p = NULL;
-    struct mg_iobuf io = {0, 0, 0, 16};
+    struct mg_iobuf io = {0, 0, 0, 16, 0};
     const char *expected;
 
     expected = "\"\"";
@@ -2527,7 +3527,7 @@ static void test_str(void) {
     TESTDOUBLE("%.*g", DBLWIDTH(10, 1e11), "1e+11"); // e > width
     TESTDOUBLE("%.*g", DBLWIDTH(10, -1e11), "-1e+11"); // -e < -width
     {
-      struct mg_iobuf io = {0, 0, 0, 16};
+      struct mg_iobuf io = {0, 0, 0, 16, 0};
       mg_xprintf(mg_pfn_iobuf, &io, "%.*g", 88, -1e-88); // > sizeof(tmp)
       mg_iobuf_free(&io);
     }
@@ -3039,14 +4039,113 @@ static void test_crc32(void) {
   ASSERT(mg_crc32(mg_crc32(0, "ab", 2), "c", 1) == 891568578);
 }
 
-static void test_crc16(void) {
-  ASSERT(mg_crc16(0, 0, 0) == 0);
-  ASSERT(mg_crc16(0, "a", 1) == 0x82f7);
-  ASSERT(mg_crc16(0, "abc", 3) == 0x9e25);
-  ASSERT(mg_crc16(mg_crc16(0, "ab", 2), "c", 1) == 0x9e25);
+#if MG_ENABLE_DEFLATE
+// Check gzip framing: magic, method, no optional fields, the CRC32/ISIZE
+// trailer, and that the deflate stream in between decompresses to data
+static bool gzcheck(const char *buf, size_t len, const char *data, size_t n) {
+  const uint8_t *p = (const uint8_t *) buf;
+  struct mg_iobuf io = {NULL, 0, 0, 256, 0};
+  uint32_t crc, size;
+  bool ok;
+  if (len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 0) {
+    return false;
+  }
+  ok = mg_inflate(buf + 10, len - 18, n, &io) && io.len == n &&
+       (n == 0 || memcmp(io.buf, data, n) == 0);
+  mg_iobuf_free(&io);
+  p += len - 8;
+  crc = MG_U32(p[3], p[2], p[1], p[0]), size = MG_U32(p[7], p[6], p[5], p[4]);
+  return ok && crc == mg_crc32(0, data, n) && size == (uint32_t) n;
 }
 
-static void us(struct mg_connection *c, int ev, void *ev_data) {
+static void test_deflate(void) {
+  struct mg_deflate d;
+  struct mg_iobuf io = {0, 0, 0, 64, 0}, out = {0, 0, 0, 64, 0};
+  char data[4000], rnd[3000];
+  size_t i, n = 0;
+  for (i = 0; n + 40 < sizeof(data); i++) {
+    n += mg_snprintf(data + n, sizeof(data) - n, "{\"id\":%lu,\"on\":%s},",
+                     (unsigned long) i, i % 3 ? "true" : "false");
+  }
+
+  // Empty stream: fixed block with just the end-of-block code
+  memset(&d, 0, sizeof(d));
+  ASSERT(mg_deflate(&d, NULL, 0, true, &io));
+  ASSERT(io.len == 2 && io.buf[0] == 3 && io.buf[1] == 0);
+  mg_iobuf_free(&io);
+
+  memset(&d, 0, sizeof(d));
+  ASSERT(mg_gzip(&d, data, n, true, &io));
+  ASSERT(gzcheck((char *) io.buf, io.len, data, n));
+  ASSERT(io.len * 4 < n);
+  ASSERT(d.win == NULL);
+  mg_iobuf_free(&io);
+
+  // Streaming: every piece ends with a sync flush
+  memset(&d, 0, sizeof(d));
+  for (i = 0; i < n; i += 1000) {
+    size_t len = i + 1000 < n ? 1000 : n - i, ofs = io.len;
+    ASSERT(mg_gzip(&d, data + i, len, false, &io));
+    ASSERT(io.len > ofs + 4);
+    ASSERT(memcmp(io.buf + io.len - 4, "\x00\x00\xff\xff", 4) == 0);
+  }
+  ASSERT(d.size == n && d.crc == mg_crc32(0, data, n));
+  ASSERT(mg_gzip(&d, NULL, 0, true, &io));
+  ASSERT(gzcheck((char *) io.buf, io.len, data, n));
+  ASSERT(io.len * 3 < n);
+  mg_iobuf_free(&io);
+
+  // Abandoned stream
+  memset(&d, 0, sizeof(d));
+  ASSERT(mg_deflate(&d, data, n, false, &io));
+  mg_deflate_free(&d);
+  ASSERT(d.win == NULL);
+  mg_iobuf_free(&io);
+
+  // Decompression
+  ASSERT(mg_inflate("\x03\x00", 2, 10, &out) && out.len == 0);
+  ASSERT(!mg_inflate("\x07", 1, 10, &out));  // Reserved block type
+  memset(&d, 0, sizeof(d));
+  ASSERT(mg_deflate(&d, data, n, true, &io));
+  ASSERT(mg_inflate((char *) io.buf, io.len, n, &out));
+  ASSERT(out.len == n && memcmp(out.buf, data, n) == 0);
+  ASSERT(!mg_inflate((char *) io.buf, io.len, n - 1, &out));  // Too large
+  ASSERT(!mg_inflate((char *) io.buf, io.len / 2, n, &out));  // Truncated
+  ASSERT(out.len == n);
+  mg_iobuf_free(&out);
+  mg_iobuf_free(&io);
+
+  // Sync-flushed pieces that refer to each other, 00 00 ff ff stripped
+  memset(&d, 0, sizeof(d));
+  for (i = 0; i < n; i += 1000) {
+    ASSERT(mg_deflate(&d, data + i, i + 1000 < n ? 1000 : n - i, false, &io));
+  }
+  mg_deflate_free(&d);
+  ASSERT(mg_inflate((char *) io.buf, io.len - 4, n, &out));
+  ASSERT(out.len == n && memcmp(out.buf, data, n) == 0);
+  mg_iobuf_free(&out);
+  mg_iobuf_free(&io);
+
+  // Incompressible data goes in stored blocks
+  mg_random(rnd, sizeof(rnd));
+  memset(&d, 0, sizeof(d));
+  ASSERT(mg_deflate(&d, rnd, sizeof(rnd), true, &io));
+  ASSERT(io.len > sizeof(rnd));
+  ASSERT(mg_inflate((char *) io.buf, io.len, sizeof(rnd), &out));
+  ASSERT(out.len == sizeof(rnd) && memcmp(out.buf, rnd, sizeof(rnd)) == 0);
+  mg_iobuf_free(&out);
+  mg_iobuf_free(&io);
+}
+#endif
+
+static void test_crc16(void) {
+  ASSERT(mg_crc16(0, 0, 0) == 0);
+  ASSERT(mg_crc16(0, "a", 1) == 0x82f7);
+  ASSERT(mg_crc16(0, "abc", 3) == 0x9e25);
+  ASSERT(mg_crc16(mg_crc16(0, "ab", 2), "c", 1) == 0x9e25);
+}
+
+static void us(struct mg_connection *c, int ev, void *ev_data) {
   struct mg_http_message *hm = (struct mg_http_message *) ev_data;
   if (ev == MG_EV_HTTP_MSG && mg_match(hm->uri, mg_str("/upload"), NULL)) {
     MG_DEBUG(("Got all %lu bytes!", (unsigned long) hm->body.len));
@@ -3246,6 +4345,451 @@ static void test_http_chunked(void) {
   test_http_chunked_case(eX, eh4, 2, "abcdabcd");
 }
 
+#if MG_ENABLE_DEFLATE
+struct gz_status {
+  int status;                        // Response status, 0 if none yet
+  char enc[16], vary[32], etag[48];  // Response headers
+  char body[4000];                   // Response body, de-chunked
+  size_t len;                        // Body length
+};
+
+static void ehgz(struct mg_connection *c, int ev, void *ev_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  const char *data = (const char *) c->fn_data;
+  if (ev != MG_EV_HTTP_MSG) return;
+  if (mg_match(hm->uri, mg_str("/json"), NULL)) {
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", data);
+  } else if (mg_match(hm->uri, mg_str("/small"), NULL)) {
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n", "{}");
+  } else if (mg_match(hm->uri, mg_str("/bin"), NULL)) {
+    mg_http_reply(c, 200, "Content-Type: image/png\r\n", "%s", data);
+  } else if (mg_match(hm->uri, mg_str("/chunks"), NULL)) {
+    size_t i, n = strlen(data);
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                 "Transfer-Encoding: chunked\r\n\r\n");
+    for (i = 0; i < n; i += 1000) {
+      mg_http_printf_chunk(c, "%.*s", (int) (n - i < 1000 ? n - i : 1000),
+                           data + i);
+    }
+    mg_http_printf_chunk(c, "");
+  } else {
+    struct mg_http_serve_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    mg_http_serve_file(c, hm, "data/range.txt", &opts);
+  }
+}
+
+static void hdrcpy(char *buf, size_t len, struct mg_http_message *hm,
+                   const char *name) {
+  struct mg_str *v = mg_http_get_header(hm, name);
+  mg_snprintf(buf, len, "%.*s", v ? (int) v->len : 0, v ? v->buf : "");
+}
+
+static void ehgzc(struct mg_connection *c, int ev, void *ev_data) {
+  struct gz_status *st = (struct gz_status *) c->fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    st->status = mg_http_status(hm);
+    hdrcpy(st->enc, sizeof(st->enc), hm, "Content-Encoding");
+    hdrcpy(st->vary, sizeof(st->vary), hm, "Vary");
+    hdrcpy(st->etag, sizeof(st->etag), hm, "ETag");
+    st->len = hm->body.len < sizeof(st->body) ? hm->body.len : 0;
+    memcpy(st->body, hm->body.buf, st->len);
+    c->is_draining = 1;
+  }
+}
+
+static int gzfetch(struct mg_mgr *mgr, struct gz_status *st, const char *url,
+                   const char *req) {
+  struct mg_connection *c = mg_http_connect(mgr, url, ehgzc, st);
+  int i;
+  memset(st, 0, sizeof(*st));
+  mg_printf(c, "%s", req);
+  for (i = 0; i < 500 && st->status == 0; i++) mg_mgr_poll(mgr, 1);
+  return st->status;
+}
+
+static void test_http_gzip(void) {
+  struct mg_mgr mgr;
+  struct gz_status st;
+  const char *url = "http://127.0.0.1:12380";
+  struct mg_str file = mg_file_read(&mg_fs_posix, "data/range.txt");
+  char data[3000], etag[48];
+  size_t i, n = 0;
+  for (i = 0; n + 40 < sizeof(data); i++) {
+    n += mg_snprintf(data + n, sizeof(data) - n, "{\"id\":%lu,\"on\":%s},",
+                     (unsigned long) i, i % 3 ? "true" : "false");
+  }
+  ASSERT(file.len >= MG_HTTP_GZIP_MIN);
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehgz, data);
+
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\n"
+                                 "Accept-Encoding: deflate, gzip\r\n\r\n") ==
+         200);
+  ASSERT(strcmp(st.enc, "gzip") == 0);
+  ASSERT(strcmp(st.vary, "Accept-Encoding") == 0);
+  ASSERT(gzcheck(st.body, st.len, data, n) && st.len * 4 < n);
+
+  // Not compressed: no Accept-Encoding, too small, wrong type
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+  ASSERT(memcmp(st.body, data, n) == 0);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /small HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == 2);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /bin HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+
+  // Accept-Encoding is parsed, q=0 refuses a coding
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip;q=0, br\r\n\r\n") ==
+         200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\nAccept-Encoding: "
+                                 "*;q=0.5, GZIP ; Q=0.000\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\n"
+                                 "Accept-Encoding: nogzip\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\nAccept-Encoding: "
+                                 "br;q=1, *;q=0.1,\r\n\r\n") == 200);
+  ASSERT(strcmp(st.enc, "gzip") == 0 && gzcheck(st.body, st.len, data, n));
+  ASSERT(gzfetch(&mgr, &st, url, "GET /json HTTP/1.1\r\n"
+                                 "Accept-Encoding: x-gzip;q=0.01\r\n\r\n") ==
+         200);
+  ASSERT(strcmp(st.enc, "gzip") == 0 && gzcheck(st.body, st.len, data, n));
+
+  ASSERT(gzfetch(&mgr, &st, url, "GET /chunks HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip\r\n\r\n") == 200);
+  ASSERT(strcmp(st.enc, "gzip") == 0);
+  ASSERT(gzcheck(st.body, st.len, data, n) && st.len * 3 < n);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /chunks HTTP/1.1\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == n);
+
+  // Static file: compressed copy has its own ETag and is cached
+  ASSERT(gzfetch(&mgr, &st, url, "GET /file HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip\r\n\r\n") == 200);
+  ASSERT(strcmp(st.enc, "gzip") == 0);
+  ASSERT(strcmp(st.vary, "Accept-Encoding") == 0);
+  ASSERT(gzcheck(st.body, st.len, file.buf, file.len) && st.len < file.len);
+  ASSERT(mg_match(mg_str(st.etag), mg_str("\"#.gz\""), NULL));
+  mg_snprintf(etag, sizeof(etag), "%s", st.etag);
+  ASSERT(mgr.http_gzip != NULL);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /file HTTP/1.1\r\n"
+                                 "Accept-Encoding: gzip\r\n\r\n") == 200);
+  ASSERT(strcmp(st.etag, etag) == 0 && strcmp(st.enc, "gzip") == 0);
+  ASSERT(gzcheck(st.body, st.len, file.buf, file.len));
+  mg_snprintf(data, sizeof(data),
+              "GET /file HTTP/1.1\r\nAccept-Encoding: gzip\r\n"
+              "If-None-Match: %s\r\n\r\n", etag);
+  ASSERT(gzfetch(&mgr, &st, url, data) == 304);
+  ASSERT(gzfetch(&mgr, &st, url, "GET /file HTTP/1.1\r\n\r\n") == 200);
+  ASSERT(st.enc[0] == '\0' && st.len == file.len);
+  ASSERT(strcmp(st.etag, etag) != 0);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL && mgr.http_gzip == NULL);
+  free((void *) file.buf);
+}
+#endif
+
+struct body_status {
+  size_t len, max_recv;  // Body bytes received, largest receive buffer
+  uint32_t crc;          // Body CRC
+  int fragments, msgs;   // MG_EV_HTTP_BODY and MG_EV_HTTP_MSG count
+};
+
+// Stream request bodies, pausing after every fragment
+static void ehbody(struct mg_connection *c, int ev, void *ev_data) {
+  struct body_status *st = (struct body_status *) c->fn_data;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_HTTP_HDRS) {
+    c->is_http_stream = mg_match(hm->uri, mg_str("/stream"), NULL);
+  } else if (ev == MG_EV_HTTP_BODY) {
+    ASSERT(hm->body.len > 0 && mg_strcmp(hm->uri, mg_str("/stream")) == 0);
+    st->crc = mg_crc32(st->crc, hm->body.buf, hm->body.len);
+    st->len += hm->body.len, st->fragments++;
+    c->is_full = 1;
+  } else if (ev == MG_EV_POLL) {
+    c->is_full = 0;
+  } else if (ev == MG_EV_HTTP_MSG) {
+    ASSERT(hm->body.len == 0 || mg_strcmp(hm->uri, mg_str("/stream")) != 0);
+    st->msgs++;
+    mg_http_reply(c, 200, "", "%lu", (unsigned long) st->len);
+  }
+  if (c->recv.size > st->max_recv) st->max_recv = c->recv.size;
+}
+
+// Send a response without Content-Length, the body ends on close
+static void ehbodyeof(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_READ && c->recv.len > 0) {
+    struct mg_str *body = (struct mg_str *) c->fn_data;
+    mg_printf(c, "HTTP/1.1 200 OK\r\n\r\n");
+    mg_send(c, body->buf, body->len);
+    c->recv.len = 0, c->is_draining = 1;
+  }
+  (void) ev_data;
+}
+
+// Stream a response body
+static void ehbodyc(struct mg_connection *c, int ev, void *ev_data) {
+  struct body_status *st = (struct body_status *) c->fn_data;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "GET / HTTP/1.1\r\n\r\n");
+  } else if (ev == MG_EV_HTTP_HDRS) {
+    c->is_http_stream = 1;
+  } else if (ev == MG_EV_HTTP_BODY) {
+    st->crc = mg_crc32(st->crc, hm->body.buf, hm->body.len);
+    st->len += hm->body.len, st->fragments++;
+  } else if (ev == MG_EV_HTTP_MSG) {
+    ASSERT(hm->body.len == 0 && mg_http_status(hm) == 200);
+    st->msgs++;
+  }
+}
+
+static void test_http_body_stream(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  struct body_status st;
+  const char *url = "http://127.0.0.1:12379";
+  size_t i, len = 4 * MG_IO_SIZE * 16, sent;
+  char *data = (char *) calloc(1, len);
+  struct mg_str body;
+  uint32_t crc;
+  ASSERT(data != NULL);
+  for (i = 0; i < len; i++) data[i] = (char) (i * 7 + i / 251);
+  crc = mg_crc32(0, data, len);
+  memset(&st, 0, sizeof(st));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehbody, &st);
+
+  // Content-Length body, followed by a pipelined request
+  c = mg_connect(&mgr, url, NULL, NULL);
+  mg_printf(c, "POST /stream HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+            (unsigned long) len);
+  mg_send(c, data, len);
+  mg_printf(c, "GET /x HTTP/1.1\r\n\r\n");
+  for (i = 0; i < 10000 && st.msgs < 2; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.msgs == 2 && st.len == len && st.crc == crc);
+  ASSERT(st.fragments > 1 && st.max_recv < len / 4);
+
+  // Chunked body, in chunks of different sizes
+  memset(&st, 0, sizeof(st));
+  mg_printf(c, "POST /stream HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+  for (sent = 0, i = 1; sent < len; sent += i, i = i * 3 + 1) {
+    if (i > len - sent) i = len - sent;
+    mg_printf(c, "%lx\r\n", (unsigned long) i);
+    mg_send(c, data + sent, i);
+    mg_printf(c, "\r\n");
+  }
+  mg_printf(c, "0\r\n\r\n");
+  for (i = 0; i < 10000 && st.msgs < 1; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.msgs == 1 && st.len == len && st.crc == crc);
+  ASSERT(st.fragments > 1 && st.max_recv < len / 4);
+
+  // Invalid chunk
+  memset(&st, 0, sizeof(st));
+  mg_printf(c, "POST /stream HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+               "3\r\nabcX\r\n0\r\n\r\n");
+  for (i = 0; i < 100 && mgr.conns->next != NULL; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.msgs == 0 && st.len == 3);
+
+  // Response without Content-Length: MG_EV_HTTP_MSG fires on close
+  memset(&st, 0, sizeof(st));
+  body = mg_str_n(data, len);
+  mg_listen(&mgr, "tcp://127.0.0.1:12390", ehbodyeof, &body);
+  mg_http_connect(&mgr, "http://127.0.0.1:12390", ehbodyc, &st);
+  for (i = 0; i < 10000 && st.msgs < 1; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.msgs == 1 && st.len == len && st.crc == crc);
+  ASSERT(st.fragments > 1);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  free(data);
+}
+
+#if MG_ENABLE_HTTP2
+struct h2_status {
+  int status[8];        // Response status by stream ID / 2, 0 if none yet
+  char hdrs[8][64];     // Response header block
+  char body[8][400];    // Response body
+  size_t len[8];        // Body length
+  uint32_t rst[8];      // RST_STREAM error code + 1, 0 if none
+  bool ended[8];        // Got END_STREAM
+  int settings, acks;   // SETTINGS frames received, acknowledgements
+  uint32_t max_streams;  // Server's SETTINGS_MAX_CONCURRENT_STREAMS
+  uint32_t max_list;     // Server's SETTINGS_MAX_HEADER_LIST_SIZE
+  bool pong;            // Got PING ACK with our payload
+  uint32_t goaway;      // GOAWAY error code + 1, 0 if none
+  int accepts;          // Server side MG_EV_ACCEPT on stream connections
+};
+
+static void eh2s(struct mg_connection *c, int ev, void *ev_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_ACCEPT && c->is_http2) {
+    struct mg_tls_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    mg_tls_init(c, &opts);  // Streams use the parent's TLS: does nothing
+    ASSERT(c->is_accepted && !c->is_tls && c->tls == NULL && !c->is_closing);
+    ((struct h2_status *) c->fn_data)->accepts++;
+  }
+  if (ev != MG_EV_HTTP_MSG) return;
+  ASSERT(c->is_http2 && mg_strcmp(hm->proto, mg_str("HTTP/2.0")) == 0);
+  if (mg_match(hm->uri, mg_str("/echo"), NULL)) {
+    mg_http_reply(c, 200, "X-Foo: bar\r\n", "%.*s", (int) hm->body.len,
+                  hm->body.buf);
+  } else if (mg_match(hm->uri, mg_str("/file"), NULL)) {
+    struct mg_http_serve_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    mg_http_serve_file(c, hm, "data/range.txt", &opts);
+  } else if (mg_match(hm->uri, mg_str("/chunks"), NULL)) {
+    mg_printf(c, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    mg_http_printf_chunk(c, "ab");
+    mg_http_printf_chunk(c, "cd");
+    mg_http_printf_chunk(c, "");
+  } else {
+    struct mg_str *host = mg_http_get_header(hm, "Host");
+    struct mg_str *cc = mg_http_get_header(hm, "Cache-Control");
+    mg_http_reply(c, 200, "", "%.*s %.*s", host ? (int) host->len : 0,
+                  host ? host->buf : "", cc ? (int) cc->len : 0,
+                  cc ? cc->buf : "");
+  }
+}
+
+// Raw HTTP/2 client: record frames the server sends
+static void eh2c(struct mg_connection *c, int ev, void *ev_data) {
+  struct h2_status *st = (struct h2_status *) c->fn_data;
+  while (ev == MG_EV_READ && c->recv.len >= 9) {
+    uint8_t *p = c->recv.buf, type = p[3], flags = p[4];
+    size_t len = MG_LOAD_BE24(p), i = (MG_LOAD_BE32(p + 5) & 15) / 2;
+    if (c->recv.len < 9 + len) break;
+    if (type == 0 && st->len[i] + len <= sizeof(st->body[i])) {  // DATA
+      memcpy(st->body[i] + st->len[i], p + 9, len);
+      st->len[i] += len;
+    } else if (type == 1 && len > 0) {  // HEADERS. :status 200 or 404
+      st->status[i] = p[9] == 0x88 ? 200 : p[9] == 0x8d ? 404 : -1;
+      memcpy(st->hdrs[i], p + 9, len < 64 ? len : 64);
+    } else if (type == 3) {  // RST_STREAM
+      st->rst[i] = MG_LOAD_BE32(p + 9) + 1;
+    } else if (type == 4 && (flags & 1)) {  // SETTINGS ACK
+      st->acks++;
+    } else if (type == 4) {
+      size_t j;
+      for (j = 0; j + 6 <= len; j += 6) {
+        uint16_t k = MG_LOAD_BE16(p + 9 + j);
+        if (k == 3) st->max_streams = MG_LOAD_BE32(p + 11 + j);
+        if (k == 6) st->max_list = MG_LOAD_BE32(p + 11 + j);
+      }
+      st->settings++;
+    } else if (type == 6 && (flags & 1)) {  // PING ACK
+      st->pong = len == 8 && memcmp(p + 9, "pingpong", 8) == 0;
+    } else if (type == 7) {  // GOAWAY
+      st->goaway = MG_LOAD_BE32(p + 13) + 1;
+    }
+    if ((type == 0 || type == 1) && (flags & 1)) st->ended[i] = true;
+    mg_iobuf_del(&c->recv, 0, 9 + len);
+  }
+  (void) ev_data;
+}
+
+static void h2send(struct mg_connection *c, uint8_t type, uint8_t flags,
+                   uint32_t id, const char *buf, size_t len) {
+  uint8_t hdr[9];
+  MG_STORE_BE24(hdr, len);
+  hdr[3] = type, hdr[4] = flags;
+  MG_STORE_BE32(hdr + 5, id);
+  mg_send(c, hdr, sizeof(hdr));
+  mg_send(c, buf, len);
+}
+
+static void test_http2(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  struct h2_status st;
+  const char *url = "http://127.0.0.1:12381";
+  // RFC 7541 C.4.1, C.4.2: Huffman-coded, use the dynamic table
+  const char *req1 = "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0"
+                     "\xab\x90\xf4\xff";
+  const char *req2 = "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf";
+  // POST /echo, with Content-Length: 10, and without it
+  const char *post = "\x83\x86\x04\x05/echo\x0f\x0d\x02" "10";
+  const char *chunked = "\x83\x86\x04\x05/echo";
+  const char *file = "\x82\x86\x04\x05/file";
+  const char *chunks = "\x82\x86\x04\x07/chunks";
+  const char *bad = "\x82\x86\x84\x00\x01X\x01x";  // Uppercase header name
+  struct mg_str data = mg_file_read(&mg_fs_posix, "data/range.txt");
+  uint8_t bomb[9 + 4000 + 12000];
+  int i;
+  memset(&st, 0, sizeof(st));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, eh2s, &st);
+  c = mg_connect(&mgr, url, eh2c, &st);
+  mg_printf(c, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+  h2send(c, 4, 0, 0, NULL, 0);
+  h2send(c, 1, 5, 1, req1, strlen(req1));
+  h2send(c, 1, 5, 3, req2, strlen(req2));
+  h2send(c, 1, 4, 5, post, strlen(post));
+  h2send(c, 1, 4, 7, chunked, strlen(chunked));
+  h2send(c, 0, 0, 5, "hello", 5);
+  h2send(c, 0, 0, 7, "ab", 2);
+  h2send(c, 0, 1, 5, "world", 5);
+  h2send(c, 0, 1, 7, "cd", 2);
+  h2send(c, 1, 5, 9, file, strlen(file));
+  h2send(c, 1, 5, 11, chunks, strlen(chunks));
+  h2send(c, 1, 5, 13, bad, 8);
+  h2send(c, 6, 0, 0, "pingpong", 8);
+  for (i = 0; i < 1000 && !(st.ended[5] && st.rst[6] && st.pong); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(st.settings == 1 && st.acks == 1 && st.pong);
+  ASSERT(st.max_streams == MG_HTTP2_MAX_STREAMS && st.max_list == 16384);
+  ASSERT(st.status[0] == 200 && st.ended[0]);
+  ASSERT(st.len[0] == 16 && memcmp(st.body[0], "www.example.com ", 16) == 0);
+  ASSERT(st.status[1] == 200 && st.ended[1]);
+  ASSERT(st.len[1] == 24 &&
+         memcmp(st.body[1], "www.example.com no-cache", 24) == 0);
+  ASSERT(st.status[2] == 200 && st.ended[2]);
+  ASSERT(memcmp(st.hdrs[2] + 1, "\x00\x05x-foo\x03" "bar", 10) == 0);
+  ASSERT(st.len[2] == 10 && memcmp(st.body[2], "helloworld", 10) == 0);
+  ASSERT(st.status[3] == 200 && st.ended[3]);
+  ASSERT(st.len[3] == 4 && memcmp(st.body[3], "abcd", 4) == 0);
+  ASSERT(st.status[4] == 200 && st.ended[4] && st.len[4] == data.len);
+  ASSERT(memcmp(st.body[4], data.buf, data.len) == 0);
+  ASSERT(st.status[5] == 200 && st.ended[5]);
+  ASSERT(st.len[5] == 4 && memcmp(st.body[5], "abcd", 4) == 0);
+  ASSERT(st.status[6] == 0 && st.rst[6] == 1 + 1);  // PROTOCOL_ERROR
+  ASSERT(st.goaway == 0 && st.accepts == 7);
+  // Streams are not in the connection list: listener, client, server
+  ASSERT(mgr.conns->next->next->next == NULL);
+
+  // Client stream IDs must be odd and increasing
+  h2send(c, 1, 5, 3, req2, strlen(req2));
+  h2send(c, 1, 5, 14, req2, strlen(req2));
+  for (i = 0; i < 1000 && st.goaway == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.goaway == 1 + 1 && st.status[7] == 0);
+
+  // A 4000 byte dynamic table entry, referenced 12000 times, would decode to
+  // 48 MB. The header list size is capped: COMPRESSION_ERROR
+  memset(&st, 0, sizeof(st));
+  memset(bomb, 0xbe, sizeof(bomb));
+  memcpy(bomb, "\x82\x86\x84\x40\x01x\x7f\xa1\x1e", 9);
+  memset(bomb + 9, 'a', 4000);
+  c = mg_connect(&mgr, url, eh2c, &st);
+  mg_printf(c, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+  h2send(c, 4, 0, 0, NULL, 0);
+  h2send(c, 1, 5, 1, (char *) bomb, sizeof(bomb));
+  for (i = 0; i < 1000 && st.goaway == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(st.goaway == 9 + 1 && st.status[0] == 0 && st.accepts == 0);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  free((void *) data.buf);
+}
+#endif
+
 static void test_invalid_listen_addr(void) {
   struct mg_mgr mgr;
   struct mg_connection *c;
@@ -3315,7 +4859,7 @@ static void eh11(struct mg_connection *c, int ev, void *ev_data) {
   struct stream_status *status = (struct stream_status *) c->fn_data;
   if (ev == MG_EV_CONNECT) {
     size_t len = MG_MAX_RECV_SIZE * 2;
-    struct mg_iobuf buf = {NULL, 0, 0, 0};
+    struct mg_iobuf buf = {NULL, 0, 0, 0, 0};
     mg_iobuf_init(&buf, len, 0);
     mg_random(buf.buf, buf.size);
     buf.len = buf.size;
@@ -3348,6 +4892,176 @@ static void test_http_stream_buffer(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+static void ehref(struct mg_connection *c, int ev, void *ev_data) {
+  struct mg_iobuf *io = (struct mg_iobuf *) c->fn_data;
+  if (ev == MG_EV_READ) {
+    mg_iobuf_add(io, io->len, c->recv.buf, c->recv.len);
+    c->recv.len = 0;
+  }
+  (void) ev_data;
+}
+
+static void refcb(void *arg) {
+  (*(int *) arg)++;
+}
+
+static void test_send_ref(void) {
+  struct mg_mgr mgr;
+  const char *url = "tcp://127.0.0.1:12361";
+  struct mg_iobuf io = {NULL, 0, 0, 0, 0};
+  struct mg_connection *c, *t;
+  size_t i, len = MG_MAX_RECV_SIZE;
+  char *data = (char *) calloc(1, len);
+  int done = 0;
+  ASSERT(data != NULL);
+  for (i = 0; i < len; i++) data[i] = (char) (i * 7 + i / 251);
+
+  mg_mgr_init(&mgr);
+  mg_listen(&mgr, url, ehref, &io);
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL);
+  mg_printf(c, "[");
+  ASSERT(mg_send_ref(c, data, len, refcb, &done) == true);
+  mg_printf(c, "|");
+  ASSERT(mg_send_ref(c, "xyz", 3, refcb, &done) == true);
+  ASSERT(mg_send_ref(c, "!", 1, NULL, NULL) == true);
+  mg_printf(c, "]");
+  ASSERT(c->send.len == 3 && done == 0);
+  for (i = 0; i < 1000 && io.len < len + 7; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(done == 2);
+  ASSERT(io.len == len + 7);
+  ASSERT(io.buf[0] == '[' && memcmp(io.buf + 1, data, len) == 0);
+  ASSERT(memcmp(io.buf + 1 + len, "|xyz!]", 6) == 0);
+  mgr.io_shrink_ms = 0;  // Drained receive buffer gets freed
+  mg_mgr_poll(&mgr, 1);
+  for (t = mgr.conns; t != NULL; t = t->next) {
+    if (t->is_accepted && mgr.io_shrink > 0) {
+      ASSERT(t->recv.size <= mgr.io_shrink);
+    }
+  }
+
+  // Buffers not sent yet are released on close
+  ASSERT(mg_send_ref(c, data, len, refcb, &done) == true);
+  ASSERT(done == 2);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  ASSERT(done == 3);
+  mg_iobuf_free(&io);
+  free(data);
+}
+
+static void test_pool(void) {
+  struct mg_mgr mgr;
+  const char *url = "tcp://127.0.0.1:12362";
+  struct mg_connection *c;
+  size_t i;
+  mg_mgr_init(&mgr);
+  mgr.pool.max = 2;
+  ASSERT(mg_listen(&mgr, url, NULL, NULL) != NULL);
+  ASSERT(mgr.pool.conns == 1 && mgr.pool.conns_peak == 1);
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL);
+  mg_printf(c, "hi");
+  for (i = 0; i < 100 && mgr.pool.conns < 3; i++) mg_mgr_poll(&mgr, 1);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(mgr.pool.conns == 3 && mgr.pool.conns_peak == 3);
+  ASSERT(mgr.pool.free_conns == 0 && mgr.pool.reused == 0);
+
+  // Closed connections and their buffers go to the pool, up to pool.max
+  for (c = mgr.conns; c != NULL; c = c->next) c->is_closing = !c->is_listening;
+  mg_mgr_poll(&mgr, 1);
+  ASSERT(mgr.pool.conns == 1 && mgr.pool.conns_peak == 3);
+  ASSERT(mgr.pool.free_conns == 2 && mgr.pool.free_bufs == 2);
+
+  // And get reused, zeroed
+  c = mg_connect(&mgr, url, NULL, NULL);
+  ASSERT(c != NULL && c->send.buf == NULL && c->is_closing == 0);
+  ASSERT(mgr.pool.free_conns == 1 && mgr.pool.reused == 1);
+  mg_printf(c, "hi");
+  ASSERT(c->send.size == MG_IO_SIZE && memcmp(c->send.buf, "hi", 3) == 0);
+  ASSERT(mgr.pool.free_bufs == 1 && mgr.pool.reused == 2);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL && mgr.pool.conns == 0);
+  ASSERT(mgr.pool.free_conns == 0 && mgr.pool.conn_list == NULL);
+  ASSERT(mgr.pool.free_bufs == 0 && mgr.pool.buf_list == NULL);
+}
+
+// On MG_EV_POLL, write "hi" to the connection given in fn_data, once
+static void ecoal(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_POLL && c->fn_data != NULL) {
+    mg_printf((struct mg_connection *) c->fn_data, "hi");
+    c->fn_data = NULL;
+  }
+  (void) ev_data;
+}
+
+static void test_coalesce(void) {
+  struct mg_mgr mgr;
+  const char *url = "tcp://127.0.0.1:12382";
+  struct mg_connection *c, *a = NULL;
+  size_t i, sends;
+  mg_mgr_init(&mgr);
+  ASSERT(mg_listen(&mgr, url, NULL, NULL) != NULL);
+  c = mg_connect(&mgr, url, ecoal, NULL);
+  ASSERT(c != NULL);
+  for (i = 0; i < 100 && a == NULL; i++) {
+    mg_mgr_poll(&mgr, 1);
+    if (mgr.conns->is_accepted) a = mgr.conns;  // Newest goes first
+  }
+  ASSERT(a != NULL);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+
+  // Output queued for an already processed connection waits for next poll
+  c->fn_data = a;
+  mg_mgr_poll(&mgr, 0);
+  ASSERT(a->send.len == 2);
+  for (i = 0; i < 100 && a->send.len > 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(a->send.len == 0);
+
+  // Coalescing: flushed at the end of the same poll, with one send call
+  mgr.coalesce = true;
+  sends = mgr.io.sends;
+  c->fn_data = a;
+  mg_mgr_poll(&mgr, 0);
+  ASSERT(a->send.len == 0 && a->is_coalesced == 0);
+  ASSERT(mgr.io.sends == sends + 1 && mgr.io.bytes >= 4);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+
+#if MG_TLS == MG_TLS_BUILTIN
+  {
+    // Built-in TLS encrypts up to MG_IO_SIZE per poll, coalescing encrypts
+    // all in full-size records and sends them at once. Echoed by /body
+    static char buf[FETCH_BUF_SIZE], body[60000];
+    struct mg_tls_opts opts;
+    size_t records, n1, n2;
+    url = "https://localhost:12383";
+    memset(&opts, 0, sizeof(opts));
+    opts.cert = mg_unpacked("/certs/server.crt");
+    opts.key = mg_unpacked("/certs/server.key");
+    memset(body, 'x', sizeof(body) - 1);
+    mg_mgr_init(&mgr);
+    ASSERT(mg_http_listen(&mgr, url, eh1, &opts) != NULL);
+    ASSERT(fetch(&mgr, buf, url,
+                 "POST /body HTTP/1.0\nContent-Length: %d\n\n%s",
+                 (int) strlen(body), body) == 200);
+    ASSERT(cmpbody(buf, body) == 0);
+    records = mgr.io.records, n1 = mgr.io.sends;
+    ASSERT(records >= 8);  // 4 records each way, or more if MG_IO_SIZE < 16K
+    mgr.coalesce = true;
+    ASSERT(fetch(&mgr, buf, url,
+                 "POST /body HTTP/1.0\nContent-Length: %d\n\n%s",
+                 (int) strlen(body), body) == 200);
+    ASSERT(cmpbody(buf, body) == 0);
+    n2 = mgr.io.sends - n1;
+    ASSERT(mgr.io.records - records == 8);
+    ASSERT(n2 < n1);
+    mg_mgr_free(&mgr);
+    ASSERT(mgr.conns == NULL);
+  }
+#endif
+}
+
 static void test_multipart(void) {
   struct mg_http_part part;
   size_t ofs;
@@ -3559,6 +5273,239 @@ static void test_ws_fragmentation(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+#if MG_ENABLE_DEFLATE
+struct wsz_status {
+  char msg[2000];  // Message the client sends, echoed by the server
+  size_t len;      // Message length
+  size_t sent[3];  // Bytes the server sent for each echo
+  int echoes;      // Echoes received by the client
+  int open;        // Both sides negotiated compression
+};
+
+static void wszs(struct mg_connection *c, int ev, void *ev_data) {
+  struct wsz_status *s = (struct wsz_status *) c->fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+  } else if (ev == MG_EV_WS_OPEN) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    if (c->is_ws_deflate) s->open++;
+    if (mg_strcmp(hm->uri, mg_str("/twice")) == 0) {
+      mg_ws_send(c, s->msg, s->len, WEBSOCKET_OP_TEXT);
+      mg_ws_send(c, s->msg, s->len, WEBSOCKET_OP_TEXT);
+    }
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    ASSERT((wm->flags & 0x40) == 0);
+    if (s->echoes < 3) {
+      s->sent[s->echoes] =
+          mg_ws_send(c, wm->data.buf, wm->data.len, WEBSOCKET_OP_TEXT);
+    }
+  }
+}
+
+static void wszc(struct mg_connection *c, int ev, void *ev_data) {
+  struct wsz_status *s = (struct wsz_status *) c->fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    if (c->is_ws_deflate) s->open++;
+    mg_ws_printf(c, WEBSOCKET_OP_TEXT, "%.*s", (int) s->len, s->msg);
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    s->echoes++;
+    if (s->echoes < 3) {
+      ASSERT(mg_strcmp(wm->data, mg_str_n(s->msg, s->len)) == 0);
+    } else {
+      ASSERT(mg_strcmp(wm->data, mg_str("hi")) == 0);
+    }
+    if (s->echoes == 1) mg_ws_send(c, s->msg, s->len, WEBSOCKET_OP_TEXT);
+    if (s->echoes == 2) mg_ws_send(c, "hi", 2, WEBSOCKET_OP_TEXT);
+  }
+}
+
+// Raw server: accepts the upgrade with the extension response in fn_data
+static void wszr(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_READ &&
+      mg_http_get_request_len(c->recv.buf, c->recv.len) > 0) {
+    mg_printf(c,
+              "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+              "Connection: Upgrade\r\nSec-WebSocket-Extensions: %s\r\n\r\n",
+              (char *) c->fn_data);
+    c->recv.len = 0;
+  }
+  (void) ev_data;
+}
+
+// Browser-like client: lets the server keep context. Keeps what it gets
+static void wszb(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "GET /twice HTTP/1.1\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Extensions: permessage-deflate; "
+                 "client_max_window_bits\r\n\r\n");
+  }
+  (void) ev_data;
+}
+
+// Payload length of a server frame shorter than 64K
+static size_t wszlen(const uint8_t *p) {
+  size_t n = p[1] & 127;
+  return n < 126 ? n : (size_t) p[2] << 8 | p[3];
+}
+
+static void wszo(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_ERROR) *(int *) c->fn_data = 1;
+  if (ev == MG_EV_WS_OPEN) *(int *) c->fn_data = c->is_ws_deflate ? 2 : 3;
+  (void) ev_data;
+}
+
+static void test_ws_deflate(void) {
+  const char *url = "ws://localhost:12387/ws", *url2 = "ws://localhost:12388";
+  struct wsz_status s;
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  const uint8_t *f;
+  size_t n;
+  int i, done = 0;
+
+  // Letters in random order: the second echo is compressed much better,
+  // as it matches the first one
+  memset(&s, 0, sizeof(s));
+  mg_random(s.msg, sizeof(s.msg));
+  for (s.len = 0; s.len < sizeof(s.msg); s.len++) {
+    s.msg[s.len] = (char) ('a' + (unsigned char) s.msg[s.len] % 26);
+  }
+  mg_mgr_init(&mgr);
+  ASSERT(mg_http_listen(&mgr, url, wszs, &s) != NULL);
+  mg_ws_connect(&mgr, url, wszc, &s, NULL);
+  for (i = 0; i < 100 && s.echoes < 3; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s.open == 2 && s.echoes == 3);
+  ASSERT(s.sent[0] > 0 && s.sent[0] < s.len);
+  ASSERT(s.sent[1] == s.sent[0]);  // We asked the server not to keep context
+  ASSERT(s.sent[2] == 4);          // Small message is not compressed
+
+  // With context kept, the second message matches the first one
+  c = mg_connect(&mgr, url, wszb, NULL);
+  for (i = 0; i < 50; i++) mg_mgr_poll(&mgr, 1);
+  for (n = 0; n + 4 < c->recv.len; n++) {
+    if (memcmp(c->recv.buf + n, "\r\n\r\n", 4) == 0) break;
+  }
+  ASSERT(n + 8 < c->recv.len);
+  ASSERT(mgstrstr(mg_str_n((char *) c->recv.buf, n + 2),
+                  mg_str("deflate; client_no_context_takeover\r\n")));
+  f = c->recv.buf + n + 4;
+  ASSERT(f[0] == 0xc1 && wszlen(f) < s.len);  // FIN, RSV1, TEXT
+  f += wszlen(f) + (wszlen(f) < 126 ? 2 : 4);
+  ASSERT(f + 2 <= c->recv.buf + c->recv.len);
+  ASSERT(f[0] == 0xc1 && wszlen(f) < s.sent[0] / 4);
+
+  // A server must not keep context for messages it sends us
+  ASSERT((c = mg_listen(&mgr, url2, wszr, (void *) "permessage-deflate")));
+  mg_ws_connect(&mgr, url2, wszo, &done, NULL);
+  for (i = 0; i < 50 && done == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(done == 1);
+  c->fn_data = (void *) "permessage-deflate; server_no_context_takeover";
+  done = 0;
+  mg_ws_connect(&mgr, url2, wszo, &done, NULL);
+  for (i = 0; i < 50 && done == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(done == 2);
+  c->fn_data = (void *) "x-webkit-deflate-frame";
+  done = 0;
+  mg_ws_connect(&mgr, url2, wszo, &done, NULL);
+  for (i = 0; i < 50 && done == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(done == 1);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+#endif
+
+static struct mg_str s_wsb;  // Expected broadcast message
+
+static void wsbs(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+  } else if (ev == MG_EV_WS_OPEN) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    if (mg_strcmp(hm->uri, mg_str("/dash")) == 0) c->data[0] = 'D';
+    (*(int *) c->fn_data)++;
+  }
+}
+
+static void wsbc(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    ASSERT(mg_strcmp(wm->data, s_wsb) == 0);
+    (*(int *) c->fn_data)++;
+  }
+}
+
+static bool wsbf(struct mg_connection *c, void *arg) {
+  (void) arg;
+  return c->data[0] == 'D';
+}
+
+static void test_ws_broadcast(void) {
+  const char *url = "ws://localhost:12389";
+  char msg[3000], buf[40];
+  struct mg_mgr mgr;
+  struct mg_connection *c, *busy = NULL;
+  int i, opened = 0, refs = 0, got[4] = {0, 0, 0, 0};
+  size_t n, flen = 0;
+
+  for (n = 0; n + 40 < sizeof(msg);) {
+    n += mg_snprintf(msg + n, sizeof(msg) - n, "{\"id\":%lu,\"on\":true},",
+                     (unsigned long) n);
+  }
+  mg_mgr_init(&mgr);
+  ASSERT(mg_http_listen(&mgr, url, wsbs, &opened) != NULL);
+  for (i = 0; i < 4; i++) {
+    mg_snprintf(buf, sizeof(buf), "%s/%s", url, i < 3 ? "dash" : "other");
+    ASSERT(mg_ws_connect(&mgr, buf, wsbc, &got[i], NULL) != NULL);
+  }
+  for (i = 0; i < 100 && opened < 4; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(opened == 4);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);  // Flush 101 responses
+
+  // Group members only
+  s_wsb = mg_str_n(msg, n);
+  ASSERT(mg_ws_broadcast(&mgr, msg, n, WEBSOCKET_OP_TEXT, wsbf, NULL) == 3);
+  // Receivers copy nothing, and reference one shared frame: a 4 byte
+  // header then msg, or msg compressed if permessage-deflate is on
+  for (c = mgr.conns; c != NULL; c = c->next) {
+    if (!c->is_accepted || !c->is_websocket) continue;
+    ASSERT(c->send.len == 0);
+    if (c->send_refs_len == 0) continue;
+    if (flen == 0) flen = c->send_refs_len;
+    ASSERT(c->send_refs_len == flen);
+    ASSERT(c->is_ws_deflate ? flen < n : flen == n + 4);
+    refs++;
+  }
+  ASSERT(refs == 3);
+  for (i = 0; i < 100 && got[0] + got[1] + got[2] < 3; i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(got[0] == 1 && got[1] == 1 && got[2] == 1 && got[3] == 0);
+
+  // Everyone, except a connection that has too much queued
+  for (c = mgr.conns; c != NULL && busy == NULL; c = c->next) {
+    if (c->is_accepted && c->is_websocket) busy = c;
+  }
+  ASSERT(busy != NULL && busy->send.len == 0);
+  ASSERT(mg_iobuf_resize(&busy->send, MG_WS_BROADCAST_MAX + 1));
+  busy->send.len = MG_WS_BROADCAST_MAX + 1;
+  s_wsb = mg_str("hi");
+  ASSERT(mg_ws_broadcast(&mgr, "hi", 2, WEBSOCKET_OP_TEXT, NULL, NULL) == 3);
+  busy->send.len = 0;
+  ASSERT(mg_ws_broadcast(&mgr, "hi", 2, WEBSOCKET_OP_TEXT, NULL, NULL) == 4);
+  for (i = 0; i < 100 && got[0] + got[1] + got[2] + got[3] < 10; i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(got[0] + got[1] + got[2] + got[3] == 10);  // One missed the first
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
 static void h7(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
@@ -3910,7 +5857,7 @@ static void resp_rpc(struct mg_rpc_req *r) {
 
 static void test_rpc(void) {
   struct mg_rpc *head = NULL;
-  struct mg_iobuf io = {0, 0, 0, 256};
+  struct mg_iobuf io = {0, 0, 0, 256, 0};
   struct mg_rpc_req req = {&head, 0, mg_pfn_iobuf, &io, 0, {0, 0}};
   mg_rpc_add(&head, mg_str("rpc.list"), mg_rpc_list, NULL);
 
@@ -3986,16 +5933,32 @@ static void test_rpc(void) {
 
 static void ph(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_POLL) ++(*(int *) c->fn_data);
+  if (ev == MG_EV_HTTP_MSG) mg_http_reply(c, 200, "", "hi");
   (void) c, (void) ev_data;
 }
 
 static void test_poll(void) {
-  int count = 0, i;
+  int count = 0, polled = 0, i;
+  char buf[FETCH_BUF_SIZE];
   struct mg_mgr mgr;
+  struct mg_connection *c;
   mg_mgr_init(&mgr);
   mg_http_listen(&mgr, "http://127.0.0.1:12340", ph, &count);
   for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 0);
   ASSERT(count == 10);
+
+  // Idle connections are skipped, unless they ask for MG_EV_POLL
+  mgr.poll_opt_in = true;
+  c = mg_http_listen(&mgr, "http://127.0.0.1:12341", ph, &polled);
+  ASSERT(c != NULL);
+  c->is_polled = 1;
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 0);
+  ASSERT(count == 10);
+  ASSERT(polled == 10);
+  // Busy connections are still served
+  ASSERT(fetch(&mgr, buf, "http://127.0.0.1:12340", "GET / HTTP/1.0\n\n") ==
+         200);
+  ASSERT(cmpbody(buf, "hi") == 0);
   mg_mgr_free(&mgr);
 }
 
@@ -5481,6 +7444,11 @@ static void test_wakeup(void) {
   mg_log_set(MG_LL_DEBUG);
   c = mg_http_listen(&mgr, "http://127.0.0.1:12341", hwu, NULL);
   mg_wakeup_init(&mgr);  // Initialise wakeup socket pair
+  for (i = 0; i < 40; i++) {  // Grow connection index, some conns go away
+    struct mg_connection *t = mg_listen(&mgr, "udp://127.0.0.1:0", NULL, NULL);
+    ASSERT(t != NULL);
+    if (i % 3 == 0) t->is_closing = 1;
+  }
   data = (struct wudata *) calloc(1, sizeof(*data));  // wuthread owns it
   data->conn_id = c->id;
   data->mgr = c->mgr;
@@ -5518,6 +7486,9 @@ int main(void) {
   test_str();
   test_match();
   test_crc32();
+#if MG_ENABLE_DEFLATE
+  test_deflate();
+#endif
   test_crc16();
   DASHBOARD("misc");
 
@@ -5557,6 +7528,13 @@ int main(void) {
   test_multipart();
   test_invalid_listen_addr();
   test_http_chunked();
+  test_http_body_stream();
+#if MG_ENABLE_DEFLATE
+  test_http_gzip();
+#endif
+#if MG_ENABLE_HTTP2
+  test_http2();
+#endif
   DASHBOARD("http_support");
 
   s_error = false;
@@ -5569,6 +7547,7 @@ int main(void) {
 
   s_error = false;
   test_timer();
+  test_timer_wheel();
   DASHBOARD("timers");
 
   s_error = false;
@@ -5585,21 +7564,36 @@ int main(void) {
 
   s_error = false;
   test_tls();
+  test_tls_ctx();
+  test_tls_resume();
+  test_tls_chain_cache();
   DASHBOARD("tls");
 
   s_error = false;
   test_ws();
   test_ws_fragmentation();
+#if MG_ENABLE_DEFLATE
+  test_ws_deflate();
+#endif
+  test_ws_broadcast();
   DASHBOARD("ws");
 
   s_error = false;
   test_http_upload();
   test_http_stream_buffer();
+  test_send_ref();
+  test_pool();
+  test_coalesce();
   test_http_server();
   test_http_404();
   test_http_no_content_length();
   test_http_pipeline();
+  test_http_trickle();
   test_http_range();
+  test_http_big_file();
+#if MG_HTTP_CACHE_SIZE > 0
+  test_http_cache();
+#endif
   DASHBOARD("http_server");
 
 #ifndef LOCALHOST_ONLY
@@ -5619,6 +7613,17 @@ int main(void) {
   printf("\nLOCALHOST_ONLY, skipping SNTP, MQTT and HTTPclient tests\n");
   (void) test_sntp, (void) test_mqtt, (void) test_http_client;
 #endif
+  s_error = false;
+  test_mqtt_session();
+  test_mqtt_pub_batch();
+  DASHBOARD("mqtt_local");
+
+#if MG_ENABLE_MQTT_BROKER
+  s_error = false;
+  test_mqtt_broker();
+  DASHBOARD("mqtt_broker");
+#endif
+
   s_error = false;
   test_poll();
   printf("HEALTH_DASHBOARD\t\"poll\": %s\n", s_error ? "false" : "true");
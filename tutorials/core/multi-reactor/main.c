@@ -0,0 +1,100 @@
+// Copyright (c) 2025 Cesanta Software Limited
+// All rights reserved
+//
+// Multi-reactor example.
+// Instead of one event manager polled by one thread, we run several event
+// managers ("reactors"), each polled by its own thread. Every reactor has
+// its own listening socket on the same port (MG_ENABLE_REUSEPORT=1), so the
+// OS distributes incoming connections between reactors, and each connection
+// lives on exactly one reactor: no locking is required in event handlers.
+//
+// Reactors talk to each other with mg_wakeup(): a request to /broadcast is
+// forwarded to the listening connection of every reactor.
+//
+// Benchmark, e.g.: wrk -t8 -c400 -d10s http://localhost:8000/
+// and compare against the same command with NUM_REACTORS set to 1.
+
+#include "mongoose.h"
+
+#ifndef NUM_REACTORS
+#define NUM_REACTORS 4
+#endif
+
+static const char *s_listen_url = "http://0.0.0.0:8000";
+
+struct reactor {
+  struct mg_mgr mgr;      // Event manager owned by this reactor
+  unsigned long lsn_id;   // ID of this reactor's listening connection
+  int index;              // Reactor number, for logging
+  unsigned long served;   // Number of requests served by this reactor
+};
+
+static struct reactor s_reactors[NUM_REACTORS];
+
+static void start_thread(void *(*f)(void *), void *p) {
+#ifdef _WIN32
+  _beginthread((void(__cdecl *)(void *)) f, 0, p);
+#else
+#include <pthread.h>
+  pthread_t thread_id = (pthread_t) 0;
+  pthread_attr_t attr;
+  (void) pthread_attr_init(&attr);
+  (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread_id, &attr, f, p);
+  pthread_attr_destroy(&attr);
+#endif
+}
+
+// HTTP request callback. Runs in the thread of the reactor that owns c
+static void fn(struct mg_connection *c, int ev, void *ev_data) {
+  struct reactor *r = (struct reactor *) c->fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    r->served++;
+    if (mg_match(hm->uri, mg_str("/broadcast"), NULL)) {
+      int i;
+      for (i = 0; i < NUM_REACTORS; i++) {
+        mg_wakeup(&s_reactors[i].mgr, s_reactors[i].lsn_id, hm->body.buf,
+                  hm->body.len);
+      }
+      mg_http_reply(c, 200, "", "Broadcasted to %d reactors\n", NUM_REACTORS);
+    } else {
+      mg_http_reply(c, 200, "", "Served by reactor %d, total %lu\n", r->index,
+                    r->served);
+    }
+  } else if (ev == MG_EV_WAKEUP) {
+    struct mg_str *data = (struct mg_str *) ev_data;
+    MG_INFO(("Reactor %d got message: [%.*s]", r->index, (int) data->len,
+             data->buf));
+  }
+}
+
+static void *reactor_thread(void *param) {
+  struct reactor *r = (struct reactor *) param;
+  for (;;) mg_mgr_poll(&r->mgr, 1000);
+  return NULL;
+}
+
+int main(void) {
+  int i;
+  mg_log_set(MG_LL_INFO);
+  // Set up all reactors before starting threads, so that any reactor
+  // can mg_wakeup() any other one from the very first request
+  for (i = 0; i < NUM_REACTORS; i++) {
+    struct reactor *r = &s_reactors[i];
+    struct mg_connection *c;
+    r->index = i;
+    mg_mgr_init(&r->mgr);
+    if ((c = mg_http_listen(&r->mgr, s_listen_url, fn, r)) == NULL) {
+      MG_ERROR(("Cannot listen on %s. Built with MG_ENABLE_REUSEPORT=1?",
+                s_listen_url));
+      return EXIT_FAILURE;
+    }
+    r->lsn_id = c->id;
+    mg_wakeup_init(&r->mgr);
+  }
+  for (i = 1; i < NUM_REACTORS; i++) start_thread(reactor_thread, &s_reactors[i]);
+  MG_INFO(("Started %d reactors on %s", NUM_REACTORS, s_listen_url));
+  reactor_thread(&s_reactors[0]);  // Main thread runs reactor 0
+  return 0;
+}
@@ -0,0 +1 @@
+../../../mongoose.c
\ No newline at end of file
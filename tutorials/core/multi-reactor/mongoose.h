@@ -0,0 +1 @@
+../../../mongoose.h
\ No newline at end of file
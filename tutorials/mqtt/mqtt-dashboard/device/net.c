@@ -55,7 +55,7 @@ static void set_device_id(void) {
 static void publish_status(struct mg_connection *c) {
   char topic[100];
   struct mg_mqtt_opts pub_opts;
-  struct mg_iobuf io = {0, 0, 0, 512};
+  struct mg_iobuf io = {0, 0, 0, 512, 0};
 
   // Print JSON notification into the io buffer
   mg_xprintf(
@@ -145,7 +145,7 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
   } else if (ev == MG_EV_MQTT_MSG) {
     // When we get echo response, print it
     struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
-    struct mg_iobuf io = {0, 0, 0, 512};
+    struct mg_iobuf io = {0, 0, 0, 512, 0};
     struct mg_rpc_req r = {&s_rpc, NULL, mg_pfn_iobuf,
                            &io,    NULL, {mm->data.buf, mm->data.len}};
     size_t clipped_len = mm->data.len > 512 ? 512 : mm->data.len;
@@ -79,7 +79,7 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data) {
   } else if (ev == MG_EV_MQTT_MSG) {
     // Treat this message as JSON-RPC: process an RPC request
     struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
-    struct mg_iobuf io = {0, 0, 0, 512};
+    struct mg_iobuf io = {0, 0, 0, 512, 0};
     struct mg_rpc_req r = {&s_rpc, NULL, mg_pfn_iobuf,
                            &io,    NULL, {mm->data.buf, mm->data.len}};
     size_t clipped_len = mm->data.len > 512 ? 512 : mm->data.len;